@@ -47,6 +47,10 @@ void MainWindow::initWinSparkle()
     // provide the key using Windows resource.
     win_sparkle_set_dsa_pub_pem(reinterpret_cast<const char *>(QResource(":/pem/dsa_pub.pem").data()));
 
+    // Qt runs a message loop on this thread already, let WinSparkle's windows
+    // use it instead of starting another one on a thread of its own.
+    win_sparkle_set_ui_on_host_thread(1);
+
     // Initialize the updater and possibly show some UI
     win_sparkle_init();
 }
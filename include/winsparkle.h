@@ -73,9 +73,56 @@ WIN_SPARKLE_API void __cdecl win_sparkle_init();
 
     Should be called by the app when it's shutting down. Cancels any
     pending Sparkle operations and shuts down its helper threads.
+
+    Waits at most for the time set with win_sparkle_set_shutdown_timeout().
+    If some threads are still running then, the error is logged together
+    with their names and the function returns anyway.
+
+    @see win_sparkle_set_shutdown_timeout()
  */
 WIN_SPARKLE_API void __cdecl win_sparkle_cleanup();
 
+/**
+    Sets how long win_sparkle_cleanup() may wait for WinSparkle's threads.
+
+    Operations in progress, such as network requests, are cancelled by
+    win_sparkle_cleanup() right away, so it usually returns much sooner.
+
+    Default value is 5000 ms (5 seconds).
+
+    @param  milliseconds  Maximum time to wait, in milliseconds.
+
+    @since 0.6.0
+
+    @see win_sparkle_cleanup()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_shutdown_timeout(int milliseconds);
+
+/**
+    Sets whether win_sparkle_init() does its work in the background.
+
+    Normally, win_sparkle_init() reads WinSparkle's settings from the
+    registry or the configuration file, and it may also write them, before
+    returning. When this is enabled, it only detects the UI language and then
+    leaves everything else to a worker thread, so that it doesn't delay the
+    app's startup with any I/O.
+
+    The application must then not rely on the update checks being scheduled,
+    nor on WinSparkle having asked the user for permission, by the time
+    win_sparkle_init() returns.
+
+    Disabled by default.
+
+    @param state  1 to enable deferred initialization, 0 to disable it.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_init()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_deferred_init(int state);
+
 //@}
 
 
@@ -160,316 +207,2521 @@ WIN_SPARKLE_API void __cdecl win_sparkle_set_langid(unsigned short lang);
 WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_url(const char *url);
 
 /**
-    Sets DSA public key.
-
-    Only PEM format is supported.
-
-    Public key will be used to verify DSA signature of the update file.
-    PEM data will be set only if it contains valid DSA public key.
-
-    If this function isn't called by the app, public key is obtained from
-    Windows resource named "DSAPub" of type "DSAPEM".
+    Requires the appcast feed to be signed and sets URL of its signature.
 
-    @param dsa_pub_pem  DSA public key in PEM format.
+    The signature is the base64-encoded EdDSA (Ed25519) signature of the
+    feed file, made with the key set by win_sparkle_set_eddsa_public_key().
+    It is downloaded before the feed on every check and the feed is
+    rejected if it doesn't match it. This makes it safe to serve the feed
+    from third-party caches or CDNs.
 
-    @return  1 if valid DSA public key provided, 0 otherwise.
+    @param url  URL of the signature, e.g. the feed's URL with ".sig" appended.
 
     @since 0.6.0
  */
-WIN_SPARKLE_API int __cdecl win_sparkle_set_dsa_pub_pem(const char *dsa_pub_pem);
+WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_signature_url(const char *url);
 
 /**
-    Sets application metadata.
+    Sets other locations of the appcast feed, used if its main URL is slow
+    or fails.
 
-    Normally, these are taken from VERSIONINFO/StringFileInfo resources,
-    but if your application doesn't use them for some reason, using this
-    function is an alternative.
+    Checks start with the main URL, as usual. If its server doesn't respond
+    within the time it usually takes (the 95th percentile of recent checks,
+    a few seconds at first), the feed is requested from the next URL too,
+    and so on. The first feed downloaded successfully is used and the other
+    requests are cancelled. The next URL is also tried right away if all
+    the requests made so far failed.
 
-    @param company_name  Company name of the vendor.
-    @param app_name      Application name. This is both shown to the user
-                         and used in HTTP User-Agent header.
-    @param app_version   Version of the app, as string (e.g. "1.2" or "1.2rc1").
+    All the URLs must serve the same feed. The feed's signature, if any,
+    is still downloaded from the single URL set with
+    win_sparkle_set_appcast_signature_url().
 
-    @note @a company_name and @a app_name are used to determine the location
-          of WinSparkle settings in registry.
-          (HKCU\Software\<company_name>\<app_name>\WinSparkle is used.)
+    The fallback URLs aren't used if administrators set the appcast URL
+    with a policy.
 
-    @since 0.3
+    @param urls  Space-separated URLs, or NULL or empty string for none.
 
-    @see win_sparkle_set_app_build_version();
+    @since 0.6.0
  */
-WIN_SPARKLE_API void __cdecl win_sparkle_set_app_details(const wchar_t *company_name,
-                                                         const wchar_t *app_name,
-                                                         const wchar_t *app_version);
+WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_fallback_urls(const char *urls);
+
+/// Roles of additional appcast feeds, see win_sparkle_add_appcast_feed()
+typedef enum
+{
+    /// More updates of the app, e.g. from a separately published beta feed
+    WIN_SPARKLE_FEED_ROLE_UPDATES = 0,
+    /// Add-ons installed together with the app's update, as its components
+    WIN_SPARKLE_FEED_ROLE_COMPONENTS = 1
+} win_sparkle_feed_role_t;
 
 /**
-    Sets application build version number.
+    Adds another appcast feed to check together with the main one.
 
-    This is the internal version number that is not normally shown to the user.
-    It can be used for finer granularity that official release versions, e.g. for
-    interim builds.
+    All feeds are downloaded and parsed at the same time, so a check takes
+    as long as the slowest of them, and their results are merged into a
+    single update:
 
-    If this function is called, then the provided *build* number is used for comparing
-    versions; it is compared to the "version" attribute in the appcast and corresponds
-    to OS X Sparkle's CFBundleVersion handling. If used, then the appcast must
-    also contain the "shortVersionString" attribute with human-readable display
-    version string. The version passed to win_sparkle_set_app_details()
-    corresponds to this and is used for display.
+     - The update is the newest suitable one of the main feed and all
+       feeds with the WIN_SPARKLE_FEED_ROLE_UPDATES role.
+     - The update found in each feed with the
+       WIN_SPARKLE_FEED_ROLE_COMPONENTS role is added to it as a component
+       (see `sparkle:component` in README.md), so that it's downloaded,
+       verified and installed together with it.
 
-    @since 0.4
+    Only the main feed is signed and cached. A feed that fails is skipped
+    with a warning in the log, only a failure of the main feed fails the
+    check. The feeds aren't used if administrators set the appcast URL with
+    a policy.
 
-    @see win_sparkle_set_app_details()
+    @param url   URL of the feed, or NULL to remove all the added feeds.
+    @param role  What the feed's updates are used for.
+
+    @since 0.6.0
  */
-WIN_SPARKLE_API void __cdecl win_sparkle_set_app_build_version(const wchar_t *build);
+WIN_SPARKLE_API void __cdecl win_sparkle_add_appcast_feed(const char *url,
+                                                         win_sparkle_feed_role_t role);
 
 /**
-    Set the registry path where settings will be stored.
+    Sets the update channels the app receives updates from.
 
-    Normally, these are stored in
-    "HKCU\Software\<company_name>\<app_name>\WinSparkle"
-    but if your application needs to store the data elsewhere for
-    some reason, using this function is an alternative.
+    A single appcast feed can serve updates for several channels, e.g.
+    stable releases, betas and nightly builds, by marking items with a
+    `<sparkle:channel>` element with the name of the channel. Items without
+    it are in the default channel and are always offered; items in other
+    channels are only offered if their channel was set with this function.
+    The newest of the acceptable items is then offered, as usual.
 
-    Note that @a path is relative to HKCU/HKLM root and the root is not part
-    of it. For example:
-    @code
-    win_sparkle_set_registry_path("Software\\My App\\Updates");
-    @endcode
+    By default, only the default channel is used.
 
-    @param path  Registry path where settings will be stored.
+    @param channels  Comma-separated names of the channels, e.g.
+                     "beta,nightly", or NULL or empty string for only the
+                     default channel.
 
-    @since 0.3
+    @since 0.6.0
  */
-WIN_SPARKLE_API void __cdecl win_sparkle_set_registry_path(const char *path);
+WIN_SPARKLE_API void __cdecl win_sparkle_set_channels(const char *channels);
 
 /**
-    Sets whether updates are checked automatically or only through a manual call.
+    Sets URL of a document with the latest version available.
 
-    If disabled, win_sparkle_check_update_with_ui() must be used explicitly.
+    If set, every check first downloads this document, which should only
+    contain the version (as in `sparkle:version`) of the newest update in
+    the appcast feed, e.g. "2.1.3". Instead of the document, the server may
+    send the version in the `X-Sparkle-Latest-Version` header of the
+    response. The feed itself is only downloaded if this version is newer
+    than the app's, so that checks that find nothing cost just a few
+    hundred bytes, however large the feed is.
 
-    @param  state  1 to have updates checked automatically, 0 otherwise
+    If the document can't be downloaded or is empty, the feed is checked
+    as usual.
 
-    @since 0.4
+    @param url  URL of the document, or NULL to always check the feed.
+
+    @since 0.6.0
  */
-WIN_SPARKLE_API void __cdecl win_sparkle_set_automatic_check_for_updates(int state);
+WIN_SPARKLE_API void __cdecl win_sparkle_set_latest_version_url(const char *url);
 
 /**
-    Gets the automatic update checking state
+    Sets the maximum size of the appcast feed.
 
-    @return  1 if updates are set to be checked automatically, 0 otherwise
+    Checks of feeds larger than this fail with an error, so that a broken
+    or malicious server can't make the app use lots of memory. The text of
+    individual elements of the feed is limited too, regardless of this.
 
-    @note Defaults to 0 when not yet configured (as happens on first start).
+    Default value is 16 MB.
 
-    @since 0.4
+    @param  bytes  Maximum size in bytes, or 0 for no limit.
+
+    @since 0.6.0
  */
-WIN_SPARKLE_API int __cdecl win_sparkle_get_automatic_check_for_updates();
+WIN_SPARKLE_API void __cdecl win_sparkle_set_max_appcast_size(int bytes);
 
 /**
-    Sets the automatic update interval.
+    Sends information needed to filter the appcast feed to its server.
 
-    @param  interval The interval in seconds between checks for updates.
-                     The minimum update interval is 3600 seconds (1 hour).
+    If enabled, the following query parameters are appended to the appcast
+    URL, so that the server (or a worker at the edge) can return only the
+    items relevant to this client instead of the whole feed:
 
-    @since 0.4
- */
-WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_interval(int interval);
+     - `appVersion`: build version of the app (as in `sparkle:version`)
+     - `os`: the `sparkle:os` value of items for this build of the app,
+       "windows-x64" or "windows-x86", or "windows-arm64" on ARM64 Windows
+     - `osVersion`: Windows version as compared against
+       `sparkle:minimumSystemVersion`, e.g. "10.0.0"
+     - `channels`: update channels set with win_sparkle_set_channels(),
+       if any
 
-/**
-    Gets the automatic update interval in seconds.
+    The feed is still filtered by WinSparkle as usual. If it's signed, the
+    signature must be that of the filtered feed the server returns. The
+    response may be cached per distinct URL.
 
-    Default value is one day.
+    Disabled by default.
 
-    @since 0.4
+    @param  enabled  1 to send the parameters, 0 not to.
+
+    @since 0.6.0
  */
-WIN_SPARKLE_API int __cdecl win_sparkle_get_update_check_interval();
+WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_filter_hints(int enabled);
 
 /**
-    Gets the time for the last update check.
+    Sets DSA public key.
 
-    Default value is -1, indicating that the update check has never run.
+    Only PEM format is supported.
 
-    @since 0.4
-*/
-WIN_SPARKLE_API time_t __cdecl win_sparkle_get_last_check_time();
+    Public key will be used to verify DSA signature of the update file.
+    PEM data will be set only if it contains valid DSA public key.
 
-/// Callback type for win_sparkle_error_callback()
-typedef void (__cdecl *win_sparkle_error_callback_t)();
+    If this function isn't called by the app, public key is obtained from
+    Windows resource named "DSAPub" of type "DSAPEM".
 
-/**
-    Set callback to be called when the updater encounters an error.
+    @param dsa_pub_pem  DSA public key in PEM format.
 
-    @since 0.5
-*/
-WIN_SPARKLE_API void __cdecl win_sparkle_set_error_callback(win_sparkle_error_callback_t callback);
+    @return  1 if valid DSA public key provided, 0 otherwise.
 
-/// Callback type for win_sparkle_can_shutdown_callback()
-typedef int (__cdecl *win_sparkle_can_shutdown_callback_t)();
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_set_dsa_pub_pem(const char *dsa_pub_pem);
 
 /**
-    Set callback for querying the application if it can be closed.
+    Sets EdDSA (Ed25519) public key.
 
-    This callback will be called to ask the host if it's ready to shut down,
-    before attempting to launch the installer. The callback returns TRUE if
-    the host application can be safely shut down or FALSE if not (e.g. because
-    the user has unsaved documents).
+    The key is the base64-encoded 32 bytes public key, as generated by
+    Sparkle's generate_keys tool.
 
-    @note There's no guarantee about the thread from which the callback is called,
-          except that it certainly *won't* be called from the app's main thread.
-          Make sure the callback is thread-safe.
+    Public key will be used to verify the `sparkle:edSignature` signature
+    of the update file. If it is set, the update must have this signature
+    and its DSA signature, if any, is not checked.
 
-    @since 0.4
+    If this function isn't called by the app, public key is obtained from
+    Windows resource named "EdDSAPub" of type "EDDSA".
 
-    @see win_sparkle_set_shutdown_request_callback()
-*/
-WIN_SPARKLE_API void __cdecl win_sparkle_set_can_shutdown_callback(win_sparkle_can_shutdown_callback_t callback);
+    @param pubkey  Base64-encoded Ed25519 public key.
 
+    @return  1 if valid public key provided, 0 otherwise.
 
-/// Callback type for win_sparkle_shutdown_request_callback()
-typedef void (__cdecl *win_sparkle_shutdown_request_callback_t)();
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_set_eddsa_public_key(const char *pubkey);
 
 /**
-    Set callback for shutting down the application.
+    Sets whether updates must also have a valid Authenticode signature.
 
-    This callback will be called to ask the host to shut down immediately after
-    launching the installer. Its implementation should gracefully terminate the
-    application.
+    If enabled, the installer of the update must be Authenticode-signed
+    with a certificate trusted by the computer that wasn't revoked, in
+    addition to the checks of its EdDSA or DSA signature. Updates that
+    aren't signed this way, e.g. ZIP archives, are rejected.
 
-    It will only be called if the call to the callback set with
-    win_sparkle_set_can_shutdown_callback() returns TRUE.
+    The Authenticode signature is checked in parallel with the other
+    signature, as soon as the update is downloaded. Windows checks it again,
+    along with SmartScreen, when the installer is launched, but the
+    certificate revocation lists are then already cached, so the installer
+    starts without waiting for them. The result is remembered until the
+    file changes; files not verified before are checked when launched.
 
-    @note There's no guarantee about the thread from which the callback is called,
-          except that it certainly *won't* be called from the app's main thread.
-          Make sure the callback is thread-safe.
+    By default, Authenticode signatures aren't checked.
 
-    @since 0.4
+    @param state  1 to check Authenticode signatures, 0 not to.
 
-    @see win_sparkle_set_can_shutdown_callback()
-*/
-WIN_SPARKLE_API void __cdecl win_sparkle_set_shutdown_request_callback(win_sparkle_shutdown_request_callback_t);
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_authenticode_check(int state);
 
-/// Callback type for win_sparkle_did_find_update_callback()
-typedef void(__cdecl *win_sparkle_did_find_update_callback_t)();
+/// HTTP client implementations, see win_sparkle_set_http_backend()
+typedef enum
+{
+    /// WinINet, the default
+    WIN_SPARKLE_HTTP_BACKEND_WININET = 0,
+    /// WinHTTP
+    WIN_SPARKLE_HTTP_BACKEND_WINHTTP = 1
+} win_sparkle_http_backend_t;
 
 /**
-    Set callback to be called when the updater did find an update.
+    Sets the HTTP client implementation used for all network access.
 
-    This is useful in combination with
-    win_sparkle_check_update_with_ui_and_install() as it allows you to perform
-    some action after WinSparkle checks for updates.
+    WinINet, used by default, is designed for interactive applications: it
+    shares Internet Explorer's per-user settings and state and cannot be used
+    from services.
 
-    @since 0.5
+    WinHTTP can be used from services and other non-interactive processes,
+    has lower per-request overhead and uses HTTP/2 where the OS supports it.
+    On Windows older than 8.1, it uses the proxy configured with
+    "netsh winhttp" instead of the user's proxy settings.
 
-    @see win_sparkle_did_not_find_update_callback()
-    @see win_sparkle_check_update_with_ui_and_install()
-*/
-WIN_SPARKLE_API void __cdecl win_sparkle_set_did_find_update_callback(win_sparkle_did_find_update_callback_t callback);
+    @param backend  The implementation to use.
 
-/// Callback type for win_sparkle_did_not_find_update_callback()
-typedef void (__cdecl *win_sparkle_did_not_find_update_callback_t)();
+    @return  1 if the backend is known, 0 otherwise.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_http_max_connections_per_server()
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_set_http_backend(win_sparkle_http_backend_t backend);
 
 /**
-    Set callback to be called when the updater did not find an update.
+    Sets the maximum number of simultaneous connections to a single server.
 
-    This is useful in combination with
-    win_sparkle_check_update_with_ui_and_install() as it allows you to perform
-    some action after WinSparkle checks for updates.
+    Large update files are downloaded over this many parallel connections,
+    if the server supports it. Use 1 to always download over a single
+    connection.
 
-    @since 0.5
+    Default value is 4.
 
-    @see win_sparkle_did_find_update_callback()
-    @see win_sparkle_check_update_with_ui_and_install()
-*/
-WIN_SPARKLE_API void __cdecl win_sparkle_set_did_not_find_update_callback(win_sparkle_did_not_find_update_callback_t callback);
+    @param max_connections  Number of connections, between 1 and 16.
 
-/// Callback type for win_sparkle_update_cancelled_callback()
-typedef void (__cdecl *win_sparkle_update_cancelled_callback_t)();
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_http_backend()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_http_max_connections_per_server(int max_connections);
+
+/// TLS certificate revocation checking, see win_sparkle_set_revocation_check()
+typedef enum
+{
+    /// The HTTP backend's default: the system setting with WinINet, no
+    /// checking with WinHTTP
+    WIN_SPARKLE_REVOCATION_CHECK_DEFAULT = 0,
+    /// Check, and fail if the revocation status can't be determined
+    WIN_SPARKLE_REVOCATION_CHECK_STRICT = 1,
+    /// Check, but connect if the revocation servers can't be reached
+    WIN_SPARKLE_REVOCATION_CHECK_SOFT_FAIL = 2,
+    /// Don't fail if the revocation status can't be determined
+    WIN_SPARKLE_REVOCATION_CHECK_DISABLED = 3
+} win_sparkle_revocation_check_t;
 
 /**
-    Set callback to be called when the user cancels a download.
+    Sets how the revocation of servers' TLS certificates is checked.
 
-    This is useful in combination with
-    win_sparkle_check_update_with_ui_and_install() as it allows you to perform
-    some action when the installation is interrupted.
+    On networks where the CRL and OCSP servers are unreachable, looking
+    the status up can make every connection wait for many seconds.
+    Certificates known to be revoked are always refused.
 
-    @since 0.5
+    With WIN_SPARKLE_REVOCATION_CHECK_SOFT_FAIL, a server whose certificate's
+    status couldn't be looked up isn't checked again for an hour, so that
+    only the first connection waits for the lookup. The status stapled to
+    the server's handshake (OCSP stapling) is used if there is one, which
+    needs no lookups.
 
-    @see win_sparkle_check_update_with_ui_and_install()
-*/
-WIN_SPARKLE_API void __cdecl win_sparkle_set_update_cancelled_callback(win_sparkle_update_cancelled_callback_t callback);
+    With WinINet, the revocation checking is enabled by the system
+    setting; WIN_SPARKLE_REVOCATION_CHECK_STRICT doesn't enable it, and the
+    other values only ignore failed lookups.
 
-//@}
+    @param check  How to check revocation.
 
+    @return  1 if the value is known, 0 otherwise.
 
-/*--------------------------------------------------------------------------*
-                              Manual usage
- *--------------------------------------------------------------------------*/
+    @since 0.6.0
 
-/**
-    @name Manually using WinSparkle
+    @see win_sparkle_set_http_backend()
  */
-//@{
+WIN_SPARKLE_API int __cdecl win_sparkle_set_revocation_check(win_sparkle_revocation_check_t check);
 
 /**
-    Checks if an update is available, showing progress UI to the user.
+    Sets whether updates are downloaded before the user is told about them.
 
-    Normally, WinSparkle checks for updates on startup and only shows its UI
-    when it finds an update. If the application disables this behavior, it
-    can hook this function to "Check for updates..." menu item.
+    If enabled, an update found by a scheduled background check is
+    downloaded and verified in the background, at low priority, before
+    the update dialog is shown; installing it then doesn't require
+    waiting for the download. Updates the user chose to skip are not
+    downloaded, and neither are updates found while the network
+    connection is metered (the update is offered as usual then), unless
+    there's budget for it, see win_sparkle_set_metered_download_budget().
 
-    When called, background thread is started to check for updates. A small
-    window is shown to let the user know the progress. If no update is found,
-    the user is told so. If there is an update, the usual "update available"
-    window is shown.
+    This requires signed updates, see win_sparkle_set_eddsa_public_key()
+    or win_sparkle_set_dsa_pub_pem(), because the download is kept in
+    a cache of verified updates until it's installed.
 
-    This function returns immediately.
+    Disabled by default.
 
-    @note Because this function is intended for manual, user-initiated checks
-          for updates, it ignores "Skip this version" even if the user checked
-          it previously.
+    @param state  1 to download updates before prompting, 0 to only
+                  download them when the user chooses to install them.
 
-    @see win_sparkle_check_update_without_ui()
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
  */
-WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui();
+WIN_SPARKLE_API void __cdecl win_sparkle_set_predownload_updates(int state);
 
 /**
-    Checks if an update is available, showing progress UI to the user and
-    immediately installing the update if one is available.
+    Sets whether updates are installed when the application exits.
 
-    This is useful for the case when users should almost always use the
-    newest version of your software. When called, WinSparkle will check for
-    updates showing a progress UI to the user. If an update is found the update
-    prompt will be skipped and the update will be installed immediately.
+    If enabled, an update found by a scheduled background check is
+    downloaded and verified in the background, without showing any UI.
+    win_sparkle_cleanup() then launches its installer as the application
+    exits, so the user never has to wait for the application to restart.
+    The installer is launched without waiting for it, so it must wait
+    for the application to exit, or close it, like installers usually do.
 
-    If your application expects to do something after checking for updates you
-    may wish to use win_sparkle_set_did_not_find_update_callback() and
-    win_sparkle_set_update_cancelled_callback().
+    Updates found by checks the user started, e.g. with
+    win_sparkle_check_update_with_ui(), are shown as usual. Installing
+    one of them replaces the update staged for exit.
 
-    @since 0.5
+    This requires signed updates, see win_sparkle_set_eddsa_public_key()
+    or win_sparkle_set_dsa_pub_pem().
 
-    @see win_sparkle_set_did_find_update_callback()
-    @see win_sparkle_set_update_cancelled_callback()
+    Disabled by default.
+
+    @param state  1 to install updates on exit, 0 to offer them to the user.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_update_found_callback()
  */
-WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui_and_install();
+WIN_SPARKLE_API void __cdecl win_sparkle_set_install_on_exit(int state);
 
 /**
-    Checks if an update is available.
+    Sets whether update files are downloaded with BITS.
 
-    No progress UI is shown to the user when checking. If an update is
-    available, the usual "update available" window is shown; this function
-    is *not* completely UI-less.
+    BITS (Background Intelligent Transfer Service) downloads the file in
+    the background, using only network bandwidth that isn't needed by
+    other applications. The download continues where it left off if it's
+    interrupted, even after the application or the computer is restarted.
+    This is slower than the default download, but well suited for large
+    update files.
 
-    Use with caution, it usually makes more sense to use the automatic update
-    checks on interval option or manual check with visible UI.
+    The appcast feed and release notes are always downloaded with the
+    HTTP backend set by win_sparkle_set_http_backend(), as are update
+    files if BITS isn't available.
 
-    This function returns immediately.
+    Disabled by default.
 
-    @note This function respects "Skip this version" choice by the user.
+    @param state  1 to download update files with BITS, 0 to use the HTTP
+                  backend.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_bits_download(int state);
+
+/**
+    Sets whether updates downloaded in the background yield the network
+    to other traffic.
+
+    If enabled, updates downloaded without the user waiting for them (see
+    win_sparkle_set_predownload_updates(), win_sparkle_set_install_on_exit()
+    and win_sparkle_start_service_agent()) are downloaded with BITS at its
+    lowest priority, like with win_sparkle_set_bits_download(), and with
+    Delivery Optimization in background mode if it's enabled. Both only
+    use bandwidth that other applications leave idle, so that e.g. voice
+    calls aren't disturbed. Updates the user waits for are downloaded as
+    usual.
+
+    If BITS isn't available, the updates are downloaded with the HTTP
+    backend. Its connections can't be tagged for QoS by WinSparkle, as
+    WinINet and WinHTTP don't expose their sockets; administrators who
+    need routers to deprioritize the traffic can mark it with a DSCP value
+    using policy-based QoS for the update server's address.
+
+    Disabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_max_download_rate()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_low_priority_downloads(int state);
+
+/**
+    Sets whether updates downloaded in the background wait for AC power.
+
+    If enabled, updates that would be downloaded without the user waiting
+    for them (see win_sparkle_set_predownload_updates(),
+    win_sparkle_set_install_on_exit() and win_sparkle_start_service_agent())
+    aren't downloaded while the computer runs on battery or in battery
+    saver mode, and neither are their signatures verified. The periodic
+    checks still run, as they are cheap, and the download is done by
+    another check as soon as the computer is back on AC power. Critical
+    updates are downloaded right away.
+
+    Enabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_power_aware_downloads(int state);
+
+/**
+    Sets how much data updates downloaded in the background may use per
+    day on metered connections.
+
+    By default, updates aren't downloaded in the background (see
+    win_sparkle_set_predownload_updates(), win_sparkle_set_install_on_exit()
+    and win_sparkle_start_service_agent()) while the connection is metered,
+    e.g. mobile broadband, and scheduled checks wait for an unmetered
+    connection for up to one check interval. With a budget, they are done
+    on metered connections too, using at most @a megabytes per local
+    calendar day. An update that doesn't fit is downloaded over several
+    days and sessions, each continuing the partial download where the
+    previous one stopped. The usage is counted in WinSparkle's settings,
+    so it's shared by all instances of the app.
+
+    Connections that are roaming or over (or approaching) their data limit
+    are never used for background downloads. Downloads the user asked for
+    in the update dialog don't count and aren't limited.
+
+    @param megabytes  Daily budget in megabytes, 0 for none (the default).
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_metered_download_budget(int megabytes);
+
+/**
+    Sets whether background work runs at full speed only while the user is
+    idle.
+
+    If enabled, updates downloaded without the user waiting for them (see
+    win_sparkle_set_predownload_updates(), win_sparkle_set_install_on_exit()
+    and win_sparkle_start_service_agent()) and their signatures'
+    verification stay out of the way while the user is using the computer:
+    they run at low priority and the download's speed is limited to
+    128 KB/s. Once there was no input for two minutes, or the screen is
+    locked, they run at full speed. A full-screen application, such as a
+    game or a presentation, counts as activity even without input.
+
+    If disabled, the background work always runs at low priority, but
+    otherwise at full speed.
+
+    Enabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_idle_aware_downloads(int state);
+
+/**
+    Sets whether update files are shared between computers on the local
+    network.
+
+    If enabled, update files are downloaded with BITS (see
+    win_sparkle_set_bits_download()), letting it get the file from other
+    computers on the same network that downloaded it already, instead of
+    from the server, and offer it to the others in turn. This saves a lot
+    of bandwidth when many computers in an office update at the same time.
+
+    The sharing is done by BranchCache, available from Windows 7 on. It
+    must be enabled on the computers (in distributed cache mode) and on
+    the server, typically by an administrator; otherwise the files are
+    downloaded from the server as usual. The signature of the update is
+    verified regardless of where it came from.
+
+    Disabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_peer_caching(int state);
+
+/**
+    Sets whether update files are downloaded with Delivery Optimization.
+
+    Delivery Optimization is the download service Windows Update uses.
+    It gets parts of the file from other computers on the network that
+    have it and from Microsoft Connected Cache servers, if the
+    organization has any, saving internet bandwidth. Like BITS, it
+    continues interrupted downloads even after a restart.
+
+    It is available from Windows 10 version 1809 on and can be configured
+    or disabled by administrators. Where it can't be used, update files
+    are downloaded as usual. The signature of the update is verified
+    regardless of where it came from.
+
+    Disabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_bits_download(), win_sparkle_set_peer_caching()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_delivery_optimization(int state);
+
+/**
+    Sets whether downloaded updates are shared with the other users of the
+    computer.
+
+    If enabled, the first user to download an update puts a copy of it
+    into a directory in ProgramData that all users can read and add files
+    to, and the others copy it from there instead of downloading it. This
+    helps on terminal servers, where many users run the app on the same
+    computer.
+
+    Only signed updates are shared. As anyone can put files into the
+    directory, every user verifies the signature of the copy they take;
+    a file that doesn't match is ignored and the update is downloaded.
+
+    Disabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_peer_caching()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_shared_update_cache(int state);
+
+/**
+    Starts checking for updates on behalf of all users of the computer.
+
+    Call this from the application's Windows service, running as
+    LocalSystem, instead of win_sparkle_init(), after configuring
+    WinSparkle the same way the application does (appcast URL, keys, app
+    details). The service then downloads the appcast feed once for the
+    whole computer, pre-downloads updates into the cache shared by all
+    users (see win_sparkle_set_shared_update_cache()), and hands the feed
+    out to the instances of the application that use it, see
+    win_sparkle_set_use_service_agent(). Both must use the same registry
+    path, which identifies the application.
+
+    The check interval is the one set with
+    win_sparkle_set_update_check_interval(), unless the feed asks for
+    checking less often. The service doesn't show any UI and doesn't
+    install updates, that's still done by the application in the user's
+    session.
+
+    Stop the agent by calling win_sparkle_cleanup() when the service stops.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_start_service_agent(void);
+
+/**
+    Sets whether the appcast feed is taken from the service agent.
+
+    If enabled and the application's service runs the agent (see
+    win_sparkle_start_service_agent()), update checks get the feed the
+    agent downloaded instead of downloading it themselves, and updates
+    are copied from the cache shared by all users of the computer, where
+    the agent puts them. If the agent isn't running, the feed and the
+    updates are downloaded as usual.
+
+    Only a service running as LocalSystem is accepted as the agent. The
+    feed (if signed, see win_sparkle_set_appcast_signature_url()) and the
+    updates are verified as if they were downloaded. Whether the update is
+    skipped or offered to the user right now is decided by the
+    application as before.
+
+    Disabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_use_service_agent(int state);
+
+/**
+    Sets the maximum rate at which WinSparkle downloads data.
+
+    The limit applies to all downloads together, including parallel
+    connections of a single download. Downloads done with BITS (see
+    win_sparkle_set_bits_download()) are not limited by this, BITS only
+    uses idle bandwidth anyway.
+
+    Unlimited by default.
+
+    @param bytes_per_second  The maximum rate in bytes per second, or 0 for
+                             no limit.
+
+    @since 0.6.0
+
+    @see win_sparkle_set_download_backoff()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_max_download_rate(int bytes_per_second);
+
+/**
+    Sets the size up to which updates are downloaded to a temporary file.
+
+    The installer of an update the user is waiting for is launched right
+    after it's downloaded and verified. Unless it's big, writing it out to
+    the disk first only slows that down, so it's downloaded to a file with
+    FILE_ATTRIBUTE_TEMPORARY: Windows keeps the data in memory, where
+    verifying the update's signature and the antivirus scan read them from,
+    and only writes them to the disk if memory runs short. Updates
+    downloaded in the background, which are kept for later, always go to
+    the disk, and so does an update once it waits for the app to exit (see
+    win_sparkle_set_install_on_exit()).
+
+    Default value is 64 MB.
+
+    @param megabytes  The limit in megabytes, or 0 to always write updates
+                      to the disk.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_temporary_staging_limit(int megabytes);
+
+/**
+    Sets whether downloads slow down when other applications use the network.
+
+    If enabled, WinSparkle watches how much data the computer receives
+    besides its own downloads. When it's more than negligible, the download
+    rate is halved (repeatedly, if the other traffic persists); it then
+    returns to the normal rate gradually once the other traffic stops. This
+    keeps the network responsive for other applications on slow links.
+
+    Disabled by default.
+
+    @param state  1 to enable, 0 to disable.
+
+    @since 0.6.0
+
+    @see win_sparkle_set_max_download_rate()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_download_backoff(int state);
+
+/**
+    Sets whether WinSparkle shows its UI on its own.
+
+    In headless mode, updates found by automatic checks or by
+    win_sparkle_check_update_without_ui() are only reported to the
+    application through the callback set with
+    win_sparkle_set_did_find_update_callback(); the update window isn't
+    shown. The application can show it by calling
+    win_sparkle_check_update_with_ui() then. Neither does WinSparkle ask the
+    user for permission to check for updates; use
+    win_sparkle_set_automatic_check_for_updates() to enable the checks.
+
+    The UI toolkit is only initialized when a window is actually shown, so
+    processes that never show one don't pay for it in memory usage and
+    startup time.
+
+    Disabled by default.
+
+    @param state  1 to enable headless mode, 0 to disable it.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_did_find_update_callback()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_headless_mode(int state);
+
+/**
+    Sets the application's main window.
+
+    WinSparkle's windows are centered on this window. If it isn't set, or
+    if the window is hidden or minimized, they're centered on the biggest
+    window of the application, which WinSparkle has to look for among all
+    windows on the desktop.
+
+    This function may be called at any time, e.g. again when the main
+    window is recreated.
+
+    @param hwnd  HWND of the window, or NULL to unset it.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_host_window(void *hwnd);
+
+/**
+    Sets whether WinSparkle's windows run on the application's thread.
+
+    By default, WinSparkle shows its windows on a thread of its own, with
+    its own message loop. If enabled, they are created on the thread that
+    calls win_sparkle_init() instead, and the application's message loop
+    on that thread runs them as any other windows. This saves a thread and
+    a message loop in applications that have one already, whatever toolkit
+    they use.
+
+    WinSparkle's functions may still be called from any thread; their
+    notifications are posted to the application's thread.
+
+    Disabled by default.
+
+    @param state  1 to run the UI on the application's thread, 0 to use
+                  a thread of its own.
+
+    @note Must be called before win_sparkle_init(). Both win_sparkle_init()
+          and win_sparkle_cleanup() must then be called from the thread
+          with the message loop, and win_sparkle_cleanup() not from within
+          a WinSparkle dialog's callback.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_ui_on_host_thread(int state);
+
+/**
+    Sets how long WinSparkle's UI thread is kept once it has no windows.
+
+    The UI thread and the UI toolkit are started only when WinSparkle
+    first shows a window and normally keep running until
+    win_sparkle_cleanup(). If a timeout is set, they're shut down when no
+    WinSparkle window was open for that long, returning the memory they use
+    to the system, and started again next time a window is shown. This is
+    useful in applications that run for a long time.
+
+    Doesn't apply if the UI runs on the application's thread, see
+    win_sparkle_set_ui_on_host_thread().
+
+    @param seconds  Idle time after which the UI is shut down, or 0 to keep
+                    it running (the default).
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_ui_idle_timeout(int seconds);
+
+/**
+    Sets application metadata.
+
+    Normally, these are taken from VERSIONINFO/StringFileInfo resources,
+    but if your application doesn't use them for some reason, using this
+    function is an alternative.
+
+    @param company_name  Company name of the vendor.
+    @param app_name      Application name. This is both shown to the user
+                         and used in HTTP User-Agent header.
+    @param app_version   Version of the app, as string (e.g. "1.2" or "1.2rc1").
+
+    @note @a company_name and @a app_name are used to determine the location
+          of WinSparkle settings in registry.
+          (HKCU\Software\<company_name>\<app_name>\WinSparkle is used.)
+
+    @since 0.3
+
+    @see win_sparkle_set_app_build_version();
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_app_details(const wchar_t *company_name,
+                                                         const wchar_t *app_name,
+                                                         const wchar_t *app_version);
+
+/**
+    Sets application build version number.
+
+    This is the internal version number that is not normally shown to the user.
+    It can be used for finer granularity that official release versions, e.g. for
+    interim builds.
+
+    If this function is called, then the provided *build* number is used for comparing
+    versions; it is compared to the "version" attribute in the appcast and corresponds
+    to OS X Sparkle's CFBundleVersion handling. If used, then the appcast must
+    also contain the "shortVersionString" attribute with human-readable display
+    version string. The version passed to win_sparkle_set_app_details()
+    corresponds to this and is used for display.
 
     @since 0.4
 
-    @see win_sparkle_check_update_with_ui()
+    @see win_sparkle_set_app_details()
  */
-WIN_SPARKLE_API void __cdecl win_sparkle_check_update_without_ui();
+WIN_SPARKLE_API void __cdecl win_sparkle_set_app_build_version(const wchar_t *build);
+
+/**
+    Set the registry path where settings will be stored.
+
+    Normally, these are stored in
+    "HKCU\Software\<company_name>\<app_name>\WinSparkle"
+    but if your application needs to store the data elsewhere for
+    some reason, using this function is an alternative.
+
+    Note that @a path is relative to HKCU/HKLM root and the root is not part
+    of it. For example:
+    @code
+    win_sparkle_set_registry_path("Software\\My App\\Updates");
+    @endcode
+
+    Administrators can enforce settings (e.g. CheckForUpdates or
+    UpdateInterval) with group policy, by setting them under the same path
+    in HKLM\Software\Policies, i.e. with the "Software\" prefix replaced by
+    "Software\Policies\". Such values take precedence over the user's own.
+    An "AppcastURL" string value there overrides the appcast URL, and
+    a "MaintenanceWindows" one the windows set with
+    win_sparkle_set_maintenance_windows().
+
+    @param path  Registry path where settings will be stored.
+
+    @since 0.3
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_registry_path(const char *path);
+
+/**
+    Store settings in a file instead of the registry.
+
+    This is useful for portable installations of the application, or when
+    the registry isn't kept between sessions, e.g. on non-persistent virtual
+    desktops. The file is read only once and changes are written to it
+    shortly after they are made, and by win_sparkle_cleanup(). Settings
+    already stored in the registry are not used when this is set.
+
+    The directory of the file must exist and be writable. The file is
+    created when the first setting is stored.
+
+    @param path  Full path to the file, or NULL to use the registry.
+
+    @note Call this before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_registry_path()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_config_file(const wchar_t *path);
+
+/**
+    Set the directory to download updates to.
+
+    The update is downloaded into a subdirectory of it, under a name
+    ending with ".partial", and renamed when its signature is verified.
+    The verified updates cache is kept there too. By default, this is the
+    temporary directory. Choose a directory on the same volume as the
+    application, so that the update files are only ever renamed, never
+    copied, including by the application's own installation steps.
+
+    The directory must exist and be writable.
+
+    @param path  Full path to the directory, or NULL to use the temporary
+                 directory.
+
+    @note Call this before win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_set_update_downloaded_callback()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_staging_directory(const wchar_t *path);
+
+/**
+    Sets whether updates are checked automatically or only through a manual call.
+
+    If disabled, win_sparkle_check_update_with_ui() must be used explicitly.
+
+    @param  state  1 to have updates checked automatically, 0 otherwise
+
+    @since 0.4
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_automatic_check_for_updates(int state);
+
+/**
+    Gets the automatic update checking state
+
+    @return  1 if updates are set to be checked automatically, 0 otherwise
+
+    @note Defaults to 0 when not yet configured (as happens on first start).
+
+    @since 0.4
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_get_automatic_check_for_updates();
+
+/**
+    Sets the automatic update interval.
+
+    @param  interval The interval in seconds between checks for updates.
+                     The minimum update interval is 3600 seconds (1 hour).
+
+    The appcast feed can ask for checking less often with a
+    `<sparkle:checkInterval>` element (the interval in seconds) placed in
+    `<channel>` before the items; the longer of the two intervals is used
+    then. Failed checks are retried with increasing delays and a delay
+    requested by the server with the `Retry-After` header is honored.
+
+    @since 0.4
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_interval(int interval);
+
+/**
+    Gets the automatic update interval in seconds.
+
+    Default value is one day.
+
+    @since 0.4
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_get_update_check_interval();
+
+/**
+    Lets the automatic update interval adapt to how often the app is
+    released.
+
+    WinSparkle then learns the cadence from the `<pubDate>` of the newest
+    item in the appcast feed, seen by each check, and checks:
+
+    - as often as allowed for a few days after a release, because fixes
+      tend to follow it;
+    - often again when the next release is due, judging by the typical
+      time between releases;
+    - otherwise the less often the longer there wasn't any release.
+
+    The interval stays between @a min_interval and @a max_interval; the one
+    set with win_sparkle_set_update_check_interval() is used until a
+    release date is known. A longer `<sparkle:checkInterval>` requested by
+    the feed is still honored.
+
+    @param  min_interval  Shortest interval in seconds, at least 3600
+                          (1 hour).
+    @param  max_interval  Longest interval in seconds, at least
+                          @a min_interval. Use 0 for both to go back to
+                          the fixed interval (the default).
+
+    @since 0.6.0
+
+    @see win_sparkle_set_update_check_interval()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_adaptive_check_interval(int min_interval, int max_interval);
+
+/**
+    Sets the maximum random delay added to automatic update checks.
+
+    Each automatic check is done up to this many seconds after it's due,
+    so that the appcast server isn't hit by all installations of the app
+    at the same time.
+
+    Default value is 300 seconds (5 minutes). Use 0 to check as soon as
+    the check is due.
+
+    This function must be called before win_sparkle_init().
+
+    @param  seconds  Maximum delay in seconds.
+
+    @since 0.6.0
+
+    @see win_sparkle_set_update_check_tolerance()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_jitter(int seconds);
+
+/**
+    Sets how much the system may delay automatic update checks.
+
+    On Windows Vista and newer, the system may delay the check by up to
+    this many seconds to do it together with other scheduled work and so
+    save power.
+
+    Default value is 60 seconds.
+
+    This function must be called before win_sparkle_init().
+
+    @param  seconds  Tolerable delay in seconds.
+
+    @since 0.6.0
+
+    @see win_sparkle_set_update_check_jitter()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_tolerance(int seconds);
+
+/**
+    Limits background downloads of updates to maintenance windows.
+
+    Updates pre-downloaded (see win_sparkle_set_predownload_updates()) or
+    staged to be installed on exit (see win_sparkle_set_install_on_exit()),
+    and updates installed by win_sparkle_check_update_and_install_silently(),
+    are then only downloaded during the windows, e.g. at night, to keep the
+    traffic off the network during business hours. Updates the user chose
+    to install are downloaded right away.
+
+    If the app downloads updates in the background, automatic checks are
+    moved into the windows too. So that the installations of the app don't
+    all start downloading when a window opens, each of them picks a random
+    moment within the window, once for good, and starts then. Silent
+    installs requested outside the windows wait until that moment.
+
+    Administrators can set the windows with a "MaintenanceWindows" string
+    policy value, see win_sparkle_set_registry_path(), which takes
+    precedence.
+
+    @param windows  Comma-separated ranges of local time in the 24-hour
+                    "hh:mm-hh:mm" format, e.g. "22:00-6:00" or
+                    "0:00-9:00, 17:00-24:00". A range may span midnight.
+                    NULL or empty string to download at any time (the
+                    default).
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_maintenance_windows(const char *windows);
+
+/**
+    Enables or disables warming up connections before automatic checks.
+
+    If enabled, WinSparkle connects to the appcast's server, and to the
+    servers of the update and release notes found by the previous check,
+    a few seconds before each automatic check is due. The check then
+    doesn't wait for DNS resolution and TLS handshakes, which can take
+    most of the time of fetching a small appcast over long distances.
+
+    This is disabled by default.
+
+    This function must be called before win_sparkle_init().
+
+    @param  state  1 to enable, 0 to disable.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_connection_warmup(int state);
+
+/**
+    Sets URL of a server that announces new releases as they're published.
+
+    If set, WinSparkle keeps a request to this URL open while automatic
+    checks are enabled, and checks for updates right away (give or take
+    the jitter set with win_sparkle_set_update_check_jitter()) when the
+    server announces a release. This lets the check interval be long, e.g.
+    a day, while urgent fixes still reach users within minutes. Checks
+    triggered this way are done at most once every 5 minutes.
+
+    The server can either:
+
+     - hold each request until a release is published (long polling) and
+       then respond with any non-empty body; if nothing was published for
+       a while, it must respond with an empty body (e.g. status 204) in less
+       than a minute, after which the request is repeated, or
+     - respond with a stream of server-sent events (Content-Type
+       `text/event-stream`), in which every event with data, of the default
+       type or of type "update", announces a release. Comment lines must be
+       sent at least every 30 seconds to keep the connection alive.
+
+    Failed requests are retried with increasing delays.
+
+    This function must be called before win_sparkle_init().
+
+    @param url  URL of the notification server, or NULL to only check
+                periodically.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_notification_url(const char *url);
+
+/**
+    Gets the time for the last update check.
+
+    Default value is -1, indicating that the update check has never run.
+
+    @since 0.4
+*/
+WIN_SPARKLE_API time_t __cdecl win_sparkle_get_last_check_time();
+
+/// Callback type for win_sparkle_error_callback()
+typedef void (__cdecl *win_sparkle_error_callback_t)();
+
+/**
+    Set callback to be called when the updater encounters an error.
+
+    @since 0.5
+*/
+WIN_SPARKLE_API void __cdecl win_sparkle_set_error_callback(win_sparkle_error_callback_t callback);
+
+/**
+    Kinds of errors, see win_sparkle_error_info_t.
+
+    @since 0.6.0
+ */
+typedef enum
+{
+    /// No error was reported yet
+    WIN_SPARKLE_ERROR_NONE = 0,
+    /// The server couldn't be reached, e.g. it couldn't be resolved
+    WIN_SPARKLE_ERROR_NETWORK = 1,
+    /// The server didn't respond or stopped sending data in time
+    WIN_SPARKLE_ERROR_TIMEOUT = 2,
+    /// The server responded with an error status
+    WIN_SPARKLE_ERROR_HTTP = 3,
+    /// The feed or the update didn't match its signature
+    WIN_SPARKLE_ERROR_SIGNATURE = 4,
+    /// Any other error, e.g. an invalid appcast feed
+    WIN_SPARKLE_ERROR_OTHER = 5
+} win_sparkle_error_kind_t;
+
+/**
+    Details of an error, see win_sparkle_get_last_error().
+
+    New fields may be added to the end of this struct in future versions.
+
+    @since 0.6.0
+ */
+typedef struct
+{
+    /// Must be set to sizeof(win_sparkle_error_info_t)
+    size_t size;
+    /// What kind of error it was
+    win_sparkle_error_kind_t kind;
+    /// HTTP status code of the response, for WIN_SPARKLE_ERROR_HTTP
+    unsigned http_status;
+    /**
+        Windows error code, e.g. one of WinHTTP's ERROR_WINHTTP_* codes
+        for WIN_SPARKLE_ERROR_NETWORK, or 0 if there's none.
+     */
+    unsigned long system_error;
+    /// The error message, as logged, UTF-8 encoded and NUL-terminated
+    char message[256];
+} win_sparkle_error_info_t;
+
+/**
+    Gets the details of the last error that made an update check or the
+    update's download fail.
+
+    This is meant to be called from the callback set with
+    win_sparkle_set_error_callback(), to tell the user more about the
+    error or to decide whether to try again later. Checks cancelled by the
+    application or user are not errors.
+
+    @param info  Struct to fill in, with its size field set. Only the first
+                 @a info->size bytes are written.
+
+    @return 1 if @a info was filled in, 0 if there was no error yet or on
+            error (e.g. if @a info->size is too small).
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_get_last_error(win_sparkle_error_info_t *info);
+
+/// Callback type for win_sparkle_can_shutdown_callback()
+typedef int (__cdecl *win_sparkle_can_shutdown_callback_t)();
+
+/**
+    Set callback for querying the application if it can be closed.
+
+    This callback will be called to ask the host if it's ready to shut down,
+    before attempting to launch the installer. The callback returns TRUE if
+    the host application can be safely shut down or FALSE if not (e.g. because
+    the user has unsaved documents).
+
+    @note There's no guarantee about the thread from which the callback is called,
+          except that it certainly *won't* be called from the app's main thread.
+          Make sure the callback is thread-safe.
+
+    @since 0.4
+
+    @see win_sparkle_set_shutdown_request_callback()
+*/
+WIN_SPARKLE_API void __cdecl win_sparkle_set_can_shutdown_callback(win_sparkle_can_shutdown_callback_t callback);
+
+
+/// Callback type for win_sparkle_shutdown_request_callback()
+typedef void (__cdecl *win_sparkle_shutdown_request_callback_t)();
+
+/**
+    Set callback for shutting down the application.
+
+    This callback will be called to ask the host to shut down immediately after
+    launching the installer. Its implementation should gracefully terminate the
+    application.
+
+    It will only be called if the call to the callback set with
+    win_sparkle_set_can_shutdown_callback() returns TRUE.
+
+    @note There's no guarantee about the thread from which the callback is called,
+          except that it certainly *won't* be called from the app's main thread.
+          Make sure the callback is thread-safe.
+
+    @since 0.4
+
+    @see win_sparkle_set_can_shutdown_callback()
+*/
+WIN_SPARKLE_API void __cdecl win_sparkle_set_shutdown_request_callback(win_sparkle_shutdown_request_callback_t);
+
+/// Callback type for win_sparkle_did_find_update_callback()
+typedef void(__cdecl *win_sparkle_did_find_update_callback_t)();
+
+/**
+    Set callback to be called when the updater did find an update.
+
+    This is useful in combination with
+    win_sparkle_check_update_with_ui_and_install() as it allows you to perform
+    some action after WinSparkle checks for updates.
+
+    @since 0.5
+
+    @see win_sparkle_did_not_find_update_callback()
+    @see win_sparkle_check_update_with_ui_and_install()
+*/
+WIN_SPARKLE_API void __cdecl win_sparkle_set_did_find_update_callback(win_sparkle_did_find_update_callback_t callback);
+
+/// Callback type for win_sparkle_did_not_find_update_callback()
+typedef void (__cdecl *win_sparkle_did_not_find_update_callback_t)();
+
+/**
+    Set callback to be called when the updater did not find an update.
+
+    This is useful in combination with
+    win_sparkle_check_update_with_ui_and_install() as it allows you to perform
+    some action after WinSparkle checks for updates.
+
+    @since 0.5
+
+    @see win_sparkle_did_find_update_callback()
+    @see win_sparkle_check_update_with_ui_and_install()
+*/
+WIN_SPARKLE_API void __cdecl win_sparkle_set_did_not_find_update_callback(win_sparkle_did_not_find_update_callback_t callback);
+
+/// Callback type for win_sparkle_update_cancelled_callback()
+typedef void (__cdecl *win_sparkle_update_cancelled_callback_t)();
+
+/**
+    Set callback to be called when the user cancels a download.
+
+    This is useful in combination with
+    win_sparkle_check_update_with_ui_and_install() as it allows you to perform
+    some action when the installation is interrupted.
+
+    @since 0.5
+
+    @see win_sparkle_check_update_with_ui_and_install()
+*/
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_cancelled_callback(win_sparkle_update_cancelled_callback_t callback);
+
+/**
+    Callback type for win_sparkle_set_download_progress_callback()
+
+    @param downloaded        Number of bytes downloaded so far.
+    @param total             Size of the update in bytes, 0 if not known.
+    @param bytes_per_second  Download speed since the previous call, 0 if
+                             not known yet.
+    @param user_data         The value passed to
+                             win_sparkle_set_download_progress_callback().
+ */
+typedef void (__cdecl *win_sparkle_download_progress_callback_t)(size_t downloaded,
+                                                                 size_t total,
+                                                                 size_t bytes_per_second,
+                                                                 void *user_data);
+
+/**
+    Set callback to be called with the progress of the update's download.
+
+    This lets the application show the progress in its own UI, e.g. in
+    headless mode (see win_sparkle_set_headless_mode()) or with
+    win_sparkle_check_update_and_install_silently(). It is called for
+    downloads of updates the user is waiting for, in addition to WinSparkle's
+    own progress UI, if shown; updates downloaded in advance in the background
+    (see win_sparkle_set_predownload_updates()) aren't reported.
+
+    The callback is called on a background thread. It should return quickly,
+    the download doesn't continue until it does.
+
+    @param callback         The callback, NULL to remove it.
+    @param user_data        Passed to @a callback.
+    @param min_interval_ms  Minimum time between two calls, in milliseconds.
+                            Use 0 to be called for every received chunk of
+                            data. The call when the download completes is
+                            made regardless.
+
+    @note The callback is only used by downloads started after this call.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_download_progress_callback(win_sparkle_download_progress_callback_t callback,
+                                                                        void *user_data,
+                                                                        int min_interval_ms);
+
+/**
+    Callback type for win_sparkle_set_update_downloaded_callback()
+
+    @param path       Full path to the downloaded and verified update file.
+    @param user_data  The value passed to
+                      win_sparkle_set_update_downloaded_callback().
+ */
+typedef void (__cdecl *win_sparkle_update_downloaded_callback_t)(const wchar_t *path,
+                                                                 void *user_data);
+
+/**
+    Set callback to be called when an update was downloaded and verified.
+
+    The file is in the staging directory (see
+    win_sparkle_set_staging_directory()) and already has its final name.
+    It's kept in WinSparkle's cache of verified updates, so the application
+    should copy or hard-link it if it needs the file to stay, rather than
+    move it. The callback is also called for updates downloaded in advance
+    (see win_sparkle_set_predownload_updates()).
+
+    The callback is called on a background thread.
+
+    @param callback   The callback, NULL to remove it.
+    @param user_data  Passed to @a callback.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_downloaded_callback(win_sparkle_update_downloaded_callback_t callback,
+                                                                        void *user_data);
+
+//@}
+
+
+/*--------------------------------------------------------------------------*
+                            Bulk configuration
+ *--------------------------------------------------------------------------*/
+
+/**
+    @name Bulk configuration
+ */
+//@{
+
+/**
+    Configuration applied by win_sparkle_configure().
+
+    Each member corresponds to the function of the same name; NULL members
+    are left unchanged. Initialize the struct to zeros and set only the
+    members you need. New members may be added to the end of this struct
+    in future versions.
+
+    @since 0.6.0
+ */
+typedef struct
+{
+    /// Must be set to sizeof(win_sparkle_config_t)
+    size_t size;
+
+    /// See win_sparkle_set_appcast_url()
+    const char *appcast_url;
+    /// See win_sparkle_set_appcast_signature_url()
+    const char *appcast_signature_url;
+    /// See win_sparkle_set_dsa_pub_pem()
+    const char *dsa_pub_pem;
+    /// See win_sparkle_set_eddsa_public_key()
+    const char *eddsa_public_key;
+
+    /// See win_sparkle_set_app_details()
+    const wchar_t *company_name;
+    /// See win_sparkle_set_app_details()
+    const wchar_t *app_name;
+    /// See win_sparkle_set_app_details()
+    const wchar_t *app_version;
+    /// See win_sparkle_set_app_build_version()
+    const wchar_t *app_build_version;
+    /// See win_sparkle_set_registry_path()
+    const char *registry_path;
+
+    /// See win_sparkle_set_error_callback()
+    win_sparkle_error_callback_t error_callback;
+    /// See win_sparkle_set_can_shutdown_callback()
+    win_sparkle_can_shutdown_callback_t can_shutdown_callback;
+    /// See win_sparkle_set_shutdown_request_callback()
+    win_sparkle_shutdown_request_callback_t shutdown_request_callback;
+    /// See win_sparkle_set_did_find_update_callback()
+    win_sparkle_did_find_update_callback_t did_find_update_callback;
+    /// See win_sparkle_set_did_not_find_update_callback()
+    win_sparkle_did_not_find_update_callback_t did_not_find_update_callback;
+    /// See win_sparkle_set_update_cancelled_callback()
+    win_sparkle_update_cancelled_callback_t update_cancelled_callback;
+} win_sparkle_config_t;
+
+/**
+    Applies all the configuration in @a config at once.
+
+    This is equivalent to calling the individual functions listed in
+    win_sparkle_config_t, but everything is validated first: if any value
+    is invalid (e.g. the public key can't be parsed or the appcast URL is
+    insecure), nothing is changed. Otherwise, the app metadata and the
+    callbacks are each updated in a single step, so that WinSparkle's
+    threads never see a half-configured state.
+
+    @param config  The configuration to apply.
+
+    @return  1 if the configuration was applied, 0 if it was invalid.
+
+    @note Call this before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_configure(const win_sparkle_config_t *config);
+
+//@}
+
+
+/*--------------------------------------------------------------------------*
+                              Manual usage
+ *--------------------------------------------------------------------------*/
+
+/**
+    @name Manually using WinSparkle
+ */
+//@{
+
+/**
+    Checks if an update is available, showing progress UI to the user.
+
+    Normally, WinSparkle checks for updates on startup and only shows its UI
+    when it finds an update. If the application disables this behavior, it
+    can hook this function to "Check for updates..." menu item.
+
+    When called, background thread is started to check for updates. A small
+    window is shown to let the user know the progress. If no update is found,
+    the user is told so. If there is an update, the usual "update available"
+    window is shown.
+
+    This function returns immediately.
+
+    @note Because this function is intended for manual, user-initiated checks
+          for updates, it ignores "Skip this version" even if the user checked
+          it previously.
+
+    @see win_sparkle_check_update_without_ui()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui();
+
+/**
+    Checks if an update is available, showing progress UI to the user and
+    immediately installing the update if one is available.
+
+    This is useful for the case when users should almost always use the
+    newest version of your software. When called, WinSparkle will check for
+    updates showing a progress UI to the user. If an update is found the update
+    prompt will be skipped and the update will be installed immediately.
+
+    If your application expects to do something after checking for updates you
+    may wish to use win_sparkle_set_did_not_find_update_callback() and
+    win_sparkle_set_update_cancelled_callback().
+
+    @since 0.5
+
+    @see win_sparkle_set_did_find_update_callback()
+    @see win_sparkle_set_update_cancelled_callback()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui_and_install();
+
+/**
+    Checks if an update is available.
+
+    No progress UI is shown to the user when checking. If an update is
+    available, the usual "update available" window is shown; this function
+    is *not* completely UI-less, unless headless mode is enabled with
+    win_sparkle_set_headless_mode().
+
+    Use with caution, it usually makes more sense to use the automatic update
+    checks on interval option or manual check with visible UI.
+
+    This function returns immediately.
+
+    @note This function respects "Skip this version" choice by the user.
+
+    @since 0.4
+
+    @see win_sparkle_check_update_with_ui()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_without_ui();
+
+/**
+    Checks if an update is available and installs it without any UI.
+
+    This is meant for unattended installations, e.g. on managed computers.
+    The update is downloaded, verified and its installer launched, with
+    the update's installer arguments, all in the background; the
+    application is then asked to shut down with the callback set by
+    win_sparkle_set_shutdown_request_callback(). WinSparkle's UI isn't
+    shown nor even initialized.
+
+    The application is informed of the progress through the callbacks:
+    - win_sparkle_set_did_find_update_callback() when an update was found,
+    - win_sparkle_set_did_not_find_update_callback() when there's none,
+    - win_sparkle_set_error_callback() when the update couldn't be
+      installed, including when the callback set with
+      win_sparkle_set_can_shutdown_callback() refused to shut down.
+
+    The installer must be able to run without user interaction, typically
+    thanks to the sparkle:installerArguments attribute of the update's
+    enclosure.
+
+    This function returns immediately.
+
+    @note "Skip this version" choice of the user is ignored.
+
+    @since 0.6.0
+
+    @see win_sparkle_check_update_with_ui_and_install()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_and_install_silently();
+
+/**
+    Checks for updates in an update bundle, without accessing the network.
+
+    This is meant for computers without a usable Internet connection. The
+    bundle is a copy of the appcast feed and the update file, e.g. on a USB
+    drive or a file share, with the file named as in the enclosure's URL
+    and in the same directory as the feed. If the app's feed is signed (see
+    win_sparkle_set_appcast_signature_url()), the feed's signature must be
+    there too, in a file named as the feed with ".sig" appended.
+
+    The check proceeds like win_sparkle_check_update_with_ui(), except that
+    the feed is read from @a path and the update file is verified and
+    imported from the bundle before the update is shown, so that installing
+    it doesn't download anything. Only signed updates can be imported.
+
+    This function returns immediately.
+
+    @param path  Path to the bundle's appcast feed file.
+
+    @since 0.6.0
+
+    @see win_sparkle_check_update_with_ui()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_import_update(const wchar_t *path);
+
+/**
+    Prepares WinSparkle's UI in the background.
+
+    Initializing the UI toolkit and creating the update window takes a
+    while, which the user notices when checking for updates manually for the
+    first time. Call this when the application is idle, e.g. a few seconds
+    after it started, if the user is likely to check for updates; the window
+    then shows up without delay. It's initialized at low priority and stays
+    hidden until something is shown in it.
+
+    This function returns immediately.
+
+    @note Must be called after win_sparkle_init().
+
+    @since 0.6.0
+
+    @see win_sparkle_check_update_with_ui()
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_prewarm_ui();
+
+//@}
+
+
+/*--------------------------------------------------------------------------*
+                            Asynchronous checks
+ *--------------------------------------------------------------------------*/
+
+/**
+    @name Asynchronous update checks
+
+    These functions let the application check for updates and present the
+    result in its own UI. Unlike the functions above, each check has its own
+    completion callback, and its result is passed to it instead of to the
+    global callbacks such as win_sparkle_set_did_find_update_callback().
+
+    WinSparkle's UI isn't used by these checks.
+ */
+//@{
+
+/// Handle of a check started with win_sparkle_check_async()
+typedef struct win_sparkle_check_s *win_sparkle_check_t;
+
+/// Outcome of a check, see win_sparkle_check_result_t
+typedef enum
+{
+    /// An update is available
+    WIN_SPARKLE_CHECK_UPDATE_AVAILABLE = 1,
+    /// No update is available, the installed version is the latest one
+    WIN_SPARKLE_CHECK_NO_UPDATE = 0,
+    /// The check failed, e.g. because the appcast couldn't be downloaded
+    WIN_SPARKLE_CHECK_ERROR = -1,
+    /// The check was cancelled with win_sparkle_check_cancel() or by
+    /// win_sparkle_cleanup()
+    WIN_SPARKLE_CHECK_CANCELLED = -2
+} win_sparkle_check_status_t;
+
+/**
+    Result of a check started with win_sparkle_check_async().
+
+    All strings are UTF-8 encoded and never NULL; they are empty if the feed
+    doesn't provide the value or if no update is available.
+ */
+typedef struct
+{
+    /// Outcome of the check
+    win_sparkle_check_status_t status;
+    /// Version of the update (sparkle:version)
+    const char *version;
+    /// Human-readable version of the update (sparkle:shortVersionString)
+    const char *short_version;
+    /// Title of the update
+    const char *title;
+    /// Description of the update
+    const char *description;
+    /// URL of the update's installer, empty if it must be downloaded manually
+    const char *download_url;
+    /// Size of the installer in bytes, -1 if the feed doesn't say
+    long long download_size;
+    /// URL of the release notes
+    const char *release_notes_url;
+    /// URL of the web page to download the update from manually
+    const char *web_browser_url;
+} win_sparkle_check_result_t;
+
+/// Options of a check, see win_sparkle_check_async()
+typedef struct
+{
+    /// Must be set to sizeof(win_sparkle_check_options_t)
+    size_t size;
+    /// If nonzero, the version the user chose to skip is reported too
+    int ignore_skipped_version;
+} win_sparkle_check_options_t;
+
+/**
+    Callback type for win_sparkle_check_async().
+
+    @param check      The check that completed.
+    @param result     Its result, also available from
+                      win_sparkle_check_get_result().
+    @param user_data  The value passed to win_sparkle_check_async().
+ */
+typedef void (__cdecl *win_sparkle_check_completed_callback_t)(
+                        win_sparkle_check_t check,
+                        const win_sparkle_check_result_t *result,
+                        void *user_data);
+
+/**
+    Starts checking for updates in the background.
+
+    @a on_complete is called exactly once, on a background thread, when the
+    check completes, fails or is cancelled. Don't call
+    win_sparkle_check_wait() on the same check from it.
+
+    This function returns immediately.
+
+    @param opts         Options of the check, NULL for the defaults.
+    @param on_complete  Called when the check completes, may be NULL if the
+                        application waits for it with
+                        win_sparkle_check_wait() instead.
+    @param user_data    Passed to @a on_complete.
+
+    @return  Handle of the check, to be released with
+             win_sparkle_check_release(), or NULL on error.
+
+    @note Must be called after win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API win_sparkle_check_t __cdecl win_sparkle_check_async(
+                        const win_sparkle_check_options_t *opts,
+                        win_sparkle_check_completed_callback_t on_complete,
+                        void *user_data);
+
+/**
+    Waits for a check to complete.
+
+    When this returns 1, the check's callback has already returned.
+
+    @param check       Handle returned by win_sparkle_check_async().
+    @param timeout_ms  How long to wait, in milliseconds, or -1 to wait
+                       as long as it takes.
+
+    @return  1 if the check completed, 0 if the timeout elapsed.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_check_wait(win_sparkle_check_t check, int timeout_ms);
+
+/**
+    Returns the result of a completed check.
+
+    @param check  Handle returned by win_sparkle_check_async().
+
+    @return  The result, valid until the handle is released, or NULL if
+             the check didn't complete yet.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API const win_sparkle_check_result_t* __cdecl win_sparkle_check_get_result(win_sparkle_check_t check);
+
+/**
+    Cancels a check.
+
+    The check stops as soon as possible, including in the middle of a
+    download, and its callback receives WIN_SPARKLE_CHECK_CANCELLED,
+    unless it completed already. This function returns immediately.
+
+    @param check  Handle returned by win_sparkle_check_async().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_check_cancel(win_sparkle_check_t check);
+
+/**
+    Releases the handle of a check.
+
+    The check isn't cancelled by this; it continues and its callback is
+    still called. The handle must not be used after this call.
+
+    @param check  Handle returned by win_sparkle_check_async().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_check_release(win_sparkle_check_t check);
+
+/// How far the download of an update got, see win_sparkle_cached_update_info_t
+typedef enum
+{
+    /// The update wasn't downloaded yet
+    WIN_SPARKLE_DOWNLOAD_NONE = 0,
+    /// Its download was interrupted and will be resumed
+    WIN_SPARKLE_DOWNLOAD_PARTIAL = 1,
+    /// It's downloaded and can be installed without waiting for the download
+    WIN_SPARKLE_DOWNLOAD_READY = 2
+} win_sparkle_download_state_t;
+
+/**
+    The update found by the last check, see
+    win_sparkle_get_cached_update_info().
+
+    The strings are UTF-8 encoded and NUL-terminated, truncated if they
+    don't fit. New fields may be added to the end of this struct in future
+    versions.
+ */
+typedef struct
+{
+    /// Must be set to sizeof(win_sparkle_cached_update_info_t)
+    size_t size;
+    /// Version of the update (sparkle:version)
+    char version[64];
+    /// Human-readable version of the update (sparkle:shortVersionString)
+    char short_version[64];
+    /// Title of the update
+    char title[256];
+    /// Size of the installer in bytes, -1 if the feed doesn't say
+    long long download_size;
+    /// How far its download got
+    win_sparkle_download_state_t download_state;
+    /// Time of the last check, as returned by win_sparkle_get_last_check_time()
+    time_t last_check_time;
+} win_sparkle_cached_update_info_t;
+
+/**
+    Returns the update found by the last check, without checking again.
+
+    This is meant for showing that an update is available as soon as the
+    application starts, e.g. as a badge, before a new check completes. The
+    result is taken from the copy of the appcast WinSparkle keeps in its
+    settings; no network request is made and no thread is started, so the
+    function returns right away.
+
+    The update is only reported if it would be offered now: it's newer
+    than the installed version, the user didn't choose to skip it (unless
+    it's critical), and the appcast's URL and update channels didn't change
+    since the check.
+
+    @param info  Receives the update's details if there's one. Its size
+                 field must be set; only the fields that fit into it are
+                 filled.
+
+    @return WIN_SPARKLE_CHECK_UPDATE_AVAILABLE if there's an update,
+            WIN_SPARKLE_CHECK_NO_UPDATE if there isn't or if the last check
+            isn't known, WIN_SPARKLE_CHECK_ERROR on error.
+
+    @note Can be called before win_sparkle_init(), once the app's details
+          and the appcast URL are set.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API win_sparkle_check_status_t __cdecl win_sparkle_get_cached_update_info(
+                        win_sparkle_cached_update_info_t *info);
+
+//@}
+
+
+/*--------------------------------------------------------------------------*
+                                Statistics
+ *--------------------------------------------------------------------------*/
+
+/**
+    @name Statistics
+
+    Performance metrics of the update checks and downloads done since the
+    application started, e.g. for monitoring them with telemetry.
+ */
+//@{
+
+/// Number of buckets in win_sparkle_stats_t::check_latency_histogram
+#define WIN_SPARKLE_STATS_LATENCY_BUCKETS 8
+
+/// Number of phases in win_sparkle_stats_t::allocations
+#define WIN_SPARKLE_STATS_ALLOC_PHASES 6
+
+/** @name Phases of win_sparkle_stats_t::allocations */
+//@{
+/// win_sparkle_init() and the deferred initialization
+#define WIN_SPARKLE_STATS_PHASE_INIT      0
+/// Update checks, including the appcast's download
+#define WIN_SPARKLE_STATS_PHASE_CHECK     1
+/// Parsing the appcast
+#define WIN_SPARKLE_STATS_PHASE_PARSE     2
+/// Downloading update files
+#define WIN_SPARKLE_STATS_PHASE_DOWNLOAD  3
+/// Verifying update files' signatures
+#define WIN_SPARKLE_STATS_PHASE_VERIFY    4
+/// The UI thread
+#define WIN_SPARKLE_STATS_PHASE_UI        5
+//@}
+
+/// Number of entries in win_sparkle_stats_t::footprints
+#define WIN_SPARKLE_STATS_FOOTPRINTS 4
+
+/** @name Points of win_sparkle_stats_t::footprints */
+//@{
+/// After win_sparkle_init(), including the deferred initialization
+#define WIN_SPARKLE_STATS_FOOTPRINT_INIT           0
+/// After the last update check finished
+#define WIN_SPARKLE_STATS_FOOTPRINT_CHECK          1
+/// After the update dialog was last shown
+#define WIN_SPARKLE_STATS_FOOTPRINT_DIALOG_SHOWN   2
+/// After the update dialog was last closed
+#define WIN_SPARKLE_STATS_FOOTPRINT_DIALOG_CLOSED  3
+//@}
+
+/**
+    Resource usage of the whole process at a point of WinSparkle's work,
+    see win_sparkle_stats_t::footprints.
+
+    All fields are 0 if the point wasn't reached yet.
+ */
+typedef struct
+{
+    /// Private bytes (commit charge) of the process
+    unsigned long long private_bytes;
+    /// Working set of the process, in bytes
+    unsigned long long working_set;
+    /// Number of GDI objects
+    unsigned gdi_objects;
+    /// Number of USER objects
+    unsigned user_objects;
+    /// Number of kernel handles
+    unsigned handles;
+} win_sparkle_footprint_t;
+
+/**
+    Statistics returned by win_sparkle_get_stats().
+
+    Times are in milliseconds. The check timings are of the appcast feed's
+    download; they are 0 if the value couldn't be measured (e.g. connect time
+    when an existing connection was reused).
+
+    New fields may be added to the end of this struct in future versions.
+ */
+typedef struct
+{
+    /// Must be set to sizeof(win_sparkle_stats_t)
+    size_t size;
+
+    /// Number of update checks that downloaded the appcast
+    unsigned checks;
+    /// Number of update checks that failed
+    unsigned failed_checks;
+    /// Number of automatic checks retrying a failed one before the next regular check
+    unsigned check_retries;
+
+    /**
+        Histogram of successful checks' durations. The buckets are for
+        checks that took less than 100, 250, 500, 1000, 2500, 5000 and
+        10000 ms, and longer.
+     */
+    unsigned check_latency_histogram[WIN_SPARKLE_STATS_LATENCY_BUCKETS];
+
+    /// Duration of the last successful check
+    unsigned last_check_ms;
+    /// Time the last check spent resolving the server's name (DNS)
+    unsigned last_check_resolve_ms;
+    /// Time the last check spent establishing the TCP connection
+    unsigned last_check_connect_ms;
+    /// Time the last check spent in the TLS handshake
+    unsigned last_check_tls_ms;
+    /**
+        Time from the start of the request until the response headers
+        arrived (time to first byte), excluding the time spent resolving,
+        connecting and in the TLS handshake.
+     */
+    unsigned last_check_ttfb_ms;
+    /// Number of redirects the last check followed to get to the appcast
+    unsigned last_check_redirects;
+    /// Time spent receiving the appcast's data
+    unsigned last_check_transfer_ms;
+    /// Time spent parsing (and verifying) the appcast
+    unsigned last_check_parse_ms;
+
+    /// Number of HTTP responses with the whole resource (200 OK)
+    unsigned responses_full;
+    /// Number of HTTP responses with a part of it (206 Partial Content)
+    unsigned responses_partial;
+    /// Number of HTTP responses saying the cached copy is current (304 Not Modified)
+    unsigned responses_not_modified;
+    /// Number of interrupted update downloads that were resumed
+    unsigned resumed_downloads;
+
+    /// Bytes received over the network (compressed, if compression was used)
+    unsigned long long bytes_downloaded;
+    /// Bytes that didn't need to be downloaded because a cached copy was current
+    unsigned long long bytes_saved_by_cache;
+    /// Bytes not downloaded thanks to HTTP compression
+    unsigned long long bytes_saved_by_compression;
+
+    /// Download speed of the last update file, 0 if none was downloaded
+    unsigned long long last_download_bytes_per_second;
+    /// Speed of the last update file's signature verification
+    unsigned long long last_verification_bytes_per_second;
+
+    /**
+        Number of memory allocations WinSparkle made, by phase of its work
+        (indexed by WIN_SPARKLE_STATS_PHASE_INIT etc.). This is only
+        counted in builds with WIN_SPARKLE_ALLOC_STATS defined, which are
+        meant for keeping track of WinSparkle's memory use, and is 0
+        otherwise.
+     */
+    unsigned long long allocations[WIN_SPARKLE_STATS_ALLOC_PHASES];
+    /// Bytes allocated, by phase, see allocations
+    unsigned long long allocated_bytes[WIN_SPARKLE_STATS_ALLOC_PHASES];
+
+    /**
+        Time from the last call to win_sparkle_check_update_with_ui() (or
+        win_sparkle_check_update_with_ui_and_install()) until the update
+        dialog was first painted, 0 if it wasn't yet.
+     */
+    unsigned last_ui_first_paint_ms;
+    /// Time from that call until the check's result was shown
+    unsigned last_ui_result_shown_ms;
+    /// Time from that call until the release notes were rendered
+    unsigned last_ui_release_notes_ms;
+
+    /**
+        The process's resource usage after initialization, a check and
+        showing and closing the dialog (indexed by
+        WIN_SPARKLE_STATS_FOOTPRINT_INIT etc.), for finding out how much
+        WinSparkle adds to the application in each of them.
+     */
+    win_sparkle_footprint_t footprints[WIN_SPARKLE_STATS_FOOTPRINTS];
+
+    /**
+        Number of times a WinSparkle thread, or a thread calling its API,
+        had to wait for a lock held by another thread. Together with the
+        times below, it shows how much calling WinSparkle from several
+        threads at once costs; see win_sparkle_set_api_stall_threshold()
+        for finding which locks are waited for.
+     */
+    unsigned lock_contentions;
+    /// Total time spent waiting for the locks, in microseconds
+    unsigned long long lock_wait_us;
+    /// Longest single wait for a lock, in microseconds
+    unsigned longest_lock_wait_us;
+
+    /**
+        Kind of the last error reported to the application, a
+        win_sparkle_error_kind_t value; see win_sparkle_get_last_error()
+        for all the details.
+     */
+    int last_error_kind;
+    /// HTTP status code of the last error, if it was WIN_SPARKLE_ERROR_HTTP
+    unsigned last_error_http_status;
+    /// Windows error code of the last error, 0 if none
+    unsigned long last_error_system_code;
+} win_sparkle_stats_t;
+
+/**
+    Gets the statistics.
+
+    Only the first @a stats->size bytes of the struct are written, so that
+    applications compiled against older versions of the header keep working.
+
+    @param stats  Struct to fill in, with its size field set.
+
+    @return 1 on success, 0 on error (e.g. if @a stats->size is too small).
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_get_stats(win_sparkle_stats_t *stats);
+
+/**
+    Gets the statistics as a JSON object.
+
+    The object's keys are the names of win_sparkle_stats_t's fields, with
+    arrays for the histogram and the per-phase counts. This is meant for
+    tools collecting the metrics of a test run, e.g. to compare them with
+    those of the previous release, together with
+    win_sparkle_set_http_replay() for repeatable runs.
+
+    @param buffer  Buffer to write the NUL-terminated JSON to; it is
+                   truncated if it doesn't fit. May be NULL if @a size is 0.
+    @param size    Size of @a buffer in bytes.
+
+    @return Length of the whole JSON, without the terminating NUL, so that
+            the call can be repeated with a large enough buffer if it's
+            not less than @a size; -1 on error.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_get_stats_json(char *buffer, size_t size);
+
+/**
+    State of the scheduler of automatic checks, see win_sparkle_status_t.
+
+    @since 0.6.0
+ */
+typedef enum
+{
+    /// Automatic checks aren't scheduled, e.g. before win_sparkle_init()
+    WIN_SPARKLE_SCHEDULER_STOPPED = 0,
+    /// Waiting until the next check is due
+    WIN_SPARKLE_SCHEDULER_WAITING = 1,
+    /// A due check waits for a (cheaper) network connection
+    WIN_SPARKLE_SCHEDULER_WAITING_FOR_NETWORK = 2,
+    /// The scheduler's check is in progress
+    WIN_SPARKLE_SCHEDULER_CHECKING = 3
+} win_sparkle_scheduler_state_t;
+
+/**
+    Kinds of operations in progress, see win_sparkle_operation_status_t.
+
+    @since 0.6.0
+ */
+typedef enum
+{
+    /// Checking for updates
+    WIN_SPARKLE_OPERATION_CHECK = 1,
+    /// Downloading and verifying the update
+    WIN_SPARKLE_OPERATION_DOWNLOAD = 2
+} win_sparkle_operation_kind_t;
+
+/**
+    Phases of operations in progress, see win_sparkle_operation_status_t.
+
+    @since 0.6.0
+ */
+typedef enum
+{
+    /**
+        Waiting for the same operation to finish elsewhere, e.g. in another
+        instance of the app, so that it isn't done twice
+     */
+    WIN_SPARKLE_PHASE_QUEUED = 0,
+    /// Downloading and parsing the appcast feed
+    WIN_SPARKLE_PHASE_CHECKING = 1,
+    /// Downloading the update
+    WIN_SPARKLE_PHASE_DOWNLOADING = 2,
+    /// Verifying the update's signature
+    WIN_SPARKLE_PHASE_VERIFYING = 3
+} win_sparkle_phase_t;
+
+/// Most operations reported in win_sparkle_status_t::operations
+#define WIN_SPARKLE_STATUS_MAX_OPERATIONS 4
+
+/**
+    An operation in progress, see win_sparkle_status_t.
+
+    @since 0.6.0
+ */
+typedef struct
+{
+    /// What is being done
+    win_sparkle_operation_kind_t kind;
+    /// Current phase of it
+    win_sparkle_phase_t phase;
+    /// Time spent in the current phase, in milliseconds
+    unsigned phase_ms;
+    /// Bytes of the update downloaded so far, in the downloading phase
+    unsigned long long bytes_done;
+    /// Size of the update, 0 if not known (yet)
+    unsigned long long bytes_total;
+    /// Average download speed in the downloading phase, 0 if not known yet
+    unsigned long long bytes_per_second;
+} win_sparkle_operation_status_t;
+
+/**
+    Snapshot of what WinSparkle is doing, see win_sparkle_get_status().
+
+    New fields may be added to the end of this struct in future versions.
+
+    @since 0.6.0
+ */
+typedef struct
+{
+    /// Must be set to sizeof(win_sparkle_status_t)
+    size_t size;
+
+    /// What the scheduler of automatic checks does
+    win_sparkle_scheduler_state_t scheduler;
+    /**
+        When the next automatic check is due, without the random delay
+        (see win_sparkle_set_update_check_jitter()); may be in the past if
+        it waits for the network. 0 if none is scheduled.
+     */
+    time_t next_check_time;
+
+    /**
+        Number of operations in progress. They are described in
+        operations, up to WIN_SPARKLE_STATUS_MAX_OPERATIONS of them.
+     */
+    unsigned operation_count;
+    /// Number of the operations in the WIN_SPARKLE_PHASE_QUEUED phase
+    unsigned queued_operations;
+    /// The operations in progress
+    win_sparkle_operation_status_t operations[WIN_SPARKLE_STATUS_MAX_OPERATIONS];
+
+    /**
+        Kind of the last error reported to the application, see
+        win_sparkle_get_last_error() for all of its details.
+     */
+    win_sparkle_error_kind_t last_error_kind;
+    /// HTTP status code of the last error, if it was WIN_SPARKLE_ERROR_HTTP
+    unsigned last_error_http_status;
+    /// Windows error code of the last error, 0 if none
+    unsigned long last_error_system_code;
+    /// When the last error happened, 0 if there was none
+    time_t last_error_time;
+} win_sparkle_status_t;
+
+/**
+    Gets a snapshot of what WinSparkle is doing: when the next automatic
+    check is due, the checks and downloads in progress and the last error.
+
+    This doesn't take any locks nor wait for WinSparkle's threads, so it's
+    cheap enough to be polled often, e.g. to show the state in the app's
+    status bar. The values are consistent for each part of the snapshot,
+    but an operation may e.g. finish between reading the scheduler's state
+    and the operations.
+
+    @param status  Struct to fill in, with its size field set. Only the
+                   first @a status->size bytes are written.
+
+    @return 1 on success, 0 on error (e.g. if @a status->size is too small).
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_get_status(win_sparkle_status_t *status);
+
+/**
+    Enables sending of performance telemetry to @a url.
+
+    Telemetry is off by default. When enabled, the statistics of update
+    checks and downloads (see win_sparkle_get_stats()) are aggregated
+    locally, across runs of the application, and sent to @a url once a
+    day, in a single POST request with a JSON object like this:
+
+    @code
+    {"period_start":1700000000,"period_end":1700086400,
+     "app_version":"1.2","winsparkle_version":"0.6.0",
+     "checks":3,"failed_checks":1,
+     "check_latency_ms":{"p50":240,"p90":910,"p99":910,"samples":2},
+     "responses_full":2,"responses_not_modified":1,
+     "bytes_downloaded":5242880,"bytes_saved_by_cache":2048,
+     "update_downloads":1,"update_download_bytes_per_second":1048576,
+     "failures":{"network":1,"timeout":0,"http":0,"signature":0,"other":0}}
+    @endcode
+
+    The times are Unix timestamps. No information identifying the user or
+    the computer is included. The aggregates are sent after a scheduled
+    update check succeeds, so that the request can reuse the check's
+    connection if @a url is on the appcast's server. If sending fails, it's
+    retried after the next check.
+
+    It's up to the application to ask the user for consent before enabling
+    this.
+
+    @param url  URL to send the telemetry to, NULL to disable it.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_telemetry_url(const char *url);
+
+/**
+    Records WinSparkle's HTTP responses, for replaying them later.
+
+    Every response WinSparkle receives, such as the appcast and the update
+    file, is saved into @a directory together with its headers and the
+    times its phases and data took, so that performance tests can be
+    repeated with win_sparkle_set_http_replay() without depending on the
+    network.
+
+    Files downloaded with BITS or Delivery Optimization (see
+    win_sparkle_set_bits_download()) aren't recorded.
+
+    @param directory  Existing directory to save the responses to, NULL to
+                      stop recording.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_http_recording(const wchar_t *directory);
+
+/**
+    Replays HTTP responses recorded with win_sparkle_set_http_recording()
+    instead of accessing the network.
+
+    Each request is answered with the first recorded response to the same
+    URL with the same headers that wasn't replayed yet, or with the last
+    one if all were, so that update checks can be repeated. Requests that
+    weren't recorded fail. The responses are delayed like when recorded,
+    scaled by @a time_scale_percent.
+
+    This takes precedence over win_sparkle_set_http_recording().
+
+    @param directory           Directory with the recording, NULL to use
+                               the network again.
+    @param time_scale_percent  Percentage of the recorded times to take,
+                               100 to replay at the recorded speed, 0 to
+                               replay without any delays.
+
+    @note Must be called before win_sparkle_init().
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_http_replay(const wchar_t *directory,
+                                                         int time_scale_percent);
+
+//@}
+
+
+/*--------------------------------------------------------------------------*
+                            Network diagnostics
+ *--------------------------------------------------------------------------*/
+
+/**
+    @name Network diagnostics
+
+    Measurements of the network path to the appcast's server and to the
+    update's mirrors, e.g. for a support tool when users report that
+    updates are slow.
+ */
+//@{
+
+/**
+    Diagnostics of one server, see win_sparkle_diagnostics_report_t.
+
+    Times are in milliseconds. The network phases are 0 if they didn't
+    happen (e.g. the connection was reused, or there's no TLS) or the HTTP
+    backend doesn't report them.
+ */
+typedef struct
+{
+    /// URL that was requested
+    const char *url;
+    /**
+        The proxy used for the URL: "DIRECT", the proxy's address, or
+        empty if the HTTP backend leaves it to the system (WinINet does).
+     */
+    const char *proxy;
+    /// Time spent finding the proxy, e.g. by WPAD or a PAC script
+    unsigned proxy_ms;
+    /// Time spent resolving the server's name (DNS)
+    unsigned resolve_ms;
+    /// Time spent establishing the TCP connection
+    unsigned connect_ms;
+    /// Time spent in the TLS handshake
+    unsigned tls_ms;
+    /// Time from sending the request until the response started arriving
+    unsigned ttfb_ms;
+    /// Number of redirects followed
+    unsigned redirects;
+    /// Bytes received, at most a short sample for the update's mirrors
+    unsigned long long bytes;
+    /// Download speed while receiving them, 0 if it couldn't be measured
+    unsigned long long bytes_per_second;
+    /// Error message if the request failed, empty string otherwise
+    const char *error;
+} win_sparkle_diagnostics_host_t;
+
+/**
+    Report of win_sparkle_run_diagnostics().
+
+    New fields may be added to the end of this struct in future versions,
+    check @a size before using them.
+ */
+typedef struct
+{
+    /// sizeof(win_sparkle_diagnostics_report_t) of the WinSparkle version
+    size_t size;
+    /// The appcast feed's download
+    win_sparkle_diagnostics_host_t appcast;
+    /// Time spent parsing the feed, 0 if it couldn't be downloaded
+    unsigned feed_parse_ms;
+    /// Version of the newest update in the feed, empty string if none
+    const char *feed_version;
+    /// Error parsing the feed, empty string if it was parsed
+    const char *feed_error;
+    /// The update file's servers, the main download URL and then the mirrors
+    const win_sparkle_diagnostics_host_t *mirrors;
+    /// Number of elements in @a mirrors
+    size_t mirror_count;
+} win_sparkle_diagnostics_report_t;
+
+/**
+    Callback type for win_sparkle_run_diagnostics().
+
+    @param report     The report, valid only during the call.
+    @param user_data  The value passed to win_sparkle_run_diagnostics().
+ */
+typedef void (__cdecl *win_sparkle_diagnostics_callback_t)(
+                        const win_sparkle_diagnostics_report_t *report,
+                        void *user_data);
+
+/**
+    Runs network diagnostics in the background.
+
+    The appcast feed is downloaded and parsed (without checking its
+    signature or changing any state), then a sample of a few seconds of the
+    update file is downloaded from each of its servers. For each request,
+    the proxy resolution, DNS, connect, TLS and time to first byte are
+    measured, along with the download speed.
+
+    The requests use the same HTTP backend and connections as update
+    checks, so a server connected to recently may be reached over an open
+    connection, without DNS, connect or TLS times.
+
+    This function returns immediately. @a report_cb is called once, on a
+    background thread, when the diagnostics finish; it isn't called if
+    win_sparkle_cleanup() interrupts them.
+
+    @param report_cb  Receives the report.
+    @param user_data  Passed to @a report_cb.
+
+    @return  1 if the diagnostics were started, 0 on error, e.g. if
+             the appcast URL isn't set.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_run_diagnostics(win_sparkle_diagnostics_callback_t report_cb,
+                                                        void *user_data);
+
+//@}
+
+
+/*--------------------------------------------------------------------------*
+                                 Logging
+ *--------------------------------------------------------------------------*/
+
+/**
+    @name Logging
+
+    WinSparkle logs its errors, and optionally its progress, to the debug
+    output (see OutputDebugString()). Logging is cheap: messages are only
+    queued in memory and written out by a background thread, which can
+    also write them to a file and pass them to the application, e.g. to
+    include them in its own diagnostics.
+ */
+//@{
+
+/// Levels of log messages, see win_sparkle_set_log_level()
+typedef enum
+{
+    /// Errors that made an operation fail
+    WIN_SPARKLE_LOG_ERROR = 1,
+    /// Problems WinSparkle recovered from, e.g. by retrying
+    WIN_SPARKLE_LOG_WARNING = 2,
+    /// Progress of update checks and downloads
+    WIN_SPARKLE_LOG_INFO = 3,
+    /// Details for debugging WinSparkle
+    WIN_SPARKLE_LOG_DEBUG = 4
+} win_sparkle_log_level_t;
+
+/**
+    Sets the most detailed level of messages that are logged.
+
+    Default value is WIN_SPARKLE_LOG_ERROR.
+
+    @param level  The level; messages of this and more important levels
+                  are logged.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_log_level(win_sparkle_log_level_t level);
+
+/**
+    Sets a file to write the log messages to.
+
+    Messages are appended to the file, one per line with the time, thread
+    and level. When the file would grow over @a max_size bytes, it's
+    renamed to the same name with ".1" appended, replacing the previous
+    such file, and a new one is started.
+
+    @param path      Path of the file, NULL or empty string for none (the
+                     default). Several instances of the app may log into
+                     the same file.
+    @param max_size  Size in bytes at which the file is rotated, 0 for the
+                     default of 1 MB.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_log_file(const wchar_t *path, int max_size);
+
+/**
+    Callback type for win_sparkle_set_log_callback()
+
+    @param level      Level of the message.
+    @param message    The message, in UTF-8.
+    @param user_data  The value passed to win_sparkle_set_log_callback().
+ */
+typedef void (__cdecl *win_sparkle_log_callback_t)(win_sparkle_log_level_t level,
+                                                   const char *message,
+                                                   void *user_data);
+
+/**
+    Set callback to be called with every log message.
+
+    The callback is called on WinSparkle's logging thread, a while after
+    the message was logged, or from win_sparkle_cleanup() for the last
+    messages. It must not call WinSparkle functions that log.
+
+    @param callback   The callback, NULL to remove it.
+    @param user_data  Passed to @a callback.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_log_callback(win_sparkle_log_callback_t callback,
+                                                          void *user_data);
+
+/**
+    Reports WinSparkle functions that block the calling thread for too long.
+
+    This is a diagnostic aid for applications that call WinSparkle from
+    their UI thread: when any win_sparkle_xxx() function takes longer than
+    @a milliseconds to return, a warning is logged (see
+    win_sparkle_set_log_level()) with a breakdown of where the time went,
+    e.g. waiting for a lock held by WinSparkle's UI thread or for a thread
+    to finish, and an "ApiStall" event is traced. Calls made from
+    WinSparkle's callbacks count as a part of the call that invoked them.
+
+    Measuring is cheap, but it is disabled by default.
+
+    @param milliseconds  Threshold, 0 to disable reporting.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API void __cdecl win_sparkle_set_api_stall_threshold(int milliseconds);
+
+//@}
+
+
+/*--------------------------------------------------------------------------*
+                               Appcast tools
+ *--------------------------------------------------------------------------*/
+
+/**
+    @name Appcast tools
+
+    Functions for publishing appcasts, meant to be used by build or release
+    tools rather than by the application itself.
+ */
+//@{
+
+/**
+    Converts an appcast feed to the binary appcast format.
+
+    Binary appcasts are used in place, without parsing, so WinSparkle
+    finds the update in even very large feeds quickly. They can be
+    served instead of the RSS or JSON feed, from the same or a different
+    URL; WinSparkle recognizes the format by its content.
+
+    All items of the feed are converted. Delta updates are not included.
+
+    @param feed_path    Path of the RSS or JSON feed to convert.
+    @param binary_path  Path of the binary appcast to create.
+
+    @return 1 on success, 0 on failure, which is logged.
+
+    @since 0.6.0
+ */
+WIN_SPARKLE_API int __cdecl win_sparkle_convert_appcast_to_binary(const wchar_t *feed_path,
+                                                                  const wchar_t *binary_path);
 
 //@}
 
@@ -41,6 +41,29 @@ type
   TUpdateType = (utSilent, utWithUI, utWithUIAndInstall);
   TCanShutDownCallback = function: boolean;
 
+  TCheckStatus = (csCancelled, csError, csNoUpdate, csUpdateAvailable);
+  TDownloadState = (dsNone, dsPartial, dsReady);
+
+  // Result of TWinSparkle.CheckUpdatesAsync; strings are UTF-8
+  TUpdateInfo = record
+    Status: TCheckStatus;
+    Version, ShortVersion, Title, Description, DownloadURL: string;
+    DownloadSize: int64; // -1 if not known
+    ReleaseNotesURL, WebBrowserURL: string;
+  end;
+
+  // Result of TWinSparkle.GetCachedUpdateInfo; strings are UTF-8
+  TCachedUpdateInfo = record
+    Version, ShortVersion, Title: string;
+    DownloadSize: int64; // -1 if not known
+    DownloadState: TDownloadState;
+    LastCheckTime: TDateTime;
+  end;
+
+  // Both are called on the main thread, see CheckUpdatesAsync
+  TCheckCompletedCallback = procedure(const Info: TUpdateInfo);
+  TDownloadProgressCallback = procedure(Downloaded, Total, BytesPerSecond: int64);
+
   { TWinSparkle }
 
   TWinSparkle = class
@@ -50,6 +73,10 @@ type
     FOnUpdateNotFound: TProcedure;
     class var
     FOnCanShutDown: TCanShutDownCallback;
+    class var
+    FCheck: Pointer;
+    FOnDownloadProgress: TDownloadProgressCallback;
+    class function GetIsChecking: boolean; static;
     class function GetAutoCheck: boolean; static;
     class function GetAutoCheckIntereval: cint; static;
     class function GetLastCheckTime: TDateTime; static;
@@ -85,18 +112,66 @@ type
     class property OnCancelledUpdate: TProcedure
       read FOnCancelledUpdate write FOnCancelledUpdate;
     class procedure CheckUpdates(const UpdateType: TUpdateType);
+    // Checks for updates in the background, without WinSparkle's UI, and
+    // calls OnComplete on the main thread with the result. The main thread
+    // must process TThread.Queue'd calls (VCL and LCL applications do so
+    // in their message loop). Returns False if a check is already running
+    // or it couldn't be started.
+    class function CheckUpdatesAsync(OnComplete: TCheckCompletedCallback;
+      IgnoreSkippedVersion: boolean = False): boolean;
+    // Cancels the check started by CheckUpdatesAsync; its OnComplete is
+    // still called, with csCancelled unless it completed already.
+    class procedure CancelCheck;
+    class property IsChecking: boolean read GetIsChecking;
+    // Reports the progress of update downloads on the main thread, at most
+    // once per MinInterval milliseconds. Calls arriving while the previous
+    // one wasn't delivered yet are merged into it. Nil removes the callback.
+    class procedure SetDownloadProgressCallback(
+      Callback: TDownloadProgressCallback; MinInterval: cint = 100);
+    // Returns the update found by the last check, without checking again.
+    // Info is only filled in if csUpdateAvailable is returned.
+    class function GetCachedUpdateInfo(out Info: TCachedUpdateInfo): TCheckStatus;
   end;
 
 
 
 implementation
 
-uses dateutils;
+uses Classes, dateutils;
+
+{$PACKRECORDS C}
 
 type
   TWinSparkleCallbackVoid = procedure; cdecl;
   TWinSparkleCallbackCanShutdown = function: longbool; cdecl;
 
+  PWinSparkleCheckResult = ^TWinSparkleCheckResult;
+  TWinSparkleCheckResult = record
+    status: cint;
+    version, short_version, title, description, download_url: PChar;
+    download_size: clonglong;
+    release_notes_url, web_browser_url: PChar;
+  end;
+
+  TWinSparkleCheckOptions = record
+    size: PtrUInt;
+    ignore_skipped_version: cint;
+  end;
+
+  TWinSparkleCachedUpdateInfo = record
+    size: PtrUInt;
+    version, short_version: array[0..63] of char;
+    title: array[0..255] of char;
+    download_size: clonglong;
+    download_state: cint;
+    last_check_time: int64; // time_t of MSVC builds
+  end;
+
+  TWinSparkleCallbackCheckCompleted = procedure(check: Pointer;
+    result: PWinSparkleCheckResult; user_data: Pointer); cdecl;
+  TWinSparkleCallbackDownloadProgress = procedure(downloaded, total,
+    bytes_per_second: PtrUInt; user_data: Pointer); cdecl;
+
 procedure win_sparkle_init; cdecl; external WinSparkleLib;
 procedure win_sparkle_cleanup; cdecl; external WinSparkleLib;
 procedure win_sparkle_set_lang(lang: PChar); cdecl; external WinSparkleLib;
@@ -134,6 +209,156 @@ procedure win_sparkle_set_update_cancelled_callback(callback: TWinSparkleCallbac
 procedure win_sparkle_check_update_with_ui; cdecl; external WinSparkleLib;
 procedure win_sparkle_check_update_with_ui_and_install; cdecl; external WinSparkleLib;
 procedure win_sparkle_check_update_without_ui; cdecl; external WinSparkleLib;
+procedure win_sparkle_set_download_progress_callback(callback:
+  TWinSparkleCallbackDownloadProgress; user_data: Pointer; min_interval_ms: cint);
+  cdecl; external WinSparkleLib;
+function win_sparkle_check_async(const opts: TWinSparkleCheckOptions;
+  on_complete: TWinSparkleCallbackCheckCompleted; user_data: Pointer): Pointer;
+  cdecl; external WinSparkleLib;
+procedure win_sparkle_check_cancel(check: Pointer); cdecl; external WinSparkleLib;
+procedure win_sparkle_check_release(check: Pointer); cdecl; external WinSparkleLib;
+function win_sparkle_get_cached_update_info(var info: TWinSparkleCachedUpdateInfo): cint;
+  cdecl; external WinSparkleLib;
+
+function ToCheckStatus(Status: cint): TCheckStatus;
+begin
+  case Status of
+    1: Result := csUpdateAvailable;
+    0: Result := csNoUpdate;
+    -2: Result := csCancelled;
+    else
+      Result := csError;
+  end;
+end;
+
+type
+  { TCheckDelivery }
+
+  // Carries the result of one check from WinSparkle's thread to the main one
+  TCheckDelivery = class
+  private
+    FCheck: Pointer;
+    FOnComplete: TCheckCompletedCallback;
+    FInfo: TUpdateInfo;
+  public
+    constructor Create(OnComplete: TCheckCompletedCallback);
+    procedure Deliver;
+  end;
+
+  { TProgressDelivery }
+
+  // Merges progress reports that arrive faster than the main thread takes
+  // them, so that at most one call is queued at any time
+  TProgressDelivery = class
+  private
+    FLock: TRTLCriticalSection;
+    FQueued: boolean;
+    FDownloaded, FTotal, FBytesPerSecond: int64;
+  public
+    constructor Create;
+    destructor Destroy; override;
+    procedure Post(Downloaded, Total, BytesPerSecond: int64);
+    procedure Deliver;
+  end;
+
+var
+  ProgressDelivery: TProgressDelivery;
+
+constructor TCheckDelivery.Create(OnComplete: TCheckCompletedCallback);
+begin
+  inherited Create;
+  FOnComplete := OnComplete;
+end;
+
+procedure TCheckDelivery.Deliver;
+begin
+  try
+    if TWinSparkle.FCheck = FCheck then
+      TWinSparkle.FCheck := nil;
+    win_sparkle_check_release(FCheck);
+    if Assigned(FOnComplete) then
+      FOnComplete(FInfo);
+  finally
+    Free;
+  end;
+end;
+
+constructor TProgressDelivery.Create;
+begin
+  inherited Create;
+  InitCriticalSection(FLock);
+end;
+
+destructor TProgressDelivery.Destroy;
+begin
+  TThread.RemoveQueuedEvents(@Deliver);
+  DoneCriticalSection(FLock);
+  inherited Destroy;
+end;
+
+procedure TProgressDelivery.Post(Downloaded, Total, BytesPerSecond: int64);
+var
+  NeedsQueue: boolean;
+begin
+  EnterCriticalSection(FLock);
+  try
+    FDownloaded := Downloaded;
+    FTotal := Total;
+    FBytesPerSecond := BytesPerSecond;
+    NeedsQueue := not FQueued;
+    FQueued := True;
+  finally
+    LeaveCriticalSection(FLock);
+  end;
+  if NeedsQueue then
+    TThread.Queue(nil, @Deliver);
+end;
+
+procedure TProgressDelivery.Deliver;
+var
+  Downloaded, Total, BytesPerSecond: int64;
+begin
+  EnterCriticalSection(FLock);
+  try
+    Downloaded := FDownloaded;
+    Total := FTotal;
+    BytesPerSecond := FBytesPerSecond;
+    FQueued := False;
+  finally
+    LeaveCriticalSection(FLock);
+  end;
+  if Assigned(TWinSparkle.FOnDownloadProgress) then
+    TWinSparkle.FOnDownloadProgress(Downloaded, Total, BytesPerSecond);
+end;
+
+procedure DoOnCheckCompleted(check: Pointer; result: PWinSparkleCheckResult;
+  user_data: Pointer); cdecl;
+var
+  Delivery: TCheckDelivery;
+begin
+  // the strings are only valid until the handle is released, copy them
+  Delivery := TCheckDelivery(user_data);
+  Delivery.FCheck := check;
+  with Delivery.FInfo do
+  begin
+    Status := ToCheckStatus(result^.status);
+    Version := result^.version;
+    ShortVersion := result^.short_version;
+    Title := result^.title;
+    Description := result^.description;
+    DownloadURL := result^.download_url;
+    DownloadSize := result^.download_size;
+    ReleaseNotesURL := result^.release_notes_url;
+    WebBrowserURL := result^.web_browser_url;
+  end;
+  TThread.Queue(nil, @Delivery.Deliver);
+end;
+
+procedure DoOnDownloadProgress(downloaded, total, bytes_per_second: PtrUInt;
+  user_data: Pointer); cdecl;
+begin
+  ProgressDelivery.Post(downloaded, total, bytes_per_second);
+end;
 
 procedure DoOnError; cdecl;
 begin
@@ -244,6 +469,7 @@ end;
 
 class procedure TWinSparkle.Cleanup;
 begin
+  win_sparkle_set_download_progress_callback(nil, nil, 0);
   win_sparkle_cleanup;
 end;
 
@@ -263,4 +489,71 @@ begin
   end;
 end;
 
+class function TWinSparkle.GetIsChecking: boolean; static;
+begin
+  Result := FCheck <> nil;
+end;
+
+class function TWinSparkle.CheckUpdatesAsync(OnComplete: TCheckCompletedCallback;
+  IgnoreSkippedVersion: boolean): boolean;
+var
+  Options: TWinSparkleCheckOptions;
+  Delivery: TCheckDelivery;
+begin
+  Result := False;
+  if FCheck <> nil then
+    Exit;
+  Options.size := SizeOf(Options);
+  Options.ignore_skipped_version := Ord(IgnoreSkippedVersion);
+  Delivery := TCheckDelivery.Create(OnComplete);
+  // the completion is always called on another thread and queued to this
+  // one, so it can't be delivered before FCheck is set
+  FCheck := win_sparkle_check_async(Options, @DoOnCheckCompleted, Delivery);
+  if FCheck = nil then
+    Delivery.Free
+  else
+    Result := True;
+end;
+
+class procedure TWinSparkle.CancelCheck;
+begin
+  if FCheck <> nil then
+    win_sparkle_check_cancel(FCheck);
+end;
+
+class procedure TWinSparkle.SetDownloadProgressCallback(
+  Callback: TDownloadProgressCallback; MinInterval: cint);
+begin
+  FOnDownloadProgress := Callback;
+  if Assigned(Callback) then
+    win_sparkle_set_download_progress_callback(@DoOnDownloadProgress, nil,
+      MinInterval)
+  else
+    win_sparkle_set_download_progress_callback(nil, nil, 0);
+end;
+
+class function TWinSparkle.GetCachedUpdateInfo(
+  out Info: TCachedUpdateInfo): TCheckStatus;
+var
+  RawInfo: TWinSparkleCachedUpdateInfo;
+begin
+  FillChar(RawInfo, SizeOf(RawInfo), 0);
+  RawInfo.size := SizeOf(RawInfo);
+  Result := ToCheckStatus(win_sparkle_get_cached_update_info(RawInfo));
+  if Result <> csUpdateAvailable then
+    Exit;
+  Info.Version := PChar(@RawInfo.version[0]);
+  Info.ShortVersion := PChar(@RawInfo.short_version[0]);
+  Info.Title := PChar(@RawInfo.title[0]);
+  Info.DownloadSize := RawInfo.download_size;
+  Info.DownloadState := TDownloadState(RawInfo.download_state);
+  Info.LastCheckTime := UnixToDateTime(RawInfo.last_check_time);
+end;
+
+initialization
+  ProgressDelivery := TProgressDelivery.Create;
+
+finalization
+  ProgressDelivery.Free;
+
 end.
@@ -0,0 +1,121 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "allocstats.h"
+
+#ifdef WIN_SPARKLE_ALLOC_STATS
+
+#include <windows.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Thread's current phase plus 1, or 0 if none, in a TLS slot. The index is
+// stored plus 1 too, so that allocations made before it's allocated, while
+// the DLL's globals are still being constructed, aren't counted.
+struct PhaseTls
+{
+    PhaseTls()
+    {
+        const DWORD tls = TlsAlloc();
+        index = (tls == TLS_OUT_OF_INDEXES) ? 0 : tls + 1;
+    }
+
+    ~PhaseTls()
+    {
+        if ( index )
+            TlsFree(index - 1);
+        index = 0;
+    }
+
+    DWORD index;
+} g_tlsPhase;
+
+volatile LONGLONG g_allocations[WIN_SPARKLE_STATS_ALLOC_PHASES];
+volatile LONGLONG g_allocatedBytes[WIN_SPARKLE_STATS_ALLOC_PHASES];
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                             AllocationStats
+ *--------------------------------------------------------------------------*/
+
+void AllocationStats::Count(size_t bytes)
+{
+    if ( !g_tlsPhase.index )
+        return;
+
+    // this must not allocate, nor change the thread's last error
+    const DWORD lastError = GetLastError();
+    const size_t phase = reinterpret_cast<size_t>(TlsGetValue(g_tlsPhase.index - 1));
+    SetLastError(lastError);
+
+    if ( phase == 0 || phase > WIN_SPARKLE_STATS_ALLOC_PHASES )
+        return;
+
+    InterlockedIncrement64(&g_allocations[phase - 1]);
+    InterlockedExchangeAdd64(&g_allocatedBytes[phase - 1], LONGLONG(bytes));
+}
+
+void AllocationStats::Get(win_sparkle_stats_t& stats)
+{
+    for ( int i = 0; i < WIN_SPARKLE_STATS_ALLOC_PHASES; i++ )
+    {
+        stats.allocations[i] = (unsigned long long)g_allocations[i];
+        stats.allocated_bytes[i] = (unsigned long long)g_allocatedBytes[i];
+    }
+}
+
+
+/*--------------------------------------------------------------------------*
+                             AllocationScope
+ *--------------------------------------------------------------------------*/
+
+AllocationScope::AllocationScope(int phase) : m_previous(NULL)
+{
+    if ( !g_tlsPhase.index )
+        return;
+
+    m_previous = TlsGetValue(g_tlsPhase.index - 1);
+    TlsSetValue(g_tlsPhase.index - 1, reinterpret_cast<void*>(size_t(phase + 1)));
+}
+
+AllocationScope::~AllocationScope()
+{
+    if ( g_tlsPhase.index )
+        TlsSetValue(g_tlsPhase.index - 1, m_previous);
+}
+
+} // namespace winsparkle
+
+#endif // WIN_SPARKLE_ALLOC_STATS
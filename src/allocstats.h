@@ -0,0 +1,98 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _allocstats_h_
+#define _allocstats_h_
+
+#include "winsparkle.h"
+
+#include <stddef.h>
+
+namespace winsparkle
+{
+
+/**
+    Counts WinSparkle's memory allocations by phase of its work, for
+    win_sparkle_stats_t::allocations.
+
+    This is only compiled in if WinSparkle is built with
+    WIN_SPARKLE_ALLOC_STATS defined. The build then replaces the global
+    operator new in WinSparkle.dll (see PrivateHeap), which doesn't affect
+    the application's own allocations; of the rest, only those made on a thread inside an
+    AllocationScope are counted. Without WIN_SPARKLE_ALLOC_STATS, all of
+    this compiles to nothing.
+ */
+class AllocationStats
+{
+public:
+    /**
+        Counts an allocation of @a bytes made without operator new, e.g.
+        by expat, in the current thread's phase, if any.
+     */
+    static void Count(size_t bytes)
+#ifdef WIN_SPARKLE_ALLOC_STATS
+        ;
+#else
+        {}
+#endif
+
+    /// Copies the counts to @a stats.
+    static void Get(win_sparkle_stats_t& stats)
+#ifdef WIN_SPARKLE_ALLOC_STATS
+        ;
+#else
+        {}
+#endif
+};
+
+
+/**
+    Attributes the current thread's allocations to a phase while it
+    exists, see AllocationStats.
+
+    Scopes can be nested, the innermost one's phase is used.
+ */
+class AllocationScope
+{
+public:
+#ifdef WIN_SPARKLE_ALLOC_STATS
+    /// @param phase  One of the WIN_SPARKLE_STATS_PHASE_xxx values.
+    explicit AllocationScope(int phase);
+    ~AllocationScope();
+
+private:
+    void *m_previous;
+#else
+    explicit AllocationScope(int /*phase*/) {}
+#endif
+
+private:
+    AllocationScope(const AllocationScope&);
+    AllocationScope& operator=(const AllocationScope&);
+};
+
+} // namespace winsparkle
+
+#endif // _allocstats_h_
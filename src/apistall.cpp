@@ -0,0 +1,222 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "apistall.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <new>
+#include <sstream>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                               ApiCallTimer
+ *--------------------------------------------------------------------------*/
+
+volatile LONG ApiCallTimer::ms_thresholdMs = 0;
+
+namespace
+{
+
+// ApiCallTimer::State of the current thread's API call, NULL if none
+struct ApiCallTls
+{
+    ApiCallTls() : index(TlsAlloc()) {}
+    ~ApiCallTls() { TlsFree(index); }
+    DWORD index;
+} g_tlsApiCall;
+
+// Converts a QueryPerformanceCounter() difference to microseconds.
+unsigned long long CounterToMicroseconds(LONGLONG ticks)
+{
+    static LARGE_INTEGER freq = { 0 };
+    if ( freq.QuadPart == 0 )
+        QueryPerformanceFrequency(&freq);
+    return static_cast<unsigned long long>(ticks) * 1000000 / freq.QuadPart;
+}
+
+} // anonymous namespace
+
+
+struct ApiCallTimer::State
+{
+    // Waits are aggregated by kind, only the first few distinct ones are
+    // kept and the rest counted as "elsewhere"; anything slow enough to be
+    // reported waits on one or two things, not many.
+    enum { MAX_STALLS = 8 };
+
+    struct Stall
+    {
+        const char *what;
+        const char *detail;
+        LONGLONG ticks;
+        unsigned count;
+    };
+
+    const char *function;
+    LARGE_INTEGER start;
+    Stall stalls[MAX_STALLS];
+    unsigned stallsCount;
+    bool inStall;
+
+    void AddStall(const char *what, const char *detail, LONGLONG ticks)
+    {
+        for ( unsigned i = 0; i < stallsCount; i++ )
+        {
+            Stall& s = stalls[i];
+            if ( s.what == what && s.detail == detail )
+            {
+                s.ticks += ticks;
+                s.count++;
+                return;
+            }
+        }
+
+        if ( stallsCount == MAX_STALLS )
+            return;
+
+        Stall& s = stalls[stallsCount++];
+        s.what = what;
+        s.detail = detail;
+        s.ticks = ticks;
+        s.count = 1;
+    }
+};
+
+
+void ApiCallTimer::SetThreshold(unsigned milliseconds)
+{
+    InterlockedExchange(&ms_thresholdMs, static_cast<LONG>(milliseconds));
+}
+
+
+void ApiCallTimer::Start(const char *function)
+{
+    if ( g_tlsApiCall.index == TLS_OUT_OF_INDEXES )
+        return;
+
+    // nested call, e.g. from a callback; it's a part of the outer one
+    if ( TlsGetValue(g_tlsApiCall.index) )
+        return;
+
+    // allocated so that the common disabled case doesn't grow the stack
+    // of every API function by the size of the breakdown
+    m_state = new(std::nothrow) State;
+    if ( !m_state )
+        return;
+
+    m_state->function = function;
+    m_state->stallsCount = 0;
+    m_state->inStall = false;
+    QueryPerformanceCounter(&m_state->start);
+
+    TlsSetValue(g_tlsApiCall.index, m_state);
+}
+
+
+void ApiCallTimer::Stop()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // reset first, so that logging below isn't attributed to the call
+    TlsSetValue(g_tlsApiCall.index, NULL);
+
+    const unsigned long long totalUs =
+        CounterToMicroseconds(now.QuadPart - m_state->start.QuadPart);
+    const unsigned long long thresholdUs =
+        static_cast<unsigned long long>(ms_thresholdMs) * 1000;
+
+    if ( thresholdUs && totalUs >= thresholdUs )
+    {
+        std::ostringstream breakdown;
+        unsigned long long stalledUs = 0;
+        for ( unsigned i = 0; i < m_state->stallsCount; i++ )
+        {
+            const State::Stall& s = m_state->stalls[i];
+            const unsigned long long us = CounterToMicroseconds(s.ticks);
+            stalledUs += us;
+
+            breakdown << us / 1000 << " ms " << s.what;
+            if ( s.detail )
+                breakdown << " (" << s.detail << ")";
+            if ( s.count > 1 )
+                breakdown << " " << s.count << " times";
+            breakdown << ", ";
+        }
+        breakdown << (totalUs - (stalledUs < totalUs ? stalledUs : totalUs)) / 1000
+                  << " ms elsewhere";
+
+        std::ostringstream msg;
+        msg << m_state->function << "() blocked the calling thread for "
+            << totalUs / 1000 << " ms: " << breakdown.str();
+        LogWarning(msg.str());
+
+        TraceEvent("ApiStall")
+            .Field("Function", m_state->function)
+            .Field("DurationUs", totalUs)
+            .Field("Breakdown", breakdown.str())
+            .Write();
+    }
+
+    delete m_state;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                StallScope
+ *--------------------------------------------------------------------------*/
+
+void StallScope::Enter(const char *what, const char *detail)
+{
+    if ( g_tlsApiCall.index == TLS_OUT_OF_INDEXES )
+        return;
+
+    ApiCallTimer::State *call =
+        static_cast<ApiCallTimer::State*>(TlsGetValue(g_tlsApiCall.index));
+    if ( !call || call->inStall )
+        return;
+
+    call->inStall = true;
+    m_call = call;
+    m_what = what;
+    m_detail = detail;
+    QueryPerformanceCounter(&m_start);
+}
+
+
+void StallScope::Leave()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    ApiCallTimer::State *call = static_cast<ApiCallTimer::State*>(m_call);
+    call->AddStall(m_what, m_detail, now.QuadPart - m_start.QuadPart);
+    call->inStall = false;
+}
+
+} // namespace winsparkle
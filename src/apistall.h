@@ -0,0 +1,130 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _apistall_h_
+#define _apistall_h_
+
+#include <windows.h>
+
+namespace winsparkle
+{
+
+/**
+    Measures how long a public API function blocks the calling thread,
+    see win_sparkle_set_api_stall_threshold().
+
+    Put one at the top of every WIN_SPARKLE_API function. If the call takes
+    longer than the threshold, a warning is logged and an "ApiStall" trace
+    event written, breaking the time down by the StallScope waits it
+    spent. Only the outermost call on a thread is measured, calls made
+    from callbacks invoked by it count as a part of it.
+
+    When the threshold isn't set, this costs one memory read.
+ */
+class ApiCallTimer
+{
+public:
+    /// @param function  Name of the function, usually __FUNCTION__.
+    explicit ApiCallTimer(const char *function)
+        : m_state(NULL)
+    {
+        if ( IsEnabled() )
+            Start(function);
+    }
+
+    ~ApiCallTimer()
+    {
+        if ( m_state )
+            Stop();
+    }
+
+    /// Sets the threshold in milliseconds, 0 to disable measuring.
+    static void SetThreshold(unsigned milliseconds);
+
+    /// Returns true if API calls are measured.
+    static bool IsEnabled() { return ms_thresholdMs != 0; }
+
+private:
+    void Start(const char *function);
+    void Stop();
+
+    struct State;
+    State *m_state;
+
+    friend class StallScope;
+
+    static volatile LONG ms_thresholdMs;
+
+    ApiCallTimer(const ApiCallTimer&);
+    ApiCallTimer& operator=(const ApiCallTimer&);
+};
+
+
+/**
+    Attributes the time spent while it exists to a blocking wait of the
+    current thread's API call, see ApiCallTimer.
+
+    Does nothing if the thread isn't inside a measured API call. Scopes
+    can be nested, only the outermost one is counted.
+ */
+class StallScope
+{
+public:
+    /**
+        @param what    Description of the wait, e.g. "waiting for a lock".
+                       Must be a string literal or otherwise outlive the
+                       API call.
+        @param detail  Optional name of what is waited for, e.g. of the
+                       thread, with the same lifetime requirement.
+     */
+    explicit StallScope(const char *what, const char *detail = NULL)
+        : m_call(NULL)
+    {
+        if ( ApiCallTimer::IsEnabled() )
+            Enter(what, detail);
+    }
+
+    ~StallScope()
+    {
+        if ( m_call )
+            Leave();
+    }
+
+private:
+    void Enter(const char *what, const char *detail);
+    void Leave();
+
+    void *m_call;
+    const char *m_what;
+    const char *m_detail;
+    LARGE_INTEGER m_start;
+
+    StallScope(const StallScope&);
+    StallScope& operator=(const StallScope&);
+};
+
+} // namespace winsparkle
+
+#endif // _apistall_h_
@@ -24,11 +24,22 @@
  */
 
 #include "appcast.h"
+#include "allocstats.h"
+#include "binaryappcast.h"
 #include "error.h"
+#include "jsonreader.h"
+#include "privateheap.h"
+#include "utils.h"
+#include "versionkey.h"
 
 #include <expat.h>
 #include <vector>
 #include <algorithm>
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <windows.h>
 
 namespace winsparkle
@@ -56,206 +67,855 @@ namespace
 #define NODE_LINK       "link"
 #define NODE_ENCLOSURE  "enclosure"
 #define NODE_MIN_OS_VERSION NS_SPARKLE_NAME("minimumSystemVersion")
+#define NODE_DELTAS     NS_SPARKLE_NAME("deltas")
+#define NODE_CHECK_INTERVAL NS_SPARKLE_NAME("checkInterval")
+#define NODE_MIRROR     NS_SPARKLE_NAME("mirror")
+#define NODE_PUBDATE    "pubDate"
+#define NODE_PHASED_ROLLOUT NS_SPARKLE_NAME("phasedRolloutInterval")
+#define NODE_UPDATE_CHANNEL NS_SPARKLE_NAME("channel")
+#define NODE_CRITICAL_UPDATE NS_SPARKLE_NAME("criticalUpdate")
+#define NODE_COMPONENT  NS_SPARKLE_NAME("component")
 #define ATTR_URL        "url"
 #define ATTR_VERSION    NS_SPARKLE_NAME("version")
 #define ATTR_SHORTVERSION NS_SPARKLE_NAME("shortVersionString")
 #define ATTR_DSASIGNATURE NS_SPARKLE_NAME("dsaSignature")
+#define ATTR_EDSIGNATURE NS_SPARKLE_NAME("edSignature")
+#define ATTR_EDCHUNKEDSIG NS_SPARKLE_NAME("edChunkedSignature")
+#define ATTR_CHUNKMANIFEST NS_SPARKLE_NAME("chunkManifest")
 #define ATTR_OS         NS_SPARKLE_NAME("os")
 #define ATTR_ARGUMENTS  NS_SPARKLE_NAME("installerArguments")
+#define ATTR_ELEVATION  NS_SPARKLE_NAME("installerRequiresElevation")
+#define ATTR_DELTAFROM  NS_SPARKLE_NAME("deltaFrom")
+#define ATTR_LENGTH     "length"
+#define ATTR_SHA256     NS_SPARKLE_NAME("sha256")
+#define ATTR_ENCODING   NS_SPARKLE_NAME("encoding")
+#define ATTR_PRIORITY   NS_SPARKLE_NAME("priority")
 #define NODE_VERSION      ATTR_VERSION        // These can be nodes or
 #define NODE_SHORTVERSION ATTR_SHORTVERSION   // attributes.
 #define NODE_DSASIGNATURE ATTR_DSASIGNATURE
 #define OS_MARKER       "windows"
 #define OS_MARKER_LEN   7
 
-// context data for the parser
-struct ContextData
+// Appcast members corresponding to AppcastChannel::Field values
+std::string Appcast::* const ITEM_FIELDS[AppcastChannel::Field_Max] =
 {
-    ContextData(XML_Parser& p)
-        : parser(p),
-        in_channel(0), in_item(0), in_relnotes(0), in_title(0), in_description(0), in_link(0),
-        in_version(0), in_shortversion(0), in_dsasignature(0), in_min_os_version(0)
-    {}
+    &Appcast::Version,
+    &Appcast::ShortVersionString,
+    &Appcast::DownloadURL,
+    &Appcast::MirrorURLs,
+    &Appcast::Components,
+    &Appcast::DsaSignature,
+    &Appcast::EdDSASignature,
+    &Appcast::EdDSAChunkedSignature,
+    &Appcast::ReleaseNotesURL,
+    &Appcast::WebBrowserURL,
+    &Appcast::Title,
+    &Appcast::Description,
+    &Appcast::Os,
+    &Appcast::MinOSVersion,
+    &Appcast::InstallerArguments,
+    &Appcast::InstallerRequiresElevation,
+    &Appcast::Length,
+    &Appcast::Sha256,
+    &Appcast::Encoding,
+    &Appcast::PubDate,
+    &Appcast::PhasedRolloutInterval,
+    &Appcast::Channel,
+    &Appcast::CriticalUpdate,
+    &Appcast::DeltaFrom,
+    &Appcast::DeltaURL,
+    &Appcast::DeltaDsaSignature,
+    &Appcast::DeltaEdDSASignature,
+    &Appcast::ChunkManifestURL,
+    &Appcast::DeltaChain,
+};
 
-    // the parser we're using
-    XML_Parser& parser;
+// Kinds of elements and attributes the parser is interested in.
+enum NameKind
+{
+    Name_Unknown,
+    Name_Channel,
+    Name_Item,
+    Name_Enclosure,
+    Name_Deltas,
+    Name_DeltaFrom,
+    Name_CheckInterval,
+    Name_Mirror,
+    Name_CriticalUpdate,
+    Name_Component,
+    Name_Field      // element or attribute whose value is an item's field
+};
 
-    // is inside <channel>, <item> or <sparkle:releaseNotesLink>, <title>, <description>, or <link> respectively?
-    int in_channel, in_item, in_relnotes, in_title, in_description, in_link;
+struct NameInfo
+{
+    const char *name;
+    NameKind kind;
+    AppcastChannel::Field field;
+};
 
-    // is inside <sparkle:version> or <sparkle:shortVersionString> node?
-    int in_version, in_shortversion, in_dsasignature, in_min_os_version;
+const NameInfo ELEMENT_NAMES[] =
+{
+    { NODE_CHANNEL,        Name_Channel,   AppcastChannel::Field_Max },
+    { NODE_ITEM,           Name_Item,      AppcastChannel::Field_Max },
+    { NODE_ENCLOSURE,      Name_Enclosure, AppcastChannel::Field_Max },
+    { NODE_DELTAS,         Name_Deltas,    AppcastChannel::Field_Max },
+    { NODE_CHECK_INTERVAL, Name_CheckInterval, AppcastChannel::Field_Max },
+    { NODE_MIRROR,         Name_Mirror,    AppcastChannel::Field_MirrorURLs },
+    { NODE_RELNOTES,       Name_Field,     AppcastChannel::Field_ReleaseNotesURL },
+    { NODE_TITLE,          Name_Field,     AppcastChannel::Field_Title },
+    { NODE_DESCRIPTION,    Name_Field,     AppcastChannel::Field_Description },
+    { NODE_LINK,           Name_Field,     AppcastChannel::Field_WebBrowserURL },
+    { NODE_VERSION,        Name_Field,     AppcastChannel::Field_Version },
+    { NODE_SHORTVERSION,   Name_Field,     AppcastChannel::Field_ShortVersionString },
+    { NODE_DSASIGNATURE,   Name_Field,     AppcastChannel::Field_DsaSignature },
+    { NODE_MIN_OS_VERSION, Name_Field,     AppcastChannel::Field_MinOSVersion },
+    { NODE_PUBDATE,        Name_Field,     AppcastChannel::Field_PubDate },
+    { NODE_PHASED_ROLLOUT, Name_Field,     AppcastChannel::Field_PhasedRolloutInterval },
+    { NODE_UPDATE_CHANNEL, Name_Field,     AppcastChannel::Field_Channel },
+    { NODE_CRITICAL_UPDATE, Name_CriticalUpdate, AppcastChannel::Field_CriticalUpdate },
+    { NODE_COMPONENT,      Name_Component, AppcastChannel::Field_Components },
+};
 
-    // parsed <item>s
-    std::vector<Appcast> items;
+// attributes of <enclosure>
+const NameInfo ENCLOSURE_ATTR_NAMES[] =
+{
+    { ATTR_URL,            Name_Field,     AppcastChannel::Field_DownloadURL },
+    { ATTR_VERSION,        Name_Field,     AppcastChannel::Field_Version },
+    { ATTR_SHORTVERSION,   Name_Field,     AppcastChannel::Field_ShortVersionString },
+    { ATTR_DSASIGNATURE,   Name_Field,     AppcastChannel::Field_DsaSignature },
+    { ATTR_EDSIGNATURE,    Name_Field,     AppcastChannel::Field_EdDSASignature },
+    { ATTR_EDCHUNKEDSIG,   Name_Field,     AppcastChannel::Field_EdDSAChunkedSignature },
+    { ATTR_CHUNKMANIFEST,  Name_Field,     AppcastChannel::Field_ChunkManifestURL },
+    { ATTR_OS,             Name_Field,     AppcastChannel::Field_Os },
+    { ATTR_ARGUMENTS,      Name_Field,     AppcastChannel::Field_InstallerArguments },
+    { ATTR_ELEVATION,      Name_Field,     AppcastChannel::Field_InstallerRequiresElevation },
+    { ATTR_LENGTH,         Name_Field,     AppcastChannel::Field_Length },
+    { ATTR_SHA256,         Name_Field,     AppcastChannel::Field_Sha256 },
+    { ATTR_ENCODING,       Name_Field,     AppcastChannel::Field_Encoding },
+    { ATTR_DELTAFROM,      Name_DeltaFrom, AppcastChannel::Field_DeltaFrom },
 };
 
-bool is_windows_version_acceptable(const Appcast &item)
+// fields of a delta update, taken from the fields of its <enclosure>
+AppcastChannel::Field GetDeltaField(AppcastChannel::Field field)
 {
-    if (item.MinOSVersion.empty())
-        return true;
+    switch ( field )
+    {
+        case AppcastChannel::Field_DownloadURL:
+            return AppcastChannel::Field_DeltaURL;
+        case AppcastChannel::Field_DsaSignature:
+            return AppcastChannel::Field_DeltaDsaSignature;
+        case AppcastChannel::Field_EdDSASignature:
+            return AppcastChannel::Field_DeltaEdDSASignature;
+        default:
+            return AppcastChannel::Field_Max; // not used for deltas
+    }
+}
 
-    OSVERSIONINFOEXW osvi = { sizeof(osvi), 0, 0, 0, 0, { 0 }, 0, 0 };
-    DWORDLONG const dwlConditionMask = VerSetConditionMask(
-        VerSetConditionMask(
-        VerSetConditionMask(
-        0, VER_MAJORVERSION, VER_GREATER_EQUAL),
-        VER_MINORVERSION, VER_GREATER_EQUAL),
-        VER_SERVICEPACKMAJOR, VER_GREATER_EQUAL);
+/*
+    Hash table for looking up element and attribute names.
 
-    sscanf(item.MinOSVersion.c_str(), "%lu.%lu.%hu", &osvi.dwMajorVersion,
-        &osvi.dwMinorVersion, &osvi.wServicePackMajor);
+    Every name in the feed is looked up, so instead of comparing it with all
+    known names in turn, it is hashed and compared with the one known name
+    in its slot, if any. The table is filled once, during static
+    initialization, and is never modified afterwards.
+ */
+class NameTable
+{
+public:
+    template<size_t N>
+    NameTable(const NameInfo (&names)[N])
+    {
+        for ( size_t i = 0; i < SIZE; i++ )
+            m_slots[i] = NULL;
 
-    return VerifyVersionInfoW(&osvi, VER_MAJORVERSION | VER_MINORVERSION |
-        VER_SERVICEPACKMAJOR, dwlConditionMask) != FALSE;
-}
+        for ( size_t i = 0; i < N; i++ )
+        {
+            size_t slot = Hash(names[i].name) & (SIZE - 1);
+            while ( m_slots[slot] )
+                slot = (slot + 1) & (SIZE - 1);
+            m_slots[slot] = &names[i];
+        }
+    }
 
-void XMLCALL OnStartElement(void *data, const char *name, const char **attrs)
+    // returns NULL if the name isn't known
+    const NameInfo *Find(const char *name) const
+    {
+        for ( size_t slot = Hash(name) & (SIZE - 1); m_slots[slot]; slot = (slot + 1) & (SIZE - 1) )
+        {
+            if ( strcmp(m_slots[slot]->name, name) == 0 )
+                return m_slots[slot];
+        }
+        return NULL;
+    }
+
+    NameKind FindKind(const char *name) const
+    {
+        const NameInfo *info = Find(name);
+        return info ? info->kind : Name_Unknown;
+    }
+
+private:
+    // FNV-1a
+    static unsigned Hash(const char *s)
+    {
+        unsigned h = 2166136261U;
+        for ( ; *s; s++ )
+        {
+            h ^= static_cast<unsigned char>(*s);
+            h *= 16777619U;
+        }
+        return h;
+    }
+
+    // power of two, much larger than the number of names to keep chains short
+    static const size_t SIZE = 64;
+    const NameInfo *m_slots[SIZE];
+};
+
+const NameTable ELEMENTS(ELEMENT_NAMES);
+const NameTable ENCLOSURE_ATTRS(ENCLOSURE_ATTR_NAMES);
+
+// Longest text of an element that is accepted, except <description>, which
+// may contain the release notes:
+const size_t MAX_FIELD_SIZE = 64 * 1024;
+const size_t MAX_DESCRIPTION_SIZE = 1024 * 1024;
+
+// Most memory the XML parser may use for one feed:
+const size_t MAX_PARSER_MEMORY = 16 * 1024 * 1024;
+
+/**
+    Memory used by the XML parser for parsing one feed.
+
+    The parser's allocations are served from large blocks, which are all
+    freed at once with the arena. This is cheaper than the heap for its many
+    small allocations, and the total is limited, so that a malicious feed
+    can't exhaust the host app's memory: the parser fails with an error
+    instead. The blocks come from the scratch heap, see PrivateHeap.
+
+    Expat's memory functions don't take any context, so the arena used is
+    the current thread's, see ParseArena::Use.
+ */
+class ParseArena
 {
-    ContextData& ctxt = *static_cast<ContextData*>(data);
+public:
+    ParseArena() : m_start(NULL), m_next(NULL), m_end(NULL), m_total(0) {}
 
-    if ( strcmp(name, NODE_CHANNEL) == 0 )
+    ~ParseArena()
     {
-        ctxt.in_channel++;
+        for ( size_t i = 0; i < m_blocks.size(); i++ )
+            PrivateHeap::FreeScratch(m_blocks[i]);
     }
-    else if ( ctxt.in_channel && strcmp(name, NODE_ITEM) == 0 )
+
+    /// Makes the arena the current thread's for its lifetime, as RIIA.
+    class Use
     {
-        ctxt.in_item++;
-        Appcast item;
-        ctxt.items.push_back(item);
+    public:
+        Use(ParseArena& arena) : m_previous(TlsGetValue(ms_tls.index))
+        {
+            TlsSetValue(ms_tls.index, &arena);
+        }
+        ~Use() { TlsSetValue(ms_tls.index, m_previous); }
+
+    private:
+        void *m_previous;
+    };
+
+    static const XML_Memory_Handling_Suite MEMORY_SUITE;
+
+private:
+    // Each allocation is preceded by its size, keeping the data aligned.
+    union Header
+    {
+        size_t size;
+        double align1;
+        void *align2;
+    };
+
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    static ParseArena& Current()
+    {
+        return *static_cast<ParseArena*>(TlsGetValue(ms_tls.index));
     }
-    else if ( ctxt.in_item )
+
+    static Header *GetHeader(void *ptr) { return static_cast<Header*>(ptr) - 1; }
+
+    static size_t RoundUp(size_t size)
+    {
+        return (size + sizeof(Header) - 1) / sizeof(Header) * sizeof(Header);
+    }
+
+    // is ptr the last allocation made from the current block?
+    bool IsLast(void *ptr) const
+    {
+        char *mem = static_cast<char*>(ptr);
+        return mem > m_start && mem <= m_end && mem + RoundUp(GetHeader(ptr)->size) == m_next;
+    }
+
+    void *Alloc(size_t size)
     {
-        if ( strcmp(name, NODE_RELNOTES) == 0 )
+        const size_t needed = sizeof(Header) + RoundUp(size);
+        if ( needed < size || m_total + needed > MAX_PARSER_MEMORY )
+            return NULL;
+
+        char *mem;
+        if ( needed <= size_t(m_end - m_next) )
         {
-            ctxt.in_relnotes++;
+            mem = m_next;
+            m_next += needed;
         }
-        else if ( strcmp(name, NODE_TITLE) == 0 )
+        else
         {
-            ctxt.in_title++;
+            // large allocations get a block of their own, so that the
+            // rest of the current block isn't wasted
+            const bool own = needed > BLOCK_SIZE / 4;
+            mem = static_cast<char*>(PrivateHeap::AllocScratch(own ? needed : BLOCK_SIZE));
+            if ( !mem )
+                return NULL;
+            m_blocks.push_back(mem);
+            if ( !own )
+            {
+                m_start = mem;
+                m_next = mem + needed;
+                m_end = mem + BLOCK_SIZE;
+            }
         }
-        else if ( strcmp(name, NODE_DESCRIPTION) == 0 )
+
+        m_total += needed;
+        Header *header = reinterpret_cast<Header*>(mem);
+        header->size = size;
+        return header + 1;
+    }
+
+    void *Realloc(void *ptr, size_t size)
+    {
+        if ( !ptr )
+            return Alloc(size);
+
+        Header *header = GetHeader(ptr);
+        const size_t oldSize = RoundUp(header->size);
+        const size_t newSize = RoundUp(size);
+        if ( newSize < size )
+            return NULL;
+
+        if ( newSize <= oldSize )
         {
-            ctxt.in_description++;
+            // shrinking never moves the data
+            if ( IsLast(ptr) )
+            {
+                m_next -= oldSize - newSize;
+                m_total -= oldSize - newSize;
+                header->size = size;
+            }
+            return ptr;
         }
-        else if ( strcmp(name, NODE_LINK) == 0 )
+
+        // the parser's buffers usually grow while nothing else is allocated
+        if ( IsLast(ptr) && newSize - oldSize <= size_t(m_end - m_next) &&
+             m_total + newSize - oldSize <= MAX_PARSER_MEMORY )
         {
-            ctxt.in_link++;
+            m_next += newSize - oldSize;
+            m_total += newSize - oldSize;
+            header->size = size;
+            return ptr;
         }
-        else if ( strcmp(name, NODE_VERSION) == 0 )
+
+        void *mem = Alloc(size);
+        if ( !mem )
+            return NULL;
+        memcpy(mem, ptr, (std::min)(size, header->size));
+        Free(ptr);
+        return mem;
+    }
+
+    void Free(void *ptr)
+    {
+        // memory is only reclaimed if it's at the end, otherwise with the arena
+        if ( ptr && IsLast(ptr) )
         {
-            ctxt.in_version++;
+            const size_t size = sizeof(Header) + RoundUp(GetHeader(ptr)->size);
+            m_next -= size;
+            m_total -= size;
         }
-        else if ( strcmp(name, NODE_SHORTVERSION) == 0 )
+    }
+
+    static void *MallocFunc(size_t size)
+    {
+        AllocationStats::Count(size);
+        return Current().Alloc(size);
+    }
+
+    static void *ReallocFunc(void *ptr, size_t size)
+    {
+        AllocationStats::Count(size);
+        return Current().Realloc(ptr, size);
+    }
+
+    static void FreeFunc(void *ptr) { Current().Free(ptr); }
+
+    struct TlsIndex
+    {
+        TlsIndex() : index(TlsAlloc()) {}
+        ~TlsIndex() { TlsFree(index); }
+        DWORD index;
+    };
+    static TlsIndex ms_tls;
+
+    std::vector<char*> m_blocks;
+    // the current block, with the free space from m_next
+    char *m_start, *m_next, *m_end;
+    size_t m_total;
+};
+
+ParseArena::TlsIndex ParseArena::ms_tls;
+
+const XML_Memory_Handling_Suite ParseArena::MEMORY_SUITE =
+{
+    &ParseArena::MallocFunc,
+    &ParseArena::ReallocFunc,
+    &ParseArena::FreeFunc
+};
+
+
+// Longest chain of delta updates that is used, see Appcast::GetDeltaChain().
+// Beyond that, the full update is usually smaller.
+const size_t MAX_DELTA_CHAIN = 8;
+
+// Most delta updates of older items that are considered for the chain.
+const size_t MAX_DELTA_CANDIDATES = 64;
+
+/*
+    Collects the delta updates of the items, to find a chain of them from
+    the installed version when the update has no direct delta, see
+    Appcast::GetDeltaChain(). Used by both the RSS and JSON parsers.
+
+    The items that are needed for a chain follow the update in the feed, so
+    that a parser that stops at the first suitable item has to continue
+    until the installed version's item, see EndItem().
+ */
+class DeltaChainFinder
+{
+public:
+    DeltaChainFinder(const std::string& installed)
+        : m_installed(installed), m_itemStart(0), m_pending(false), m_itemsAfterUpdate(0)
+    {}
+
+    // Adds a delta update of the item being parsed.
+    void AddDelta(const std::string& from, const std::string& url,
+                  const std::string& edSignature, const std::string& dsaSignature)
+    {
+        if ( m_installed.empty() || from.empty() || url.empty() )
+            return;
+        if ( m_deltas.size() >= MAX_DELTA_CANDIDATES )
+            return;
+
+        AppcastDelta delta;
+        delta.From = from;
+        delta.URL = url;
+        delta.EdDSASignature = edSignature;
+        delta.DsaSignature = dsaSignature;
+        m_deltas.push_back(delta);
+    }
+
+    // Called after the item was added to @a channel. Returns true if no
+    // more items are needed, i.e. if a parser that stops at the first
+    // suitable item can stop now.
+    bool EndItem(const AppcastChannel& channel, const Appcast& item)
+    {
+        const bool suitable = channel.IsSuitable(channel.GetItemCount() - 1);
+        const bool hasDeltas = m_deltas.size() > m_itemStart;
+
+        // deltas of items for other systems make different files
+        if ( suitable && !item.Version.empty() )
         {
-            ctxt.in_shortversion++;
+            for ( size_t i = m_itemStart; i < m_deltas.size(); i++ )
+                m_deltas[i].To = item.Version;
         }
-        else if (strcmp(name, NODE_DSASIGNATURE) == 0)
+        else
         {
-            ctxt.in_dsasignature++;
+            m_deltas.resize(m_itemStart);
         }
-        else if (strcmp(name, NODE_MIN_OS_VERSION) == 0)
+        m_itemStart = m_deltas.size();
+
+        if ( !suitable )
+            return false;
+
+        if ( !m_pending )
         {
-            ctxt.in_min_os_version++;
+            // The update itself. A chain must end with one of its deltas,
+            // the direct one is used if there's one.
+            if ( m_installed.empty() || item.Version == m_installed || item.HasDelta() || !hasDeltas )
+                return true;
+            m_pending = true;
+            return false;
         }
-        else if (strcmp(name, NODE_ENCLOSURE) == 0)
+
+        return item.Version == m_installed || ++m_itemsAfterUpdate >= MAX_DELTA_CHAIN;
+    }
+
+    // Sets @a update's delta chain, if it needs one and there's any.
+    void SetChain(Appcast& update) const
+    {
+        if ( !update.IsValid() || update.HasDelta() || m_installed.empty() )
+            return;
+
+        // Breadth-first search from the installed version gives the
+        // shortest chain. parent[i] is the delta applied before m_deltas[i]
+        // or -1 if it's the first one, -2 if m_deltas[i] wasn't reached.
+        std::vector<int> parent(m_deltas.size(), -2);
+        std::vector<int> queue;
+        for ( size_t i = 0; i < m_deltas.size(); i++ )
         {
-            const size_t size = ctxt.items.size();
-            for ( int i = 0; attrs[i]; i += 2 )
+            if ( m_deltas[i].From == m_installed && !m_deltas[i].To.empty() )
             {
-                const char *name = attrs[i];
-                const char *value = attrs[i+1];
-
-                if ( strcmp(name, ATTR_URL) == 0 )
-                    ctxt.items[size-1].DownloadURL = value;
-                else if ( strcmp(name, ATTR_VERSION) == 0 )
-                    ctxt.items[size-1].Version = value;
-                else if ( strcmp(name, ATTR_SHORTVERSION) == 0 )
-                    ctxt.items[size-1].ShortVersionString = value;
-                else if ( strcmp(name, ATTR_DSASIGNATURE) == 0 )
-                    ctxt.items[size-1].DsaSignature = value;
-                else if ( strcmp(name, ATTR_OS) == 0 )
-                    ctxt.items[size-1].Os = value;
-                else if ( strcmp(name, ATTR_ARGUMENTS) == 0 )
-                    ctxt.items[size-1].InstallerArguments = value;
+                parent[i] = -1;
+                queue.push_back(int(i));
+            }
+        }
+
+        for ( size_t q = 0; q < queue.size(); q++ )
+        {
+            const AppcastDelta& delta = m_deltas[queue[q]];
+            if ( delta.To == update.Version )
+            {
+                std::vector<AppcastDelta> chain;
+                for ( int i = queue[q]; i >= 0; i = parent[i] )
+                    chain.insert(chain.begin(), m_deltas[i]);
+                if ( chain.size() <= MAX_DELTA_CHAIN )
+                    update.SetDeltaChain(chain);
+                return;
+            }
+
+            for ( size_t i = 0; i < m_deltas.size(); i++ )
+            {
+                if ( parent[i] == -2 && m_deltas[i].From == delta.To && m_deltas[i].To != m_installed )
+                {
+                    parent[i] = queue[q];
+                    queue.push_back(int(i));
+                }
             }
         }
     }
-}
 
+private:
+    std::string m_installed;
+    std::vector<AppcastDelta> m_deltas;
+    // index of the first delta of the item being parsed
+    size_t m_itemStart;
+    // is the update found, but without a direct delta?
+    bool m_pending;
+    size_t m_itemsAfterUpdate;
+};
 
-/**
- * Returns true if item os is exactly "windows"
- *   or if item is "windows-x64" on 64bit
- *   or if item is "windows-x86" on 32bit
- *   and is above minimum version
- */
-bool is_suitable_windows_item(const Appcast &item)
+
+// context data for the parser
+struct ContextData
 {
-    if (!is_windows_version_acceptable(item))
-        return false;
+    ContextData(XML_Parser& p, AppcastChannel& c, bool all, const std::string& installed)
+        : parser(p), channel(c), all_items(all), installed_version(installed),
+        deltas(installed), in_channel(0), in_item(0), in_deltas(0), text(NULL)
+    {}
 
-    if (item.Os == OS_MARKER)
-        return true;
+    // the parser we're using
+    XML_Parser& parser;
 
-    if (item.Os.compare(0, OS_MARKER_LEN, OS_MARKER) != 0)
-        return false;
+    // where the parsed <item>s go and whether to parse all of them
+    AppcastChannel& channel;
+    bool all_items;
+
+    // only delta updates from this version are of any use
+    std::string installed_version;
+
+    // delta updates of all items, for chains of them
+    DeltaChainFinder deltas;
+
+    // is inside <channel>, <item> or <sparkle:deltas> respectively?
+    int in_channel, in_item, in_deltas;
+
+    // the <item> being parsed
+    Appcast item;
+
+    // text of <sparkle:checkInterval>
+    std::string check_interval;
+
+    // field of the item that the current element's text goes to, if any,
+    // and the fields of the elements it is nested in
+    std::string *text;
+    std::vector<std::string*> text_stack;
+
+    // why the parsing was aborted by the handlers, if it was
+    std::string error;
+};
+
+// Windows version, as MAJOR.MINOR.SERVICEPACK, in a form that can be compared
+// as a single integer.
+typedef unsigned long long OSVersion;
+
+OSVersion MakeOSVersion(DWORD major, DWORD minor, WORD servicePack)
+{
+    return (OSVersion(major) << 32) | (OSVersion(minor & 0xFFFF) << 16) | servicePack;
+}
+
+#ifndef IMAGE_FILE_MACHINE_ARM64
+    #define IMAGE_FILE_MACHINE_ARM64 0xAA64
+#endif
+
+// IsWow64Process2() is only available since Windows 10 1709
+typedef BOOL WINAPI IsWow64Process2_t(HANDLE, USHORT*, USHORT*);
+
+// The system this code runs on, detected once per process.
+struct HostPlatform
+{
+    HostPlatform()
+    {
+        // GetVersionEx() reports the same (possibly compatibility-shimmed)
+        // version that VerifyVersionInfo() compares against.
+        OSVERSIONINFOEXW osvi = { sizeof(osvi), 0, 0, 0, 0, { 0 }, 0, 0 };
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable:4996) // GetVersionExW is deprecated
+#endif
+        if ( GetVersionExW(reinterpret_cast<OSVERSIONINFOW*>(&osvi)) )
+            version = MakeOSVersion(osvi.dwMajorVersion, osvi.dwMinorVersion, osvi.wServicePackMajor);
+        else
+            version = ~OSVersion(0); // don't refuse updates because of this
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
 
-    // Check suffix for matching bitness
 #ifdef _WIN64
-    return item.Os.compare(OS_MARKER_LEN, std::string::npos, "-x64") == 0;
+        is64bit = true;
+#else
+        is64bit = false;
+#endif
+
+#if defined(_M_ARM64) || defined(_M_ARM64EC)
+        isARM64 = true;
 #else
-    return item.Os.compare(OS_MARKER_LEN, std::string::npos, "-x86") == 0;
+        // x86 and x64 code runs emulated on ARM64 Windows, where
+        // IsWow64Process() doesn't tell anything about the native system
+        isARM64 = false;
+        auto f_IsWow64Process2 = LoadDynamicFunc<IsWow64Process2_t>("IsWow64Process2", "kernel32");
+        USHORT processMachine, nativeMachine;
+        if ( f_IsWow64Process2 &&
+             f_IsWow64Process2(GetCurrentProcess(), &processMachine, &nativeMachine) )
+        {
+            isARM64 = nativeMachine == IMAGE_FILE_MACHINE_ARM64;
+        }
 #endif
+    }
+
+    OSVersion version;
+
+    // bitness of this module (not of the OS)
+    bool is64bit;
+
+    // is the OS native ARM64 Windows, regardless of this module's architecture?
+    bool isARM64;
+};
+
+const HostPlatform HOST_PLATFORM;
+
+bool is_windows_version_acceptable(const Appcast &item)
+{
+    if (item.MinOSVersion.empty())
+        return true;
+
+    unsigned long major = 0, minor = 0;
+    unsigned short servicePack = 0;
+    sscanf(item.MinOSVersion.c_str(), "%lu.%lu.%hu", &major, &minor, &servicePack);
+
+    return HOST_PLATFORM.version >= MakeOSVersion(major, minor, servicePack);
 }
 
+// Reads the delta update's <enclosure> if it applies to the installed version.
+// Others are kept for chains of delta updates.
+void ParseDeltaEnclosure(ContextData& ctxt, const char **attrs)
+{
+    const char *from = "";
+    const char *values[AppcastChannel::Field_Max] = { 0 };
+    for ( int i = 0; attrs[i]; i += 2 )
+    {
+        const NameInfo *attr = ENCLOSURE_ATTRS.Find(attrs[i]);
+        if ( attr && attr->kind == Name_DeltaFrom )
+            from = attrs[i+1];
+        else if ( attr && attr->kind == Name_Field )
+            values[attr->field] = attrs[i+1];
+    }
 
-void XMLCALL OnEndElement(void *data, const char *name)
+    const bool applies = !ctxt.installed_version.empty() && ctxt.installed_version == from;
+    if ( !applies )
+    {
+        ctxt.deltas.AddDelta(from,
+                             values[AppcastChannel::Field_DownloadURL] ? values[AppcastChannel::Field_DownloadURL] : "",
+                             values[AppcastChannel::Field_EdDSASignature] ? values[AppcastChannel::Field_EdDSASignature] : "",
+                             values[AppcastChannel::Field_DsaSignature] ? values[AppcastChannel::Field_DsaSignature] : "");
+        return;
+    }
+
+    ctxt.item.DeltaFrom = ctxt.installed_version;
+    for ( int i = 0; attrs[i]; i += 2 )
+    {
+        const NameInfo *attr = ENCLOSURE_ATTRS.Find(attrs[i]);
+        if ( !attr || attr->kind != Name_Field )
+            continue;
+        const AppcastChannel::Field field = GetDeltaField(attr->field);
+        if ( field != AppcastChannel::Field_Max )
+            ctxt.item.*ITEM_FIELDS[field] = attrs[i+1];
+    }
+}
+
+
+// Attributes of <sparkle:component>, in the order they are stored in
+// Appcast::Components.
+const char *const COMPONENT_ATTRS[] =
 {
-    ContextData& ctxt = *static_cast<ContextData*>(data);
+    ATTR_URL,
+    ATTR_LENGTH,
+    ATTR_SHA256,
+    ATTR_EDSIGNATURE,
+    ATTR_DSASIGNATURE,
+    ATTR_PRIORITY
+};
+
+const size_t COMPONENT_ATTRS_COUNT = sizeof(COMPONENT_ATTRS) / sizeof(COMPONENT_ATTRS[0]);
+
+// Appends a value of a component's attribute to Appcast::Components.
+void AppendComponentValue(std::string& out, const char *value)
+{
+    // the separators can't be part of any valid value anyway
+    for ( const char *p = value; *p; p++ )
+        out += (*p == '\t' || *p == '\n' || *p == '\r') ? ' ' : *p;
+}
+
+// Appends the <sparkle:component> to the item's Components as a line of
+// tab-separated attribute values.
+void ParseComponent(ContextData& ctxt, const char **attrs)
+{
+    std::string& out = ctxt.item.Components;
+    if ( !out.empty() )
+        out += '\n';
 
-    if (ctxt.in_item)
+    for ( size_t n = 0; n < COMPONENT_ATTRS_COUNT; n++ )
     {
-        if (strcmp(name, NODE_RELNOTES) == 0)
+        if ( n )
+            out += '\t';
+        for ( int i = 0; attrs[i]; i += 2 )
         {
-            ctxt.in_relnotes--;
+            if ( strcmp(attrs[i], COMPONENT_ATTRS[n]) == 0 )
+                AppendComponentValue(out, attrs[i+1]);
         }
-        else if (strcmp(name, NODE_TITLE) == 0)
+    }
+}
+
+
+void XMLCALL OnStartElement(void *data, const char *name, const char **attrs)
+{
+    ContextData& ctxt = *static_cast<ContextData*>(data);
+
+    const NameInfo *info = ELEMENTS.Find(name);
+    if ( !info )
+        return;
+
+    if ( info->kind == Name_Channel )
+    {
+        ctxt.in_channel++;
+    }
+    else if ( ctxt.in_channel && info->kind == Name_Item )
+    {
+        ctxt.in_item++;
+        // clear the previous item's values, but keep the memory for reuse
+        for ( int i = 0; i < AppcastChannel::Field_Max; i++ )
+            (ctxt.item.*ITEM_FIELDS[i]).clear();
+    }
+    else if ( ctxt.in_channel && !ctxt.in_item && info->kind == Name_CheckInterval )
+    {
+        ctxt.text_stack.push_back(ctxt.text);
+        ctxt.check_interval.clear();
+        ctxt.text = &ctxt.check_interval;
+    }
+    else if ( ctxt.in_item )
+    {
+        if ( info->kind == Name_Field )
         {
-            ctxt.in_title--;
+            ctxt.text_stack.push_back(ctxt.text);
+            ctxt.text = &(ctxt.item.*ITEM_FIELDS[info->field]);
         }
-        else if (strcmp(name, NODE_DESCRIPTION) == 0)
+        else if ( info->kind == Name_Mirror )
         {
-            ctxt.in_description--;
+            // there may be any number of them, collect them all
+            ctxt.text_stack.push_back(ctxt.text);
+            ctxt.text = &ctxt.item.MirrorURLs;
+            if ( !ctxt.text->empty() )
+                ctxt.text->append(1, ' ');
         }
-        else if (strcmp(name, NODE_MIN_OS_VERSION) == 0)
+        else if ( info->kind == Name_CriticalUpdate )
         {
-            ctxt.in_min_os_version--;
+            // also found in <sparkle:tags>, as older Sparkle versions used
+            ctxt.item.CriticalUpdate = "true";
+            for ( int i = 0; attrs[i]; i += 2 )
+            {
+                if ( strcmp(attrs[i], ATTR_VERSION) == 0 && *attrs[i+1] )
+                    ctxt.item.CriticalUpdate = attrs[i+1];
+            }
         }
-        else if (strcmp(name, NODE_LINK) == 0)
+        else if ( info->kind == Name_Component )
         {
-            ctxt.in_link--;
+            ParseComponent(ctxt, attrs);
         }
-        else if (strcmp(name, NODE_VERSION) == 0)
+        else if ( info->kind == Name_Deltas )
         {
-            ctxt.in_version--;
+            ctxt.in_deltas++;
         }
-        else if (strcmp(name, NODE_SHORTVERSION) == 0)
+        else if ( info->kind == Name_Enclosure && ctxt.in_deltas )
         {
-            ctxt.in_shortversion--;
+            ParseDeltaEnclosure(ctxt, attrs);
         }
-        else if (strcmp(name, NODE_DSASIGNATURE) == 0)
+        else if ( info->kind == Name_Enclosure )
         {
-            ctxt.in_dsasignature--;
+            for ( int i = 0; attrs[i]; i += 2 )
+            {
+                const NameInfo *attr = ENCLOSURE_ATTRS.Find(attrs[i]);
+                if ( attr && attr->kind == Name_Field )
+                    ctxt.item.*ITEM_FIELDS[attr->field] = attrs[i+1];
+            }
         }
     }
-    else if (ctxt.in_channel && strcmp(name, NODE_ITEM) == 0)
+}
+
+
+void XMLCALL OnEndElement(void *data, const char *name)
+{
+    ContextData& ctxt = *static_cast<ContextData*>(data);
+
+    const NameKind kind = ELEMENTS.FindKind(name);
+    if ( kind == Name_Unknown )
+        return;
+
+    if (ctxt.in_channel && kind == Name_Item)
     {
         ctxt.in_item--;
-        if (is_suitable_windows_item(ctxt.items[ctxt.items.size() - 1]))
+        ctxt.channel.AddItem(ctxt.item);
+        if (ctxt.deltas.EndItem(ctxt.channel, ctxt.item) && !ctxt.all_items)
             XML_StopParser(ctxt.parser, XML_TRUE);
     }
-    else if (strcmp(name, NODE_CHANNEL) == 0 )
+    else if (ctxt.in_channel && kind == Name_CheckInterval && !ctxt.text_stack.empty())
+    {
+        ctxt.channel.SetCheckInterval(ctxt.check_interval);
+        ctxt.text = ctxt.text_stack.back();
+        ctxt.text_stack.pop_back();
+    }
+    else if (ctxt.in_item)
+    {
+        if (kind == Name_Deltas && ctxt.in_deltas)
+            ctxt.in_deltas--;
+        else if ((kind == Name_Field || kind == Name_Mirror) && !ctxt.text_stack.empty())
+        {
+            ctxt.text = ctxt.text_stack.back();
+            ctxt.text_stack.pop_back();
+        }
+    }
+    else if (kind == Name_Channel)
     {
         ctxt.in_channel--;
         // we've reached the end of <channel> element,
@@ -268,76 +928,1074 @@ void XMLCALL OnEndElement(void *data, const char *name)
 void XMLCALL OnText(void *data, const char *s, int len)
 {
     ContextData& ctxt = *static_cast<ContextData*>(data);
-    const size_t size = ctxt.items.size();
-
-    if ( ctxt.in_relnotes )
-        ctxt.items[size-1].ReleaseNotesURL.append(s, len);
-    else if ( ctxt.in_title )
-        ctxt.items[size-1].Title.append(s, len);
-    else if ( ctxt.in_description )
-        ctxt.items[size-1].Description.append(s, len);
-    else if ( ctxt.in_link )
-        ctxt.items[size-1].WebBrowserURL.append(s, len);
-    else if ( ctxt.in_version )
-        ctxt.items[size-1].Version.append(s, len);
-    else if ( ctxt.in_shortversion )
-        ctxt.items[size-1].ShortVersionString.append(s, len);
-    else if (ctxt.in_dsasignature)
-        ctxt.items[size-1].DsaSignature.append(s, len);
-    else if ( ctxt.in_min_os_version )
-        ctxt.items[size-1].MinOSVersion.append(s, len);
+
+    if ( !ctxt.text )
+        return;
+
+    // exceptions can't be thrown through the parser, see AppcastParser::Impl
+    const size_t maxSize = ctxt.text == &ctxt.item.Description ? MAX_DESCRIPTION_SIZE : MAX_FIELD_SIZE;
+    if ( ctxt.text->size() + len > maxSize )
+    {
+        ctxt.error = "Appcast feed contains too long text.";
+        XML_StopParser(ctxt.parser, XML_FALSE);
+        return;
+    }
+
+    ctxt.text->append(s, len);
 }
 
 } // anonymous namespace
 
 
 /*--------------------------------------------------------------------------*
-                               Appcast class
+                               JSON parsing
  *--------------------------------------------------------------------------*/
 
-Appcast Appcast::Load(const std::string& xml)
+namespace
 {
-    XML_Parser p = XML_ParserCreateNS(NULL, NS_SEP);
-    if ( !p )
-        throw std::runtime_error("Failed to create XML parser.");
-
-    ContextData ctxt(p);
 
-    XML_SetUserData(p, &ctxt);
-    XML_SetElementHandler(p, OnStartElement, OnEndElement);
-    XML_SetCharacterDataHandler(p, OnText);
+#define JSON_ITEMS          "items"
+#define JSON_CHECK_INTERVAL "checkInterval"
 
-    XML_Status st = XML_Parse(p, xml.c_str(), (int)xml.size(), XML_TRUE);
+// members of an item object
+const NameInfo JSON_ITEM_NAMES[] =
+{
+    { "title",                Name_Field,     AppcastChannel::Field_Title },
+    { "description",          Name_Field,     AppcastChannel::Field_Description },
+    { "link",                 Name_Field,     AppcastChannel::Field_WebBrowserURL },
+    { "releaseNotesLink",     Name_Field,     AppcastChannel::Field_ReleaseNotesURL },
+    { "version",              Name_Field,     AppcastChannel::Field_Version },
+    { "shortVersionString",   Name_Field,     AppcastChannel::Field_ShortVersionString },
+    { "dsaSignature",         Name_Field,     AppcastChannel::Field_DsaSignature },
+    { "minimumSystemVersion", Name_Field,     AppcastChannel::Field_MinOSVersion },
+    { "pubDate",              Name_Field,     AppcastChannel::Field_PubDate },
+    { "phasedRolloutInterval", Name_Field,    AppcastChannel::Field_PhasedRolloutInterval },
+    { "channel",              Name_Field,     AppcastChannel::Field_Channel },
+    { "criticalUpdate",       Name_CriticalUpdate, AppcastChannel::Field_CriticalUpdate },
+    { "mirrors",              Name_Mirror,    AppcastChannel::Field_MirrorURLs },
+    { "enclosure",            Name_Enclosure, AppcastChannel::Field_Max },
+    { "deltas",               Name_Deltas,    AppcastChannel::Field_Max },
+    { "components",           Name_Component, AppcastChannel::Field_Components },
+};
 
-    if ( st == XML_STATUS_ERROR )
+// members of the enclosure object and of the objects in "deltas"
+const NameInfo JSON_ENCLOSURE_NAMES[] =
+{
+    { "url",                  Name_Field,     AppcastChannel::Field_DownloadURL },
+    { "version",              Name_Field,     AppcastChannel::Field_Version },
+    { "shortVersionString",   Name_Field,     AppcastChannel::Field_ShortVersionString },
+    { "dsaSignature",         Name_Field,     AppcastChannel::Field_DsaSignature },
+    { "edSignature",          Name_Field,     AppcastChannel::Field_EdDSASignature },
+    { "edChunkedSignature",   Name_Field,     AppcastChannel::Field_EdDSAChunkedSignature },
+    { "chunkManifest",        Name_Field,     AppcastChannel::Field_ChunkManifestURL },
+    { "os",                   Name_Field,     AppcastChannel::Field_Os },
+    { "installerArguments",   Name_Field,     AppcastChannel::Field_InstallerArguments },
+    { "installerRequiresElevation", Name_Field, AppcastChannel::Field_InstallerRequiresElevation },
+    { "length",               Name_Field,     AppcastChannel::Field_Length },
+    { "sha256",               Name_Field,     AppcastChannel::Field_Sha256 },
+    { "encoding",             Name_Field,     AppcastChannel::Field_Encoding },
+    { "deltaFrom",            Name_DeltaFrom, AppcastChannel::Field_DeltaFrom },
+};
+
+const NameTable JSON_ITEM_MEMBERS(JSON_ITEM_NAMES);
+const NameTable JSON_ENCLOSURE_MEMBERS(JSON_ENCLOSURE_NAMES);
+
+// Members of the objects in "components", in the order they are stored in
+// Appcast::Components, as COMPONENT_ATTRS.
+const char *const JSON_COMPONENT_NAMES[COMPONENT_ATTRS_COUNT] =
+{
+    "url",
+    "length",
+    "sha256",
+    "edSignature",
+    "dsaSignature",
+    "priority"
+};
+
+/**
+    Reads the JSON appcast feed into AppcastChannel.
+
+    The feed is an object with an "items" array of item objects, newest
+    first, and an optional "checkInterval". An item's members are named as
+    the elements and attributes of RSS items without the "sparkle:" prefix,
+    see README.md.
+ */
+class JsonFeedParser
+{
+public:
+    JsonFeedParser(const char *data, size_t len,
+                   AppcastChannel& channel, bool allItems,
+                   const std::string& installedVersion,
+                   DeltaChainFinder& deltas)
+        : m_reader(data, len), m_channel(channel), m_allItems(allItems),
+          m_installedVersion(installedVersion), m_deltas(deltas)
+    {}
+
+    void Parse()
     {
-        std::string msg("XML parser error: ");
-        msg.append(XML_ErrorString(XML_GetErrorCode(p)));
-        XML_ParserFree(p);
-        throw std::runtime_error(msg);
+        if ( m_reader.PeekType() != JsonReader::Type_Object )
+            m_reader.Fail("feed is not an object");
+
+        m_reader.BeginObject();
+        for ( bool first = true; m_reader.NextMember(first, m_key); )
+        {
+            if ( m_key == JSON_CHECK_INTERVAL )
+            {
+                m_reader.ReadScalar(m_value, MAX_FIELD_SIZE);
+                m_channel.SetCheckInterval(m_value);
+            }
+            else if ( m_key == JSON_ITEMS && m_reader.PeekType() == JsonReader::Type_Array )
+            {
+                // like the RSS parser, stop at the first suitable item
+                if ( !ParseItems() )
+                    return;
+            }
+            else
+            {
+                m_reader.Skip();
+            }
+        }
+        m_reader.End();
     }
 
-    XML_ParserFree(p);
+private:
+    // Returns false if the parsing stopped at a suitable item.
+    bool ParseItems()
+    {
+        m_reader.BeginArray();
+        for ( bool first = true; m_reader.NextElement(first); )
+        {
+            if ( m_reader.PeekType() != JsonReader::Type_Object )
+            {
+                m_reader.Skip();
+                continue;
+            }
+
+            ParseItem();
+            m_channel.AddItem(m_item);
+            if ( m_deltas.EndItem(m_channel, m_item) && !m_allItems )
+                return false;
+        }
+        return true;
+    }
+
+    void ParseItem()
+    {
+        // clear the previous item's values, but keep the memory for reuse
+        for ( int i = 0; i < AppcastChannel::Field_Max; i++ )
+            (m_item.*ITEM_FIELDS[i]).clear();
+
+        m_reader.BeginObject();
+        for ( bool first = true; m_reader.NextMember(first, m_key); )
+        {
+            const NameInfo *info = JSON_ITEM_MEMBERS.Find(m_key.c_str());
+            switch ( info ? info->kind : Name_Unknown )
+            {
+                case Name_Field:
+                    ReadField(m_item.*ITEM_FIELDS[info->field]);
+                    break;
+                case Name_CriticalUpdate:
+                    // true, or the version older versions must update to
+                    ReadField(m_item.CriticalUpdate);
+                    if ( m_item.CriticalUpdate == "false" )
+                        m_item.CriticalUpdate.clear();
+                    break;
+                case Name_Mirror:
+                    ParseMirrors();
+                    break;
+                case Name_Enclosure:
+                    ParseEnclosure();
+                    break;
+                case Name_Deltas:
+                    ParseDeltas();
+                    break;
+                case Name_Component:
+                    ParseComponents();
+                    break;
+                default:
+                    m_reader.Skip();
+            }
+        }
+    }
+
+    void ReadField(std::string& field)
+    {
+        m_reader.ReadScalar(field, &field == &m_item.Description ? MAX_DESCRIPTION_SIZE : MAX_FIELD_SIZE);
+    }
+
+    // "mirrors" is an array of URLs
+    void ParseMirrors()
+    {
+        if ( m_reader.PeekType() != JsonReader::Type_Array )
+        {
+            m_reader.Skip();
+            return;
+        }
+
+        std::string& out = m_item.MirrorURLs;
+        m_reader.BeginArray();
+        for ( bool first = true; m_reader.NextElement(first); )
+        {
+            m_reader.ReadScalar(m_value, MAX_FIELD_SIZE);
+            if ( m_value.empty() )
+                continue;
+            if ( !out.empty() )
+                out += ' ';
+            out += m_value;
+            if ( out.size() > MAX_FIELD_SIZE )
+                throw std::runtime_error("Appcast feed contains too long text.");
+        }
+    }
+
+    void ParseEnclosure()
+    {
+        if ( m_reader.PeekType() != JsonReader::Type_Object )
+        {
+            m_reader.Skip();
+            return;
+        }
+
+        m_reader.BeginObject();
+        for ( bool first = true; m_reader.NextMember(first, m_key); )
+        {
+            const NameInfo *attr = JSON_ENCLOSURE_MEMBERS.Find(m_key.c_str());
+            if ( attr && attr->kind == Name_Field )
+                ReadField(m_item.*ITEM_FIELDS[attr->field]);
+            else
+                m_reader.Skip();
+        }
+    }
+
+    // "deltas" is an array of enclosure objects with "deltaFrom"; the one
+    // from the installed version is used, the others may make a chain
+    void ParseDeltas()
+    {
+        if ( m_reader.PeekType() != JsonReader::Type_Array )
+        {
+            m_reader.Skip();
+            return;
+        }
+
+        m_reader.BeginArray();
+        for ( bool first = true; m_reader.NextElement(first); )
+        {
+            if ( m_reader.PeekType() != JsonReader::Type_Object )
+            {
+                m_reader.Skip();
+                continue;
+            }
+
+            for ( int i = 0; i < AppcastChannel::Field_Max; i++ )
+                (m_delta.*ITEM_FIELDS[i]).clear();
+
+            m_reader.BeginObject();
+            for ( bool firstMember = true; m_reader.NextMember(firstMember, m_key); )
+            {
+                const NameInfo *attr = JSON_ENCLOSURE_MEMBERS.Find(m_key.c_str());
+                if ( attr && attr->kind == Name_DeltaFrom )
+                    ReadField(m_delta.DeltaFrom);
+                else if ( attr && attr->kind == Name_Field && GetDeltaField(attr->field) != AppcastChannel::Field_Max )
+                    ReadField(m_delta.*ITEM_FIELDS[attr->field]);
+                else
+                    m_reader.Skip();
+            }
+
+            if ( m_installedVersion.empty() || m_delta.DeltaFrom != m_installedVersion )
+            {
+                m_deltas.AddDelta(m_delta.DeltaFrom, m_delta.DownloadURL,
+                                  m_delta.EdDSASignature, m_delta.DsaSignature);
+                continue;
+            }
+
+            m_item.DeltaFrom = m_installedVersion;
+            m_item.DeltaURL = m_delta.DownloadURL;
+            m_item.DeltaDsaSignature = m_delta.DsaSignature;
+            m_item.DeltaEdDSASignature = m_delta.EdDSASignature;
+        }
+    }
+
+    // "components" is an array of objects, each stored as a line of
+    // Appcast::Components, see ParseComponent()
+    void ParseComponents()
+    {
+        if ( m_reader.PeekType() != JsonReader::Type_Array )
+        {
+            m_reader.Skip();
+            return;
+        }
+
+        std::string& out = m_item.Components;
+        m_reader.BeginArray();
+        for ( bool first = true; m_reader.NextElement(first); )
+        {
+            if ( m_reader.PeekType() != JsonReader::Type_Object )
+            {
+                m_reader.Skip();
+                continue;
+            }
+
+            for ( size_t n = 0; n < COMPONENT_ATTRS_COUNT; n++ )
+                m_component[n].clear();
+
+            m_reader.BeginObject();
+            for ( bool firstMember = true; m_reader.NextMember(firstMember, m_key); )
+            {
+                size_t n = 0;
+                while ( n < COMPONENT_ATTRS_COUNT && m_key != JSON_COMPONENT_NAMES[n] )
+                    n++;
+                if ( n < COMPONENT_ATTRS_COUNT )
+                    m_reader.ReadScalar(m_component[n], MAX_FIELD_SIZE);
+                else
+                    m_reader.Skip();
+            }
+
+            if ( !out.empty() )
+                out += '\n';
+            for ( size_t n = 0; n < COMPONENT_ATTRS_COUNT; n++ )
+            {
+                if ( n )
+                    out += '\t';
+                AppendComponentValue(out, m_component[n].c_str());
+            }
+        }
+    }
+
+    JsonReader m_reader;
+    AppcastChannel& m_channel;
+    bool m_allItems;
+    std::string m_installedVersion;
+    DeltaChainFinder& m_deltas;
+
+    // buffers reused for all items
+    Appcast m_item, m_delta;
+    std::string m_key, m_value;
+    std::string m_component[COMPONENT_ATTRS_COUNT];
+};
+
+} // anonymous namespace
 
-    if (ctxt.items.empty())
-        return Appcast(); // invalid
 
+/*--------------------------------------------------------------------------*
+                           AppcastChannel class
+ *--------------------------------------------------------------------------*/
+
+AppcastChannel AppcastChannel::Load(const std::string& xml,
+                                    const std::string& installedVersion,
+                                    const std::string& channels)
+{
+    AppcastParser parser(true, installedVersion, channels);
+    parser.Feed(xml.c_str(), xml.size());
+    parser.Finish();
+    return parser.GetChannel();
+}
+
+
+void AppcastChannel::AddItem(const Appcast& item)
+{
+    Item data;
+
+    if ( item.Os == OS_MARKER )
+        data.os = ItemOs_Windows;
+    else if ( item.Os == OS_MARKER "-x86" )
+        data.os = ItemOs_WindowsX86;
+    else if ( item.Os == OS_MARKER "-x64" )
+        data.os = ItemOs_WindowsX64;
+    else if ( item.Os == OS_MARKER "-arm64" )
+        data.os = ItemOs_WindowsARM64;
+    else
+        data.os = ItemOs_Other;
+
+    data.osVersionAcceptable = is_windows_version_acceptable(item);
+
+    data.channelAllowed = item.Channel.empty() ||
+        std::find(m_allowedChannels.begin(), m_allowedChannels.end(), item.Channel) != m_allowedChannels.end();
+
+    // Release notes are often the bulk of an item, don't keep them for items
+    // that can never be offered, e.g. older releases in other channels.
+    const bool keepDescription = m_keepAllDescriptions || (data.osVersionAcceptable && data.channelAllowed);
+
+    for ( int i = 0; i < Field_Max; i++ )
+    {
+        data.fields[i] = m_strings.size();
+        if ( i != Field_Description || keepDescription )
+            m_strings.append(item.*ITEM_FIELDS[i]);
+    }
+    data.fields[Field_Max] = m_strings.size();
+
+    m_items.push_back(data);
+    m_versionIndex.clear();
+}
+
+
+std::string AppcastChannel::GetField(size_t index, Field field) const
+{
+    const Item& item = m_items[index];
+    return m_strings.substr(item.fields[field], item.fields[field + 1] - item.fields[field]);
+}
+
+
+std::string Appcast::*AppcastChannel::GetFieldMember(Field field)
+{
+    return ITEM_FIELDS[field];
+}
+
+
+Appcast AppcastChannel::GetItem(size_t index) const
+{
+    const Item& item = m_items[index];
+
+    Appcast appcast;
+    for ( int i = 0; i < Field_Max; i++ )
+    {
+        (appcast.*ITEM_FIELDS[i]).assign(m_strings, item.fields[i], item.fields[i + 1] - item.fields[i]);
+    }
+    appcast.CheckInterval = m_checkInterval;
+    return appcast;
+}
+
+
+void AppcastChannel::SetAllowedChannels(const std::string& channels)
+{
+    m_allowedChannels.clear();
+
+    const char *separators = ", \t";
+    for ( size_t pos = channels.find_first_not_of(separators);
+          pos != std::string::npos;
+          pos = channels.find_first_not_of(separators, pos) )
+    {
+        const size_t end = channels.find_first_of(separators, pos);
+        m_allowedChannels.push_back(channels.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+
+bool AppcastChannel::IsSuitable(size_t index) const
+{
+    const Item& item = m_items[index];
+    if ( !item.osVersionAcceptable || !item.channelAllowed )
+        return false;
+
+    if ( item.os == ItemOs_Windows )
+        return true;
+
+    // native builds are always preferred on ARM64, see GetUpdate()
+    if ( HOST_PLATFORM.isARM64 )
+        return item.os == ItemOs_WindowsARM64;
+
+    return item.os == (HOST_PLATFORM.is64bit ? ItemOs_WindowsX64 : ItemOs_WindowsX86);
+}
+
+
+bool AppcastChannel::IsSuitableEmulated(size_t index) const
+{
+    const Item& item = m_items[index];
+    if ( !HOST_PLATFORM.isARM64 || !item.osVersionAcceptable || !item.channelAllowed )
+        return false;
+
+    return item.os == (HOST_PLATFORM.is64bit ? ItemOs_WindowsX64 : ItemOs_WindowsX86);
+}
+
+
+namespace
+{
+
+struct VersionGreater
+{
+    VersionGreater(const std::vector<VersionKey>& v) : versions(v) {}
+
+    bool operator()(size_t a, size_t b) const
+    {
+        return versions[a] > versions[b];
+    }
+
+    const std::vector<VersionKey>& versions;
+};
+
+} // anonymous namespace
+
+
+const std::vector<size_t>& AppcastChannel::GetVersionIndex() const
+{
+    if ( m_versionIndex.size() != m_items.size() )
+    {
+        // parse each version only once, not in every comparison
+        std::vector<VersionKey> versions;
+        versions.reserve(m_items.size());
+        m_versionIndex.clear();
+        m_versionIndex.reserve(m_items.size());
+
+        for ( size_t i = 0; i < m_items.size(); i++ )
+        {
+            versions.push_back(VersionKey(GetField(i, Field_Version)));
+            m_versionIndex.push_back(i);
+        }
+
+        std::stable_sort(m_versionIndex.begin(), m_versionIndex.end(), VersionGreater(versions));
+    }
+
+    return m_versionIndex;
+}
+
+
+Appcast AppcastChannel::GetUpdate() const
+{
     /*
      * Search for first <item> which specifies with the attribute sparkle:os set to "windows"
      * or "windows-x64"/"windows-x86" based on this modules bitness and meets the minimum
      * os version, if set. If none, use the first item that meets the minimum os version, if set.
+     * Items in channels the app didn't opt into are never used.
+     *
+     * On ARM64, "windows-arm64" is used instead of the module's bitness, but the x64 or x86
+     * build that this module can run as (emulated) is used if it's a newer version.
      */
-    std::vector<Appcast>::iterator it = std::find_if(ctxt.items.begin(), ctxt.items.end(), is_suitable_windows_item);
-    if (it != ctxt.items.end())
-        return *it;
+    size_t emulated = m_items.size();
+    for ( size_t i = 0; i < m_items.size(); i++ )
+    {
+        if ( IsSuitable(i) )
+        {
+            if ( emulated == m_items.size() ||
+                 GetField(i, Field_Version) == GetField(emulated, Field_Version) )
+                return GetItem(i);
+            break;
+        }
+        if ( emulated == m_items.size() && IsSuitableEmulated(i) )
+            emulated = i;
+    }
+
+    if ( emulated != m_items.size() )
+        return GetItem(emulated);
+
+    for ( size_t i = 0; i < m_items.size(); i++ )
+    {
+        if ( IsOSVersionAcceptable(i) && IsChannelAllowed(i) )
+            return GetItem(i);
+    }
+
+    return Appcast(); // There are no items that meet the set minimum os version
+}
+
+
+/*--------------------------------------------------------------------------*
+                            AppcastParser class
+ *--------------------------------------------------------------------------*/
+
+struct AppcastParser::Impl
+{
+    Impl(bool allItems, const std::string& installedVersion, const std::string& channels)
+        : parser(CreateParser(arena)),
+          ctxt(parser, channel, allItems, installedVersion),
+          format(Format_Auto),
+          done(false)
+    {
+        if ( !parser )
+            throw std::runtime_error("Failed to create XML parser.");
+
+        channel.SetAllowedChannels(channels);
+
+        XML_SetUserData(parser, &ctxt);
+        XML_SetElementHandler(parser, OnStartElement, OnEndElement);
+        XML_SetCharacterDataHandler(parser, OnText);
+    }
+
+    ~Impl()
+    {
+        if ( parser )
+        {
+            ParseArena::Use use(arena);
+            XML_ParserFree(parser);
+        }
+    }
+
+    static XML_Parser CreateParser(ParseArena& arena)
+    {
+        ParseArena::Use use(arena);
+        const XML_Char sep[] = { NS_SEP, 0 };
+        return XML_ParserCreate_MM(NULL, &ParseArena::MEMORY_SUITE, sep);
+    }
+
+    void Parse(const char *data, int len, bool isFinal)
+    {
+        XML_Status st;
+        {
+            ParseArena::Use use(arena);
+            st = XML_Parse(parser, data, len, isFinal ? XML_TRUE : XML_FALSE);
+        }
+
+        if ( st == XML_STATUS_ERROR && !ctxt.error.empty() )
+            throw std::runtime_error(ctxt.error);
+        if ( st == XML_STATUS_ERROR )
+        {
+            std::string msg("XML parser error: ");
+            msg.append(XML_ErrorString(XML_GetErrorCode(parser)));
+            throw std::runtime_error(msg);
+        }
+
+        // the parser was stopped by OnEndElement(), it has all it needs
+        if ( st == XML_STATUS_SUSPENDED || isFinal )
+            done = true;
+    }
+
+    // JSON and binary feeds are read in place, so they are collected whole
+    // first
+    void AddToBuffer(const char *data, size_t len)
+    {
+        if ( buffer.size() + len > MAX_PARSER_MEMORY )
+            throw std::runtime_error("Appcast feed is too large.");
+        buffer.append(data, len);
+    }
+
+    void ParseBuffer()
+    {
+        if ( format == Format_Binary )
+            BinaryAppcast(buffer.data(), buffer.size()).AddTo(channel, ctxt.all_items, ctxt.installed_version);
+        else
+            JsonFeedParser(buffer.data(), buffer.size(), channel, ctxt.all_items, ctxt.installed_version, ctxt.deltas).Parse();
+        done = true;
+        std::string().swap(buffer);
+    }
+
+    // Tells the feed's format from its first non-whitespace character,
+    // returns Format_Auto if there's none yet.
+    static Format DetectFormat(const char *data, size_t len)
+    {
+        for ( const char *p = data; p != data + len; p++ )
+        {
+            switch ( *p )
+            {
+                case ' ': case '\t': case '\r': case '\n':
+                case '\xEF': case '\xBB': case '\xBF': // UTF-8 BOM
+                    continue;
+                case '{':
+                    return Format_JSON;
+                case 'W': // BinaryAppcast's magic, XML can't start with it
+                    return Format_Binary;
+                default:
+                    return Format_RSS;
+            }
+        }
+        return Format_Auto;
+    }
+
+    // must outlive the parser, which is allocated from it
+    ParseArena arena;
+    XML_Parser parser;
+    AppcastChannel channel;
+    ContextData ctxt;
+    Format format;
+    // the JSON or binary feed, or the whitespace before a feed of
+    // undetected format
+    std::string buffer;
+    bool done;
+};
+
+
+AppcastParser::AppcastParser(bool allItems,
+                             const std::string& installedVersion,
+                             const std::string& channels)
+    : m_impl(new Impl(allItems, installedVersion, channels))
+{
+}
+
+
+AppcastParser::~AppcastParser()
+{
+}
+
+
+bool AppcastParser::Feed(const void *data, size_t len)
+{
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_PARSE);
+
+    if ( m_impl->done )
+        return false;
+
+    const char *ptr = static_cast<const char*>(data);
+    if ( m_impl->format == Format_Auto )
+    {
+        m_impl->format = Impl::DetectFormat(ptr, len);
+        if ( m_impl->format == Format_Auto )
+        {
+            m_impl->AddToBuffer(ptr, len);
+            return true;
+        }
+        if ( m_impl->format == Format_RSS && !m_impl->buffer.empty() )
+        {
+            m_impl->Parse(m_impl->buffer.data(), int(m_impl->buffer.size()), false);
+            m_impl->buffer.clear();
+        }
+    }
+
+    if ( m_impl->format == Format_JSON || m_impl->format == Format_Binary )
+    {
+        m_impl->AddToBuffer(ptr, len);
+        return true;
+    }
+
+    // XML_Parse() takes int length, so feed huge chunks piecewise
+    while ( len && !m_impl->done )
+    {
+        const int chunk = len > INT_MAX ? INT_MAX : (int)len;
+        m_impl->Parse(ptr, chunk, false);
+        ptr += chunk;
+        len -= chunk;
+    }
+
+    return !m_impl->done;
+}
+
+
+Appcast AppcastParser::Finish()
+{
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_PARSE);
+
+    if ( !m_impl->done && (m_impl->format == Format_JSON || m_impl->format == Format_Binary) )
+        m_impl->ParseBuffer();
+    else if ( !m_impl->done )
+        m_impl->Parse(m_impl->buffer.data(), int(m_impl->buffer.size()), true);
+
+    Appcast update = m_impl->channel.GetUpdate();
+    m_impl->ctxt.deltas.SetChain(update);
+    return update;
+}
+
+
+void AppcastParser::SetFormat(Format format)
+{
+    m_impl->format = format;
+}
+
+
+AppcastParser::Format AppcastParser::GetFormatFromContentType(const std::string& contentType)
+{
+    // ignore parameters such as charset
+    std::string type = contentType.substr(0, contentType.find(';'));
+    const size_t last = type.find_last_not_of(" \t");
+    type.erase(last == std::string::npos ? 0 : last + 1);
+    for ( size_t i = 0; i < type.size(); i++ )
+        type[i] = char(tolower(static_cast<unsigned char>(type[i])));
+
+    const size_t slash = type.find('/');
+    if ( slash == std::string::npos )
+        return Format_Auto;
+    const std::string subtype = type.substr(slash + 1);
+    const size_t plus = subtype.rfind('+');
+    const std::string suffix = plus == std::string::npos ? subtype : subtype.substr(plus + 1);
+
+    // e.g. application/json, application/feed+json
+    if ( suffix == "json" )
+        return Format_JSON;
+    // e.g. application/rss+xml, text/xml
+    if ( suffix == "xml" )
+        return Format_RSS;
+    // text/plain, application/octet-stream etc. say nothing about the format
+    return Format_Auto;
+}
+
+
+const AppcastChannel& AppcastParser::GetChannel() const
+{
+    return m_impl->channel;
+}
+
+
+AppcastChannel& AppcastParser::GetChannel()
+{
+    return m_impl->channel;
+}
+
+
+/*--------------------------------------------------------------------------*
+                               Appcast class
+ *--------------------------------------------------------------------------*/
+
+Appcast Appcast::Load(const std::string& xml,
+                      const std::string& installedVersion,
+                      const std::string& channels)
+{
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_PARSE);
+    AppcastParser parser(false, installedVersion, channels);
+    parser.Feed(xml.c_str(), xml.size());
+    return parser.Finish();
+}
+
+
+std::string Appcast::GetHostOs()
+{
+    if ( HOST_PLATFORM.isARM64 )
+        return OS_MARKER "-arm64";
+    return HOST_PLATFORM.is64bit ? OS_MARKER "-x64" : OS_MARKER "-x86";
+}
+
+
+std::string Appcast::GetHostOSVersion()
+{
+    char buf[64];
+    sprintf(buf, "%u.%u.%u",
+            unsigned(HOST_PLATFORM.version >> 32),
+            unsigned((HOST_PLATFORM.version >> 16) & 0xFFFF),
+            unsigned(HOST_PLATFORM.version & 0xFFFF));
+    return buf;
+}
+
+
+std::vector<std::string> Appcast::GetDownloadURLs() const
+{
+    std::vector<std::string> urls;
+    if ( !DownloadURL.empty() )
+        urls.push_back(DownloadURL);
+
+    const char *whitespace = " \t\r\n";
+    for ( size_t pos = MirrorURLs.find_first_not_of(whitespace);
+          pos != std::string::npos;
+          pos = MirrorURLs.find_first_not_of(whitespace, pos) )
+    {
+        const size_t end = MirrorURLs.find_first_of(whitespace, pos);
+        urls.push_back(MirrorURLs.substr(pos, end - pos));
+        pos = end;
+    }
+
+    return urls;
+}
+
+
+std::vector<AppcastComponent> Appcast::GetComponents() const
+{
+    std::vector<AppcastComponent> components;
+
+    size_t pos = 0;
+    while ( pos < Components.length() )
+    {
+        size_t end = Components.find('\n', pos);
+        if ( end == std::string::npos )
+            end = Components.length();
+
+        std::string values[COMPONENT_ATTRS_COUNT];
+        size_t n = 0;
+        for ( size_t i = pos; i <= end; i++ )
+        {
+            if ( i == end || Components[i] == '\t' )
+            {
+                if ( ++n == COMPONENT_ATTRS_COUNT )
+                    break;
+            }
+            else
+            {
+                values[n] += Components[i];
+            }
+        }
+        pos = end + 1;
+
+        AppcastComponent c;
+        c.DownloadURL = values[0];
+        c.Length = values[1];
+        c.Sha256 = values[2];
+        c.EdDSASignature = values[3];
+        c.DsaSignature = values[4];
+        c.Priority = atoi(values[5].c_str());
+        if ( !c.DownloadURL.empty() )
+            components.push_back(c);
+    }
+
+    std::stable_sort(components.begin(), components.end(),
+                     [](const AppcastComponent& a, const AppcastComponent& b)
+                     {
+                         return a.Priority < b.Priority;
+                     });
+    return components;
+}
+
+
+void Appcast::AddComponent(const AppcastComponent& component)
+{
+    // stored as ParseComponent() does
+    if ( !Components.empty() )
+        Components += '\n';
+    AppendComponentValue(Components, component.DownloadURL.c_str());
+    Components += '\t';
+    AppendComponentValue(Components, component.Length.c_str());
+    Components += '\t';
+    AppendComponentValue(Components, component.Sha256.c_str());
+    Components += '\t';
+    AppendComponentValue(Components, component.EdDSASignature.c_str());
+    Components += '\t';
+    AppendComponentValue(Components, component.DsaSignature.c_str());
+    Components += '\t';
+    if ( component.Priority )
+    {
+        char priority[16];
+        sprintf(priority, "%d", component.Priority);
+        Components += priority;
+    }
+}
+
+
+std::vector<AppcastDelta> Appcast::GetDeltaChain() const
+{
+    std::vector<AppcastDelta> chain;
+
+    size_t pos = 0;
+    while ( pos < DeltaChain.length() )
+    {
+        size_t end = DeltaChain.find('\n', pos);
+        if ( end == std::string::npos )
+            end = DeltaChain.length();
+
+        // stored by SetDeltaChain(), in the order of AppcastDelta's members
+        std::string values[5];
+        size_t n = 0;
+        for ( size_t i = pos; i < end && n < 5; i++ )
+        {
+            if ( DeltaChain[i] == '\t' )
+                n++;
+            else
+                values[n] += DeltaChain[i];
+        }
+        pos = end + 1;
+
+        AppcastDelta delta;
+        delta.From = values[0];
+        delta.To = values[1];
+        delta.URL = values[2];
+        delta.EdDSASignature = values[3];
+        delta.DsaSignature = values[4];
+        if ( delta.URL.empty() )
+            return std::vector<AppcastDelta>(); // a broken chain is of no use
+        chain.push_back(delta);
+    }
+
+    return chain;
+}
+
+
+void Appcast::SetDeltaChain(const std::vector<AppcastDelta>& chain)
+{
+    DeltaChain.clear();
+    for ( size_t i = 0; i < chain.size(); i++ )
+    {
+        if ( i )
+            DeltaChain += '\n';
+        AppendComponentValue(DeltaChain, chain[i].From.c_str());
+        DeltaChain += '\t';
+        AppendComponentValue(DeltaChain, chain[i].To.c_str());
+        DeltaChain += '\t';
+        AppendComponentValue(DeltaChain, chain[i].URL.c_str());
+        DeltaChain += '\t';
+        AppendComponentValue(DeltaChain, chain[i].EdDSASignature.c_str());
+        DeltaChain += '\t';
+        AppendComponentValue(DeltaChain, chain[i].DsaSignature.c_str());
+    }
+}
+
+
+int Appcast::GetCheckInterval() const
+{
+    const long interval = strtol(CheckInterval.c_str(), NULL, 10);
+    if ( interval <= 0 )
+        return 0;
+    return interval > INT_MAX ? INT_MAX : int(interval);
+}
+
+
+time_t Appcast::GetPubDate() const
+{
+    // e.g. "Wed, 09 Jan 2019 14:30:00 +0100"; the day of week is optional
+    const char *s = PubDate.c_str();
+    const char *comma = strchr(s, ',');
+    if ( comma )
+        s = comma + 1;
+
+    int day, year, hour, minute, second = 0;
+    char month[4], zone[8] = "";
+    const int fields = sscanf(s, "%d %3s %d %d:%d:%d %7s", &day, month, &year, &hour, &minute, &second, zone);
+    if ( fields < 5 )
+        return 0;
+    if ( fields == 5 )
+    {
+        // the seconds are optional too
+        second = 0;
+        sscanf(s, "%d %3s %d %d:%d %7s", &day, month, &year, &hour, &minute, zone);
+    }
+
+    static const char *const MONTHS[] =
+        { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    int mon = -1;
+    for ( int i = 0; i < 12; i++ )
+    {
+        if ( _stricmp(month, MONTHS[i]) == 0 )
+            mon = i;
+    }
+    if ( mon == -1 )
+        return 0;
+
+    // two-digit years are allowed by RFC 822
+    if ( year < 100 )
+        year += year < 70 ? 2000 : 1900;
+
+    struct tm t = { 0 };
+    t.tm_year = year - 1900;
+    t.tm_mon = mon;
+    t.tm_mday = day;
+    t.tm_hour = hour;
+    t.tm_min = minute;
+    t.tm_sec = second;
+    const time_t utc = _mkgmtime(&t);
+    if ( utc == time_t(-1) )
+        return 0;
+
+    // offset of the time zone from UTC in minutes
+    int offset = 0;
+    if ( zone[0] == '+' || zone[0] == '-' )
+    {
+        const int hhmm = atoi(zone + 1);
+        offset = (hhmm / 100) * 60 + hhmm % 100;
+        if ( zone[0] == '-' )
+            offset = -offset;
+    }
     else
     {
-        it = std::find_if(ctxt.items.begin(), ctxt.items.end(), is_windows_version_acceptable);
-        if (it != ctxt.items.end())
-            return *it;
-        else 
-            return Appcast(); // There are no items that meet the set minimum os version
+        static const struct { const char *name; int offset; } ZONES[] =
+        {
+            { "EST", -5 * 60 }, { "EDT", -4 * 60 },
+            { "CST", -6 * 60 }, { "CDT", -5 * 60 },
+            { "MST", -7 * 60 }, { "MDT", -6 * 60 },
+            { "PST", -8 * 60 }, { "PDT", -7 * 60 }
+        };
+        // anything else, including GMT and UT, is taken as UTC
+        for ( size_t i = 0; i < sizeof(ZONES) / sizeof(ZONES[0]); i++ )
+        {
+            if ( _stricmp(zone, ZONES[i].name) == 0 )
+                offset = ZONES[i].offset;
+        }
     }
+
+    return utc - time_t(offset) * 60;
+}
+
+
+bool Appcast::IsAvailableToRolloutGroup(unsigned group, time_t now) const
+{
+    const long interval = strtol(PhasedRolloutInterval.c_str(), NULL, 10);
+    if ( interval <= 0 )
+        return true;
+
+    // the rollout can't be phased without knowing when it started
+    const time_t published = GetPubDate();
+    if ( !published )
+        return true;
+
+    return now >= published + time_t(group) * interval;
+}
+
+
+bool Appcast::IsCritical(const VersionKey& installedVersion) const
+{
+    if ( CriticalUpdate.empty() )
+        return false;
+    if ( CriticalUpdate == "true" )
+        return true;
+
+    return installedVersion < VersionKey(CriticalUpdate);
 }
 
 } // namespace winsparkle
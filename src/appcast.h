@@ -26,11 +26,64 @@
 #ifndef _appcast_h_
 #define _appcast_h_
 
+#include <memory>
 #include <string>
+#include <vector>
+#include <time.h>
 
 namespace winsparkle
 {
 
+class VersionKey;
+
+/**
+    Additional package installed together with the update, e.g. a language
+    pack or a plugin, from a <sparkle:component> element of the item.
+
+    See Appcast::GetComponents().
+ */
+struct AppcastComponent
+{
+    AppcastComponent() : Priority(0) {}
+
+    /// URL of the package
+    std::string DownloadURL;
+
+    /// Size of the package in bytes, as given by the feed, may be empty
+    std::string Length;
+
+    /// Hex-encoded SHA-256 hash of the package, may be empty
+    std::string Sha256;
+
+    /// Ed25519 signature of the package
+    std::string EdDSASignature;
+
+    /// Signing signature of the package
+    std::string DsaSignature;
+
+    /// Download order, lower values first (sparkle:priority attribute)
+    int Priority;
+};
+
+/// A step of a chain of delta updates, see Appcast::GetDeltaChain().
+struct AppcastDelta
+{
+    /// Version the delta applies to
+    std::string From;
+
+    /// Version the delta turns it into
+    std::string To;
+
+    /// URL of the delta
+    std::string URL;
+
+    /// Ed25519 signature of the delta
+    std::string EdDSASignature;
+
+    /// Signing signature of the delta
+    std::string DsaSignature;
+};
+
 /**
     This class contains information from the appcast.
  */
@@ -43,12 +96,51 @@ struct Appcast
     /// URL of the update
     std::string DownloadURL;
 
+    /**
+        URLs of mirrors of DownloadURL, separated by whitespace, see
+        GetDownloadURLs().
+
+        These come from <sparkle:mirror> elements of the item.
+     */
+    std::string MirrorURLs;
+
+    /**
+        Additional packages of the update, one per line, see
+        GetComponents().
+
+        These come from <sparkle:component> elements of the item.
+     */
+    std::string Components;
+
     /// Signing signature of the update
     std::string DsaSignature;
 
+    /// Ed25519 signature of the update
+    std::string EdDSASignature;
+
+    /// Ed25519 signature of the update's chunked digest
+    std::string EdDSAChunkedSignature;
+
+    /**
+        URL of the hashes of the update's chunks, whose SHA-256 hash is the
+        chunked digest, see HasChunkManifest().
+
+        A download damaged e.g. by a proxy can then be repaired by
+        downloading only the chunks that don't match their hashes.
+     */
+    std::string ChunkManifestURL;
+
     /// URL of the release notes page
     std::string ReleaseNotesURL;
 
+    /**
+        Contents of the ReleaseNotesURL page, if UpdateChecker downloaded
+        it already, so that the UI doesn't have to.
+
+        This doesn't come from the feed and isn't cached with it.
+     */
+    std::string ReleaseNotes;
+
     /// URL to launch in web browser (instead of downloading update ourselves)
     std::string WebBrowserURL;
 
@@ -67,6 +159,73 @@ struct Appcast
     // Arguments passed on the the updater executable
     std::string InstallerArguments;
 
+    /// "true" if the installer must be run elevated, see IsElevationRequired()
+    std::string InstallerRequiresElevation;
+
+    /// Size of the update in bytes, as given by the feed, may be empty
+    std::string Length;
+
+    /// Hex-encoded SHA-256 hash of the update, may be empty
+    std::string Sha256;
+
+    /// Content encoding the server may send the update with, see IsCompressed()
+    std::string Encoding;
+
+    /// Publication date of the update (RFC 822), see GetPubDate()
+    std::string PubDate;
+
+    /**
+        Interval between the phases of a gradual rollout of the update, in
+        seconds, see IsAvailableToRolloutGroup().
+
+        This comes from the <sparkle:phasedRolloutInterval> element.
+     */
+    std::string PhasedRolloutInterval;
+
+    /**
+        Update channel of the item (e.g. "beta"), from the
+        <sparkle:channel> element. Empty for the default channel, which
+        all installations get updates from.
+     */
+    std::string Channel;
+
+    /**
+        Whether the update is critical, see IsCritical(): "true" if the item
+        has a <sparkle:criticalUpdate> element without any sparkle:version
+        attribute, otherwise the value of the attribute. Empty if the item
+        has no such element.
+     */
+    std::string CriticalUpdate;
+
+    /// Version the delta update below applies to, see HasDelta()
+    std::string DeltaFrom;
+
+    /// URL of the delta update
+    std::string DeltaURL;
+
+    /// Signing signature of the delta update
+    std::string DeltaDsaSignature;
+
+    /// Ed25519 signature of the delta update
+    std::string DeltaEdDSASignature;
+
+    /**
+        Delta updates leading from the installed version to this one through
+        older releases, one per line, see GetDeltaChain().
+
+        Only set if there's no direct delta update (see HasDelta()).
+     */
+    std::string DeltaChain;
+
+    /**
+        Minimum interval between update checks requested by the feed, in
+        seconds, see GetCheckInterval().
+
+        This comes from the <sparkle:checkInterval> element of <channel>,
+        which must precede the items to be found.
+     */
+    std::string CheckInterval;
+
     /**
         Initializes the struct with data from XML appcast feed.
 
@@ -74,12 +233,35 @@ struct Appcast
         the rest is ignored. Entries that are not appliable (e.g. for different
         OS) are likewise skipped.
 
+        If the entry has a delta update (in <sparkle:deltas>) from
+        @a installedVersion, it is read too, see HasDelta(). Otherwise, the
+        older entries' delta updates are used to find a chain of them from
+        @a installedVersion, see GetDeltaChain().
+
         Throws on error.
         Returns NULL if no error ocurred, but there was no update in the appcast.
 
-        @param xml Appcast feed data.
+        @param xml               Appcast feed data.
+        @param installedVersion  Build version of the installed app.
+        @param channels          Update channels to accept items from, see
+                                 AppcastChannel::SetAllowedChannels().
+     */
+    static Appcast Load(const std::string& xml,
+                        const std::string& installedVersion = std::string(),
+                        const std::string& channels = std::string());
+
+    /**
+        Returns the OS value (see Os) of items meant for this module,
+        "windows-x64" or "windows-x86", according to its bitness, or
+        "windows-arm64" when running on ARM64 Windows.
      */
-    static Appcast Load(const std::string& xml);
+    static std::string GetHostOs();
+
+    /**
+        Returns the version of this OS as MAJOR.MINOR.SERVICEPACK, the
+        version that items' MinOSVersion is compared against.
+     */
+    static std::string GetHostOSVersion();
 
     /// Returns true if the struct constains valid data.
     bool IsValid() const { return !Version.empty(); }
@@ -87,6 +269,399 @@ struct Appcast
     /// If true, then download and install the update ourselves.
     /// If false, launch a web browser to WebBrowserURL.
     bool HasDownload() const { return !DownloadURL.empty(); }
+
+    /**
+        May the update be downloaded compressed (gzip or deflate, from the
+        enclosure's sparkle:encoding attribute)?
+
+        The server must then send it with the Content-Encoding header, as
+        the OS's HTTP stack decompresses it while it's downloaded. Other
+        encodings aren't supported and the update is downloaded as it is.
+        Length, Sha256 and the signatures are of the decompressed file.
+     */
+    bool IsCompressed() const { return Encoding == "gzip" || Encoding == "deflate"; }
+
+    /// Returns DownloadURL followed by the MirrorURLs, if any.
+    std::vector<std::string> GetDownloadURLs() const;
+
+    /// Is the update made of more than the installer at DownloadURL?
+    bool HasComponents() const { return !Components.empty(); }
+
+    /**
+        Returns the additional packages of the update in the order they
+        should be downloaded in, i.e. sorted by their priority; packages with
+        the same priority keep their order in the feed.
+
+        The installer at DownloadURL always comes first, before any of them.
+     */
+    std::vector<AppcastComponent> GetComponents() const;
+
+    /// Adds a package to the update, after the existing ones.
+    void AddComponent(const AppcastComponent& component);
+
+    /**
+        Is there a delta update, i.e. a binary patch that turns the installer
+        of DeltaFrom version into the one at DownloadURL?
+     */
+    bool HasDelta() const { return !DeltaFrom.empty() && !DeltaURL.empty(); }
+
+    /// Is there a chain of delta updates, see GetDeltaChain()?
+    bool HasDeltaChain() const { return !DeltaChain.empty(); }
+
+    /**
+        Returns the delta updates that turn the installer of the installed
+        version into the one at DownloadURL when applied one after another,
+        in that order. Each of them comes from the <sparkle:deltas> of a
+        newer release, the last one from this item's. Empty if there's no
+        such chain.
+     */
+    std::vector<AppcastDelta> GetDeltaChain() const;
+
+    /// Sets DeltaChain to @a chain, see GetDeltaChain().
+    void SetDeltaChain(const std::vector<AppcastDelta>& chain);
+
+    /// Can the chunks in ChunkManifestURL be trusted, i.e. are they signed?
+    bool HasChunkManifest() const { return !ChunkManifestURL.empty() && !EdDSAChunkedSignature.empty(); }
+
+    /// Returns CheckInterval in seconds, 0 if the feed doesn't set it.
+    int GetCheckInterval() const;
+
+    /// Returns PubDate as UTC time, 0 if it's missing or malformed.
+    time_t GetPubDate() const;
+
+    /**
+        Is the update available to installations in phased rollout group
+        @a group already?
+
+        If the feed sets PhasedRolloutInterval, the update is released to
+        the installations gradually: to group 0 at PubDate, to group 1 one
+        interval later and so on, to all of them PHASED_ROLLOUT_GROUPS - 1
+        intervals after PubDate. Each installation is randomly assigned to
+        one of the groups.
+
+        @param group  The installation's group, less than
+                      PHASED_ROLLOUT_GROUPS.
+        @param now    Current time.
+
+        @return true if the update isn't rolled out gradually, or if the
+                rollout reached @a group.
+     */
+    bool IsAvailableToRolloutGroup(unsigned group, time_t now) const;
+
+    /**
+        Is the update critical (e.g. a security fix) for the installed
+        version?
+
+        It is if the item marks it with <sparkle:criticalUpdate>, unless the
+        element's sparkle:version attribute says it's only critical for
+        versions older than @a installedVersion.
+
+        Critical updates can't be skipped, aren't rolled out gradually and
+        are shown to the user right away.
+     */
+    bool IsCritical(const VersionKey& installedVersion) const;
+
+    /**
+        Should the installer be launched elevated right away?
+
+        Installers that need administrator rights would otherwise ask for
+        them themselves. Many do so by restarting themselves elevated.
+     */
+    bool IsElevationRequired() const
+    {
+        return InstallerRequiresElevation == "true" || InstallerRequiresElevation == "1";
+    }
+};
+
+/**
+    Found update, shared by the threads it's handed to.
+
+    The appcast is copied once, when the update is found; from then on the
+    UI, UpdateDownloader and the asynchronous checks only share the
+    pointer. It is never modified after that, so it needs no locking.
+ */
+typedef std::shared_ptr<const Appcast> AppcastPtr;
+
+/// Number of groups installations are divided into for phased rollouts.
+const unsigned PHASED_ROLLOUT_GROUPS = 7;
+
+
+/**
+    All items of an appcast feed.
+
+    Unlike Appcast, which only holds the update selected for this system,
+    this keeps every item of the feed, so that items can be selected by
+    different criteria without parsing the feed again.
+
+    The items' text is kept in a single buffer, an item itself is just a few
+    offsets into it. Whether an item is meant for this system is determined
+    only once, when it is added.
+ */
+class AppcastChannel
+{
+public:
+    /// Fields of an item, see the corresponding Appcast members.
+    enum Field
+    {
+        Field_Version,
+        Field_ShortVersionString,
+        Field_DownloadURL,
+        Field_MirrorURLs,
+        Field_Components,
+        Field_DsaSignature,
+        Field_EdDSASignature,
+        Field_EdDSAChunkedSignature,
+        Field_ReleaseNotesURL,
+        Field_WebBrowserURL,
+        Field_Title,
+        Field_Description,
+        Field_Os,
+        Field_MinOSVersion,
+        Field_InstallerArguments,
+        Field_InstallerRequiresElevation,
+        Field_Length,
+        Field_Sha256,
+        Field_Encoding,
+        Field_PubDate,
+        Field_PhasedRolloutInterval,
+        Field_Channel,
+        Field_CriticalUpdate,
+        Field_DeltaFrom,
+        Field_DeltaURL,
+        Field_DeltaDsaSignature,
+        Field_DeltaEdDSASignature,
+        Field_ChunkManifestURL,
+        Field_DeltaChain,
+
+        Field_Max
+    };
+
+    AppcastChannel() : m_keepAllDescriptions(false) {}
+
+    /**
+        Parses all items of the XML appcast feed.
+
+        Throws on error.
+
+        @param xml               Appcast feed data.
+        @param installedVersion  Build version of the installed app, to read
+                                 the items' delta updates from, if any.
+        @param channels          Update channels to accept items from, see
+                                 SetAllowedChannels().
+     */
+    static AppcastChannel Load(const std::string& xml,
+                               const std::string& installedVersion = std::string(),
+                               const std::string& channels = std::string());
+
+    /**
+        Sets the update channels (see Appcast::Channel) whose items are
+        suitable, in addition to the items in the default channel.
+
+        Must be called before any items are added.
+
+        @param channels  Comma-separated channel names, e.g. "beta,nightly".
+     */
+    void SetAllowedChannels(const std::string& channels);
+
+    /**
+        Keeps the Appcast::Description of all items, not only of those that
+        can be offered, see AddItem().
+
+        Must be called before any items are added.
+     */
+    void SetKeepAllDescriptions() { m_keepAllDescriptions = true; }
+
+    /**
+        Adds an item at the end of the channel.
+
+        The item's Appcast::Description is only kept if it can be offered,
+        i.e. if both IsOSVersionAcceptable() and IsChannelAllowed() are true
+        for it, and is empty otherwise.
+     */
+    void AddItem(const Appcast& item);
+
+    /// Sets the channel's Appcast::CheckInterval, included in all items.
+    void SetCheckInterval(const std::string& interval) { m_checkInterval = interval; }
+
+    /// Returns the channel's Appcast::CheckInterval.
+    const std::string& GetCheckInterval() const { return m_checkInterval; }
+
+    /// Returns the number of items in the channel.
+    size_t GetItemCount() const { return m_items.size(); }
+
+    /// Returns value of the item's field.
+    std::string GetField(size_t index, Field field) const;
+
+    /// Returns the item as Appcast.
+    Appcast GetItem(size_t index) const;
+
+    /// Returns the Appcast member corresponding to the field.
+    static std::string Appcast::*GetFieldMember(Field field);
+
+    /// Does this OS version satisfy the item's minimum OS version, if any?
+    bool IsOSVersionAcceptable(size_t index) const { return m_items[index].osVersionAcceptable; }
+
+    /// Is the item in the default channel or in one of the allowed ones?
+    bool IsChannelAllowed(size_t index) const { return m_items[index].channelAllowed; }
+
+    /**
+        Is the item meant for this system?
+
+        That is the case if its OS is "windows", or "windows-x64" or
+        "windows-x86" matching this module's bitness ("windows-arm64" on
+        ARM64 Windows), and if both IsOSVersionAcceptable() and
+        IsChannelAllowed() are true.
+     */
+    bool IsSuitable(size_t index) const;
+
+    /**
+        Is the item a build matching this module's bitness on ARM64 Windows?
+
+        Such builds run emulated, so they are only used if they are newer
+        than the first suitable native build, see GetUpdate().
+     */
+    bool IsSuitableEmulated(size_t index) const;
+
+    /**
+        Returns indexes of all items sorted from the newest version to the
+        oldest. Items with the same version are in feed order.
+     */
+    const std::vector<size_t>& GetVersionIndex() const;
+
+    /**
+        Returns the newest item for which @a pred(channel, index) is true,
+        or invalid Appcast if there's none.
+     */
+    template<typename Pred>
+    Appcast FindLatest(Pred pred) const
+    {
+        const std::vector<size_t>& index = GetVersionIndex();
+        for ( std::vector<size_t>::const_iterator i = index.begin(); i != index.end(); ++i )
+        {
+            if ( pred(*this, *i) )
+                return GetItem(*i);
+        }
+        return Appcast();
+    }
+
+    /**
+        Returns the update to use, as Appcast::Load() does.
+
+        This is the first suitable item (see IsSuitable()) in feed order or,
+        if there's none, the first item in an allowed channel whose minimum
+        OS version is met. On ARM64 Windows, an emulated build (see
+        IsSuitableEmulated()) that comes before the first native one is
+        used instead, unless they have the same version.
+     */
+    Appcast GetUpdate() const;
+
+private:
+    // Platform the item is for, according to its OS field.
+    enum ItemOs
+    {
+        ItemOs_Windows,
+        ItemOs_WindowsX86,
+        ItemOs_WindowsX64,
+        ItemOs_WindowsARM64,
+        ItemOs_Other
+    };
+
+    struct Item
+    {
+        // Start of each field's value in m_strings. Fields are stored one
+        // after another, so a value ends where the next one starts.
+        size_t fields[Field_Max + 1];
+
+        ItemOs os;
+        bool osVersionAcceptable;
+        bool channelAllowed;
+    };
+
+    std::string m_strings;
+    std::vector<Item> m_items;
+    std::string m_checkInterval;
+    std::vector<std::string> m_allowedChannels;
+    bool m_keepAllDescriptions;
+
+    // built on demand by GetVersionIndex()
+    mutable std::vector<size_t> m_versionIndex;
+};
+
+
+/**
+    Parser of appcast feeds that can be fed the data piecewise, as they are
+    being downloaded.
+
+    By default, parsing stops as soon as an item suitable for this system is
+    found, so that the rest of the feed doesn't need to be downloaded.
+ */
+class AppcastParser
+{
+public:
+    /**
+        Creates the parser. Throws on error.
+
+        @param allItems          If true, parse the whole feed instead of
+                                 stopping at the first suitable item.
+        @param installedVersion  Build version of the installed app, to read
+                                 the items' delta updates from, if any.
+        @param channels          Update channels to accept items from, see
+                                 AppcastChannel::SetAllowedChannels().
+     */
+    AppcastParser(bool allItems = false,
+                  const std::string& installedVersion = std::string(),
+                  const std::string& channels = std::string());
+    ~AppcastParser();
+
+    /// Formats of the feed.
+    enum Format
+    {
+        Format_Auto,    ///< Detect from the data, e.g. JSON if it starts with '{'
+        Format_RSS,     ///< Sparkle's RSS feed
+        Format_JSON,    ///< JSON feed, described in README.md
+        Format_Binary   ///< See BinaryAppcast
+    };
+
+    /**
+        Sets the feed's format, e.g. one known from its Content-Type.
+
+        Must be called before Feed(). The format is detected from the data
+        by default.
+     */
+    void SetFormat(Format format);
+
+    /// Returns the format of a feed with given Content-Type header value.
+    static Format GetFormatFromContentType(const std::string& contentType);
+
+    /**
+        Parse next chunk of the feed.
+
+        Throws on error.
+
+        @return false if the parser doesn't need any more data.
+     */
+    bool Feed(const void *data, size_t len);
+
+    /**
+        Finish parsing and return the result, as Appcast::Load() does.
+
+        Call this after all of the data were fed to the parser (or when
+        Feed() returned false). Throws on error.
+     */
+    Appcast Finish();
+
+    /// Returns the items parsed so far.
+    const AppcastChannel& GetChannel() const;
+
+    /// Returns the channel the items go to, e.g. to set it up before Feed().
+    AppcastChannel& GetChannel();
+
+private:
+    AppcastParser(const AppcastParser&);
+    AppcastParser& operator=(const AppcastParser&);
+
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
 };
 
 } // namespace winsparkle
@@ -24,28 +24,116 @@
  */
 
 #include "appcontroller.h"
+#include "threads.h"
+
+#include <vector>
 
 
 namespace winsparkle
 {
 
-CriticalSection ApplicationController::ms_csVars;
+/*--------------------------------------------------------------------------*
+                              callbacks table
+ *--------------------------------------------------------------------------*/
 
-win_sparkle_error_callback_t               ApplicationController::ms_cbError = NULL;
-win_sparkle_can_shutdown_callback_t        ApplicationController::ms_cbIsReadyToShutdown = NULL;
-win_sparkle_shutdown_request_callback_t    ApplicationController::ms_cbRequestShutdown = NULL;
-win_sparkle_did_find_update_callback_t     ApplicationController::ms_cbDidFindUpdate = NULL;
-win_sparkle_did_not_find_update_callback_t ApplicationController::ms_cbDidNotFindUpdate = NULL;
-win_sparkle_update_cancelled_callback_t    ApplicationController::ms_cbUpdateCancelled = NULL;
+namespace
+{
 
-bool ApplicationController::IsReadyToShutdown()
+/*
+    The application's callbacks.
+
+    A table is never modified once published: setters publish a modified
+    copy instead. So the callbacks are called without holding any lock and
+    a slow callback doesn't hold up other threads, nor can it deadlock with
+    a thread setting callbacks.
+ */
+struct Callbacks
+{
+    win_sparkle_error_callback_t               error;
+    win_sparkle_can_shutdown_callback_t        isReadyToShutdown;
+    win_sparkle_shutdown_request_callback_t    requestShutdown;
+    win_sparkle_did_find_update_callback_t     didFindUpdate;
+    win_sparkle_did_not_find_update_callback_t didNotFindUpdate;
+    win_sparkle_update_cancelled_callback_t    updateCancelled;
+    win_sparkle_download_progress_callback_t   downloadProgress;
+    void                                      *downloadProgressUserData;
+    int                                        downloadProgressInterval;
+    win_sparkle_update_downloaded_callback_t   updateDownloaded;
+    void                                      *updateDownloadedUserData;
+};
+
+const Callbacks NO_CALLBACKS = { 0 };
+
+// the current table
+const Callbacks * volatile g_callbacks = &NO_CALLBACKS;
+
+/*
+    Replaced tables.
+
+    Another thread may still be calling a callback from a replaced table, and
+    there's no telling when it's done, so they are kept until the DLL is
+    unloaded. Callbacks are set a few times at startup, so this stays small.
+ */
+struct RetiredCallbacks
+{
+    ~RetiredCallbacks()
+    {
+        for ( size_t i = 0; i < tables.size(); i++ )
+            delete tables[i];
+    }
+
+    std::vector<const Callbacks*> tables;
+};
+
+// serializes modifications of the table and guards g_retiredCallbacks
+CriticalSection g_csCallbacks;
+RetiredCallbacks g_retiredCallbacks;
+
+inline const Callbacks& GetCallbacks()
 {
+    // volatile read has acquire semantics, the table's contents are
+    // visible once the pointer is
+    return *g_callbacks;
+}
+
+/*
+    Helper for publishing a new table: copies the current one, to be
+    modified; the copy replaces the current table when this goes out of scope.
+ */
+class CallbacksUpdate
+{
+public:
+    CallbacksUpdate() : m_lock(g_csCallbacks), m_table(new Callbacks(GetCallbacks())) {}
+
+    ~CallbacksUpdate()
     {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_cbIsReadyToShutdown )
-            return (*ms_cbIsReadyToShutdown)() == 0 ? false : true;
+        const Callbacks *old = g_callbacks;
+        InterlockedExchangePointer(reinterpret_cast<void* volatile*>(const_cast<Callbacks* volatile*>(&g_callbacks)),
+                                   m_table);
+        if ( old != &NO_CALLBACKS )
+            g_retiredCallbacks.tables.push_back(old);
     }
 
+    Callbacks *operator->() { return m_table; }
+
+private:
+    CriticalSectionLocker m_lock;
+    Callbacks *m_table;
+};
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                              ApplicationController
+ *--------------------------------------------------------------------------*/
+
+bool ApplicationController::IsReadyToShutdown()
+{
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.isReadyToShutdown )
+        return (*cb.isReadyToShutdown)() == 0 ? false : true;
+
     // default implementations:
 
     return true;
@@ -53,13 +141,11 @@ bool ApplicationController::IsReadyToShutdown()
 
 void ApplicationController::RequestShutdown()
 {
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.requestShutdown )
     {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_cbRequestShutdown )
-        {
-            (*ms_cbRequestShutdown)();
-            return;
-        }
+        (*cb.requestShutdown)();
+        return;
     }
 
     // default implementations:
@@ -69,51 +155,121 @@ void ApplicationController::RequestShutdown()
 
 void ApplicationController::NotifyUpdateError()
 {
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_cbError )
-        {
-            (*ms_cbError)();
-            return;
-        }
-    }
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.error )
+        (*cb.error)();
 }
 
 void ApplicationController::NotifyUpdateFound()
 {
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        if (ms_cbDidFindUpdate)
-        {
-            (*ms_cbDidFindUpdate)();
-            return;
-        }
-    }
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.didFindUpdate )
+        (*cb.didFindUpdate)();
 }
 
 void ApplicationController::NotifyUpdateNotFound()
 {
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_cbDidNotFindUpdate )
-        {
-            (*ms_cbDidNotFindUpdate)();
-            return;
-        }
-    }
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.didNotFindUpdate )
+        (*cb.didNotFindUpdate)();
 }
 
 void ApplicationController::NotifyUpdateCancelled()
 {
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_cbUpdateCancelled )
-        {
-            (*ms_cbUpdateCancelled)();
-            return;
-        }
-    }
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.updateCancelled )
+        (*cb.updateCancelled)();
+}
+
+void ApplicationController::NotifyDownloadProgress(size_t downloaded, size_t total, size_t bytesPerSecond)
+{
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.downloadProgress )
+        (*cb.downloadProgress)(downloaded, total, bytesPerSecond, cb.downloadProgressUserData);
+}
+
+int ApplicationController::GetDownloadProgressInterval()
+{
+    const Callbacks& cb = GetCallbacks();
+    return cb.downloadProgress ? cb.downloadProgressInterval : -1;
+}
+
+void ApplicationController::NotifyUpdateDownloaded(const std::wstring& path)
+{
+    const Callbacks& cb = GetCallbacks();
+    if ( cb.updateDownloaded )
+        (*cb.updateDownloaded)(path.c_str(), cb.updateDownloadedUserData);
+}
+
+void ApplicationController::SetErrorCallback(win_sparkle_error_callback_t callback)
+{
+    CallbacksUpdate update;
+    update->error = callback;
+}
+
+void ApplicationController::SetCanShutdownCallback(win_sparkle_can_shutdown_callback_t callback)
+{
+    CallbacksUpdate update;
+    update->isReadyToShutdown = callback;
+}
+
+void ApplicationController::SetShutdownRequestCallback(win_sparkle_shutdown_request_callback_t callback)
+{
+    CallbacksUpdate update;
+    update->requestShutdown = callback;
+}
+
+void ApplicationController::SetDidFindUpdateCallback(win_sparkle_did_find_update_callback_t callback)
+{
+    CallbacksUpdate update;
+    update->didFindUpdate = callback;
 }
 
+void ApplicationController::SetDidNotFindUpdateCallback(win_sparkle_did_not_find_update_callback_t callback)
+{
+    CallbacksUpdate update;
+    update->didNotFindUpdate = callback;
+}
+
+void ApplicationController::SetUpdateCancelledCallback(win_sparkle_update_cancelled_callback_t callback)
+{
+    CallbacksUpdate update;
+    update->updateCancelled = callback;
+}
+
+void ApplicationController::SetDownloadProgressCallback(win_sparkle_download_progress_callback_t callback,
+                                                        void *userData,
+                                                        int minInterval)
+{
+    CallbacksUpdate update;
+    update->downloadProgress = callback;
+    update->downloadProgressUserData = userData;
+    update->downloadProgressInterval = minInterval < 0 ? 0 : minInterval;
+}
+
+void ApplicationController::SetUpdateDownloadedCallback(win_sparkle_update_downloaded_callback_t callback,
+                                                        void *userData)
+{
+    CallbacksUpdate update;
+    update->updateDownloaded = callback;
+    update->updateDownloadedUserData = userData;
+}
+
+void ApplicationController::SetCallbacks(const win_sparkle_config_t& config)
+{
+    CallbacksUpdate update;
+    if ( config.error_callback )
+        update->error = config.error_callback;
+    if ( config.can_shutdown_callback )
+        update->isReadyToShutdown = config.can_shutdown_callback;
+    if ( config.shutdown_request_callback )
+        update->requestShutdown = config.shutdown_request_callback;
+    if ( config.did_find_update_callback )
+        update->didFindUpdate = config.did_find_update_callback;
+    if ( config.did_not_find_update_callback )
+        update->didNotFindUpdate = config.did_not_find_update_callback;
+    if ( config.update_cancelled_callback )
+        update->updateCancelled = config.update_cancelled_callback;
+}
 
 } // namespace winsparkle
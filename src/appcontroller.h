@@ -27,7 +27,6 @@
 #define _appcontroller_h_
 
 #include "winsparkle.h"
-#include "threads.h"
 
 
 namespace winsparkle
@@ -69,6 +68,18 @@ public:
     /// Notify that an update was cancelled.
     static void NotifyUpdateCancelled();
 
+    /// Notify about the progress of the update's download.
+    static void NotifyDownloadProgress(size_t downloaded, size_t total, size_t bytesPerSecond);
+
+    /**
+        Returns the minimum interval between NotifyDownloadProgress() calls
+        in milliseconds, or -1 if the application doesn't want them.
+     */
+    static int GetDownloadProgressInterval();
+
+    /// Notify that a verified update file is ready at @a path.
+    static void NotifyUpdateDownloaded(const std::wstring& path);
+
     //@}
 
     /**
@@ -77,61 +88,39 @@ public:
     //@{
 
     /// Set the win_sparkle_error_callback_t function
-    static void SetErrorCallback(win_sparkle_error_callback_t callback)
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        ms_cbError = callback;
-    }
+    static void SetErrorCallback(win_sparkle_error_callback_t callback);
 
     /// Set the win_sparkle_can_shutdown_callback_t function
-    static void SetCanShutdownCallback(win_sparkle_can_shutdown_callback_t callback)
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        ms_cbIsReadyToShutdown = callback;
-    }
+    static void SetCanShutdownCallback(win_sparkle_can_shutdown_callback_t callback);
 
     /// Set the win_sparkle_shutdown_request_callback_t function
-    static void SetShutdownRequestCallback(win_sparkle_shutdown_request_callback_t callback)
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        ms_cbRequestShutdown = callback;
-    }
+    static void SetShutdownRequestCallback(win_sparkle_shutdown_request_callback_t callback);
 
     /// Set the win_sparkle_did_find_update_callback_t function
-    static void SetDidFindUpdateCallback(win_sparkle_did_find_update_callback_t callback)
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        ms_cbDidFindUpdate = callback;
-    }
+    static void SetDidFindUpdateCallback(win_sparkle_did_find_update_callback_t callback);
 
     /// Set the win_sparkle_did_not_find_update_callback_t function
-    static void SetDidNotFindUpdateCallback(win_sparkle_did_not_find_update_callback_t callback)
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        ms_cbDidNotFindUpdate = callback;
-    }
+    static void SetDidNotFindUpdateCallback(win_sparkle_did_not_find_update_callback_t callback);
 
     /// Set the win_sparkle_update_cancelled_callback_t function
-    static void SetUpdateCancelledCallback(win_sparkle_update_cancelled_callback_t callback)
-    {
-        CriticalSectionLocker lock(ms_csVars);
-        ms_cbUpdateCancelled = callback;
-    }
+    static void SetUpdateCancelledCallback(win_sparkle_update_cancelled_callback_t callback);
+
+    /// Set the win_sparkle_download_progress_callback_t function
+    static void SetDownloadProgressCallback(win_sparkle_download_progress_callback_t callback,
+                                            void *userData,
+                                            int minInterval);
+
+    /// Set the win_sparkle_update_downloaded_callback_t function
+    static void SetUpdateDownloadedCallback(win_sparkle_update_downloaded_callback_t callback,
+                                            void *userData);
+
+    /// Set all non-NULL callbacks from @a config at once
+    static void SetCallbacks(const win_sparkle_config_t& config);
 
     //@}
 
 private:
     ApplicationController(); // cannot be instantiated
-
-    // guards the variables below:
-    static CriticalSection ms_csVars;
-
-    static win_sparkle_error_callback_t               ms_cbError;
-    static win_sparkle_can_shutdown_callback_t        ms_cbIsReadyToShutdown;
-    static win_sparkle_shutdown_request_callback_t    ms_cbRequestShutdown;
-    static win_sparkle_did_find_update_callback_t     ms_cbDidFindUpdate;
-    static win_sparkle_did_not_find_update_callback_t ms_cbDidNotFindUpdate;
-    static win_sparkle_update_cancelled_callback_t    ms_cbUpdateCancelled;
 };
 
 } // namespace winsparkle
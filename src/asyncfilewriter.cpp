@@ -0,0 +1,286 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "asyncfilewriter.h"
+#include "error.h"
+
+#include <new>
+#include <malloc.h>
+#include <string.h>
+
+namespace winsparkle
+{
+
+namespace
+{
+
+// alignment of the buffers, so that the OS can write them out efficiently
+const size_t BUFFER_ALIGNMENT = 4096;
+
+const unsigned long long NO_FAILURE = ~0ULL;
+
+} // anonymous namespace
+
+
+AsyncFileWriter::AsyncFileWriter()
+    : m_nextSlot(0), m_lentSlot(NULL),
+      m_handle(INVALID_HANDLE_VALUE),
+      m_end(0), m_failedAt(NO_FAILURE)
+{
+    memset(m_slots, 0, sizeof(m_slots));
+    for ( unsigned i = 0; i < SLOT_COUNT; i++ )
+    {
+        // GetOverlappedResult() requires manual-reset events
+        m_slots[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if ( !m_slots[i].overlapped.hEvent )
+        {
+            Win32Exception err;
+            for ( unsigned j = 0; j < i; j++ )
+                CloseHandle(m_slots[j].overlapped.hEvent);
+            throw err;
+        }
+    }
+}
+
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    Abort();
+
+    for ( unsigned i = 0; i < SLOT_COUNT; i++ )
+    {
+        CloseHandle(m_slots[i].overlapped.hEvent);
+        _aligned_free(m_slots[i].buffer);
+    }
+}
+
+
+void AsyncFileWriter::Open(const std::wstring& path, bool append, bool temporary)
+{
+    if ( IsOpen() )
+        throw std::runtime_error("File already open");
+
+    m_handle = CreateFileW(path.c_str(),
+                           GENERIC_WRITE,
+                           FILE_SHARE_READ,
+                           NULL,
+                           append ? OPEN_ALWAYS : CREATE_ALWAYS,
+                           (temporary ? FILE_ATTRIBUTE_TEMPORARY : FILE_ATTRIBUTE_NORMAL) |
+                               FILE_FLAG_OVERLAPPED,
+                           NULL);
+    if ( m_handle == INVALID_HANDLE_VALUE )
+        throw Win32Exception("Cannot create file");
+
+    m_end = 0;
+    m_failedAt = NO_FAILURE;
+
+    if ( append )
+    {
+        LARGE_INTEGER size;
+        if ( !GetFileSizeEx(m_handle, &size) )
+        {
+            Win32Exception err("Cannot open file");
+            Abort();
+            throw err;
+        }
+        m_end = size.QuadPart;
+    }
+}
+
+
+void AsyncFileWriter::Preallocate(unsigned long long size)
+{
+    if ( size <= m_end )
+        return;
+
+    LARGE_INTEGER pos;
+    pos.QuadPart = size;
+    if ( !SetFilePointerEx(m_handle, pos, NULL, FILE_BEGIN) || !SetEndOfFile(m_handle) )
+        throw Win32Exception("Cannot allocate disk space for file");
+}
+
+
+void *AsyncFileWriter::GetBuffer(size_t& len)
+{
+    if ( len > BUFFER_SIZE )
+        len = BUFFER_SIZE;
+
+    m_lentSlot = &AcquireSlot();
+    return m_lentSlot->buffer;
+}
+
+
+void AsyncFileWriter::WriteAt(unsigned long long offset, const void *data, size_t len)
+{
+    if ( m_failedAt != NO_FAILURE )
+        throw std::runtime_error("Cannot write to file");
+
+    // If the data are in the buffer we lent out, just write it.
+    if ( m_lentSlot && data == m_lentSlot->buffer && len <= BUFFER_SIZE )
+    {
+        Slot& slot = *m_lentSlot;
+        m_lentSlot = NULL;
+        StartWrite(slot, offset, len);
+        return;
+    }
+
+    m_lentSlot = NULL;
+
+    const char *ptr = static_cast<const char*>(data);
+    while ( len )
+    {
+        const size_t chunk = len < BUFFER_SIZE ? len : BUFFER_SIZE;
+        Slot& slot = AcquireSlot();
+        memcpy(slot.buffer, ptr, chunk);
+        StartWrite(slot, offset, chunk);
+
+        ptr += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+
+void AsyncFileWriter::Close()
+{
+    if ( !IsOpen() )
+        return;
+
+    for ( unsigned i = 0; i < SLOT_COUNT; i++ )
+        WaitFor(m_slots[i]);
+
+    // remove any preallocated space that wasn't used after all
+    Truncate(m_end);
+
+    CloseHandle(m_handle);
+    m_handle = INVALID_HANDLE_VALUE;
+}
+
+
+void AsyncFileWriter::Abort()
+{
+    if ( !IsOpen() )
+        return;
+
+    CancelIo(m_handle);
+
+    for ( unsigned i = 0; i < SLOT_COUNT; i++ )
+    {
+        try
+        {
+            WaitFor(m_slots[i]);
+        }
+        catch ( ... )
+        {
+            // already recorded in m_failedAt
+        }
+    }
+
+    try
+    {
+        Truncate(m_failedAt < m_end ? m_failedAt : m_end);
+    }
+    catch ( ... )
+    {
+    }
+
+    CloseHandle(m_handle);
+    m_handle = INVALID_HANDLE_VALUE;
+}
+
+
+AsyncFileWriter::Slot& AsyncFileWriter::AcquireSlot()
+{
+    Slot& slot = m_slots[m_nextSlot];
+    m_nextSlot = (m_nextSlot + 1) % SLOT_COUNT;
+
+    WaitFor(slot);
+
+    if ( !slot.buffer )
+    {
+        slot.buffer = _aligned_malloc(BUFFER_SIZE, BUFFER_ALIGNMENT);
+        if ( !slot.buffer )
+            throw std::bad_alloc();
+    }
+
+    return slot;
+}
+
+
+void AsyncFileWriter::WaitFor(Slot& slot)
+{
+    if ( !slot.pending )
+        return;
+    slot.pending = false;
+
+    DWORD written;
+    const bool ok = GetOverlappedResult(m_handle, &slot.overlapped, &written, TRUE) != 0;
+    if ( !ok || written != slot.length )
+    {
+        if ( slot.offset < m_failedAt )
+            m_failedAt = slot.offset;
+        if ( !ok )
+            throw Win32Exception("Cannot write to file");
+        throw std::runtime_error("Cannot write to file");
+    }
+}
+
+
+void AsyncFileWriter::StartWrite(Slot& slot, unsigned long long offset, size_t len)
+{
+    HANDLE event = slot.overlapped.hEvent;
+    memset(&slot.overlapped, 0, sizeof(slot.overlapped));
+    slot.overlapped.hEvent = event;
+    slot.overlapped.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+    slot.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    if ( !WriteFile(m_handle, slot.buffer, static_cast<DWORD>(len), NULL, &slot.overlapped) &&
+         GetLastError() != ERROR_IO_PENDING )
+    {
+        if ( offset < m_failedAt )
+            m_failedAt = offset;
+        throw Win32Exception("Cannot write to file");
+    }
+
+    // Even if the write completed synchronously, the result is retrieved
+    // with GetOverlappedResult() in WaitFor().
+    slot.pending = true;
+    slot.length = len;
+    slot.offset = offset;
+
+    if ( offset + len > m_end )
+        m_end = offset + len;
+}
+
+
+void AsyncFileWriter::Truncate(unsigned long long size)
+{
+    LARGE_INTEGER pos;
+    pos.QuadPart = size;
+    if ( !SetFilePointerEx(m_handle, pos, NULL, FILE_BEGIN) || !SetEndOfFile(m_handle) )
+        throw Win32Exception("Cannot write to file");
+}
+
+} // namespace winsparkle
@@ -0,0 +1,142 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _asyncfilewriter_h_
+#define _asyncfilewriter_h_
+
+#include <string>
+#include <windows.h>
+
+namespace winsparkle
+{
+
+/**
+    Writes a file asynchronously, so that writing the data overlaps with
+    producing more of them (e.g. downloading).
+
+    The data are written with overlapped I/O from a small ring of
+    page-aligned buffers; a buffer is only reused once its write completed.
+    Because of that, a write error may be reported (by throwing) from a later
+    call than the one that started the write.
+
+    This class is not thread-safe.
+ */
+class AsyncFileWriter
+{
+public:
+    /// Size of a single write buffer.
+    static const size_t BUFFER_SIZE = 1024 * 1024;
+
+    AsyncFileWriter();
+
+    /// Calls Abort() if the file is still open.
+    ~AsyncFileWriter();
+
+    /**
+        Create the file, or open an existing one to append to it if
+        @a append is true.
+
+        A new file is created with FILE_ATTRIBUTE_TEMPORARY if @a temporary
+        is true: the cache manager then keeps its data in memory rather than
+        writing them to the disk, as long as there's enough memory.
+
+        Throws on error.
+     */
+    void Open(const std::wstring& path, bool append, bool temporary = false);
+
+    /// Is the file open?
+    bool IsOpen() const { return m_handle != INVALID_HANDLE_VALUE; }
+
+    /**
+        Preallocate the file to @a size bytes.
+
+        Windows always performs writes that extend the file synchronously, so
+        this should be done whenever the final size is known in advance.
+        Close() truncates the file after the last written byte again.
+     */
+    void Preallocate(unsigned long long size);
+
+    /**
+        Get a buffer to put the data for the next Write() or WriteAt() into.
+
+        Passing this buffer to them avoids copying the data. The buffer is
+        valid until the next call to any of the writing methods.
+
+        @param len  Requested size, lowered to BUFFER_SIZE if it's larger.
+     */
+    void *GetBuffer(size_t& len);
+
+    /// Append the data after the last byte written so far.
+    void Write(const void *data, size_t len) { WriteAt(m_end, data, len); }
+
+    /// Write the data at given offset.
+    void WriteAt(unsigned long long offset, const void *data, size_t len);
+
+    /**
+        Wait for all writes to finish and close the file.
+
+        Throws if any of the writes failed.
+     */
+    void Close();
+
+    /**
+        Close the file without throwing, e.g. when an error occurred.
+
+        Any preallocated space not written to yet is removed from the file,
+        as are any data after a failed write. For files written sequentially,
+        this means that all of the file's content is valid.
+     */
+    void Abort();
+
+private:
+    struct Slot
+    {
+        OVERLAPPED overlapped;
+        void *buffer;
+        size_t length;
+        unsigned long long offset;
+        bool pending;
+    };
+
+    // return the next slot, once it is free to use
+    Slot& AcquireSlot();
+    // wait for the slot's write to finish, throw if it failed
+    void WaitFor(Slot& slot);
+    void StartWrite(Slot& slot, unsigned long long offset, size_t len);
+    void Truncate(unsigned long long size);
+
+    static const unsigned SLOT_COUNT = 4;
+    Slot m_slots[SLOT_COUNT];
+    unsigned m_nextSlot;
+    Slot *m_lentSlot;
+
+    HANDLE m_handle;
+    // end of the written data and offset of the first failed write, if any
+    unsigned long long m_end, m_failedAt;
+};
+
+} // namespace winsparkle
+
+#endif // _asyncfilewriter_h_
@@ -0,0 +1,318 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "binaryappcast.h"
+#include "error.h"
+#include "versionkey.h"
+
+#include <map>
+#include <stdexcept>
+#include <string.h>
+#include <windows.h>
+
+namespace winsparkle
+{
+
+namespace
+{
+
+const char BINARY_APPCAST_MAGIC[4] = { 'W', 'S', 'B', 'A' };
+const unsigned BINARY_APPCAST_VERSION = 1;
+
+// size of the header, in 32-bit numbers
+const size_t HEADER_WORDS = 8;
+const size_t HEADER_SIZE = HEADER_WORDS * 4;
+
+// Largest files accepted by Convert():
+const size_t MAX_FEED_FILE_SIZE = 256 * 1024 * 1024;
+
+inline unsigned ReadUInt32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+void WriteUInt32(std::string& data, unsigned value)
+{
+    const unsigned char bytes[4] =
+    {
+        (unsigned char)(value & 0xFF), (unsigned char)((value >> 8) & 0xFF),
+        (unsigned char)((value >> 16) & 0xFF), (unsigned char)((value >> 24) & 0xFF)
+    };
+    data.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+void ThrowInvalid()
+{
+    throw std::runtime_error("Invalid binary appcast.");
+}
+
+// Builds the string pool, storing each distinct text only once.
+class StringPool
+{
+public:
+    // returns the offset of the text in the pool
+    unsigned Add(const std::string& text)
+    {
+        if ( text.empty() )
+            return 0;
+
+        std::map<std::string, unsigned>::const_iterator i = m_offsets.find(text);
+        if ( i != m_offsets.end() )
+            return i->second;
+
+        const unsigned offset = unsigned(m_data.size());
+        m_data += text;
+        m_offsets[text] = offset;
+        return offset;
+    }
+
+    const std::string& GetData() const { return m_data; }
+
+private:
+    std::string m_data;
+    std::map<std::string, unsigned> m_offsets;
+};
+
+std::string ReadFeedFile(const std::wstring& path)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE )
+        throw Win32Exception("Failed to open appcast feed");
+
+    std::string data;
+    char buffer[64 * 1024];
+    DWORD read;
+    while ( ReadFile(file, buffer, sizeof(buffer), &read, NULL) && read > 0 )
+    {
+        data.append(buffer, read);
+        if ( data.size() > MAX_FEED_FILE_SIZE )
+        {
+            CloseHandle(file);
+            throw std::runtime_error("Appcast feed is too large.");
+        }
+    }
+    CloseHandle(file);
+    return data;
+}
+
+void WriteBinaryFile(const std::wstring& path, const std::string& data)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE )
+        throw Win32Exception("Failed to create binary appcast");
+
+    DWORD written = 0;
+    const bool ok = WriteFile(file, data.data(), DWORD(data.length()), &written, NULL) &&
+                    written == data.length();
+    CloseHandle(file);
+    if ( !ok )
+        throw Win32Exception("Failed to write binary appcast");
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                            BinaryAppcast class
+ *--------------------------------------------------------------------------*/
+
+BinaryAppcast::BinaryAppcast(const void *data, size_t size)
+{
+    if ( !IsBinaryAppcast(data, size) || size < HEADER_SIZE )
+        ThrowInvalid();
+
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    unsigned header[HEADER_WORDS];
+    for ( size_t i = 0; i < HEADER_WORDS; i++ )
+        header[i] = ReadUInt32(bytes + 4 * i);
+
+    if ( header[1] != BINARY_APPCAST_VERSION )
+        throw std::runtime_error("Unsupported binary appcast version.");
+
+    m_itemCount = header[2];
+    m_fieldCount = header[3];
+    m_checkIntervalOffset = header[4];
+    m_checkIntervalLength = header[5];
+    const size_t poolOffset = header[6];
+    const size_t poolSize = header[7];
+
+    // The table follows the header and the pool must be within the data.
+    // All sizes are 32-bit numbers, so none of this can overflow.
+    const unsigned long long tableSize = (unsigned long long)m_itemCount * m_fieldCount * 8;
+    if ( m_fieldCount == 0 ||
+         HEADER_SIZE + tableSize > poolOffset ||
+         poolOffset > size || poolSize > size - poolOffset ||
+         m_checkIntervalOffset > poolSize || m_checkIntervalLength > poolSize - m_checkIntervalOffset )
+        ThrowInvalid();
+
+    m_table = bytes + HEADER_SIZE;
+    m_pool = reinterpret_cast<const char*>(bytes + poolOffset);
+
+    // Check all values once, so that GetField() doesn't have to.
+    const unsigned char *end = m_table + size_t(tableSize);
+    for ( const unsigned char *p = m_table; p != end; p += 8 )
+    {
+        const unsigned offset = ReadUInt32(p);
+        const unsigned len = ReadUInt32(p + 4);
+        if ( offset > poolSize || len > poolSize - offset )
+            ThrowInvalid();
+    }
+}
+
+
+bool BinaryAppcast::IsBinaryAppcast(const void *data, size_t size)
+{
+    return size >= sizeof(BINARY_APPCAST_MAGIC) &&
+           memcmp(data, BINARY_APPCAST_MAGIC, sizeof(BINARY_APPCAST_MAGIC)) == 0;
+}
+
+
+const char *BinaryAppcast::GetField(size_t index, AppcastChannel::Field field, size_t& len) const
+{
+    if ( size_t(field) >= m_fieldCount )
+    {
+        // added to the format after the data were written
+        len = 0;
+        return m_pool;
+    }
+
+    const unsigned char *p = m_table + (index * m_fieldCount + field) * 8;
+    len = ReadUInt32(p + 4);
+    return m_pool + ReadUInt32(p);
+}
+
+
+Appcast BinaryAppcast::GetItem(size_t index) const
+{
+    Appcast appcast;
+    for ( int i = 0; i < AppcastChannel::Field_Max; i++ )
+    {
+        const AppcastChannel::Field field = AppcastChannel::Field(i);
+        size_t len;
+        const char *value = GetField(index, field, len);
+        (appcast.*AppcastChannel::GetFieldMember(field)).assign(value, len);
+    }
+    appcast.CheckInterval = GetCheckInterval();
+    return appcast;
+}
+
+
+std::string BinaryAppcast::GetCheckInterval() const
+{
+    return std::string(m_pool + m_checkIntervalOffset, m_checkIntervalLength);
+}
+
+
+size_t BinaryAppcast::CountNewerThan(const VersionKey& version) const
+{
+    // items are sorted from the newest, find the first one not newer
+    size_t first = 0, last = m_itemCount;
+    while ( first < last )
+    {
+        const size_t middle = first + (last - first) / 2;
+        size_t len;
+        const char *value = GetField(middle, AppcastChannel::Field_Version, len);
+        if ( VersionKey(std::string(value, len)) > version )
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first;
+}
+
+
+void BinaryAppcast::AddTo(AppcastChannel& channel, bool allItems, const std::string& installedVersion) const
+{
+    channel.SetCheckInterval(GetCheckInterval());
+
+    // Older items are never offered, so they don't need to be looked at.
+    const size_t count = allItems || installedVersion.empty()
+                         ? m_itemCount
+                         : CountNewerThan(VersionKey(installedVersion));
+
+    for ( size_t i = 0; i < count; i++ )
+    {
+        channel.AddItem(GetItem(i));
+        // the items are sorted, so the first suitable one is the newest
+        if ( !allItems && channel.IsSuitable(channel.GetItemCount() - 1) )
+            break;
+    }
+}
+
+
+std::string BinaryAppcast::Write(const AppcastChannel& channel)
+{
+    const std::vector<size_t>& order = channel.GetVersionIndex();
+
+    StringPool pool;
+    std::string table;
+    table.reserve(order.size() * AppcastChannel::Field_Max * 8);
+    for ( size_t i = 0; i < order.size(); i++ )
+    {
+        for ( int f = 0; f < AppcastChannel::Field_Max; f++ )
+        {
+            const std::string value = channel.GetField(order[i], AppcastChannel::Field(f));
+            WriteUInt32(table, pool.Add(value));
+            WriteUInt32(table, unsigned(value.size()));
+        }
+    }
+    const std::string& checkInterval = channel.GetCheckInterval();
+    const unsigned checkIntervalOffset = pool.Add(checkInterval);
+
+    if ( HEADER_SIZE + table.size() + pool.GetData().size() > 0xFFFFFFFFULL )
+        throw std::runtime_error("Appcast is too large for the binary format.");
+
+    std::string data;
+    data.reserve(HEADER_SIZE + table.size() + pool.GetData().size());
+    data.append(BINARY_APPCAST_MAGIC, sizeof(BINARY_APPCAST_MAGIC));
+    WriteUInt32(data, BINARY_APPCAST_VERSION);
+    WriteUInt32(data, unsigned(order.size()));
+    WriteUInt32(data, AppcastChannel::Field_Max);
+    WriteUInt32(data, checkIntervalOffset);
+    WriteUInt32(data, unsigned(checkInterval.size()));
+    WriteUInt32(data, unsigned(HEADER_SIZE + table.size()));
+    WriteUInt32(data, unsigned(pool.GetData().size()));
+    data += table;
+    data += pool.GetData();
+    return data;
+}
+
+
+void BinaryAppcast::Convert(const std::wstring& feedPath, const std::wstring& binaryPath)
+{
+    const std::string feed = ReadFeedFile(feedPath);
+
+    AppcastParser parser(true);
+    // every client selects its own item, keep everything of all of them
+    parser.GetChannel().SetKeepAllDescriptions();
+    parser.Feed(feed.data(), feed.size());
+    parser.Finish();
+
+    WriteBinaryFile(binaryPath, Write(parser.GetChannel()));
+}
+
+} // namespace winsparkle
@@ -0,0 +1,138 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _binaryappcast_h_
+#define _binaryappcast_h_
+
+#include "appcast.h"
+
+#include <string>
+
+namespace winsparkle
+{
+
+class VersionKey;
+
+/**
+    Read-only view of an appcast in WinSparkle's binary format.
+
+    The format is meant for large feeds and for the snapshot of the last
+    appcast: it's used in place, e.g. memory-mapped or as downloaded,
+    without parsing it or creating objects for items that aren't needed.
+    It consists of
+
+    - a header of eight 32-bit little-endian numbers: the "WSBA" magic,
+      format version (BINARY_APPCAST_VERSION), number of items, number of
+      fields of each item, offset and length of the channel's check
+      interval in the string pool, and offset and size of the string pool
+      in the data;
+    - the item table: for each item, offset and length in the string pool
+      of each field, as 32-bit numbers in the order of AppcastChannel::Field.
+      Items are sorted from the newest version to the oldest, so that the
+      items newer than the installed version can be found by binary search;
+    - the string pool with UTF-8 text of the fields, not NUL-terminated.
+
+    Fields may be added at the end of AppcastChannel::Field without changing
+    the format version: items of older data have them empty.
+ */
+class BinaryAppcast
+{
+public:
+    /**
+        Creates a view of binary appcast data.
+
+        The data aren't copied and must stay valid while the view is used.
+
+        Throws if the data aren't a valid binary appcast.
+     */
+    BinaryAppcast(const void *data, size_t size);
+
+    /// Do the data start like a binary appcast?
+    static bool IsBinaryAppcast(const void *data, size_t size);
+
+    /// Returns the number of items.
+    size_t GetItemCount() const { return m_itemCount; }
+
+    /**
+        Returns the value of the item's field.
+
+        The value points into the data and isn't NUL-terminated.
+     */
+    const char *GetField(size_t index, AppcastChannel::Field field, size_t& len) const;
+
+    /// Returns the item as Appcast, including the channel's check interval.
+    Appcast GetItem(size_t index) const;
+
+    /// Returns the channel's Appcast::CheckInterval.
+    std::string GetCheckInterval() const;
+
+    /**
+        Returns the number of items with a version newer than @a version,
+        which are the first items of the table.
+     */
+    size_t CountNewerThan(const VersionKey& version) const;
+
+    /**
+        Adds the items to the channel, as AppcastParser does.
+
+        @param channel           Channel to add the items to.
+        @param allItems          If false, stop at the first suitable item
+                                 and only consider items newer than
+                                 @a installedVersion, if it's not empty.
+        @param installedVersion  Build version of the installed app.
+     */
+    void AddTo(AppcastChannel& channel, bool allItems, const std::string& installedVersion) const;
+
+    /**
+        Returns the channel's items in the binary format.
+
+        Items are sorted as GetVersionIndex() does and text used by more
+        than one field is only stored once.
+     */
+    static std::string Write(const AppcastChannel& channel);
+
+    /**
+        Converts an appcast feed file (RSS or JSON) to the binary format.
+
+        All items of the feed are kept, including their release notes,
+        so that each client can select the one it needs. Delta updates,
+        which are selected for the installed version when the feed is
+        parsed, are not included.
+
+        Throws on error.
+     */
+    static void Convert(const std::wstring& feedPath, const std::wstring& binaryPath);
+
+private:
+    const unsigned char *m_table;
+    const char *m_pool;
+    size_t m_itemCount;
+    size_t m_fieldCount;
+    size_t m_checkIntervalOffset, m_checkIntervalLength;
+};
+
+} // namespace winsparkle
+
+#endif // _binaryappcast_h_
@@ -0,0 +1,285 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "downloadbackend.h"
+
+#include "download.h"
+#include "error.h"
+#include "threads.h"
+#include "utils.h"
+
+#include <windows.h>
+#include <objbase.h>
+#include <bits.h>
+#include <bits3_0.h>
+
+#ifdef _MSC_VER
+#pragma comment(lib, "ole32.lib")
+#endif
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// How often to check the transfer's state, in milliseconds
+const DWORD BITS_POLL_INTERVAL = 500;
+
+
+bool GetBITSManager(COMPtr<IBackgroundCopyManager>& manager)
+{
+    return SUCCEEDED(CoCreateInstance(__uuidof(BackgroundCopyManager), NULL,
+                                      CLSCTX_LOCAL_SERVER,
+                                      __uuidof(IBackgroundCopyManager),
+                                      reinterpret_cast<void**>(manager.Receive())));
+}
+
+
+std::string JobIDToString(const GUID& id)
+{
+    wchar_t buf[40];
+    StringFromGUID2(id, buf, 40);
+    return WideToAnsi(buf);
+}
+
+bool StringToJobID(const std::string& s, GUID& id)
+{
+    return SUCCEEDED(CLSIDFromString(const_cast<LPOLESTR>(AnsiToWide(s).c_str()), &id));
+}
+
+
+// Finds a job created before for downloading @a url and returns the
+// file's local path, or returns false if there's no such usable job.
+bool OpenExistingJob(IBackgroundCopyManager *manager,
+                     const std::string& jobID,
+                     const std::string& url,
+                     COMPtr<IBackgroundCopyJob>& job,
+                     std::wstring& path)
+{
+    GUID id;
+    if ( jobID.empty() || !StringToJobID(jobID, id) )
+        return false;
+    if ( FAILED(manager->GetJob(id, job.Receive())) )
+        return false; // finished and forgotten by now, or never existed
+
+    BG_JOB_STATE state;
+    if ( FAILED(job->GetState(&state)) ||
+         state == BG_JOB_STATE_ACKNOWLEDGED || state == BG_JOB_STATE_CANCELLED )
+        return false;
+
+    // make sure the job really is for this file
+    COMPtr<IEnumBackgroundCopyFiles> files;
+    COMPtr<IBackgroundCopyFile> file;
+    ULONG fetched = 0;
+    if ( FAILED(job->EnumFiles(files.Receive())) ||
+         files->Next(1, file.Receive(), &fetched) != S_OK || fetched != 1 )
+        return false;
+
+    LPWSTR remoteName = NULL, localName = NULL;
+    bool ok = false;
+    if ( SUCCEEDED(file->GetRemoteName(&remoteName)) &&
+         SUCCEEDED(file->GetLocalName(&localName)) )
+    {
+        ok = WideToAnsi(remoteName) == url;
+        path = localName;
+    }
+    CoTaskMemFree(remoteName);
+    CoTaskMemFree(localName);
+
+    if ( !ok )
+        job->Cancel(); // can't be used for anything else
+    return ok;
+}
+
+
+// Lets the job share the file with other computers on the LAN, see
+// Download_PeerCaching. Does nothing if BITS is older than 3.0.
+void EnablePeerCaching(IBackgroundCopyJob *job)
+{
+    COMPtr<IBackgroundCopyJob4> job4;
+    if ( SUCCEEDED(job->QueryInterface(__uuidof(IBackgroundCopyJob4),
+                                       reinterpret_cast<void**>(job4.Receive()))) )
+    {
+        job4->SetPeerCachingFlags(BG_JOB_ENABLE_PEERCACHING_CLIENT |
+                                  BG_JOB_ENABLE_PEERCACHING_SERVER);
+    }
+}
+
+
+std::string GetJobError(IBackgroundCopyJob *job)
+{
+    std::string msg("Update file download failed");
+
+    COMPtr<IBackgroundCopyError> error;
+    LPWSTR description = NULL;
+    if ( SUCCEEDED(job->GetError(error.Receive())) &&
+         SUCCEEDED(error->GetErrorDescription(LANGIDFROMLCID(GetThreadLocale()), &description)) )
+    {
+        msg += ": ";
+        msg += WideToAnsi(description);
+        CoTaskMemFree(description);
+    }
+
+    return msg;
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                             public functions
+ *--------------------------------------------------------------------------*/
+
+bool DownloadFileInBackground(const std::string& url,
+                              const std::wstring& filename,
+                              IDownloadSink *sink,
+                              IBackgroundDownloadSink *bgSink,
+                              Thread *onThread,
+                              int flags)
+{
+    COMInitializer com;
+
+    COMPtr<IBackgroundCopyManager> manager;
+    if ( !GetBITSManager(manager) )
+        return false; // BITS service disabled or otherwise unavailable
+
+    // Continue the transfer started e.g. in a previous session, if any.
+    COMPtr<IBackgroundCopyJob> job;
+    std::wstring path;
+    if ( OpenExistingJob(manager.Get(), bgSink->GetBackgroundJob(), url, job, path) )
+    {
+        std::string jobID;
+        GUID id;
+        if ( SUCCEEDED(job->GetId(&id)) )
+            jobID = JobIDToString(id);
+        bgSink->SetBackgroundJob(jobID, path);
+    }
+    else
+    {
+        GUID id;
+        CheckHResult(manager->CreateJob(L"WinSparkle update download",
+                                        BG_JOB_TYPE_DOWNLOAD, &id, job.Receive()),
+                     "Failed to create background download");
+
+        // the highest priority that still only uses idle bandwidth, unless
+        // it should give way to other background transfers too
+        job->SetPriority((flags & Download_LowPriority) ? BG_JOB_PRIORITY_LOW
+                                                        : BG_JOB_PRIORITY_NORMAL);
+
+        path = bgSink->GetBackgroundTarget(filename);
+        HRESULT hr = job->AddFile(AnsiToWide(url).c_str(), path.c_str());
+        if ( FAILED(hr) )
+        {
+            job->Cancel();
+            CheckHResult(hr, "Failed to start background download");
+        }
+
+        // remember the job before it starts, to find it again after restart
+        bgSink->SetBackgroundJob(JobIDToString(id), path);
+    }
+
+    if ( flags & Download_PeerCaching )
+        EnablePeerCaching(job.Get());
+
+    CheckHResult(job->Resume(), "Failed to start background download");
+
+    // Note that if the thread is terminated, the job is left running; it
+    // will be picked up by the next download of the same file.
+    bool lengthSet = false;
+    for ( ;; )
+    {
+        BG_JOB_STATE state;
+        CheckHResult(job->GetState(&state), "Failed to query background download");
+
+        BG_JOB_PROGRESS progress;
+        if ( SUCCEEDED(job->GetProgress(&progress)) )
+        {
+            if ( !lengthSet && progress.BytesTotal != BG_SIZE_UNKNOWN )
+            {
+                sink->SetLength(size_t(progress.BytesTotal));
+                lengthSet = true;
+            }
+            bgSink->SetBackgroundProgress(size_t(progress.BytesTransferred));
+        }
+
+        switch ( state )
+        {
+            case BG_JOB_STATE_TRANSFERRED:
+                // this moves the file to its final location
+                CheckHResult(job->Complete(), "Failed to finish background download");
+                return true;
+
+            case BG_JOB_STATE_ERROR:
+            {
+                const std::string msg = GetJobError(job.Get());
+                job->Cancel();
+                throw std::runtime_error(msg);
+            }
+
+            case BG_JOB_STATE_CANCELLED:
+            case BG_JOB_STATE_ACKNOWLEDGED:
+                throw std::runtime_error("Background download was cancelled.");
+
+            case BG_JOB_STATE_SUSPENDED:
+                // e.g. by an administrator or another tool
+                job->Resume();
+                break;
+
+            default:
+                // still in progress; transient errors are retried by BITS
+                break;
+        }
+
+        if ( onThread )
+            onThread->GetCancellationToken().Wait(NULL, BITS_POLL_INTERVAL);
+        else
+            Sleep(BITS_POLL_INTERVAL);
+    }
+}
+
+
+void CancelBackgroundDownload(const std::string& jobID)
+{
+    if ( CancelDeliveryOptimizationDownload(jobID) )
+        return;
+
+    GUID id;
+    if ( jobID.empty() || !StringToJobID(jobID, id) )
+        return;
+
+    COMInitializer com;
+
+    COMPtr<IBackgroundCopyManager> manager;
+    COMPtr<IBackgroundCopyJob> job;
+    if ( GetBITSManager(manager) && SUCCEEDED(manager->GetJob(id, job.Receive())) )
+        job->Cancel(); // fails harmlessly if it's finished already
+}
+
+} // namespace winsparkle
@@ -0,0 +1,121 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "databudget.h"
+#include "settings.h"
+#include "logger.h"
+
+#include <windows.h>
+
+namespace winsparkle
+{
+
+namespace
+{
+
+// The usage is kept for the day it was counted on, as yyyymmdd.
+const char DATA_USAGE_DAY_VALUE[] = "DataUsageDay";
+// ... and the bytes used on each type of connection on that day.
+const char *const DATA_USAGE_VALUES[] =
+{
+    "DataUsageUnrestricted",
+    "DataUsageMetered",
+    "DataUsageRestricted"
+};
+
+unsigned GetToday()
+{
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+    return now.wYear * 10000 + now.wMonth * 100 + now.wDay;
+}
+
+// Returns today's usage of connections of @a cost so far.
+unsigned long long GetUsage(ConnectionCost cost)
+{
+    unsigned day = 0;
+    unsigned long long used = 0;
+    if ( !Settings::ReadConfigValue(DATA_USAGE_DAY_VALUE, day) || day != GetToday() ||
+         !Settings::ReadConfigValue(DATA_USAGE_VALUES[cost], used) )
+        return 0;
+    return used;
+}
+
+} // anonymous namespace
+
+
+unsigned long long DataBudget::GetAllowance(ConnectionCost cost)
+{
+    switch ( cost )
+    {
+        case ConnectionCost_Unrestricted:
+            return UNLIMITED;
+
+        case ConnectionCost_Metered:
+        {
+            const unsigned long long budget =
+                (unsigned long long)Settings::GetMeteredDownloadBudget() * 1024 * 1024;
+            const unsigned long long used = GetUsage(cost);
+            return used < budget ? budget - used : 0;
+        }
+
+        case ConnectionCost_Restricted:
+            break;
+    }
+
+    // the user may pay a lot for every byte
+    return 0;
+}
+
+
+void DataBudget::RecordUsage(ConnectionCost cost, unsigned long long bytes)
+{
+    if ( !bytes )
+        return;
+
+    try
+    {
+        const unsigned today = GetToday();
+        unsigned day = 0;
+        const bool sameDay = Settings::ReadConfigValue(DATA_USAGE_DAY_VALUE, day) && day == today;
+        const unsigned long long used = sameDay ? GetUsage(cost) : 0;
+
+        Settings::Batch batch;
+        if ( !sameDay )
+        {
+            Settings::WriteConfigValue(DATA_USAGE_DAY_VALUE, today);
+            for ( size_t i = 0; i < sizeof(DATA_USAGE_VALUES) / sizeof(DATA_USAGE_VALUES[0]); i++ )
+                Settings::DeleteConfigValue(DATA_USAGE_VALUES[i]);
+        }
+        Settings::WriteConfigValue(DATA_USAGE_VALUES[cost], used + bytes);
+        batch.Commit();
+    }
+    catch ( std::exception& e )
+    {
+        LogError(std::string("Cannot record data usage: ") + e.what());
+    }
+}
+
+} // namespace winsparkle
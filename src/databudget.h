@@ -0,0 +1,88 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _databudget_h_
+#define _databudget_h_
+
+#include "download.h"
+
+#include <stddef.h>
+#include <stdexcept>
+
+namespace winsparkle
+{
+
+/**
+    Exception thrown by background downloads when today's budget for the
+    metered connection is used up, see DataBudget.
+
+    The partial download is kept and continued by a later check.
+ */
+class DataBudgetExhaustedException : public std::runtime_error
+{
+public:
+    DataBudgetExhaustedException()
+        : std::runtime_error("Today's data budget for metered connections is used up.") {}
+};
+
+
+/**
+    Limits how much data background downloads of updates use per day on
+    metered connections, see win_sparkle_set_metered_download_budget().
+
+    The bytes downloaded in the background are counted per local calendar
+    day and per type of connection, in the settings, so that the budget
+    holds across sessions and instances of the app. A large update is then
+    downloaded over several days, each day continuing the partial download
+    left by the previous one.
+ */
+class DataBudget
+{
+public:
+    /// Returned by GetAllowance() if there's no limit.
+    static const unsigned long long UNLIMITED = ~0ULL;
+
+    /**
+        Returns how many bytes background downloads may still use today
+        on a connection of @a cost.
+
+        That's UNLIMITED for unrestricted connections and 0 for restricted
+        ones, or for metered ones if no budget is set.
+     */
+    static unsigned long long GetAllowance(ConnectionCost cost);
+
+    /// Same as GetAllowance() for the current connection.
+    static unsigned long long GetAllowance() { return GetAllowance(GetConnectionCost()); }
+
+    /**
+        Records that background downloads used @a bytes on a connection of
+        @a cost today. Only logs errors, doesn't throw.
+     */
+    static void RecordUsage(ConnectionCost cost, unsigned long long bytes);
+};
+
+} // namespace winsparkle
+
+#endif // _databudget_h_
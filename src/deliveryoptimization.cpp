@@ -0,0 +1,386 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "downloadbackend.h"
+
+#include "download.h"
+#include "error.h"
+#include "threads.h"
+#include "utils.h"
+
+#include <windows.h>
+#include <objbase.h>
+#include <oleauto.h>
+#include <stdio.h>
+
+#ifdef _MSC_VER
+#pragma comment(lib, "ole32.lib")
+#pragma comment(lib, "oleaut32.lib")
+#endif
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                         Delivery Optimization API
+ *--------------------------------------------------------------------------*/
+
+// Declarations from deliveryoptimization.h of Windows 10 SDKs, which the
+// SDKs WinSparkle is built with don't have. Only what's used is declared.
+
+namespace
+{
+
+const CLSID CLSID_DeliveryOptimization =
+    { 0x5b99fa76, 0x721c, 0x423c, { 0xad, 0xac, 0x56, 0xd0, 0x3c, 0x8a, 0x80, 0x07 } };
+const IID IID_IDOManager =
+    { 0x400e2d4a, 0x1431, 0x4c1a, { 0xa7, 0x48, 0x39, 0xca, 0x47, 0x2c, 0xfd, 0xb1 } };
+const IID IID_IDODownload =
+    { 0xfbbd7fc0, 0xc147, 0x4727, { 0xa3, 0x8d, 0x82, 0x7e, 0xf0, 0x71, 0xee, 0x77 } };
+
+enum DODownloadState
+{
+    DODownloadState_Created,
+    DODownloadState_Transferring,
+    DODownloadState_Transferred,
+    DODownloadState_Finalized,
+    DODownloadState_Aborted,
+    DODownloadState_Paused
+};
+
+enum DODownloadProperty
+{
+    DODownloadProperty_Id = 0,
+    DODownloadProperty_Uri = 1,
+    DODownloadProperty_DisplayName = 3,
+    DODownloadProperty_LocalPath = 4,
+    DODownloadProperty_ForegroundPriority = 11
+};
+
+struct DO_DOWNLOAD_STATUS
+{
+    UINT64 BytesTotal;
+    UINT64 BytesTransferred;
+    DODownloadState State;
+    HRESULT Error;
+    HRESULT ExtendedError;
+};
+
+struct DO_DOWNLOAD_ENUM_CATEGORY
+{
+    DODownloadProperty Property;
+    LPCWSTR Value;
+};
+
+struct IDODownload : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE Start(void *ranges) = 0;
+    virtual HRESULT STDMETHODCALLTYPE Pause() = 0;
+    virtual HRESULT STDMETHODCALLTYPE Abort() = 0;
+    virtual HRESULT STDMETHODCALLTYPE Finalize() = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetStatus(DO_DOWNLOAD_STATUS *status) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetProperty(DODownloadProperty propId, VARIANT *propVal) = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetProperty(DODownloadProperty propId, VARIANT *propVal) = 0;
+};
+
+struct IDOManager : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE CreateDownload(IDODownload **download) = 0;
+    virtual HRESULT STDMETHODCALLTYPE EnumDownloads(DO_DOWNLOAD_ENUM_CATEGORY *category,
+                                                    IEnumUnknown **downloads) = 0;
+};
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// How often to check the download's state, in milliseconds
+const DWORD DO_POLL_INTERVAL = 500;
+
+// Prefix of IDs of Delivery Optimization downloads, to tell them from BITS
+// jobs in IBackgroundDownloadSink::GetBackgroundJob()
+const char DO_JOB_PREFIX[] = "DO:";
+const size_t DO_JOB_PREFIX_LEN = sizeof(DO_JOB_PREFIX) - 1;
+
+
+// The service only works with callers that allow it to impersonate them.
+void SetProxyBlanket(IUnknown *proxy)
+{
+    CoSetProxyBlanket(proxy, RPC_C_AUTHN_DEFAULT, RPC_C_AUTHZ_NONE,
+                      COLE_DEFAULT_PRINCIPAL, RPC_C_AUTHN_LEVEL_DEFAULT,
+                      RPC_C_IMP_LEVEL_IMPERSONATE, NULL, EOAC_STATIC_CLOAKING);
+}
+
+
+bool GetDOManager(COMPtr<IDOManager>& manager)
+{
+    // not available before Windows 10 1809 or if disabled by policy
+    if ( FAILED(CoCreateInstance(CLSID_DeliveryOptimization, NULL, CLSCTX_LOCAL_SERVER,
+                                 IID_IDOManager,
+                                 reinterpret_cast<void**>(manager.Receive()))) )
+        return false;
+
+    SetProxyBlanket(manager.Get());
+    return true;
+}
+
+
+void SetStringProperty(IDODownload *download, DODownloadProperty prop, const std::wstring& value)
+{
+    VARIANT v;
+    VariantInit(&v);
+    v.vt = VT_BSTR;
+    v.bstrVal = SysAllocString(value.c_str());
+    const HRESULT hr = download->SetProperty(prop, &v);
+    VariantClear(&v);
+    CheckHResult(hr, "Failed to set up Delivery Optimization download");
+}
+
+
+std::wstring GetStringProperty(IDODownload *download, DODownloadProperty prop)
+{
+    std::wstring value;
+    VARIANT v;
+    VariantInit(&v);
+    if ( SUCCEEDED(download->GetProperty(prop, &v)) && v.vt == VT_BSTR && v.bstrVal )
+        value = v.bstrVal;
+    VariantClear(&v);
+    return value;
+}
+
+
+bool IsDOJobID(const std::string& jobID)
+{
+    return jobID.compare(0, DO_JOB_PREFIX_LEN, DO_JOB_PREFIX) == 0;
+}
+
+
+// Finds the download with given ID, see IsDOJobID().
+bool FindDownload(IDOManager *manager, const std::string& jobID, COMPtr<IDODownload>& download)
+{
+    const std::wstring id(AnsiToWide(jobID.substr(DO_JOB_PREFIX_LEN)));
+    DO_DOWNLOAD_ENUM_CATEGORY category = { DODownloadProperty_Id, id.c_str() };
+
+    COMPtr<IEnumUnknown> downloads;
+    COMPtr<IUnknown> item;
+    ULONG fetched = 0;
+    if ( FAILED(manager->EnumDownloads(&category, downloads.Receive())) ||
+         downloads->Next(1, item.Receive(), &fetched) != S_OK || fetched != 1 ||
+         FAILED(item->QueryInterface(IID_IDODownload,
+                                     reinterpret_cast<void**>(download.Receive()))) )
+        return false;
+
+    SetProxyBlanket(download.Get());
+    return true;
+}
+
+
+// Finds a download started before for @a url and returns the file's local
+// path, or returns false if there's no such usable download.
+bool OpenExistingDownload(IDOManager *manager,
+                          const std::string& jobID,
+                          const std::string& url,
+                          COMPtr<IDODownload>& download,
+                          std::wstring& path)
+{
+    if ( !IsDOJobID(jobID) || !FindDownload(manager, jobID, download) )
+        return false; // finished and forgotten by now, or never existed
+
+    DO_DOWNLOAD_STATUS status;
+    if ( FAILED(download->GetStatus(&status)) ||
+         status.State == DODownloadState_Finalized || status.State == DODownloadState_Aborted )
+        return false;
+
+    // make sure it really is this file
+    path = GetStringProperty(download.Get(), DODownloadProperty_LocalPath);
+    if ( WideToAnsi(GetStringProperty(download.Get(), DODownloadProperty_Uri)) != url ||
+         path.empty() )
+    {
+        download->Abort(); // can't be used for anything else
+        return false;
+    }
+
+    return true;
+}
+
+
+// Creates a new download of @a url to @a path.
+void CreateDownload(IDOManager *manager,
+                    const std::string& url,
+                    const std::wstring& path,
+                    bool foreground,
+                    COMPtr<IDODownload>& download)
+{
+    CheckHResult(manager->CreateDownload(download.Receive()),
+                 "Failed to create Delivery Optimization download");
+    SetProxyBlanket(download.Get());
+
+    SetStringProperty(download.Get(), DODownloadProperty_Uri, AnsiToWide(url));
+    SetStringProperty(download.Get(), DODownloadProperty_LocalPath, path);
+    SetStringProperty(download.Get(), DODownloadProperty_DisplayName, L"WinSparkle update download");
+
+    if ( foreground )
+    {
+        VARIANT v;
+        VariantInit(&v);
+        v.vt = VT_BOOL;
+        v.boolVal = VARIANT_TRUE;
+        download->SetProperty(DODownloadProperty_ForegroundPriority, &v);
+    }
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                             public functions
+ *--------------------------------------------------------------------------*/
+
+bool DownloadFileWithDeliveryOptimization(const std::string& url,
+                                          const std::wstring& filename,
+                                          IDownloadSink *sink,
+                                          IBackgroundDownloadSink *bgSink,
+                                          Thread *onThread,
+                                          int flags)
+{
+    COMInitializer com;
+
+    COMPtr<IDOManager> manager;
+    if ( !GetDOManager(manager) )
+        return false;
+
+    // Continue the download started e.g. in a previous session, if any.
+    COMPtr<IDODownload> download;
+    std::wstring path;
+    const std::string previousJob = bgSink->GetBackgroundJob();
+    if ( OpenExistingDownload(manager.Get(), previousJob, url, download, path) )
+    {
+        bgSink->SetBackgroundJob(previousJob, path);
+    }
+    else
+    {
+        // a BITS transfer started before the download method was changed
+        if ( !previousJob.empty() && !IsDOJobID(previousJob) )
+            CancelBackgroundDownload(previousJob);
+
+        path = bgSink->GetBackgroundTarget(filename);
+        // e.g. left over from a download that can't be continued
+        _wremove(path.c_str());
+
+        try
+        {
+            CreateDownload(manager.Get(), url, path, !(flags & Download_Background), download);
+            if ( FAILED(download->Start(NULL)) )
+            {
+                download->Abort();
+                return false;
+            }
+        }
+        catch ( std::exception& e )
+        {
+            // the HTTP backend will do the job
+            LogError(e.what());
+            if ( download.Get() )
+                download->Abort();
+            return false;
+        }
+
+        // remember the download, to find it again after restart
+        const std::wstring id = GetStringProperty(download.Get(), DODownloadProperty_Id);
+        bgSink->SetBackgroundJob(id.empty() ? std::string() : DO_JOB_PREFIX + WideToAnsi(id), path);
+    }
+
+    // Note that if the thread is terminated, the download is left running;
+    // it will be picked up by the next download of the same file.
+    bool lengthSet = false;
+    for ( ;; )
+    {
+        DO_DOWNLOAD_STATUS status;
+        CheckHResult(download->GetStatus(&status), "Failed to query Delivery Optimization download");
+
+        // the total size is 0 until it's known
+        if ( !lengthSet && status.BytesTotal && status.BytesTotal != UINT64(-1) )
+        {
+            sink->SetLength(size_t(status.BytesTotal));
+            lengthSet = true;
+        }
+        bgSink->SetBackgroundProgress(size_t(status.BytesTransferred));
+
+        switch ( status.State )
+        {
+            case DODownloadState_Transferred:
+                // this makes the file available at its final location
+                CheckHResult(download->Finalize(), "Failed to finish Delivery Optimization download");
+                return true;
+
+            case DODownloadState_Paused:
+                // paused because of an error, or by somebody else
+                if ( FAILED(status.Error) )
+                {
+                    download->Abort();
+                    CheckHResult(status.Error, "Update file download failed");
+                }
+                download->Start(NULL);
+                break;
+
+            case DODownloadState_Finalized:
+            case DODownloadState_Aborted:
+                throw std::runtime_error("Delivery Optimization download was cancelled.");
+
+            default:
+                // still in progress
+                break;
+        }
+
+        if ( onThread )
+            onThread->GetCancellationToken().Wait(NULL, DO_POLL_INTERVAL);
+        else
+            Sleep(DO_POLL_INTERVAL);
+    }
+}
+
+
+bool CancelDeliveryOptimizationDownload(const std::string& jobID)
+{
+    if ( !IsDOJobID(jobID) )
+        return false;
+
+    COMInitializer com;
+
+    COMPtr<IDOManager> manager;
+    COMPtr<IDODownload> download;
+    if ( GetDOManager(manager) && FindDownload(manager.Get(), jobID, download) )
+        download->Abort(); // fails harmlessly if it's finished already
+
+    return true;
+}
+
+} // namespace winsparkle
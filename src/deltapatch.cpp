@@ -0,0 +1,102 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "deltapatch.h"
+
+#include "error.h"
+
+#include <windows.h>
+
+namespace winsparkle
+{
+
+namespace
+{
+
+// from msdelta.h, which isn't in all SDKs
+typedef LONGLONG DELTA_FLAG_TYPE;
+const DELTA_FLAG_TYPE DELTA_FLAG_NONE = 0;
+
+typedef BOOL (WINAPI *ApplyDeltaW_t)(DELTA_FLAG_TYPE ApplyFlags,
+                                     LPCWSTR lpSourceName,
+                                     LPCWSTR lpDeltaName,
+                                     LPCWSTR lpTargetName);
+
+// Loads msdelta.dll for as long as it exists.
+class MSDeltaLibrary
+{
+public:
+    MSDeltaLibrary() : ApplyDeltaW(NULL), m_dll(NULL)
+    {
+        // load it from the system directory only, avoid DLL planting
+        wchar_t path[MAX_PATH];
+        const UINT len = GetSystemDirectoryW(path, MAX_PATH);
+        if ( len == 0 || len > MAX_PATH - 13 )
+            return;
+        wcscat_s(path, MAX_PATH, L"\\msdelta.dll");
+
+        m_dll = LoadLibraryW(path);
+        if ( m_dll )
+            ApplyDeltaW = reinterpret_cast<ApplyDeltaW_t>(GetProcAddress(m_dll, "ApplyDeltaW"));
+    }
+
+    ~MSDeltaLibrary()
+    {
+        if ( m_dll )
+            FreeLibrary(m_dll);
+    }
+
+    // NULL if not available
+    ApplyDeltaW_t ApplyDeltaW;
+
+private:
+    HMODULE m_dll;
+};
+
+} // anonymous namespace
+
+
+bool ApplyDeltaPatch(const std::wstring& source,
+                     const std::wstring& delta,
+                     const std::wstring& target)
+{
+    MSDeltaLibrary msdelta;
+    if ( !msdelta.ApplyDeltaW )
+        return false;
+
+    // remove leftovers of a previous attempt, if any
+    DeleteFileW(target.c_str());
+
+    if ( !msdelta.ApplyDeltaW(DELTA_FLAG_NONE, source.c_str(), delta.c_str(), target.c_str()) )
+    {
+        const Win32Exception error("Failed to apply delta update");
+        DeleteFileW(target.c_str()); // don't leave a partial file behind
+        throw error;
+    }
+
+    return true;
+}
+
+} // namespace winsparkle
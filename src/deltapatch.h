@@ -0,0 +1,56 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _deltapatch_h_
+#define _deltapatch_h_
+
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Reconstructs a file from an older version of it and a binary delta.
+
+    The delta must be in the format of the Windows delta compression API
+    (msdelta.dll), e.g. created with its CreateDelta() function. It is only
+    available since Windows Vista.
+
+    Throws on error, e.g. if the delta doesn't apply to @a source.
+
+    @param source  The older version of the file.
+    @param delta   The delta patch.
+    @param target  Path to write the reconstructed file to.
+
+    @return false if delta patches aren't supported by the system, true if
+            @a target was created.
+ */
+bool ApplyDeltaPatch(const std::wstring& source,
+                     const std::wstring& delta,
+                     const std::wstring& target);
+
+} // namespace winsparkle
+
+#endif // _deltapatch_h_
@@ -0,0 +1,223 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "diagnostics.h"
+
+#include "appcast.h"
+#include "download.h"
+#include "settings.h"
+#include "trace.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <string.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// The sample of the update file downloaded from each server is at most
+// this large...
+const size_t SAMPLE_MAX_BYTES = 8 * 1024 * 1024;
+
+// ...and takes at most this long, once the data started arriving (in
+// microseconds).
+const unsigned long long SAMPLE_MAX_TIME = 3 * 1000 * 1000;
+
+// Sink measuring the transfer; it keeps the data only if @a keepData.
+struct DiagnosticsSink : public IDownloadSink
+{
+    DiagnosticsSink(bool keepData, size_t maxBytes)
+        : keepData(keepData), maxBytes(maxBytes), bytes(0), firstChunk(0), transferTime(0) {}
+
+    virtual void SetLength(size_t) {}
+    virtual void SetFilename(const std::wstring&) {}
+
+    virtual void Add(const void *buffer, size_t len)
+    {
+        if ( !timer.get() )
+        {
+            timer.reset(new TraceTimer);
+            firstChunk = len;
+        }
+
+        bytes += len;
+        if ( keepData )
+        {
+            if ( maxBytes && bytes > maxBytes )
+                throw std::runtime_error("Appcast feed is too large.");
+            data.append(static_cast<const char*>(buffer), len);
+        }
+        transferTime = timer->GetMicroseconds();
+    }
+
+    virtual bool IsComplete() const
+    {
+        return !keepData && (bytes >= maxBytes || transferTime >= SAMPLE_MAX_TIME);
+    }
+
+    virtual void SetTimings(const DownloadTimings& t) { timings = t; }
+
+    bool keepData;
+    size_t maxBytes;
+
+    std::string data;
+    unsigned long long bytes;
+    // the speed is measured from the first chunk of data to the last one,
+    // so the first one's bytes don't count
+    unsigned long long firstChunk;
+    std::unique_ptr<TraceTimer> timer;
+    unsigned long long transferTime;
+    DownloadTimings timings;
+};
+
+// Measurements of one server, with the strings win_sparkle_diagnostics_host_t
+// points to.
+struct HostDiagnostics
+{
+    HostDiagnostics(const std::string& url) : url(url)
+    {
+        memset(&info, 0, sizeof(info));
+    }
+
+    // Points the strings of info to the members; must be called again
+    // whenever the object moves.
+    const win_sparkle_diagnostics_host_t& GetInfo()
+    {
+        info.url = url.c_str();
+        info.proxy = proxy.c_str();
+        info.error = error.c_str();
+        return info;
+    }
+
+    std::string url, proxy, error;
+    win_sparkle_diagnostics_host_t info;
+};
+
+// Looks up the proxy for the server and downloads from it into @a sink.
+void DiagnoseHost(HostDiagnostics& host, DiagnosticsSink& sink, int flags, Thread *onThread)
+{
+    try
+    {
+        const TraceTimer proxyTimer;
+        host.proxy = GetProxyForURL(host.url);
+        host.info.proxy_ms = unsigned(proxyTimer.GetMicroseconds() / 1000);
+
+        DownloadFile(host.url, &sink, onThread, flags);
+    }
+    catch ( const std::exception& e )
+    {
+        host.error = e.what();
+    }
+
+    host.info.resolve_ms = sink.timings.resolve;
+    host.info.connect_ms = sink.timings.connect;
+    host.info.tls_ms = sink.timings.secure;
+    host.info.ttfb_ms = sink.timings.firstByte;
+    host.info.redirects = sink.timings.redirects;
+    host.info.bytes = sink.bytes;
+    if ( sink.transferTime )
+        host.info.bytes_per_second = (sink.bytes - sink.firstChunk) * 1000000 / sink.transferTime;
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                            NetworkDiagnostics
+ *--------------------------------------------------------------------------*/
+
+NetworkDiagnostics::NetworkDiagnostics(win_sparkle_diagnostics_callback_t callback, void *userData)
+    : Thread("WinSparkle network diagnostics"),
+      m_callback(callback), m_userData(userData)
+{
+}
+
+
+void NetworkDiagnostics::Run()
+{
+    // no initialization to do, so signal readiness immediately
+    SignalReady();
+
+    win_sparkle_diagnostics_report_t report;
+    memset(&report, 0, sizeof(report));
+    report.size = sizeof(report);
+
+    // the appcast feed, downloaded as by the update checks
+    HostDiagnostics appcastHost(Settings::GetAppcastURL());
+    DiagnosticsSink feed(true, Settings::GetMaxAppcastSize());
+    DiagnoseHost(appcastHost, feed, Download_BypassProxies | Download_Compressed, this);
+
+    std::string feedVersion, feedError;
+    Appcast appcast;
+    if ( appcastHost.error.empty() )
+    {
+        const TraceTimer parseTimer;
+        try
+        {
+            appcast = Appcast::Load(feed.data, Settings::GetAppBuildVersionUTF8(),
+                                    Settings::GetUpdateChannels());
+            feedVersion = appcast.Version;
+        }
+        catch ( const std::exception& e )
+        {
+            feedError = e.what();
+        }
+        report.feed_parse_ms = unsigned(parseTimer.GetMicroseconds() / 1000);
+    }
+    feed.data.clear();
+
+    // a sample of the update file from each of its servers
+    std::vector<HostDiagnostics> mirrors;
+    const std::vector<std::string> urls = appcast.GetDownloadURLs();
+    for ( size_t i = 0; i < urls.size(); i++ )
+    {
+        mirrors.push_back(HostDiagnostics(urls[i]));
+        DiagnosticsSink sample(false, SAMPLE_MAX_BYTES);
+        DiagnoseHost(mirrors.back(), sample, 0, this);
+    }
+
+    std::vector<win_sparkle_diagnostics_host_t> mirrorInfo;
+    for ( size_t i = 0; i < mirrors.size(); i++ )
+        mirrorInfo.push_back(mirrors[i].GetInfo());
+
+    report.appcast = appcastHost.GetInfo();
+    report.feed_version = feedVersion.c_str();
+    report.feed_error = feedError.c_str();
+    report.mirrors = mirrorInfo.empty() ? NULL : &mirrorInfo[0];
+    report.mirror_count = mirrorInfo.size();
+
+    m_callback(&report, m_userData);
+}
+
+} // namespace winsparkle
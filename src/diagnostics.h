@@ -0,0 +1,57 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _diagnostics_h_
+#define _diagnostics_h_
+
+#include "threads.h"
+#include "winsparkle.h"
+
+namespace winsparkle
+{
+
+/**
+    Runs the network diagnostics of win_sparkle_run_diagnostics() and passes
+    the report to the callback.
+
+    The thread terminates itself when done.
+ */
+class NetworkDiagnostics : public Thread
+{
+public:
+    NetworkDiagnostics(win_sparkle_diagnostics_callback_t callback, void *userData);
+
+protected:
+    virtual void Run();
+    virtual bool IsJoinable() const { return false; }
+
+private:
+    win_sparkle_diagnostics_callback_t m_callback;
+    void *m_userData;
+};
+
+} // namespace winsparkle
+
+#endif // _diagnostics_h_
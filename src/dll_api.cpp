@@ -25,18 +25,124 @@
 
 #include "winsparkle.h"
 
+#include "allocstats.h"
+#include "apistall.h"
 #include "appcontroller.h"
+#include "binaryappcast.h"
 #include "settings.h"
 #include "error.h"
+#include "logger.h"
 #include "ui.h"
 #include "updatechecker.h"
 #include "updatedownloader.h"
+#include "updatescheduler.h"
+#include "serviceagent.h"
+#include "signatureverifier.h"
+#include "diagnostics.h"
+#include "download.h"
+#include "pipelinestatus.h"
+#include "stats.h"
+#include "threads.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <cstring>
 #include <ctime>
 #include <windows.h>
 
 using namespace winsparkle;
 
+namespace
+{
+
+// Returns how much of @a timeout is left since @a start (both in ms).
+DWORD GetRemainingTime(DWORD start, DWORD timeout)
+{
+    const DWORD elapsed = GetTickCount() - start;
+    return elapsed >= timeout ? 0 : timeout - elapsed;
+}
+
+// Does the part of win_sparkle_init() that uses the settings storage.
+void InitUpdateChecks()
+{
+    // first things first, but don't make the app's startup wait for it
+    UpdateDownloader::CleanLeftoversInBackground();
+
+    // check for updates
+    bool checkUpdates;
+    if ( Settings::ReadConfigValue("CheckForUpdates", checkUpdates) )
+    {
+        if ( checkUpdates )
+            UpdateScheduler::Start();
+    }
+    else // not yet configured
+    {
+        bool didRunOnce;
+        Settings::ReadConfigValue("DidRunOnce", didRunOnce, false);
+        if ( !didRunOnce )
+        {
+            // Do nothing on the first execution of the app, for better
+            // first-time impression.
+            Settings::WriteConfigValue("DidRunOnce", true);
+        }
+        else
+        {
+            // Only when the app is launched for the second time, ask the
+            // user for their permission to check for updates. In headless
+            // mode, it's up to the app to ask.
+            if ( !Settings::GetHeadlessMode() )
+                UI::AskForPermission();
+        }
+    }
+}
+
+/*
+    Runs InitUpdateChecks() on a worker thread, so that win_sparkle_init()
+    doesn't do any I/O, see win_sparkle_set_deferred_init().
+
+    It is joinable, so that win_sparkle_cleanup() can make sure it doesn't
+    start the update checks after they were stopped.
+ */
+class DeferredInitializer : public Thread
+{
+public:
+    DeferredInitializer() : Thread("WinSparkle init") {}
+
+protected:
+    virtual void Run()
+    {
+        SignalReady();
+
+        // win_sparkle_cleanup() may have been called already
+        CheckShouldTerminate();
+        FootprintRecorder footprint(WIN_SPARKLE_STATS_FOOTPRINT_INIT);
+        AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_INIT);
+        InitUpdateChecks();
+    }
+
+    virtual bool IsJoinable() const { return true; }
+};
+
+DeferredInitializer *g_deferredInit = NULL;
+
+// Copies UTF-8 string @a s into @a buffer, truncated to whole characters.
+template<size_t N>
+void CopyTruncatedUTF8(char (&buffer)[N], const std::string& s)
+{
+    size_t len = s.length();
+    if ( len >= N )
+    {
+        len = N - 1;
+        // don't cut a multi-byte character in half
+        while ( len && (s[len] & 0xC0) == 0x80 )
+            len--;
+    }
+    memcpy(buffer, s.data(), len);
+    buffer[len] = '\0';
+}
+
+} // anonymous namespace
+
 extern "C"
 {
 
@@ -46,8 +152,21 @@ extern "C"
 
 WIN_SPARKLE_API void __cdecl win_sparkle_init()
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
+        AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_INIT);
+        Tracing::Register();
+        Logger::StartWriter();
+
+        // a broken manifest is reported now, not by the first update check
+        Settings::LoadConfigManifest();
+
+        // this must be done on the calling thread, before the UI is used
+        if ( Settings::GetUIOnHostThread() )
+            UI::AttachToHostThread();
+
         // finish initialization
         if (!Settings::GetLanguage().IsOk())
         {
@@ -66,35 +185,15 @@ WIN_SPARKLE_API void __cdecl win_sparkle_init()
                 Settings::SetLanguage(lang);
         }
 
-        // first things first
-        UpdateDownloader::CleanLeftovers();
-
-        // check for updates
-        bool checkUpdates;
-        if ( Settings::ReadConfigValue("CheckForUpdates", checkUpdates) )
+        if ( Settings::GetDeferredInit() )
         {
-            if ( checkUpdates )
-            {
-                UpdateChecker *check = new PeriodicUpdateChecker();
-                check->Start();
-            }
+            g_deferredInit = new DeferredInitializer();
+            g_deferredInit->Start();
         }
-        else // not yet configured
+        else
         {
-            bool didRunOnce;
-            Settings::ReadConfigValue("DidRunOnce", didRunOnce, false);
-            if ( !didRunOnce )
-            {
-                // Do nothing on the first execution of the app, for better
-                // first-time impression.
-                Settings::WriteConfigValue("DidRunOnce", true);
-            }
-            else
-            {
-                // Only when the app is launched for the second time, ask the
-                // user for their permission to check for updates.
-                UI::AskForPermission();
-            }
+            InitUpdateChecks();
+            Stats::RecordFootprint(WIN_SPARKLE_STATS_FOOTPRINT_INIT);
         }
     }
     CATCH_ALL_EXCEPTIONS
@@ -103,11 +202,83 @@ WIN_SPARKLE_API void __cdecl win_sparkle_init()
 
 WIN_SPARKLE_API void __cdecl win_sparkle_cleanup()
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        const DWORD start = GetTickCount();
+        const DWORD timeout = DWORD(Settings::GetShutdownTimeout());
+
+        if ( g_deferredInit )
+        {
+            // it may be about to start the scheduler
+            g_deferredInit->GetCancellationToken().Cancel();
+            if ( g_deferredInit->Join(GetRemainingTime(start, timeout)) )
+                delete g_deferredInit;
+            g_deferredInit = NULL;
+        }
+
+        UpdateScheduler::Stop();
+        ServiceAgent::StopAgent();
+
+        // Tell worker threads (UpdateChecker, UpdateDownloader) to stop
+        // first, so that they don't wait for the UI or start it again...
+        Thread::TerminateAll(0);
+
+        bool finished = UI::ShutDown(GetRemainingTime(start, timeout));
+
+        // ...then wait for them; they stop as soon as they notice, even in
+        // the middle of network I/O
+        finished = Thread::TerminateAll(GetRemainingTime(start, timeout)) && finished;
+
+        if ( !finished )
+        {
+            winsparkle::LogError("Shutdown timed out, still running: " +
+                                 Thread::GetRunningThreadNames());
+        }
+
+        CloseDownloadSession();
+
+        Settings::FlushConfig();
+
+        // the application is exiting, see win_sparkle_set_install_on_exit()
+        UpdateDownloader::LaunchStagedInstaller();
+
+        // threads that are still running may yet write events
+        if ( finished )
+            Tracing::Unregister();
+
+        // last, to write out everything logged by the threads too
+        Logger::StopWriter();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_deferred_init(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetDeferredInit(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_shutdown_timeout(int milliseconds)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        UI::ShutDown();
+        if ( milliseconds < 0 )
+        {
+            winsparkle::LogError("Invalid shutdown timeout (min: 0 ms)");
+            milliseconds = 0;
+        }
 
-        // FIXME: shut down any worker UpdateChecker and UpdateDownloader threads too
+        Settings::SetShutdownTimeout(milliseconds);
     }
     CATCH_ALL_EXCEPTIONS
 }
@@ -119,6 +290,8 @@ WIN_SPARKLE_API void __cdecl win_sparkle_cleanup()
 
 WIN_SPARKLE_API void __cdecl win_sparkle_set_lang(const char *lang)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
         Settings::SetLanguage(lang);
@@ -128,6 +301,8 @@ WIN_SPARKLE_API void __cdecl win_sparkle_set_lang(const char *lang)
 
 WIN_SPARKLE_API void __cdecl win_sparkle_set_langid(unsigned short lang)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
         Settings::SetLanguage(lang);
@@ -142,6 +317,8 @@ WIN_SPARKLE_API void __cdecl win_sparkle_set_langid(unsigned short lang)
 
 WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_url(const char *url)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
         CheckForInsecureURL(url, "appcast feed");
@@ -150,214 +327,1232 @@ WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_url(const char *url)
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API int __cdecl win_sparkle_set_dsa_pub_pem(const char *dsa_pub_pem)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_signature_url(const char *url)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        Settings::SetDSAPubKeyPem(dsa_pub_pem);
-        return 1;
+        CheckForInsecureURL(url, "appcast signature");
+        Settings::SetAppcastSignatureURL(url);
     }
     CATCH_ALL_EXCEPTIONS
-    return 0;
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_app_details(const wchar_t *company_name,
-                                                         const wchar_t *app_name,
-                                                         const wchar_t *app_version)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_fallback_urls(const char *urls)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        Settings::SetCompanyName(company_name);
-        Settings::SetAppName(app_name);
-        Settings::SetAppVersion(app_version);
+        Settings::SetAppcastFallbackURLs(urls);
+        const std::vector<std::string> list = Settings::GetAppcastFallbackURLs();
+        for ( size_t i = 0; i < list.size(); i++ )
+            CheckForInsecureURL(list[i], "appcast feed");
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_app_build_version(const wchar_t *build)
+WIN_SPARKLE_API void __cdecl win_sparkle_add_appcast_feed(const char *url,
+                                                         win_sparkle_feed_role_t role)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        Settings::SetAppBuildVersion(build);
+        if ( !url )
+        {
+            Settings::ClearAdditionalFeeds();
+            return;
+        }
+
+        Settings::FeedRole feedRole;
+        switch ( role )
+        {
+            case WIN_SPARKLE_FEED_ROLE_UPDATES:
+                feedRole = Settings::FeedRole_Updates;
+                break;
+            case WIN_SPARKLE_FEED_ROLE_COMPONENTS:
+                feedRole = Settings::FeedRole_Components;
+                break;
+            default:
+                winsparkle::LogError("Invalid appcast feed role");
+                return;
+        }
+
+        CheckForInsecureURL(url, "appcast feed");
+        Settings::AddAdditionalFeed(url, feedRole);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_registry_path(const char *path)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_channels(const char *channels)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        Settings::SetRegistryPath(path);
+        Settings::SetUpdateChannels(channels);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_automatic_check_for_updates(int state)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_latest_version_url(const char *url)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        Settings::WriteConfigValue("CheckForUpdates", state != 0);
+        if ( url )
+            CheckForInsecureURL(url, "latest version");
+        Settings::SetLatestVersionURL(url);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API int __cdecl win_sparkle_get_automatic_check_for_updates()
+WIN_SPARKLE_API void __cdecl win_sparkle_set_max_appcast_size(int bytes)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        bool checkUpdates;
-        if ( Settings::ReadConfigValue("CheckForUpdates", checkUpdates, false) )
-        return checkUpdates ? 1 : 0;
+        Settings::SetMaxAppcastSize(bytes > 0 ? size_t(bytes) : 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_appcast_filter_hints(int enabled)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetAppcastFilterHints(enabled != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_set_dsa_pub_pem(const char *dsa_pub_pem)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetDSAPubKeyPem(dsa_pub_pem);
+        return 1;
     }
     CATCH_ALL_EXCEPTIONS
+    return 0;
+}
 
+WIN_SPARKLE_API int __cdecl win_sparkle_set_eddsa_public_key(const char *pubkey)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetEdDSAPubKey(pubkey);
+        return 1;
+    }
+    CATCH_ALL_EXCEPTIONS
     return 0;
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_interval(int interval)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_authenticode_check(int state)
 {
-    static const int MIN_CHECK_INTERVAL = 3600; // one hour
+    const ApiCallTimer apiCall(__FUNCTION__);
 
     try
     {
-        if ( interval < MIN_CHECK_INTERVAL )
+        Settings::SetAuthenticodeCheck(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_set_http_backend(win_sparkle_http_backend_t backend)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        switch ( backend )
         {
-            winsparkle::LogError("Invalid update interval (min: 3600 seconds)");
-            interval = MIN_CHECK_INTERVAL;
+            case WIN_SPARKLE_HTTP_BACKEND_WININET:
+                Settings::SetHttpBackend(Settings::HttpBackend_WinINet);
+                return 1;
+            case WIN_SPARKLE_HTTP_BACKEND_WINHTTP:
+                Settings::SetHttpBackend(Settings::HttpBackend_WinHTTP);
+                return 1;
         }
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
 
-        Settings::WriteConfigValue("UpdateInterval", interval);
+WIN_SPARKLE_API int __cdecl win_sparkle_set_revocation_check(win_sparkle_revocation_check_t check)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        switch ( check )
+        {
+            case WIN_SPARKLE_REVOCATION_CHECK_DEFAULT:
+                Settings::SetRevocationCheck(Settings::RevocationCheck_Default);
+                return 1;
+            case WIN_SPARKLE_REVOCATION_CHECK_STRICT:
+                Settings::SetRevocationCheck(Settings::RevocationCheck_Strict);
+                return 1;
+            case WIN_SPARKLE_REVOCATION_CHECK_SOFT_FAIL:
+                Settings::SetRevocationCheck(Settings::RevocationCheck_SoftFail);
+                return 1;
+            case WIN_SPARKLE_REVOCATION_CHECK_DISABLED:
+                Settings::SetRevocationCheck(Settings::RevocationCheck_Disabled);
+                return 1;
+        }
     }
     CATCH_ALL_EXCEPTIONS
+    return 0;
 }
 
-WIN_SPARKLE_API int __cdecl win_sparkle_get_update_check_interval()
+WIN_SPARKLE_API void __cdecl win_sparkle_set_http_max_connections_per_server(int max_connections)
 {
-    static const int DEFAULT_CHECK_INTERVAL = 60*60*24; // one day
+    const ApiCallTimer apiCall(__FUNCTION__);
 
     try
     {
-        int interval;
-        Settings::ReadConfigValue("UpdateInterval", interval, DEFAULT_CHECK_INTERVAL);
-        return interval;
+        if ( max_connections < 1 )
+            max_connections = 1;
+        else if ( max_connections > 16 )
+            max_connections = 16;
+        Settings::SetHttpMaxConnectionsPerServer(max_connections);
     }
     CATCH_ALL_EXCEPTIONS
+}
 
-    return DEFAULT_CHECK_INTERVAL;
+WIN_SPARKLE_API void __cdecl win_sparkle_set_predownload_updates(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetPreDownloadUpdates(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API time_t __cdecl win_sparkle_get_last_check_time()
+WIN_SPARKLE_API void __cdecl win_sparkle_set_install_on_exit(int state)
 {
-    static const time_t DEFAULT_LAST_CHECK_TIME = -1;
+    const ApiCallTimer apiCall(__FUNCTION__);
 
     try
     {
-        time_t last_check;
-        Settings::ReadConfigValue("LastCheckTime", last_check, DEFAULT_LAST_CHECK_TIME);
-        return last_check;
+        Settings::SetInstallOnExit(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
+}
 
-    return DEFAULT_LAST_CHECK_TIME;
+WIN_SPARKLE_API void __cdecl win_sparkle_set_bits_download(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetBITSDownload(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_error_callback(win_sparkle_error_callback_t callback)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_low_priority_downloads(int state)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        ApplicationController::SetErrorCallback(callback);
+        Settings::SetLowPriorityDownloads(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_can_shutdown_callback(win_sparkle_can_shutdown_callback_t callback)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_power_aware_downloads(int state)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        ApplicationController::SetCanShutdownCallback(callback);
+        Settings::SetPowerAwareDownloads(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_shutdown_request_callback(win_sparkle_shutdown_request_callback_t callback)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_metered_download_budget(int megabytes)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        ApplicationController::SetShutdownRequestCallback(callback);
+        Settings::SetMeteredDownloadBudget(megabytes > 0 ? unsigned(megabytes) : 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_did_find_update_callback(win_sparkle_did_find_update_callback_t callback)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_idle_aware_downloads(int state)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        ApplicationController::SetDidFindUpdateCallback(callback);
+        Settings::SetIdleAwareDownloads(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_did_not_find_update_callback(win_sparkle_did_not_find_update_callback_t callback)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_peer_caching(int state)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        ApplicationController::SetDidNotFindUpdateCallback(callback);
+        Settings::SetPeerCaching(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_set_update_cancelled_callback(win_sparkle_update_cancelled_callback_t callback)
+WIN_SPARKLE_API void __cdecl win_sparkle_set_delivery_optimization(int state)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        ApplicationController::SetUpdateCancelledCallback(callback);
+        Settings::SetDeliveryOptimization(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-/*--------------------------------------------------------------------------*
-                              Manual usage
- *--------------------------------------------------------------------------*/
+WIN_SPARKLE_API void __cdecl win_sparkle_set_shared_update_cache(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
 
-WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui()
+    try
+    {
+        Settings::SetSharedUpdateCache(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_start_service_agent()
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        // Initialize UI thread and show progress indicator.
-        UI::ShowCheckingUpdates();
+        Tracing::Register();
+        Logger::StartWriter();
+        ServiceAgent::StartAgent();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
 
-        // Then run the actual check in the background.
-        UpdateChecker *check = new ManualUpdateChecker();
-        check->Start();
+WIN_SPARKLE_API void __cdecl win_sparkle_set_use_service_agent(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetUseServiceAgent(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui_and_install()
+WIN_SPARKLE_API void __cdecl win_sparkle_set_max_download_rate(int bytes_per_second)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        // Initialize UI thread and show progress indicator.
-        UI::ShowCheckingUpdates();
+        Settings::SetMaxDownloadRate(bytes_per_second > 0 ? size_t(bytes_per_second) : 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
 
-        // Then run the actual check in the background.
-        UpdateChecker *check = new ManualAutoInstallUpdateChecker();
-        check->Start();
+WIN_SPARKLE_API void __cdecl win_sparkle_set_temporary_staging_limit(int megabytes)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetTemporaryStagingLimit(megabytes > 0 ? size_t(megabytes) * 1024 * 1024 : 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
-WIN_SPARKLE_API void __cdecl win_sparkle_check_update_without_ui()
+WIN_SPARKLE_API void __cdecl win_sparkle_set_download_backoff(int state)
 {
+    const ApiCallTimer apiCall(__FUNCTION__);
+
     try
     {
-        // Run the check in background. Only show UI if updates
-        // are available.
-        UpdateChecker *check = new OneShotUpdateChecker();
-        check->Start();
+        Settings::SetDownloadBackoff(state != 0);
     }
     CATCH_ALL_EXCEPTIONS
 }
 
+WIN_SPARKLE_API void __cdecl win_sparkle_set_headless_mode(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetHeadlessMode(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_host_window(void *hwnd)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetHostWindow(hwnd);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_ui_on_host_thread(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetUIOnHostThread(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_ui_idle_timeout(int seconds)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( seconds < 0 )
+        {
+            winsparkle::LogError("Invalid UI idle timeout (min: 0 s)");
+            seconds = 0;
+        }
+
+        Settings::SetUIIdleTimeout(seconds);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_app_details(const wchar_t *company_name,
+                                                         const wchar_t *app_name,
+                                                         const wchar_t *app_version)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetCompanyName(company_name);
+        Settings::SetAppName(app_name);
+        Settings::SetAppVersion(app_version);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_app_build_version(const wchar_t *build)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetAppBuildVersion(build);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_registry_path(const char *path)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetRegistryPath(path);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_configure(const win_sparkle_config_t *config)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !config || config->size < sizeof(config->size) )
+            throw std::runtime_error("Invalid win_sparkle_config_t size.");
+
+        // older, smaller versions of the struct lack the later fields
+        win_sparkle_config_t cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        memcpy(&cfg, config, (std::min)(config->size, sizeof(cfg)));
+
+        // validate everything before changing anything
+        Settings::MetadataUpdate update;
+        if ( cfg.appcast_url )
+            CheckForInsecureURL(cfg.appcast_url, "appcast feed");
+        if ( cfg.appcast_signature_url )
+            CheckForInsecureURL(cfg.appcast_signature_url, "appcast signature");
+        if ( cfg.dsa_pub_pem )
+            update.dsaPubKey = SignatureVerifier::ParseDSAPubKey(cfg.dsa_pub_pem);
+        if ( cfg.eddsa_public_key )
+            update.eddsaPubKey = SignatureVerifier::ParseEdDSAPubKey(cfg.eddsa_public_key);
+
+        update.appcastURL = cfg.appcast_url;
+        update.appcastSignatureURL = cfg.appcast_signature_url;
+        update.companyName = cfg.company_name;
+        update.appName = cfg.app_name;
+        update.appVersion = cfg.app_version;
+        update.appBuildVersion = cfg.app_build_version;
+        update.registryPath = cfg.registry_path;
+
+        Settings::SetMetadata(update);
+        ApplicationController::SetCallbacks(cfg);
+        return 1;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_config_file(const wchar_t *path)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetConfigFile(path);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_staging_directory(const wchar_t *path)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetStagingDirectory(path);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_automatic_check_for_updates(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::WriteConfigValue("CheckForUpdates", state != 0);
+        UpdateScheduler::Reschedule();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_get_automatic_check_for_updates()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        bool checkUpdates;
+        if ( Settings::ReadConfigValue("CheckForUpdates", checkUpdates, false) )
+        return checkUpdates ? 1 : 0;
+    }
+    CATCH_ALL_EXCEPTIONS
+
+    return 0;
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_interval(int interval)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    static const int MIN_CHECK_INTERVAL = 3600; // one hour
+
+    try
+    {
+        if ( interval < MIN_CHECK_INTERVAL )
+        {
+            winsparkle::LogError("Invalid update interval (min: 3600 seconds)");
+            interval = MIN_CHECK_INTERVAL;
+        }
+
+        Settings::WriteConfigValue("UpdateInterval", interval);
+        UpdateScheduler::Reschedule();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_get_update_check_interval()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    static const int DEFAULT_CHECK_INTERVAL = 60*60*24; // one day
+
+    try
+    {
+        int interval;
+        Settings::ReadConfigValue("UpdateInterval", interval, DEFAULT_CHECK_INTERVAL);
+        return interval;
+    }
+    CATCH_ALL_EXCEPTIONS
+
+    return DEFAULT_CHECK_INTERVAL;
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_adaptive_check_interval(int min_interval, int max_interval)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    static const int MIN_CHECK_INTERVAL = 3600; // one hour
+
+    try
+    {
+        if ( min_interval != 0 || max_interval != 0 )
+        {
+            if ( min_interval < MIN_CHECK_INTERVAL )
+            {
+                winsparkle::LogError("Invalid adaptive update interval (min: 3600 seconds)");
+                min_interval = MIN_CHECK_INTERVAL;
+            }
+            if ( max_interval < min_interval )
+            {
+                winsparkle::LogError("Invalid adaptive update interval (max is less than min)");
+                max_interval = min_interval;
+            }
+        }
+
+        Settings::SetAdaptiveCheckInterval(min_interval, max_interval);
+        UpdateScheduler::Reschedule();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_jitter(int seconds)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( seconds < 0 )
+        {
+            winsparkle::LogError("Invalid update check jitter (min: 0 seconds)");
+            seconds = 0;
+        }
+
+        Settings::SetUpdateCheckJitter(seconds);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_check_tolerance(int seconds)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( seconds < 0 )
+        {
+            winsparkle::LogError("Invalid update check tolerance (min: 0 seconds)");
+            seconds = 0;
+        }
+
+        Settings::SetUpdateCheckTolerance(seconds);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_maintenance_windows(const char *windows)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( windows && !UpdateScheduler::IsValidMaintenanceWindows(windows) )
+        {
+            winsparkle::LogError("Invalid maintenance windows (expected e.g. \"22:00-6:00\")");
+            return;
+        }
+
+        Settings::SetMaintenanceWindows(windows);
+        UpdateScheduler::Reschedule();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_connection_warmup(int state)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetConnectionWarmup(state != 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_notification_url(const char *url)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( url )
+            CheckForInsecureURL(url, "update notification");
+        Settings::SetUpdateNotificationURL(url);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API time_t __cdecl win_sparkle_get_last_check_time()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    static const time_t DEFAULT_LAST_CHECK_TIME = -1;
+
+    try
+    {
+        time_t last_check;
+        Settings::ReadConfigValue("LastCheckTime", last_check, DEFAULT_LAST_CHECK_TIME);
+        return last_check;
+    }
+    CATCH_ALL_EXCEPTIONS
+
+    return DEFAULT_LAST_CHECK_TIME;
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_error_callback(win_sparkle_error_callback_t callback)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetErrorCallback(callback);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_get_last_error(win_sparkle_error_info_t *info)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !info || info->size < sizeof(info->size) )
+            return 0;
+
+        return Stats::GetLastError(*info) ? 1 : 0;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_can_shutdown_callback(win_sparkle_can_shutdown_callback_t callback)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetCanShutdownCallback(callback);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_shutdown_request_callback(win_sparkle_shutdown_request_callback_t callback)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetShutdownRequestCallback(callback);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_did_find_update_callback(win_sparkle_did_find_update_callback_t callback)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetDidFindUpdateCallback(callback);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_did_not_find_update_callback(win_sparkle_did_not_find_update_callback_t callback)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetDidNotFindUpdateCallback(callback);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_cancelled_callback(win_sparkle_update_cancelled_callback_t callback)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetUpdateCancelledCallback(callback);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_download_progress_callback(win_sparkle_download_progress_callback_t callback,
+                                                                        void *user_data,
+                                                                        int min_interval_ms)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetDownloadProgressCallback(callback, user_data, min_interval_ms);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_update_downloaded_callback(win_sparkle_update_downloaded_callback_t callback,
+                                                                        void *user_data)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        ApplicationController::SetUpdateDownloadedCallback(callback, user_data);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+/*--------------------------------------------------------------------------*
+                              Manual usage
+ *--------------------------------------------------------------------------*/
+
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        // Show progress indicator and run the actual check in the
+        // background, while the UI thread initializes if needed.
+        Stats::StartUIInteraction();
+        UpdateChecker *check = new ManualUpdateChecker();
+        UI::ShowCheckingUpdates(check);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_with_ui_and_install()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        // Show progress indicator and run the actual check in the
+        // background, while the UI thread initializes if needed.
+        Stats::StartUIInteraction();
+        UpdateChecker *check = new ManualAutoInstallUpdateChecker();
+        UI::ShowCheckingUpdates(check);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_without_ui()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        // Run the check in background. Only show UI if updates
+        // are available.
+        UpdateChecker *check = new OneShotUpdateChecker();
+        check->Start();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_check_update_and_install_silently()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        UpdateChecker *check = new UnattendedUpdateChecker();
+        check->Start();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_import_update(const wchar_t *path)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !path || !*path )
+            throw std::runtime_error("Update bundle path not specified.");
+
+        Stats::StartUIInteraction();
+        UpdateChecker *check = new ImportUpdateChecker(path);
+        UI::ShowCheckingUpdates(check);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_prewarm_ui()
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        UI::Prewarm();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+
+/*--------------------------------------------------------------------------*
+                            Asynchronous checks
+ *--------------------------------------------------------------------------*/
+
+WIN_SPARKLE_API win_sparkle_check_t __cdecl win_sparkle_check_async(
+                        const win_sparkle_check_options_t *opts,
+                        win_sparkle_check_completed_callback_t on_complete,
+                        void *user_data)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        // older, smaller versions of the struct lack the later fields
+        const bool ignoreSkipped =
+            opts &&
+            opts->size >= offsetof(win_sparkle_check_options_t, ignore_skipped_version) + sizeof(int) &&
+            opts->ignore_skipped_version;
+
+        UpdateCheckRequest *request = new UpdateCheckRequest(on_complete, user_data, ignoreSkipped);
+        try
+        {
+            request->Start();
+        }
+        catch ( ... )
+        {
+            request->Release();
+            throw;
+        }
+        return reinterpret_cast<win_sparkle_check_t>(request);
+    }
+    CATCH_ALL_EXCEPTIONS
+    return NULL;
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_check_wait(win_sparkle_check_t check, int timeout_ms)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        const DWORD timeout = timeout_ms < 0 ? INFINITE : static_cast<DWORD>(timeout_ms);
+        return reinterpret_cast<UpdateCheckRequest*>(check)->Wait(timeout) ? 1 : 0;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
+
+WIN_SPARKLE_API const win_sparkle_check_result_t* __cdecl win_sparkle_check_get_result(win_sparkle_check_t check)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    return reinterpret_cast<UpdateCheckRequest*>(check)->GetResult();
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_check_cancel(win_sparkle_check_t check)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        reinterpret_cast<UpdateCheckRequest*>(check)->Cancel();
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_check_release(win_sparkle_check_t check)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    if ( check )
+        reinterpret_cast<UpdateCheckRequest*>(check)->Release();
+}
+
+WIN_SPARKLE_API win_sparkle_check_status_t __cdecl win_sparkle_get_cached_update_info(
+                        win_sparkle_cached_update_info_t *info)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !info || info->size < sizeof(info->size) )
+            return WIN_SPARKLE_CHECK_ERROR;
+
+        Appcast update;
+        if ( !UpdateChecker::GetCachedUpdate(update) )
+            return WIN_SPARKLE_CHECK_NO_UPDATE;
+
+        win_sparkle_cached_update_info_t result;
+        memset(&result, 0, sizeof(result));
+        CopyTruncatedUTF8(result.version, update.Version);
+        CopyTruncatedUTF8(result.short_version, update.ShortVersionString);
+        CopyTruncatedUTF8(result.title, update.Title);
+        result.download_size = update.Length.empty() ? -1 : _strtoi64(update.Length.c_str(), NULL, 10);
+        switch ( UpdateDownloader::GetDownloadState(update) )
+        {
+            case UpdateDownloader::DownloadState_None:
+                result.download_state = WIN_SPARKLE_DOWNLOAD_NONE;
+                break;
+            case UpdateDownloader::DownloadState_Partial:
+                result.download_state = WIN_SPARKLE_DOWNLOAD_PARTIAL;
+                break;
+            case UpdateDownloader::DownloadState_Ready:
+                result.download_state = WIN_SPARKLE_DOWNLOAD_READY;
+                break;
+        }
+        result.last_check_time = win_sparkle_get_last_check_time();
+
+        // everything except for the size field, as much as the caller has
+        const size_t size = info->size < sizeof(result) ? info->size : sizeof(result);
+        memcpy(reinterpret_cast<char*>(info) + sizeof(info->size),
+               reinterpret_cast<const char*>(&result) + sizeof(result.size),
+               size - sizeof(info->size));
+        return WIN_SPARKLE_CHECK_UPDATE_AVAILABLE;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return WIN_SPARKLE_CHECK_ERROR;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                Statistics
+ *--------------------------------------------------------------------------*/
+
+WIN_SPARKLE_API int __cdecl win_sparkle_get_stats(win_sparkle_stats_t *stats)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !stats || stats->size < sizeof(stats->size) )
+            return 0;
+
+        Stats::Get(*stats);
+        return 1;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_get_stats_json(char *buffer, size_t size)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !buffer && size )
+            return -1;
+
+        const std::string json = Stats::GetJSON();
+        if ( size )
+        {
+            const size_t len = json.length() < size ? json.length() : size - 1;
+            memcpy(buffer, json.data(), len);
+            buffer[len] = '\0';
+        }
+        return int(json.length());
+    }
+    CATCH_ALL_EXCEPTIONS
+    return -1;
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_get_status(win_sparkle_status_t *status)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !status || status->size < sizeof(status->size) )
+            return 0;
+
+        PipelineStatus::Get(*status);
+        return 1;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_telemetry_url(const char *url)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetTelemetryURL(url);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_http_recording(const wchar_t *directory)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Settings::SetHttpRecordingDirectory(directory);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_http_replay(const wchar_t *directory,
+                                                         int time_scale_percent)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( time_scale_percent < 0 )
+        {
+            winsparkle::LogError("Invalid HTTP replay time scale (min: 0 %)");
+            return;
+        }
+        Settings::SetHttpReplay(directory, time_scale_percent);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+
+/*--------------------------------------------------------------------------*
+                            Network diagnostics
+ *--------------------------------------------------------------------------*/
+
+WIN_SPARKLE_API int __cdecl win_sparkle_run_diagnostics(win_sparkle_diagnostics_callback_t report_cb,
+                                                        void *user_data)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !report_cb )
+        {
+            winsparkle::LogError("Diagnostics need a callback for the report");
+            return 0;
+        }
+        if ( Settings::GetAppcastURL().empty() )
+        {
+            winsparkle::LogError("Appcast URL not specified.");
+            return 0;
+        }
+
+        Thread *diagnostics = new NetworkDiagnostics(report_cb, user_data);
+        diagnostics->Start();
+        return 1;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                 Logging
+ *--------------------------------------------------------------------------*/
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_log_level(win_sparkle_log_level_t level)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( level < WIN_SPARKLE_LOG_ERROR || level > WIN_SPARKLE_LOG_DEBUG )
+        {
+            winsparkle::LogError("Invalid log level");
+            return;
+        }
+
+        Logger::SetLevel(level);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_log_file(const wchar_t *path, int max_size)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( max_size < 0 )
+        {
+            winsparkle::LogError("Invalid log file size (min: 0 bytes)");
+            max_size = 0;
+        }
+
+        Logger::SetFile(path, size_t(max_size));
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_log_callback(win_sparkle_log_callback_t callback,
+                                                          void *user_data)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        Logger::SetCallback(callback, user_data);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API void __cdecl win_sparkle_set_api_stall_threshold(int milliseconds)
+{
+    try
+    {
+        ApiCallTimer::SetThreshold(milliseconds > 0 ? milliseconds : 0);
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+WIN_SPARKLE_API int __cdecl win_sparkle_convert_appcast_to_binary(const wchar_t *feed_path,
+                                                                  const wchar_t *binary_path)
+{
+    const ApiCallTimer apiCall(__FUNCTION__);
+
+    try
+    {
+        if ( !feed_path || !binary_path )
+        {
+            winsparkle::LogError("Invalid appcast conversion path (NULL)");
+            return 0;
+        }
+
+        BinaryAppcast::Convert(feed_path, binary_path);
+        return 1;
+    }
+    CATCH_ALL_EXCEPTIONS
+    return 0;
+}
+
 
 } // extern "C"
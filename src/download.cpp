@@ -24,65 +24,159 @@
  */
 
 #include "download.h"
+#include "downloadbackend.h"
 
 #include "error.h"
+#include "logger.h"
+#include "ratelimiter.h"
 #include "settings.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 #include "winsparkle-version.h"
 
+#include <algorithm>
+#include <map>
+#include <memory>
 #include <string>
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
 #include <windows.h>
 #include <wininet.h>
+#include <netlistmgr.h>
+
+#ifdef _MSC_VER
+#pragma comment(lib, "ole32.lib")
+#endif
 
 
 namespace winsparkle
 {
 
 /*--------------------------------------------------------------------------*
-                                helpers
+                            backends support
  *--------------------------------------------------------------------------*/
 
-namespace
+SharedSession::SharedSession(Handle (*openFunc)(), void (*closeFunc)(Handle))
+    : m_openFunc(openFunc), m_closeFunc(closeFunc),
+      m_handle(NULL), m_users(0), m_closeRequested(false)
 {
+}
+
+SharedSession::Handle SharedSession::Acquire()
+{
+    CriticalSectionLocker lock(m_cs);
+
+    // Note that this is only done once per session, so the user agent,
+    // including the dynamic IsWow64Process lookup, is computed once.
+    if ( !m_handle )
+        m_handle = m_openFunc();
 
-struct InetHandle
+    m_users++;
+    return m_handle;
+}
+
+void SharedSession::Release()
 {
-    InetHandle(HINTERNET handle = 0) : m_handle(handle), m_callback(NULL) {}
+    CriticalSectionLocker lock(m_cs);
 
-    ~InetHandle()
+    if ( --m_users == 0 && m_closeRequested )
     {
-        Close();
+        m_closeFunc(m_handle);
+        m_handle = NULL;
+        m_closeRequested = false;
     }
+}
+
+void SharedSession::Close()
+{
+    CriticalSectionLocker lock(m_cs);
 
-    InetHandle& operator=(HINTERNET handle)
+    if ( m_users > 0 )
     {
-        Close();
-        m_handle = handle;
-        return *this;
+        m_closeRequested = true;
     }
-
-    void SetStatusCallback(INTERNET_STATUS_CALLBACK callback)
+    else if ( m_handle )
     {
-        m_callback = callback;
-        InternetSetStatusCallback(m_handle, m_callback);
+        m_closeFunc(m_handle);
+        m_handle = NULL;
     }
+}
+
 
-    void Close()
+HttpPhaseTimer::HttpPhaseTimer() : m_phaseStart(0), m_lastPhase(HttpPhase_Received)
+{
+}
+
+void HttpPhaseTimer::OnPhase(HttpPhase phase)
+{
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+
+    // duration of the phase that just ended
+    unsigned long long elapsed = 0;
+    if ( m_phaseStart && frequency.QuadPart )
+        elapsed = (now.QuadPart - m_phaseStart) * 1000000 / frequency.QuadPart;
+
+    switch ( phase )
     {
-        if (m_handle)
-        {
-            if (m_callback)
-                InternetSetStatusCallback(m_handle, NULL);
-            InternetCloseHandle(m_handle);
-            m_handle = NULL;
-        }
+        case HttpPhase_Resolving:
+        case HttpPhase_Connecting:
+            m_phaseStart = now.QuadPart;
+            break;
+
+        case HttpPhase_Resolved:
+            m_timings.resolve += elapsed;
+            m_phaseStart = 0;
+            break;
+
+        case HttpPhase_Connected:
+            m_timings.connect += elapsed;
+            // time the TLS handshake, if any, until the request is sent
+            m_phaseStart = now.QuadPart;
+            break;
+
+        case HttpPhase_Sending:
+            if ( m_lastPhase == HttpPhase_Connected )
+                m_timings.secure += elapsed;
+            m_phaseStart = now.QuadPart;
+            break;
+
+        case HttpPhase_Sent:
+            m_timings.send += elapsed;
+            m_phaseStart = now.QuadPart;
+            break;
+
+        case HttpPhase_Receiving:
+            // only the first one after sending the request is of interest,
+            // it's reported for every read of the response body too
+            if ( m_lastPhase == HttpPhase_Sent )
+                m_timings.wait += elapsed;
+            m_phaseStart = 0;
+            break;
+
+        case HttpPhase_Received:
+            m_phaseStart = 0;
+            break;
+
+        case HttpPhase_Redirect:
+            m_timings.redirects++;
+            m_phaseStart = 0;
+            break;
+
+        case HttpPhase_ConnectionClosed:
+            // doesn't interrupt the phase being timed
+            m_timings.closedConnections++;
+            return;
     }
 
-    operator HINTERNET() const { return m_handle; }
+    m_lastPhase = phase;
+}
 
-    HINTERNET m_handle;
-    INTERNET_STATUS_CALLBACK m_callback;
-};
 
 std::wstring MakeUserAgent()
 {
@@ -109,235 +203,1511 @@ std::wstring MakeUserAgent()
 }
 
 
-bool GetHttpHeader(HINTERNET handle, DWORD whatToGet, DWORD& output)
+int GetMaxConnectionsPerServer()
 {
-    DWORD outputSize = sizeof(output);
-    DWORD headerIndex = 0;
-    return HttpQueryInfoA
-           (
-               handle,
-               whatToGet | HTTP_QUERY_FLAG_NUMBER,
-               &output,
-               &outputSize,
-               &headerIndex
-           ) == TRUE;
+    return Settings::GetHttpMaxConnectionsPerServer();
 }
 
 
-std::wstring GetURLFileName(const char *url)
+void WaitUntilSignaledWithTerminationCheck(Event& event, Thread *thread)
 {
-    const char *lastSlash = strrchr(url, '/');
-    std::string fn(lastSlash ? lastSlash + 1 : url);
-    if (fn.find_first_of('?') != std::string::npos)
-        fn = fn.substr(0, fn.find_first_of('?'));
-    return AnsiToWide(fn);
+    if (thread)
+        thread->WaitWithTerminationCheck(event);
+    else
+        event.WaitUntilSignaled();
 }
 
-struct DownloadCallbackContext
-{
-    DownloadCallbackContext(InetHandle *conn_) : conn(conn_), lastError(ERROR_SUCCESS) {}
-    InetHandle *conn;
-    DWORD lastError;
-    Event eventRequestComplete;
-};
 
-void CALLBACK DownloadInternetStatusCallback(_In_ HINTERNET hInternet,
-                                             _In_ DWORD_PTR dwContext,
-                                             _In_ DWORD     dwInternetStatus,
-                                             _In_ LPVOID    lpvStatusInformation,
-                                             _In_ DWORD     dwStatusInformationLength)
+namespace
 {
-    DownloadCallbackContext *context = (DownloadCallbackContext*)dwContext;
-    INTERNET_ASYNC_RESULT *res = (INTERNET_ASYNC_RESULT*)lpvStatusInformation;
 
-    switch (dwInternetStatus)
-    {
-        case INTERNET_STATUS_HANDLE_CREATED:
-            context->conn->m_handle = (HINTERNET)(res->dwResult);
-            break;
+// How long a server whose certificate's revocation status couldn't be
+// looked up isn't checked again:
+const DWORD REVOCATION_OFFLINE_TIME = 60 * 60 * 1000;
+
+// guards g_revocationOffline
+CriticalSection g_csRevocationOffline;
+
+// servers whose revocation lookups failed, with the tick count when
+std::map<std::wstring, DWORD> g_revocationOffline;
+
+} // anonymous namespace
+
 
-        case INTERNET_STATUS_REQUEST_COMPLETE:
-            context->lastError = res->dwError;
-            context->eventRequestComplete.Signal();
+bool ShouldCheckRevocation(const std::wstring& host)
+{
+    switch ( Settings::GetRevocationCheck() )
+    {
+        case Settings::RevocationCheck_Strict:
+            return true;
+        case Settings::RevocationCheck_SoftFail:
             break;
+        default:
+            return false;
     }
+
+    CriticalSectionLocker lock(g_csRevocationOffline);
+    std::map<std::wstring, DWORD>::iterator i = g_revocationOffline.find(host);
+    if ( i == g_revocationOffline.end() )
+        return true;
+    if ( GetTickCount() - i->second < REVOCATION_OFFLINE_TIME )
+        return false;
+    g_revocationOffline.erase(i);
+    return true;
 }
 
-void WaitUntilSignaledWithTerminationCheck(Event& event, Thread *thread)
+
+void RememberRevocationOffline(const std::wstring& host)
+{
+    CriticalSectionLocker lock(g_csRevocationOffline);
+    g_revocationOffline[host] = GetTickCount();
+}
+
+
+void WaitForNetworkIO(Event& event, Thread *thread, NetworkWait wait)
+{
+    const DWORD budget = wait == NetworkWait_Response ? RESPONSE_TIMEOUT : STALL_TIMEOUT;
+    const DWORD remaining = DownloadDeadline::GetRemaining();
+    const DWORD timeout = (std::min)(budget, remaining);
+
+    const bool signaled = thread
+                          ? thread->GetCancellationToken().Wait(event.GetHandle(), timeout)
+                          : event.WaitUntilSignaled(timeout);
+    if ( signaled )
+        return;
+
+    if ( remaining <= budget )
+        throw DownloadTimeoutException("Download took too long.",
+                                       DownloadTimeoutException::Timeout_Deadline);
+    if ( wait == NetworkWait_Response )
+        throw DownloadTimeoutException("The server didn't respond in time.",
+                                       DownloadTimeoutException::Timeout_Response);
+    throw DownloadTimeoutException("The server stopped sending data.",
+                                   DownloadTimeoutException::Timeout_Stall);
+}
+
+
+void CheckHResult(HRESULT hr, const char *msg)
 {
-    for (;;)
+    if ( FAILED(hr) )
     {
-        if (thread)
-            thread->CheckShouldTerminate();
-        if (event.WaitUntilSignaled(100))
-            return;
+        std::ostringstream s;
+        s << msg << " (error 0x" << std::hex << unsigned(hr) << ")";
+        throw std::runtime_error(s.str());
     }
 }
 
+
+/*--------------------------------------------------------------------------*
+                            DownloadDeadline
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// DownloadDeadline of the current thread, NULL if none
+struct DownloadDeadlineTls
+{
+    DownloadDeadlineTls() : index(TlsAlloc()) {}
+    ~DownloadDeadlineTls() { TlsFree(index); }
+    DWORD index;
+} g_tlsDownloadDeadline;
+
 } // anonymous namespace
 
 
+DownloadDeadline::DownloadDeadline(unsigned milliseconds)
+    : m_deadline(0), m_previous(NULL), m_active(false)
+{
+    if ( milliseconds == INFINITE || g_tlsDownloadDeadline.index == TLS_OUT_OF_INDEXES )
+        return;
+
+    m_previous = static_cast<DownloadDeadline*>(TlsGetValue(g_tlsDownloadDeadline.index));
+    if ( m_previous && GetRemaining() <= milliseconds )
+        m_deadline = m_previous->m_deadline;
+    else
+        m_deadline = GetTickCount() + milliseconds;
+
+    m_active = true;
+    TlsSetValue(g_tlsDownloadDeadline.index, this);
+}
+
+
+DownloadDeadline::~DownloadDeadline()
+{
+    if ( m_active )
+        TlsSetValue(g_tlsDownloadDeadline.index, m_previous);
+}
+
+
+/*static*/ unsigned DownloadDeadline::GetRemaining()
+{
+    if ( g_tlsDownloadDeadline.index == TLS_OUT_OF_INDEXES )
+        return INFINITE;
+
+    const DownloadDeadline *current =
+        static_cast<DownloadDeadline*>(TlsGetValue(g_tlsDownloadDeadline.index));
+    if ( !current )
+        return INFINITE;
+
+    // compared as a difference, to work when the tick count wraps around
+    const LONG left = LONG(current->m_deadline - GetTickCount());
+    return left > 0 ? unsigned(left) : 0;
+}
+
+
 /*--------------------------------------------------------------------------*
-                                public functions
+                                helpers
  *--------------------------------------------------------------------------*/
 
-void DownloadFile(const std::string& url, IDownloadSink *sink, Thread *onThread, int flags)
-{
-    char url_path[2048];
-    URL_COMPONENTSA urlc;
-    memset(&urlc, 0, sizeof(urlc));
-    urlc.dwStructSize = sizeof(urlc);
-    urlc.lpszUrlPath = url_path;
-    urlc.dwUrlPathLength = sizeof(url_path);
-
-    if ( !InternetCrackUrlA(url.c_str(), 0, ICU_DECODE, &urlc) )
-        throw Win32Exception();
-
-    InetHandle inet = InternetOpen
-                      (
-                          MakeUserAgent().c_str(),
-                          INTERNET_OPEN_TYPE_PRECONFIG,
-                          NULL, // lpszProxyName
-                          NULL, // lpszProxyBypass
-                          INTERNET_FLAG_ASYNC // dwFlags
-                      );
-    if ( !inet )
-        throw Win32Exception();
-
-    // Never allow local caching, always contact the server for both
-    // appcast feeds and downloads. This is useful in case of
-    // misconfigured servers.
-    DWORD dwFlags = INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_RELOAD;
-    // For some requests (appcast feeds), don't even allow proxies to cache,
-    // as we need the most up-to-date information.
-    if ( flags & Download_BypassProxies )
-        dwFlags |= INTERNET_FLAG_PRAGMA_NOCACHE;
-    if ( urlc.nScheme == INTERNET_SCHEME_HTTPS )
-        dwFlags |= INTERNET_FLAG_SECURE;
-
-    InetHandle conn;
-
-    DownloadCallbackContext context(&conn);
-    inet.SetStatusCallback(&DownloadInternetStatusCallback);
-
-    HINTERNET conn_raw = InternetOpenUrlA
-                         (
-                             inet,
-                             url.c_str(),
-                             NULL, // lpszHeaders
-                             -1,   // dwHeadersLength
-                             dwFlags,
-                             (DWORD_PTR)&context  // dwContext
-                         );
-    // InternetOpenUrl() may return NULL handle and then fill it in asynchronously from 
-    // DownloadInternetStatusCallback. We must make sure we don't overwrite the handle
-    // in that case, or throw an error.
-    if (conn_raw)
-    {
-        conn = conn_raw;
-    }
-    else
+namespace
+{
+
+// HTTP status codes we need to handle
+enum HttpStatus
+{
+    HttpStatus_OK = 200,
+    HttpStatus_PartialContent = 206,
+    HttpStatus_NotModified = 304,
+    HttpStatus_RangeNotSatisfiable = 416
+};
+
+// Returns CPU time used by the calling thread so far in microseconds, for
+// tracing.
+unsigned long long GetThreadCpuTime()
+{
+    FILETIME creation, exit, kernel, user;
+    if ( !GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user) )
+        return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    // in 100ns units
+    return (k.QuadPart + u.QuadPart) / 10;
+}
+
+// Returns the number of seconds from the response's Retry-After header, -1
+// if there's none. The header is either a number of seconds or a date.
+int GetRetryAfter(IHttpResponse& response)
+{
+    std::string value;
+    if ( !response.GetHeader("Retry-After", value) || value.empty() )
+        return -1;
+
+    if ( value.find_first_not_of("0123456789") == std::string::npos )
     {
-        if (GetLastError() != ERROR_IO_PENDING)
-            throw Win32Exception();
+        const unsigned long seconds = strtoul(value.c_str(), NULL, 10);
+        return seconds > INT_MAX ? INT_MAX : int(seconds);
     }
 
-    WaitUntilSignaledWithTerminationCheck(context.eventRequestComplete, onThread);
+    SYSTEMTIME st;
+    FILETIME ft;
+    if ( !InternetTimeToSystemTimeA(value.c_str(), &st, 0) || !SystemTimeToFileTime(&st, &ft) )
+        return -1;
 
-    // Check returned status code - we need to detect 404 instead of
-    // downloading the human-readable 404 page:
-    DWORD statusCode;
-    if ( GetHttpHeader(conn, HTTP_QUERY_STATUS_CODE, statusCode) && statusCode >= 400 )
+    // FILETIME counts 100ns intervals since 1601, time_t seconds since 1970
+    ULARGE_INTEGER t;
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    const long long retryTime = (long long)(t.QuadPart / 10000000ULL) - 11644473600LL;
+    const long long delay = retryTime - (long long)time(NULL);
+    if ( delay <= 0 )
+        return 0;
+    return delay > INT_MAX ? INT_MAX : int(delay);
+}
+
+IDownloadBackend& GetNetworkBackend()
+{
+    switch ( Settings::GetHttpBackend() )
     {
-        throw std::runtime_error("Update file not found on the server.");
+        case Settings::HttpBackend_WinHTTP:
+            return GetWinHTTPBackend();
+        case Settings::HttpBackend_WinINet:
+        default:
+            return GetWinINetBackend();
     }
+}
+
+IDownloadBackend& GetBackend()
+{
+    if ( !Settings::GetHttpReplayDirectory().empty() )
+        return GetReplayBackend();
+
+    IDownloadBackend& backend = GetNetworkBackend();
+    if ( !Settings::GetHttpRecordingDirectory().empty() )
+        return GetRecordingBackend(backend);
+    return backend;
+}
 
-    // Get content length if possible:
-    DWORD contentLength;
-    if ( GetHttpHeader(conn, HTTP_QUERY_CONTENT_LENGTH, contentLength) )
-        sink->SetLength(contentLength);
 
-    // Get filename fron Content-Disposition, if available
-    char contentDisposition[512];
-    DWORD cdSize = 512;
-    bool filename_set = false;
-    if ( HttpQueryInfoA(conn, HTTP_QUERY_CONTENT_DISPOSITION, contentDisposition, &cdSize, NULL) )
+bool GetHttpHeader(IHttpResponse& response, const char *name, size_t& output)
+{
+    std::string value;
+    if ( !response.GetHeader(name, value) || value.empty() )
+        return false;
+    char *end;
+    output = strtoul(value.c_str(), &end, 10);
+    return *end == 0;
+}
+
+
+// Returns value suitable for If-Range: header, i.e. strong ETag or
+// Last-Modified date, or empty string if the server didn't send either.
+std::string GetResourceValidator(IHttpResponse& response)
+{
+    std::string value;
+    if ( response.GetHeader("ETag", value) && value.compare(0, 2, "W/") != 0 )
+        return value;
+    if ( response.GetHeader("Last-Modified", value) )
+        return value;
+    return std::string();
+}
+
+
+// Size of the first read from the response; it grows up to the maximum for
+// as long as the data arrive faster than they're read.
+const size_t READ_CHUNK_MIN_SIZE = 16 * 1024;
+const size_t READ_CHUNK_MAX_SIZE = 1024 * 1024;
+
+// Reads the response body and passes it to onData(data, len). If maxLen is
+// not zero, reads at most this many bytes. Returns number of bytes read.
+//
+// If sink is given, the data are read into the buffer it provides via
+// IDownloadSink::GetBuffer(), if any, and reading stops as soon as
+// IDownloadSink::IsComplete() returns true.
+//
+// If onThread is told to terminate, TerminateThreadException is thrown,
+// unless cancelled is given: then it's set to true and reading stops, as it
+// does when the sink's IDownloadSink::IsCancelled() returns true.
+//
+// The reading is slowed down as needed by DownloadRateLimiter.
+template<typename Callback>
+size_t ReadResponseData(IHttpResponse& response, size_t maxLen, Callback onData,
+                        Thread *onThread, IDownloadSink *sink = NULL,
+                        bool *cancelled = NULL)
+{
+    DownloadRateLimiter& limiter = DownloadRateLimiter::Get();
+    size_t total = 0;
+    size_t chunkSize = READ_CHUNK_MIN_SIZE;
+    // only used if the sink has no buffer; not zeroed, it's read into
+    DataBuffer<char> ownBuffer(0, DataBuffer_Uninitialized);
+
+    for ( ;; )
     {
-        char *ptr = strstr(contentDisposition, "filename=");
-        if ( ptr )
+        size_t toRead = limiter.GetChunkSize(chunkSize);
+        if ( maxLen )
         {
-            char c_filename[512];
-            ptr += 9;
-            while ( *ptr == ' ' )
-                ptr++;
+            if ( total == maxLen )
+                break;
+            if ( maxLen - total < toRead )
+                toRead = maxLen - total;
+        }
+
+        void *buffer = sink ? sink->GetBuffer(toRead) : NULL;
+        if ( !buffer || toRead == 0 )
+        {
+            toRead = limiter.GetChunkSize(chunkSize);
+            if ( maxLen && maxLen - total < toRead )
+                toRead = maxLen - total;
+            ownBuffer.Reserve(toRead);
+            buffer = ownBuffer.data;
+        }
 
-            bool quoted = false;
-            if ( *ptr == '"' || *ptr == '\'')
+        if ( onThread )
+        {
+            if ( cancelled && onThread->GetCancellationToken().IsCancelled() )
             {
-                quoted = true;
-                ptr++;
+                *cancelled = true;
+                break;
             }
+            onThread->CheckShouldTerminate();
+        }
 
-            char *ptr2 = c_filename;
-            while ( *ptr != ';' && *ptr != 0)
-                *ptr2++ = *ptr++;
+        const size_t read = response.Read(buffer, toRead);
+        if ( read == 0 )
+            break; // all of the file was downloaded
 
-            if ( quoted )
-                *(ptr2 - 1) = 0;
-            else
-                *ptr2 = 0;
+        limiter.Consume(read, onThread);
+        onData(buffer, read);
+        total += read;
 
-            sink->SetFilename(AnsiToWide(c_filename));
-            filename_set = true;
+        if ( sink && sink->IsComplete() )
+            break; // the rest isn't needed, closing the response aborts it
+        if ( cancelled && sink && sink->IsCancelled() )
+        {
+            *cancelled = true;
+            break;
         }
+
+        // A full buffer means more data were already waiting, so read
+        // bigger chunks to make fewer calls (and callbacks) per megabyte.
+        if ( read == toRead && chunkSize < READ_CHUNK_MAX_SIZE )
+            chunkSize *= 2;
     }
 
-    if ( !filename_set )
+    return total;
+}
+
+
+// Checks that Content-Range: of a 206 response starts at the expected offset.
+bool CheckContentRange(IHttpResponse& response, size_t offset)
+{
+    std::ostringstream expected;
+    expected << "bytes " << offset << "-";
+    std::string contentRange;
+    return response.GetHeader("Content-Range", contentRange) &&
+           contentRange.compare(0, expected.str().length(), expected.str()) == 0;
+}
+
+
+// Downloads @a length bytes at @a offset of the file and passes them to
+// @a sink's AddAt(). The range is only accepted from the same version of
+// the file if @a validator isn't empty.
+void DownloadRange(IDownloadBackend& backend,
+                   const std::string& url,
+                   int flags,
+                   const std::string& validator,
+                   IRandomAccessDownloadSink *sink,
+                   size_t offset,
+                   size_t length,
+                   Thread *onThread)
+{
+    std::ostringstream headers;
+    headers << "Range: bytes=" << offset << "-" << (offset + length - 1) << "\r\n";
+    if ( !validator.empty() )
+        headers << "If-Range: " << validator << "\r\n";
+
+    std::unique_ptr<IHttpResponse> response(backend.OpenURL(url, headers.str(), flags, onThread));
+
+    if ( response->GetStatusCode() != HttpStatus_PartialContent ||
+         !CheckContentRange(*response, offset) )
     {
-        DWORD ousize = 0;
-        InternetQueryOptionA(conn, INTERNET_OPTION_URL, NULL, &ousize);
-        if (GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+        throw std::runtime_error("Server didn't honor range request.");
+    }
+
+    const size_t received = ReadResponseData(*response, length,
+        [&offset, sink](const void *data, size_t len)
         {
-            DataBuffer<char> optionurl(ousize);
-            if ( InternetQueryOptionA(conn, INTERNET_OPTION_URL, optionurl, &ousize) )
-                sink->SetFilename(GetURLFileName(optionurl));
-            else
-                sink->SetFilename(GetURLFileName(urlc.lpszUrlPath));
+            sink->AddAt(offset, data, len);
+            offset += len;
+        },
+        onThread);
+
+    if ( received != length )
+        throw std::runtime_error("Incomplete download of the update file.");
+}
+
+
+// Segmented downloads are only worth it for big files:
+const size_t SEGMENTED_DOWNLOAD_MIN_SIZE = 16 * 1024 * 1024;
+
+/**
+    Downloads a single byte range of a file on a connection of its own.
+ */
+class SegmentDownloader : public Thread
+{
+public:
+    SegmentDownloader(IDownloadBackend& backend,
+                      const std::string& url,
+                      int flags,
+                      const std::string& validator,
+                      IRandomAccessDownloadSink *sink,
+                      size_t offset,
+                      size_t length)
+        : Thread("WinSparkle segment download"),
+          m_backend(backend), m_url(url), m_flags(flags), m_validator(validator),
+          m_sink(sink), m_offset(offset), m_length(length)
+    {
+    }
+
+    /// Returns error message if the segment couldn't be downloaded.
+    const std::string& GetError() const { return m_error; }
+
+protected:
+    virtual void Run()
+    {
+        // no initialization to do, so signal readiness immediately
+        SignalReady();
+
+        try
+        {
+            DownloadRange(m_backend, m_url, m_flags, m_validator, m_sink, m_offset, m_length, this);
         }
-        else
+        catch (TerminateThreadException&)
+        {
+            m_error = "Download cancelled.";
+            throw;
+        }
+        catch (const std::exception& e)
         {
-            sink->SetFilename(GetURLFileName(urlc.lpszUrlPath));
+            m_error = e.what();
+        }
+        catch (...)
+        {
+            m_error = "Unknown error.";
         }
     }
 
-    // Download the data:
-    char buffer[10240];
-    for ( ;; )
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    IDownloadBackend& m_backend;
+    std::string m_url;
+    int m_flags;
+    std::string m_validator;
+    IRandomAccessDownloadSink *m_sink;
+    size_t m_offset, m_length;
+    std::string m_error;
+};
+
+
+// Owns running SegmentDownloader threads; cancels them if not joined.
+class SegmentDownloaders
+{
+public:
+    ~SegmentDownloaders()
+    {
+        for ( size_t i = 0; i < m_threads.size(); i++ )
+        {
+            m_threads[i]->TerminateAndJoin();
+            delete m_threads[i];
+        }
+    }
+
+    void Start(SegmentDownloader *thread)
+    {
+        m_threads.push_back(thread);
+        thread->Start();
+    }
+
+    // Waits for all threads to finish, throws if any of them failed.
+    void JoinAll(Thread *onThread)
     {
-        INTERNET_BUFFERS ibuf = { 0 };
-        ibuf.dwStructSize = sizeof(ibuf);
-        ibuf.lpvBuffer = buffer;
-        ibuf.dwBufferLength = sizeof(buffer);
+        for ( size_t i = 0; i < m_threads.size(); i++ )
+        {
+            if ( onThread )
+                m_threads[i]->JoinWithTerminationCheck(*onThread);
+            else
+                m_threads[i]->Join();
+            if ( !m_threads[i]->GetError().empty() )
+                throw std::runtime_error(m_threads[i]->GetError());
+        }
+    }
+
+private:
+    std::vector<SegmentDownloader*> m_threads;
+};
+
+
+// What the AsyncSegment downloads of one DownloadSegmented() call share.
+struct AsyncSegmentResults
+{
+    AsyncSegmentResults() : running(0) {}
+
+    // Number of segments still being downloaded
+    volatile LONG running;
+    // Signaled when the last of them finishes
+    Event done;
 
-        if (!InternetReadFileEx(conn, &ibuf, IRF_ASYNC | IRF_NO_WAIT, NULL))
+    // guards the variable below:
+    CriticalSection cs;
+    // Error of the first segment that failed
+    std::string error;
+
+    void Finish(const std::string& err)
+    {
+        if ( !err.empty() )
         {
-            if (GetLastError() != ERROR_IO_PENDING)
-                throw Win32Exception();
+            CriticalSectionLocker lock(cs);
+            if ( error.empty() )
+                error = err;
+        }
+        if ( InterlockedDecrement(&running) == 0 )
+            done.Signal();
+    }
+};
+
+/**
+    Downloads a single byte range of a file like SegmentDownloader, but
+    with an asynchronous request, see IDownloadBackend::OpenURLAsync().
+ */
+class AsyncSegment : public IAsyncResponseHandler
+{
+public:
+    AsyncSegment(IRandomAccessDownloadSink *sink,
+                 size_t offset,
+                 size_t length,
+                 AsyncSegmentResults& results)
+        : m_sink(sink), m_offset(offset), m_length(length), m_received(0),
+          m_results(results)
+    {
+    }
+
+    ~AsyncSegment()
+    {
+        // cancel the request before the handler goes away
+        m_request.reset();
+    }
+
+    /// Starts the download, returns false if @a backend can't do it.
+    bool Start(IDownloadBackend& backend,
+               const std::string& url,
+               int flags,
+               const std::string& validator)
+    {
+        std::ostringstream headers;
+        headers << "Range: bytes=" << m_offset << "-" << (m_offset + m_length - 1) << "\r\n";
+        if ( !validator.empty() )
+            headers << "If-Range: " << validator << "\r\n";
 
-            WaitUntilSignaledWithTerminationCheck(context.eventRequestComplete, onThread);
-            continue;
+        InterlockedIncrement(&m_results.running);
+        try
+        {
+            m_request.reset(backend.OpenURLAsync(url, headers.str(), flags, this));
+        }
+        catch ( ... )
+        {
+            InterlockedDecrement(&m_results.running);
+            throw;
         }
+        if ( !m_request )
+        {
+            InterlockedDecrement(&m_results.running);
+            return false;
+        }
+        return true;
+    }
 
-        if (ibuf.dwBufferLength == 0)
+    virtual bool OnHeaders(IHttpResponse& response)
+    {
+        if ( response.GetStatusCode() != HttpStatus_PartialContent ||
+             !CheckContentRange(response, m_offset) )
         {
-            if (context.lastError != ERROR_SUCCESS)
-                throw Win32Exception();
-            else
-                break; // all of the file was downloaded
+            throw std::runtime_error("Server didn't honor range request.");
         }
+        return true;
+    }
+
+    virtual bool OnData(const void *data, size_t len)
+    {
+        if ( len > m_length - m_received )
+            len = m_length - m_received;
+        m_sink->AddAt(m_offset + m_received, data, len);
+        m_received += len;
+        return m_received < m_length;
+    }
+
+    virtual void OnComplete(const std::string& error)
+    {
+        if ( error.empty() && m_received != m_length )
+            m_results.Finish("Incomplete download of the update file.");
+        else
+            m_results.Finish(error);
+    }
+
+private:
+    IRandomAccessDownloadSink *m_sink;
+    size_t m_offset, m_length, m_received;
+    AsyncSegmentResults& m_results;
+    std::unique_ptr<IAsyncRequest> m_request;
+};
+
+
+// Owns AsyncSegment downloads; cancels them if not finished.
+class AsyncSegments
+{
+public:
+    ~AsyncSegments()
+    {
+        for ( size_t i = 0; i < m_segments.size(); i++ )
+            delete m_segments[i];
+    }
 
-        sink->Add(ibuf.lpvBuffer, ibuf.dwBufferLength);
+    /// Starts the download, returns false if the backend can't do it.
+    bool Start(AsyncSegment *segment,
+               IDownloadBackend& backend,
+               const std::string& url,
+               int flags,
+               const std::string& validator)
+    {
+        m_segments.push_back(segment);
+        return segment->Start(backend, url, flags, validator);
+    }
+
+private:
+    std::vector<AsyncSegment*> m_segments;
+};
+
+
+// Downloads the file in @a segments parts in parallel. The first segment is
+// read from the already open @a response.
+//
+// The other segments are downloaded with asynchronous requests if the
+// backend supports them, so that they don't need a thread each; that's
+// only done if they won't have to be slowed down, see
+// DownloadRateLimiter::MayLimit(), and SegmentDownloader threads are used
+// otherwise.
+void DownloadSegmented(IDownloadBackend& backend,
+                       IHttpResponse& response,
+                       const std::string& url,
+                       int flags,
+                       const std::string& validator,
+                       IRandomAccessDownloadSink *sink,
+                       size_t length,
+                       int segments,
+                       Thread *onThread)
+{
+    sink->BeginSegmented(length);
+
+    const size_t segmentSize = length / segments;
+
+    // declared before the segments, which use them until they're destroyed
+    AsyncSegmentResults asyncResults;
+    AsyncSegments asyncWorkers;
+    SegmentDownloaders workers;
+
+    bool async = !DownloadRateLimiter::Get().MayLimit();
+    for ( int i = 1; i < segments; i++ )
+    {
+        const size_t offset = i * segmentSize;
+        const size_t len = (i == segments - 1) ? length - offset : segmentSize;
+        if ( async )
+        {
+            async = asyncWorkers.Start(new AsyncSegment(sink, offset, len, asyncResults),
+                                       backend, url, flags, validator);
+            if ( async )
+                continue;
+            // else: the backend doesn't support it, use threads instead
+        }
+        workers.Start(new SegmentDownloader(backend, url, flags, validator, sink, offset, len));
     }
+
+    size_t offset = 0;
+    const size_t received = ReadResponseData(response, segmentSize,
+        [&offset, sink](const void *data, size_t len)
+        {
+            sink->AddAt(offset, data, len);
+            offset += len;
+        },
+        onThread);
+    if ( received != segmentSize )
+        throw std::runtime_error("Incomplete download of the update file.");
+
+    workers.JoinAll(onThread);
+
+    // Stalled requests fail with the backend's receive timeout.
+    while ( asyncResults.running > 0 )
+        WaitUntilSignaledWithTerminationCheck(asyncResults.done, onThread);
+    if ( !asyncResults.error.empty() )
+        throw std::runtime_error(asyncResults.error);
+}
+
+
+// How long to wait for any of the probed servers to respond:
+const DWORD MIRROR_PROBE_TIMEOUT = 5000;
+
+// Largest response read by PreconnectToServer() to keep the connection:
+const size_t PRECONNECT_MAX_RESPONSE = 16 * 1024;
+
+// What the MirrorProbe threads of one RankServersByLatency() call share.
+struct MirrorProbeResults
+{
+    MirrorProbeResults() : first(-1), finished(0) {}
+
+    // Index of the first server that responded, -1 if none did yet
+    volatile LONG first;
+    // Number of probes that finished, successfully or not
+    volatile LONG finished;
+    // Signaled whenever a probe finishes
+    Event done;
+};
+
+/**
+    Checks how fast a server responds by requesting the first byte of a file.
+ */
+class MirrorProbe : public Thread
+{
+public:
+    MirrorProbe(IDownloadBackend& backend,
+                const std::string& url,
+                LONG index,
+                MirrorProbeResults& results)
+        : Thread("WinSparkle mirror probe"),
+          m_backend(backend), m_url(url), m_index(index), m_results(results)
+    {
+    }
+
+protected:
+    virtual void Run()
+    {
+        // no initialization to do, so signal readiness immediately
+        SignalReady();
+
+        try
+        {
+            std::unique_ptr<IHttpResponse> response(
+                m_backend.OpenURL(m_url, "Range: bytes=0-0\r\n", 0, this));
+            if ( response->GetStatusCode() < 400 )
+                InterlockedCompareExchange(&m_results.first, m_index, -1);
+        }
+        catch (TerminateThreadException&)
+        {
+            throw;
+        }
+        catch (...)
+        {
+            // the server is unusable, don't prefer it
+        }
+
+        InterlockedIncrement(&m_results.finished);
+        m_results.done.Signal();
+    }
+
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    IDownloadBackend& m_backend;
+    std::string m_url;
+    LONG m_index;
+    MirrorProbeResults& m_results;
+};
+
+
+// Owns running MirrorProbe threads; cancels them if not finished.
+class MirrorProbes
+{
+public:
+    ~MirrorProbes()
+    {
+        for ( size_t i = 0; i < m_threads.size(); i++ )
+        {
+            m_threads[i]->TerminateAndJoin();
+            delete m_threads[i];
+        }
+    }
+
+    void Start(MirrorProbe *thread)
+    {
+        m_threads.push_back(thread);
+        thread->Start();
+    }
+
+private:
+    std::vector<MirrorProbe*> m_threads;
+};
+
+
+/*--------------------------------------------------------------------------*
+                                file names
+ *--------------------------------------------------------------------------*/
+
+int HexDigitValue(char c)
+{
+    if ( c >= '0' && c <= '9' )
+        return c - '0';
+    if ( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool EqualsNoCase(const char *begin, const char *end, const char *str)
+{
+    const size_t len = strlen(str);
+    return size_t(end - begin) == len && _strnicmp(begin, str, len) == 0;
+}
+
+bool IsHeaderSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// Converts the name given by the server to a file name, throwing away any
+// directories in it, so that the file can't be written elsewhere.
+std::wstring SanitizeFileName(const std::wstring& name)
+{
+    const size_t sep = name.find_last_of(L"/\\:");
+    const std::wstring fn = sep == std::wstring::npos ? name : name.substr(sep + 1);
+    if ( fn == L"." || fn == L".." )
+        return std::wstring();
+    return fn;
+}
+
+// Decodes RFC 5987 ext-value, i.e. charset'language'percent-encoded-value.
+// Only UTF-8 and ISO-8859-1, which all clients must support, are known.
+bool DecodeExtValue(const char *begin, const char *end, std::wstring& value)
+{
+    const char *charsetEnd = std::find(begin, end, '\'');
+    if ( charsetEnd == end )
+        return false;
+    const char *langEnd = std::find(charsetEnd + 1, end, '\'');
+    if ( langEnd == end )
+        return false;
+
+    std::string decoded;
+    AppendPercentDecoded(decoded, langEnd + 1, end);
+
+    if ( EqualsNoCase(begin, charsetEnd, "UTF-8") )
+    {
+        value = AnsiToWide(decoded);
+        return true;
+    }
+    if ( EqualsNoCase(begin, charsetEnd, "ISO-8859-1") )
+    {
+        // the first 256 code points are the same as in Latin-1
+        value.resize(decoded.length());
+        for ( size_t i = 0; i < decoded.length(); i++ )
+            value[i] = static_cast<unsigned char>(decoded[i]);
+        return true;
+    }
+    return false;
+}
+
+// Gets the file name from Content-Disposition header value (RFC 6266),
+// preferring filename*= over filename=. Parsed in a single pass over the
+// value, which is of unlimited length. Returns false if there's no name.
+bool ParseContentDisposition(const std::string& header, std::wstring& filename)
+{
+    const char *p = header.c_str();
+    const char *end = p + header.length();
+
+    std::wstring plainName, extName;
+    bool hasPlain = false, hasExt = false;
+
+    // skip the disposition type
+    p = std::find(p, end, ';');
+
+    while ( p < end )
+    {
+        // at ';' before the next parameter
+        p++;
+        while ( p < end && IsHeaderSpace(*p) )
+            p++;
+
+        const char *nameBegin = p;
+        while ( p < end && *p != '=' && *p != ';' )
+            p++;
+        const char *nameEnd = p;
+        while ( nameEnd > nameBegin && IsHeaderSpace(nameEnd[-1]) )
+            nameEnd--;
+
+        if ( p == end || *p == ';' )
+            continue; // parameter without value
+
+        p++; // '='
+        while ( p < end && IsHeaderSpace(*p) )
+            p++;
+
+        std::string value;
+        if ( p < end && *p == '"' )
+        {
+            // quoted-string, with backslash escapes
+            for ( p++; p < end && *p != '"'; p++ )
+            {
+                if ( *p == '\\' && p + 1 < end )
+                    p++;
+                value += *p;
+            }
+            p = std::find(p, end, ';');
+        }
+        else
+        {
+            const char *valueBegin = p;
+            p = std::find(p, end, ';');
+            const char *valueEnd = p;
+            while ( valueEnd > valueBegin && IsHeaderSpace(valueEnd[-1]) )
+                valueEnd--;
+
+            // some servers use single quotes, which isn't valid but clear
+            if ( valueEnd - valueBegin >= 2 &&
+                 *valueBegin == '\'' && valueEnd[-1] == '\'' )
+            {
+                valueBegin++;
+                valueEnd--;
+            }
+
+            if ( EqualsNoCase(nameBegin, nameEnd, "filename*") )
+            {
+                if ( DecodeExtValue(valueBegin, valueEnd, extName) )
+                    hasExt = true;
+                continue;
+            }
+            value.assign(valueBegin, valueEnd);
+        }
+
+        if ( EqualsNoCase(nameBegin, nameEnd, "filename") )
+        {
+            plainName = AnsiToWide(value);
+            hasPlain = true;
+        }
+    }
+
+    if ( hasExt )
+        filename = SanitizeFileName(extName);
+    if ( (!hasExt || filename.empty()) && hasPlain )
+        filename = SanitizeFileName(plainName);
+    return !filename.empty();
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                public functions
+ *--------------------------------------------------------------------------*/
+
+void AppendPercentDecoded(std::string& out, const char *begin, const char *end)
+{
+    out.reserve(out.length() + (end - begin));
+    for ( const char *p = begin; p < end; p++ )
+    {
+        if ( *p == '%' && end - p > 2 )
+        {
+            const int hi = HexDigitValue(p[1]);
+            const int lo = HexDigitValue(p[2]);
+            if ( hi >= 0 && lo >= 0 )
+            {
+                out += static_cast<char>(hi * 16 + lo);
+                p += 2;
+                continue;
+            }
+        }
+        out += *p;
+    }
+}
+
+
+std::wstring GetURLFileName(const char *url)
+{
+    // The query of signed URLs often contains slashes, so the path must be
+    // found first.
+    const char *pathEnd = url + strcspn(url, "?#");
+
+    const char *name = pathEnd;
+    while ( name > url && name[-1] != '/' )
+        name--;
+
+    std::string fn;
+    AppendPercentDecoded(fn, name, pathEnd);
+    return SanitizeFileName(AnsiToWide(fn));
+}
+
+
+
+std::string DownloadResult::Describe() const
+{
+    switch ( status )
+    {
+        case Status_Downloaded:
+        case Status_NotModified:
+            break;
+        case Status_HttpError:
+        {
+            std::ostringstream msg;
+            msg << "The server responded with HTTP status " << httpStatus << ".";
+            return msg.str();
+        }
+        case Status_Cancelled:
+            return "The download was cancelled.";
+    }
+    return std::string();
+}
+
+
+void DownloadResult::ThrowIfFailed() const
+{
+    switch ( status )
+    {
+        case Status_Downloaded:
+        case Status_NotModified:
+            break;
+        case Status_HttpError:
+            throw HttpErrorException("Update file not found on the server.",
+                                     httpStatus, retryAfter);
+        case Status_Cancelled:
+            throw OperationCancelledException();
+    }
+}
+
+
+namespace
+{
+
+DownloadResult DoDownloadFile(const std::string& url, IDownloadSink *sink, Thread *onThread, int flags)
+{
+    TraceActivity activity("Download");
+    activity.SetResult("Error");
+    TraceEvent("DownloadRequest").Field("Url", url).Write(activity.GetId());
+    if ( Logger::IsEnabled(WIN_SPARKLE_LOG_INFO) )
+        LogInfo("Downloading " + url);
+    const TraceTimer timer;
+
+    // internal deployments may host the files on shares, no server needed
+    if ( IsFileSourceURL(url) )
+    {
+        const bool downloaded = DownloadFromFileSource(url, sink, onThread);
+        activity.SetResult(downloaded ? "FileSource" : "NotModified");
+        return DownloadResult(downloaded ? DownloadResult::Status_Downloaded
+                                         : DownloadResult::Status_NotModified);
+    }
+
+    if ( flags & Download_DeliveryOptimization )
+    {
+        IBackgroundDownloadSink *bgSink = dynamic_cast<IBackgroundDownloadSink*>(sink);
+        if ( bgSink &&
+             DownloadFileWithDeliveryOptimization(url, GetURLFileName(url.c_str()), sink, bgSink, onThread, flags) )
+        {
+            activity.SetResult("DeliveryOptimization");
+            return DownloadResult();
+        }
+    }
+
+    if ( flags & Download_Background )
+    {
+        IBackgroundDownloadSink *bgSink = dynamic_cast<IBackgroundDownloadSink*>(sink);
+        if ( bgSink &&
+             DownloadFileInBackground(url, GetURLFileName(url.c_str()), sink, bgSink, onThread, flags) )
+        {
+            activity.SetResult("Background");
+            return DownloadResult();
+        }
+    }
+
+    IDownloadBackend& backend = GetBackend();
+
+    // If the sink has a part of the file already, only ask for the rest,
+    // but only if it didn't change on the server in the meantime:
+    std::string headers;
+    std::string resumeValidator;
+    const size_t resumeOffset = sink->GetResumeOffset(resumeValidator);
+    if ( resumeOffset && !resumeValidator.empty() )
+    {
+        std::ostringstream h;
+        h << "Range: bytes=" << resumeOffset << "-\r\n"
+          << "If-Range: " << resumeValidator << "\r\n";
+        headers = h.str();
+    }
+
+    // If the sink has a copy of the resource already, only download it
+    // again if it changed:
+    std::string cachedETag, cachedLastModified;
+    const bool hasCachedVersion = sink->GetCachedVersion(cachedETag, cachedLastModified);
+    if ( hasCachedVersion )
+    {
+        if ( !cachedETag.empty() )
+            headers += "If-None-Match: " + cachedETag + "\r\n";
+        if ( !cachedLastModified.empty() )
+            headers += "If-Modified-Since: " + cachedLastModified + "\r\n";
+    }
+
+    std::unique_ptr<IHttpResponse> response(backend.OpenURL(url, headers, flags, onThread));
+
+    // Check returned status code - we need to detect 404 instead of
+    // downloading the human-readable 404 page:
+    const unsigned statusCode = response->GetStatusCode();
+    const unsigned long long headersTime = timer.GetMicroseconds();
+    const HttpPhaseTimings phases = response->GetPhaseTimings();
+    TraceEvent("ResponseReceived")
+        .Field("Status", statusCode)
+        .Field("TimeToHeadersUs", headersTime)
+        .Field("ResolveUs", phases.resolve)
+        .Field("ConnectUs", phases.connect)
+        .Field("TlsUs", phases.secure)
+        .Field("SendUs", phases.send)
+        .Field("ServerWaitUs", phases.wait)
+        .Field("Redirects", phases.redirects)
+        .Field("ClosedConnections", phases.closedConnections)
+        .Write(activity.GetId());
+    Stats::RecordResponse(statusCode);
+
+    DownloadTimings timings;
+    timings.resolve = unsigned(phases.resolve / 1000);
+    timings.connect = unsigned(phases.connect / 1000);
+    timings.secure = unsigned(phases.secure / 1000);
+    timings.redirects = phases.redirects;
+    const unsigned long long setupTime = phases.resolve + phases.connect + phases.secure;
+    timings.firstByte = unsigned((headersTime > setupTime ? headersTime - setupTime : 0) / 1000);
+    if ( statusCode == HttpStatus_RangeNotSatisfiable )
+    {
+        // the partial data are bogus, start from scratch next time
+        sink->SetStartOffset(0, std::string());
+        throw std::runtime_error("Cannot resume download of the update file.");
+    }
+    if ( statusCode >= 400 )
+    {
+        activity.SetResult("HttpError");
+        DownloadResult result(DownloadResult::Status_HttpError);
+        result.httpStatus = statusCode;
+        result.retryAfter = GetRetryAfter(*response);
+        return result;
+    }
+    if ( statusCode == HttpStatus_NotModified && hasCachedVersion )
+    {
+        activity.SetResult("NotModified");
+        sink->SetTimings(timings);
+        return DownloadResult(DownloadResult::Status_NotModified);
+    }
+
+    // If the server sent "206 Partial Content", it honored our Range: request
+    // and agreed that the data didn't change. Otherwise, it sends the whole
+    // file again.
+    size_t startOffset = 0;
+    if ( statusCode == HttpStatus_PartialContent && resumeOffset )
+    {
+        if ( !CheckContentRange(*response, resumeOffset) )
+        {
+            sink->SetStartOffset(0, std::string());
+            throw std::runtime_error("Unexpected partial content received from the server.");
+        }
+        startOffset = resumeOffset;
+        Stats::RecordResumedDownload();
+    }
+    const std::string validator = GetResourceValidator(*response);
+    sink->SetStartOffset(startOffset, validator);
+
+    std::string etag, lastModified;
+    response->GetHeader("ETag", etag);
+    response->GetHeader("Last-Modified", lastModified);
+    sink->SetCacheValidators(etag, lastModified);
+
+    std::string extraHeaderValue;
+    for ( size_t i = 0; ; i++ )
+    {
+        const char *extraHeader = sink->GetExtraHeaderName(i);
+        if ( !extraHeader )
+            break;
+        if ( response->GetHeader(extraHeader, extraHeaderValue) )
+            sink->SetExtraHeader(i, extraHeaderValue);
+    }
+
+    // Get content length if possible (if the data are compressed, it's the
+    // length of the compressed data, which is of no use to the sink):
+    size_t contentLength;
+    std::string contentEncoding;
+    const bool hasContentLength =
+        GetHttpHeader(*response, "Content-Length", contentLength) &&
+        !(response->GetHeader("Content-Encoding", contentEncoding) && contentEncoding != "identity");
+    if ( hasContentLength )
+        sink->SetLength(startOffset + contentLength);
+    // Get filename fron Content-Disposition, if available
+    std::string contentDisposition;
+    std::wstring filename;
+    if ( response->GetHeader("Content-Disposition", contentDisposition) &&
+         ParseContentDisposition(contentDisposition, filename) )
+    {
+        sink->SetFilename(filename);
+    }
+    else
+    {
+        // use the URL after redirects, if possible
+        const std::string finalURL = response->GetURL();
+        sink->SetFilename(GetURLFileName(finalURL.empty() ? url.c_str() : finalURL.c_str()));
+    }
+
+    // Download the data, in parallel if the sink supports it and the server
+    // can send us individual parts of the file:
+    IRandomAccessDownloadSink *segmentedSink =
+        (flags & Download_Segmented) ? dynamic_cast<IRandomAccessDownloadSink*>(sink) : NULL;
+    const int segments = GetMaxConnectionsPerServer();
+    std::string acceptRanges;
+    if ( segmentedSink &&
+         segments > 1 &&
+         statusCode == HttpStatus_OK &&
+         hasContentLength && contentLength >= SEGMENTED_DOWNLOAD_MIN_SIZE &&
+         !validator.empty() &&
+         response->GetHeader("Accept-Ranges", acceptRanges) && acceptRanges == "bytes" )
+    {
+        DownloadSegmented(backend, *response, url, flags, validator, segmentedSink,
+                          contentLength, segments, onThread);
+        const unsigned long long duration = timer.GetMicroseconds();
+        TraceEvent("DownloadFinished")
+            .Field("Bytes", contentLength)
+            .Field("DurationUs", duration)
+            .Write(activity.GetId());
+        activity.SetResult("Downloaded");
+
+        Stats::AddBytesDownloaded(contentLength);
+        timings.transfer = unsigned((duration - headersTime) / 1000);
+        sink->SetTimings(timings);
+        return DownloadResult();
+    }
+
+    const unsigned long long cpuStart = Tracing::IsEnabled() ? GetThreadCpuTime() : 0;
+    size_t received = 0;
+    bool cancelled = false;
+    ReadResponseData(*response, 0,
+        [sink, &received](const void *data, size_t len)
+        {
+            sink->Add(data, len);
+            received += len;
+        },
+        onThread, sink, &cancelled);
+
+    if ( cancelled )
+    {
+        activity.SetResult("Cancelled");
+        return DownloadResult(DownloadResult::Status_Cancelled);
+    }
+
+    const unsigned long long duration = timer.GetMicroseconds();
+    if ( Tracing::IsEnabled() )
+    {
+        const unsigned long long transferTime = duration - headersTime;
+        TraceEvent("DownloadFinished")
+            .Field("Bytes", received)
+            .Field("DurationUs", duration)
+            .Field("BytesPerSecond", transferTime ? received * 1000000ULL / transferTime : 0)
+            .Field("CpuUs", GetThreadCpuTime() - cpuStart)
+            .Write(activity.GetId());
+    }
+    activity.SetResult("Downloaded");
+
+    // decompressed data are received, Content-Length is of what was sent
+    if ( !contentEncoding.empty() && contentEncoding != "identity" &&
+         GetHttpHeader(*response, "Content-Length", contentLength) && contentLength < received )
+    {
+        Stats::AddBytesDownloaded(contentLength);
+        Stats::AddBytesSavedByCompression(received - contentLength);
+    }
+    else
+    {
+        Stats::AddBytesDownloaded(received);
+    }
+    timings.transfer = unsigned((duration - headersTime) / 1000);
+    sink->SetTimings(timings);
+    return DownloadResult();
+}
+
+} // anonymous namespace
+
+
+DownloadResult TryDownloadFile(const std::string& url, IDownloadSink *sink, Thread *onThread, int flags)
+{
+    try
+    {
+        return DoDownloadFile(url, sink, onThread, flags);
+    }
+    catch ( OperationCancelledException& )
+    {
+        // thrown further down, e.g. by the backend while waiting for the
+        // server, or by a sink that doesn't implement IsCancelled()
+        if ( !onThread || !onThread->GetCancellationToken().IsCancelled() )
+            throw;
+        return DownloadResult(DownloadResult::Status_Cancelled);
+    }
+}
+
+
+bool DownloadFile(const std::string& url, IDownloadSink *sink, Thread *onThread, int flags)
+{
+    const DownloadResult result = TryDownloadFile(url, sink, onThread, flags);
+    result.ThrowIfFailed();
+    return result.status == DownloadResult::Status_Downloaded;
+}
+
+
+void DownloadFileRange(const std::string& url, size_t offset, size_t length,
+                       IRandomAccessDownloadSink *sink, Thread *onThread)
+{
+    TraceActivity activity("DownloadRange");
+    activity.SetResult("Error");
+
+    if ( IsFileSourceURL(url) )
+        DownloadRangeFromFileSource(url, offset, length, sink, onThread);
+    else
+        DownloadRange(GetBackend(), url, 0, std::string(), sink, offset, length, onThread);
+
+    Stats::AddBytesDownloaded(length);
+    activity.SetResult("Downloaded");
+}
+
+
+void PostData(const std::string& url, const std::string& contentType,
+              const std::string& data, Thread *onThread)
+{
+    const std::string headers = "Content-Type: " + contentType + "\r\n";
+    std::unique_ptr<IHttpResponse> response(GetBackend().PostData(url, headers, data, onThread));
+
+    const unsigned statusCode = response->GetStatusCode();
+    TraceEvent("DataPosted")
+        .Field("Url", url)
+        .Field("Bytes", data.size())
+        .Field("Status", statusCode)
+        .Write();
+    if ( statusCode >= 400 )
+    {
+        throw HttpErrorException("The server didn't accept the data.",
+                                 statusCode, GetRetryAfter(*response));
+    }
+
+    // Connections are only kept for reuse once the response was read.
+    char buffer[1024];
+    while ( response->Read(buffer, sizeof(buffer)) )
+        ;
+}
+
+
+std::vector<std::string> RankServersByLatency(const std::vector<std::string>& urls, Thread *onThread)
+{
+    if ( urls.size() < 2 )
+        return urls;
+
+    IDownloadBackend& backend = GetBackend();
+
+    MirrorProbeResults results;
+    LONG first = -1;
+    {
+        MirrorProbes probes;
+        for ( size_t i = 0; i < urls.size(); i++ )
+            probes.Start(new MirrorProbe(backend, urls[i], LONG(i), results));
+
+        const DWORD start = GetTickCount();
+        for ( ;; )
+        {
+            first = results.first;
+            if ( first != -1 || results.finished == LONG(urls.size()) )
+                break;
+
+            const DWORD elapsed = GetTickCount() - start;
+            if ( elapsed >= MIRROR_PROBE_TIMEOUT )
+                break;
+
+            if ( onThread )
+                onThread->GetCancellationToken().Wait(results.done.GetHandle(), MIRROR_PROBE_TIMEOUT - elapsed);
+            else
+                results.done.WaitUntilSignaled(MIRROR_PROBE_TIMEOUT - elapsed);
+        }
+        // the probes still running are cancelled here
+    }
+
+    TraceEvent("MirrorSelected")
+        .Field("Servers", urls.size())
+        .Field("Url", first != -1 ? urls[first] : std::string())
+        .Write();
+
+    if ( first <= 0 )
+        return urls;
+
+    std::vector<std::string> ranked;
+    ranked.reserve(urls.size());
+    ranked.push_back(urls[first]);
+    for ( size_t i = 0; i < urls.size(); i++ )
+    {
+        if ( LONG(i) != first )
+            ranked.push_back(urls[i]);
+    }
+    return ranked;
+}
+
+
+std::string GetProxyForURL(const std::string& url)
+{
+    if ( IsFileSourceURL(url) )
+        return "DIRECT";
+    return GetBackend().GetProxyForURL(url);
+}
+
+
+void PreconnectToServer(const std::string& url, Thread *onThread)
+{
+    try
+    {
+        std::unique_ptr<IHttpResponse> response(
+            GetBackend().OpenURL(url, "Range: bytes=0-0\r\n", 0, onThread));
+
+        // Connections are only kept for reuse once the response was read.
+        // Servers that ignore the range send the whole file, give up on
+        // reusing the connection if it isn't small.
+        char buffer[1024];
+        size_t total = 0;
+        while ( total < PRECONNECT_MAX_RESPONSE )
+        {
+            const size_t read = response->Read(buffer, sizeof(buffer));
+            if ( !read )
+                break;
+            total += read;
+        }
+    }
+    catch ( std::exception& )
+    {
+        // the download itself reports any errors
+    }
+}
+
+
+void CloseDownloadSession()
+{
+    GetWinINetBackend().CloseSession();
+    GetWinHTTPBackend().CloseSession();
+}
+
+
+/*--------------------------------------------------------------------------*
+                            network connection
+ *--------------------------------------------------------------------------*/
+
+ConnectionCost GetConnectionCost()
+{
+    // INetworkCostManager is only available since Windows 8 (and in its
+    // SDK); assume unrestricted connection on older systems.
+#ifdef __INetworkCostManager_INTERFACE_DEFINED__
+    const HRESULT hrInit = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    ConnectionCost result = ConnectionCost_Unrestricted;
+    INetworkCostManager *manager = NULL;
+    if ( SUCCEEDED(CoCreateInstance(__uuidof(NetworkListManager), NULL, CLSCTX_ALL,
+                                    __uuidof(INetworkCostManager),
+                                    reinterpret_cast<void**>(&manager))) )
+    {
+        DWORD cost = NLM_CONNECTION_COST_UNKNOWN;
+        if ( SUCCEEDED(manager->GetCost(&cost, NULL)) )
+        {
+            if ( cost & (NLM_CONNECTION_COST_OVERDATALIMIT |
+                         NLM_CONNECTION_COST_APPROACHINGDATALIMIT |
+                         NLM_CONNECTION_COST_ROAMING) )
+                result = ConnectionCost_Restricted;
+            else if ( cost & (NLM_CONNECTION_COST_FIXED | NLM_CONNECTION_COST_VARIABLE) )
+                result = ConnectionCost_Metered;
+        }
+        manager->Release();
+    }
+
+    if ( SUCCEEDED(hrInit) )
+        CoUninitialize();
+
+    return result;
+#else
+    return ConnectionCost_Unrestricted;
+#endif
+}
+
+
+bool IsConnectionMetered()
+{
+    return GetConnectionCost() != ConnectionCost_Unrestricted;
+}
+
+
+bool IsConnectedToInternet()
+{
+    COMInitializer com;
+
+    COMPtr<INetworkListManager> manager;
+    if ( FAILED(CoCreateInstance(__uuidof(NetworkListManager), NULL, CLSCTX_ALL,
+                                 __uuidof(INetworkListManager),
+                                 reinterpret_cast<void**>(manager.Receive()))) )
+    {
+        return true;
+    }
+
+    NLM_CONNECTIVITY connectivity;
+    if ( FAILED(manager->GetConnectivity(&connectivity)) )
+        return true;
+
+    return (connectivity & (NLM_CONNECTIVITY_IPV4_INTERNET | NLM_CONNECTIVITY_IPV6_INTERNET)) != 0;
 }
 
 } // namespace winsparkle
@@ -27,12 +27,40 @@
 #define _download_h_
 
 #include <string>
+#include <stdexcept>
+#include <vector>
 
 namespace winsparkle
 {
 
 class Thread;
 
+/**
+    How long the phases of a download took, in milliseconds.
+
+    The network phases are 0 if they didn't happen (e.g. if an existing
+    connection was reused) or if they aren't known.
+ */
+struct DownloadTimings
+{
+    DownloadTimings()
+        : resolve(0), connect(0), secure(0), firstByte(0), transfer(0), redirects(0) {}
+
+    /// Resolving the server's name
+    unsigned resolve;
+    /// Establishing the TCP connection
+    unsigned connect;
+    /// TLS handshake
+    unsigned secure;
+    /// From starting the request, excluding the above, until the response
+    /// headers arrived
+    unsigned firstByte;
+    /// Receiving the data
+    unsigned transfer;
+    /// Number of redirects followed
+    unsigned redirects;
+};
+
 /**
     Abstraction for storing downloaded data.
  */
@@ -52,22 +80,211 @@ struct IDownloadSink
 
     /// Add chunk of downloaded data
     virtual void Add(const void *data, size_t len) = 0;
+
+    /**
+        Ask the sink if it already holds a part of the resource from a previous,
+        interrupted download.
+
+        @param validator  Set to the ETag or Last-Modified value of the
+                          resource the partial data came from.
+
+        @return Number of bytes that don't need to be downloaded again, 0 to
+                download the whole resource.
+     */
+    virtual size_t GetResumeOffset(std::string& /*validator*/) const { return 0; }
+
+    /**
+        Inform the sink where the data passed to Add() starts.
+
+        This is called before SetFilename(). If @a offset is 0, the server
+        sent the whole resource and any partial data must be discarded.
+
+        @param offset     Offset of the first byte passed to Add().
+        @param validator  ETag or Last-Modified value of the resource, empty
+                          if the server didn't send any. Can be used to resume
+                          the download later.
+     */
+    virtual void SetStartOffset(size_t /*offset*/, const std::string& /*validator*/) {}
+
+    /**
+        Ask the sink if it holds a copy of the resource from a previous
+        download.
+
+        If it does, the request is made conditional on the resource having
+        changed since. If it didn't change, no data are passed to the sink
+        and DownloadFile() returns false.
+
+        @param etag          Set to the ETag of the cached copy, if known.
+        @param lastModified  Set to the Last-Modified value of the cached
+                             copy, if known.
+
+        @return true if there's a cached copy and at least one of @a etag
+                and @a lastModified was set.
+     */
+    virtual bool GetCachedVersion(std::string& /*etag*/, std::string& /*lastModified*/) const { return false; }
+
+    /**
+        Inform the sink of the ETag and Last-Modified values of the
+        downloaded resource, to be returned from GetCachedVersion() later.
+
+        This is called before SetFilename(). Either value may be empty if the
+        server didn't send it.
+     */
+    virtual void SetCacheValidators(const std::string& /*etag*/, const std::string& /*lastModified*/) {}
+
+    /**
+        Ask the sink for the names of additional response headers it needs,
+        e.g. custom ones.
+
+        @param index  Index of the header, starting from 0.
+
+        @return Name of the header, or NULL if there are no more.
+
+        If the response has the header, its value is passed to
+        SetExtraHeader() before SetFilename().
+     */
+    virtual const char *GetExtraHeaderName(size_t /*index*/) const { return NULL; }
+
+    /// Inform the sink of the value of the header named by GetExtraHeaderName(index).
+    virtual void SetExtraHeader(size_t /*index*/, const std::string& /*value*/) {}
+
+    /**
+        Ask the sink for a buffer to read the next chunk of data into.
+
+        This lets the data be received directly into the sink's own memory:
+        the chunk is then passed to Add() with @a data pointing to the
+        returned buffer, so the sink doesn't need to copy it anywhere.
+
+        @param len  Size of the chunk that is about to be read. The sink may
+                    lower it (but not to 0) if its buffer is smaller.
+
+        @return Buffer of at least @a len bytes, valid until the next call,
+                or NULL to let DownloadFile() use its own buffer.
+
+        @note This is not used for the data passed to
+              IRandomAccessDownloadSink::AddAt().
+     */
+    virtual void *GetBuffer(size_t& /*len*/) { return NULL; }
+
+    /**
+        Check if the sink received all the data it needs.
+
+        This is checked after every Add(). If it returns true, the transfer
+        is stopped right away, without downloading the rest of the data,
+        and DownloadFile() returns as if the download finished.
+     */
+    virtual bool IsComplete() const { return false; }
+
+    /**
+        Check if the download was cancelled, e.g. because the operation the
+        sink downloads for was.
+
+        This is checked after every Add(), like IsComplete(). If it returns
+        true, the transfer is stopped and TryDownloadFile() returns
+        DownloadResult::Status_Cancelled, so sinks don't need to throw from
+        Add() when they're cancelled.
+     */
+    virtual bool IsCancelled() const { return false; }
+
+    /**
+        Inform the sink how long the download took.
+
+        Called after all the data were passed to the sink, or after the
+        response headers if DownloadFile() returns false.
+     */
+    virtual void SetTimings(const DownloadTimings& /*timings*/) {}
 };
 
+/**
+    IDownloadSink that can receive parts of the data out of order.
+
+    This is needed for downloading the file in several parallel segments,
+    see Download_Segmented.
+ */
+struct IRandomAccessDownloadSink : public IDownloadSink
+{
+    /**
+        Prepare the sink for receiving data of total size @a len out of order.
+
+        Called after SetFilename(). When this is called, the data are passed
+        to AddAt() instead of Add().
+     */
+    virtual void BeginSegmented(size_t len) = 0;
+
+    /**
+        Add chunk of downloaded data at given offset.
+
+        Note that this is called from several threads at once.
+     */
+    virtual void AddAt(size_t offset, const void *data, size_t len) = 0;
+};
+
+
+/**
+    Interface for sinks that can receive a file downloaded in the background
+    by the system, see Download_Background.
+
+    This is implemented by IDownloadSink implementations in addition to
+    IDownloadSink. The file is written by the system service directly, so of
+    the IDownloadSink methods, only SetLength() is used for such downloads.
+ */
+struct IBackgroundDownloadSink
+{
+    virtual ~IBackgroundDownloadSink() {}
+
+    /**
+        Returns full path to save the file named @a filename to.
+
+        Called instead of IDownloadSink::SetFilename() when a new transfer
+        is started. The file only appears there once it's complete.
+     */
+    virtual std::wstring GetBackgroundTarget(const std::wstring& filename) = 0;
+
+    /**
+        Returns ID of the transfer of this file started before, e.g. by a
+        previous run of the application, or empty string if there's none.
+     */
+    virtual std::string GetBackgroundJob() const = 0;
+
+    /**
+        Inform the sink of the transfer used and of the file's location.
+
+        The sink should remember @a job, so that an interrupted transfer can
+        be continued later by returning it from GetBackgroundJob().
+     */
+    virtual void SetBackgroundJob(const std::string& job, const std::wstring& path) = 0;
+
+    /// Inform the sink how much of the file was downloaded so far.
+    virtual void SetBackgroundProgress(size_t downloaded) = 0;
+};
+
+
 /**
     IDownloadSink imlementation for storing data in a string.
  */
 struct StringDownloadSink : public IDownloadSink
 {
-    virtual void SetLength(size_t) {}
+    /// Creates the sink, with the download failing if it's over @a maxLength.
+    explicit StringDownloadSink(size_t maxLength = size_t(-1)) : maxLength(maxLength) {}
+
+    virtual void SetLength(size_t len)
+    {
+        if ( len > maxLength )
+            throw std::runtime_error("Downloaded data are too large.");
+    }
 
     virtual void SetFilename(const std::wstring&) {}
 
     virtual void Add(const void *data, size_t len)
     {
+        if ( len > maxLength - this->data.size() )
+            throw std::runtime_error("Downloaded data are too large.");
         this->data.append(reinterpret_cast<const char*>(data), len);
     }
 
+    /// Maximum length of the data accepted.
+    size_t maxLength;
+
     /// Downloaded data, as a string.
     std::string data;
 };
@@ -77,22 +294,370 @@ struct StringDownloadSink : public IDownloadSink
 enum DownloadFlag
 {
     /// Instruct proxies to pass the request upstream
-    Download_BypassProxies = 1
+    Download_BypassProxies = 1,
+
+    /**
+        Download large files in several segments over parallel connections,
+        if the server supports range requests. The sink must implement
+        IRandomAccessDownloadSink, otherwise this flag is ignored.
+     */
+    Download_Segmented = 2,
+
+    /**
+        Let the server compress the response (gzip or deflate), if the OS
+        can decompress it. The sink always receives decompressed data.
+
+        Ranges then refer to the compressed data, so don't use this for
+        downloads that may be resumed or segmented.
+     */
+    Download_Compressed = 4,
+
+    /**
+        Let the system download the file in the background with BITS, using
+        only idle bandwidth. The transfer survives restarts of the
+        application and of the computer. The sink must implement
+        IBackgroundDownloadSink, otherwise this flag is ignored, as it is if
+        BITS isn't available.
+
+        Conditional and range requests aren't used for such downloads.
+     */
+    Download_Background = 8,
+
+    /**
+        Let the background download (see Download_Background) get the file
+        from other computers on the local network that downloaded it
+        before, and offer it to them in turn, using BranchCache. The data
+        are checked against the server's content information, so this
+        works (from Windows 7 on) only where BranchCache is enabled on the
+        computers and on the server.
+     */
+    Download_PeerCaching = 16,
+
+    /**
+        Let Delivery Optimization (Windows 10 1809 and newer) download the
+        file, getting parts of it from other computers on the network and
+        from caching servers where possible. It is used like
+        Download_Background, with the same requirements on the sink; if
+        Download_Background is set too, the download only uses idle
+        bandwidth, otherwise it runs with foreground priority.
+
+        If Delivery Optimization isn't available, the file is downloaded
+        as if this flag wasn't set.
+     */
+    Download_DeliveryOptimization = 32,
+
+    /**
+        Let background downloads (see Download_Background) yield to all
+        other transfers, by using the lowest BITS priority. Ignored by the
+        other ways of downloading.
+     */
+    Download_LowPriority = 64
 };
 
+/**
+    Exception thrown by DownloadFile() if the server responded with an
+    error status.
+ */
+class HttpErrorException : public std::runtime_error
+{
+public:
+    HttpErrorException(const std::string& msg, unsigned statusCode, int retryAfter)
+        : std::runtime_error(msg), m_statusCode(statusCode), m_retryAfter(retryAfter)
+    {}
+
+    /// Returns HTTP status code of the response.
+    unsigned GetStatusCode() const { return m_statusCode; }
+
+    /**
+        Returns the number of seconds the server asked the client to wait
+        before trying again (the Retry-After header), or -1 if it didn't.
+     */
+    int GetRetryAfter() const { return m_retryAfter; }
+
+    /**
+        Is the error likely to go away by itself, so that trying again soon
+        makes sense? True e.g. for overloaded servers.
+     */
+    bool IsTransient() const
+    {
+        return m_statusCode == 408 || m_statusCode == 429 || m_statusCode >= 500;
+    }
+
+private:
+    unsigned m_statusCode;
+    int m_retryAfter;
+};
+
+/**
+    Exception thrown by DownloadFile() if the download took too long.
+ */
+class DownloadTimeoutException : public std::runtime_error
+{
+public:
+    /// Which limit was exceeded.
+    enum Kind
+    {
+        /// The server didn't respond to the request in time.
+        Timeout_Response,
+        /// The server stopped sending data of the response.
+        Timeout_Stall,
+        /// The DownloadDeadline passed.
+        Timeout_Deadline
+    };
+
+    DownloadTimeoutException(const std::string& msg, Kind kind)
+        : std::runtime_error(msg), m_kind(kind)
+    {}
+
+    Kind GetKind() const { return m_kind; }
+
+private:
+    Kind m_kind;
+};
+
+/**
+    Limits how long the downloads made on the current thread may take in
+    total, while the object exists.
+
+    Besides the deadline, every request has fixed budgets for connecting,
+    for the server's response and for periods without any data received;
+    DownloadTimeoutException is thrown when any of them is exceeded.
+
+    If there's a deadline already, a nested one can only make it sooner.
+ */
+class DownloadDeadline
+{
+public:
+    /**
+        Sets the deadline @a milliseconds from now. INFINITE doesn't set
+        any (but keeps the existing one).
+     */
+    explicit DownloadDeadline(unsigned milliseconds);
+    ~DownloadDeadline();
+
+    /**
+        Returns the number of milliseconds left until the current thread's
+        deadline, 0 if it passed, or INFINITE if there's none.
+     */
+    static unsigned GetRemaining();
+
+private:
+    DownloadDeadline(const DownloadDeadline&);
+    DownloadDeadline& operator=(const DownloadDeadline&);
+
+    // GetTickCount() value of the deadline
+    unsigned m_deadline;
+    DownloadDeadline *m_previous;
+    bool m_active;
+};
+
+
+/**
+    Outcome of TryDownloadFile().
+
+    The routine ways for a download not to succeed, the server responding
+    with an error status and the download being cancelled, are reported
+    with it rather than by throwing. Callers that try several servers, or
+    race requests and cancel the losers, then don't unwind through all the
+    layers of the download for them.
+ */
+struct DownloadResult
+{
+    enum Status
+    {
+        /// The resource was downloaded
+        Status_Downloaded,
+        /// The sink's cached copy is still current
+        Status_NotModified,
+        /// The server responded with an error status, see httpStatus
+        Status_HttpError,
+        /// The download's thread was told to terminate, or the sink cancelled it
+        Status_Cancelled
+    };
+
+    explicit DownloadResult(Status status_ = Status_Downloaded)
+        : status(status_), httpStatus(0), retryAfter(-1) {}
+
+    Status status;
+    /// HTTP status code of the error response, for Status_HttpError
+    unsigned httpStatus;
+    /// Retry-After of the error response in seconds, -1 if it had none
+    int retryAfter;
+
+    /// Was the resource downloaded, or is the cached copy current?
+    bool Succeeded() const
+    {
+        return status == Status_Downloaded || status == Status_NotModified;
+    }
+
+    /// Describes the failure, for logging.
+    std::string Describe() const;
+
+    /**
+        Throws as DownloadFile() does if the download didn't succeed:
+        HttpErrorException or TerminateThreadException.
+     */
+    void ThrowIfFailed() const;
+};
+
+/**
+    Downloads a HTTP resource, reporting the routine failures with the
+    result.
+
+    Other errors, e.g. when the server can't be reached or if the sink
+    can't store the data, are still thrown.
+
+    @param url       URL of the resource to download.
+    @param sink      Where to put downloaded data.
+    @param onThread  Thread the request runs on.
+    @param flags     Or-combination of DownloadFlag values.
+
+    @see DownloadFile()
+ */
+DownloadResult TryDownloadFile(const std::string& url, IDownloadSink *sink, Thread *onThread, int flags = 0);
+
 /**
     Downloads a HTTP resource.
 
-    Throws on error.
+    Throws on error, see DownloadResult::ThrowIfFailed() for the routine
+    ones.
 
     @param url       URL of the resource to download.
     @param sink      Where to put downloaded data.
     @param onThread  Thread the request runs on.
     @param flags     Or-combination of DownloadFlag values.
 
+    @return true if the resource was downloaded, false if the sink's cached
+            copy is still current (see IDownloadSink::GetCachedVersion()).
+
+    @see HttpErrorException
+
     @see CheckConnection()
  */
-void DownloadFile(const std::string& url, IDownloadSink *sink, Thread *onThread, int flags = 0);
+bool DownloadFile(const std::string& url, IDownloadSink *sink, Thread *onThread, int flags = 0);
+
+/**
+    Downloads a part of a file with a range request.
+
+    The @a length bytes at @a offset are passed to @a sink's
+    IRandomAccessDownloadSink::AddAt(), possibly in several calls; no other
+    sink methods are called. The request isn't conditional, so the caller
+    must check that the data are from the file it expects, e.g. by their hash.
+
+    Throws on error, including if the server doesn't support range requests.
+ */
+void DownloadFileRange(const std::string& url, size_t offset, size_t length,
+                       IRandomAccessDownloadSink *sink, Thread *onThread);
+
+/**
+    Sends data to a HTTP server in a POST request.
+
+    The request is made in the session shared by DownloadFile() calls, so an
+    open connection to the server is reused. The response's body is ignored.
+
+    Throws on error.
+
+    @param url          URL to send the data to.
+    @param contentType  MIME type of @a data.
+    @param data         The data to send.
+    @param onThread     Thread the request runs on.
+
+    @see HttpErrorException
+ */
+void PostData(const std::string& url, const std::string& contentType,
+              const std::string& data, Thread *onThread);
+
+/**
+    Orders servers hosting the same file by how fast they respond.
+
+    All the servers are asked for the first byte of the file at once; the
+    one that responds first is moved to the front of the list, the others
+    keep their order. Servers that don't respond within a few seconds or
+    respond with an error aren't preferred.
+
+    @param urls      URLs of the file on the servers, preferred first.
+    @param onThread  Thread the requests are made from.
+
+    @return @a urls, reordered.
+ */
+std::vector<std::string> RankServersByLatency(const std::vector<std::string>& urls, Thread *onThread);
+
+/**
+    Describes the proxy DownloadFile() uses for @a url, see
+    IDownloadBackend::GetProxyForURL(). Throws on error.
+ */
+std::string GetProxyForURL(const std::string& url);
+
+/**
+    Returns the file name part of @a url, without any query string.
+
+    This is the name DownloadFile() uses for the file if the server doesn't
+    specify one.
+ */
+std::wstring GetURLFileName(const char *url);
+
+/**
+    Connects to the server of @a url in the session shared by DownloadFile()
+    calls, so that a subsequent download from it doesn't have to wait for
+    DNS resolution and the TLS handshake.
+
+    Only a single byte is requested from @a url. Errors are ignored.
+
+    Throws TerminateThreadException if @a onThread is told to terminate.
+ */
+void PreconnectToServer(const std::string& url, Thread *onThread);
+
+/**
+    Closes the network session shared by all DownloadFile() calls.
+
+    Requests in progress are not affected; the session is closed when they
+    finish. A subsequent DownloadFile() call opens a new session.
+ */
+void CloseDownloadSession();
+
+/**
+    Checks if the current network connection is metered.
+
+    This is the case e.g. on mobile broadband, where the user may be
+    charged for the data, or if the connection is over its data limit.
+    Large downloads the user didn't ask for should be avoided then.
+
+    @return true if metered, false if not or if it cannot be determined.
+
+    @see GetConnectionCost()
+ */
+bool IsConnectionMetered();
+
+/// How much the user pays for data on the network connection.
+enum ConnectionCost
+{
+    /// Not metered, or it cannot be determined
+    ConnectionCost_Unrestricted,
+    /// Metered, e.g. mobile broadband with a data plan
+    ConnectionCost_Metered,
+    /// Roaming, or over or close to its data limit
+    ConnectionCost_Restricted
+};
+
+/// Returns the cost of the current network connection.
+ConnectionCost GetConnectionCost();
+
+/**
+    Checks if the computer is connected to the Internet.
+
+    @return false if known to be offline, true if connected or if it cannot
+            be determined (e.g. on Windows XP).
+ */
+bool IsConnectedToInternet();
+
+/**
+    Cancels a background download started by DownloadFile().
+
+    Does nothing if the download doesn't exist (anymore).
+
+    @param job  ID of the download, see IBackgroundDownloadSink::SetBackgroundJob().
+ */
+void CancelBackgroundDownload(const std::string& job);
 
 } // namespace winsparkle
 
@@ -0,0 +1,512 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _downloadbackend_h_
+#define _downloadbackend_h_
+
+#include "threads.h"
+
+#include <string>
+#include <objbase.h>
+
+namespace winsparkle
+{
+
+struct IDownloadSink;
+struct IBackgroundDownloadSink;
+struct IRandomAccessDownloadSink;
+
+/**
+    Durations of the network phases of a request, in microseconds.
+
+    If the request was redirected, they are the sums over all the requests
+    made. Phases that didn't happen (e.g. connecting, if an existing
+    connection was reused) or that the backend doesn't report are 0.
+ */
+struct HttpPhaseTimings
+{
+    HttpPhaseTimings()
+        : resolve(0), connect(0), secure(0), send(0), wait(0),
+          redirects(0), closedConnections(0) {}
+
+    /// Resolving the server's name (DNS)
+    unsigned long long resolve;
+    /// Establishing the TCP connection
+    unsigned long long connect;
+    /// From connected until the request started being sent: TLS handshake
+    unsigned long long secure;
+    /// Sending the request
+    unsigned long long send;
+    /// From sent request until the response started arriving: server think time
+    unsigned long long wait;
+    /// Number of redirects followed
+    unsigned redirects;
+    /// Number of connections the server closed during the request
+    unsigned closedConnections;
+};
+
+/// Network phases of a request, as reported by the backends.
+enum HttpPhase
+{
+    HttpPhase_Resolving,
+    HttpPhase_Resolved,
+    HttpPhase_Connecting,
+    HttpPhase_Connected,
+    HttpPhase_Sending,
+    HttpPhase_Sent,
+    HttpPhase_Receiving,
+    HttpPhase_Received,
+    HttpPhase_Redirect,
+    HttpPhase_ConnectionClosed
+};
+
+/**
+    Measures HttpPhaseTimings from notifications of phase changes.
+
+    The backends call OnPhase() from their status callbacks. They must not
+    call it from more than one thread at a time and must only read
+    GetTimings() when the callback can't run, e.g. after the request
+    completed.
+ */
+class HttpPhaseTimer
+{
+public:
+    HttpPhaseTimer();
+
+    /// Records that @a phase of the request started or finished.
+    void OnPhase(HttpPhase phase);
+
+    const HttpPhaseTimings& GetTimings() const { return m_timings; }
+
+private:
+    HttpPhaseTimings m_timings;
+    // when the phase being timed started, 0 if none is being timed
+    long long m_phaseStart;
+    HttpPhase m_lastPhase;
+};
+
+/**
+    HTTP response being received, see IDownloadBackend::OpenURL().
+ */
+struct IHttpResponse
+{
+    virtual ~IHttpResponse() {}
+
+    /// Returns HTTP status code of the response.
+    virtual unsigned GetStatusCode() = 0;
+
+    /// Gets value of a response header, returns false if it isn't present.
+    virtual bool GetHeader(const char *name, std::string& value) = 0;
+
+    /// Returns URL of the resource, after following any redirects.
+    virtual std::string GetURL() = 0;
+
+    /**
+        Reads the next chunk of the response body into @a buffer.
+
+        Throws on error.
+
+        @return Number of bytes read, 0 at the end of data.
+     */
+    virtual size_t Read(void *buffer, size_t len) = 0;
+
+    /**
+        Returns how long the network phases of the request took, up until
+        the response headers arrived. Empty if the backend can't tell.
+     */
+    virtual HttpPhaseTimings GetPhaseTimings() { return HttpPhaseTimings(); }
+};
+
+
+/**
+    Receives the response of a request started with
+    IDownloadBackend::OpenURLAsync().
+
+    The methods are called on the backend's threads, one at a time, and
+    shouldn't block them. If OnHeaders() or OnData() throws, the request
+    ends with the exception's message as the error.
+ */
+struct IAsyncResponseHandler
+{
+    virtual ~IAsyncResponseHandler() {}
+
+    /**
+        Called when the response headers arrived.
+
+        @a response may only be queried for the status and headers, its
+        Read() must not be called.
+
+        @return false to end the request without reading the body.
+     */
+    virtual bool OnHeaders(IHttpResponse& response) = 0;
+
+    /**
+        Called with the next chunk of the response body.
+
+        @return false to end the request, e.g. when all the data needed
+                arrived.
+     */
+    virtual bool OnData(const void *data, size_t len) = 0;
+
+    /**
+        Called once when the request ended, with the error message if it
+        failed or empty string if it didn't.
+
+        This may also be called while the request is being destroyed, so
+        the handler must outlive it. Must not throw.
+     */
+    virtual void OnComplete(const std::string& error) = 0;
+};
+
+/**
+    Request started by IDownloadBackend::OpenURLAsync().
+
+    Destroying it cancels the request if it is still running and waits
+    until the handler's methods don't run anymore.
+ */
+struct IAsyncRequest
+{
+    virtual ~IAsyncRequest() {}
+};
+
+
+/**
+    Implementation of HTTP requests used by DownloadFile().
+ */
+struct IDownloadBackend
+{
+    virtual ~IDownloadBackend() {}
+
+    /**
+        Sends a GET request and waits until the response headers arrive.
+
+        Throws on error.
+
+        @param url       URL of the resource to download.
+        @param headers   Additional request headers, each terminated with CRLF.
+        @param flags     Or-combination of DownloadFlag values.
+        @param onThread  Thread the request runs on.
+
+        @return The response, owned by the caller.
+     */
+    virtual IHttpResponse *OpenURL(const std::string& url,
+                                   const std::string& headers,
+                                   int flags,
+                                   Thread *onThread) = 0;
+
+    /**
+        Sends a POST request with @a body and waits until the response
+        headers arrive. Throws on error.
+
+        The request uses the same shared session as OpenURL(), so it can
+        reuse an open connection to the server.
+
+        @param url       URL to send the data to.
+        @param headers   Additional request headers, each terminated with CRLF.
+        @param body      Data of the request.
+        @param onThread  Thread the request runs on.
+
+        @return The response, owned by the caller.
+     */
+    virtual IHttpResponse *PostData(const std::string& url,
+                                    const std::string& headers,
+                                    const std::string& body,
+                                    Thread *onThread) = 0;
+
+    /**
+        Sends a GET request like OpenURL(), but doesn't wait for it: the
+        response is passed to @a handler as it arrives, driven entirely by
+        the backend's completion notifications, so no thread is blocked
+        while the request runs.
+
+        Throws if the request couldn't be started.
+
+        @return The request, owned by the caller, or NULL if the backend
+                doesn't support asynchronous requests; OpenURL() must be
+                used then.
+     */
+    virtual IAsyncRequest *OpenURLAsync(const std::string& url,
+                                        const std::string& headers,
+                                        int flags,
+                                        IAsyncResponseHandler *handler)
+    {
+        return NULL;
+    }
+
+    /// Closes the backend's shared session, see CloseDownloadSession().
+    virtual void CloseSession() = 0;
+
+    /**
+        Describes the proxy requests to @a url go through: "DIRECT", the
+        proxy's address, or empty string if the backend leaves the proxy
+        to the system. Throws on error.
+
+        This may take long if it wasn't looked up yet, e.g. with WPAD.
+     */
+    virtual std::string GetProxyForURL(const std::string& /*url*/) { return std::string(); }
+};
+
+/// Returns the WinINet-based backend.
+IDownloadBackend& GetWinINetBackend();
+
+/// Returns the WinHTTP-based backend.
+IDownloadBackend& GetWinHTTPBackend();
+
+/// Returns backend recording responses of @a backend, see
+/// win_sparkle_set_http_recording().
+IDownloadBackend& GetRecordingBackend(IDownloadBackend& backend);
+
+/// Returns backend replaying recorded responses, see
+/// win_sparkle_set_http_replay().
+IDownloadBackend& GetReplayBackend();
+
+/**
+    Downloads the file with BITS, see Download_Background.
+
+    Throws on error.
+
+    @param url       URL of the file to download.
+    @param filename  Name to save the file under.
+    @param sink      The sink, notified of the file's length.
+    @param bgSink    The same sink, receiving the file.
+    @param onThread  Thread the download runs on.
+    @param flags     Or-combination of DownloadFlag values.
+
+    @return false if BITS isn't available, true if the file was downloaded.
+ */
+bool DownloadFileInBackground(const std::string& url,
+                              const std::wstring& filename,
+                              IDownloadSink *sink,
+                              IBackgroundDownloadSink *bgSink,
+                              Thread *onThread,
+                              int flags);
+
+/**
+    Downloads the file with Delivery Optimization, see
+    Download_DeliveryOptimization.
+
+    The parameters and return value are the same as for
+    DownloadFileInBackground(). False is also returned if the download
+    couldn't be started, so another method should be tried then.
+ */
+bool DownloadFileWithDeliveryOptimization(const std::string& url,
+                                          const std::wstring& filename,
+                                          IDownloadSink *sink,
+                                          IBackgroundDownloadSink *bgSink,
+                                          Thread *onThread,
+                                          int flags);
+
+/**
+    Cancels the download started by DownloadFileWithDeliveryOptimization().
+
+    @return false if @a job isn't a Delivery Optimization download.
+ */
+bool CancelDeliveryOptimizationDownload(const std::string& job);
+
+
+/*--------------------------------------------------------------------------*
+                              file sources
+ *--------------------------------------------------------------------------*/
+
+/**
+    Is @a url a file on a share or a local disk rather than an HTTP URL?
+
+    These are the file:// URLs and UNC paths of files on shares, which
+    DownloadFile() reads directly instead of using the HTTP backend.
+ */
+bool IsFileSourceURL(const std::string& url);
+
+/**
+    Reads the file at @a url into @a sink, see IsFileSourceURL().
+
+    A sink that can receive files downloaded in the background gets a copy
+    made with CopyFileEx(), which lets the system offload the copy (e.g. to
+    the storage with ODX) and bypass the cache for large files; other sinks
+    get the data as with HTTP. The file's size and modification time stand
+    for the ETag.
+
+    @return false if the sink's cached copy is still current.
+ */
+bool DownloadFromFileSource(const std::string& url, IDownloadSink *sink, Thread *onThread);
+
+/// Reads a part of the file at @a url, like DownloadFileRange().
+void DownloadRangeFromFileSource(const std::string& url, size_t offset, size_t length,
+                                 IRandomAccessDownloadSink *sink, Thread *onThread);
+
+
+/**
+    Session handle shared by all requests made with a backend, so that
+    keep-alive connections and TLS sessions are reused between them (e.g.
+    between the appcast feed and the update file download that follows it).
+
+    The session is opened on first use and closed when Close() was called
+    and no request uses it anymore.
+ */
+class SharedSession
+{
+public:
+    typedef void *Handle;
+
+    SharedSession(Handle (*openFunc)(), void (*closeFunc)(Handle));
+
+    /// Returns the session handle, opening it if needed. Throws on error.
+    Handle Acquire();
+
+    /// Releases the handle obtained from Acquire().
+    void Release();
+
+    /// Closes the session as soon as it isn't used by any request.
+    void Close();
+
+private:
+    Handle (*m_openFunc)();
+    void (*m_closeFunc)(Handle);
+
+    // guards the variables below:
+    CriticalSection m_cs;
+    Handle m_handle;
+    int m_users;
+    bool m_closeRequested;
+};
+
+/// Holds a reference to SharedSession during a request, as RIIA.
+class SharedSessionRef
+{
+public:
+    SharedSessionRef(SharedSession& session)
+        : m_session(session), m_handle(session.Acquire()) {}
+    ~SharedSessionRef() { m_session.Release(); }
+
+    operator SharedSession::Handle() const { return m_handle; }
+
+private:
+    SharedSession& m_session;
+    SharedSession::Handle m_handle;
+};
+
+
+/// Appends [begin, end) to out, decoding %XX escapes. Invalid escapes are
+/// copied as they are.
+void AppendPercentDecoded(std::string& out, const char *begin, const char *end);
+
+/// Returns the User-Agent string to use for HTTP requests.
+std::wstring MakeUserAgent();
+
+/// Returns maximum number of simultaneous connections to a single server.
+int GetMaxConnectionsPerServer();
+
+/// Waits for @a event, throwing if @a thread is told to terminate meanwhile.
+void WaitUntilSignaledWithTerminationCheck(Event& event, Thread *thread);
+
+/**
+    Should revocation of @a host's certificate be checked?
+
+    True for RevocationCheck_Strict, and for RevocationCheck_SoftFail unless
+    the revocation status couldn't be looked up recently, see
+    RememberRevocationOffline().
+ */
+bool ShouldCheckRevocation(const std::wstring& host);
+
+/// Records that the revocation status of @a host's certificate couldn't be
+/// looked up, so that it isn't tried again for a while.
+void RememberRevocationOffline(const std::wstring& host);
+
+// Budgets of a request's phases, in milliseconds. The connection's budget
+// is set as the backends' option, the others are enforced by
+// WaitForNetworkIO().
+const DWORD CONNECT_TIMEOUT = 15000;
+const DWORD RESPONSE_TIMEOUT = 60000;
+const DWORD STALL_TIMEOUT = 30000;
+
+/// What the backend waits for in WaitForNetworkIO().
+enum NetworkWait
+{
+    /// response headers, after starting the request (RESPONSE_TIMEOUT)
+    NetworkWait_Response,
+    /// next chunk of the response body (STALL_TIMEOUT)
+    NetworkWait_Data
+};
+
+/**
+    Waits for @a event signaled when asynchronous I/O of a request
+    completes, like WaitUntilSignaledWithTerminationCheck().
+
+    Throws DownloadTimeoutException if the budget for @a wait or the
+    thread's DownloadDeadline runs out first. The caller must then close
+    the request, which cancels the I/O.
+ */
+void WaitForNetworkIO(Event& event, Thread *thread, NetworkWait wait);
+
+
+/*--------------------------------------------------------------------------*
+          COM helpers for the system services downloading files
+ *--------------------------------------------------------------------------*/
+
+/// Throws std::runtime_error with @a msg if @a hr is a failure.
+void CheckHResult(HRESULT hr, const char *msg);
+
+/// Initializes COM on the current thread for as long as it exists.
+class COMInitializer
+{
+public:
+    // If COM is already initialized as STA, the services can be used anyway.
+    COMInitializer() : m_initialized(SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED))) {}
+    ~COMInitializer() { if ( m_initialized ) CoUninitialize(); }
+
+private:
+    bool m_initialized;
+};
+
+/// Releases COM interface pointer, as RIIA.
+template<typename T>
+class COMPtr
+{
+public:
+    COMPtr() : m_ptr(NULL) {}
+    ~COMPtr() { Reset(); }
+
+    void Reset()
+    {
+        if ( m_ptr )
+            m_ptr->Release();
+        m_ptr = NULL;
+    }
+
+    /// Returns address to store a new pointer into.
+    T **Receive() { Reset(); return &m_ptr; }
+
+    T *Get() const { return m_ptr; }
+    T *operator->() const { return m_ptr; }
+
+private:
+    COMPtr(const COMPtr&);
+    COMPtr& operator=(const COMPtr&);
+
+    T *m_ptr;
+};
+
+} // namespace winsparkle
+
+#endif // _downloadbackend_h_
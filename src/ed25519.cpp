@@ -0,0 +1,450 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "ed25519.h"
+
+#include <stdexcept>
+#include <string.h>
+
+/*
+    Only verification is implemented here, which involves public data only,
+    so none of it needs to be constant-time. The field and group arithmetic
+    follows TweetNaCl (https://tweetnacl.cr.yp.to/, public domain): numbers
+    modulo 2^255-19 are stored as 16 limbs of 16 bits, points in extended
+    twisted Edwards coordinates.
+ */
+
+namespace winsparkle
+{
+
+namespace
+{
+
+typedef long long i64;
+typedef i64 gf[16];
+
+const gf GF0 = { 0 };
+const gf GF1 = { 1 };
+
+// curve constant d
+const gf D =
+{
+    0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+    0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203
+};
+
+// 2*d
+const gf D2 =
+{
+    0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+    0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406
+};
+
+// base point coordinates
+const gf BASE_X =
+{
+    0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+    0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169
+};
+const gf BASE_Y =
+{
+    0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+    0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666
+};
+
+// sqrt(-1)
+const gf SQRT_M1 =
+{
+    0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+    0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83
+};
+
+// order of the base point, little-endian
+const i64 ORDER[32] =
+{
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+    0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0x10
+};
+
+/*--------------------------------------------------------------------------*
+                          arithmetic mod 2^255-19
+ *--------------------------------------------------------------------------*/
+
+void Set(gf r, const gf a)
+{
+    for ( int i = 0; i < 16; i++ )
+        r[i] = a[i];
+}
+
+void Carry(gf o)
+{
+    for ( int i = 0; i < 16; i++ )
+    {
+        o[i] += (i64(1) << 16);
+        const i64 c = o[i] >> 16;
+        if ( i < 15 )
+            o[i + 1] += c - 1;
+        else
+            o[0] += 38 * (c - 1);
+        o[i] -= c * 65536;
+    }
+}
+
+// swaps p and q if b is 1
+void Select(gf p, gf q, int b)
+{
+    const i64 c = ~i64(b - 1);
+    for ( int i = 0; i < 16; i++ )
+    {
+        const i64 t = c & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+void Pack(unsigned char *o, const gf n)
+{
+    gf m, t;
+    Set(t, n);
+    Carry(t);
+    Carry(t);
+    Carry(t);
+    for ( int j = 0; j < 2; j++ )
+    {
+        m[0] = t[0] - 0xffed;
+        for ( int i = 1; i < 15; i++ )
+        {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        const int b = int((m[15] >> 16) & 1);
+        m[14] &= 0xffff;
+        Select(t, m, 1 - b);
+    }
+    for ( int i = 0; i < 16; i++ )
+    {
+        o[2 * i] = (unsigned char)(t[i] & 0xff);
+        o[2 * i + 1] = (unsigned char)(t[i] >> 8);
+    }
+}
+
+void Unpack(gf o, const unsigned char *n)
+{
+    for ( int i = 0; i < 16; i++ )
+        o[i] = n[2 * i] + (i64(n[2 * i + 1]) << 8);
+    o[15] &= 0x7fff;
+}
+
+bool NotEqual(const gf a, const gf b)
+{
+    unsigned char c[32], d[32];
+    Pack(c, a);
+    Pack(d, b);
+    return memcmp(c, d, 32) != 0;
+}
+
+int Parity(const gf a)
+{
+    unsigned char d[32];
+    Pack(d, a);
+    return d[0] & 1;
+}
+
+void Add(gf o, const gf a, const gf b)
+{
+    for ( int i = 0; i < 16; i++ )
+        o[i] = a[i] + b[i];
+}
+
+void Sub(gf o, const gf a, const gf b)
+{
+    for ( int i = 0; i < 16; i++ )
+        o[i] = a[i] - b[i];
+}
+
+void Mul(gf o, const gf a, const gf b)
+{
+    i64 t[31];
+    for ( int i = 0; i < 31; i++ )
+        t[i] = 0;
+    for ( int i = 0; i < 16; i++ )
+        for ( int j = 0; j < 16; j++ )
+            t[i + j] += a[i] * b[j];
+    for ( int i = 0; i < 15; i++ )
+        t[i] += 38 * t[i + 16];
+    for ( int i = 0; i < 16; i++ )
+        o[i] = t[i];
+    Carry(o);
+    Carry(o);
+}
+
+void Square(gf o, const gf a)
+{
+    Mul(o, a, a);
+}
+
+void Invert(gf o, const gf i)
+{
+    gf c;
+    Set(c, i);
+    for ( int a = 253; a >= 0; a-- )
+    {
+        Square(c, c);
+        if ( a != 2 && a != 4 )
+            Mul(c, c, i);
+    }
+    Set(o, c);
+}
+
+// computes i^((p-5)/8)
+void Pow2523(gf o, const gf i)
+{
+    gf c;
+    Set(c, i);
+    for ( int a = 250; a >= 0; a-- )
+    {
+        Square(c, c);
+        if ( a != 1 )
+            Mul(c, c, i);
+    }
+    Set(o, c);
+}
+
+/*--------------------------------------------------------------------------*
+                               curve points
+ *--------------------------------------------------------------------------*/
+
+void PointAdd(gf p[4], gf q[4])
+{
+    gf a, b, c, d, t, e, f, g, h;
+
+    Sub(a, p[1], p[0]);
+    Sub(t, q[1], q[0]);
+    Mul(a, a, t);
+    Add(b, p[0], p[1]);
+    Add(t, q[0], q[1]);
+    Mul(b, b, t);
+    Mul(c, p[3], q[3]);
+    Mul(c, c, D2);
+    Mul(d, p[2], q[2]);
+    Add(d, d, d);
+    Sub(e, b, a);
+    Sub(f, d, c);
+    Add(g, d, c);
+    Add(h, b, a);
+
+    Mul(p[0], e, f);
+    Mul(p[1], h, g);
+    Mul(p[2], g, f);
+    Mul(p[3], e, h);
+}
+
+void PointSelect(gf p[4], gf q[4], int b)
+{
+    for ( int i = 0; i < 4; i++ )
+        Select(p[i], q[i], b);
+}
+
+void PointPack(unsigned char *r, gf p[4])
+{
+    gf tx, ty, zi;
+    Invert(zi, p[2]);
+    Mul(tx, p[0], zi);
+    Mul(ty, p[1], zi);
+    Pack(r, ty);
+    r[31] ^= (unsigned char)(Parity(tx) << 7);
+}
+
+// computes p = s*q; q is overwritten
+void ScalarMult(gf p[4], gf q[4], const unsigned char *s)
+{
+    Set(p[0], GF0);
+    Set(p[1], GF1);
+    Set(p[2], GF1);
+    Set(p[3], GF0);
+    for ( int i = 255; i >= 0; --i )
+    {
+        const int b = (s[i / 8] >> (i & 7)) & 1;
+        PointSelect(p, q, b);
+        PointAdd(q, p);
+        PointAdd(p, p);
+        PointSelect(p, q, b);
+    }
+}
+
+void ScalarMultBase(gf p[4], const unsigned char *s)
+{
+    gf q[4];
+    Set(q[0], BASE_X);
+    Set(q[1], BASE_Y);
+    Set(q[2], GF1);
+    Mul(q[3], BASE_X, BASE_Y);
+    ScalarMult(p, q, s);
+}
+
+// decodes point p and negates it, returns false if it's not on the curve
+bool UnpackNeg(gf r[4], const unsigned char *p)
+{
+    gf t, chk, num, den, den2, den4, den6;
+    Set(r[2], GF1);
+    Unpack(r[1], p);
+    Square(num, r[1]);
+    Mul(den, num, D);
+    Sub(num, num, r[2]);
+    Add(den, r[2], den);
+
+    Square(den2, den);
+    Square(den4, den2);
+    Mul(den6, den4, den2);
+    Mul(t, den6, num);
+    Mul(t, t, den);
+
+    Pow2523(t, t);
+    Mul(t, t, num);
+    Mul(t, t, den);
+    Mul(t, t, den);
+    Mul(r[0], t, den);
+
+    Square(chk, r[0]);
+    Mul(chk, chk, den);
+    if ( NotEqual(chk, num) )
+        Mul(r[0], r[0], SQRT_M1);
+
+    Square(chk, r[0]);
+    Mul(chk, chk, den);
+    if ( NotEqual(chk, num) )
+        return false;
+
+    if ( Parity(r[0]) == (p[31] >> 7) )
+        Sub(r[0], GF0, r[0]);
+
+    Mul(r[3], r[0], r[1]);
+    return true;
+}
+
+/*--------------------------------------------------------------------------*
+                       arithmetic modulo group order
+ *--------------------------------------------------------------------------*/
+
+void ModOrder(unsigned char *r, i64 x[64])
+{
+    i64 carry;
+    for ( int i = 63; i >= 32; --i )
+    {
+        carry = 0;
+        int j;
+        for ( j = i - 32; j < i - 12; ++j )
+        {
+            x[j] += carry - 16 * x[i] * ORDER[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry * 256;
+        }
+        x[j] += carry;
+        x[i] = 0;
+    }
+    carry = 0;
+    for ( int j = 0; j < 32; j++ )
+    {
+        x[j] += carry - (x[31] >> 4) * ORDER[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+    for ( int j = 0; j < 32; j++ )
+        x[j] -= carry * ORDER[j];
+    for ( int i = 0; i < 32; i++ )
+    {
+        x[i + 1] += x[i] >> 8;
+        r[i] = (unsigned char)(x[i] & 255);
+    }
+}
+
+// reduces 64 bytes long little-endian number modulo the group order
+void Reduce(unsigned char *r, const unsigned char *n)
+{
+    i64 x[64];
+    for ( int i = 0; i < 64; i++ )
+        x[i] = n[i];
+    ModOrder(r, x);
+}
+
+// checks that little-endian number s is smaller than the group order
+bool IsReduced(const unsigned char *s)
+{
+    for ( int i = 31; i >= 0; --i )
+    {
+        if ( s[i] != ORDER[i] )
+            return s[i] < ORDER[i];
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                            Ed25519PublicKey
+ *--------------------------------------------------------------------------*/
+
+Ed25519PublicKey::Ed25519PublicKey(const std::string& key)
+    : m_key(key)
+{
+    if ( key.size() != KEY_SIZE ||
+         !UnpackNeg(m_negPoint, reinterpret_cast<const unsigned char*>(key.data())) )
+    {
+        throw std::invalid_argument("Invalid Ed25519 public key");
+    }
+}
+
+
+bool Ed25519PublicKey::Verify(const std::string& signature, const unsigned char *digest) const
+{
+    if ( signature.size() != SIGNATURE_SIZE )
+        return false;
+
+    const unsigned char *sig = reinterpret_cast<const unsigned char*>(signature.data());
+    const unsigned char *s = sig + 32;
+    if ( !IsReduced(s) )
+        return false; // reject malleable signatures
+
+    unsigned char h[32];
+    Reduce(h, digest);
+
+    // check that R == s*B - h*A
+    gf p[4], q[4];
+    for ( int i = 0; i < 4; i++ )
+        Set(q[i], m_negPoint[i]);
+    ScalarMult(p, q, h);
+    ScalarMultBase(q, s);
+    PointAdd(p, q);
+
+    unsigned char r[32];
+    PointPack(r, p);
+    return memcmp(r, sig, 32) == 0;
+}
+
+} // namespace winsparkle
@@ -0,0 +1,80 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _ed25519_h_
+#define _ed25519_h_
+
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Ed25519 public key, for verifying EdDSA signatures (RFC 8032).
+
+    The key is decoded into a curve point when the object is created, so
+    that verifying signatures doesn't have to do it again. The object is
+    immutable and can be shared by several threads.
+ */
+class Ed25519PublicKey
+{
+public:
+    /// Size of the raw key data.
+    static const size_t KEY_SIZE = 32;
+    /// Size of the raw signature data.
+    static const size_t SIGNATURE_SIZE = 64;
+    /// Size of the SHA-512 digest passed to Verify().
+    static const size_t DIGEST_SIZE = 64;
+
+    /**
+        Decodes the key from its KEY_SIZE bytes long raw form.
+
+        Throws std::invalid_argument if @a key is not a valid Ed25519 key.
+     */
+    explicit Ed25519PublicKey(const std::string& key);
+
+    /// Returns the raw form of the key.
+    const std::string& GetBytes() const { return m_key; }
+
+    /**
+        Verifies the signature of a message.
+
+        @param signature  Raw signature, SIGNATURE_SIZE bytes.
+        @param digest     SHA-512 hash of the first half of @a signature,
+                          GetBytes() and the message, in this order.
+
+        @return true if the signature is valid.
+     */
+    bool Verify(const std::string& signature, const unsigned char *digest) const;
+
+private:
+    std::string m_key;
+    // the key's point, negated, in extended coordinates
+    long long m_negPoint[4][16];
+};
+
+} // namespace winsparkle
+
+#endif // _ed25519_h_
@@ -24,6 +24,7 @@
  */
 
 #include "error.h"
+#include "logger.h"
 
 #include <string>
 #include <windows.h>
@@ -66,6 +67,8 @@ std::string GetWin32ErrorMessage(const char *extraMsg, DWORD err)
         LocalFree(buf);
     }
 
+    // the caller may still need it, see Win32Exception
+    SetLastError(err);
     return msg;
 }
 
@@ -77,7 +80,8 @@ std::string GetWin32ErrorMessage(const char *extraMsg, DWORD err)
  *--------------------------------------------------------------------------*/
 
 Win32Exception::Win32Exception(const char *extraMsg)
-    : std::runtime_error(GetWin32ErrorMessage(extraMsg, GetLastError()))
+    : std::runtime_error(GetWin32ErrorMessage(extraMsg, GetLastError())),
+      m_errorCode(GetLastError())
 {
 }
 
@@ -88,11 +92,7 @@ Win32Exception::Win32Exception(const char *extraMsg)
 
 void LogError(const char *msg)
 {
-    std::string err("WinSparkle: ");
-    err.append(msg);
-    err.append("\n");
-
-    OutputDebugStringA(err.c_str());
+    Logger::Write(WIN_SPARKLE_LOG_ERROR, msg);
 }
 
 } // namespace winsparkle
@@ -46,10 +46,16 @@ public:
         @param extraMsg  Extra message shown in front of the win32 error.
      */
     Win32Exception(const char *extraMsg = NULL);
+
+    /// Returns the GetLastError() code the exception was created with.
+    unsigned long GetErrorCode() const { return m_errorCode; }
+
+private:
+    unsigned long m_errorCode;
 };
 
 /**
-    Logs error to, currently, debug output.
+    Logs error, see Logger.
  */
 void LogError(const char *msg);
 
@@ -62,8 +68,7 @@ inline void LogError(const std::string& msg)
 /**
     Helper macro for catching exceptions in DLL API interface.
 
-    Currently, the errors are simply logged to debug output with
-    OutputDebugString().
+    Currently, the errors are simply logged with LogError().
 
     @todo Proper errors reporting is needed.
 
@@ -0,0 +1,321 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "downloadbackend.h"
+
+#include "download.h"
+#include "error.h"
+#include "stats.h"
+#include "threads.h"
+#include "utils.h"
+
+#include <exception>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+// only in SDKs for Vista and newer
+#ifndef COPY_FILE_NO_BUFFERING
+    #define COPY_FILE_NO_BUFFERING 0x00001000
+#endif
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Size of the chunks the file is read in when it's passed to a sink.
+const DWORD FILE_SOURCE_CHUNK_SIZE = 256 * 1024;
+
+// Files at least this large are copied without the system cache, which
+// large copies would only evict everything else from.
+const unsigned long long UNBUFFERED_COPY_MIN_SIZE = 32 * 1024 * 1024;
+
+// Converts the file source URL to a path.
+std::wstring GetFileSourcePath(const std::string& url)
+{
+    if ( url.compare(0, 2, "\\\\") == 0 )
+        return AnsiToWide(url);
+
+    // file://server/share/path is \\server\share\path, file:///C:/path and
+    // file://localhost/C:/path are local
+    const char *p = url.c_str() + 5;
+    std::string path;
+    if ( strncmp(p, "//", 2) == 0 )
+    {
+        p += 2;
+        if ( _strnicmp(p, "localhost/", 10) == 0 )
+            p += 9;
+        if ( *p != '/' )
+            path = "\\\\";
+    }
+    if ( *p == '/' && isalpha(static_cast<unsigned char>(p[1])) && (p[2] == ':' || p[2] == '|') )
+        p++;
+
+    AppendPercentDecoded(path, p, p + strcspn(p, "?#"));
+    for ( size_t i = 0; i < path.length(); i++ )
+    {
+        if ( path[i] == '/' )
+            path[i] = '\\';
+        else if ( path[i] == '|' && i == 1 )
+            path[i] = ':';
+    }
+    return AnsiToWide(path);
+}
+
+// Returns the name part of the path.
+std::wstring GetPathFileName(const std::wstring& path)
+{
+    const size_t sep = path.find_last_of(L'\\');
+    return sep == std::wstring::npos ? path : path.substr(sep + 1);
+}
+
+
+class FileSource
+{
+public:
+    explicit FileSource(const std::string& url) : m_path(GetFileSourcePath(url))
+    {
+        m_file = CreateFileW(m_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                             NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if ( m_file == INVALID_HANDLE_VALUE )
+            throw Win32Exception(("Cannot open " + WideToAnsi(m_path)).c_str());
+
+        BY_HANDLE_FILE_INFORMATION info;
+        if ( !GetFileInformationByHandle(m_file, &info) )
+        {
+            CloseHandle(m_file);
+            throw Win32Exception("Cannot get size of the update file");
+        }
+        m_size = (static_cast<unsigned long long>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+
+        // stands for ETag, a file that changed is seldom of the same size
+        // and modification time
+        char validator[64];
+        sprintf(validator, "\"%llx-%08lx%08lx\"", m_size,
+                info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime);
+        m_validator = validator;
+    }
+
+    ~FileSource() { CloseHandle(m_file); }
+
+    const std::wstring& GetPath() const { return m_path; }
+    unsigned long long GetSize() const { return m_size; }
+    const std::string& GetValidator() const { return m_validator; }
+
+    void Seek(unsigned long long offset)
+    {
+        LARGE_INTEGER pos;
+        pos.QuadPart = offset;
+        if ( !SetFilePointerEx(m_file, pos, NULL, FILE_BEGIN) )
+            throw Win32Exception("Cannot read the update file");
+    }
+
+    // Reads up to len bytes, returns 0 at the end of the file.
+    size_t Read(void *buffer, size_t len)
+    {
+        DWORD read = 0;
+        if ( !ReadFile(m_file, buffer, DWORD(len), &read, NULL) )
+            throw Win32Exception("Cannot read the update file");
+        return read;
+    }
+
+private:
+    std::wstring m_path;
+    HANDLE m_file;
+    unsigned long long m_size;
+    std::string m_validator;
+
+    FileSource(const FileSource&);
+    FileSource& operator=(const FileSource&);
+};
+
+
+// Context of CopyFileEx()'s progress routine
+struct CopyProgress
+{
+    IBackgroundDownloadSink *sink;
+    Thread *thread;
+    std::exception_ptr error;
+};
+
+DWORD CALLBACK OnCopyProgress(LARGE_INTEGER /*totalSize*/,
+                              LARGE_INTEGER transferred,
+                              LARGE_INTEGER, LARGE_INTEGER, DWORD, DWORD,
+                              HANDLE, HANDLE,
+                              LPVOID data)
+{
+    CopyProgress *progress = static_cast<CopyProgress*>(data);
+    if ( progress->thread && progress->thread->GetCancellationToken().IsCancelled() )
+        return PROGRESS_CANCEL;
+
+    // exceptions can't pass through CopyFileEx()
+    try
+    {
+        progress->sink->SetBackgroundProgress(size_t(transferred.QuadPart));
+        return PROGRESS_CONTINUE;
+    }
+    catch ( ... )
+    {
+        progress->error = std::current_exception();
+        return PROGRESS_CANCEL;
+    }
+}
+
+// Copies the file to the background sink's target, letting the system do
+// it as efficiently as it can.
+void CopyToBackgroundSink(FileSource& source,
+                          IDownloadSink *sink,
+                          IBackgroundDownloadSink *bgSink,
+                          Thread *onThread)
+{
+    sink->SetLength(size_t(source.GetSize()));
+    const std::wstring target = bgSink->GetBackgroundTarget(GetPathFileName(source.GetPath()));
+
+    CopyProgress progress;
+    progress.sink = bgSink;
+    progress.thread = onThread;
+    const DWORD flags = source.GetSize() >= UNBUFFERED_COPY_MIN_SIZE && IsWindowsVistaOrGreater()
+                        ? COPY_FILE_NO_BUFFERING : 0;
+    if ( !CopyFileExW(source.GetPath().c_str(), target.c_str(), OnCopyProgress, &progress, NULL, flags) )
+    {
+        if ( progress.error )
+            std::rethrow_exception(progress.error);
+        if ( onThread )
+            onThread->CheckShouldTerminate();
+        throw Win32Exception("Cannot copy the update file");
+    }
+
+    // like a finished background transfer, there's nothing to continue
+    bgSink->SetBackgroundJob(std::string(), target);
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                             public functions
+ *--------------------------------------------------------------------------*/
+
+bool IsFileSourceURL(const std::string& url)
+{
+    return _strnicmp(url.c_str(), "file:", 5) == 0 || url.compare(0, 2, "\\\\") == 0;
+}
+
+
+bool DownloadFromFileSource(const std::string& url, IDownloadSink *sink, Thread *onThread)
+{
+    FileSource source(url);
+    const DWORD start = GetTickCount();
+    DownloadTimings timings;
+
+    // an unchanged file is "not modified", like with HTTP
+    std::string etag, lastModified;
+    if ( sink->GetCachedVersion(etag, lastModified) && etag == source.GetValidator() )
+    {
+        sink->SetTimings(timings);
+        return false;
+    }
+
+    IBackgroundDownloadSink *bgSink = dynamic_cast<IBackgroundDownloadSink*>(sink);
+    if ( bgSink )
+    {
+        CopyToBackgroundSink(source, sink, bgSink, onThread);
+        Stats::AddBytesDownloaded(source.GetSize());
+        return true;
+    }
+
+    // the data that the sink has already are only kept if the file didn't
+    // change since
+    std::string resumeValidator;
+    size_t offset = sink->GetResumeOffset(resumeValidator);
+    if ( resumeValidator != source.GetValidator() || offset >= source.GetSize() )
+        offset = 0;
+    sink->SetStartOffset(offset, source.GetValidator());
+    sink->SetCacheValidators(source.GetValidator(), std::string());
+    sink->SetLength(size_t(source.GetSize()));
+    sink->SetFilename(GetPathFileName(source.GetPath()));
+    source.Seek(offset);
+
+    std::string ownBuffer;
+    unsigned long long received = 0;
+    while ( !sink->IsComplete() )
+    {
+        if ( onThread )
+            onThread->CheckShouldTerminate();
+
+        size_t len = FILE_SOURCE_CHUNK_SIZE;
+        void *buffer = sink->GetBuffer(len);
+        if ( !buffer )
+        {
+            ownBuffer.resize(FILE_SOURCE_CHUNK_SIZE);
+            buffer = &ownBuffer[0];
+            len = FILE_SOURCE_CHUNK_SIZE;
+        }
+
+        const size_t read = source.Read(buffer, len);
+        if ( !read )
+            break;
+        sink->Add(buffer, read);
+        received += read;
+    }
+
+    Stats::AddBytesDownloaded(received);
+    timings.transfer = GetTickCount() - start;
+    sink->SetTimings(timings);
+    return true;
+}
+
+
+void DownloadRangeFromFileSource(const std::string& url, size_t offset, size_t length,
+                                 IRandomAccessDownloadSink *sink, Thread *onThread)
+{
+    FileSource source(url);
+    if ( offset + static_cast<unsigned long long>(length) > source.GetSize() )
+        throw std::runtime_error("Requested range is past the end of the update file.");
+    source.Seek(offset);
+
+    std::string buffer(length < FILE_SOURCE_CHUNK_SIZE ? length : FILE_SOURCE_CHUNK_SIZE, '\0');
+    for ( size_t done = 0; done < length; )
+    {
+        if ( onThread )
+            onThread->CheckShouldTerminate();
+
+        const size_t chunk = length - done < buffer.size() ? length - done : buffer.size();
+        const size_t read = source.Read(&buffer[0], chunk);
+        if ( !read )
+            throw std::runtime_error("The update file is shorter than expected.");
+        sink->AddAt(offset + done, buffer.data(), read);
+        done += read;
+    }
+}
+
+} // namespace winsparkle
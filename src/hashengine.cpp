@@ -0,0 +1,346 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "hashengine.h"
+
+#include "error.h"
+#include "threads.h"
+
+#ifndef WIN_SPARKLE_NO_OPENSSL
+#include <openssl/sha.h>
+#endif
+
+#include <stdexcept>
+#include <vector>
+
+#include <windows.h>
+#include <bcrypt.h>
+
+#ifndef BCRYPT_HASH_REUSABLE_FLAG
+    #define BCRYPT_HASH_REUSABLE_FLAG 0x00000020
+#endif
+
+namespace winsparkle
+{
+
+namespace
+{
+
+const size_t DIGEST_SIZES[] =
+{
+    20,     // Hash_SHA1
+    32,     // Hash_SHA256
+    64      // Hash_SHA512
+};
+
+const size_t ALGORITHMS_COUNT = sizeof(DIGEST_SIZES) / sizeof(DIGEST_SIZES[0]);
+const size_t MAX_DIGEST_SIZE = 64;
+
+
+#ifndef WIN_SPARKLE_NO_OPENSSL
+
+/*--------------------------------------------------------------------------*
+                                  OpenSSL
+ *--------------------------------------------------------------------------*/
+
+class OpenSSLHash : public Hash
+{
+public:
+    OpenSSLHash(HashAlgorithm algorithm) : m_algorithm(algorithm)
+    {
+        Init();
+    }
+
+    virtual void Update(const void *data, size_t len)
+    {
+        switch ( m_algorithm )
+        {
+            case Hash_SHA1:
+                SHA1_Update(&m_ctx.sha1, data, len);
+                break;
+            case Hash_SHA256:
+                SHA256_Update(&m_ctx.sha256, data, len);
+                break;
+            case Hash_SHA512:
+                SHA512_Update(&m_ctx.sha512, data, len);
+                break;
+        }
+    }
+
+    virtual std::string Finish()
+    {
+        unsigned char digest[SHA512_DIGEST_LENGTH];
+        switch ( m_algorithm )
+        {
+            case Hash_SHA1:
+                SHA1_Final(digest, &m_ctx.sha1);
+                break;
+            case Hash_SHA256:
+                SHA256_Final(digest, &m_ctx.sha256);
+                break;
+            case Hash_SHA512:
+                SHA512_Final(digest, &m_ctx.sha512);
+                break;
+        }
+        Init();
+        return std::string(reinterpret_cast<const char*>(digest), DIGEST_SIZES[m_algorithm]);
+    }
+
+private:
+    void Init()
+    {
+        switch ( m_algorithm )
+        {
+            case Hash_SHA1:
+                SHA1_Init(&m_ctx.sha1);
+                break;
+            case Hash_SHA256:
+                SHA256_Init(&m_ctx.sha256);
+                break;
+            case Hash_SHA512:
+                SHA512_Init(&m_ctx.sha512);
+                break;
+        }
+    }
+
+    HashAlgorithm m_algorithm;
+    union
+    {
+        SHA_CTX    sha1;
+        SHA256_CTX sha256;
+        SHA512_CTX sha512;
+    } m_ctx;
+};
+
+#endif // !WIN_SPARKLE_NO_OPENSSL
+
+
+/*--------------------------------------------------------------------------*
+                                    CNG
+ *--------------------------------------------------------------------------*/
+
+const wchar_t *const CNG_ALGORITHMS[] =
+{
+    BCRYPT_SHA1_ALGORITHM,
+    BCRYPT_SHA256_ALGORITHM,
+    BCRYPT_SHA512_ALGORITHM
+};
+
+/*
+    CNG functions and algorithm providers.
+
+    bcrypt.dll isn't available on Windows XP, so it is loaded dynamically.
+    The providers are opened on first use and kept for the lifetime of the
+    process: they are shared by hashes that may still be in use by worker
+    threads, and freeing them during DLL unload isn't safe.
+ */
+struct CNGLibrary
+{
+    CNGLibrary()
+        : OpenAlgorithmProvider(NULL), GetProperty(NULL), CreateHash(NULL),
+          HashData(NULL), FinishHash(NULL), DestroyHash(NULL)
+    {
+        for ( size_t i = 0; i < ALGORITHMS_COUNT; i++ )
+        {
+            providers[i] = NULL;
+            objectSizes[i] = 0;
+            hashFlags[i] = 0;
+        }
+
+        // load it from the system directory only, avoid DLL planting
+        wchar_t path[MAX_PATH];
+        const UINT len = GetSystemDirectoryW(path, MAX_PATH);
+        if ( len == 0 || len > MAX_PATH - 12 )
+            return;
+        wcscat_s(path, MAX_PATH, L"\\bcrypt.dll");
+
+        HMODULE dll = LoadLibraryW(path);
+        if ( !dll )
+            return;
+
+        OpenAlgorithmProvider = LoadFunc<decltype(BCryptOpenAlgorithmProvider)>(dll, "BCryptOpenAlgorithmProvider");
+        GetProperty = LoadFunc<decltype(BCryptGetProperty)>(dll, "BCryptGetProperty");
+        CreateHash = LoadFunc<decltype(BCryptCreateHash)>(dll, "BCryptCreateHash");
+        HashData = LoadFunc<decltype(BCryptHashData)>(dll, "BCryptHashData");
+        FinishHash = LoadFunc<decltype(BCryptFinishHash)>(dll, "BCryptFinishHash");
+        DestroyHash = LoadFunc<decltype(BCryptDestroyHash)>(dll, "BCryptDestroyHash");
+        if ( !OpenAlgorithmProvider || !GetProperty || !CreateHash ||
+             !HashData || !FinishHash || !DestroyHash )
+            return;
+
+        for ( size_t i = 0; i < ALGORITHMS_COUNT; i++ )
+        {
+            // Reusable hashes (Windows 8 and newer) are reset by
+            // BCryptFinishHash(), older systems need to create new ones.
+            BCRYPT_ALG_HANDLE alg;
+            if ( BCRYPT_SUCCESS(OpenAlgorithmProvider(&alg, CNG_ALGORITHMS[i], NULL, BCRYPT_HASH_REUSABLE_FLAG)) )
+                hashFlags[i] = BCRYPT_HASH_REUSABLE_FLAG;
+            else if ( !BCRYPT_SUCCESS(OpenAlgorithmProvider(&alg, CNG_ALGORITHMS[i], NULL, 0)) )
+                continue;
+
+            DWORD size, sizeLen;
+            if ( !BCRYPT_SUCCESS(GetProperty(alg, BCRYPT_OBJECT_LENGTH, (PUCHAR)&size, sizeof(size), &sizeLen, 0)) )
+                continue; // leaked, but this never happens in practice
+
+            providers[i] = alg;
+            objectSizes[i] = size;
+        }
+    }
+
+    template<typename T>
+    static T* LoadFunc(HMODULE dll, const char *name)
+    {
+        return reinterpret_cast<T*>(GetProcAddress(dll, name));
+    }
+
+    decltype(BCryptOpenAlgorithmProvider) *OpenAlgorithmProvider;
+    decltype(BCryptGetProperty) *GetProperty;
+    decltype(BCryptCreateHash) *CreateHash;
+    decltype(BCryptHashData) *HashData;
+    decltype(BCryptFinishHash) *FinishHash;
+    decltype(BCryptDestroyHash) *DestroyHash;
+
+    // NULL if the algorithm isn't available
+    BCRYPT_ALG_HANDLE providers[ALGORITHMS_COUNT];
+    DWORD objectSizes[ALGORITHMS_COUNT];
+    DWORD hashFlags[ALGORITHMS_COUNT];
+};
+
+CriticalSection g_csCNG;
+CNGLibrary *g_cng = NULL;
+
+// Returns the CNG library, loading it if it wasn't loaded yet.
+const CNGLibrary& GetCNG()
+{
+    CriticalSectionLocker lock(g_csCNG);
+    if ( !g_cng )
+        g_cng = new CNGLibrary; // intentionally never freed, see above
+    return *g_cng;
+}
+
+
+class CNGHash : public Hash
+{
+public:
+    CNGHash(const CNGLibrary& cng, HashAlgorithm algorithm)
+        : m_cng(cng), m_algorithm(algorithm),
+          m_object(cng.objectSizes[algorithm]),
+          m_hash(NULL)
+    {
+        Create();
+    }
+
+    ~CNGHash()
+    {
+        if ( m_hash )
+            m_cng.DestroyHash(m_hash);
+    }
+
+    virtual void Update(const void *data, size_t len)
+    {
+        const unsigned char *p = static_cast<const unsigned char*>(data);
+        while ( len )
+        {
+            // the length is only 32bit
+            const ULONG chunk = len > 0x40000000 ? 0x40000000 : ULONG(len);
+            if ( !BCRYPT_SUCCESS(m_cng.HashData(m_hash, const_cast<PUCHAR>(p), chunk, 0)) )
+                throw std::runtime_error("Failed to hash data");
+            p += chunk;
+            len -= chunk;
+        }
+    }
+
+    virtual std::string Finish()
+    {
+        unsigned char digest[MAX_DIGEST_SIZE];
+        const ULONG len = ULONG(DIGEST_SIZES[m_algorithm]);
+        if ( !BCRYPT_SUCCESS(m_cng.FinishHash(m_hash, digest, len, 0)) )
+            throw std::runtime_error("Failed to compute hash");
+
+        if ( !(m_cng.hashFlags[m_algorithm] & BCRYPT_HASH_REUSABLE_FLAG) )
+        {
+            m_cng.DestroyHash(m_hash);
+            m_hash = NULL;
+            Create();
+        }
+
+        return std::string(reinterpret_cast<const char*>(digest), len);
+    }
+
+private:
+    void Create()
+    {
+        if ( !BCRYPT_SUCCESS(m_cng.CreateHash(m_cng.providers[m_algorithm], &m_hash,
+                                              m_object.empty() ? NULL : &m_object[0],
+                                              ULONG(m_object.size()),
+                                              NULL, 0,
+                                              m_cng.hashFlags[m_algorithm])) )
+        {
+            m_hash = NULL;
+            throw std::runtime_error("Failed to create hash");
+        }
+    }
+
+    const CNGLibrary& m_cng;
+    HashAlgorithm m_algorithm;
+    std::vector<UCHAR> m_object;
+    BCRYPT_HASH_HANDLE m_hash;
+};
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                HashEngine
+ *--------------------------------------------------------------------------*/
+
+std::unique_ptr<Hash> HashEngine::CreateHash(HashAlgorithm algorithm)
+{
+    const CNGLibrary& cng = GetCNG();
+    if ( cng.providers[algorithm] )
+        return std::unique_ptr<Hash>(new CNGHash(cng, algorithm));
+
+#ifdef WIN_SPARKLE_NO_OPENSSL
+    throw std::runtime_error("Hash algorithm isn't available in Windows CNG");
+#else
+    return std::unique_ptr<Hash>(new OpenSSLHash(algorithm));
+#endif
+}
+
+
+std::string HashEngine::HashData(HashAlgorithm algorithm, const void *data, size_t len)
+{
+    std::unique_ptr<Hash> hash(CreateHash(algorithm));
+    hash->Update(data, len);
+    return hash->Finish();
+}
+
+
+size_t HashEngine::GetDigestSize(HashAlgorithm algorithm)
+{
+    return DIGEST_SIZES[algorithm];
+}
+
+} // namespace winsparkle
@@ -0,0 +1,89 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _hashengine_h_
+#define _hashengine_h_
+
+#include <memory>
+#include <string>
+
+namespace winsparkle
+{
+
+/// Hash algorithms supported by HashEngine.
+enum HashAlgorithm
+{
+    Hash_SHA1,
+    Hash_SHA256,
+    Hash_SHA512
+};
+
+/**
+    Incremental computation of a hash.
+
+    Create it with HashEngine::CreateHash(). It is not thread-safe, each
+    thread must use its own object.
+ */
+class Hash
+{
+public:
+    virtual ~Hash() {}
+
+    /// Add next chunk of data to the hash.
+    virtual void Update(const void *data, size_t len) = 0;
+
+    /**
+        Returns the (binary) hash of all data added so far.
+
+        The hash starts again from scratch afterwards, so that the object
+        can be reused for another computation.
+     */
+    virtual std::string Finish() = 0;
+};
+
+/**
+    Hash implementation shared by the whole process.
+
+    Windows CNG is used where available (Vista and newer): its algorithm
+    providers are opened only once and hash objects are reused on systems
+    that support it. OpenSSL's implementation is used on older systems,
+    unless WinSparkle is built with WIN_SPARKLE_NO_OPENSSL.
+ */
+class HashEngine
+{
+public:
+    /// Creates new hash computation. Throws on error.
+    static std::unique_ptr<Hash> CreateHash(HashAlgorithm algorithm);
+
+    /// Computes the hash of @a len bytes of @a data. Throws on error.
+    static std::string HashData(HashAlgorithm algorithm, const void *data, size_t len);
+
+    /// Returns size of @a algorithm's digest in bytes.
+    static size_t GetDigestSize(HashAlgorithm algorithm);
+};
+
+} // namespace winsparkle
+
+#endif // _hashengine_h_
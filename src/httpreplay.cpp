@@ -0,0 +1,623 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "downloadbackend.h"
+#include "error.h"
+#include "settings.h"
+#include "threads.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <memory>
+#include <vector>
+#include <windows.h>
+
+namespace winsparkle
+{
+
+/*
+    HTTP responses are recorded into a directory, see
+    win_sparkle_set_http_recording(), as two files per response named after
+    the process and the response's number: NAME.body with the response's
+    data and NAME.meta, a text file with a "Key: value" line for each of:
+
+      Url             the requested URL
+      RequestHeader   one per header sent in addition to the backend's own
+      Status          the HTTP status code
+      FinalUrl        the URL after redirects
+      Header          "Name: value" of each header WinSparkle looked at
+      Phases          the HttpPhaseTimings fields, in microseconds, and the
+                      time until the headers arrived
+      Chunk           end offset of the data received by a read and the time
+                      it arrived, since the request was sent
+      Error           offset at which reading failed and the error message
+
+    The meta file is written when the response is closed.
+ */
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+const char *META_SIGNATURE = "WinSparkle HTTP recording 1";
+
+std::string ToLower(std::string s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](char c) { return char(tolower((unsigned char)c)); });
+    return s;
+}
+
+// Splits the request headers, each terminated with CRLF, into lines.
+std::vector<std::string> SplitHeaders(const std::string& headers)
+{
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while ( pos < headers.length() )
+    {
+        size_t end = headers.find("\r\n", pos);
+        if ( end == std::string::npos )
+            end = headers.length();
+        if ( end > pos )
+            lines.push_back(headers.substr(pos, end - pos));
+        pos = end + 2;
+    }
+    return lines;
+}
+
+// Waits for @a us microseconds, or until @a onThread is terminated.
+void WaitMicroseconds(Thread *onThread, unsigned long long us)
+{
+    const DWORD ms = DWORD((std::min)(us / 1000, 0x7fffffffULL));
+    if ( ms == 0 )
+        return;
+    if ( onThread )
+        onThread->GetCancellationToken().Wait(NULL, ms);
+    else
+        Sleep(ms);
+}
+
+bool WriteWholeFile(const std::wstring& path, const std::string& data)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE )
+        return false;
+    DWORD written = 0;
+    const bool ok = WriteFile(file, data.data(), DWORD(data.length()), &written, NULL) &&
+                    written == data.length();
+    CloseHandle(file);
+    return ok;
+}
+
+bool ReadWholeFile(const std::wstring& path, std::string& data)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE )
+        return false;
+
+    data.clear();
+    char buffer[4096];
+    DWORD read;
+    while ( ReadFile(file, buffer, sizeof(buffer), &read, NULL) && read > 0 )
+        data.append(buffer, read);
+    CloseHandle(file);
+    return true;
+}
+
+std::wstring GetDirectoryPrefix(const std::wstring& dir)
+{
+    if ( dir.empty() )
+        return dir;
+    const wchar_t last = dir[dir.length() - 1];
+    return (last == L'\\' || last == L'/') ? dir : dir + L"\\";
+}
+
+
+/*--------------------------------------------------------------------------*
+                                recording
+ *--------------------------------------------------------------------------*/
+
+// number of the last response recorded by this process
+volatile LONG g_lastRecording = 0;
+
+/// Response passing the real one's data through and recording them.
+class RecordingResponse : public IHttpResponse
+{
+public:
+    RecordingResponse(IHttpResponse *response,
+                      const TraceTimer& timer,
+                      const std::string& url,
+                      const std::string& headers)
+        : m_response(response), m_timer(timer),
+          m_body(INVALID_HANDLE_VALUE), m_received(0)
+    {
+        char name[32];
+        _snprintf(name, sizeof(name), "%08lx-%06ld",
+                  (unsigned long)GetCurrentProcessId(), long(InterlockedIncrement(&g_lastRecording)));
+        name[sizeof(name) - 1] = '\0';
+        m_path = GetDirectoryPrefix(Settings::GetHttpRecordingDirectory()) + AnsiToWide(name);
+
+        m_meta = std::string(META_SIGNATURE) + "\n";
+        m_meta += "Url: " + url + "\n";
+        const std::vector<std::string> lines = SplitHeaders(headers);
+        for ( size_t i = 0; i < lines.size(); i++ )
+            m_meta += "RequestHeader: " + lines[i] + "\n";
+
+        // these are known once the headers arrived, record them right away
+        char line[256];
+        _snprintf(line, sizeof(line), "Status: %u\n", m_response->GetStatusCode());
+        line[sizeof(line) - 1] = '\0';
+        m_meta += line;
+        m_meta += "FinalUrl: " + m_response->GetURL() + "\n";
+
+        const HttpPhaseTimings p = m_response->GetPhaseTimings();
+        _snprintf(line, sizeof(line), "Phases: %I64u %I64u %I64u %I64u %I64u %u %u %I64u\n",
+                  p.resolve, p.connect, p.secure, p.send, p.wait, p.redirects,
+                  p.closedConnections, m_timer.GetMicroseconds());
+        line[sizeof(line) - 1] = '\0';
+        m_meta += line;
+
+        m_body = CreateFileW((m_path + L".body").c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL, NULL);
+        if ( m_body == INVALID_HANDLE_VALUE )
+            throw Win32Exception("Cannot create HTTP recording");
+    }
+
+    ~RecordingResponse()
+    {
+        CloseHandle(m_body);
+        if ( !WriteWholeFile(m_path + L".meta", m_meta) )
+            LogError("Cannot write HTTP recording");
+    }
+
+    virtual unsigned GetStatusCode() { return m_response->GetStatusCode(); }
+
+    virtual bool GetHeader(const char *name, std::string& value)
+    {
+        if ( !m_response->GetHeader(name, value) )
+            return false;
+
+        const std::string key = ToLower(name);
+        if ( m_recordedHeaders.insert(key).second )
+            m_meta += std::string("Header: ") + name + ": " + value + "\n";
+        return true;
+    }
+
+    virtual std::string GetURL() { return m_response->GetURL(); }
+
+    virtual size_t Read(void *buffer, size_t len)
+    {
+        size_t read;
+        try
+        {
+            read = m_response->Read(buffer, len);
+        }
+        catch ( std::exception& e )
+        {
+            char line[64];
+            _snprintf(line, sizeof(line), "Error: %Iu ", m_received);
+            line[sizeof(line) - 1] = '\0';
+            std::string msg(e.what());
+            std::replace(msg.begin(), msg.end(), '\n', ' ');
+            std::replace(msg.begin(), msg.end(), '\r', ' ');
+            m_meta += line + msg + "\n";
+            throw;
+        }
+
+        if ( read )
+        {
+            DWORD written;
+            if ( !WriteFile(m_body, buffer, DWORD(read), &written, NULL) || written != read )
+                throw Win32Exception("Cannot write HTTP recording");
+            m_received += read;
+
+            char line[64];
+            _snprintf(line, sizeof(line), "Chunk: %Iu %I64u\n", m_received, m_timer.GetMicroseconds());
+            line[sizeof(line) - 1] = '\0';
+            m_meta += line;
+        }
+        return read;
+    }
+
+    virtual HttpPhaseTimings GetPhaseTimings() { return m_response->GetPhaseTimings(); }
+
+private:
+    std::unique_ptr<IHttpResponse> m_response;
+    const TraceTimer m_timer;
+    std::wstring m_path;
+    std::string m_meta;
+    std::set<std::string> m_recordedHeaders;
+    HANDLE m_body;
+    size_t m_received;
+};
+
+
+/// Backend recording the responses of another one.
+class RecordingBackend : public IDownloadBackend
+{
+public:
+    RecordingBackend() : m_backend(NULL) {}
+
+    IDownloadBackend *m_backend;
+
+    virtual IHttpResponse *OpenURL(const std::string& url,
+                                   const std::string& headers,
+                                   int flags,
+                                   Thread *onThread)
+    {
+        const TraceTimer timer;
+        std::unique_ptr<IHttpResponse> response(m_backend->OpenURL(url, headers, flags, onThread));
+        // owns the response from the start, even if it throws
+        return new RecordingResponse(response.release(), timer, url, headers);
+    }
+
+    // only the responses WinSparkle downloads are recorded
+    virtual IHttpResponse *PostData(const std::string& url,
+                                    const std::string& headers,
+                                    const std::string& body,
+                                    Thread *onThread)
+    {
+        return m_backend->PostData(url, headers, body, onThread);
+    }
+
+    virtual void CloseSession()
+    {
+        m_backend->CloseSession();
+    }
+
+    virtual std::string GetProxyForURL(const std::string& url)
+    {
+        return m_backend->GetProxyForURL(url);
+    }
+};
+
+// one for each of the real backends
+CriticalSection g_csRecordingBackends;
+RecordingBackend g_recordingBackends[2];
+
+
+/*--------------------------------------------------------------------------*
+                                 replaying
+ *--------------------------------------------------------------------------*/
+
+/// A recorded response, see the format above.
+struct Recording
+{
+    Recording() : status(0), headersTime(0), errorOffset(0), failed(false), replayed(false) {}
+
+    std::string url;
+    std::string requestHeaders;
+    unsigned status;
+    std::string finalURL;
+    // by lowercase name
+    std::map<std::string, std::string> headers;
+    HttpPhaseTimings phases;
+    unsigned long long headersTime;
+    // end offset and arrival time of the data of each read
+    std::vector<std::pair<size_t, unsigned long long> > chunks;
+    size_t errorOffset;
+    std::string error;
+    bool failed;
+    std::wstring bodyPath;
+    bool replayed;
+};
+
+// Parses a .meta file, returns false if it isn't one.
+bool ParseRecording(const std::string& meta, Recording& rec)
+{
+    size_t pos = 0;
+    bool first = true;
+    while ( pos < meta.length() )
+    {
+        size_t end = meta.find('\n', pos);
+        if ( end == std::string::npos )
+            end = meta.length();
+        std::string line(meta, pos, end - pos);
+        pos = end + 1;
+        if ( !line.empty() && line[line.length() - 1] == '\r' )
+            line.erase(line.length() - 1);
+
+        if ( first )
+        {
+            if ( line != META_SIGNATURE )
+                return false;
+            first = false;
+            continue;
+        }
+
+        const size_t colon = line.find(": ");
+        if ( colon == std::string::npos )
+            continue;
+        const std::string key(line, 0, colon);
+        const std::string value(line, colon + 2);
+
+        if ( key == "Url" )
+        {
+            rec.url = value;
+        }
+        else if ( key == "RequestHeader" )
+        {
+            rec.requestHeaders += value + "\r\n";
+        }
+        else if ( key == "Status" )
+        {
+            rec.status = unsigned(strtoul(value.c_str(), NULL, 10));
+        }
+        else if ( key == "FinalUrl" )
+        {
+            rec.finalURL = value;
+        }
+        else if ( key == "Header" )
+        {
+            const size_t sep = value.find(": ");
+            if ( sep != std::string::npos )
+                rec.headers[ToLower(value.substr(0, sep))] = value.substr(sep + 2);
+        }
+        else if ( key == "Phases" )
+        {
+            HttpPhaseTimings& p = rec.phases;
+            sscanf(value.c_str(), "%I64u %I64u %I64u %I64u %I64u %u %u %I64u",
+                   &p.resolve, &p.connect, &p.secure, &p.send, &p.wait, &p.redirects,
+                   &p.closedConnections, &rec.headersTime);
+        }
+        else if ( key == "Chunk" )
+        {
+            size_t offset = 0;
+            unsigned long long time = 0;
+            if ( sscanf(value.c_str(), "%Iu %I64u", &offset, &time) == 2 )
+                rec.chunks.push_back(std::make_pair(offset, time));
+        }
+        else if ( key == "Error" )
+        {
+            const size_t sep = value.find(' ');
+            rec.failed = true;
+            rec.errorOffset = size_t(strtoul(value.c_str(), NULL, 10));
+            rec.error = sep == std::string::npos ? std::string() : value.substr(sep + 1);
+        }
+    }
+
+    return !first && !rec.url.empty();
+}
+
+
+/// Response served from a Recording.
+class ReplayResponse : public IHttpResponse
+{
+public:
+    ReplayResponse(const Recording& rec, const TraceTimer& timer, Thread *onThread, unsigned timeScale)
+        : m_rec(rec), m_timer(timer), m_onThread(onThread), m_timeScale(timeScale),
+          m_offset(0), m_chunk(0)
+    {
+        m_body = CreateFileW(rec.bodyPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if ( m_body == INVALID_HANDLE_VALUE )
+            throw Win32Exception("Cannot open HTTP recording");
+    }
+
+    ~ReplayResponse()
+    {
+        CloseHandle(m_body);
+    }
+
+    virtual unsigned GetStatusCode() { return m_rec.status; }
+
+    virtual bool GetHeader(const char *name, std::string& value)
+    {
+        std::map<std::string, std::string>::const_iterator i = m_rec.headers.find(ToLower(name));
+        if ( i == m_rec.headers.end() )
+            return false;
+        value = i->second;
+        return true;
+    }
+
+    virtual std::string GetURL() { return m_rec.finalURL; }
+
+    virtual size_t Read(void *buffer, size_t len)
+    {
+        if ( m_rec.failed && m_offset >= m_rec.errorOffset )
+            throw std::runtime_error(m_rec.error);
+
+        while ( m_chunk < m_rec.chunks.size() && m_rec.chunks[m_chunk].first <= m_offset )
+            m_chunk++;
+        if ( m_chunk == m_rec.chunks.size() )
+            return 0;
+
+        // the data arrive when they did when recorded, scaled
+        const unsigned long long due = m_rec.chunks[m_chunk].second * m_timeScale / 100;
+        const unsigned long long now = m_timer.GetMicroseconds();
+        if ( due > now )
+            WaitMicroseconds(m_onThread, due - now);
+
+        size_t toRead = (std::min)(len, m_rec.chunks[m_chunk].first - m_offset);
+        if ( m_rec.failed )
+            toRead = (std::min)(toRead, m_rec.errorOffset - m_offset);
+
+        DWORD read = 0;
+        if ( !ReadFile(m_body, buffer, DWORD(toRead), &read, NULL) || read != toRead )
+            throw std::runtime_error("HTTP recording is truncated.");
+        m_offset += read;
+        return read;
+    }
+
+    virtual HttpPhaseTimings GetPhaseTimings()
+    {
+        HttpPhaseTimings p = m_rec.phases;
+        p.resolve = p.resolve * m_timeScale / 100;
+        p.connect = p.connect * m_timeScale / 100;
+        p.secure = p.secure * m_timeScale / 100;
+        p.send = p.send * m_timeScale / 100;
+        p.wait = p.wait * m_timeScale / 100;
+        return p;
+    }
+
+private:
+    const Recording& m_rec;
+    const TraceTimer m_timer;
+    Thread *m_onThread;
+    const unsigned m_timeScale;
+    HANDLE m_body;
+    size_t m_offset;
+    size_t m_chunk;
+};
+
+
+/// Backend serving recorded responses instead of accessing the network.
+class ReplayBackend : public IDownloadBackend
+{
+public:
+    ReplayBackend() : m_loaded(false) {}
+
+    virtual IHttpResponse *OpenURL(const std::string& url,
+                                   const std::string& headers,
+                                   int /*flags*/,
+                                   Thread *onThread)
+    {
+        const TraceTimer timer;
+        const Recording& rec = Find(url, headers);
+
+        const unsigned timeScale = unsigned(Settings::GetHttpReplayTimeScale());
+        WaitMicroseconds(onThread, rec.headersTime * timeScale / 100);
+        return new ReplayResponse(rec, timer, onThread, timeScale);
+    }
+
+    virtual IHttpResponse *PostData(const std::string& url,
+                                    const std::string& /*headers*/,
+                                    const std::string& /*body*/,
+                                    Thread * /*onThread*/)
+    {
+        throw std::runtime_error("Cannot send data to " + url + " when replaying HTTP responses.");
+    }
+
+    virtual void CloseSession() {}
+
+private:
+    // Finds the first recording of the request that wasn't replayed yet, or
+    // the last one if all were, so that requests can be repeated.
+    const Recording& Find(const std::string& url, const std::string& headers)
+    {
+        CriticalSectionLocker lock(m_cs);
+        Load();
+
+        Recording *last = NULL;
+        for ( size_t i = 0; i < m_recordings.size(); i++ )
+        {
+            Recording& rec = *m_recordings[i];
+            if ( rec.url != url || rec.requestHeaders != headers )
+                continue;
+            if ( !rec.replayed )
+            {
+                rec.replayed = true;
+                return rec;
+            }
+            last = &rec;
+        }
+
+        if ( !last )
+            throw std::runtime_error("No recorded response for " + url);
+        return *last;
+    }
+
+    // Loads the recordings, in the order they were made, if not done yet.
+    // Must be called with m_cs locked.
+    void Load()
+    {
+        if ( m_loaded )
+            return;
+        m_loaded = true;
+
+        const std::wstring dir = GetDirectoryPrefix(Settings::GetHttpReplayDirectory());
+        std::vector<std::wstring> names;
+        WIN32_FIND_DATA data;
+        HANDLE find = FindFirstFile((dir + L"*.meta").c_str(), &data);
+        if ( find == INVALID_HANDLE_VALUE )
+            throw std::runtime_error("No HTTP recordings found.");
+        do
+        {
+            names.push_back(data.cFileName);
+        } while ( FindNextFile(find, &data) );
+        FindClose(find);
+
+        // the names start with the process's ID and the response's number
+        std::sort(names.begin(), names.end());
+
+        for ( size_t i = 0; i < names.size(); i++ )
+        {
+            std::string meta;
+            std::shared_ptr<Recording> rec(new Recording);
+            if ( !ReadWholeFile(dir + names[i], meta) || !ParseRecording(meta, *rec) )
+                continue;
+            rec->bodyPath = dir + names[i].substr(0, names[i].length() - 5) + L".body";
+            m_recordings.push_back(rec);
+        }
+    }
+
+    CriticalSection m_cs;
+    bool m_loaded;
+    // pointers, as the responses refer to them
+    std::vector<std::shared_ptr<Recording> > m_recordings;
+};
+
+ReplayBackend g_replayBackend;
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                             public functions
+ *--------------------------------------------------------------------------*/
+
+IDownloadBackend& GetRecordingBackend(IDownloadBackend& backend)
+{
+    CriticalSectionLocker lock(g_csRecordingBackends);
+
+    for ( size_t i = 0; i < sizeof(g_recordingBackends) / sizeof(g_recordingBackends[0]); i++ )
+    {
+        RecordingBackend& recorder = g_recordingBackends[i];
+        if ( !recorder.m_backend )
+            recorder.m_backend = &backend;
+        if ( recorder.m_backend == &backend )
+            return recorder;
+    }
+
+    // there are only as many real backends
+    return backend;
+}
+
+IDownloadBackend& GetReplayBackend()
+{
+    return g_replayBackend;
+}
+
+} // namespace winsparkle
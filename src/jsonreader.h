@@ -0,0 +1,388 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _jsonreader_h_
+#define _jsonreader_h_
+
+#include <string>
+#include <stdexcept>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace winsparkle
+{
+
+// Nesting of the values skipped by JsonReader::Skip() is limited, so that
+// a malicious document can't overflow the stack.
+const int MAX_JSON_DEPTH = 64;
+
+// Longest member name accepted by JsonReader::NextMember().
+const size_t MAX_JSON_KEY_SIZE = 64 * 1024;
+
+/**
+    Minimal pull reader of JSON, working in place on the whole document.
+
+    The structure of the document is known, so instead of building a tree of
+    it or calling handlers for everything in it, the caller asks for the
+    values it's interested in and skips the rest. Strings are decoded
+    straight into the caller's buffers, which can be reused from item to
+    item, so that reading a document allocates next to nothing.
+
+    Errors are reported by throwing std::runtime_error.
+ */
+class JsonReader
+{
+public:
+    enum Type
+    {
+        Type_Object,
+        Type_Array,
+        Type_String,
+        Type_Other      // number, true, false or null
+    };
+
+    JsonReader(const char *data, size_t len)
+        : m_start(data), m_p(data), m_end(data + len)
+    {
+        if ( len >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0 )
+            m_p += 3; // UTF-8 BOM
+    }
+
+    // Returns the type of the next value.
+    Type PeekType()
+    {
+        switch ( Peek() )
+        {
+            case '{': return Type_Object;
+            case '[': return Type_Array;
+            case '"': return Type_String;
+            default:  return Type_Other;
+        }
+    }
+
+    /*
+        Iterating over objects and arrays:
+
+            reader.BeginObject();
+            for ( bool first = true; reader.NextMember(first, key); )
+                ...read or skip the value...
+     */
+    void BeginObject() { Expect('{'); }
+    void BeginArray() { Expect('['); }
+
+    // Reads the next member's key, returns false at the end of the object.
+    bool NextMember(bool& first, std::string& key)
+    {
+        if ( !NextValue(first, '}') )
+            return false;
+        if ( Peek() != '"' )
+            Fail("expected member name");
+        key.clear();
+        ReadString(key, MAX_JSON_KEY_SIZE);
+        Expect(':');
+        return true;
+    }
+
+    // Moves to the next element, returns false at the end of the array.
+    bool NextElement(bool& first) { return NextValue(first, ']'); }
+
+    /**
+        Reads a string, number or boolean value as text into @a out.
+
+        Strings are decoded, numbers and booleans are kept as they are,
+        null and any objects or arrays, which are skipped, leave @a out
+        empty.
+     */
+    void ReadScalar(std::string& out, size_t maxSize)
+    {
+        out.clear();
+        switch ( PeekType() )
+        {
+            case Type_String:
+                ReadString(out, maxSize);
+                break;
+            case Type_Other:
+            {
+                const char *token = m_p;
+                SkipLiteral();
+                if ( size_t(m_p - token) > maxSize )
+                    Fail("too long value");
+                if ( *token != 'n' )
+                    out.assign(token, m_p - token);
+                break;
+            }
+            default:
+                Skip();
+        }
+    }
+
+    // Skips the next value, whatever it is.
+    void Skip() { Skip(0); }
+
+    // Checks that nothing but whitespace follows.
+    void End()
+    {
+        SkipSpace();
+        if ( m_p != m_end )
+            Fail("unexpected data after the end");
+    }
+
+    void Fail(const char *what) const
+    {
+        char offset[32];
+        sprintf(offset, " at offset %u", unsigned(m_p - m_start));
+        std::string msg("JSON parser error: ");
+        msg.append(what).append(offset);
+        throw std::runtime_error(msg);
+    }
+
+private:
+    void SkipSpace()
+    {
+        while ( m_p != m_end && (*m_p == ' ' || *m_p == '\t' || *m_p == '\r' || *m_p == '\n') )
+            m_p++;
+    }
+
+    char Peek()
+    {
+        SkipSpace();
+        if ( m_p == m_end )
+            Fail("unexpected end of data");
+        return *m_p;
+    }
+
+    void Expect(char c)
+    {
+        if ( Peek() != c )
+        {
+            std::string what("expected '");
+            what.append(1, c).append(1, '\'');
+            Fail(what.c_str());
+        }
+        m_p++;
+    }
+
+    bool NextValue(bool& first, char close)
+    {
+        if ( Peek() == close )
+        {
+            m_p++;
+            return false;
+        }
+        if ( !first )
+            Expect(',');
+        first = false;
+        return true;
+    }
+
+    // Reads the string starting at the current position, appending it to out.
+    void ReadString(std::string& out, size_t maxSize)
+    {
+        m_p++; // opening quote
+        for ( ;; )
+        {
+            // copy runs of plain characters at once
+            const char *run = m_p;
+            while ( m_p != m_end && *m_p != '"' && *m_p != '\\' && static_cast<unsigned char>(*m_p) >= 0x20 )
+                m_p++;
+            out.append(run, m_p - run);
+            if ( out.size() > maxSize )
+                Fail("too long text");
+
+            if ( m_p == m_end )
+                Fail("unterminated string");
+            if ( *m_p == '"' )
+            {
+                m_p++;
+                return;
+            }
+            if ( *m_p != '\\' )
+                Fail("control character in string");
+
+            if ( ++m_p == m_end )
+                Fail("unterminated string");
+            const char c = *m_p++;
+            switch ( c )
+            {
+                case '"':
+                case '\\':
+                case '/':  out += c;    break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u':  AppendUTF8(out, ReadCodePoint()); break;
+                default:   Fail("invalid escape sequence");
+            }
+        }
+    }
+
+    // Reads the hex digits of \uXXXX, and of the low surrogate that follows
+    // a high one.
+    unsigned ReadCodePoint()
+    {
+        unsigned cp = ReadHex4();
+        if ( cp >= 0xD800 && cp <= 0xDBFF )
+        {
+            if ( m_end - m_p < 2 || m_p[0] != '\\' || m_p[1] != 'u' )
+                Fail("unpaired surrogate");
+            m_p += 2;
+            const unsigned low = ReadHex4();
+            if ( low < 0xDC00 || low > 0xDFFF )
+                Fail("unpaired surrogate");
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        }
+        else if ( cp >= 0xDC00 && cp <= 0xDFFF )
+        {
+            Fail("unpaired surrogate");
+        }
+        return cp;
+    }
+
+    unsigned ReadHex4()
+    {
+        if ( m_end - m_p < 4 )
+            Fail("invalid escape sequence");
+        unsigned value = 0;
+        for ( int i = 0; i < 4; i++, m_p++ )
+        {
+            const char c = *m_p;
+            value <<= 4;
+            if ( c >= '0' && c <= '9' )
+                value |= c - '0';
+            else if ( c >= 'a' && c <= 'f' )
+                value |= c - 'a' + 10;
+            else if ( c >= 'A' && c <= 'F' )
+                value |= c - 'A' + 10;
+            else
+                Fail("invalid escape sequence");
+        }
+        return value;
+    }
+
+    static void AppendUTF8(std::string& out, unsigned cp)
+    {
+        if ( cp < 0x80 )
+        {
+            out += char(cp);
+        }
+        else if ( cp < 0x800 )
+        {
+            out += char(0xC0 | (cp >> 6));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else if ( cp < 0x10000 )
+        {
+            out += char(0xE0 | (cp >> 12));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += char(0xF0 | (cp >> 18));
+            out += char(0x80 | ((cp >> 12) & 0x3F));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+    }
+
+    // Skips a number or true, false or null.
+    void SkipLiteral()
+    {
+        const char *token = m_p;
+        while ( m_p != m_end && (isalnum(static_cast<unsigned char>(*m_p)) || *m_p == '-' || *m_p == '+' || *m_p == '.') )
+            m_p++;
+
+        const size_t len = m_p - token;
+        const bool isNumber = *token == '-' || (*token >= '0' && *token <= '9');
+        if ( !isNumber &&
+             !(len == 4 && memcmp(token, "true", 4) == 0) &&
+             !(len == 5 && memcmp(token, "false", 5) == 0) &&
+             !(len == 4 && memcmp(token, "null", 4) == 0) )
+        {
+            m_p = token;
+            Fail("unexpected character");
+        }
+    }
+
+    // Skips a string without decoding it.
+    void SkipString()
+    {
+        for ( m_p++; m_p != m_end && *m_p != '"'; m_p++ )
+        {
+            if ( *m_p == '\\' && ++m_p == m_end )
+                break;
+        }
+        if ( m_p == m_end )
+            Fail("unterminated string");
+        m_p++;
+    }
+
+    void Skip(int depth)
+    {
+        if ( depth > MAX_JSON_DEPTH )
+            Fail("too deeply nested value");
+
+        switch ( PeekType() )
+        {
+            case Type_Object:
+            {
+                m_p++;
+                for ( bool first = true; NextValue(first, '}'); )
+                {
+                    if ( Peek() != '"' )
+                        Fail("expected member name");
+                    SkipString();
+                    Expect(':');
+                    Skip(depth + 1);
+                }
+                break;
+            }
+            case Type_Array:
+            {
+                m_p++;
+                for ( bool first = true; NextValue(first, ']'); )
+                    Skip(depth + 1);
+                break;
+            }
+            case Type_String:
+                SkipString();
+                break;
+            case Type_Other:
+                SkipLiteral();
+                break;
+        }
+    }
+
+    const char *const m_start;
+    const char *m_p;
+    const char *const m_end;
+};
+
+} // namespace winsparkle
+
+#endif // _jsonreader_h_
@@ -0,0 +1,422 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "logger.h"
+#include "threads.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <windows.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// number of messages the ring buffer holds; must be a power of two
+const LONG RING_SIZE = 256;
+
+// how long the writer thread lets messages accumulate after the first one,
+// to write them out together, unless woken up sooner (in milliseconds)
+const DWORD BATCH_DELAY = 200;
+
+// default size at which the log file is rotated (in bytes)
+const size_t DEFAULT_MAX_FILE_SIZE = 1024 * 1024;
+
+/**
+    Slot of the ring buffer.
+
+    This is a bounded queue with a sequence number in every slot: a writer
+    may fill the slot at position N once its sequence is N, and makes it N+1
+    when done, which lets the reader take it. The reader then makes it
+    N+RING_SIZE, for the writer coming around the next time. Writers only
+    compete for the position with a compare-and-swap, so they never block
+    each other or wait for the reader.
+
+    The sequence is stored relative to the slot's index, so that the
+    zero-initialized buffer is ready before any constructors run.
+ */
+struct LogRecord
+{
+    volatile LONG sequence;
+    win_sparkle_log_level_t level;
+    DWORD threadId;
+    FILETIME time;
+    char text[Logger::MAX_MESSAGE_LENGTH];
+};
+
+LogRecord g_ring[RING_SIZE];
+
+// position the next message is written to
+volatile LONG g_writePos = 0;
+
+// position of the next message to take; only changed with g_csReader locked
+volatile LONG g_readPos = 0;
+
+// number of messages dropped because the buffer was full
+volatile LONG g_dropped = 0;
+
+// wakes up the writer thread, NULL when it doesn't run
+HANDLE g_wakeEvent = NULL;
+
+// guards taking the messages from the buffer and the sinks below
+CriticalSection g_csReader;
+
+std::wstring g_filePath;
+size_t g_maxFileSize = DEFAULT_MAX_FILE_SIZE;
+HANDLE g_file = INVALID_HANDLE_VALUE;
+size_t g_fileSize = 0;
+
+win_sparkle_log_callback_t g_callback = NULL;
+void *g_callbackData = NULL;
+
+inline LONG GetSequence(LONG index)
+{
+    return g_ring[index].sequence + index;
+}
+
+inline void SetSequence(LONG index, LONG sequence)
+{
+    // the barrier publishes the record's data before the sequence
+    InterlockedExchange(&g_ring[index].sequence, sequence - index);
+}
+
+// Difference of positions, correct even when they wrap around.
+inline LONG Distance(LONG a, LONG b)
+{
+    return LONG((unsigned long)a - (unsigned long)b);
+}
+
+const char *GetLevelName(win_sparkle_log_level_t level)
+{
+    switch ( level )
+    {
+        case WIN_SPARKLE_LOG_ERROR:   return "ERROR";
+        case WIN_SPARKLE_LOG_WARNING: return "WARNING";
+        case WIN_SPARKLE_LOG_INFO:    return "INFO";
+        case WIN_SPARKLE_LOG_DEBUG:   return "DEBUG";
+    }
+    return "?";
+}
+
+// Formats the message as a line of the log file.
+std::string FormatRecord(const LogRecord& record)
+{
+    FILETIME local;
+    SYSTEMTIME st;
+    if ( !FileTimeToLocalFileTime(&record.time, &local) ||
+         !FileTimeToSystemTime(&local, &st) )
+    {
+        ZeroMemory(&st, sizeof(st));
+    }
+
+    char prefix[64];
+    _snprintf(prefix, sizeof(prefix), "%04u-%02u-%02u %02u:%02u:%02u.%03u [%lu] %s: ",
+              unsigned(st.wYear), unsigned(st.wMonth), unsigned(st.wDay),
+              unsigned(st.wHour), unsigned(st.wMinute), unsigned(st.wSecond),
+              unsigned(st.wMilliseconds), (unsigned long)record.threadId,
+              GetLevelName(record.level));
+    prefix[sizeof(prefix) - 1] = '\0';
+
+    std::string line(prefix);
+    line.append(record.text);
+    line.append("\r\n");
+    return line;
+}
+
+void CloseFile()
+{
+    if ( g_file != INVALID_HANDLE_VALUE )
+        CloseHandle(g_file);
+    g_file = INVALID_HANDLE_VALUE;
+}
+
+bool OpenFile()
+{
+    if ( g_file != INVALID_HANDLE_VALUE )
+        return true;
+
+    // other instances of the app may log into the same file; appending
+    // keeps their lines whole
+    g_file = CreateFileW(g_filePath.c_str(), FILE_APPEND_DATA,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                         NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( g_file == INVALID_HANDLE_VALUE )
+        return false;
+
+    LARGE_INTEGER size;
+    g_fileSize = GetFileSizeEx(g_file, &size) ? size_t(size.QuadPart) : 0;
+    return true;
+}
+
+// Writes the line to the log file, if any. Must be called with g_csReader
+// locked.
+void WriteToFile(const std::string& line)
+{
+    if ( g_filePath.empty() )
+        return;
+
+    // keep the previous file, so that the latest messages are never lost
+    if ( g_fileSize > 0 && g_fileSize + line.length() > g_maxFileSize )
+    {
+        CloseFile();
+        MoveFileExW(g_filePath.c_str(), (g_filePath + L".1").c_str(), MOVEFILE_REPLACE_EXISTING);
+    }
+
+    if ( !OpenFile() )
+        return;
+
+    DWORD written;
+    if ( WriteFile(g_file, line.data(), DWORD(line.length()), &written, NULL) )
+        g_fileSize += written;
+}
+
+// Writes the message out. Must be called with g_csReader locked.
+void WriteRecord(const LogRecord& record)
+{
+    std::string msg("WinSparkle: ");
+    msg.append(record.text);
+    msg.append("\n");
+    OutputDebugStringA(msg.c_str());
+
+    WriteToFile(FormatRecord(record));
+
+    if ( g_callback )
+        g_callback(record.level, record.text, g_callbackData);
+}
+
+// Writes a message that didn't go through the buffer.
+void WriteDirectly(win_sparkle_log_level_t level, const char *text)
+{
+    LogRecord record;
+    record.level = level;
+    record.threadId = GetCurrentThreadId();
+    GetSystemTimeAsFileTime(&record.time);
+    strncpy(record.text, text, sizeof(record.text) - 1);
+    record.text[sizeof(record.text) - 1] = '\0';
+    WriteRecord(record);
+}
+
+// Writes out all messages in the buffer.
+void Drain()
+{
+    CriticalSectionLocker lock(g_csReader);
+
+    for ( ;; )
+    {
+        const LONG pos = g_readPos;
+        const LONG index = pos & (RING_SIZE - 1);
+        if ( Distance(GetSequence(index), pos + 1) < 0 )
+            break; // empty, or the next message is still being written
+        MemoryBarrier();
+
+        const LogRecord record = g_ring[index];
+        SetSequence(index, pos + RING_SIZE);
+        // the barrier pairs with the one in Logger::Write(): either the
+        // next message is seen here, or its writer sees the buffer empty
+        // and wakes up the writer thread
+        InterlockedExchange(&g_readPos, pos + 1);
+
+        WriteRecord(record);
+    }
+
+    const LONG dropped = InterlockedExchange(&g_dropped, 0);
+    if ( dropped > 0 )
+    {
+        char msg[64];
+        _snprintf(msg, sizeof(msg), "%ld log messages were dropped", long(dropped));
+        msg[sizeof(msg) - 1] = '\0';
+        WriteDirectly(WIN_SPARKLE_LOG_WARNING, msg);
+    }
+
+    if ( g_file != INVALID_HANDLE_VALUE )
+        FlushFileBuffers(g_file);
+}
+
+
+/// Thread writing the messages out of the buffer.
+class LogWriter : public Thread
+{
+public:
+    LogWriter() : Thread("WinSparkle log writer", true) {}
+
+protected:
+    virtual void Run()
+    {
+        SignalReady();
+
+        try
+        {
+            for ( ;; )
+            {
+                // woken up by the first message after the buffer was empty
+                GetCancellationToken().Wait(g_wakeEvent);
+                // and then by errors and when the buffer is filling up
+                GetCancellationToken().Wait(g_wakeEvent, BATCH_DELAY);
+                Drain();
+            }
+        }
+        catch ( OperationCancelledException& )
+        {
+            // StopWriter() writes out the rest
+        }
+    }
+
+    virtual bool IsJoinable() const { return true; }
+};
+
+CriticalSection g_csWriter;
+LogWriter *g_writer = NULL;
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                  Logger
+ *--------------------------------------------------------------------------*/
+
+volatile win_sparkle_log_level_t Logger::ms_level = WIN_SPARKLE_LOG_ERROR;
+
+void Logger::Write(win_sparkle_log_level_t level, const char *msg)
+{
+    if ( !IsEnabled(level) )
+        return;
+
+    LONG pos = g_writePos;
+    LONG index;
+    for ( ;; )
+    {
+        index = pos & (RING_SIZE - 1);
+        const LONG diff = Distance(GetSequence(index), pos);
+        if ( diff == 0 )
+        {
+            const LONG current = InterlockedCompareExchange(&g_writePos, pos + 1, pos);
+            if ( current == pos )
+                break;
+            pos = current;
+        }
+        else if ( diff < 0 )
+        {
+            // full, the reader didn't take the slot from the last round yet
+            InterlockedIncrement(&g_dropped);
+            return;
+        }
+        else
+        {
+            // another writer took the position already
+            pos = g_writePos;
+        }
+    }
+
+    LogRecord& record = g_ring[index];
+    record.level = level;
+    record.threadId = GetCurrentThreadId();
+    GetSystemTimeAsFileTime(&record.time);
+    strncpy(record.text, msg, sizeof(record.text) - 1);
+    record.text[sizeof(record.text) - 1] = '\0';
+    SetSequence(index, pos + 1);
+
+    // Only wake up the writer thread when needed, to keep this cheap: when
+    // the buffer was empty, when it's half full and for errors, which are
+    // written out right away in case the process crashes. This reads
+    // g_readPos after publishing the message, see Drain().
+    const HANDLE wake = g_wakeEvent;
+    const LONG queued = Distance(pos, g_readPos);
+    if ( wake && (queued == 0 || queued == RING_SIZE / 2 || level == WIN_SPARKLE_LOG_ERROR) )
+        SetEvent(wake);
+}
+
+void Logger::SetFile(const wchar_t *path, size_t maxSize)
+{
+    CriticalSectionLocker lock(g_csReader);
+
+    CloseFile();
+    g_filePath = path ? path : L"";
+    g_maxFileSize = maxSize ? maxSize : DEFAULT_MAX_FILE_SIZE;
+}
+
+void Logger::SetCallback(win_sparkle_log_callback_t callback, void *userData)
+{
+    CriticalSectionLocker lock(g_csReader);
+
+    g_callback = callback;
+    g_callbackData = userData;
+}
+
+void Logger::StartWriter()
+{
+    CriticalSectionLocker lock(g_csWriter);
+
+    if ( g_writer )
+        return;
+
+    if ( !g_wakeEvent )
+    {
+        g_wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if ( !g_wakeEvent )
+            return; // the messages are still written out by StopWriter()
+    }
+
+    try
+    {
+        std::unique_ptr<LogWriter> writer(new LogWriter());
+        writer->Start();
+        g_writer = writer.release();
+
+        // write out the messages logged until now
+        SetEvent(g_wakeEvent);
+    }
+    catch ( std::exception& e )
+    {
+        WriteDirectly(WIN_SPARKLE_LOG_ERROR, e.what());
+    }
+}
+
+void Logger::StopWriter()
+{
+    {
+        CriticalSectionLocker lock(g_csWriter);
+        if ( g_writer )
+        {
+            g_writer->TerminateAndJoin();
+            delete g_writer;
+            g_writer = NULL;
+        }
+    }
+
+    Drain();
+
+    CriticalSectionLocker lock(g_csReader);
+    CloseFile();
+}
+
+} // namespace winsparkle
@@ -0,0 +1,123 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _logger_h_
+#define _logger_h_
+
+#include "winsparkle.h"
+
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Leveled logging to the debug output, a log file and the application.
+
+    Writing a message only copies it into a fixed-size in-memory ring
+    buffer, without taking any lock, so it's cheap enough even for hot
+    paths such as the download loop; messages below the level set with
+    win_sparkle_set_log_level() cost a single memory read. A background
+    thread takes the messages from the buffer and writes them out, to
+    OutputDebugString(), to the file set with win_sparkle_set_log_file(),
+    rotating it when it grows too big, and to the callback set with
+    win_sparkle_set_log_callback().
+
+    Messages longer than MAX_MESSAGE_LENGTH are truncated. If the buffer
+    is full, because messages are written faster than they can be written
+    out, new ones are dropped and their number is logged later.
+
+    All methods are thread-safe.
+ */
+class Logger
+{
+public:
+    /// Maximum length of a message, including the terminating NUL.
+    static const size_t MAX_MESSAGE_LENGTH = 512;
+
+    /// Should messages of @a level be logged?
+    static bool IsEnabled(win_sparkle_log_level_t level)
+    {
+        return level <= ms_level;
+    }
+
+    /// Logs @a msg if IsEnabled(@a level).
+    static void Write(win_sparkle_log_level_t level, const char *msg);
+
+    /// Sets the most detailed level logged.
+    static void SetLevel(win_sparkle_log_level_t level) { ms_level = level; }
+
+    /**
+        Sets the log file, see win_sparkle_set_log_file().
+
+        @param path     Path of the file, NULL or empty for none.
+        @param maxSize  Size in bytes at which the file is rotated.
+     */
+    static void SetFile(const wchar_t *path, size_t maxSize);
+
+    /// Sets the callback, see win_sparkle_set_log_callback().
+    static void SetCallback(win_sparkle_log_callback_t callback, void *userData);
+
+    /**
+        Starts the thread writing the messages out. Messages logged before
+        are kept in the buffer until then. Does nothing if it's running.
+     */
+    static void StartWriter();
+
+    /**
+        Stops the writer thread and writes out the messages logged so far
+        on the calling thread.
+     */
+    static void StopWriter();
+
+private:
+    static volatile win_sparkle_log_level_t ms_level;
+};
+
+
+/// Logs a warning, i.e. an error WinSparkle recovered from.
+inline void LogWarning(const std::string& msg)
+{
+    if ( Logger::IsEnabled(WIN_SPARKLE_LOG_WARNING) )
+        Logger::Write(WIN_SPARKLE_LOG_WARNING, msg.c_str());
+}
+
+/// Logs a message about the progress of updating.
+inline void LogInfo(const std::string& msg)
+{
+    if ( Logger::IsEnabled(WIN_SPARKLE_LOG_INFO) )
+        Logger::Write(WIN_SPARKLE_LOG_INFO, msg.c_str());
+}
+
+/// Logs a detailed message for debugging.
+inline void LogDebug(const char *msg)
+{
+    if ( Logger::IsEnabled(WIN_SPARKLE_LOG_DEBUG) )
+        Logger::Write(WIN_SPARKLE_LOG_DEBUG, msg);
+}
+
+} // namespace winsparkle
+
+#endif // _logger_h_
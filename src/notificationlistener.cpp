@@ -0,0 +1,231 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "notificationlistener.h"
+#include "download.h"
+#include "error.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// The server must respond to every request, and send at least a comment
+// line on event streams, within the download stall budgets (1 minute for
+// the response headers, 30 seconds between data).
+
+// shortest time between the start of two requests, in case the server
+// responds right away (in milliseconds)
+const DWORD MIN_REQUEST_INTERVAL = 10 * 1000; // 10 seconds
+
+// how long to wait before trying again after a request failed; the delay
+// doubles with every further failure, up to MAX_RETRY_DELAY (in milliseconds)
+const DWORD FIRST_RETRY_DELAY = 30 * 1000; // 30 seconds
+const DWORD MAX_RETRY_DELAY = 60 * 60 * 1000; // 1 hour
+
+// longer lines of event streams are truncated, only the field names and
+// short values matter
+const size_t MAX_LINE_LENGTH = 1024;
+
+// Randomized exponential backoff, for the same reasons as with update checks:
+// many clients lose the connection at once when the server restarts.
+DWORD GetRetryDelay(unsigned failures)
+{
+    DWORD delay = FIRST_RETRY_DELAY << (std::min)(failures - 1, 7u);
+    delay = (std::min)(delay, MAX_RETRY_DELAY);
+    return delay / 2 + GetRandomNumber(delay - delay / 2);
+}
+
+/**
+    Sink for the responses of the notification server.
+
+    Long polling responses are only counted, event streams are parsed as
+    they arrive.
+ */
+class NotificationSink : public IDownloadSink
+{
+public:
+    NotificationSink(NotificationListener::Callback callback)
+        : m_callback(callback), m_eventStream(false), m_received(0),
+          m_lastWasCR(false), m_hasData(false)
+    {}
+
+    virtual void SetLength(size_t) {}
+    virtual void SetFilename(const std::wstring&) {}
+
+    virtual const char *GetExtraHeaderName(size_t index) const { return index == 0 ? "Content-Type" : NULL; }
+
+    virtual void SetExtraHeader(size_t, const std::string& value)
+    {
+        static const char EVENT_STREAM[] = "text/event-stream";
+        m_eventStream = _strnicmp(value.c_str(), EVENT_STREAM, sizeof(EVENT_STREAM) - 1) == 0;
+    }
+
+    virtual void Add(const void *data, size_t len)
+    {
+        m_received += len;
+        if ( !m_eventStream )
+            return;
+
+        const char *p = static_cast<const char*>(data);
+        for ( const char *end = p + len; p != end; ++p )
+        {
+            // lines end with CR, LF or CRLF
+            const char c = *p;
+            if ( c == '\n' && m_lastWasCR )
+            {
+                m_lastWasCR = false;
+                continue;
+            }
+            m_lastWasCR = c == '\r';
+
+            if ( c == '\r' || c == '\n' )
+            {
+                ProcessLine();
+                m_line.clear();
+            }
+            else if ( m_line.size() < MAX_LINE_LENGTH )
+            {
+                m_line += c;
+            }
+        }
+    }
+
+    /// Called when the response ended.
+    void Finish()
+    {
+        // an event stream that ended is simply reconnected, an incomplete
+        // event at its end is discarded as the specification says
+        if ( !m_eventStream && m_received )
+            m_callback();
+    }
+
+private:
+    void ProcessLine()
+    {
+        // empty line dispatches the event
+        if ( m_line.empty() )
+        {
+            if ( m_hasData && (m_event.empty() || m_event == "message" || m_event == "update") )
+                m_callback();
+            m_hasData = false;
+            m_event.clear();
+            return;
+        }
+
+        // comment, typically sent to keep the connection alive
+        if ( m_line[0] == ':' )
+            return;
+
+        const size_t colon = m_line.find(':');
+        const std::string field = m_line.substr(0, colon);
+        std::string value;
+        if ( colon != std::string::npos )
+        {
+            const size_t start = m_line.compare(colon + 1, 1, " ") == 0 ? colon + 2 : colon + 1;
+            value = m_line.substr(start);
+        }
+
+        if ( field == "data" )
+            m_hasData = true;
+        else if ( field == "event" )
+            m_event = value;
+    }
+
+    NotificationListener::Callback m_callback;
+    bool m_eventStream;
+    size_t m_received;
+
+    // event stream parsing state
+    std::string m_line;
+    bool m_lastWasCR;
+    bool m_hasData;
+    std::string m_event;
+};
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                          NotificationListener
+ *--------------------------------------------------------------------------*/
+
+NotificationListener::NotificationListener(const std::string& url, Callback callback)
+    : Thread("WinSparkle update notifications", true),
+      m_url(url), m_callback(callback)
+{
+}
+
+
+void NotificationListener::Run()
+{
+    SignalReady();
+
+    unsigned failures = 0;
+    for ( ;; )
+    {
+        const DWORD started = GetTickCount();
+        DWORD delay;
+        try
+        {
+            NotificationSink sink(m_callback);
+            DownloadFile(m_url, &sink, this);
+            sink.Finish();
+
+            failures = 0;
+            const DWORD elapsed = GetTickCount() - started;
+            delay = elapsed < MIN_REQUEST_INTERVAL ? MIN_REQUEST_INTERVAL - elapsed : 0;
+        }
+        catch ( TerminateThreadException& )
+        {
+            throw;
+        }
+        catch ( HttpErrorException& e )
+        {
+            LogError(e.what());
+            delay = GetRetryDelay(++failures);
+            if ( e.GetRetryAfter() > 0 )
+                delay = (std::max)(delay, (std::min)(DWORD(e.GetRetryAfter()) * 1000, MAX_RETRY_DELAY));
+        }
+        catch ( std::exception& e )
+        {
+            LogError(e.what());
+            delay = GetRetryDelay(++failures);
+        }
+
+        GetCancellationToken().Wait(NULL, delay);
+    }
+}
+
+} // namespace winsparkle
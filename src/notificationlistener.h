@@ -0,0 +1,68 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _notificationlistener_h_
+#define _notificationlistener_h_
+
+#include "threads.h"
+
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Listens for announcements of new releases from the server set with
+    win_sparkle_set_update_notification_url().
+
+    The URL is requested over and over. The server either holds the request
+    until a release is published (long polling), responding with a non-empty
+    body when it is and with an empty one (e.g. 204) when it has nothing to
+    announce, or it keeps the response open as a stream of server-sent events
+    (Content-Type: text/event-stream), in which every event with data, of the
+    default type or of type "update", announces a release.
+
+    The callback is called on this thread for every announcement. Failed
+    requests are retried with exponential backoff.
+ */
+class NotificationListener : public Thread
+{
+public:
+    typedef void (*Callback)();
+
+    NotificationListener(const std::string& url, Callback callback);
+
+protected:
+    virtual void Run();
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    std::string m_url;
+    Callback m_callback;
+};
+
+} // namespace winsparkle
+
+#endif // _notificationlistener_h_
@@ -0,0 +1,345 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "pipelinestatus.h"
+
+#include <string.h>
+#include <windows.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Sequence lock, see PipelineStatus. It needs no initialization, so that
+// it can be used by static objects.
+struct SequenceLock
+{
+    volatile LONG seq;
+
+    void BeginWrite() { InterlockedIncrement(&seq); }
+    void EndWrite() { InterlockedIncrement(&seq); }
+
+    // returns the value to pass to Validate() after reading
+    LONG BeginRead()
+    {
+        for ( ;; )
+        {
+            const LONG value = InterlockedCompareExchange(&seq, 0, 0);
+            if ( !(value & 1) )
+                return value;
+            YieldProcessor();
+        }
+    }
+
+    // were the values read since BeginRead() consistent?
+    bool Validate(LONG value)
+    {
+        return InterlockedCompareExchange(&seq, 0, 0) == value;
+    }
+};
+
+struct SchedulerStatus
+{
+    SequenceLock lock;
+    volatile LONG state;
+    volatile time_t nextCheck;
+} g_scheduler;
+
+struct ErrorStatus
+{
+    SequenceLock lock;
+    volatile LONG kind;
+    volatile unsigned httpStatus;
+    volatile unsigned long systemError;
+    volatile time_t time;
+} g_lastError;
+
+struct OperationSlot
+{
+    // is the slot used by an operation?
+    volatile LONG used;
+
+    SequenceLock lock;
+    volatile LONG kind;
+    volatile LONG phase;
+    volatile DWORD phaseStart;
+    volatile unsigned long long done, total;
+
+    // the first progress in the phase, which the speed is computed from,
+    // so that resumed downloads don't count the data they already had
+    volatile bool hasRateBase;
+    volatile DWORD rateBaseTime;
+    volatile unsigned long long rateBaseDone;
+};
+
+OperationSlot g_slots[WIN_SPARKLE_STATUS_MAX_OPERATIONS];
+
+// all operations in progress and those in WIN_SPARKLE_PHASE_QUEUED of them
+volatile LONG g_operationCount = 0;
+volatile LONG g_queuedCount = 0;
+
+// StatusOperation of the current thread, NULL if none
+struct StatusOperationTls
+{
+    StatusOperationTls() : index(TlsAlloc()) {}
+    ~StatusOperationTls() { TlsFree(index); }
+    DWORD index;
+} g_tlsStatusOperation;
+
+void ReadSlot(OperationSlot& slot, DWORD now, win_sparkle_operation_status_t& op)
+{
+    for ( ;; )
+    {
+        const LONG seq = slot.lock.BeginRead();
+
+        op.kind = win_sparkle_operation_kind_t(slot.kind);
+        op.phase = win_sparkle_phase_t(slot.phase);
+        op.phase_ms = unsigned(now - slot.phaseStart);
+        op.bytes_done = slot.done;
+        op.bytes_total = slot.total;
+        op.bytes_per_second = 0;
+        const DWORD rateTime = now - slot.rateBaseTime;
+        if ( slot.hasRateBase && rateTime > 0 && op.bytes_done >= slot.rateBaseDone )
+            op.bytes_per_second = (op.bytes_done - slot.rateBaseDone) * 1000 / rateTime;
+
+        if ( slot.lock.Validate(seq) )
+            return;
+    }
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                              PipelineStatus
+ *--------------------------------------------------------------------------*/
+
+void PipelineStatus::SetScheduler(win_sparkle_scheduler_state_t state, time_t nextCheck)
+{
+    g_scheduler.lock.BeginWrite();
+    g_scheduler.state = state;
+    g_scheduler.nextCheck = nextCheck;
+    g_scheduler.lock.EndWrite();
+}
+
+
+void PipelineStatus::SetLastError(win_sparkle_error_kind_t kind,
+                                  unsigned httpStatus, unsigned long systemError)
+{
+    g_lastError.lock.BeginWrite();
+    g_lastError.kind = kind;
+    g_lastError.httpStatus = httpStatus;
+    g_lastError.systemError = systemError;
+    g_lastError.time = time(NULL);
+    g_lastError.lock.EndWrite();
+}
+
+
+void PipelineStatus::Get(win_sparkle_status_t& status)
+{
+    const size_t size = status.size < sizeof(win_sparkle_status_t) ? status.size : sizeof(win_sparkle_status_t);
+
+    win_sparkle_status_t s;
+    memset(&s, 0, sizeof(s));
+
+    for ( ;; )
+    {
+        const LONG seq = g_scheduler.lock.BeginRead();
+        s.scheduler = win_sparkle_scheduler_state_t(g_scheduler.state);
+        s.next_check_time = g_scheduler.nextCheck;
+        if ( g_scheduler.lock.Validate(seq) )
+            break;
+    }
+
+    s.operation_count = unsigned(InterlockedCompareExchange(&g_operationCount, 0, 0));
+    s.queued_operations = unsigned(InterlockedCompareExchange(&g_queuedCount, 0, 0));
+
+    const DWORD now = GetTickCount();
+    unsigned count = 0;
+    for ( unsigned i = 0; i < WIN_SPARKLE_STATUS_MAX_OPERATIONS; i++ )
+    {
+        if ( InterlockedCompareExchange(&g_slots[i].used, 0, 0) )
+            ReadSlot(g_slots[i], now, s.operations[count++]);
+    }
+
+    for ( ;; )
+    {
+        const LONG seq = g_lastError.lock.BeginRead();
+        s.last_error_kind = win_sparkle_error_kind_t(g_lastError.kind);
+        s.last_error_http_status = g_lastError.httpStatus;
+        s.last_error_system_code = g_lastError.systemError;
+        s.last_error_time = g_lastError.time;
+        if ( g_lastError.lock.Validate(seq) )
+            break;
+    }
+
+    // everything except for the size field
+    memcpy(reinterpret_cast<char*>(&status) + sizeof(status.size),
+           reinterpret_cast<const char*>(&s) + sizeof(status.size),
+           size - sizeof(status.size));
+}
+
+
+/*--------------------------------------------------------------------------*
+                             StatusOperation
+ *--------------------------------------------------------------------------*/
+
+StatusOperation::StatusOperation(win_sparkle_operation_kind_t kind,
+                                 win_sparkle_phase_t phase)
+    : m_slot(NULL), m_outer(NULL), m_kind(kind), m_phase(phase),
+      m_previous(GetCurrent())
+{
+    if ( g_tlsStatusOperation.index != TLS_OUT_OF_INDEXES )
+        TlsSetValue(g_tlsStatusOperation.index, this);
+
+    if ( m_previous )
+    {
+        StatusOperation *owner = m_previous->m_outer ? m_previous->m_outer : m_previous;
+        if ( owner->m_kind == kind )
+        {
+            m_outer = owner;
+            m_outer->SetPhase(phase);
+            return;
+        }
+    }
+
+    InterlockedIncrement(&g_operationCount);
+    if ( phase == WIN_SPARKLE_PHASE_QUEUED )
+        InterlockedIncrement(&g_queuedCount);
+
+    for ( unsigned i = 0; i < WIN_SPARKLE_STATUS_MAX_OPERATIONS; i++ )
+    {
+        if ( InterlockedCompareExchange(&g_slots[i].used, 1, 0) == 0 )
+        {
+            OperationSlot& slot = g_slots[i];
+            slot.lock.BeginWrite();
+            slot.kind = kind;
+            slot.phase = phase;
+            slot.phaseStart = GetTickCount();
+            slot.done = slot.total = 0;
+            slot.hasRateBase = false;
+            slot.lock.EndWrite();
+            m_slot = &slot;
+            break;
+        }
+    }
+}
+
+
+StatusOperation::~StatusOperation()
+{
+    if ( g_tlsStatusOperation.index != TLS_OUT_OF_INDEXES )
+        TlsSetValue(g_tlsStatusOperation.index, m_previous);
+
+    if ( m_outer )
+        return;
+
+    if ( m_slot )
+        InterlockedExchange(&static_cast<OperationSlot*>(m_slot)->used, 0);
+    if ( m_phase == WIN_SPARKLE_PHASE_QUEUED )
+        InterlockedDecrement(&g_queuedCount);
+    InterlockedDecrement(&g_operationCount);
+}
+
+
+void StatusOperation::SetPhase(win_sparkle_phase_t phase)
+{
+    if ( m_outer )
+    {
+        m_outer->SetPhase(phase);
+        return;
+    }
+
+    if ( phase == m_phase )
+        return;
+
+    if ( m_phase == WIN_SPARKLE_PHASE_QUEUED )
+        InterlockedDecrement(&g_queuedCount);
+    else if ( phase == WIN_SPARKLE_PHASE_QUEUED )
+        InterlockedIncrement(&g_queuedCount);
+    m_phase = phase;
+
+    if ( !m_slot )
+        return;
+
+    OperationSlot& slot = *static_cast<OperationSlot*>(m_slot);
+    slot.lock.BeginWrite();
+    slot.phase = phase;
+    slot.phaseStart = GetTickCount();
+    slot.done = slot.total = 0;
+    slot.hasRateBase = false;
+    slot.lock.EndWrite();
+}
+
+
+void StatusOperation::SetProgress(unsigned long long done, unsigned long long total)
+{
+    if ( m_outer )
+    {
+        m_outer->SetProgress(done, total);
+        return;
+    }
+
+    if ( !m_slot )
+        return;
+
+    OperationSlot& slot = *static_cast<OperationSlot*>(m_slot);
+    slot.lock.BeginWrite();
+    slot.done = done;
+    slot.total = total;
+    if ( !slot.hasRateBase )
+    {
+        slot.hasRateBase = true;
+        slot.rateBaseTime = GetTickCount();
+        slot.rateBaseDone = done;
+    }
+    slot.lock.EndWrite();
+}
+
+
+/*static*/
+StatusOperation *StatusOperation::GetCurrent()
+{
+    if ( g_tlsStatusOperation.index == TLS_OUT_OF_INDEXES )
+        return NULL;
+    return static_cast<StatusOperation*>(TlsGetValue(g_tlsStatusOperation.index));
+}
+
+
+/*static*/
+void StatusOperation::SetCurrentPhase(win_sparkle_phase_t phase)
+{
+    StatusOperation *current = GetCurrent();
+    if ( current )
+        current->SetPhase(phase);
+}
+
+} // namespace winsparkle
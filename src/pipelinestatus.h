@@ -0,0 +1,117 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _pipelinestatus_h_
+#define _pipelinestatus_h_
+
+#include "winsparkle.h"
+
+#include <time.h>
+
+namespace winsparkle
+{
+
+/**
+    Keeps the snapshot of what WinSparkle does, for win_sparkle_get_status().
+
+    Each part of it (the scheduler's state, every operation and the last
+    error) is guarded by a sequence lock, like the download progress shown
+    by the UI: the counter is odd while the values are being written and
+    readers retry if it changed while they were reading. Reading thus never
+    blocks the writers, nor takes any locks. Every part supports only one
+    writer at a time.
+ */
+class PipelineStatus
+{
+public:
+    /**
+        Records the scheduler's state and when the next check is due.
+
+        Called with the scheduler's lock held, which serializes the calls.
+     */
+    static void SetScheduler(win_sparkle_scheduler_state_t state, time_t nextCheck);
+
+    /// Records the last error reported to the application.
+    static void SetLastError(win_sparkle_error_kind_t kind,
+                             unsigned httpStatus, unsigned long systemError);
+
+    /// Copies the snapshot to @a status, up to its size field.
+    static void Get(win_sparkle_status_t& status);
+};
+
+
+/**
+    An operation in progress, reported by win_sparkle_get_status() while
+    the object exists.
+
+    The operation is the current thread's, until the object is destroyed:
+    phases are set with SetCurrentPhase() from the code it calls. Creating
+    an operation of the same kind as the current one on the same thread
+    just refers to the outer one, so e.g. a periodic check that waits for
+    its turn and the check itself are reported as a single operation.
+
+    Only WIN_SPARKLE_STATUS_MAX_OPERATIONS operations are described in the
+    status at the same time, the others are only counted.
+ */
+class StatusOperation
+{
+public:
+    StatusOperation(win_sparkle_operation_kind_t kind,
+                    win_sparkle_phase_t phase);
+    ~StatusOperation();
+
+    /// Enters @a phase, which resets the progress.
+    void SetPhase(win_sparkle_phase_t phase);
+
+    /**
+        Records the progress of the download, @a total is 0 if not known.
+
+        May be called from other threads than the operation's, but not
+        from several of them at once.
+     */
+    void SetProgress(unsigned long long done, unsigned long long total);
+
+    /// Returns the current thread's innermost operation, NULL if none.
+    static StatusOperation *GetCurrent();
+
+    /// Sets the phase of the current thread's operation, if it has any.
+    static void SetCurrentPhase(win_sparkle_phase_t phase);
+
+private:
+    // slot in the status, NULL if all of them are used
+    void *m_slot;
+    // operation this one refers to, NULL if it's its own
+    StatusOperation *m_outer;
+    win_sparkle_operation_kind_t m_kind;
+    win_sparkle_phase_t m_phase;
+    StatusOperation *m_previous;
+
+    StatusOperation(const StatusOperation&);
+    StatusOperation& operator=(const StatusOperation&);
+};
+
+} // namespace winsparkle
+
+#endif // _pipelinestatus_h_
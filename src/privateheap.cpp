@@ -0,0 +1,253 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "privateheap.h"
+#include "allocstats.h"
+
+#include <new>
+#include <stdlib.h>
+#include <windows.h>
+
+#ifdef WIN_SPARKLE_PRIVATE_HEAP
+
+// The heap is destroyed when WinSparkle.dll is unloaded, after the DLL's
+// other globals that may still free memory into it, so this file's globals
+// are constructed before and destroyed after them.
+#ifdef _MSC_VER
+    #pragma warning(disable:4073)
+    #pragma init_seg(lib)
+    #define WIN_SPARKLE_EARLY_INIT
+#else
+    #define WIN_SPARKLE_EARLY_INIT __attribute__((init_priority(101)))
+#endif
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Created on first use: operator new is called while the globals are
+// still being constructed.
+HANDLE volatile g_heap = NULL;
+
+// set once the heap was destroyed, when the DLL is being unloaded
+bool g_heapDestroyed = false;
+
+struct HeapOwner
+{
+    ~HeapOwner()
+    {
+        HANDLE heap = InterlockedExchangePointer(&g_heap, NULL);
+        g_heapDestroyed = true;
+        if ( heap )
+            HeapDestroy(heap);
+    }
+} g_heapOwner WIN_SPARKLE_EARLY_INIT;
+
+HANDLE GetHeap()
+{
+    HANDLE heap = g_heap;
+    if ( heap )
+        return heap;
+    if ( g_heapDestroyed )
+        return NULL;
+
+    heap = HeapCreate(0, 0, 0);
+    if ( !heap )
+        return NULL;
+
+    // The low-fragmentation heap is the default since Vista, but not on XP.
+    // Most of WinSparkle's allocations are small strings.
+    ULONG lfh = 2;
+    HeapSetInformation(heap, HeapCompatibilityInformation, &lfh, sizeof(lfh));
+
+    // another thread may have been faster
+    HANDLE other = InterlockedCompareExchangePointer(&g_heap, heap, NULL);
+    if ( other )
+    {
+        HeapDestroy(heap);
+        return other;
+    }
+    return heap;
+}
+
+// The scratch heap and the number of blocks allocated from it. They are
+// modified rarely and briefly, so a spin lock guards them: unlike
+// a critical section, it needs no initialization that could come too late.
+volatile LONG g_scratchSpin = 0;
+HANDLE g_scratchHeap = NULL;
+size_t g_scratchBlocks = 0;
+
+struct ScratchLocker
+{
+    ScratchLocker()
+    {
+        while ( InterlockedExchange(&g_scratchSpin, 1) != 0 )
+            Sleep(0);
+    }
+
+    ~ScratchLocker() { InterlockedExchange(&g_scratchSpin, 0); }
+};
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                               PrivateHeap
+ *--------------------------------------------------------------------------*/
+
+void *PrivateHeap::Alloc(size_t size)
+{
+    HANDLE heap = GetHeap();
+    // after the DLL's globals were destroyed, the memory is simply leaked
+    if ( !heap )
+        return g_heapDestroyed ? malloc(size) : NULL;
+    return HeapAlloc(heap, 0, size);
+}
+
+void PrivateHeap::Free(void *ptr)
+{
+    HANDLE heap = g_heap;
+    // if the heap is gone, so is the memory
+    if ( ptr && heap )
+        HeapFree(heap, 0, ptr);
+}
+
+void PrivateHeap::Compact()
+{
+    HANDLE heap = g_heap;
+    if ( heap )
+        HeapCompact(heap, 0);
+}
+
+void *PrivateHeap::AllocScratch(size_t size)
+{
+    ScratchLocker lock;
+
+    if ( !g_scratchHeap )
+    {
+        g_scratchHeap = HeapCreate(0, 0, 0);
+        if ( !g_scratchHeap )
+            return NULL;
+    }
+
+    void *ptr = HeapAlloc(g_scratchHeap, 0, size ? size : 1);
+    if ( ptr )
+        g_scratchBlocks++;
+    return ptr;
+}
+
+void PrivateHeap::FreeScratch(void *ptr)
+{
+    if ( !ptr )
+        return;
+
+    ScratchLocker lock;
+
+    HeapFree(g_scratchHeap, 0, ptr);
+
+    // all memory goes back to the system at once, however fragmented
+    if ( --g_scratchBlocks == 0 )
+    {
+        HeapDestroy(g_scratchHeap);
+        g_scratchHeap = NULL;
+    }
+}
+
+} // namespace winsparkle
+
+#endif // WIN_SPARKLE_PRIVATE_HEAP
+
+
+/*--------------------------------------------------------------------------*
+                        global allocation functions
+ *--------------------------------------------------------------------------*/
+
+// These replace the C++ runtime's ones in WinSparkle.dll only, see
+// PrivateHeap and AllocationStats.
+
+#if defined(WIN_SPARKLE_PRIVATE_HEAP) || defined(WIN_SPARKLE_ALLOC_STATS)
+
+namespace
+{
+
+void *Allocate(size_t size)
+{
+    winsparkle::AllocationStats::Count(size);
+    // operator new must return a unique pointer even for 0 bytes
+    return winsparkle::PrivateHeap::Alloc(size ? size : 1);
+}
+
+} // anonymous namespace
+
+void *operator new(size_t size)
+{
+    void *ptr = Allocate(size);
+    if ( !ptr )
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) throw()
+{
+    return Allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) throw()
+{
+    return Allocate(size);
+}
+
+void operator delete(void *ptr) throw()
+{
+    winsparkle::PrivateHeap::Free(ptr);
+}
+
+void operator delete[](void *ptr) throw()
+{
+    winsparkle::PrivateHeap::Free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) throw()
+{
+    winsparkle::PrivateHeap::Free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) throw()
+{
+    winsparkle::PrivateHeap::Free(ptr);
+}
+
+#endif // WIN_SPARKLE_PRIVATE_HEAP || WIN_SPARKLE_ALLOC_STATS
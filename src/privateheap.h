@@ -0,0 +1,104 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _privateheap_h_
+#define _privateheap_h_
+
+#include <stddef.h>
+#ifndef WIN_SPARKLE_PRIVATE_HEAP
+#include <stdlib.h>
+#endif
+
+namespace winsparkle
+{
+
+/**
+    WinSparkle's own heaps, used instead of the CRT heap it shares with
+    the application.
+
+    This is only compiled in if WinSparkle is built with
+    WIN_SPARKLE_PRIVATE_HEAP defined. The build then replaces the global
+    operator new in WinSparkle.dll, so that its strings, containers and
+    wxWidgets objects come from a private heap, which doesn't affect the
+    application's own allocations. Expat and large transient buffers use
+    a separate scratch heap, which is destroyed whenever nothing is
+    allocated from it, so that parsing a big appcast or downloading
+    doesn't leave the application's heap fragmented. Without
+    WIN_SPARKLE_PRIVATE_HEAP, the CRT heap is used.
+ */
+class PrivateHeap
+{
+public:
+    /// Allocates @a size bytes from the private heap, NULL on failure.
+    static void *Alloc(size_t size)
+#ifdef WIN_SPARKLE_PRIVATE_HEAP
+        ;
+#else
+        { return malloc(size); }
+#endif
+
+    /// Frees memory allocated with Alloc().
+    static void Free(void *ptr)
+#ifdef WIN_SPARKLE_PRIVATE_HEAP
+        ;
+#else
+        { free(ptr); }
+#endif
+
+    /**
+        Returns the private heap's free memory to the system, if possible.
+        Called when WinSparkle has nothing to do.
+     */
+    static void Compact()
+#ifdef WIN_SPARKLE_PRIVATE_HEAP
+        ;
+#else
+        {}
+#endif
+
+    /**
+        Allocates @a size bytes of transient memory from the scratch heap,
+        NULL on failure. The memory must be freed with FreeScratch() as
+        soon as it's no longer needed.
+     */
+    static void *AllocScratch(size_t size)
+#ifdef WIN_SPARKLE_PRIVATE_HEAP
+        ;
+#else
+        { return malloc(size); }
+#endif
+
+    /// Frees memory allocated with AllocScratch().
+    static void FreeScratch(void *ptr)
+#ifdef WIN_SPARKLE_PRIVATE_HEAP
+        ;
+#else
+        { free(ptr); }
+#endif
+};
+
+} // namespace winsparkle
+
+#endif // _privateheap_h_
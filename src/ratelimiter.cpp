@@ -0,0 +1,245 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "ratelimiter.h"
+
+#include "settings.h"
+#include "threads.h"
+
+#include <vector>
+#include <windows.h>
+#include <iphlpapi.h>
+
+#ifdef _MSC_VER
+#pragma comment(lib, "iphlpapi.lib")
+#endif
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Tokens that may accumulate while no data arrive, in seconds of transfer;
+// this is the longest burst allowed.
+const double BUCKET_SECONDS = 0.5;
+
+// How often other traffic is checked for, in milliseconds.
+const DWORD BACKOFF_SAMPLE_INTERVAL = 1000;
+
+// Other traffic below this rate (bytes/sec) is just background noise...
+const size_t BACKOFF_NOISE_RATE = 16 * 1024;
+
+// ...and so is anything below this fraction of our own traffic, which
+// includes packet headers and the like.
+const size_t BACKOFF_OVERHEAD_DIVISOR = 10;
+
+// Never slow down below this rate when backing off (bytes/sec).
+const size_t BACKOFF_MIN_RATE = 8 * 1024;
+
+// Rate of background downloads while the user is active (bytes/sec), low
+// enough not to disturb e.g. video calls on slow connections.
+const size_t USER_ACTIVE_RATE = 128 * 1024;
+
+// Returns the number of bytes received by all network interfaces, modulo
+// 2^32 (the counters are 32-bit on older systems anyway).
+DWORD GetReceivedTraffic()
+{
+    ULONG size = 0;
+    if ( GetIfTable(NULL, &size, FALSE) != ERROR_INSUFFICIENT_BUFFER )
+        return 0;
+
+    std::vector<char> buffer(size);
+    MIB_IFTABLE *table = reinterpret_cast<MIB_IFTABLE*>(&buffer[0]);
+    if ( GetIfTable(table, &size, FALSE) != NO_ERROR )
+        return 0;
+
+    DWORD total = 0;
+    for ( DWORD i = 0; i < table->dwNumEntries; i++ )
+    {
+        const MIB_IFROW& row = table->table[i];
+        if ( row.dwType != IF_TYPE_SOFTWARE_LOOPBACK )
+            total += row.dwInOctets;
+    }
+    return total;
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                           DownloadRateLimiter
+ *--------------------------------------------------------------------------*/
+
+DownloadRateLimiter DownloadRateLimiter::ms_instance;
+
+DownloadRateLimiter::DownloadRateLimiter()
+    : m_tokens(0), m_lastRefill(GetTickCount()),
+      m_received(0),
+      m_lastSample(0), m_sampleReceived(0), m_sampleTraffic(0),
+      m_backoffRate(0), m_backoffFrom(0)
+{
+}
+
+DownloadRateLimiter& DownloadRateLimiter::Get()
+{
+    return ms_instance;
+}
+
+
+size_t DownloadRateLimiter::GetRate(bool yieldToUser) const
+{
+    size_t rate = Settings::GetMaxDownloadRate();
+    if ( m_backoffRate && (!rate || m_backoffRate < rate) )
+        rate = m_backoffRate;
+    if ( yieldToUser && (!rate || USER_ACTIVE_RATE < rate) )
+        rate = USER_ACTIVE_RATE;
+    return rate;
+}
+
+
+size_t DownloadRateLimiter::GetChunkSize(size_t len)
+{
+    const bool yieldToUser = BackgroundPriority::ShouldYieldToUser();
+
+    CriticalSectionLocker lock(m_cs);
+
+    const size_t rate = GetRate(yieldToUser);
+    if ( !rate )
+        return len;
+
+    // about a tenth of a second worth of data
+    const size_t chunk = rate / 10 < 1024 ? 1024 : rate / 10;
+    return len < chunk ? len : chunk;
+}
+
+
+bool DownloadRateLimiter::MayLimit()
+{
+    if ( Settings::GetMaxDownloadRate() || Settings::GetDownloadBackoff() )
+        return true;
+
+    BackgroundPriority::Refresh();
+    return BackgroundPriority::ShouldYieldToUser();
+}
+
+
+void DownloadRateLimiter::Consume(size_t len, Thread *onThread)
+{
+    // The bucket is shared by all downloads, even if some of them yield to
+    // the user; it's rare for a background download to run at the same
+    // time as one the user waits for, which makes them all wait less.
+    BackgroundPriority::Refresh();
+    const bool yieldToUser = BackgroundPriority::ShouldYieldToUser();
+
+    DWORD waitTime = 0;
+    {
+        CriticalSectionLocker lock(m_cs);
+
+        const DWORD now = GetTickCount();
+        m_received += len;
+        if ( Settings::GetDownloadBackoff() )
+            UpdateBackoff(now);
+        else
+            m_backoffRate = 0;
+
+        const size_t rate = GetRate(yieldToUser);
+        if ( !rate )
+        {
+            m_lastRefill = now;
+            return;
+        }
+
+        // refill the bucket for the time since the last call
+        m_tokens += double(now - m_lastRefill) * rate / 1000;
+        m_lastRefill = now;
+        if ( m_tokens > rate * BUCKET_SECONDS )
+            m_tokens = rate * BUCKET_SECONDS;
+
+        // Take the tokens even if there aren't enough: the debt makes
+        // everybody else wait too, so the total rate stays within the limit.
+        m_tokens -= len;
+        if ( m_tokens < 0 )
+            waitTime = DWORD(-m_tokens * 1000 / rate);
+    }
+
+    if ( !waitTime )
+        return;
+
+    if ( onThread )
+    {
+        // wake up early if the thread should terminate
+        onThread->GetCancellationToken().Wait(NULL, waitTime);
+        return;
+    }
+
+    Sleep(waitTime);
+}
+
+
+void DownloadRateLimiter::UpdateBackoff(DWORD now)
+{
+    if ( m_lastSample && now - m_lastSample < BACKOFF_SAMPLE_INTERVAL )
+        return;
+
+    const DWORD traffic = GetReceivedTraffic();
+    const DWORD elapsed = now - m_lastSample;
+    const bool firstSample = m_lastSample == 0 || elapsed > 10 * BACKOFF_SAMPLE_INTERVAL;
+
+    const unsigned long long ours = m_received - m_sampleReceived;
+    const DWORD total = traffic - m_sampleTraffic;
+
+    m_lastSample = now;
+    m_sampleReceived = m_received;
+    m_sampleTraffic = traffic;
+
+    // the counters are meaningless after a long pause
+    if ( firstSample )
+        return;
+
+    const size_t ourRate = size_t(ours * 1000 / elapsed);
+    const size_t otherRate = total > ours ? size_t((total - ours) * 1000 / elapsed) : 0;
+
+    if ( otherRate > BACKOFF_NOISE_RATE && otherRate > ourRate / BACKOFF_OVERHEAD_DIVISOR )
+    {
+        // somebody else needs the bandwidth, halve our share
+        if ( !m_backoffRate )
+            m_backoffFrom = ourRate;
+        m_backoffRate = ourRate / 2 < BACKOFF_MIN_RATE ? BACKOFF_MIN_RATE : ourRate / 2;
+    }
+    else if ( m_backoffRate )
+    {
+        // speed up gradually, until back at the original rate
+        m_backoffRate += m_backoffRate / 4;
+        if ( m_backoffRate >= m_backoffFrom )
+            m_backoffRate = 0;
+    }
+}
+
+} // namespace winsparkle
@@ -0,0 +1,117 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _ratelimiter_h_
+#define _ratelimiter_h_
+
+#include "threads.h"
+
+#include <stddef.h>
+
+namespace winsparkle
+{
+
+/**
+    Limits the rate at which all downloads together receive data.
+
+    The limit is set with win_sparkle_set_max_download_rate() and enforced
+    with a token bucket: every received byte takes a token, tokens are
+    added at the allowed rate and a download that runs out of them waits
+    until there are enough again.
+
+    If enabled by win_sparkle_set_download_backoff(), the rate is also
+    lowered whenever other applications receive data at the same time, and
+    raised again gradually once they stop.
+
+    Background downloads are limited to a low rate while the user is using
+    the computer, see BackgroundPriority::ShouldYieldToUser().
+ */
+class DownloadRateLimiter
+{
+public:
+    /// Returns the limiter shared by all downloads.
+    static DownloadRateLimiter& Get();
+
+    /**
+        Returns the largest chunk of data that should be read at once.
+
+        Reading too much at once would make the transfer bursty. Returns
+        @a len if it is small enough.
+     */
+    size_t GetChunkSize(size_t len);
+
+    /**
+        Accounts for @a len bytes just received.
+
+        Waits for as long as needed to keep the rate within the limit. Throws
+        OperationCancelledException if @a onThread is told to terminate
+        meanwhile.
+
+        Note that this is called from several threads at once.
+     */
+    void Consume(size_t len, Thread *onThread);
+
+    /**
+        Could downloads be slowed down now?
+
+        Downloads that can't wait in Consume(), because they don't run on
+        a thread of their own, should only be used when this is false.
+     */
+    bool MayLimit();
+
+private:
+    DownloadRateLimiter();
+
+    // Returns the current limit in bytes per second, 0 if unlimited. The
+    // user's activity only limits downloads that should yield to it.
+    size_t GetRate(bool yieldToUser) const;
+
+    // Updates the back-off state, at most once per sampling interval.
+    void UpdateBackoff(DWORD now);
+
+    // guards the variables below:
+    CriticalSection m_cs;
+
+    // available tokens, negative if a download is waiting for them
+    double m_tokens;
+    DWORD m_lastRefill;
+
+    // total bytes received by all downloads
+    unsigned long long m_received;
+
+    // back-off state: the received counters when last sampled and the
+    // lowered rate, 0 if not backing off
+    DWORD m_lastSample;
+    unsigned long long m_sampleReceived;
+    DWORD m_sampleTraffic;
+    size_t m_backoffRate;
+    size_t m_backoffFrom;
+
+    static DownloadRateLimiter ms_instance;
+};
+
+} // namespace winsparkle
+
+#endif // _ratelimiter_h_
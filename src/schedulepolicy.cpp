@@ -0,0 +1,424 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "schedulepolicy.h"
+
+#include <cstdlib>
+#include <algorithm>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// how long to wait before looking at the settings again if checks are
+// disabled (in seconds)
+const unsigned IDLE_RECHECK_INTERVAL = 60 * 60; // 1 hour
+
+// how long to wait before trying again after a check failed with a transient
+// error; the delay doubles with every further failure, up to the check
+// interval (in seconds)
+const unsigned FIRST_RETRY_DELAY = 5 * 60; // 5 minutes
+
+// longest delay requested by the server with Retry-After that is honored,
+// in case the server is misconfigured (in seconds)
+const unsigned MAX_RETRY_AFTER = 7 * 24 * 60 * 60; // 1 week
+
+// longest delay the timer is set for; when it fires, the time of the next
+// check is simply computed again (in seconds)
+const unsigned MAX_TIMER_DELAY = 24 * 60 * 60; // 1 day
+
+// shortest time between checks requested by the notification server, so
+// that announcements can't make the clients overwhelm the appcast server
+// (in seconds)
+const unsigned MIN_NOTIFIED_CHECK_INTERVAL = 5 * 60; // 5 minutes
+
+// how often to look at the power state while a download waits for AC power
+// (in seconds)
+const unsigned POWER_RECHECK_INTERVAL = 15 * 60; // 15 minutes
+
+// part at the end of maintenance windows where no downloads are started,
+// so that the timer's tolerance doesn't push them out of the window; half
+// of the window if it's shorter (in seconds)
+const time_t MAINTENANCE_WINDOW_MARGIN = 10 * 60; // 10 minutes
+
+// how long after a release are adaptive checks done as often as allowed,
+// to quickly find fixes that followed it (in seconds)
+const time_t RELEASE_FOLLOWUP_PERIOD = 3 * 24 * 60 * 60; // 3 days
+
+// fraction of the time since the last release used as the adaptive interval
+const unsigned ADAPTIVE_INTERVAL_DIVISOR = 4;
+
+// fraction of the typical time between releases used as the adaptive
+// interval when the next release is due
+const unsigned RELEASE_DUE_INTERVAL_DIVISOR = 10;
+
+// gaps between releases longer than this aren't taken fully into account,
+// so that one long pause doesn't skew the typical interval (in seconds)
+const time_t MAX_RELEASE_GAP = 180 * 24 * 60 * 60; // 180 days
+
+const unsigned MINUTES_PER_DAY = 24 * 60;
+
+// Parses time of day in the "h[h][:mm]" format, advancing @a p past it.
+bool ParseTimeOfDay(const char *& p, unsigned& minutes)
+{
+    if ( *p < '0' || *p > '9' )
+        return false;
+    char *end;
+    const unsigned long hours = strtoul(p, &end, 10);
+    unsigned long mins = 0;
+    if ( *end == ':' )
+    {
+        p = end + 1;
+        if ( *p < '0' || *p > '9' )
+            return false;
+        mins = strtoul(p, &end, 10);
+        if ( end - p != 2 )
+            return false;
+    }
+    p = end;
+
+    if ( hours > 24 || mins >= 60 || (hours == 24 && mins != 0) )
+        return false;
+    minutes = unsigned(hours * 60 + mins);
+    return true;
+}
+
+} // anonymous namespace
+
+
+bool ParseMaintenanceWindows(const std::string& spec, std::vector<MaintenanceWindow>& windows)
+{
+    windows.clear();
+
+    const char *p = spec.c_str();
+    for ( ;; )
+    {
+        while ( *p == ' ' || *p == '\t' )
+            p++;
+        if ( !*p && windows.empty() )
+            return true; // no windows at all
+
+        unsigned start, end;
+        if ( !ParseTimeOfDay(p, start) || *p++ != '-' || !ParseTimeOfDay(p, end) )
+            return false;
+
+        MaintenanceWindow window;
+        window.start = start % MINUTES_PER_DAY;
+        // a window ending when it starts lasts the whole day
+        window.length = (end + MINUTES_PER_DAY - window.start) % MINUTES_PER_DAY;
+        if ( window.length == 0 )
+            window.length = MINUTES_PER_DAY;
+        windows.push_back(window);
+
+        while ( *p == ' ' || *p == '\t' )
+            p++;
+        if ( !*p )
+            return true;
+        if ( *p++ != ',' )
+            return false;
+    }
+}
+
+
+/*--------------------------------------------------------------------------*
+                             SchedulePolicy
+ *--------------------------------------------------------------------------*/
+
+SchedulePolicy::SchedulePolicy(SchedulerClock& clock)
+    : m_clock(clock),
+      m_failedChecks(0),
+      m_retryTime(0),
+      m_serverRetryAfter(false),
+      m_checkRequested(false),
+      m_requestedCheckInProgress(false),
+      m_downloadDeferred(false)
+{
+}
+
+
+time_t SchedulePolicy::GetNextCheckTime(const ScheduleConfig& config, time_t lastCheck) const
+{
+    const time_t now = m_clock.Now();
+
+    // Only check for updates in reasonable intervals:
+    const time_t intervalEnd = m_checkRequested ? lastCheck + time_t(MIN_NOTIFIED_CHECK_INTERVAL)
+                                                : GetIntervalEnd(config, lastCheck);
+    time_t nextCheck = (std::max)(intervalEnd, m_retryTime);
+
+    // check again for the deferred download as soon as it can be done
+    if ( m_downloadDeferred && !config.savePower )
+        nextCheck = (std::min)(nextCheck, (std::max)(m_retryTime, now));
+
+    // if the check may download, it must wait for a maintenance window; the
+    // window instance must be found from the current time, not a past one
+    if ( config.checkInMaintenanceWindow )
+    {
+        return GetMaintenanceWindowTime(config.maintenanceWindows,
+                                        config.maintenanceWindowSlot,
+                                        (std::max)(nextCheck, now));
+    }
+
+    return nextCheck;
+}
+
+
+unsigned SchedulePolicy::GetTimerDelay(const ScheduleConfig& config, time_t lastCheck, bool& warmup)
+{
+    unsigned delay = IDLE_RECHECK_INTERVAL;
+
+    if ( config.checkEnabled )
+    {
+        const time_t currentTime = m_clock.Now();
+        const time_t nextCheck = GetNextCheckTime(config, lastCheck);
+        if ( nextCheck <= currentTime )
+            delay = 0;
+        else
+            delay = unsigned((std::min)(nextCheck - currentTime, time_t(MAX_TIMER_DELAY)));
+
+        // the moment within maintenance windows spreads the checks already,
+        // and the jitter could push them past the window's end
+        if ( !config.checkInMaintenanceWindow )
+            delay += m_clock.GetRandomNumber(config.jitter);
+
+        // there are no power notifications without a window, poll instead
+        if ( m_downloadDeferred )
+            delay = (std::min)(delay, POWER_RECHECK_INTERVAL);
+    }
+
+    // if the timer is for the check itself, fire a bit earlier to warm up
+    warmup = delay > WARMUP_LEAD_TIME && delay < MAX_TIMER_DELAY &&
+             config.checkEnabled && config.connectionWarmup;
+    if ( warmup )
+        delay -= WARMUP_LEAD_TIME;
+
+    return delay;
+}
+
+
+unsigned SchedulePolicy::GetCheckInterval(const ScheduleConfig& config) const
+{
+    return GetCheckIntervalAt(config, m_clock.Now());
+}
+
+
+unsigned SchedulePolicy::GetCheckIntervalAt(const ScheduleConfig& config, time_t when) const
+{
+    if ( !config.maxCheckInterval )
+        return config.checkInterval;
+
+    // without any history, use the usual interval
+    time_t interval = config.checkInterval;
+
+    if ( config.lastRelease && config.lastRelease <= when )
+    {
+        const time_t age = when - config.lastRelease;
+        const time_t cadence = config.releaseInterval;
+
+        interval = age / ADAPTIVE_INTERVAL_DIVISOR;
+        if ( cadence )
+        {
+            // The interval shrinks gradually as the release nears, rather
+            // than at once, which could make all of the fleet check at the
+            // same time: it always changes by less than the time passing.
+            const time_t untilDue = age < cadence ? cadence - age : age - cadence;
+            interval = (std::min)(interval, (std::max)(untilDue / 2, cadence / RELEASE_DUE_INTERVAL_DIVISOR));
+        }
+
+        if ( age < RELEASE_FOLLOWUP_PERIOD )
+            interval = 0;
+    }
+
+    interval = (std::max)(interval, time_t(config.minCheckInterval));
+    interval = (std::min)(interval, time_t(config.maxCheckInterval));
+    return (std::max)(unsigned(interval), config.feedCheckInterval);
+}
+
+
+time_t SchedulePolicy::GetIntervalEnd(const ScheduleConfig& config, time_t lastCheck) const
+{
+    const time_t now = m_clock.Now();
+    time_t end = lastCheck + time_t(GetCheckIntervalAt(config, now));
+    if ( !config.maxCheckInterval )
+        return end;
+
+    // The adaptive interval changes with time, so the check is due when the
+    // interval at that moment is over; the timers are set up to a day ahead,
+    // and deciding by the interval now would make all the clients whose
+    // interval ended meanwhile check at once when they fire. As the
+    // interval changes slower than the time passes, this converges quickly.
+    for ( int i = 0; i < 8 && end > now; i++ )
+        end = lastCheck + time_t(GetCheckIntervalAt(config, end));
+    return end;
+}
+
+
+bool SchedulePolicy::OnReleaseSeen(time_t published, time_t& lastRelease, unsigned& releaseInterval) const
+{
+    // dates in the future are wrong, or the clock is
+    published = (std::min)(published, m_clock.Now());
+    if ( published <= lastRelease )
+        return false;
+
+    if ( lastRelease )
+    {
+        const time_t gap = (std::min)(published - lastRelease, MAX_RELEASE_GAP);
+        // an average that follows changes of the cadence, but not a single odd gap
+        releaseInterval = releaseInterval ? unsigned((3 * time_t(releaseInterval) + gap) / 4)
+                                          : unsigned(gap);
+    }
+    lastRelease = published;
+    return true;
+}
+
+
+bool SchedulePolicy::CanDeferCheck(const ScheduleConfig& config, time_t lastCheck) const
+{
+    // the check is eventually done even if the network never gets better
+    return GetNextCheckTime(config, lastCheck) + time_t(GetCheckInterval(config)) > m_clock.Now();
+}
+
+
+bool SchedulePolicy::OnCheckStarted()
+{
+    m_downloadDeferred = false;
+    // announcements made during the check must cause another one
+    m_requestedCheckInProgress = m_checkRequested;
+    m_checkRequested = false;
+    return m_failedChecks != 0;
+}
+
+
+void SchedulePolicy::OnCheckSucceeded()
+{
+    m_failedChecks = 0;
+    m_retryTime = 0;
+}
+
+
+void SchedulePolicy::OnCheckFailed(const ScheduleConfig& config, bool transient, int retryAfter)
+{
+    m_checkRequested = m_checkRequested || m_requestedCheckInProgress;
+
+    const unsigned interval = GetCheckInterval(config);
+    unsigned delay = interval;
+
+    if ( transient )
+    {
+        // Exponential backoff, randomized so that clients that failed at the
+        // same time (e.g. during an outage) don't all retry at the same time
+        // too. Only a half of the delay is random, to keep it increasing.
+        m_failedChecks++;
+        delay = FIRST_RETRY_DELAY << (std::min)(m_failedChecks - 1, 20u);
+        delay = (std::min)(delay, interval);
+        delay = delay / 2 + m_clock.GetRandomNumber(delay - delay / 2);
+    }
+
+    m_serverRetryAfter = retryAfter > 0;
+    if ( m_serverRetryAfter )
+        delay = (std::max)(delay, (std::min)(unsigned(retryAfter), MAX_RETRY_AFTER));
+
+    m_retryTime = m_clock.Now() + delay;
+}
+
+
+void SchedulePolicy::OnNetworkChanged()
+{
+    // a failure while offline says nothing about the server, so there's no
+    // need to back off
+    if ( !m_serverRetryAfter )
+        m_retryTime = 0;
+}
+
+
+void SchedulePolicy::Reset()
+{
+    m_checkRequested = false;
+    m_downloadDeferred = false;
+}
+
+
+bool SchedulePolicy::IsInMaintenanceWindow(const std::vector<MaintenanceWindow>& windows) const
+{
+    if ( windows.empty() )
+        return true;
+
+    const time_t now = m_clock.Now();
+
+    // the window may have started on the previous day
+    for ( int day = -1; day <= 0; day++ )
+    {
+        const time_t midnight = m_clock.GetLocalMidnight(now, day);
+        for ( size_t i = 0; i < windows.size(); i++ )
+        {
+            const time_t start = windows[i].GetStart(midnight);
+            if ( now >= start && now < start + windows[i].GetLength() )
+                return true;
+        }
+    }
+
+    return false;
+}
+
+
+time_t SchedulePolicy::GetMaintenanceWindowTime(const std::vector<MaintenanceWindow>& windows,
+                                                unsigned slot, time_t due) const
+{
+    if ( windows.empty() )
+        return due;
+
+    // Windows last a day at most, so one starting on the next day always
+    // ends after @a due, and one from the previous day may still be open.
+    time_t best = 0;
+    for ( int day = -1; day <= 1; day++ )
+    {
+        const time_t midnight = m_clock.GetLocalMidnight(due, day);
+        for ( size_t i = 0; i < windows.size(); i++ )
+        {
+            const time_t start = windows[i].GetStart(midnight);
+            const time_t length = windows[i].GetLength();
+            if ( due >= start + length )
+                continue;
+
+            const time_t spread = length - (std::min)(MAINTENANCE_WINDOW_MARGIN, length / 2);
+            const time_t slotTime = start + spread * time_t(slot) / time_t(MAINTENANCE_WINDOW_SLOTS);
+
+            // downloads that become due during the window after this
+            // installation's moment start right away
+            const time_t candidate = (std::max)(due, slotTime);
+            if ( best == 0 || candidate < best )
+                best = candidate;
+        }
+    }
+
+    return best;
+}
+
+} // namespace winsparkle
@@ -0,0 +1,262 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _schedulepolicy_h_
+#define _schedulepolicy_h_
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace winsparkle
+{
+
+/**
+    Source of time and randomness for SchedulePolicy.
+
+    UpdateScheduler uses the system clock; a simulation can use a virtual
+    clock instead and run the same policy for many clients quickly and
+    reproducibly.
+ */
+class SchedulerClock
+{
+public:
+    virtual ~SchedulerClock() {}
+
+    /// Returns the current time.
+    virtual time_t Now() const = 0;
+
+    /// Returns the local midnight @a days days after the one starting the
+    /// day of @a time.
+    virtual time_t GetLocalMidnight(time_t time, int days) const = 0;
+
+    /// Returns a random number between 0 and @a max, inclusive.
+    virtual unsigned GetRandomNumber(unsigned max) = 0;
+};
+
+
+/// Daily period of local time, see win_sparkle_set_maintenance_windows().
+struct MaintenanceWindow
+{
+    unsigned start;  // minutes since midnight
+    unsigned length; // in minutes, a whole day at most
+
+    // Returns the time the window instance that started on the local day
+    // beginning at @a midnight starts.
+    time_t GetStart(time_t midnight) const { return midnight + time_t(start) * 60; }
+
+    // Returns the window's length in seconds.
+    time_t GetLength() const { return time_t(length) * 60; }
+};
+
+/**
+    Parses the maintenance windows, see win_sparkle_set_maintenance_windows().
+
+    @return false if @a spec is invalid.
+ */
+bool ParseMaintenanceWindows(const std::string& spec, std::vector<MaintenanceWindow>& windows);
+
+
+/// Settings the schedule depends on, see SchedulePolicy.
+struct ScheduleConfig
+{
+    ScheduleConfig()
+        : checkEnabled(false), checkInterval(0),
+          minCheckInterval(0), maxCheckInterval(0), feedCheckInterval(0),
+          lastRelease(0), releaseInterval(0), jitter(0),
+          connectionWarmup(false), checkInMaintenanceWindow(false),
+          maintenanceWindowSlot(0), savePower(false) {}
+
+    /// Are periodic checks enabled at all?
+    bool checkEnabled;
+    /// Interval between checks in seconds, including the feed's minimum.
+    unsigned checkInterval;
+    /// Shortest and longest interval between adaptive checks in seconds,
+    /// see SchedulePolicy::GetCheckInterval(); 0 if checks aren't adaptive.
+    unsigned minCheckInterval, maxCheckInterval;
+    /// Interval the appcast feed asks for at least, in seconds, 0 if none.
+    unsigned feedCheckInterval;
+    /// When the newest release known was published, 0 if not known.
+    time_t lastRelease;
+    /// Typical time between releases in seconds, 0 if not known.
+    unsigned releaseInterval;
+    /// Largest random delay added to each check, in seconds.
+    unsigned jitter;
+    /// Should connections be opened shortly before checks?
+    bool connectionWarmup;
+    /// Are checks moved into maintenance windows, because they may download?
+    bool checkInMaintenanceWindow;
+    /// The maintenance windows, empty if there are none.
+    std::vector<MaintenanceWindow> maintenanceWindows;
+    /// This installation's moment within the windows, see
+    /// SchedulePolicy::MAINTENANCE_WINDOW_SLOTS.
+    unsigned maintenanceWindowSlot;
+    /// Should background downloads wait to save power?
+    bool savePower;
+};
+
+
+/**
+    Decides when periodic update checks are done.
+
+    This is the platform-independent part of UpdateScheduler: the jitter,
+    the backoff after failures, the minimal interval between checks
+    requested by the notification server, the retries of downloads deferred
+    to save power and the maintenance windows. It doesn't read any settings,
+    set timers or lock anything; the caller provides ScheduleConfig and
+    serializes the calls.
+ */
+class SchedulePolicy
+{
+public:
+    /// How long before a check connections are warmed up, in seconds.
+    static const unsigned WARMUP_LEAD_TIME = 5;
+
+    /// Number of moments within maintenance windows installations are
+    /// randomly spread over.
+    static const unsigned MAINTENANCE_WINDOW_SLOTS = 1000;
+
+    SchedulePolicy(SchedulerClock& clock);
+
+    /**
+        Returns the time when the next check is due, which may be in the
+        past.
+
+        @param lastCheck  Time of the last successful check, 0 if none.
+     */
+    time_t GetNextCheckTime(const ScheduleConfig& config, time_t lastCheck) const;
+
+    /// Is a check due now?
+    bool IsCheckDue(const ScheduleConfig& config, time_t lastCheck) const
+        { return GetNextCheckTime(config, lastCheck) <= m_clock.Now(); }
+
+    /**
+        Returns the delay, in seconds, until the timer should fire next.
+
+        The timer may fire before the check is due, e.g. when its delay is
+        limited so that changed settings are noticed; it's then just set
+        again.
+
+        @param warmup  Set to whether the timer fires WARMUP_LEAD_TIME
+                       seconds before the check, to warm up connections.
+     */
+    unsigned GetTimerDelay(const ScheduleConfig& config, time_t lastCheck, bool& warmup);
+
+    /**
+        Returns the interval between checks in seconds.
+
+        That's ScheduleConfig::checkInterval, unless the checks are adaptive
+        (see win_sparkle_set_adaptive_check_interval()): then it depends on
+        the release history, between the minimum and maximum interval.
+        Checks are done often shortly after a release, as fixes tend to
+        follow it, and when the next release is due judging by the typical
+        time between releases. Otherwise they're done the less often the
+        longer it's been quiet. The appcast feed's minimum is honored in
+        any case.
+     */
+    unsigned GetCheckInterval(const ScheduleConfig& config) const;
+
+    /**
+        Updates the release history with a release published at @a published,
+        as found by a check.
+
+        @param lastRelease      The newest release known, updated if this
+                                one is newer.
+        @param releaseInterval  The typical time between releases, updated
+                                with the time since @a lastRelease.
+
+        @return false if the release was known already.
+     */
+    bool OnReleaseSeen(time_t published, time_t& lastRelease, unsigned& releaseInterval) const;
+
+    /**
+        May a due check be deferred until the network connection changes?
+
+        It may for up to one check interval after it became due.
+     */
+    bool CanDeferCheck(const ScheduleConfig& config, time_t lastCheck) const;
+
+    /// Call when a check is started; returns whether it's a retry.
+    bool OnCheckStarted();
+
+    /// Call when a check succeeded.
+    void OnCheckSucceeded();
+
+    /// Call when a check failed, see UpdateScheduler::OnCheckFailed().
+    void OnCheckFailed(const ScheduleConfig& config, bool transient, int retryAfter);
+
+    /// Call when the computer connected to a network.
+    void OnNetworkChanged();
+
+    /// Call when the notification server announced a release.
+    void OnUpdatePublished() { m_checkRequested = true; }
+
+    /// Call when a check deferred downloading the update to save power.
+    void OnDownloadDeferred() { m_downloadDeferred = true; }
+
+    /// Did the last check defer downloading the update?
+    bool IsDownloadDeferred() const { return m_downloadDeferred; }
+
+    /// Forgets the requested and deferred checks when scheduling stops.
+    void Reset();
+
+    /// Is a maintenance window open now? True if there are none.
+    bool IsInMaintenanceWindow(const std::vector<MaintenanceWindow>& windows) const;
+
+    /// See UpdateScheduler::GetMaintenanceWindowTime().
+    time_t GetMaintenanceWindowTime(const std::vector<MaintenanceWindow>& windows,
+                                    unsigned slot, time_t due) const;
+
+private:
+    // Returns the interval between checks done at @a when.
+    unsigned GetCheckIntervalAt(const ScheduleConfig& config, time_t when) const;
+
+    // Returns when the interval between checks since @a lastCheck is over.
+    time_t GetIntervalEnd(const ScheduleConfig& config, time_t lastCheck) const;
+
+    SchedulerClock& m_clock;
+
+    // number of checks that failed in a row with a transient error
+    unsigned m_failedChecks;
+
+    // time before which no check should be done after a failure, 0 if none
+    time_t m_retryTime;
+
+    // was m_retryTime requested by the server with Retry-After?
+    bool m_serverRetryAfter;
+
+    // did the notification server announce a release that wasn't checked for yet?
+    bool m_checkRequested;
+
+    // was the check in progress requested by the notification server?
+    bool m_requestedCheckInProgress;
+
+    // did the last check defer downloading the update until on AC power?
+    bool m_downloadDeferred;
+};
+
+} // namespace winsparkle
+
+#endif // _schedulepolicy_h_
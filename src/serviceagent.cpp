@@ -0,0 +1,534 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "serviceagent.h"
+#include "allocstats.h"
+#include "appcast.h"
+#include "error.h"
+#include "hashengine.h"
+#include "settings.h"
+#include "updatechecker.h"
+#include "updatedownloader.h"
+#include "updatescheduler.h"
+#include "winsparkle.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <time.h>
+
+#include <windows.h>
+#include <aclapi.h>
+#include <sddl.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+    #define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+// How long to wait for a busy agent, and for either side of the pipe to
+// send or receive data (in milliseconds)
+const DWORD PIPE_TIMEOUT = 5000;
+
+// Size of the pipe's buffers and of the chunks the feed is sent in.
+const DWORD PIPE_BUFFER_SIZE = 64 * 1024;
+
+// Largest feed accepted from the agent if the app doesn't set a limit, see
+// Settings::GetMaxAppcastSize().
+const size_t MAX_PIPE_FEED_SIZE = 64 * 1024 * 1024;
+
+// ...and the largest feed signature, which is just a short base64 string.
+const size_t MAX_PIPE_SIGNATURE_SIZE = 1024;
+
+// How soon a failed check is retried (in seconds)
+const int CHECK_RETRY_INTERVAL = 60 * 60;
+
+// The pipe can be used by the system and administrators, other local users
+// can only read the feed from it.
+const wchar_t PIPE_SDDL[] = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GR;;;AU)";
+
+// The running agent, see ServiceAgent::StartAgent()
+CriticalSection g_csAgent;
+ServiceAgent *g_agent = NULL;
+
+// Returns the name of the agent's pipe, which is different for every app
+// using WinSparkle.
+std::wstring GetPipeName()
+{
+    static const wchar_t digits[] = L"0123456789abcdef";
+
+    const std::string app = Settings::GetRegistryPath();
+    const std::string appHash = HashEngine::HashData(Hash_SHA1, app.data(), app.size());
+
+    std::wstring name(L"\\\\.\\pipe\\WinSparkle-");
+    for ( size_t i = 0; i < 8; i++ )
+    {
+        const unsigned char c = static_cast<unsigned char>(appHash[i]);
+        name += digits[c >> 4];
+        name += digits[c & 0xF];
+    }
+    return name;
+}
+
+// Closes the handle when it goes out of scope.
+struct HandleCloser
+{
+    explicit HandleCloser(HANDLE h) : handle(h) {}
+    ~HandleCloser() { CloseHandle(handle); }
+    HANDLE handle;
+};
+
+// Is the pipe owned by the system or the administrators, i.e. is it really
+// the agent's? Objects created by services are owned by the administrators.
+bool IsOwnedBySystem(HANDLE pipe)
+{
+    PSID owner = NULL;
+    PSECURITY_DESCRIPTOR sd = NULL;
+    if ( GetSecurityInfo(pipe, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION,
+                         &owner, NULL, NULL, NULL, &sd) != ERROR_SUCCESS )
+        return false;
+
+    const bool trusted = owner &&
+                         (IsWellKnownSid(owner, WinLocalSystemSid) ||
+                          IsWellKnownSid(owner, WinBuiltinAdministratorsSid));
+    LocalFree(sd);
+    return trusted;
+}
+
+void AppendUInt32(std::string& data, unsigned value)
+{
+    for ( int i = 0; i < 4; i++ )
+        data += char((value >> (8 * i)) & 0xFF);
+}
+
+bool ReadUInt32(const std::string& data, size_t& pos, unsigned& value)
+{
+    if ( data.size() - pos < 4 )
+        return false;
+    value = 0;
+    for ( int i = 0; i < 4; i++ )
+        value |= unsigned((unsigned char)data[pos + i]) << (8 * i);
+    pos += 4;
+    return true;
+}
+
+bool ReadString(const std::string& data, size_t& pos, std::string& value)
+{
+    unsigned len;
+    if ( !ReadUInt32(data, pos, len) || data.size() - pos < len )
+        return false;
+    value.assign(data, pos, len);
+    pos += len;
+    return true;
+}
+
+// The agent's response: the feed's signature and the feed itself, each as
+// 32-bit length followed by the data. Both are empty if the agent didn't
+// download the feed yet.
+std::string MakeResponse(const std::string& feed, const std::string& signature)
+{
+    std::string response;
+    response.reserve(8 + signature.size() + feed.size());
+    AppendUInt32(response, unsigned(signature.size()));
+    response += signature;
+    AppendUInt32(response, unsigned(feed.size()));
+    response += feed;
+    return response;
+}
+
+// Parses the agent's response, returns false if it isn't complete yet.
+bool ParseResponse(const std::string& response, std::string& feed, std::string& signature)
+{
+    size_t pos = 0;
+    return ReadString(response, pos, signature) &&
+           ReadString(response, pos, feed);
+}
+
+/**
+    Overlapped I/O on a pipe.
+
+    The operations are waited for with the thread's cancellation token and
+    time out, so that neither side of the pipe can block the other one. An
+    operation that didn't finish is cancelled.
+ */
+class PipeIO
+{
+public:
+    PipeIO(HANDLE pipe, Thread& thread)
+        : m_pipe(pipe), m_thread(thread), m_event(true), m_pending(false)
+    {
+    }
+
+    ~PipeIO() { Cancel(); }
+
+    // Waits up to @a timeout ms for a client to connect to the server end
+    // of the pipe. Returns false if none did.
+    bool Connect(DWORD timeout)
+    {
+        Prepare();
+        if ( !ConnectNamedPipe(m_pipe, &m_ov) )
+        {
+            switch ( GetLastError() )
+            {
+                case ERROR_PIPE_CONNECTED:
+                    return true;
+                case ERROR_IO_PENDING:
+                    m_pending = true;
+                    break;
+                case ERROR_NO_DATA:
+                    // the client gave up already
+                    DisconnectNamedPipe(m_pipe);
+                    return false;
+                default:
+                    throw Win32Exception("Cannot wait for clients of the service agent");
+            }
+        }
+        else
+        {
+            m_pending = true;
+        }
+
+        DWORD transferred;
+        return Finish(timeout, transferred);
+    }
+
+    // Writes all of @a data, returns false if it couldn't be done in time.
+    bool Write(const std::string& data)
+    {
+        size_t pos = 0;
+        while ( pos < data.size() )
+        {
+            const DWORD len = DWORD((std::min)(data.size() - pos, size_t(PIPE_BUFFER_SIZE)));
+            Prepare();
+            if ( !Issue(WriteFile(m_pipe, data.data() + pos, len, NULL, &m_ov)) )
+                return false;
+            DWORD written;
+            if ( !Finish(PIPE_TIMEOUT, written) )
+                return false;
+            pos += written;
+        }
+        return true;
+    }
+
+    // Reads up to @a len bytes into @a buffer, returns false at the end of
+    // the data, on error or if nothing came in time.
+    bool Read(void *buffer, DWORD len, DWORD& read)
+    {
+        read = 0;
+        Prepare();
+        if ( !Issue(ReadFile(m_pipe, buffer, len, NULL, &m_ov)) )
+            return false;
+        return Finish(PIPE_TIMEOUT, read) && read > 0;
+    }
+
+private:
+    void Prepare()
+    {
+        ZeroMemory(&m_ov, sizeof(m_ov));
+        m_ov.hEvent = m_event.GetHandle();
+    }
+
+    // Checks the result of starting an operation.
+    bool Issue(BOOL started)
+    {
+        if ( !started && GetLastError() != ERROR_IO_PENDING )
+            return false;
+        m_pending = true;
+        return true;
+    }
+
+    // Waits for the operation to finish, returns false if it failed or
+    // didn't finish in time.
+    bool Finish(DWORD timeout, DWORD& transferred)
+    {
+        if ( !m_thread.GetCancellationToken().Wait(m_ov.hEvent, timeout) )
+        {
+            Cancel();
+            return false;
+        }
+        m_pending = false;
+        return GetOverlappedResult(m_pipe, &m_ov, &transferred, FALSE) != 0;
+    }
+
+    void Cancel()
+    {
+        if ( !m_pending )
+            return;
+        // the operation must be over before m_ov goes away
+        CancelIo(m_pipe);
+        DWORD transferred;
+        GetOverlappedResult(m_pipe, &m_ov, &transferred, TRUE);
+        m_pending = false;
+    }
+
+    HANDLE m_pipe;
+    Thread& m_thread;
+    Event m_event;
+    OVERLAPPED m_ov;
+    bool m_pending;
+};
+
+// Creates the server end of the agent's pipe.
+HANDLE CreateAgentPipe()
+{
+    PSECURITY_DESCRIPTOR sd = NULL;
+    if ( !ConvertStringSecurityDescriptorToSecurityDescriptorW(PIPE_SDDL, SDDL_REVISION_1, &sd, NULL) )
+        throw Win32Exception("Cannot create service agent pipe");
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), sd, FALSE };
+
+    // Only one client is served at a time, the others wait for a moment.
+    // Creating the first instance fails if someone else created the pipe.
+    const std::wstring name = GetPipeName();
+    const DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE;
+    const DWORD pipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
+    HANDLE pipe = CreateNamedPipeW(name.c_str(), openMode, pipeMode | PIPE_REJECT_REMOTE_CLIENTS,
+                                   1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, &sa);
+    if ( pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_INVALID_PARAMETER )
+    {
+        // PIPE_REJECT_REMOTE_CLIENTS is only known since Vista; the pipe
+        // still can't be used remotely without network logon rights
+        pipe = CreateNamedPipeW(name.c_str(), openMode, pipeMode,
+                                1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, &sa);
+    }
+    const DWORD err = GetLastError();
+    LocalFree(sd);
+
+    if ( pipe == INVALID_HANDLE_VALUE )
+    {
+        SetLastError(err);
+        throw Win32Exception("Cannot create service agent pipe");
+    }
+    return pipe;
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                 the agent
+ *--------------------------------------------------------------------------*/
+
+ServiceAgent::ServiceAgent()
+    : Thread("WinSparkle service agent", true),
+      m_feedCheckInterval(0)
+{
+}
+
+
+void ServiceAgent::Run()
+{
+    // no initialization to do, so signal readiness immediately
+    SignalReady();
+
+    HANDLE pipe;
+    try
+    {
+        pipe = CreateAgentPipe();
+    }
+    catch ( std::exception& e )
+    {
+        LogError(e.what());
+        return;
+    }
+    HandleCloser closePipe(pipe);
+
+    time_t nextCheck = 0;
+    for ( ;; )
+    {
+        const time_t now = time(NULL);
+        if ( now >= nextCheck )
+        {
+            bool checked = false;
+            try
+            {
+                CheckForUpdates();
+                checked = true;
+            }
+            catch ( std::exception& e )
+            {
+                LogError(e.what());
+            }
+
+            // the feed may ask for checking less often, like UpdateScheduler
+            const int interval = (std::max)(win_sparkle_get_update_check_interval(), m_feedCheckInterval);
+            nextCheck = time(NULL) + (checked ? interval : (std::min)(interval, CHECK_RETRY_INTERVAL));
+
+            // the check pre-downloads updates, so it must wait for a
+            // maintenance window, if any
+            try
+            {
+                nextCheck = UpdateScheduler::GetMaintenanceWindowTime(nextCheck);
+            }
+            catch ( std::exception& e )
+            {
+                LogError(e.what());
+            }
+        }
+
+        // wake up at least once an hour, in case the clock was changed
+        const time_t wait = (std::min)(nextCheck - time(NULL), time_t(60 * 60));
+        ServeClient(pipe, wait > 0 ? DWORD(wait * 1000) : 0);
+    }
+}
+
+
+void ServiceAgent::CheckForUpdates()
+{
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_CHECK);
+    std::string feed, signature;
+    UpdateChecker::DownloadFeed(*this, feed, signature);
+
+    // the users' instances select the update for themselves, this only
+    // tells if there's any to prepare for them
+    const Appcast appcast = Appcast::Load(feed, Settings::GetAppBuildVersionUTF8(),
+                                          Settings::GetUpdateChannels());
+    m_feed.swap(feed);
+    m_signature.swap(signature);
+    m_feedCheckInterval = appcast.GetCheckInterval();
+
+    // This puts the update into the shared cache, where the users' instances
+    // find it when they download it.
+    if ( appcast.IsValid() && appcast.HasDownload() &&
+         Settings::GetAppBuildVersionKey() < VersionKey(appcast.Version) &&
+         UpdateScheduler::IsInMaintenanceWindow() && !UpdateScheduler::ShouldSavePower() )
+    {
+        UpdateDownloader::PreDownload(appcast, *this);
+    }
+}
+
+
+void ServiceAgent::ServeClient(HANDLE pipe, DWORD timeout)
+{
+    PipeIO io(pipe, *this);
+    if ( !io.Connect(timeout) )
+        return;
+
+    if ( io.Write(MakeResponse(m_feed, m_signature)) )
+    {
+        // Wait for the client to read it all and close its end, the data it
+        // didn't read yet would be thrown away by disconnecting.
+        char c;
+        DWORD read;
+        io.Read(&c, 1, read);
+    }
+    DisconnectNamedPipe(pipe);
+}
+
+
+/*static*/
+void ServiceAgent::StartAgent()
+{
+    CriticalSectionLocker lock(g_csAgent);
+    if ( g_agent )
+        return;
+
+    // the users' instances get the updates from there
+    Settings::SetSharedUpdateCache(true);
+
+    std::unique_ptr<ServiceAgent> agent(new ServiceAgent);
+    agent->Start();
+    g_agent = agent.release();
+}
+
+
+/*static*/
+void ServiceAgent::StopAgent()
+{
+    ServiceAgent *agent;
+    {
+        CriticalSectionLocker lock(g_csAgent);
+        agent = g_agent;
+        g_agent = NULL;
+    }
+    if ( !agent )
+        return;
+
+    agent->TerminateAndJoin();
+    delete agent;
+}
+
+
+/*--------------------------------------------------------------------------*
+                               the clients
+ *--------------------------------------------------------------------------*/
+
+/*static*/
+bool ServiceAgent::FetchFeed(Thread& onThread, std::string& feed, std::string& signature)
+{
+    const std::wstring name = GetPipeName();
+    HANDLE pipe = CreateFileW(name.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING,
+                              FILE_FLAG_OVERLAPPED, NULL);
+    if ( pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY )
+    {
+        // serving another client, which doesn't take long
+        if ( WaitNamedPipeW(name.c_str(), PIPE_TIMEOUT) )
+        {
+            pipe = CreateFileW(name.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING,
+                               FILE_FLAG_OVERLAPPED, NULL);
+        }
+    }
+    if ( pipe == INVALID_HANDLE_VALUE )
+        return false; // not running, or busy checking
+    HandleCloser closePipe(pipe);
+
+    if ( !IsOwnedBySystem(pipe) )
+    {
+        LogError("Ignoring service agent pipe not created by the system.");
+        return false;
+    }
+
+    const size_t maxFeedSize = Settings::GetMaxAppcastSize() ? Settings::GetMaxAppcastSize()
+                                                             : MAX_PIPE_FEED_SIZE;
+    std::string response;
+    std::vector<char> buffer(PIPE_BUFFER_SIZE);
+    PipeIO io(pipe, onThread);
+    for ( ;; )
+    {
+        DWORD read;
+        if ( !io.Read(&buffer[0], DWORD(buffer.size()), read) )
+            return false;
+        response.append(&buffer[0], read);
+        if ( ParseResponse(response, feed, signature) )
+            break;
+        if ( response.size() > maxFeedSize + MAX_PIPE_SIGNATURE_SIZE )
+        {
+            LogError("Service agent sent too large appcast feed.");
+            return false;
+        }
+    }
+
+    return !feed.empty();
+}
+
+} // namespace winsparkle
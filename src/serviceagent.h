@@ -0,0 +1,97 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _serviceagent_h_
+#define _serviceagent_h_
+
+#include "threads.h"
+
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Checks for updates on behalf of all users of the computer, see
+    win_sparkle_start_service_agent().
+
+    The agent runs in the application's Windows service. It checks the
+    appcast feed periodically, pre-downloads the update into the cache
+    shared by all users (see UpdateCache::StoreShared()) and hands the
+    feed out to the instances of the application running in the users'
+    sessions over a named pipe, see FetchFeed(). They then only do what's
+    specific to the user: decide if the update is offered, and install it.
+
+    The feed and the update files are verified again by every user, the
+    agent only saves them the network traffic.
+ */
+class ServiceAgent : public Thread
+{
+public:
+    /// Starts the agent, does nothing if it's running already. Throws on error.
+    static void StartAgent();
+
+    /// Stops the agent, if it's running.
+    static void StopAgent();
+
+    /**
+        Gets the feed the agent downloaded last, if it is running.
+
+        The agent's pipe must be owned by the system (or administrators),
+        so that other users can't pose as the agent.
+
+        @param onThread   Thread doing this, for cancellation.
+        @param feed       Receives the feed's data.
+        @param signature  Receives the feed's detached signature, empty if
+                          the feed isn't signed.
+
+        @return true if the feed was received, false if the agent isn't
+                running or hasn't checked for updates yet.
+     */
+    static bool FetchFeed(Thread& onThread, std::string& feed, std::string& signature);
+
+protected:
+    ServiceAgent();
+
+    virtual void Run();
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    // Checks the feed and pre-downloads the update, if there is one.
+    void CheckForUpdates();
+
+    // Waits up to @a timeout ms for a client and sends it the feed.
+    void ServeClient(HANDLE pipe, DWORD timeout);
+
+    // the feed handed out to the clients, with its signature
+    std::string m_feed, m_signature;
+
+    // interval between checks asked for by the feed, in seconds, 0 if none
+    int m_feedCheckInterval;
+};
+
+} // namespace winsparkle
+
+#endif // _serviceagent_h_
@@ -26,23 +26,83 @@
 #include "settings.h"
 
 #include "error.h"
+#include "jsonreader.h"
 #include "utils.h"
 #include "threads.h"
 #include "signatureverifier.h"
+#include "settingsstore.h"
+
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+
+#ifndef REG_NOTIFY_THREAD_AGNOSTIC
+    #define REG_NOTIFY_THREAD_AGNOSTIC 0x10000000L
+#endif
 
 
 namespace winsparkle
 {
 
-CriticalSection Settings::ms_csVars;
+ReadWriteLock Settings::ms_lockVars("settings variables");
 Settings::Lang Settings::ms_lang;
 std::string  Settings::ms_appcastURL;
+std::string  Settings::ms_appcastSignatureURL;
+std::string  Settings::ms_appcastFallbackURLs;
+std::vector<Settings::AdditionalFeed> Settings::ms_additionalFeeds;
+std::string  Settings::ms_updateChannels;
+std::string  Settings::ms_latestVersionURL;
+std::string  Settings::ms_updateNotificationURL;
+std::wstring Settings::ms_stagingDirectory;
+size_t       Settings::ms_maxAppcastSize = 16 * 1024 * 1024;
+bool         Settings::ms_appcastFilterHints = false;
 std::string  Settings::ms_registryPath;
 std::wstring Settings::ms_companyName;
 std::wstring Settings::ms_appName;
 std::wstring Settings::ms_appVersion;
 std::wstring Settings::ms_appBuildVersion;
-std::string Settings::ms_DSAPubKey;
+std::string Settings::ms_appBuildVersionUTF8;
+VersionKey Settings::ms_appBuildVersionKey;
+bool Settings::ms_hasAppBuildVersionKey = false;
+std::shared_ptr<const DSAPublicKey> Settings::ms_DSAPubKey;
+bool Settings::ms_DSAPubKeyLoaded = false;
+std::shared_ptr<const Ed25519PublicKey> Settings::ms_EdDSAPubKey;
+bool Settings::ms_EdDSAPubKeyLoaded = false;
+bool Settings::ms_configManifestLoaded = false;
+bool Settings::ms_authenticodeCheck = false;
+Settings::HttpBackend Settings::ms_httpBackend = Settings::HttpBackend_WinINet;
+int Settings::ms_httpMaxConnections = 4;
+Settings::RevocationCheck Settings::ms_revocationCheck = Settings::RevocationCheck_Default;
+bool Settings::ms_preDownloadUpdates = false;
+bool Settings::ms_installOnExit = false;
+bool Settings::ms_BITSDownload = false;
+bool Settings::ms_lowPriorityDownloads = false;
+bool Settings::ms_powerAwareDownloads = true;
+bool Settings::ms_idleAwareDownloads = true;
+unsigned Settings::ms_meteredDownloadBudget = 0;
+std::wstring Settings::ms_httpRecordingDirectory;
+std::wstring Settings::ms_httpReplayDirectory;
+int Settings::ms_httpReplayTimeScale = 100;
+std::string Settings::ms_telemetryURL;
+bool Settings::ms_peerCaching = false;
+bool Settings::ms_deliveryOptimization = false;
+bool Settings::ms_sharedUpdateCache = false;
+bool Settings::ms_useServiceAgent = false;
+size_t Settings::ms_maxDownloadRate = 0;
+size_t Settings::ms_temporaryStagingLimit = 64 * 1024 * 1024;
+bool Settings::ms_downloadBackoff = false;
+int Settings::ms_updateCheckJitter = 5 * 60;
+int Settings::ms_minAdaptiveCheckInterval = 0;
+int Settings::ms_maxAdaptiveCheckInterval = 0;
+int Settings::ms_updateCheckTolerance = 60;
+std::string Settings::ms_maintenanceWindows;
+bool Settings::ms_connectionWarmup = false;
+int Settings::ms_shutdownTimeout = 5000;
+bool Settings::ms_headlessMode = false;
+bool Settings::ms_uiOnHostThread = false;
+int Settings::ms_uiIdleTimeout = 0;
+void *Settings::ms_hostWindow = NULL;
+bool Settings::ms_deferredInit = false;
 
 
 /*--------------------------------------------------------------------------*
@@ -54,72 +114,129 @@ namespace
 
 struct TranslationInfo
 {
-    WORD wLanguage;
-    WORD wCodePage;
+    WORD language;
+    WORD codepage;
 };
 
-// return language code for the resource to query
-std::wstring GetVerInfoLang(void *fi)
+// Picks the translation of VERSIONINFO strings to use:
+//   1. one in the user's UI language
+//   2. failing that, one in a different variant of the same language
+//   3. language-neutral or English one
+//   4. the first one as fallback
+size_t ChooseTranslation(const TranslationInfo *translations, size_t count)
 {
-    struct TranslationInfo
+    const LANGID uiLang = GetUserDefaultUILanguage();
+
+    for ( size_t i = 0; i < count; i++ )
     {
-        WORD language;
-        WORD codepage;
-    } *translations;
-    unsigned translationsCnt;
+        if ( translations[i].language == uiLang )
+            return i;
+    }
 
-    if ( !VerQueryValue(fi, TEXT("\\VarFileInfo\\Translation"),
-                        (LPVOID*)&translations, &translationsCnt) )
-        throw Win32Exception("Executable doesn't have required VERSIONINFO\\VarFileInfo resource");
+    for ( size_t i = 0; i < count; i++ )
+    {
+        if ( PRIMARYLANGID(translations[i].language) == PRIMARYLANGID(uiLang) )
+            return i;
+    }
 
-    translationsCnt /= sizeof(struct TranslationInfo);
-    if ( translationsCnt == 0 )
-        throw std::runtime_error("No translations in VarFileInfo resource?");
+    for ( size_t i = 0; i < count; i++ )
+    {
+        const WORD primary = PRIMARYLANGID(translations[i].language);
+        if ( primary == LANG_NEUTRAL || primary == LANG_ENGLISH )
+            return i;
+    }
 
-    // TODO: be smarter about which language to use:
-    //       1. use app main thread's locale
-    //       2. failing that, try language-neutral or English
-    //       3. use the first one as fallback
-    const size_t idx = 0;
+    return 0;
+}
 
-    wchar_t lang[9];
-    HRESULT hr = _snwprintf_s(lang, 9, 8,
-                              L"%04x%04x",
-                              translations[idx].language,
-                              translations[idx].codepage);
-    if ( FAILED(hr) )
-        throw Win32Exception();
 
-    return lang;
-}
+// VERSIONINFO resource of the executable. It's read from the file only
+// once, the fields are then looked up in memory.
+class ExeVersionInfo
+{
+public:
+    ExeVersionInfo() : m_loaded(false) {}
 
-} // anonymous namespace
+    // Gets value of given StringFileInfo field. Returns false if there's
+    // no such field. Throws if the resource cannot be loaded.
+    bool GetField(const wchar_t *field, std::wstring& value)
+    {
+        CriticalSectionLocker lock(m_cs);
 
+        if ( !m_loaded )
+            Load();
 
-std::wstring Settings::DoGetVerInfoField(const wchar_t *field, bool fatal)
-{
-    TCHAR exeFilename[MAX_PATH + 1];
+        const std::wstring key = m_prefix + field;
+        LPTSTR key_str = (LPTSTR)key.c_str(); // explicit cast to work around VC2005 bug
+
+        TCHAR *str;
+        UINT len;
+        if ( !VerQueryValue(&m_data[0], key_str, (LPVOID*)&str, &len) )
+            return false;
+
+        value = str;
+        return true;
+    }
+
+private:
+    void Load()
+    {
+        TCHAR exeFilename[MAX_PATH + 1];
+
+        if ( !GetModuleFileName(NULL, exeFilename, MAX_PATH) )
+            throw Win32Exception();
+
+        DWORD unusedHandle;
+        DWORD fiSize = GetFileVersionInfoSize(exeFilename, &unusedHandle);
+        if ( fiSize == 0 )
+            throw Win32Exception("Executable doesn't have the required VERSIONINFO resource");
+
+        std::vector<unsigned char> data(fiSize);
+
+        if ( !GetFileVersionInfo(exeFilename, unusedHandle, fiSize, &data[0]) )
+            throw Win32Exception();
+
+        TranslationInfo *translations;
+        unsigned translationsCnt;
+
+        if ( !VerQueryValue(&data[0], TEXT("\\VarFileInfo\\Translation"),
+                            (LPVOID*)&translations, &translationsCnt) )
+            throw Win32Exception("Executable doesn't have required VERSIONINFO\\VarFileInfo resource");
+
+        translationsCnt /= sizeof(TranslationInfo);
+        if ( translationsCnt == 0 )
+            throw std::runtime_error("No translations in VarFileInfo resource?");
+
+        const size_t idx = ChooseTranslation(translations, translationsCnt);
+
+        wchar_t lang[9];
+        HRESULT hr = _snwprintf_s(lang, 9, 8,
+                                  L"%04x%04x",
+                                  translations[idx].language,
+                                  translations[idx].codepage);
+        if ( FAILED(hr) )
+            throw Win32Exception();
 
-    if ( !GetModuleFileName(NULL, exeFilename, MAX_PATH) )
-        throw Win32Exception();
+        m_data.swap(data);
+        m_prefix = std::wstring(TEXT("\\StringFileInfo\\")) + lang + TEXT("\\");
+        m_loaded = true;
+    }
 
-    DWORD unusedHandle;
-    DWORD fiSize = GetFileVersionInfoSize(exeFilename, &unusedHandle);
-    if ( fiSize == 0 )
-        throw Win32Exception("Executable doesn't have the required VERSIONINFO resource");
+    CriticalSection m_cs;
+    bool m_loaded;
+    std::vector<unsigned char> m_data;
+    std::wstring m_prefix;
+};
 
-    DataBuffer<unsigned char> fi(fiSize);
+ExeVersionInfo g_exeVersionInfo;
 
-    if ( !GetFileVersionInfo(exeFilename, unusedHandle, fiSize, fi.data) )
-        throw Win32Exception();
+} // anonymous namespace
 
-    const std::wstring key =
-        TEXT("\\StringFileInfo\\") + GetVerInfoLang(fi.data) + TEXT("\\") + field;
-    LPTSTR key_str = (LPTSTR)key.c_str(); // explicit cast to work around VC2005 bug
 
-    TCHAR *value;
-    UINT len;
-    if ( !VerQueryValue(fi.data, key_str, (LPVOID*)&value, &len) )
+std::wstring Settings::DoGetVerInfoField(const wchar_t *field, bool fatal)
+{
+    std::wstring value;
+    if ( !g_exeVersionInfo.GetField(field, value) )
     {
         if ( fatal )
             throw Win32Exception("Executable doesn't have required key in StringFileInfo");
@@ -162,17 +279,204 @@ std::string Settings::GetCustomResource(const char *name, const char *type)
 }
 
 
+/*--------------------------------------------------------------------------*
+                          configuration manifest
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Longest value accepted in the manifest; keys are a few hundred bytes.
+const size_t MAX_MANIFEST_VALUE_SIZE = 64 * 1024;
+
+// Values of the manifest, empty or NULL if not present
+struct ConfigManifest
+{
+    ConfigManifest() : authenticodeCheck(false) {}
+
+    std::string  appcastURL;
+    std::string  appcastSignatureURL;
+    std::string  appcastFallbackURLs;
+    std::string  updateChannels;
+    std::string  registryPath;
+    std::wstring appName;
+    std::wstring appVersion;
+    std::wstring appBuildVersion;
+    std::wstring companyName;
+    std::shared_ptr<const DSAPublicKey> dsaPubKey;
+    std::shared_ptr<const Ed25519PublicKey> edDSAPubKey;
+    bool         authenticodeCheck;
+};
+
+void ReadManifestString(JsonReader& reader, std::string& out)
+{
+    if ( reader.PeekType() != JsonReader::Type_String )
+        reader.Fail("expected string value");
+    reader.ReadScalar(out, MAX_MANIFEST_VALUE_SIZE);
+}
+
+void ReadManifestString(JsonReader& reader, std::wstring& out)
+{
+    std::string value;
+    ReadManifestString(reader, value);
+    out = AnsiToWide(value);
+}
+
+// Reads a string or an array of strings, which are joined by sep
+void ReadManifestList(JsonReader& reader, std::string& out, char sep)
+{
+    if ( reader.PeekType() != JsonReader::Type_Array )
+    {
+        ReadManifestString(reader, out);
+        return;
+    }
+
+    std::string item;
+    reader.BeginArray();
+    for ( bool first = true; reader.NextElement(first); )
+    {
+        ReadManifestString(reader, item);
+        if ( item.empty() )
+            continue;
+        if ( out.size() + item.size() > MAX_MANIFEST_VALUE_SIZE )
+            reader.Fail("too long list");
+        if ( !out.empty() )
+            out += sep;
+        out += item;
+    }
+}
+
+void ParseConfigManifest(const std::string& data, ConfigManifest& m)
+{
+    JsonReader reader(data.data(), data.size());
+    std::string key, value;
+
+    reader.BeginObject();
+    for ( bool first = true; reader.NextMember(first, key); )
+    {
+        if ( key == "appcastURL" )
+            ReadManifestString(reader, m.appcastURL);
+        else if ( key == "appcastSignatureURL" )
+            ReadManifestString(reader, m.appcastSignatureURL);
+        else if ( key == "appcastFallbackURLs" )
+            ReadManifestList(reader, m.appcastFallbackURLs, ' ');
+        else if ( key == "updateChannels" )
+            ReadManifestList(reader, m.updateChannels, ',');
+        else if ( key == "registryPath" )
+            ReadManifestString(reader, m.registryPath);
+        else if ( key == "appName" )
+            ReadManifestString(reader, m.appName);
+        else if ( key == "appVersion" )
+            ReadManifestString(reader, m.appVersion);
+        else if ( key == "appBuildVersion" )
+            ReadManifestString(reader, m.appBuildVersion);
+        else if ( key == "companyName" )
+            ReadManifestString(reader, m.companyName);
+        else if ( key == "dsaPublicKey" )
+        {
+            ReadManifestString(reader, value);
+            m.dsaPubKey = SignatureVerifier::ParseDSAPubKey(value);
+        }
+        else if ( key == "eddsaPublicKey" )
+        {
+            ReadManifestString(reader, value);
+            m.edDSAPubKey = SignatureVerifier::ParseEdDSAPubKey(value);
+        }
+        else if ( key == "requireAuthenticode" )
+        {
+            reader.ReadScalar(value, MAX_MANIFEST_VALUE_SIZE);
+            if ( value != "true" && value != "false" )
+                reader.Fail("expected boolean value");
+            m.authenticodeCheck = value == "true";
+        }
+        else
+        {
+            // a misspelled key would be silently ignored otherwise
+            reader.Fail(("unknown key \"" + key + "\"").c_str());
+        }
+    }
+    reader.End();
+}
+
+template<typename T>
+void ApplyManifestValue(T& var, const T& value)
+{
+    if ( var.empty() )
+        var = value;
+}
+
+} // anonymous namespace
+
+
+void Settings::LoadConfigManifest()
+{
+    {
+        ReadLocker lock(ms_lockVars);
+        if ( ms_configManifestLoaded )
+            return;
+    }
+
+    // Everything is parsed and validated before any of it is used, so that
+    // a broken manifest can't leave the app half configured, e.g. with the
+    // feed URL, but without the key to verify the updates with.
+    ConfigManifest m;
+    if ( FindResourceA(NULL, "Config", "WINSPARKLE") )
+    {
+        try
+        {
+            ParseConfigManifest(GetCustomResource("Config", "WINSPARKLE"), m);
+        }
+        catch ( std::exception& e )
+        {
+            throw std::runtime_error(std::string("Invalid configuration manifest: ") + e.what());
+        }
+    }
+
+    WriteLocker lock(ms_lockVars);
+    if ( ms_configManifestLoaded )
+        return;
+    ms_configManifestLoaded = true;
+
+    ApplyManifestValue(ms_appcastURL, m.appcastURL);
+    ApplyManifestValue(ms_appcastSignatureURL, m.appcastSignatureURL);
+    ApplyManifestValue(ms_appcastFallbackURLs, m.appcastFallbackURLs);
+    ApplyManifestValue(ms_updateChannels, m.updateChannels);
+    ApplyManifestValue(ms_registryPath, m.registryPath);
+    ApplyManifestValue(ms_appName, m.appName);
+    ApplyManifestValue(ms_appVersion, m.appVersion);
+    ApplyManifestValue(ms_appBuildVersion, m.appBuildVersion);
+    ApplyManifestValue(ms_companyName, m.companyName);
+
+    if ( m.dsaPubKey && !ms_DSAPubKeyLoaded )
+    {
+        ms_DSAPubKey = m.dsaPubKey;
+        ms_DSAPubKeyLoaded = true;
+    }
+    if ( m.edDSAPubKey && !ms_EdDSAPubKeyLoaded )
+    {
+        ms_EdDSAPubKey = m.edDSAPubKey;
+        ms_EdDSAPubKeyLoaded = true;
+    }
+
+    // the manifest can only make the policy stricter than the app's call
+    if ( m.authenticodeCheck )
+        ms_authenticodeCheck = true;
+}
+
+
 /*--------------------------------------------------------------------------*
                              runtime config access
  *--------------------------------------------------------------------------*/
 
 std::string Settings::GetDefaultRegistryPath()
 {
+    // The names are converted the way earlier versions did it, so that
+    // settings of apps with non-ASCII names stay where they always were.
     std::string s("Software\\");
     std::wstring vendor = Settings::GetCompanyName();
     if ( !vendor.empty() )
-        s += WideToAnsi(vendor) + "\\";
-    s += WideToAnsi(Settings::GetAppName());
+        s += LegacyWideToAnsi(vendor) + "\\";
+    s += LegacyWideToAnsi(Settings::GetAppName());
     s += "\\WinSparkle";
 
     return s;
@@ -181,146 +485,882 @@ std::string Settings::GetDefaultRegistryPath()
 namespace
 {
 
-void RegistryWrite(const char *name, const wchar_t *value)
+// Registry transactions API, available since Windows Vista. It's loaded
+// dynamically, because the DLL must work on XP too.
+class KernelTransactions
 {
-    const std::string subkey = Settings::GetRegistryPath();
+public:
+    typedef HANDLE (WINAPI *CreateTransaction_t)(LPSECURITY_ATTRIBUTES, LPGUID, DWORD, DWORD, DWORD, DWORD, LPWSTR);
+    typedef BOOL (WINAPI *CommitTransaction_t)(HANDLE);
+    typedef LONG (WINAPI *RegOpenKeyTransactedA_t)(HKEY, LPCSTR, DWORD, REGSAM, PHKEY, HANDLE, PVOID);
 
-    HKEY key;
-    LONG result = RegCreateKeyExA
-                  (
-                      HKEY_CURRENT_USER,
-                      subkey.c_str(),
-                      0,
-                      NULL,
-                      REG_OPTION_NON_VOLATILE,
-                      KEY_SET_VALUE,
-                      NULL,
-                      &key,
-                      NULL
-                  );
-    if ( result != ERROR_SUCCESS )
-        throw Win32Exception("Cannot write settings to registry");
+    KernelTransactions()
+        : m_loaded(false), m_dll(NULL),
+          CreateTransaction(NULL), CommitTransaction(NULL), RegOpenKeyTransactedA(NULL)
+    {}
 
-    result = RegSetValueEx
-             (
-                 key,
-                 AnsiToWide(name).c_str(),
-                 0,
-                 REG_SZ,
-                 (const BYTE*)value,
-                 (DWORD)((wcslen(value) + 1) * sizeof(wchar_t))
-             );
+    bool IsAvailable()
+    {
+        if ( !m_loaded )
+        {
+            m_loaded = true;
+
+            RegOpenKeyTransactedA = reinterpret_cast<RegOpenKeyTransactedA_t>(
+                GetProcAddress(GetModuleHandleA("advapi32.dll"), "RegOpenKeyTransactedA"));
+            if ( !RegOpenKeyTransactedA )
+                return false;
+
+            // only load ktmw32.dll from the system directory
+            wchar_t path[MAX_PATH];
+            const UINT len = GetSystemDirectoryW(path, MAX_PATH);
+            if ( len == 0 || len > MAX_PATH - 13 )
+                return false;
+            wcscat_s(path, MAX_PATH, L"\\ktmw32.dll");
+            m_dll = LoadLibraryW(path);
+            if ( !m_dll )
+                return false;
+
+            CreateTransaction = reinterpret_cast<CreateTransaction_t>(GetProcAddress(m_dll, "CreateTransaction"));
+            CommitTransaction = reinterpret_cast<CommitTransaction_t>(GetProcAddress(m_dll, "CommitTransaction"));
+        }
 
-    RegCloseKey(key);
+        return RegOpenKeyTransactedA && CreateTransaction && CommitTransaction;
+    }
 
-    if ( result != ERROR_SUCCESS )
-        throw Win32Exception("Cannot write settings to registry");
-}
+private:
+    bool m_loaded;
+    HMODULE m_dll;
+
+public:
+    CreateTransaction_t CreateTransaction;
+    CommitTransaction_t CommitTransaction;
+    RegOpenKeyTransactedA_t RegOpenKeyTransactedA;
+};
+
+
+/*
+    WinSparkle's registry key in one hive, with a process-local copy of its
+    values.
+
+    The key is opened once and the handle is kept for all later accesses
+    until the registry path changes (see InvalidateConfigCaches()).
 
+    All values are read with a single RegEnumValue() pass and then served from
+    memory. RegNotifyChangeKeyValue() signals an event when the key is changed
+    by someone else (or when it is deleted), a thread pool wait turns this into
+    a flag and the values are read again on the next lookup. This way reads
+    don't need any syscalls, yet external edits are still picked up.
 
-void RegistryDelete(const char *name)
+    Values written by WinSparkle itself are updated in the cache right away
+    (write-through), so they are visible even before the notification comes.
+
+    Must be used with g_csConfigValues locked, except for OnKeyChanged().
+ */
+class RegistryKey
 {
-    const std::string subkey = Settings::GetRegistryPath();
+public:
+    // If @a policy is true, the key is under Software\Policies.
+    RegistryKey(HKEY root, bool policy = false)
+        : m_root(root), m_policy(policy), m_key(NULL), m_event(NULL), m_wait(NULL),
+          m_changed(1), m_watching(false), m_opened(false), m_lastOpenAttempt(0),
+          m_batchDepth(0), m_batchFailed(false)
+    {
+        // only HKCU values are written, HKLM is typically read-only for users
+        m_access = KEY_QUERY_VALUE | KEY_NOTIFY;
+        if ( root == HKEY_CURRENT_USER && !policy )
+            m_access |= KEY_SET_VALUE;
+    }
+
+    // Looks up value of one of given types (terminated by REG_NONE). Returns
+    // false if there's no such value.
+    bool Read(const char *name, const DWORD *types, DWORD& type, std::string& data)
+    {
+        Refresh();
+
+        Values::const_iterator i = m_values.find(NormalizeName(name));
+        if ( i == m_values.end() )
+            return false;
+
+        for ( ; *types != REG_NONE; types++ )
+        {
+            if ( i->second.type == *types )
+            {
+                type = i->second.type;
+                data = i->second.data;
+                return true;
+            }
+        }
+
+        // incorrect type -- pretend that the setting doesn't exist, it will
+        // be newly written by WinSparkle anyway
+        return false;
+    }
+
+    // Writes the value to the registry, creating the key if needed.
+    void Write(const char *name, DWORD type, const void *data, DWORD size)
+    {
+        if ( m_batchDepth )
+        {
+            Refresh();
+            Change& c = m_pending[NormalizeName(name)];
+            c.name = name;
+            c.remove = false;
+            c.value.type = type;
+            c.value.data.assign(static_cast<const char*>(data), size);
+            m_values[NormalizeName(name)] = c.value;
+            return;
+        }
+
+        const std::wstring wname = AnsiToWide(name);
+
+        for ( int attempt = 0; ; attempt++ )
+        {
+            if ( !m_key )
+                Create();
+
+            LONG result = RegSetValueEx
+                          (
+                              m_key,
+                              wname.c_str(),
+                              0,
+                              type,
+                              (const BYTE*)data,
+                              size
+                          );
+            if ( result == ERROR_SUCCESS )
+                break;
+
+            if ( result == ERROR_KEY_DELETED && attempt == 0 )
+            {
+                // somebody deleted the key while we had it open, recreate it
+                Close();
+                continue;
+            }
+
+            throw Win32Exception("Cannot write settings to registry");
+        }
+
+        Value& v = m_values[NormalizeName(name)];
+        v.type = type;
+        v.data.assign(static_cast<const char*>(data), size);
+    }
+
+    // Deletes the value from the registry, if it exists.
+    void Delete(const char *name)
+    {
+        Refresh();
+
+        if ( m_batchDepth )
+        {
+            Change& c = m_pending[NormalizeName(name)];
+            c.name = name;
+            c.remove = true;
+            m_values.erase(NormalizeName(name));
+            return;
+        }
+
+        if ( !m_key )
+            return; // no key, no value
+
+        LONG result = RegDeleteValueA(m_key, name);
+
+        // deleting a value that isn't there is not an error, neither is
+        // deleting it from a key that was deleted in the meantime
+        if ( result != ERROR_SUCCESS &&
+             result != ERROR_FILE_NOT_FOUND &&
+             result != ERROR_KEY_DELETED )
+        {
+            throw Win32Exception("Cannot delete settings from registry");
+        }
+
+        m_values.erase(NormalizeName(name));
+    }
+
+    // Starts collecting changes instead of writing them, see Settings::Batch.
+    void BeginBatch()
+    {
+        if ( m_batchDepth++ == 0 )
+            m_batchFailed = false;
+    }
+
+    // Ends a batch started by BeginBatch(). Writes the collected changes
+    // if @a commit is true and this is the outermost batch.
+    void EndBatch(bool commit)
+    {
+        if ( !commit )
+            m_batchFailed = true;
+        if ( --m_batchDepth > 0 )
+            return;
+
+        if ( m_pending.empty() )
+            return;
+
+        if ( m_batchFailed )
+        {
+            // forget the changes made to the cache, reload it on next lookup
+            m_pending.clear();
+            Close();
+            m_opened = false;
+            return;
+        }
+
+        try
+        {
+            Flush();
+            m_pending.clear();
+        }
+        catch ( ... )
+        {
+            // nothing or only some changes were written, so the cache can't
+            // be trusted
+            m_pending.clear();
+            Close();
+            m_opened = false;
+            throw;
+        }
+    }
+
+    // Closes the key and forgets cached values, e.g. when the path changed.
+    void Invalidate()
+    {
+        Close();
+        m_path.clear();
+        m_values.clear();
+        m_opened = false;
+    }
+
+private:
+    struct Value
+    {
+        DWORD type;
+        std::string data;
+    };
+
+    // value names are case-insensitive
+    typedef std::unordered_map<std::string, Value> Values;
+
+    // change collected during a batch
+    struct Change
+    {
+        std::string name;
+        bool remove;
+        Value value;
+    };
+    typedef std::unordered_map<std::string, Change> Changes;
+
+    // Writes the changes collected during a batch to the registry.
+    void Flush()
+    {
+        // Creating the key reloads the cache, which still has to include
+        // the pending changes afterwards.
+        if ( !m_key )
+        {
+            bool needed = false;
+            for ( Changes::const_iterator i = m_pending.begin(); i != m_pending.end(); ++i )
+            {
+                if ( !i->second.remove )
+                    needed = true;
+            }
+            if ( !needed )
+                return; // only deleting from a key that doesn't exist
+            Create();
+        }
+
+        if ( !FlushTransacted() )
+            ApplyChanges(m_key);
+    }
+
+    // Makes the cache reflect changes not written to the registry yet.
+    void ApplyPendingChanges()
+    {
+        for ( Changes::const_iterator i = m_pending.begin(); i != m_pending.end(); ++i )
+        {
+            if ( i->second.remove )
+                m_values.erase(i->first);
+            else
+                m_values[i->first] = i->second.value;
+        }
+    }
+
+    // Writes the changes in a registry transaction. Returns false if
+    // transactions aren't supported, throws if writing failed.
+    bool FlushTransacted()
+    {
+        if ( !ms_ktm.IsAvailable() )
+            return false;
+
+        HANDLE tx = ms_ktm.CreateTransaction(NULL, NULL, 0, 0, 0, 0, NULL);
+        if ( tx == INVALID_HANDLE_VALUE )
+            return false;
+
+        HKEY key;
+        LONG result = ms_ktm.RegOpenKeyTransactedA(m_root, GetPath().c_str(), 0, KEY_SET_VALUE, &key, tx, NULL);
+        if ( result != ERROR_SUCCESS )
+        {
+            CloseHandle(tx);
+            return false;
+        }
+
+        try
+        {
+            ApplyChanges(key);
+        }
+        catch ( ... )
+        {
+            // closing the transaction without committing rolls it back
+            RegCloseKey(key);
+            CloseHandle(tx);
+            throw;
+        }
+
+        RegCloseKey(key);
+        const BOOL ok = ms_ktm.CommitTransaction(tx);
+        CloseHandle(tx);
+        if ( !ok )
+            throw Win32Exception("Cannot write settings to registry");
+
+        return true;
+    }
+
+    void ApplyChanges(HKEY key)
+    {
+        for ( Changes::const_iterator i = m_pending.begin(); i != m_pending.end(); ++i )
+        {
+            const Change& c = i->second;
+            LONG result;
+            if ( c.remove )
+            {
+                result = RegDeleteValueA(key, c.name.c_str());
+                if ( result == ERROR_FILE_NOT_FOUND )
+                    result = ERROR_SUCCESS;
+            }
+            else
+            {
+                result = RegSetValueEx
+                         (
+                             key,
+                             AnsiToWide(c.name).c_str(),
+                             0,
+                             c.value.type,
+                             (const BYTE*)c.value.data.data(),
+                             (DWORD)c.value.data.size()
+                         );
+            }
+            if ( result != ERROR_SUCCESS )
+                throw Win32Exception("Cannot write settings to registry");
+        }
+    }
+
+    static std::string NormalizeName(const char *name)
+    {
+        std::string s(name);
+        for ( std::string::iterator i = s.begin(); i != s.end(); ++i )
+        {
+            if ( *i >= 'A' && *i <= 'Z' )
+                *i = *i - 'A' + 'a';
+        }
+        return s;
+    }
+
+    static void CALLBACK OnKeyChanged(PVOID param, BOOLEAN /*timedOut*/)
+    {
+        // runs on a thread pool thread
+        InterlockedExchange(&static_cast<RegistryKey*>(param)->m_changed, 1);
+    }
+
+    const std::string& GetPath()
+    {
+        if ( m_path.empty() )
+        {
+            m_path = Settings::GetRegistryPath();
+            if ( m_policy )
+            {
+                // Software\Vendor\App\WinSparkle -> Software\Policies\Vendor\App\WinSparkle
+                static const char SOFTWARE[] = "Software\\";
+                const size_t softwareLen = sizeof(SOFTWARE) - 1;
+                if ( _strnicmp(m_path.c_str(), SOFTWARE, softwareLen) == 0 )
+                    m_path.erase(0, softwareLen);
+                m_path = "Software\\Policies\\" + m_path;
+            }
+        }
+        return m_path;
+    }
+
+    void Refresh()
+    {
+        if ( !m_key )
+        {
+            // The key doesn't exist (yet), so it can't be watched for changes.
+            // Don't check again on every lookup, only every few seconds.
+            const DWORD now = GetTickCount();
+            if ( m_opened && now - m_lastOpenAttempt < MISSING_KEY_RETRY_INTERVAL )
+                return;
+            m_opened = true;
+            m_lastOpenAttempt = now;
+            m_values.clear();
+
+            LONG result = RegOpenKeyExA(m_root, GetPath().c_str(), 0, m_access, &m_key);
+            if ( result != ERROR_SUCCESS )
+            {
+                m_key = NULL;
+                if ( result == ERROR_FILE_NOT_FOUND )
+                    return;
+                throw Win32Exception("Cannot read settings from registry");
+            }
+            OnOpened();
+        }
+
+        if ( m_watching && InterlockedExchange(&m_changed, 0) == 0 )
+            return; // nothing changed since last time
+
+        // re-arm the notification before reading, so that no change is missed
+        Watch();
+        Load();
+    }
+
+    void Create()
+    {
+        LONG result = RegCreateKeyExA
+                      (
+                          m_root,
+                          GetPath().c_str(),
+                          0,
+                          NULL,
+                          REG_OPTION_NON_VOLATILE,
+                          m_access,
+                          NULL,
+                          &m_key,
+                          NULL
+                      );
+        if ( result != ERROR_SUCCESS )
+        {
+            m_key = NULL;
+            throw Win32Exception("Cannot write settings to registry");
+        }
+
+        m_opened = true;
+        OnOpened();
+
+        // the key may have existed already, with values we didn't see yet
+        Watch();
+        Load();
+    }
+
+    void OnOpened()
+    {
+        if ( !m_event )
+        {
+            m_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+            if ( m_event &&
+                 !RegisterWaitForSingleObject(&m_wait, m_event, &OnKeyChanged, this, INFINITE, WT_EXECUTEDEFAULT) )
+            {
+                m_wait = NULL;
+            }
+        }
+
+        m_changed = 1;
+        m_watching = false;
+    }
+
+    void Watch()
+    {
+        m_watching = false;
+        if ( !m_wait )
+            return; // without notifications, the key is read on every lookup
+
+        // Without REG_NOTIFY_THREAD_AGNOSTIC, the notification is cancelled
+        // (and the event signaled) when the calling thread exits. That only
+        // causes an unnecessary reload, but avoid it where the flag is
+        // supported (Windows 8 and newer).
+        const DWORD filter = REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET;
+        LONG result = RegNotifyChangeKeyValue(m_key, FALSE, filter | REG_NOTIFY_THREAD_AGNOSTIC, m_event, TRUE);
+        if ( result != ERROR_SUCCESS )
+            result = RegNotifyChangeKeyValue(m_key, FALSE, filter, m_event, TRUE);
+
+        m_watching = (result == ERROR_SUCCESS);
+    }
+
+    void Load()
+    {
+        m_values.clear();
+
+        DWORD maxNameLen, maxDataLen;
+        LONG result = RegQueryInfoKey
+                      (
+                          m_key,
+                          NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                          &maxNameLen,
+                          &maxDataLen,
+                          NULL, NULL
+                      );
+
+        std::wstring name;
+        std::string data;
+        for ( DWORD index = 0; result == ERROR_SUCCESS; index++ )
+        {
+            // the sizes may grow if the key is being modified concurrently
+            name.resize(maxNameLen + 1);
+            data.resize(maxDataLen ? maxDataLen : 1);
+            DWORD nameLen = (DWORD)name.size();
+            DWORD dataLen = (DWORD)data.size();
+            DWORD type;
+            result = RegEnumValue
+                     (
+                         m_key,
+                         index,
+                         &name[0],
+                         &nameLen,
+                         NULL,
+                         &type,
+                         (BYTE*)&data[0],
+                         &dataLen
+                     );
+            if ( result == ERROR_MORE_DATA )
+            {
+                maxNameLen = (DWORD)name.size() * 2;
+                maxDataLen = (std::max)(dataLen, (DWORD)data.size() * 2);
+                index--;
+                result = ERROR_SUCCESS;
+                continue;
+            }
+            if ( result != ERROR_SUCCESS )
+                break;
+
+            Value& v = m_values[NormalizeName(WideToAnsi(name.substr(0, nameLen)).c_str())];
+            v.type = type;
+            v.data.assign(data, 0, dataLen);
+        }
+
+        if ( result == ERROR_KEY_DELETED )
+        {
+            // the key was removed, treat it as if it didn't exist
+            m_values.clear();
+            Close();
+            m_opened = true;
+            m_lastOpenAttempt = GetTickCount();
+            ApplyPendingChanges();
+            return;
+        }
 
-    HKEY key;
-    LONG result = RegOpenKeyExA
-                  (
-                      HKEY_CURRENT_USER,
-                      subkey.c_str(),
-                      0,
-                      KEY_SET_VALUE,
-                      &key
-                  );
-    if ( result != ERROR_SUCCESS )
-        throw Win32Exception("Cannot delete settings from registry");
+        if ( result != ERROR_NO_MORE_ITEMS )
+        {
+            m_values.clear();
+            Close();
+            m_opened = false;
+            throw Win32Exception("Cannot read settings from registry");
+        }
 
-    result = RegDeleteValueA(key, name);
+        // if reloaded during a batch, keep its changes visible
+        ApplyPendingChanges();
+    }
 
-    RegCloseKey(key);
+    void Close()
+    {
+        // The event and the thread pool wait are kept, they can be reused
+        // for the next key. Closing the key signals the event.
+        if ( m_key )
+        {
+            RegCloseKey(m_key);
+            m_key = NULL;
+        }
+        m_watching = false;
+    }
 
-    if ( result != ERROR_SUCCESS )
-        throw Win32Exception("Cannot delete settings from registry");
+    static const DWORD MISSING_KEY_RETRY_INTERVAL = 5000; // ms
+
+    HKEY m_root;
+    bool m_policy;
+    REGSAM m_access;
+    std::string m_path;
+    HKEY m_key;
+    HANDLE m_event;
+    HANDLE m_wait;
+    volatile LONG m_changed;
+    bool m_watching;
+    bool m_opened;
+    DWORD m_lastOpenAttempt;
+    Values m_values;
+
+    int m_batchDepth;
+    bool m_batchFailed;
+    Changes m_pending;
+
+    static KernelTransactions ms_ktm;
+};
+
+KernelTransactions RegistryKey::ms_ktm;
+
+
+// Critical section to guard DoWriteConfigValue/DoReadConfigValue and the
+// settings stores.
+CriticalSection g_csConfigValues("settings");
+
+// Keys in HKCU and HKLM and the policy key in HKLM. They are created on first
+// use and never destroyed, because the thread pool may still call them back
+// during unload.
+RegistryKey *g_userConfig = NULL;
+RegistryKey *g_machineConfig = NULL;
+RegistryKey *g_policyConfig = NULL;
+
+RegistryKey& GetConfigKey(HKEY root)
+{
+    RegistryKey*& key = (root == HKEY_CURRENT_USER) ? g_userConfig : g_machineConfig;
+    if ( !key )
+        key = new RegistryKey(root);
+    return *key;
+}
+
+RegistryKey& GetPolicyKey()
+{
+    if ( !g_policyConfig )
+        g_policyConfig = new RegistryKey(HKEY_LOCAL_MACHINE, true);
+    return *g_policyConfig;
 }
 
 
-int DoRegistryRead(HKEY root, const char *name, wchar_t *buf, size_t len)
+// ISettingsStore using the registry.
+class RegistrySettingsStore : public ISettingsStore
 {
-    const std::string subkey = Settings::GetRegistryPath();
+public:
+    virtual bool Read(const char *name, const DWORD *types, DWORD& type, std::string& data)
+    {
+        // Try reading from HKCU first. If that fails, look at HKLM too, in case
+        // some settings have globally set values (either by the installer or the
+        // administrator).
+        return GetConfigKey(HKEY_CURRENT_USER).Read(name, types, type, data) ||
+               GetConfigKey(HKEY_LOCAL_MACHINE).Read(name, types, type, data);
+    }
 
-    HKEY key;
-    LONG result = RegOpenKeyExA
-                  (
-                      root,
-                      subkey.c_str(),
-                      0,
-                      KEY_QUERY_VALUE,
-                      &key
-                  );
-    if ( result != ERROR_SUCCESS )
+    virtual void Write(const char *name, DWORD type, const void *data, DWORD size)
     {
-        if ( result == ERROR_FILE_NOT_FOUND )
-            return 0;
-        throw Win32Exception("Cannot read settings from registry");
+        GetConfigKey(HKEY_CURRENT_USER).Write(name, type, data, size);
     }
 
-    DWORD buflen = (DWORD)len;
-    DWORD type;
-    result = RegQueryValueEx
-             (
-                 key,
-                 AnsiToWide(name).c_str(),
-                 0,
-                 &type,
-                 (BYTE*)buf,
-                 &buflen
-             );
+    virtual void Delete(const char *name)
+    {
+        GetConfigKey(HKEY_CURRENT_USER).Delete(name);
+    }
 
-    RegCloseKey(key);
+    virtual void BeginBatch()
+    {
+        GetConfigKey(HKEY_CURRENT_USER).BeginBatch();
+    }
 
-    if ( result != ERROR_SUCCESS )
+    virtual void EndBatch(bool commit)
     {
-        if ( result == ERROR_FILE_NOT_FOUND )
-            return 0;
-        throw Win32Exception("Cannot read settings from registry");
+        GetConfigKey(HKEY_CURRENT_USER).EndBatch(commit);
     }
+};
+
+RegistrySettingsStore g_registryStore;
+
+// Store set with Settings::SetConfigFile(), if any. Never destroyed, for the
+// same reason as the registry keys.
+ISettingsStore *g_fileStore = NULL;
 
-    if ( type != REG_SZ )
+ISettingsStore& GetStore()
+{
+    if ( g_fileStore )
+        return *g_fileStore;
+    else
+        return g_registryStore;
+}
+
+
+void StoreWrite(const char *name, const wchar_t *value)
+{
+    GetStore().Write(name, REG_SZ, value, (DWORD)((wcslen(value) + 1) * sizeof(wchar_t)));
+}
+
+
+// Reads value from the merged view of all config layers: machine policy
+// (HKLM\Software\Policies\...) first, as it is enforced by the
+// administrator, then the store. Each layer is cached in memory, so this
+// doesn't touch the registry.
+bool ReadMerged(const char *name, const DWORD *types, DWORD& type, std::string& data)
+{
+    return GetPolicyKey().Read(name, types, type, data) ||
+           GetStore().Read(name, types, type, data);
+}
+
+
+// Reads raw data of a value of given type. Returns 0 if there's no such value.
+int StoreRead(const char *name, DWORD type, std::string& data)
+{
+    const DWORD types[] = { type, REG_NONE };
+    DWORD actualType;
+    if ( !ReadMerged(name, types, actualType, data) )
     {
-        // incorrect type -- pretend that the setting doesn't exist, it will
-        // be newly written by WinSparkle anyway
+        data.clear();
         return 0;
     }
+    return 1;
+}
+
+
+std::wstring RegistryDataToString(const std::string& data)
+{
+    std::wstring value(reinterpret_cast<const wchar_t*>(data.data()), data.size() / sizeof(wchar_t));
+
+    // REG_SZ data may or may not include the terminating NUL
+    while ( !value.empty() && value[value.length() - 1] == L'\0' )
+        value.erase(value.length() - 1);
+
+    return value;
+}
+
+
+int StoreRead(const char *name, std::wstring& value)
+{
+    std::string data;
+    if ( !StoreRead(name, REG_SZ, data) )
+        return 0;
 
+    value = RegistryDataToString(data);
     return 1;
 }
 
 
-int RegistryRead(const char *name, wchar_t *buf, size_t len)
+// Reads integer value stored as REG_DWORD, REG_QWORD or, by older versions,
+// as REG_SZ. Returns 0 if there's no such value.
+int StoreReadInteger(const char *name, unsigned long long& value)
 {
-    // Try reading from HKCU first. If that fails, look at HKLM too, in case
-    // some settings have globally set values (either by the installer or the
-    // administrator).
-    if ( DoRegistryRead(HKEY_CURRENT_USER, name, buf, len) )
+    const DWORD types[] = { REG_DWORD, REG_QWORD, REG_SZ, REG_NONE };
+    DWORD type;
+    std::string data;
+    if ( !ReadMerged(name, types, type, data) )
+        return 0;
+
+    if ( type == REG_DWORD && data.size() == sizeof(DWORD) )
     {
+        DWORD v;
+        memcpy(&v, data.data(), sizeof(v));
+        value = v;
         return 1;
     }
-    else
+
+    if ( type == REG_QWORD && data.size() == sizeof(value) )
     {
-        return DoRegistryRead(HKEY_LOCAL_MACHINE, name, buf, len);
+        memcpy(&value, data.data(), sizeof(value));
+        return 1;
     }
-}
 
-// Critical section to guard DoWriteConfigValue/DoReadConfigValue.
-CriticalSection g_csConfigValues;
+    if ( type == REG_SZ )
+    {
+        std::wistringstream s(RegistryDataToString(data));
+        long long v;
+        s >> v;
+        if ( s.fail() )
+            return 0;
+        value = static_cast<unsigned long long>(v);
+        return 1;
+    }
+
+    return 0;
+}
 
 } // anonymous namespace
 
 
+void Settings::SetRegistryPath(const char *path)
+{
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_registryPath = path;
+    }
+
+    // Reopen the keys at the new location on next access. This must be done
+    // without ms_lockVars locked, because the keys lock it when reading the
+    // path with g_csConfigValues locked.
+    CriticalSectionLocker lock(g_csConfigValues);
+    if ( g_userConfig )
+        g_userConfig->Invalidate();
+    if ( g_machineConfig )
+        g_machineConfig->Invalidate();
+    if ( g_policyConfig )
+        g_policyConfig->Invalidate();
+}
+
+
+bool Settings::ReadPolicyValue(const char *name, std::string& value)
+{
+    try
+    {
+        CriticalSectionLocker lock(g_csConfigValues);
+
+        const DWORD types[] = { REG_SZ, REG_NONE };
+        DWORD type;
+        std::string data;
+        if ( !GetPolicyKey().Read(name, types, type, data) )
+            return false;
+
+        value = WideToAnsi(RegistryDataToString(data));
+        return !value.empty();
+    }
+    catch ( std::exception& )
+    {
+        // e.g. the registry path can't be determined; there's no policy then
+        return false;
+    }
+}
+
+
+void Settings::SetConfigFile(const wchar_t *path)
+{
+    CriticalSectionLocker lock(g_csConfigValues);
+
+    if ( g_fileStore )
+        g_fileStore->Flush();
+
+    // the previous store is not destroyed, see g_fileStore
+    g_fileStore = (path && *path) ? new FileSettingsStore(path) : NULL;
+}
+
+
+void Settings::FlushConfig()
+{
+    CriticalSectionLocker lock(g_csConfigValues);
+
+    GetStore().Flush();
+}
+
+
+Settings::Batch::Batch() : m_committed(false)
+{
+    g_csConfigValues.Enter();
+    m_store = &GetStore();
+    m_store->BeginBatch();
+}
+
+
+Settings::Batch::~Batch()
+{
+    if ( !m_committed )
+    {
+        try
+        {
+            m_store->EndBatch(false);
+        }
+        catch ( ... ) {} // discarding changes doesn't throw, but be safe
+    }
+    g_csConfigValues.Leave();
+}
+
+
+void Settings::Batch::Commit()
+{
+    if ( m_committed )
+        return;
+    m_committed = true;
+    m_store->EndBatch(true);
+}
+
+
 void Settings::DoWriteConfigValue(const char *name, const wchar_t *value)
 {
     CriticalSectionLocker lock(g_csConfigValues);
 
-    RegistryWrite(name, value);
+    StoreWrite(name, value);
 }
 
 
@@ -328,25 +1368,215 @@ std::wstring Settings::DoReadConfigValue(const char *name)
 {
     CriticalSectionLocker lock(g_csConfigValues);
 
-    wchar_t buf[512];
-    if ( RegistryRead(name, buf, sizeof(buf)) )
-        return buf;
+    std::wstring value;
+    if ( StoreRead(name, value) )
+        return value;
     else
         return std::wstring();
 }
 
+void Settings::DoWriteConfigInteger(const char *name, unsigned long long value, size_t size)
+{
+    CriticalSectionLocker lock(g_csConfigValues);
+
+    if ( size <= sizeof(DWORD) )
+    {
+        const DWORD v = static_cast<DWORD>(value);
+        GetStore().Write(name, REG_DWORD, &v, sizeof(v));
+    }
+    else
+    {
+        GetStore().Write(name, REG_QWORD, &value, sizeof(value));
+    }
+}
+
+
+bool Settings::DoReadConfigInteger(const char *name, unsigned long long& value)
+{
+    CriticalSectionLocker lock(g_csConfigValues);
+
+    return StoreReadInteger(name, value) != 0;
+}
+
+
+void Settings::WriteConfigBlob(const char *name, const std::string& data)
+{
+    CriticalSectionLocker lock(g_csConfigValues);
+
+    GetStore().Write(name, REG_BINARY, data.data(), (DWORD)data.size());
+}
+
+
+bool Settings::ReadConfigBlob(const char *name, std::string& data)
+{
+    CriticalSectionLocker lock(g_csConfigValues);
+
+    return StoreRead(name, REG_BINARY, data) != 0;
+}
+
 void Settings::DeleteConfigValue(const char *name)
 {
     CriticalSectionLocker lock(g_csConfigValues);
 
-    RegistryDelete(name);
+    GetStore().Delete(name);
+}
+
+std::shared_ptr<const DSAPublicKey> Settings::GetDSAPubKey()
+{
+    LoadConfigManifest();
+    {
+        ReadLocker lock(ms_lockVars);
+        if ( ms_DSAPubKeyLoaded )
+            return ms_DSAPubKey;
+    }
+
+    // An invalid key throws and is tried again next time, so that it
+    // can't be mistaken for no key (and unsigned updates accepted).
+    std::shared_ptr<const DSAPublicKey> key;
+    if ( FindResourceA(NULL, "DSAPub", "DSAPEM") )
+        key = SignatureVerifier::ParseDSAPubKey(GetCustomResource("DSAPub", "DSAPEM"));
+
+    WriteLocker lock(ms_lockVars);
+    if ( !ms_DSAPubKeyLoaded )
+    {
+        ms_DSAPubKey = key;
+        ms_DSAPubKeyLoaded = true;
+    }
+    return ms_DSAPubKey;
 }
 
 void Settings::SetDSAPubKeyPem(const std::string &pem)
 {
-    CriticalSectionLocker lock(ms_csVars);
-    SignatureVerifier::VerifyDSAPubKeyPem(pem);
-    ms_DSAPubKey = pem;
+    std::shared_ptr<const DSAPublicKey> key = SignatureVerifier::ParseDSAPubKey(pem);
+
+    WriteLocker lock(ms_lockVars);
+    ms_DSAPubKey = key;
+    ms_DSAPubKeyLoaded = true;
+}
+
+std::shared_ptr<const Ed25519PublicKey> Settings::GetEdDSAPubKey()
+{
+    LoadConfigManifest();
+    {
+        ReadLocker lock(ms_lockVars);
+        if ( ms_EdDSAPubKeyLoaded )
+            return ms_EdDSAPubKey;
+    }
+
+    // same as in GetDSAPubKey(), an invalid key is not forgotten
+    std::shared_ptr<const Ed25519PublicKey> key;
+    if ( FindResourceA(NULL, "EdDSAPub", "EDDSA") )
+        key = SignatureVerifier::ParseEdDSAPubKey(GetCustomResource("EdDSAPub", "EDDSA"));
+
+    WriteLocker lock(ms_lockVars);
+    if ( !ms_EdDSAPubKeyLoaded )
+    {
+        ms_EdDSAPubKey = key;
+        ms_EdDSAPubKeyLoaded = true;
+    }
+    return ms_EdDSAPubKey;
+}
+
+void Settings::SetEdDSAPubKey(const std::string &pubkey_base64)
+{
+    std::shared_ptr<const Ed25519PublicKey> key = SignatureVerifier::ParseEdDSAPubKey(pubkey_base64);
+
+    WriteLocker lock(ms_lockVars);
+    ms_EdDSAPubKey = key;
+    ms_EdDSAPubKeyLoaded = true;
+}
+
+void Settings::SetMetadata(const MetadataUpdate& update)
+{
+    {
+        WriteLocker lock(ms_lockVars);
+
+        if ( update.appcastURL )
+            ms_appcastURL = update.appcastURL;
+        if ( update.appcastSignatureURL )
+            ms_appcastSignatureURL = update.appcastSignatureURL;
+        if ( update.companyName )
+            ms_companyName = update.companyName;
+        if ( update.appName )
+            ms_appName = update.appName;
+        if ( update.appVersion )
+            ms_appVersion = update.appVersion;
+        if ( update.appBuildVersion )
+            ms_appBuildVersion = update.appBuildVersion;
+        if ( update.appVersion || update.appBuildVersion )
+            ms_hasAppBuildVersionKey = false;
+        if ( update.dsaPubKey )
+        {
+            ms_DSAPubKey = update.dsaPubKey;
+            ms_DSAPubKeyLoaded = true;
+        }
+        if ( update.eddsaPubKey )
+        {
+            ms_EdDSAPubKey = update.eddsaPubKey;
+            ms_EdDSAPubKeyLoaded = true;
+        }
+    }
+
+    // see SetRegistryPath() for why ms_lockVars must not be held here
+    if ( update.registryPath )
+        SetRegistryPath(update.registryPath);
+}
+
+std::vector<std::string> Settings::GetAppcastFallbackURLs()
+{
+    std::vector<std::string> urls;
+
+    // the policy's URL replaces the app's feed and thus its fallbacks too
+    std::string policyURL;
+    if ( ReadPolicyValue("AppcastURL", policyURL) )
+        return urls;
+
+    LoadConfigManifest();
+    std::string list;
+    {
+        ReadLocker lock(ms_lockVars);
+        list = ms_appcastFallbackURLs;
+    }
+
+    const char *whitespace = " \t\r\n";
+    for ( size_t pos = list.find_first_not_of(whitespace);
+          pos != std::string::npos;
+          pos = list.find_first_not_of(whitespace, pos) )
+    {
+        const size_t end = list.find_first_of(whitespace, pos);
+        urls.push_back(list.substr(pos, end - pos));
+        pos = end;
+    }
+
+    return urls;
+}
+
+std::vector<Settings::AdditionalFeed> Settings::GetAdditionalFeeds()
+{
+    // the policy's feed replaces the app's, which the others go with
+    std::string policyURL;
+    if ( ReadPolicyValue("AppcastURL", policyURL) )
+        return std::vector<AdditionalFeed>();
+
+    ReadLocker lock(ms_lockVars);
+    return ms_additionalFeeds;
+}
+
+std::wstring Settings::GetStagingDirectory()
+{
+    {
+        ReadLocker lock(ms_lockVars);
+        if ( !ms_stagingDirectory.empty() )
+        {
+            const wchar_t last = ms_stagingDirectory[ms_stagingDirectory.length() - 1];
+            return (last == L'\\' || last == L'/') ? ms_stagingDirectory : ms_stagingDirectory + L"\\";
+        }
+    }
+
+    wchar_t tmpdir[MAX_PATH + 1];
+    if ( GetTempPath(MAX_PATH + 1, tmpdir) == 0 )
+        throw Win32Exception("Cannot determine temporary directory");
+    return tmpdir;
 }
 
 } // namespace winsparkle
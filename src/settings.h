@@ -28,14 +28,22 @@
 
 #include "threads.h"
 #include "utils.h"
+#include "versionkey.h"
 
+#include <memory>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <type_traits>
 
 
 namespace winsparkle
 {
 
+class DSAPublicKey;
+class Ed25519PublicKey;
+struct ISettingsStore;
+
 /**
     Holds all of WinSparkle configuration.
 
@@ -57,35 +65,127 @@ public:
     /// Get location of the appcast
     static std::string GetAppcastURL()
     {
-        CriticalSectionLocker lock(ms_csVars);
+        // administrators can redirect the app e.g. to an internal mirror
+        std::string policyURL;
+        if ( ReadPolicyValue("AppcastURL", policyURL) )
+            return policyURL;
+
+        LoadConfigManifest();
+        {
+            ReadLocker lock(ms_lockVars);
+            if ( !ms_appcastURL.empty() )
+                return ms_appcastURL;
+        }
+        // the resource is read without holding the lock, it isn't recursive
+        const std::string url = GetCustomResource("FeedURL", "APPCAST");
+        WriteLocker lock(ms_lockVars);
         if ( ms_appcastURL.empty() )
-            ms_appcastURL = GetCustomResource("FeedURL", "APPCAST");
+            ms_appcastURL = url;
         return ms_appcastURL;
     }
 
+    /// Get URL of the appcast feed's signature, empty if it's not signed
+    static std::string GetAppcastSignatureURL()
+    {
+        LoadConfigManifest();
+        ReadLocker lock(ms_lockVars);
+        return ms_appcastSignatureURL;
+    }
+
+    /**
+        Get other URLs of the appcast feed, to use if GetAppcastURL() is slow
+        or fails, see win_sparkle_set_appcast_fallback_urls().
+
+        None are returned if the appcast URL is set by a policy.
+     */
+    static std::vector<std::string> GetAppcastFallbackURLs();
+
+    /// Role of an additional appcast feed, see win_sparkle_add_appcast_feed()
+    enum FeedRole
+    {
+        FeedRole_Updates,
+        FeedRole_Components
+    };
+
+    struct AdditionalFeed
+    {
+        std::string url;
+        FeedRole role;
+    };
+
+    /**
+        Get feeds checked together with the appcast feed, see
+        win_sparkle_add_appcast_feed().
+
+        None are returned if the appcast URL is set by a policy.
+     */
+    static std::vector<AdditionalFeed> GetAdditionalFeeds();
+
+    /// Get comma-separated update channels to accept, besides the default one
+    static std::string GetUpdateChannels()
+    {
+        LoadConfigManifest();
+        ReadLocker lock(ms_lockVars);
+        return ms_updateChannels;
+    }
+
+    /// Get URL of the document with the latest version, empty if none
+    static std::string GetLatestVersionURL()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_latestVersionURL;
+    }
+
+    /// Get URL announcing new releases, see NotificationListener; empty if none
+    static std::string GetUpdateNotificationURL()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_updateNotificationURL;
+    }
+
+    /**
+        Get the directory to download updates to, with trailing backslash.
+
+        This is the directory set by SetStagingDirectory() or the temporary
+        directory. Throws if the latter can't be determined.
+     */
+    static std::wstring GetStagingDirectory();
+
+    /**
+        Should the client's version, OS version, platform and update channels
+        be appended to the appcast URL as query parameters?
+     */
+    static bool GetAppcastFilterHints()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_appcastFilterHints;
+    }
+
+    /// Get maximum size of the appcast feed in bytes, 0 if unlimited
+    static size_t GetMaxAppcastSize()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_maxAppcastSize;
+    }
+
     /// Return application name
     static std::wstring GetAppName()
     {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_appName.empty() )
-            ms_appName = GetVerInfoField(L"ProductName");
-        return ms_appName;
+        return GetVerInfoValue(ms_appName, L"ProductName");
     }
 
     /// Return (human-readable) application version
     static std::wstring GetAppVersion()
     {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_appVersion.empty() )
-            ms_appVersion = GetVerInfoField(L"ProductVersion");
-        return ms_appVersion;
+        return GetVerInfoValue(ms_appVersion, L"ProductVersion");
     }
 
     /// Return (internal) application build version
     static std::wstring GetAppBuildVersion()
     {
+        LoadConfigManifest();
         {
-            CriticalSectionLocker lock(ms_csVars);
+            ReadLocker lock(ms_lockVars);
             if ( !ms_appBuildVersion.empty() )
                 return ms_appBuildVersion;
         }
@@ -93,42 +193,559 @@ public:
         return GetAppVersion();
     }
 
+    /**
+        Return application build version prepared for comparisons.
+
+        Unlike GetAppBuildVersion(), this doesn't convert and parse the
+        version again on every call.
+     */
+    static VersionKey GetAppBuildVersionKey()
+    {
+        PrepareAppBuildVersion();
+        ReadLocker lock(ms_lockVars);
+        return ms_appBuildVersionKey;
+    }
+
+    /**
+        Return application build version as UTF-8 string, e.g. for comparing
+        with appcast data.
+
+        Unlike WideToAnsi(GetAppBuildVersion()), this doesn't convert the
+        version again on every call.
+     */
+    static std::string GetAppBuildVersionUTF8()
+    {
+        PrepareAppBuildVersion();
+        ReadLocker lock(ms_lockVars);
+        return ms_appBuildVersionUTF8;
+    }
+
     /// Return name of the vendor
     static std::wstring GetCompanyName()
     {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_companyName.empty() )
-            ms_companyName = GetVerInfoField(L"CompanyName");
-        return ms_companyName;
+        return GetVerInfoValue(ms_companyName, L"CompanyName");
     }
 
     /// Return the registry path to store settings in
     static std::string GetRegistryPath()
     {
-        CriticalSectionLocker lock(ms_csVars);
+        LoadConfigManifest();
+        {
+            ReadLocker lock(ms_lockVars);
+            if ( !ms_registryPath.empty() )
+                return ms_registryPath;
+        }
+        // this calls other getters, so it can't be done with the lock held
+        const std::string path = GetDefaultRegistryPath();
+        WriteLocker lock(ms_lockVars);
         if ( ms_registryPath.empty() )
-            ms_registryPath = GetDefaultRegistryPath();
+            ms_registryPath = path;
         return ms_registryPath;
     }
 
-    /// Return DSA public key to verify update file signature
-    static const std::string &GetDSAPubKeyPem()
+    /**
+        Return DSA public key to verify update file signature, or NULL if
+        there's none.
+
+        The key is parsed only once and shared by all callers.
+
+        Throws if the key in the resources is invalid.
+     */
+    static std::shared_ptr<const DSAPublicKey> GetDSAPubKey();
+
+    /// Return true if DSA public key is available, throws if it's invalid
+    static bool HasDSAPubKey() { return GetDSAPubKey() != NULL; }
+
+    /**
+        Return Ed25519 public key to verify update file's EdDSA signature,
+        or NULL if there's none.
+
+        Throws if the key in the resources is invalid.
+     */
+    static std::shared_ptr<const Ed25519PublicKey> GetEdDSAPubKey();
+
+    /// Return true if EdDSA public key is available, throws if it's invalid
+    static bool HasEdDSAPubKey() { return GetEdDSAPubKey() != NULL; }
+
+    /// Must updates also have a valid Authenticode signature?
+    static bool GetAuthenticodeCheck()
     {
-        CriticalSectionLocker lock(ms_csVars);
-        if ( ms_DSAPubKey.empty() )
-            ms_DSAPubKey = GetCustomResource("DSAPub", "DSAPEM");
-        return ms_DSAPubKey;
+        LoadConfigManifest();
+        ReadLocker lock(ms_lockVars);
+        return ms_authenticodeCheck;
     }
 
-    /// Return true if DSA public key is available
-    static bool HasDSAPubKeyPem()
+    static void SetAuthenticodeCheck(bool check)
     {
-        try
-        {
-            return !GetDSAPubKeyPem().empty();
-        }
-        CATCH_ALL_EXCEPTIONS
-        return false;
+        WriteLocker lock(ms_lockVars);
+        ms_authenticodeCheck = check;
+    }
+
+    /**
+        Reads the app's configuration manifest, the "Config" resource of type
+        "WINSPARKLE", unless it was already read.
+
+        The manifest is a JSON object with the metadata otherwise provided by
+        separate resources or set by the app, see README.md. Its values are
+        used only where nothing was set by the app, so that the API still
+        takes precedence. The getters above call this, win_sparkle_init()
+        does so too, to report an invalid manifest right away.
+
+        Throws if the manifest is invalid, in which case none of it is used
+        and it is read again next time.
+     */
+    static void LoadConfigManifest();
+
+    //@}
+
+    /**
+        Network access.
+     */
+    //@{
+
+    /// HTTP client implementation, see win_sparkle_set_http_backend()
+    enum HttpBackend
+    {
+        HttpBackend_WinINet,
+        HttpBackend_WinHTTP
+    };
+
+    static HttpBackend GetHttpBackend()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_httpBackend;
+    }
+
+    static void SetHttpBackend(HttpBackend backend)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_httpBackend = backend;
+    }
+
+    /// Maximum number of simultaneous connections to a single server
+    static int GetHttpMaxConnectionsPerServer()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_httpMaxConnections;
+    }
+
+    static void SetHttpMaxConnectionsPerServer(int count)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_httpMaxConnections = count;
+    }
+
+    /// Checking of TLS certificate revocation, see win_sparkle_set_revocation_check()
+    enum RevocationCheck
+    {
+        RevocationCheck_Default,
+        RevocationCheck_Strict,
+        RevocationCheck_SoftFail,
+        RevocationCheck_Disabled
+    };
+
+    static RevocationCheck GetRevocationCheck()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_revocationCheck;
+    }
+
+    static void SetRevocationCheck(RevocationCheck check)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_revocationCheck = check;
+    }
+
+    /// Window to center WinSparkle's windows on (HWND), if the app set it.
+    static void *GetHostWindow()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_hostWindow;
+    }
+
+    static void SetHostWindow(void *hwnd)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_hostWindow = hwnd;
+    }
+
+    /// Show the UI only when the app asks for it?
+    static bool GetHeadlessMode()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_headlessMode;
+    }
+
+    static void SetHeadlessMode(bool headless)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_headlessMode = headless;
+    }
+
+    /// Run the UI on the host's thread, instead of a thread of its own?
+    static bool GetUIOnHostThread()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_uiOnHostThread;
+    }
+
+    static void SetUIOnHostThread(bool onHostThread)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_uiOnHostThread = onHostThread;
+    }
+
+    /// Seconds without windows after which the UI thread exits, 0 = never
+    static int GetUIIdleTimeout()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_uiIdleTimeout;
+    }
+
+    static void SetUIIdleTimeout(int seconds)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_uiIdleTimeout = seconds;
+    }
+
+    /// Should updates be downloaded in the background before prompting?
+    static bool GetPreDownloadUpdates()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_preDownloadUpdates;
+    }
+
+    static void SetPreDownloadUpdates(bool predownload)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_preDownloadUpdates = predownload;
+    }
+
+    /// Should updates found in the background be installed on exit?
+    static bool GetInstallOnExit()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_installOnExit;
+    }
+
+    static void SetInstallOnExit(bool installOnExit)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_installOnExit = installOnExit;
+    }
+
+    /// Should update files be downloaded with BITS?
+    static bool GetBITSDownload()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_BITSDownload;
+    }
+
+    static void SetBITSDownload(bool bits)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_BITSDownload = bits;
+    }
+
+    /// Should background downloads of updates use low priority traffic?
+    static bool GetLowPriorityDownloads()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_lowPriorityDownloads;
+    }
+
+    static void SetLowPriorityDownloads(bool lowPriority)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_lowPriorityDownloads = lowPriority;
+    }
+
+    /// Should background downloads of updates wait for AC power?
+    static bool GetPowerAwareDownloads()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_powerAwareDownloads;
+    }
+
+    static void SetPowerAwareDownloads(bool powerAware)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_powerAwareDownloads = powerAware;
+    }
+
+    /// Should background work run at full speed only while the user is idle?
+    static bool GetIdleAwareDownloads()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_idleAwareDownloads;
+    }
+
+    static void SetIdleAwareDownloads(bool idleAware)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_idleAwareDownloads = idleAware;
+    }
+
+    /// Megabytes background downloads may use per day on metered connections.
+    static unsigned GetMeteredDownloadBudget()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_meteredDownloadBudget;
+    }
+
+    static void SetMeteredDownloadBudget(unsigned megabytes)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_meteredDownloadBudget = megabytes;
+    }
+
+    /// Directory to record HTTP responses into, empty if not recording.
+    static std::wstring GetHttpRecordingDirectory()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_httpRecordingDirectory;
+    }
+
+    static void SetHttpRecordingDirectory(const wchar_t *dir)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_httpRecordingDirectory = dir ? dir : L"";
+    }
+
+    /// Directory to replay HTTP responses from, empty to use the network.
+    static std::wstring GetHttpReplayDirectory()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_httpReplayDirectory;
+    }
+
+    /// Percentage of the recorded times to take when replaying.
+    static int GetHttpReplayTimeScale()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_httpReplayTimeScale;
+    }
+
+    static void SetHttpReplay(const wchar_t *dir, int timeScale)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_httpReplayDirectory = dir ? dir : L"";
+        ms_httpReplayTimeScale = timeScale;
+    }
+
+    /// URL to send telemetry to, empty if it's disabled.
+    static std::string GetTelemetryURL()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_telemetryURL;
+    }
+
+    static void SetTelemetryURL(const char *url)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_telemetryURL = url ? url : "";
+    }
+
+    /// Should update files be shared with other computers on the LAN?
+    static bool GetPeerCaching()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_peerCaching;
+    }
+
+    static void SetPeerCaching(bool peerCaching)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_peerCaching = peerCaching;
+    }
+
+    /// Should update files be downloaded with Delivery Optimization?
+    static bool GetDeliveryOptimization()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_deliveryOptimization;
+    }
+
+    static void SetDeliveryOptimization(bool deliveryOptimization)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_deliveryOptimization = deliveryOptimization;
+    }
+
+    /// Should verified update files be shared with other users of the computer?
+    static bool GetSharedUpdateCache()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_sharedUpdateCache;
+    }
+
+    static void SetSharedUpdateCache(bool shared)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_sharedUpdateCache = shared;
+    }
+
+    /// Should the appcast be taken from the service agent, if it's running?
+    static bool GetUseServiceAgent()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_useServiceAgent;
+    }
+
+    static void SetUseServiceAgent(bool use)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_useServiceAgent = use;
+    }
+
+    /// Maximum download rate in bytes per second, 0 if unlimited
+    static size_t GetMaxDownloadRate()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_maxDownloadRate;
+    }
+
+    static void SetMaxDownloadRate(size_t rate)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_maxDownloadRate = rate;
+    }
+
+    /// Largest update, in bytes, downloaded to a temporary file, 0 if none
+    static size_t GetTemporaryStagingLimit()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_temporaryStagingLimit;
+    }
+
+    static void SetTemporaryStagingLimit(size_t bytes)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_temporaryStagingLimit = bytes;
+    }
+
+    /// Should downloads slow down when other apps use the network?
+    static bool GetDownloadBackoff()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_downloadBackoff;
+    }
+
+    static void SetDownloadBackoff(bool backoff)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_downloadBackoff = backoff;
+    }
+
+    /// Maximum random delay added to periodic update checks, in seconds
+    static int GetUpdateCheckJitter()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_updateCheckJitter;
+    }
+
+    static void SetUpdateCheckJitter(int seconds)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_updateCheckJitter = seconds;
+    }
+
+    /// Shortest interval between adaptive update checks in seconds, see
+    /// win_sparkle_set_adaptive_check_interval()
+    static int GetMinAdaptiveCheckInterval()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_minAdaptiveCheckInterval;
+    }
+
+    /// Longest interval between adaptive update checks in seconds, 0 if
+    /// the checks aren't adaptive
+    static int GetMaxAdaptiveCheckInterval()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_maxAdaptiveCheckInterval;
+    }
+
+    static void SetAdaptiveCheckInterval(int minInterval, int maxInterval)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_minAdaptiveCheckInterval = minInterval;
+        ms_maxAdaptiveCheckInterval = maxInterval;
+    }
+
+    /// How much the system may delay periodic update checks, in seconds
+    static int GetUpdateCheckTolerance()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_updateCheckTolerance;
+    }
+
+    static void SetUpdateCheckTolerance(int seconds)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_updateCheckTolerance = seconds;
+    }
+
+    /**
+        Get the daily maintenance windows, to which background downloads
+        are limited, see win_sparkle_set_maintenance_windows(). Empty if
+        there are none.
+
+        Administrators can set them with a policy, which takes precedence.
+     */
+    static std::string GetMaintenanceWindows()
+    {
+        std::string policyWindows;
+        if ( ReadPolicyValue("MaintenanceWindows", policyWindows) )
+            return policyWindows;
+
+        ReadLocker lock(ms_lockVars);
+        return ms_maintenanceWindows;
+    }
+
+    static void SetMaintenanceWindows(const char *windows)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_maintenanceWindows = windows ? windows : "";
+    }
+
+    /// Open connections to the servers shortly before periodic checks?
+    static bool GetConnectionWarmup()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_connectionWarmup;
+    }
+
+    static void SetConnectionWarmup(bool warmup)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_connectionWarmup = warmup;
+    }
+
+    /// How long win_sparkle_cleanup() may wait for threads, in milliseconds
+    static int GetShutdownTimeout()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_shutdownTimeout;
+    }
+
+    static void SetShutdownTimeout(int milliseconds)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_shutdownTimeout = milliseconds;
+    }
+
+    /// Should win_sparkle_init() leave all I/O to a worker thread?
+    static bool GetDeferredInit()
+    {
+        ReadLocker lock(ms_lockVars);
+        return ms_deferredInit;
+    }
+
+    static void SetDeferredInit(bool deferred)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_deferredInit = deferred;
     }
 
     //@}
@@ -149,19 +766,19 @@ public:
 
     static Lang GetLanguage()
     {
-        CriticalSectionLocker lock(ms_csVars);
+        ReadLocker lock(ms_lockVars);
         return ms_lang;
     }
 
     static void SetLanguage(const char *lang)
     {
-        CriticalSectionLocker lock(ms_csVars);
+        WriteLocker lock(ms_lockVars);
         ms_lang.lang = lang;
     }
     
     static void SetLanguage(unsigned short langid)
     {
-        CriticalSectionLocker lock(ms_csVars);
+        WriteLocker lock(ms_lockVars);
         ms_lang.langid = langid;
     }
 
@@ -178,47 +795,163 @@ public:
     /// Set appcast location
     static void SetAppcastURL(const char *url)
     {
-        CriticalSectionLocker lock(ms_csVars);
+        WriteLocker lock(ms_lockVars);
         ms_appcastURL = url;
     }
 
     /// Set application name
     static void SetAppName(const wchar_t *name)
     {
-        CriticalSectionLocker lock(ms_csVars);
+        WriteLocker lock(ms_lockVars);
         ms_appName = name;
     }
 
     /// Set application version
     static void SetAppVersion(const wchar_t *version)
     {
-        CriticalSectionLocker lock(ms_csVars);
+        WriteLocker lock(ms_lockVars);
         ms_appVersion = version;
+        ms_hasAppBuildVersionKey = false;
     }
 
     /// Set application's build version number
     static void SetAppBuildVersion(const wchar_t *version)
     {
-        CriticalSectionLocker lock(ms_csVars);
+        WriteLocker lock(ms_lockVars);
         ms_appBuildVersion = version;
+        ms_hasAppBuildVersionKey = false;
     }
 
     /// Set company name
     static void SetCompanyName(const wchar_t *name)
     {
-        CriticalSectionLocker lock(ms_csVars);
+        WriteLocker lock(ms_lockVars);
         ms_companyName = name;
     }
 
-    /// Set Windows registry path to store settings in (relative to HKCU/KHLM).
-    static void SetRegistryPath(const char *path)
+    /**
+        Set URL of the appcast feed's EdDSA signature.
+
+        If set, the feed must be signed: it is rejected if it doesn't match
+        the signature.
+     */
+    static void SetAppcastSignatureURL(const char *url)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_appcastSignatureURL = url;
+    }
+
+    /// Set space-separated fallback URLs, see GetAppcastFallbackURLs().
+    static void SetAppcastFallbackURLs(const char *urls)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_appcastFallbackURLs = urls ? urls : "";
+    }
+
+    /// Add a feed to check with the appcast feed, see GetAdditionalFeeds().
+    static void AddAdditionalFeed(const std::string& url, FeedRole role)
+    {
+        AdditionalFeed feed;
+        feed.url = url;
+        feed.role = role;
+        WriteLocker lock(ms_lockVars);
+        ms_additionalFeeds.push_back(feed);
+    }
+
+    /// Remove all feeds added with AddAdditionalFeed().
+    static void ClearAdditionalFeeds()
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_additionalFeeds.clear();
+    }
+
+    /// Set update channels to accept updates from, see GetUpdateChannels().
+    static void SetUpdateChannels(const char *channels)
     {
-        CriticalSectionLocker lock(ms_csVars);
-        ms_registryPath = path;
+        WriteLocker lock(ms_lockVars);
+        ms_updateChannels = channels ? channels : "";
     }
 
+    /// Set URL of the document with the latest version, see GetLatestVersionURL().
+    static void SetLatestVersionURL(const char *url)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_latestVersionURL = url ? url : "";
+    }
+
+    /// Set URL announcing new releases, see GetUpdateNotificationURL().
+    static void SetUpdateNotificationURL(const char *url)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_updateNotificationURL = url ? url : "";
+    }
+
+    /// Set directory to download updates to, NULL or empty for the default.
+    static void SetStagingDirectory(const wchar_t *path)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_stagingDirectory = path ? path : L"";
+    }
+
+    /// Set whether to send filter hints, see GetAppcastFilterHints().
+    static void SetAppcastFilterHints(bool send)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_appcastFilterHints = send;
+    }
+
+    /// Set maximum size of the appcast feed, see GetMaxAppcastSize().
+    static void SetMaxAppcastSize(size_t bytes)
+    {
+        WriteLocker lock(ms_lockVars);
+        ms_maxAppcastSize = bytes;
+    }
+
+    /// Set Windows registry path to store settings in (relative to HKCU/KHLM).
+    static void SetRegistryPath(const char *path);
+
+    /**
+        Store runtime config values in file @a path instead of the registry.
+
+        Pass NULL or empty string to use the registry again. Changes not
+        written to the previous file yet are written first.
+     */
+    static void SetConfigFile(const wchar_t *path);
+
     /// Set PEM data and verify in contains valid DSA public key
     static void SetDSAPubKeyPem(const std::string &pem);
+
+    /// Set base64-encoded Ed25519 public key, throws if it isn't valid
+    static void SetEdDSAPubKey(const std::string &pubkey_base64);
+
+    /// Values for SetMetadata(), NULL members are left unchanged.
+    struct MetadataUpdate
+    {
+        MetadataUpdate()
+            : appcastURL(NULL), appcastSignatureURL(NULL),
+              companyName(NULL), appName(NULL), appVersion(NULL),
+              appBuildVersion(NULL), registryPath(NULL)
+        {}
+
+        const char *appcastURL;
+        const char *appcastSignatureURL;
+        const wchar_t *companyName;
+        const wchar_t *appName;
+        const wchar_t *appVersion;
+        const wchar_t *appBuildVersion;
+        const char *registryPath;
+        std::shared_ptr<const DSAPublicKey> dsaPubKey;
+        std::shared_ptr<const Ed25519PublicKey> eddsaPubKey;
+    };
+
+    /**
+        Set several metadata values at once.
+
+        Unlike calling the individual setters, the values are changed
+        together, so that other threads see either none or all of them.
+        The keys must already be parsed.
+     */
+    static void SetMetadata(const MetadataUpdate& update);
     //@}
 
 
@@ -231,12 +964,18 @@ public:
     //@{
 
     // Writes given value to registry under this name.
+    //
+    // Integer values (including bool and time_t) are stored as REG_DWORD or
+    // REG_QWORD, everything else as a string.
     template<typename T>
     static void WriteConfigValue(const char *name, const T& value)
     {
-        std::wostringstream s;
-        s << value;
-        DoWriteConfigValue(name, s.str().c_str());
+        DoWriteConfigValue(name, value, typename std::is_integral<T>::type());
+    }
+
+    static void WriteConfigValue(const char *name, bool value)
+    {
+        DoWriteConfigInteger(name, value ? 1 : 0, sizeof(DWORD));
     }
 
     static void WriteConfigValue(const char *name, const std::string& value)
@@ -254,12 +993,16 @@ public:
     template<typename T>
     static bool ReadConfigValue(const char *name, T& value)
     {
-        const std::wstring v = DoReadConfigValue(name);
-        if ( v.empty() )
+        return DoReadConfigValue(name, value, typename std::is_integral<T>::type());
+    }
+
+    static bool ReadConfigValue(const char *name, bool& value)
+    {
+        unsigned long long v;
+        if ( !DoReadConfigInteger(name, v) )
             return false;
-        std::wistringstream s(v);
-        s >> value;
-        return !s.fail();
+        value = (v != 0);
+        return true;
     }
 
     static bool ReadConfigValue(const char *name, std::string& value)
@@ -287,9 +1030,55 @@ public:
         return rv;
     }
 
+    // Writes binary data to registry under this name.
+    static void WriteConfigBlob(const char *name, const std::string& data);
+
+    // Reads binary data written by WriteConfigBlob(). Returns true if it
+    // was present, false otherwise.
+    static bool ReadConfigBlob(const char *name, std::string& data);
+
     // Deletes value from registry.
     static void DeleteConfigValue(const char *name);
 
+    // Writes changes that are only kept in memory so far, if the config
+    // file is used. Throws on error.
+    static void FlushConfig();
+
+    /**
+        Groups several config writes together.
+
+        While a Batch object exists, WriteConfigValue(), WriteConfigBlob()
+        and DeleteConfigValue() only change the in-memory copy of the
+        settings (which ReadConfigValue() sees) and the registry is updated
+        in one pass by Commit(). Where possible (Windows Vista and newer),
+        this is done in a registry transaction, so that either all or none
+        of the changes are made.
+
+        If the Batch is destroyed without calling Commit(), e.g. because of
+        an exception, the changes are discarded.
+
+        Batches can be nested, only the outermost one writes the changes,
+        provided all the nested ones were committed too.
+        Other threads can't access config values while a batch exists, so
+        keep its scope short.
+     */
+    class Batch
+    {
+    public:
+        Batch();
+        ~Batch();
+
+        /// Writes the changes to the registry. Throws on error.
+        void Commit();
+
+    private:
+        ISettingsStore *m_store;
+        bool m_committed;
+
+        Batch(const Batch&);
+        Batch& operator=(const Batch&);
+    };
+
     //@}
 
 private:
@@ -303,26 +1092,156 @@ private:
     static std::wstring TryGetVerInfoField(const wchar_t *field)
         { return DoGetVerInfoField(field, false); }
     static std::wstring DoGetVerInfoField(const wchar_t *field, bool fatal);
+    // Computes the cached forms of GetAppBuildVersion(), if not done yet
+    static void PrepareAppBuildVersion()
+    {
+        {
+            ReadLocker lock(ms_lockVars);
+            if ( ms_hasAppBuildVersionKey )
+                return;
+        }
+        const std::string version = WideToAnsi(GetAppBuildVersion());
+        const VersionKey key(version);
+        WriteLocker lock(ms_lockVars);
+        if ( !ms_hasAppBuildVersionKey )
+        {
+            ms_appBuildVersionUTF8 = version;
+            ms_appBuildVersionKey = key;
+            ms_hasAppBuildVersionKey = true;
+        }
+    }
+
+    // Returns value of a variable that defaults to a VERSIONINFO field
+    static std::wstring GetVerInfoValue(std::wstring& var, const wchar_t *field)
+    {
+        LoadConfigManifest();
+        {
+            ReadLocker lock(ms_lockVars);
+            if ( !var.empty() )
+                return var;
+        }
+        const std::wstring value = GetVerInfoField(field);
+        WriteLocker lock(ms_lockVars);
+        if ( var.empty() )
+            var = value;
+        return var;
+    }
     // Gets custom win32 resource data
     static std::string GetCustomResource(const char *name, const char *type);
 
     static std::string GetDefaultRegistryPath();
 
+    // Reads string value set by group policy, in the Software\Policies
+    // counterpart of the registry path. Returns false if not set.
+    static bool ReadPolicyValue(const char *name, std::string& value);
+
     static void DoWriteConfigValue(const char *name, const wchar_t *value);
     static std::wstring DoReadConfigValue(const char *name);
 
+    // Writes REG_DWORD if size is up to 4 bytes, REG_QWORD otherwise.
+    static void DoWriteConfigInteger(const char *name, unsigned long long value, size_t size);
+    // Reads REG_DWORD or REG_QWORD value, or REG_SZ written by older versions.
+    static bool DoReadConfigInteger(const char *name, unsigned long long& value);
+
+    template<typename T>
+    static void DoWriteConfigValue(const char *name, const T& value, std::true_type /*integral*/)
+    {
+        DoWriteConfigInteger(name, static_cast<unsigned long long>(value), sizeof(T));
+    }
+
+    template<typename T>
+    static void DoWriteConfigValue(const char *name, const T& value, std::false_type /*integral*/)
+    {
+        std::wostringstream s;
+        s << value;
+        DoWriteConfigValue(name, s.str().c_str());
+    }
+
+    template<typename T>
+    static bool DoReadConfigValue(const char *name, T& value, std::true_type /*integral*/)
+    {
+        unsigned long long v;
+        if ( !DoReadConfigInteger(name, v) )
+            return false;
+        value = static_cast<T>(v);
+        return true;
+    }
+
+    template<typename T>
+    static bool DoReadConfigValue(const char *name, T& value, std::false_type /*integral*/)
+    {
+        const std::wstring v = DoReadConfigValue(name);
+        if ( v.empty() )
+            return false;
+        std::wistringstream s(v);
+        s >> value;
+        return !s.fail();
+    }
+
 private:
-    // guards the variables below:
-    static CriticalSection ms_csVars;
+    // guards the variables below; readers don't block each other, but the
+    // lock is not recursive, so nothing that locks it may be called with it
+    // held:
+    static ReadWriteLock ms_lockVars;
 
     static Lang         ms_lang;
     static std::string  ms_appcastURL;
+    static std::string  ms_appcastSignatureURL;
+    static std::string  ms_appcastFallbackURLs;
+    static std::vector<AdditionalFeed> ms_additionalFeeds;
+    static std::string  ms_updateChannels;
+    static std::string  ms_latestVersionURL;
+    static std::string  ms_updateNotificationURL;
+    static std::wstring ms_stagingDirectory;
+    static size_t       ms_maxAppcastSize;
+    static bool         ms_appcastFilterHints;
     static std::string  ms_registryPath;
     static std::wstring ms_companyName;
     static std::wstring ms_appName;
     static std::wstring ms_appVersion;
     static std::wstring ms_appBuildVersion;
-    static std::string  ms_DSAPubKey;
+    static std::string  ms_appBuildVersionUTF8;
+    static VersionKey   ms_appBuildVersionKey;
+    static bool         ms_hasAppBuildVersionKey;
+    static std::shared_ptr<const DSAPublicKey> ms_DSAPubKey;
+    static bool         ms_DSAPubKeyLoaded;
+    static std::shared_ptr<const Ed25519PublicKey> ms_EdDSAPubKey;
+    static bool         ms_EdDSAPubKeyLoaded;
+    static bool         ms_configManifestLoaded;
+    static bool         ms_authenticodeCheck;
+    static HttpBackend  ms_httpBackend;
+    static int          ms_httpMaxConnections;
+    static RevocationCheck ms_revocationCheck;
+    static bool         ms_preDownloadUpdates;
+    static bool         ms_installOnExit;
+    static bool         ms_BITSDownload;
+    static bool         ms_lowPriorityDownloads;
+    static bool         ms_powerAwareDownloads;
+    static bool         ms_idleAwareDownloads;
+    static unsigned     ms_meteredDownloadBudget;
+    static std::wstring ms_httpRecordingDirectory;
+    static std::wstring ms_httpReplayDirectory;
+    static int          ms_httpReplayTimeScale;
+    static std::string  ms_telemetryURL;
+    static bool         ms_peerCaching;
+    static bool         ms_deliveryOptimization;
+    static bool         ms_sharedUpdateCache;
+    static bool         ms_useServiceAgent;
+    static size_t       ms_maxDownloadRate;
+    static size_t       ms_temporaryStagingLimit;
+    static bool         ms_downloadBackoff;
+    static int          ms_updateCheckJitter;
+    static int          ms_minAdaptiveCheckInterval;
+    static int          ms_maxAdaptiveCheckInterval;
+    static int          ms_updateCheckTolerance;
+    static std::string  ms_maintenanceWindows;
+    static bool         ms_connectionWarmup;
+    static int          ms_shutdownTimeout;
+    static bool         ms_headlessMode;
+    static bool         ms_uiOnHostThread;
+    static int          ms_uiIdleTimeout;
+    static void        *ms_hostWindow;
+    static bool         ms_deferredInit;
 };
 
 } // namespace winsparkle
@@ -0,0 +1,327 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "settingsstore.h"
+
+#include "error.h"
+
+#include <string.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// File format: FILE_MAGIC, then records of
+//   DWORD name length, name, DWORD type, DWORD data length, data
+const char FILE_MAGIC[] = "WinSparkle settings 1\n";
+const size_t FILE_MAGIC_LEN = sizeof(FILE_MAGIC) - 1;
+
+// how long to wait for more changes before writing the file (ms)
+const DWORD FLUSH_DELAY = 2000;
+
+void AppendDWORD(std::string& out, DWORD value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool ReadDWORD(const std::string& in, size_t& pos, DWORD& value)
+{
+    if ( in.size() - pos < sizeof(value) )
+        return false;
+    memcpy(&value, in.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+bool ReadChunk(const std::string& in, size_t& pos, std::string& value)
+{
+    DWORD len;
+    if ( !ReadDWORD(in, pos, len) || in.size() - pos < len )
+        return false;
+    value.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                            FileSettingsStore
+ *--------------------------------------------------------------------------*/
+
+FileSettingsStore::FileSettingsStore(const std::wstring& path)
+    : m_path(path),
+      m_loaded(false),
+      m_dirty(false),
+      m_batchDepth(0),
+      m_batchFailed(false),
+      m_timer(NULL),
+      m_flushScheduled(false)
+{
+}
+
+
+void FileSettingsStore::Load()
+{
+    m_loaded = true;
+    m_values.clear();
+
+    HANDLE file = CreateFile(m_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                             NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if ( file == INVALID_HANDLE_VALUE )
+    {
+        if ( GetLastError() == ERROR_FILE_NOT_FOUND || GetLastError() == ERROR_PATH_NOT_FOUND )
+            return; // no settings saved yet
+        m_loaded = false;
+        throw Win32Exception("Cannot read settings file");
+    }
+
+    std::string content;
+    LARGE_INTEGER size;
+    bool ok = GetFileSizeEx(file, &size) && size.HighPart == 0;
+    if ( ok )
+    {
+        content.resize(size.LowPart);
+        DWORD read = 0;
+        ok = size.LowPart == 0 ||
+             (ReadFile(file, &content[0], size.LowPart, &read, NULL) && read == size.LowPart);
+    }
+    CloseHandle(file);
+
+    if ( !ok )
+    {
+        m_loaded = false;
+        throw Win32Exception("Cannot read settings file");
+    }
+
+    // A damaged file is treated as empty, there's nothing better to do with
+    // it and it will be rewritten on next change anyway.
+    if ( content.compare(0, FILE_MAGIC_LEN, FILE_MAGIC) != 0 )
+        return;
+
+    size_t pos = FILE_MAGIC_LEN;
+    while ( pos < content.size() )
+    {
+        std::string name;
+        Value v;
+        if ( !ReadChunk(content, pos, name) ||
+             !ReadDWORD(content, pos, v.type) ||
+             !ReadChunk(content, pos, v.data) )
+        {
+            m_values.clear();
+            return;
+        }
+        m_values[name] = v;
+    }
+}
+
+
+bool FileSettingsStore::Read(const char *name, const DWORD *types, DWORD& type, std::string& data)
+{
+    CriticalSectionLocker lock(m_cs);
+
+    if ( !m_loaded )
+        Load();
+
+    Values::const_iterator i = m_values.find(name);
+    if ( i == m_values.end() )
+        return false;
+
+    for ( ; *types != REG_NONE; types++ )
+    {
+        if ( i->second.type == *types )
+        {
+            type = i->second.type;
+            data = i->second.data;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void FileSettingsStore::Write(const char *name, DWORD type, const void *data, DWORD size)
+{
+    CriticalSectionLocker lock(m_cs);
+
+    if ( !m_loaded )
+        Load();
+
+    Value& v = m_values[name];
+    v.type = type;
+    v.data.assign(static_cast<const char*>(data), size);
+    Changed();
+}
+
+
+void FileSettingsStore::Delete(const char *name)
+{
+    CriticalSectionLocker lock(m_cs);
+
+    if ( !m_loaded )
+        Load();
+
+    if ( m_values.erase(name) )
+        Changed();
+}
+
+
+void FileSettingsStore::BeginBatch()
+{
+    CriticalSectionLocker lock(m_cs);
+
+    if ( !m_loaded )
+        Load();
+
+    if ( m_batchDepth++ == 0 )
+    {
+        m_batchFailed = false;
+        m_beforeBatch = m_values;
+    }
+}
+
+
+void FileSettingsStore::EndBatch(bool commit)
+{
+    CriticalSectionLocker lock(m_cs);
+
+    if ( !commit )
+        m_batchFailed = true;
+    if ( --m_batchDepth > 0 )
+        return;
+
+    if ( m_batchFailed )
+        m_values.swap(m_beforeBatch);
+    m_beforeBatch.clear();
+
+    if ( m_dirty )
+        ScheduleFlush();
+}
+
+
+void FileSettingsStore::Changed()
+{
+    m_dirty = true;
+
+    // the file is written once the batch ends, not in the middle of it
+    if ( m_batchDepth == 0 )
+        ScheduleFlush();
+}
+
+
+void FileSettingsStore::ScheduleFlush()
+{
+    if ( m_flushScheduled )
+        return;
+
+    if ( m_timer )
+    {
+        // previous timer already fired, it can be deleted without waiting
+        DeleteTimerQueueTimer(NULL, m_timer, NULL);
+        m_timer = NULL;
+    }
+
+    if ( CreateTimerQueueTimer(&m_timer, NULL, &OnFlushTimer, this, FLUSH_DELAY, 0, WT_EXECUTEONLYONCE) )
+    {
+        m_flushScheduled = true;
+    }
+    else
+    {
+        m_timer = NULL;
+        Flush();
+    }
+}
+
+
+void CALLBACK FileSettingsStore::OnFlushTimer(PVOID param, BOOLEAN /*timedOut*/)
+{
+    // runs on a thread pool thread
+    FileSettingsStore *self = static_cast<FileSettingsStore*>(param);
+    CriticalSectionLocker lock(self->m_cs);
+
+    self->m_flushScheduled = false;
+    if ( self->m_batchDepth > 0 )
+        return; // EndBatch() will schedule it again
+
+    try
+    {
+        self->Flush();
+    }
+    catch ( std::exception& e )
+    {
+        LogError(e.what());
+    }
+}
+
+
+void FileSettingsStore::Flush()
+{
+    CriticalSectionLocker lock(m_cs);
+
+    if ( !m_dirty )
+        return;
+
+    std::string content(FILE_MAGIC, FILE_MAGIC_LEN);
+    for ( Values::const_iterator i = m_values.begin(); i != m_values.end(); ++i )
+    {
+        AppendDWORD(content, (DWORD)i->first.size());
+        content.append(i->first);
+        AppendDWORD(content, i->second.type);
+        AppendDWORD(content, (DWORD)i->second.data.size());
+        content.append(i->second.data);
+    }
+
+    // Write a temporary file and move it over the old one, so that the
+    // settings are never lost by the application crashing midway.
+    const std::wstring tmpPath = m_path + L".tmp";
+    HANDLE file = CreateFile(tmpPath.c_str(), GENERIC_WRITE, 0, NULL,
+                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE )
+        throw Win32Exception("Cannot write settings file");
+
+    DWORD written = 0;
+    bool ok = WriteFile(file, content.data(), (DWORD)content.size(), &written, NULL) &&
+              written == content.size() &&
+              FlushFileBuffers(file);
+    CloseHandle(file);
+
+    if ( !ok || !MoveFileEx(tmpPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) )
+    {
+        DeleteFile(tmpPath.c_str());
+        throw Win32Exception("Cannot write settings file");
+    }
+
+    m_dirty = false;
+}
+
+} // namespace winsparkle
@@ -0,0 +1,141 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _settingsstore_h_
+#define _settingsstore_h_
+
+#include "threads.h"
+
+#include <windows.h>
+#include <map>
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Storage of WinSparkle's runtime config values.
+
+    Values are raw data tagged with registry value types (REG_SZ, REG_DWORD,
+    REG_QWORD, REG_BINARY), regardless of where they are actually stored.
+
+    The registry is used by default, see Settings::SetConfigFile() for the
+    alternative.
+ */
+struct ISettingsStore
+{
+    virtual ~ISettingsStore() {}
+
+    /**
+        Reads raw data of a value.
+
+        @param name   Name of the value.
+        @param types  Acceptable types, terminated by REG_NONE. A value of
+                      some other type is treated as not present.
+        @param type   Set to the actual type of the value.
+        @param data   Set to the value's data.
+
+        @return false if there's no such value. Throws on error.
+     */
+    virtual bool Read(const char *name, const DWORD *types, DWORD& type, std::string& data) = 0;
+
+    /// Writes a value. Throws on error.
+    virtual void Write(const char *name, DWORD type, const void *data, DWORD size) = 0;
+
+    /// Deletes a value, if it exists. Throws on error.
+    virtual void Delete(const char *name) = 0;
+
+    /// Starts collecting changes, see Settings::Batch.
+    virtual void BeginBatch() = 0;
+
+    /// Ends BeginBatch(), writing the changes or discarding them.
+    virtual void EndBatch(bool commit) = 0;
+
+    /// Writes any changes that weren't stored yet. Throws on error.
+    virtual void Flush() {}
+};
+
+
+/**
+    ISettingsStore keeping the values in a single file.
+
+    This is meant for portable installations and for machines that don't
+    keep the registry between sessions. The file is read once, on first
+    access; changes are kept in memory and written a moment later, after
+    a series of changes, or by Flush(). The file is replaced atomically,
+    so it is never seen half-written.
+
+    Changes made to the file by other processes are not picked up.
+ */
+class FileSettingsStore : public ISettingsStore
+{
+public:
+    /// Uses file @a path, which doesn't need to exist yet.
+    FileSettingsStore(const std::wstring& path);
+
+    virtual bool Read(const char *name, const DWORD *types, DWORD& type, std::string& data);
+    virtual void Write(const char *name, DWORD type, const void *data, DWORD size);
+    virtual void Delete(const char *name);
+    virtual void BeginBatch();
+    virtual void EndBatch(bool commit);
+    virtual void Flush();
+
+private:
+    struct Value
+    {
+        DWORD type;
+        std::string data;
+    };
+
+    // value names are case-insensitive, as in the registry
+    struct NameLess
+    {
+        bool operator()(const std::string& a, const std::string& b) const
+            { return _stricmp(a.c_str(), b.c_str()) < 0; }
+    };
+    typedef std::map<std::string, Value, NameLess> Values;
+
+    void Load();
+    void Changed();
+    void ScheduleFlush();
+    static void CALLBACK OnFlushTimer(PVOID param, BOOLEAN timedOut);
+
+    CriticalSection m_cs;
+    std::wstring m_path;
+    bool m_loaded;
+    bool m_dirty;
+    Values m_values;
+
+    int m_batchDepth;
+    bool m_batchFailed;
+    Values m_beforeBatch;
+
+    HANDLE m_timer;
+    bool m_flushScheduled;
+};
+
+} // namespace winsparkle
+
+#endif // _settingsstore_h_
@@ -25,22 +25,38 @@
 
 #include "signatureverifier.h"
 
+#include "ed25519.h"
 #include "error.h"
+#include "hashengine.h"
 #include "settings.h"
+#include "threads.h"
 #include "utils.h"
 
+#ifndef WIN_SPARKLE_NO_OPENSSL
 #include <openssl/dsa.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
-#include <openssl/sha.h>
+#endif
 
+#include <cstring>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
 
 #include <windows.h>
 #include <wincrypt.h>
+#include <wintrust.h>
+#include <softpub.h>
+#ifdef WIN_SPARKLE_NO_OPENSSL
+#include <bcrypt.h>
+#endif
 
 #ifdef _MSC_VER
 #pragma comment(lib, "crypt32.lib")
+#pragma comment(lib, "wintrust.lib")
+#ifdef WIN_SPARKLE_NO_OPENSSL
+#pragma comment(lib, "bcrypt.lib")
+#endif
 #endif
 
 namespace winsparkle
@@ -49,111 +65,315 @@ namespace winsparkle
 namespace
 {
 
-class CFile
+class Win32File
 {
-    FILE *f;
-    CFile(const CFile &);
-    CFile &operator=(const CFile &);
+    HANDLE h;
+    Win32File(const Win32File &);
+    Win32File &operator=(const Win32File &);
 public:
-    CFile(FILE *file): f(file) {}
+    Win32File(HANDLE handle): h(handle) {}
 
-    operator FILE*()
+    operator HANDLE()
     {
-        return f;
+        return h;
+    }
+
+    bool IsOk() const
+    {
+        return h != INVALID_HANDLE_VALUE;
     }
 
-    ~CFile()
+    ~Win32File()
     {
-        if (f)
-            fclose(f);
+        if (IsOk())
+            CloseHandle(h);
     }
 };
 
-class WinCryptRSAContext
+// Reads the whole file, passing it to process(data, len) in large blocks.
+// Returns the file's size. Stops between blocks if cancel is cancelled.
+template<typename Func>
+size_t ReadFileInBlocks(const std::wstring &filename, Func process,
+                        const CancellationToken *cancel = NULL)
 {
-    HCRYPTPROV handle;
+    // The file is read once from start to end, so let the cache manager
+    // know to read ahead aggressively and not to keep the data around.
+    Win32File f(CreateFileW(filename.c_str(),
+                            GENERIC_READ,
+                            FILE_SHARE_READ,
+                            NULL,
+                            OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                            NULL));
+    if (!f.IsOk())
+        throw std::runtime_error(WideToAnsi(L"Failed to open file " + filename));
 
-    WinCryptRSAContext(const WinCryptRSAContext &);
-    WinCryptRSAContext &operator=(const WinCryptRSAContext &);
-public:
-    WinCryptRSAContext()
-    {
-        if (!CryptAcquireContextW(&handle, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
-            throw Win32Exception("Failed to create crypto context");
-    }
+    // large reads make far fewer round-trips on network drives
+    const DWORD BUF_SIZE = 1024 * 1024;
+    std::vector<unsigned char> buf(BUF_SIZE);
 
-    ~WinCryptRSAContext()
+    size_t total = 0;
+    for (;;)
     {
-        if (!CryptReleaseContext(handle, 0))
-            LogError("Failed to release crypto context");
+        if (cancel)
+            cancel->ThrowIfCancelled();
+        BackgroundPriority::Refresh();
+
+        DWORD read_bytes = 0;
+        if (!ReadFile(f, &buf[0], BUF_SIZE, &read_bytes, NULL))
+            throw std::runtime_error(WideToAnsi(L"Failed to read file " + filename));
+        if (read_bytes == 0)
+            break;
+        process(&buf[0], read_bytes);
+        total += read_bytes;
     }
 
-    operator HCRYPTPROV()
+    return total;
+}
+
+/*
+    Chunked digest of a file, computed by several threads in parallel.
+
+    The file is split into CHUNKED_DIGEST_CHUNK_SIZE bytes long chunks (the
+    last one may be shorter) and the digest is SHA-256 of the concatenated
+    SHA-256 hashes of all chunks. Unlike a plain hash of the whole file, the
+    chunks can be hashed independently, so it scales with available cores.
+ */
+const ULONGLONG CHUNKED_DIGEST_CHUNK_SIZE = SignatureVerifier::CHUNKED_DIGEST_CHUNK_SIZE;
+
+// don't start more threads than this, the disk can't keep up anyway
+const DWORD CHUNKED_DIGEST_MAX_THREADS = 8;
+
+// Returns the number of processors the process may run on, which is less
+// than the machine has if its affinity is restricted, e.g. by a job object.
+DWORD GetUsableProcessorCount()
+{
+    DWORD_PTR processMask, systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) && processMask)
     {
-        return handle;
+        DWORD count = 0;
+        for (; processMask; processMask &= processMask - 1)
+            count++;
+        return count;
     }
-};
 
-class WinCryptSHA1Hash
-{
-    HCRYPTHASH handle;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+}
 
-    WinCryptSHA1Hash(const WinCryptSHA1Hash&);
-    WinCryptSHA1Hash& operator=(const WinCryptSHA1Hash &);
+class ChunkedFileDigest
+{
 public:
-    WinCryptSHA1Hash(WinCryptRSAContext &context)
+    ChunkedFileDigest(const std::wstring &filename, const CancellationToken *cancel)
+        : m_filename(filename), m_cancel(cancel), m_nextChunk(-1), m_chunks(0)
+    {
+    }
+
+    std::string Compute()
     {
-        if (!CryptCreateHash(HCRYPTPROV(context), CALG_SHA1, 0, 0, &handle))
-            throw Win32Exception("Failed to create crypto hash");
+        const std::string hashes = ComputeChunkHashes();
+        return HashEngine::HashData(Hash_SHA256, hashes.data(), hashes.size());
     }
 
-    ~WinCryptSHA1Hash()
+    // Returns the concatenated hashes of the chunks.
+    std::string ComputeChunkHashes()
     {
-        if (handle)
         {
-            if (!CryptDestroyHash(handle))
-            {
-                LogError("Failed to destroy crypto hash");
-            }
+            Win32File f(OpenFile());
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(f, &size))
+                throw std::runtime_error(WideToAnsi(L"Failed to read file " + m_filename));
+            m_size = size.QuadPart;
+        }
+
+        const ULONGLONG chunks = (m_size + CHUNKED_DIGEST_CHUNK_SIZE - 1) / CHUNKED_DIGEST_CHUNK_SIZE;
+        if (chunks > 0x7FFFFFFF)
+            throw std::runtime_error("File is too large");
+        m_chunks = LONG(chunks);
+
+        const size_t hashSize = HashEngine::GetDigestSize(Hash_SHA256);
+        m_hashes.resize(size_t(m_chunks) * hashSize);
+
+        DWORD threads = GetUsableProcessorCount();
+        if (threads > CHUNKED_DIGEST_MAX_THREADS)
+            threads = CHUNKED_DIGEST_MAX_THREADS;
+        if (threads > DWORD(m_chunks))
+            threads = DWORD(m_chunks);
+
+        // the calling thread hashes chunks too; the workers do it in the
+        // background as well if it does.
+        const bool background = BackgroundPriority::IsCurrentThreadInBackground();
+        {
+            Workers workers;
+            for (DWORD i = 1; i < threads; i++)
+                workers.Start(new Worker(*this, background));
+
+            HashChunks();
+
+            workers.JoinAll(m_cancel);
         }
+
+        return m_hashes;
     }
 
-    void hashData(const void *buffer, size_t buffer_len)
+private:
+    HANDLE OpenFile()
     {
-        if (!CryptHashData(handle, (CONST BYTE  *)buffer, buffer_len, 0))
-            throw Win32Exception("Failed to hash data");
+        HANDLE f = CreateFileW(m_filename.c_str(),
+                               GENERIC_READ,
+                               FILE_SHARE_READ,
+                               NULL,
+                               OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+        if (f == INVALID_HANDLE_VALUE)
+            throw std::runtime_error(WideToAnsi(L"Failed to open file " + m_filename));
+        return f;
     }
 
-    void hashFile(const std::wstring &filename)
+    // Hashes chunks until there are none left; run by several threads.
+    void HashChunks()
     {
-        CFile f (_wfopen(filename.c_str(), L"rb"));
-        if (!f)
-            throw std::runtime_error(WideToAnsi(L"Failed to open file " + filename));
+        Win32File f(OpenFile());
+        std::unique_ptr<Hash> hash(HashEngine::CreateHash(Hash_SHA256));
 
-        const int BUF_SIZE = 8192;
-        unsigned char buf[BUF_SIZE];
+        const DWORD BUF_SIZE = 1024 * 1024;
+        std::vector<unsigned char> buf(BUF_SIZE);
 
-        while (size_t read_bytes = fread(buf, 1, BUF_SIZE, f))
+        for (;;)
         {
-            hashData(buf, read_bytes);
-        }
+            const LONG chunk = InterlockedIncrement(&m_nextChunk);
+            if (chunk >= m_chunks)
+                break;
 
-        if (ferror(f))
-            throw std::runtime_error(WideToAnsi(L"Failed to read file " + filename));
+            ULONGLONG offset = ULONGLONG(chunk) * CHUNKED_DIGEST_CHUNK_SIZE;
+            ULONGLONG remaining = m_size - offset;
+            if (remaining > CHUNKED_DIGEST_CHUNK_SIZE)
+                remaining = CHUNKED_DIGEST_CHUNK_SIZE;
+
+            while (remaining)
+            {
+                if (m_cancel)
+                    m_cancel->ThrowIfCancelled();
+                BackgroundPriority::Refresh();
+
+                OVERLAPPED ov = { 0 };
+                ov.Offset = DWORD(offset & 0xFFFFFFFF);
+                ov.OffsetHigh = DWORD(offset >> 32);
+
+                const DWORD toRead = remaining < BUF_SIZE ? DWORD(remaining) : BUF_SIZE;
+                DWORD read_bytes = 0;
+                if (!ReadFile(f, &buf[0], toRead, &read_bytes, &ov) || read_bytes == 0)
+                    throw std::runtime_error(WideToAnsi(L"Failed to read file " + m_filename));
+
+                hash->Update(&buf[0], read_bytes);
+                offset += read_bytes;
+                remaining -= read_bytes;
+            }
+
+            const std::string digest = hash->Finish();
+            memcpy(&m_hashes[size_t(chunk) * digest.size()], digest.data(), digest.size());
+        }
     }
 
-    void sha1Val(unsigned char(&sha1)[SHA_DIGEST_LENGTH])
+    class Worker : public Thread
     {
-        DWORD hash_len = SHA_DIGEST_LENGTH;
-        if (!CryptGetHashParam(handle, HP_HASHVAL, sha1, &hash_len, 0))
-            throw Win32Exception("Failed to get SHA1 val");
-    }
+    public:
+        Worker(ChunkedFileDigest& owner, bool background)
+            : Thread("WinSparkle signature check"), m_owner(owner), m_background(background) {}
+
+        const std::string& GetError() const { return m_error; }
+
+    protected:
+        virtual void Run()
+        {
+            SignalReady();
+
+            std::unique_ptr<BackgroundPriority> priority;
+            if (m_background)
+                priority.reset(new BackgroundPriority);
+
+            try
+            {
+                m_owner.HashChunks();
+            }
+            catch (const OperationCancelledException&)
+            {
+                m_error = "Cancelled.";
+            }
+            catch (const std::exception& e)
+            {
+                m_error = e.what();
+            }
+            catch (...)
+            {
+                m_error = "Unknown error.";
+            }
+        }
+
+        virtual bool IsJoinable() const { return true; }
+
+    private:
+        ChunkedFileDigest& m_owner;
+        const bool m_background;
+        std::string m_error;
+    };
 
+    // Owns running Worker threads; joins them even if hashing failed.
+    class Workers
+    {
+    public:
+        ~Workers()
+        {
+            for (size_t i = 0; i < m_threads.size(); i++)
+            {
+                m_threads[i]->Join();
+                delete m_threads[i];
+            }
+        }
+
+        void Start(Worker *thread)
+        {
+            std::unique_ptr<Worker> guard(thread);
+            thread->Start();
+            m_threads.push_back(guard.release());
+        }
+
+        // Waits for all threads to finish, throws if any of them failed.
+        void JoinAll(const CancellationToken *cancel)
+        {
+            for (size_t i = 0; i < m_threads.size(); i++)
+                m_threads[i]->Join();
+
+            // a cancelled worker fails too, but that's not a bad signature
+            if (cancel)
+                cancel->ThrowIfCancelled();
+
+            for (size_t i = 0; i < m_threads.size(); i++)
+            {
+                if (!m_threads[i]->GetError().empty())
+                    throw std::runtime_error(m_threads[i]->GetError());
+            }
+        }
+
+    private:
+        std::vector<Worker*> m_threads;
+    };
+
+    std::wstring m_filename;
+    const CancellationToken *m_cancel;
+    ULONGLONG m_size;
+    volatile LONG m_nextChunk;
+    LONG m_chunks;
+    std::string m_hashes;
 };
 
 /**
-    Light-weight dynamic loader of OpenSSL library.
-    Loads only minimum required symbols, just enough to verify DSA SHA1 signature of the file.
+    DSA SHA1 signature verification of files and digests.
+
+    The DSA part itself is done by DSAPublicKey, using either OpenSSL or,
+    in WIN_SPARKLE_NO_OPENSSL builds, Windows CNG.
  */
 class TinySSL
 {
@@ -171,35 +391,25 @@ public:
 
     void VerifyDSASHA1Signature(const std::wstring &filename, const std::string &signature)
     {
-        unsigned char sha1[SHA_DIGEST_LENGTH];
+        std::unique_ptr<Hash> hash(HashEngine::CreateHash(Hash_SHA1));
+        ReadFileInBlocks(filename, [&hash](const void *data, size_t len) { hash->Update(data, len); });
 
-        {
-            WinCryptRSAContext ctx;
-            // SHA1 of file
-            {
-                WinCryptSHA1Hash hash(ctx);
-                hash.hashFile(filename);
-                hash.sha1Val(sha1);
-            }
-            // SHA1 of SHA1 of file
-            {
-                WinCryptSHA1Hash hash(ctx);
-                hash.hashData(sha1, ARRAYSIZE(sha1));
-                hash.sha1Val(sha1);
-            }
-        }
-
-        DSAPub pubKey(Settings::GetDSAPubKeyPem());
+        VerifyDSASHA1DigestSignature(hash->Finish(), signature);
+    }
 
-        const int code = DSA_verify(0, sha1, ARRAYSIZE(sha1), (const unsigned char*)signature.c_str(), signature.size(), pubKey);
+    void VerifyDSASHA1DigestSignature(const std::string &sha1, const std::string &signature)
+    {
+        // SHA1 of SHA1 of file
+        const std::string digest = HashEngine::HashData(Hash_SHA1, sha1.data(), sha1.size());
 
-        if (code == -1) // OpenSSL error
-            throw BadSignatureException(ERR_error_string(ERR_get_error(), nullptr));
+        const std::shared_ptr<const DSAPublicKey> pubKey = Settings::GetDSAPubKey();
+        if (!pubKey)
+            throw std::invalid_argument("Missing DSA public key");
 
-        if (code != 1)
-            throw BadSignatureException();
+        pubKey->Verify((const unsigned char*)digest.data(), digest.size(), signature);
     }
 
+#ifndef WIN_SPARKLE_NO_OPENSSL
 private:
     class BIOWrap
     {
@@ -258,9 +468,152 @@ public:
         }
 
     }; // DSAWrap
+#endif // !WIN_SPARKLE_NO_OPENSSL
 
 }; // TinySSL
 
+/*
+    DSA public key in the SubjectPublicKeyInfo form (as read by OpenSSL's
+    PEM_read_bio_DSA_PUBKEY()), decoded by crypt32.
+
+    This is enough to reject obviously wrong keys when they are set, without
+    touching OpenSSL until a signature actually has to be verified.
+ */
+class DSAPublicKeyInfo
+{
+public:
+    explicit DSAPublicKeyInfo(const std::string &pem) : m_info(NULL)
+    {
+        DWORD derSize = 0;
+        if ( pem.empty() ||
+             !CryptStringToBinaryA(pem.c_str(), DWORD(pem.size()), CRYPT_STRING_BASE64HEADER, NULL, &derSize, NULL, NULL) )
+        {
+            throw std::invalid_argument("Cannot read DSA public key from PEM");
+        }
+
+        std::vector<BYTE> der(derSize);
+        if ( !CryptStringToBinaryA(pem.c_str(), DWORD(pem.size()), CRYPT_STRING_BASE64HEADER, der.data(), &derSize, NULL, NULL) )
+            throw std::invalid_argument("Cannot read DSA public key from PEM");
+
+        DWORD infoSize = 0;
+        if ( !CryptDecodeObjectEx(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, X509_PUBLIC_KEY_INFO,
+                                  der.data(), derSize, CRYPT_DECODE_ALLOC_FLAG, NULL, &m_info, &infoSize) )
+        {
+            m_info = NULL;
+            throw std::invalid_argument("Cannot read DSA public key from PEM");
+        }
+
+        if ( !m_info->Algorithm.pszObjId || strcmp(m_info->Algorithm.pszObjId, szOID_X957_DSA) != 0 )
+        {
+            LocalFree(m_info);
+            throw std::invalid_argument("PEM data don't contain a DSA public key");
+        }
+    }
+
+    ~DSAPublicKeyInfo()
+    {
+        LocalFree(m_info);
+    }
+
+    CERT_PUBLIC_KEY_INFO *Get() const { return m_info; }
+
+#ifdef WIN_SPARKLE_NO_OPENSSL
+    // Returns the size of the DSA subgroup order q in bytes, i.e. of r and s.
+    size_t GetGroupSize() const
+    {
+        const CRYPT_OBJID_BLOB &params = m_info->Algorithm.Parameters;
+
+        CERT_DSS_PARAMETERS *dss = NULL;
+        DWORD dssSize = 0;
+        if ( !CryptDecodeObjectEx(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, X509_DSS_PARAMETERS,
+                                  params.pbData, params.cbData, CRYPT_DECODE_ALLOC_FLAG, NULL, &dss, &dssSize) )
+        {
+            throw std::invalid_argument("Cannot read DSA key parameters");
+        }
+
+        // the integer is little-endian, ignore any zero padding at its end
+        size_t size = dss->q.cbData;
+        while ( size > 0 && dss->q.pbData[size - 1] == 0 )
+            size--;
+        LocalFree(dss);
+        return size;
+    }
+#endif // WIN_SPARKLE_NO_OPENSSL
+
+private:
+    DSAPublicKeyInfo(const DSAPublicKeyInfo&);
+    DSAPublicKeyInfo& operator=(const DSAPublicKeyInfo&);
+
+    CERT_PUBLIC_KEY_INFO *m_info;
+};
+
+#ifdef WIN_SPARKLE_NO_OPENSSL
+
+// NTSTATUS returned by BCryptVerifySignature() for a signature that doesn't match
+const NTSTATUS CNG_STATUS_INVALID_SIGNATURE = NTSTATUS(0xC000A000L);
+
+// Reads DER tag and length of an element, returns the length of its content.
+size_t ReadDERHeader(const unsigned char *&p, const unsigned char *end, unsigned char tag)
+{
+    if ( end - p < 2 || *p++ != tag )
+        throw BadSignatureException("malformed DSA signature");
+
+    size_t len = *p++;
+    if ( len & 0x80 )
+    {
+        size_t bytes = len & 0x7f;
+        if ( bytes == 0 || bytes > 2 || size_t(end - p) < bytes )
+            throw BadSignatureException("malformed DSA signature");
+        len = 0;
+        while ( bytes-- )
+            len = (len << 8) | *p++;
+    }
+
+    if ( size_t(end - p) < len )
+        throw BadSignatureException("malformed DSA signature");
+    return len;
+}
+
+// Appends DER INTEGER to @a out as big-endian number of exactly @a size bytes.
+void AppendDERInteger(const unsigned char *&p, const unsigned char *end, size_t size, std::vector<UCHAR> &out)
+{
+    size_t len = ReadDERHeader(p, end, 0x02);
+    const unsigned char *value = p;
+    p += len;
+
+    while ( len > 0 && *value == 0 )
+    {
+        value++;
+        len--;
+    }
+    if ( len > size )
+        throw BadSignatureException("malformed DSA signature");
+
+    out.insert(out.end(), size - len, 0);
+    out.insert(out.end(), value, value + len);
+}
+
+/*
+    Converts OpenSSL's DSA signature, DER-encoded SEQUENCE of r and s, to
+    the concatenation of fixed size r and s expected by CNG.
+ */
+std::vector<UCHAR> DERToCNGSignature(const std::string &signature, size_t groupSize)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(signature.data());
+    const unsigned char *end = p + signature.size();
+
+    const size_t seqLen = ReadDERHeader(p, end, 0x30);
+    end = p + seqLen;
+
+    std::vector<UCHAR> sig;
+    sig.reserve(2 * groupSize);
+    AppendDERInteger(p, end, groupSize, sig);
+    AppendDERInteger(p, end, groupSize, sig);
+    return sig;
+}
+
+#endif // WIN_SPARKLE_NO_OPENSSL
+
 std::string Base64ToBin(const std::string &base64)
 {
     DWORD nDestinationSize = 0;
@@ -285,11 +638,153 @@ std::string Base64ToBin(const std::string &base64)
 
 } // anonynous
 
-void SignatureVerifier::VerifyDSAPubKeyPem(const std::string &pem)
+struct DataHasher::Impl
+{
+    Impl(HashAlgorithm algorithm) : hash(HashEngine::CreateHash(algorithm)) {}
+
+    std::unique_ptr<Hash> hash;
+};
+
+DataHasher::DataHasher(HashAlgorithm algorithm) : m_impl(new Impl(algorithm))
+{
+}
+
+DataHasher::~DataHasher()
+{
+}
+
+void DataHasher::Update(const void *data, size_t len)
+{
+    m_impl->hash->Update(data, len);
+}
+
+size_t DataHasher::UpdateFromFile(const std::wstring &filename)
+{
+    Hash& hash = *m_impl->hash;
+    return ReadFileInBlocks(filename, [&hash](const void *data, size_t len) { hash.Update(data, len); });
+}
+
+std::string DataHasher::GetDigest()
+{
+    return m_impl->hash->Finish();
+}
+
+#ifndef WIN_SPARKLE_NO_OPENSSL
+
+struct DSAPublicKey::Impl
+{
+    Impl(const std::string &pem_) : pem(pem_) {}
+
+    std::string pem;
+    // parsed by OpenSSL on first Verify() call, see DSAPublicKey docs
+    std::unique_ptr<TinySSL::DSAPub> dsa;
+    // OpenSSL caches Montgomery contexts in the DSA object on first use,
+    // which is only thread-safe with locking callbacks set up
+    CriticalSection cs;
+};
+
+DSAPublicKey::DSAPublicKey(const std::string &pem) : m_impl(new Impl(pem))
+{
+    DSAPublicKeyInfo check(pem);
+}
+
+DSAPublicKey::~DSAPublicKey()
 {
-    // DSAPub::DSAPub() throw if not valid
-    TinySSL::DSAPub dsa_pub(pem);
-    (void)dsa_pub;
+}
+
+void DSAPublicKey::Verify(const unsigned char *digest, size_t digest_len, const std::string &signature) const
+{
+    CriticalSectionLocker lock(m_impl->cs);
+
+    if ( !m_impl->dsa )
+    {
+        try
+        {
+            m_impl->dsa.reset(new TinySSL::DSAPub(m_impl->pem));
+        }
+        catch ( std::invalid_argument& e )
+        {
+            // crypt32 accepted the key, but OpenSSL didn't: fail closed
+            throw BadSignatureException(e.what());
+        }
+    }
+
+    const int code = DSA_verify(0, digest, int(digest_len), (const unsigned char*)signature.c_str(), int(signature.size()), *m_impl->dsa);
+
+    if (code == -1) // OpenSSL error
+        throw BadSignatureException(ERR_error_string(ERR_get_error(), nullptr));
+
+    if (code != 1)
+        throw BadSignatureException();
+}
+
+#else // WIN_SPARKLE_NO_OPENSSL
+
+struct DSAPublicKey::Impl
+{
+    Impl() : key(NULL), groupSize(0) {}
+    ~Impl()
+    {
+        if ( key )
+            BCryptDestroyKey(key);
+    }
+
+    // CNG key handles can be used by several threads at once
+    BCRYPT_KEY_HANDLE key;
+    size_t groupSize;
+};
+
+DSAPublicKey::DSAPublicKey(const std::string &pem) : m_impl(new Impl)
+{
+    DSAPublicKeyInfo info(pem);
+    m_impl->groupSize = info.GetGroupSize();
+
+    // CryptImportPublicKeyInfoEx2() is only available since Windows 7;
+    // crypt32.dll is already loaded by DSAPublicKeyInfo at this point
+    typedef BOOL (WINAPI *ImportPublicKeyInfoEx2_t)(DWORD, PCERT_PUBLIC_KEY_INFO, DWORD, void*, BCRYPT_KEY_HANDLE*);
+    HMODULE crypt32 = GetModuleHandleW(L"crypt32.dll");
+    ImportPublicKeyInfoEx2_t importKey = crypt32
+        ? reinterpret_cast<ImportPublicKeyInfoEx2_t>(GetProcAddress(crypt32, "CryptImportPublicKeyInfoEx2"))
+        : NULL;
+    if ( !importKey )
+        throw std::runtime_error("DSA signatures require Windows 7 or newer");
+
+    // this fails e.g. for keys longer than 3072 bits that CNG doesn't support
+    if ( !importKey(X509_ASN_ENCODING, info.Get(), 0, NULL, &m_impl->key) )
+    {
+        m_impl->key = NULL;
+        throw std::invalid_argument("DSA public key isn't supported by Windows CNG");
+    }
+}
+
+DSAPublicKey::~DSAPublicKey()
+{
+}
+
+void DSAPublicKey::Verify(const unsigned char *digest, size_t digest_len, const std::string &signature) const
+{
+    std::vector<UCHAR> sig = DERToCNGSignature(signature, m_impl->groupSize);
+
+    const NTSTATUS status = BCryptVerifySignature(m_impl->key, NULL,
+                                                  const_cast<PUCHAR>(digest), ULONG(digest_len),
+                                                  sig.data(), ULONG(sig.size()), 0);
+    if ( status == CNG_STATUS_INVALID_SIGNATURE )
+        throw BadSignatureException();
+
+    if ( !BCRYPT_SUCCESS(status) )
+    {
+        std::ostringstream msg;
+        msg << "CNG error 0x" << std::hex << (unsigned long)status;
+        throw BadSignatureException(msg.str());
+    }
+}
+
+#endif // WIN_SPARKLE_NO_OPENSSL
+
+std::shared_ptr<const DSAPublicKey> SignatureVerifier::ParseDSAPubKey(const std::string &pem)
+{
+    // DSAPub::DSAPub() throws if not valid
+    return std::make_shared<DSAPublicKey>(pem);
 }
 
 void SignatureVerifier::VerifyDSASHA1SignatureValid(const std::wstring &filename, const std::string &signature_base64)
@@ -314,4 +809,288 @@ void SignatureVerifier::VerifyDSASHA1SignatureValid(const std::wstring &filename
     }
 }
 
+void SignatureVerifier::VerifyDSASHA1DigestSignatureValid(const std::string &sha1, const std::string &signature_base64)
+{
+    try
+    {
+        if (signature_base64.size() == 0)
+            throw BadSignatureException("Missing DSA signature!");
+        if (sha1.size() != HashEngine::GetDigestSize(Hash_SHA1))
+            throw std::invalid_argument("Invalid SHA1 digest");
+
+        TinySSL::inst().VerifyDSASHA1DigestSignature(sha1, Base64ToBin(signature_base64));
+    }
+    catch (BadSignatureException&)
+    {
+        throw;
+    }
+    catch (const std::exception &e)
+    {
+        throw BadSignatureException(e.what());
+    }
+    catch (...)
+    {
+        throw BadSignatureException();
+    }
+}
+
+namespace
+{
+
+std::string DecodeEdDSASignature(const std::string &signature_base64)
+{
+    const std::string signature = Base64ToBin(signature_base64);
+    if (signature.size() != Ed25519PublicKey::SIGNATURE_SIZE)
+        throw BadSignatureException("Invalid EdDSA signature size");
+    return signature;
+}
+
+} // anonymous namespace
+
+std::shared_ptr<const Ed25519PublicKey> SignatureVerifier::ParseEdDSAPubKey(const std::string &pubkey_base64)
+{
+    return std::make_shared<Ed25519PublicKey>(Base64ToBin(pubkey_base64));
+}
+
+struct EdDSAVerifier::Impl
+{
+    std::shared_ptr<const Ed25519PublicKey> key;
+    std::string signature;
+    std::unique_ptr<Hash> hash;
+};
+
+EdDSAVerifier::EdDSAVerifier(const std::string &signature_base64) : m_impl(new Impl)
+{
+    try
+    {
+        if (signature_base64.size() == 0)
+            throw BadSignatureException("Missing EdDSA signature!");
+
+        m_impl->key = Settings::GetEdDSAPubKey();
+        if (!m_impl->key)
+            throw std::invalid_argument("Missing EdDSA public key");
+
+        m_impl->signature = DecodeEdDSASignature(signature_base64);
+
+        // Ed25519 signs SHA-512 of the signature's first half, the public
+        // key and the data itself
+        m_impl->hash = HashEngine::CreateHash(Hash_SHA512);
+        m_impl->hash->Update(m_impl->signature.data(), Ed25519PublicKey::SIGNATURE_SIZE / 2);
+        m_impl->hash->Update(m_impl->key->GetBytes().data(), Ed25519PublicKey::KEY_SIZE);
+    }
+    catch (BadSignatureException&)
+    {
+        throw;
+    }
+    catch (const std::exception &e)
+    {
+        throw BadSignatureException(e.what());
+    }
+    catch (...)
+    {
+        throw BadSignatureException();
+    }
+}
+
+EdDSAVerifier::~EdDSAVerifier()
+{
+}
+
+void EdDSAVerifier::Update(const void *data, size_t len)
+{
+    m_impl->hash->Update(data, len);
+}
+
+void EdDSAVerifier::Verify()
+{
+    const std::string digest = m_impl->hash->Finish();
+    if (!m_impl->key->Verify(m_impl->signature, (const unsigned char*)digest.data()))
+        throw BadSignatureException();
+}
+
+void SignatureVerifier::VerifyEdDSASignatureValid(const std::wstring &filename, const std::string &signature_base64,
+                                                  const CancellationToken *cancel)
+{
+    EdDSAVerifier verifier(signature_base64);
+    try
+    {
+        ReadFileInBlocks(filename, [&verifier](const void *data, size_t len) { verifier.Update(data, len); }, cancel);
+    }
+    catch (const std::exception &e)
+    {
+        throw BadSignatureException(e.what());
+    }
+    verifier.Verify();
+}
+
+void SignatureVerifier::VerifyEdDSAChunkedSignatureValid(const std::wstring &filename, const std::string &signature_base64,
+                                                         const CancellationToken *cancel)
+{
+    EdDSAVerifier verifier(signature_base64);
+    try
+    {
+        // the signed message is the chunked digest
+        ChunkedFileDigest chunked(filename, cancel);
+        const std::string message = chunked.Compute();
+        verifier.Update(message.data(), message.size());
+    }
+    catch (const std::exception &e)
+    {
+        throw BadSignatureException(e.what());
+    }
+    verifier.Verify();
+}
+
+std::string SignatureVerifier::ComputeChunkHashes(const std::wstring &filename, const CancellationToken *cancel)
+{
+    ChunkedFileDigest chunked(filename, cancel);
+    return chunked.ComputeChunkHashes();
+}
+
+void SignatureVerifier::VerifyEdDSAChunkHashesValid(const std::string &hashes, const std::string &signature_base64)
+{
+    EdDSAVerifier verifier(signature_base64);
+    if (hashes.empty() || hashes.size() % HashEngine::GetDigestSize(Hash_SHA256) != 0)
+        throw BadSignatureException("invalid chunk hashes");
+
+    const std::string message = HashEngine::HashData(Hash_SHA256, hashes.data(), hashes.size());
+    verifier.Update(message.data(), message.size());
+    verifier.Verify();
+}
+
+
+/*--------------------------------------------------------------------------*
+                               Authenticode
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// the last file whose Authenticode signature was verified, see GetFileStamp()
+const char AUTHENTICODE_VERIFIED_VALUE[] = "AuthenticodeVerifiedFile";
+
+// Opens the file for reading, without letting anyone modify it meanwhile.
+// Returns INVALID_HANDLE_VALUE on failure.
+HANDLE OpenFileForVerification(const std::wstring &filename)
+{
+    return CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+// Returns a string identifying the file and its contents: the file itself,
+// which stays the same when it's renamed on the same volume, its size and
+// the time it was last modified.
+std::string GetFileStamp(HANDLE file)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+    if ( !GetFileInformationByHandle(file, &info) )
+        return std::string();
+
+    std::ostringstream stamp;
+    stamp << std::hex
+          << info.dwVolumeSerialNumber << ':'
+          << info.nFileIndexHigh << ':' << info.nFileIndexLow << ':'
+          << info.nFileSizeHigh << ':' << info.nFileSizeLow << ':'
+          << info.ftLastWriteTime.dwHighDateTime << ':' << info.ftLastWriteTime.dwLowDateTime;
+    return stamp.str();
+}
+
+// Describes WinVerifyTrust()'s result for BadSignatureException.
+std::string DescribeTrustError(LONG status)
+{
+    switch ( status )
+    {
+        case TRUST_E_NOSIGNATURE:
+            return "the update has no Authenticode signature";
+        case TRUST_E_SUBJECT_FORM_UNKNOWN:
+            return "the update's file type can't be Authenticode-signed";
+        case TRUST_E_BAD_DIGEST:
+            return "the update doesn't match its Authenticode signature";
+        case CERT_E_REVOKED:
+            return "the update's Authenticode certificate was revoked";
+        case CERT_E_EXPIRED:
+            return "the update's Authenticode certificate has expired";
+        case CERT_E_UNTRUSTEDROOT:
+        case CERT_E_CHAINING:
+        case TRUST_E_EXPLICIT_DISTRUST:
+            return "the update's Authenticode certificate isn't trusted";
+        default:
+        {
+            std::ostringstream msg;
+            msg << "Authenticode verification failed (0x" << std::hex << unsigned(status) << ")";
+            return msg.str();
+        }
+    }
+}
+
+} // anonymous namespace
+
+void SignatureVerifier::VerifyAuthenticodeSignatureValid(const std::wstring &filename)
+{
+    HANDLE file = OpenFileForVerification(filename);
+    if ( file == INVALID_HANDLE_VALUE )
+        throw BadSignatureException("cannot open the update file");
+
+    WINTRUST_FILE_INFO fileInfo;
+    ZeroMemory(&fileInfo, sizeof(fileInfo));
+    fileInfo.cbStruct = sizeof(fileInfo);
+    fileInfo.pcwszFilePath = filename.c_str();
+    fileInfo.hFile = file;
+
+    WINTRUST_DATA data;
+    ZeroMemory(&data, sizeof(data));
+    data.cbStruct = sizeof(data);
+    data.dwUIChoice = WTD_UI_NONE;
+    data.fdwRevocationChecks = WTD_REVOKE_WHOLECHAIN;
+    data.dwUnionChoice = WTD_CHOICE_FILE;
+    data.pFile = &fileInfo;
+    data.dwStateAction = WTD_STATEACTION_VERIFY;
+    data.dwProvFlags = WTD_REVOCATION_CHECK_CHAIN_EXCLUDE_ROOT;
+
+    GUID action = WINTRUST_ACTION_GENERIC_VERIFY_V2;
+    const LONG status = WinVerifyTrust(NULL, &action, &data);
+
+    data.dwStateAction = WTD_STATEACTION_CLOSE;
+    WinVerifyTrust(NULL, &action, &data);
+
+    // the file couldn't change while it was open
+    const std::string stamp = status == ERROR_SUCCESS ? GetFileStamp(file) : std::string();
+    CloseHandle(file);
+
+    if ( status != ERROR_SUCCESS )
+        throw BadSignatureException(DescribeTrustError(status));
+
+    if ( !stamp.empty() )
+        Settings::WriteConfigValue(AUTHENTICODE_VERIFIED_VALUE, stamp);
+}
+
+bool SignatureVerifier::IsAuthenticodeVerified(const std::wstring &filename)
+{
+    std::string verified;
+    if ( !Settings::ReadConfigValue(AUTHENTICODE_VERIFIED_VALUE, verified) || verified.empty() )
+        return false;
+
+    HANDLE file = OpenFileForVerification(filename);
+    if ( file == INVALID_HANDLE_VALUE )
+        return false;
+    const std::string stamp = GetFileStamp(file);
+    CloseHandle(file);
+
+    return stamp == verified;
+}
+
+
+FileVerificationLock::FileVerificationLock(const std::wstring &filename)
+    : m_file(OpenFileForVerification(filename))
+{
+    if ( m_file != INVALID_HANDLE_VALUE )
+        m_stamp = GetFileStamp(m_file);
+}
+
+FileVerificationLock::~FileVerificationLock()
+{
+    if ( m_file != INVALID_HANDLE_VALUE )
+        CloseHandle(m_file);
+}
+
 } // namespace winsparkle
@@ -26,12 +26,53 @@
 #ifndef _signatureverifier_h_
 #define _signatureverifier_h_
 
+#include "hashengine.h"
+
 #include <exception>
+#include <memory>
+#include <stdexcept>
 #include <string>
 
 namespace winsparkle
 {
 
+class Ed25519PublicKey;
+class CancellationToken;
+
+/**
+    Parsed DSA public key.
+
+    The PEM data are checked when the object is created, but OpenSSL only
+    parses the key when the first signature is verified, so that hosts that
+    never need it (e.g. because they use EdDSA) don't run any libcrypto code.
+    The object is logically immutable and can be shared by several threads.
+
+    If WinSparkle is built with WIN_SPARKLE_NO_OPENSSL defined, Windows CNG
+    is used instead. It requires Windows 7 and doesn't support keys longer
+    than 3072 bits, which are rejected when they are set.
+ */
+class DSAPublicKey
+{
+public:
+    /// Checks PEM data, throws if they don't contain a DSA public key.
+    explicit DSAPublicKey(const std::string &pem);
+    ~DSAPublicKey();
+
+    /**
+        Verifies DSA signature of @a digest.
+
+        Throws BadSignatureException if it isn't valid.
+     */
+    void Verify(const unsigned char *digest, size_t digest_len, const std::string &signature) const;
+
+private:
+    DSAPublicKey(const DSAPublicKey&);
+    DSAPublicKey& operator=(const DSAPublicKey&);
+
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
 class BadSignatureException : public std::runtime_error
 {
 public:
@@ -39,16 +80,160 @@ public:
     BadSignatureException(const std::string& msg) : std::runtime_error("Invalid update signature: " + msg) {}
 };
 
+/**
+    Computes hash of data that become available piecewise, e.g. of a
+    file while it is being downloaded.
+ */
+class DataHasher
+{
+public:
+    explicit DataHasher(HashAlgorithm algorithm);
+    ~DataHasher();
+
+    /// Add next chunk of data to the hash.
+    void Update(const void *data, size_t len);
+
+    /// Add the whole content of a file to the hash, returns its size.
+    size_t UpdateFromFile(const std::wstring &filename);
+
+    /// Returns the (binary) hash of all data added so far.
+    std::string GetDigest();
+
+private:
+    DataHasher(const DataHasher&);
+    DataHasher& operator=(const DataHasher&);
+
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+/// DataHasher computing SHA-1, as needed to verify DSA signatures.
+class SHA1Hasher : public DataHasher
+{
+public:
+    SHA1Hasher() : DataHasher(Hash_SHA1) {}
+};
+
+/**
+    Verifies Ed25519 signature of data that become available piecewise,
+    e.g. of the appcast feed while it is being downloaded and parsed.
+
+    The key returned by Settings::GetEdDSAPubKey() is used.
+ */
+class EdDSAVerifier
+{
+public:
+    /**
+        Prepares verification of @a signature_base64.
+
+        Throws BadSignatureException if the signature or the key are missing
+        or malformed.
+     */
+    explicit EdDSAVerifier(const std::string &signature_base64);
+    ~EdDSAVerifier();
+
+    /// Add next chunk of the signed data.
+    void Update(const void *data, size_t len);
+
+    /// Throws BadSignatureException if the data don't match the signature.
+    void Verify();
+
+private:
+    EdDSAVerifier(const EdDSAVerifier&);
+    EdDSAVerifier& operator=(const EdDSAVerifier&);
+
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
 class SignatureVerifier
 {
 public:
-    // Throws an exception if pem is not a valid DSA public key in PEM format
-    static void VerifyDSAPubKeyPem(const std::string &pem);
+    // Parses DSA public key in PEM format.
+    // Throws an exception if pem is not a valid DSA public key.
+    static std::shared_ptr<const DSAPublicKey> ParseDSAPubKey(const std::string &pem);
 
     // Verify DSA signature of SHA1 hash of the file. Equivalent to:
     // openssl dgst -sha1 -binary < filename | openssl dgst -sha1 -verify dsa_pub.pem -signature signature.bin
+    // The key returned by Settings::GetDSAPubKey() is used.
     // Throws BadSignatureException on failure.
     static void VerifyDSASHA1SignatureValid(const std::wstring &filename, const std::string &signature_base64);
+
+    // Same as VerifyDSASHA1SignatureValid(), but for a file whose SHA1 hash
+    // (as returned by SHA1Hasher::GetDigest()) was already computed, so that
+    // it doesn't need to be read again.
+    static void VerifyDSASHA1DigestSignatureValid(const std::string &sha1, const std::string &signature_base64);
+
+    // Decodes base64-encoded Ed25519 public key, as used by Sparkle.
+    // Throws an exception if it's not valid.
+    static std::shared_ptr<const Ed25519PublicKey> ParseEdDSAPubKey(const std::string &pubkey_base64);
+
+    // Verify Ed25519 signature of the whole file (Sparkle's edSignature)
+    // with the key returned by Settings::GetEdDSAPubKey().
+    // Throws BadSignatureException on failure, or OperationCancelledException
+    // if cancel is given and gets cancelled while the file is being read.
+    static void VerifyEdDSASignatureValid(const std::wstring &filename, const std::string &signature_base64,
+                                          const CancellationToken *cancel = NULL);
+
+    // Verify Ed25519 signature of the file's chunked digest, which is
+    // SHA-256 of the concatenated SHA-256 hashes of its consecutive 4 MiB
+    // chunks. The chunks are hashed in parallel, which makes this much
+    // faster than VerifyEdDSASignatureValid() for very large files.
+    // Throws BadSignatureException on failure, or OperationCancelledException
+    // like VerifyEdDSASignatureValid().
+    static void VerifyEdDSAChunkedSignatureValid(const std::wstring &filename, const std::string &signature_base64,
+                                                 const CancellationToken *cancel = NULL);
+
+    // Size of the chunks of the chunked digest; the last one may be shorter.
+    static const unsigned CHUNKED_DIGEST_CHUNK_SIZE = 4 * 1024 * 1024;
+
+    // Returns the concatenated SHA-256 hashes of the file's chunks, whose
+    // SHA-256 hash is the chunked digest. Throws on error, or
+    // OperationCancelledException like VerifyEdDSAChunkedSignatureValid().
+    static std::string ComputeChunkHashes(const std::wstring &filename, const CancellationToken *cancel = NULL);
+
+    // Verify that the concatenated chunk hashes, as returned by
+    // ComputeChunkHashes(), are those signed by the chunked signature,
+    // without having the file.
+    // Throws BadSignatureException on failure.
+    static void VerifyEdDSAChunkHashesValid(const std::string &hashes, const std::string &signature_base64);
+
+    // Verify the file's Authenticode signature with WinVerifyTrust(), which
+    // also checks that the certificate is trusted and wasn't revoked. The
+    // result is remembered, see IsAuthenticodeVerified().
+    // Throws BadSignatureException on failure.
+    static void VerifyAuthenticodeSignatureValid(const std::wstring &filename);
+
+    // Was the file's Authenticode signature verified, and the file not
+    // modified since? This holds across renames of the file on the same
+    // volume and restarts of the app.
+    static bool IsAuthenticodeVerified(const std::wstring &filename);
+};
+
+/**
+    Keeps a file from being modified while the object exists, so that the
+    result of verifying it can be remembered for the file as it is.
+
+    GetStamp() identifies the file and its content like the stamps used by
+    SignatureVerifier::IsAuthenticodeVerified(): it stays the same when the
+    file is renamed on the same volume, but not if it's replaced or
+    modified. The file can still be read, e.g. by the verification itself.
+ */
+class FileVerificationLock
+{
+public:
+    explicit FileVerificationLock(const std::wstring &filename);
+    ~FileVerificationLock();
+
+    /// Returns the file's stamp, empty if it couldn't be opened.
+    const std::string& GetStamp() const { return m_stamp; }
+
+private:
+    void *m_file;
+    std::string m_stamp;
+
+    FileVerificationLock(const FileVerificationLock&);
+    FileVerificationLock& operator=(const FileVerificationLock&);
 };
 
 } // namespace winsparkle
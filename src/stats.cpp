@@ -0,0 +1,448 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "stats.h"
+#include "allocstats.h"
+#include "error.h"
+#include "pipelinestatus.h"
+#include "signatureverifier.h"
+#include "telemetry.h"
+#include "threads.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+// GetProcessMemoryInfo() has to come from psapi.dll, not kernel32.dll, to
+// keep working on Windows XP
+#define PSAPI_VERSION 1
+#include <psapi.h>
+
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// upper bounds of check_latency_histogram buckets, except for the last one
+const unsigned LATENCY_BUCKETS[WIN_SPARKLE_STATS_LATENCY_BUCKETS - 1] =
+    { 100, 250, 500, 1000, 2500, 5000, 10000 };
+
+// guards g_stats and g_lastError
+CriticalSection g_csStats;
+win_sparkle_stats_t g_stats;
+win_sparkle_error_info_t g_lastError;
+
+// time since the last StartUIInteraction() and which milestones since then
+// are yet to be recorded
+TraceTimer g_uiInteractionTimer;
+bool g_uiMilestonePending[Stats::UIMilestone_Max];
+
+unsigned long long GetBytesPerSecond(unsigned long long bytes, unsigned time)
+{
+    // too quick to measure, e.g. an empty file
+    if ( time == 0 )
+        return 0;
+    return bytes * 1000 / time;
+}
+
+void AppendJSONKey(std::string& json, const char *name)
+{
+    json += json.length() > 1 ? ",\n  \"" : "\n  \"";
+    json += name;
+    json += "\": ";
+}
+
+void AppendJSONValue(std::string& json, unsigned long long value)
+{
+    char buf[32];
+    _snprintf(buf, sizeof(buf), "%I64u", value);
+    buf[sizeof(buf) - 1] = '\0';
+    json += buf;
+}
+
+void AppendJSONField(std::string& json, const char *name, unsigned long long value)
+{
+    AppendJSONKey(json, name);
+    AppendJSONValue(json, value);
+}
+
+template<typename T, size_t N>
+void AppendJSONField(std::string& json, const char *name, const T (&values)[N])
+{
+    AppendJSONKey(json, name);
+    json += "[";
+    for ( size_t i = 0; i < N; i++ )
+    {
+        if ( i )
+            json += ", ";
+        AppendJSONValue(json, values[i]);
+    }
+    json += "]";
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                  Stats
+ *--------------------------------------------------------------------------*/
+
+void Stats::RecordCheck(unsigned totalTime, const DownloadTimings& download, unsigned parseTime)
+{
+    Telemetry::AddCheck(totalTime);
+
+    CriticalSectionLocker lock(g_csStats);
+
+    g_stats.checks++;
+
+    size_t bucket = 0;
+    while ( bucket < WIN_SPARKLE_STATS_LATENCY_BUCKETS - 1 && totalTime >= LATENCY_BUCKETS[bucket] )
+        bucket++;
+    g_stats.check_latency_histogram[bucket]++;
+
+    g_stats.last_check_ms = totalTime;
+    g_stats.last_check_resolve_ms = download.resolve;
+    g_stats.last_check_connect_ms = download.connect;
+    g_stats.last_check_tls_ms = download.secure;
+    g_stats.last_check_ttfb_ms = download.firstByte;
+    g_stats.last_check_redirects = download.redirects;
+    g_stats.last_check_transfer_ms = download.transfer;
+    g_stats.last_check_parse_ms = parseTime;
+}
+
+void Stats::RecordFailedCheck(const std::exception_ptr& error)
+{
+    Telemetry::AddFailedCheck(error);
+
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.checks++;
+    g_stats.failed_checks++;
+}
+
+win_sparkle_error_kind_t Stats::ClassifyError(const std::exception_ptr& error)
+{
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch ( DownloadTimeoutException& )
+    {
+        return WIN_SPARKLE_ERROR_TIMEOUT;
+    }
+    catch ( HttpErrorException& )
+    {
+        return WIN_SPARKLE_ERROR_HTTP;
+    }
+    catch ( BadSignatureException& )
+    {
+        return WIN_SPARKLE_ERROR_SIGNATURE;
+    }
+    catch ( Win32Exception& )
+    {
+        // the HTTP backends' errors, e.g. the server couldn't be resolved
+        return WIN_SPARKLE_ERROR_NETWORK;
+    }
+    catch ( ... )
+    {
+        // e.g. invalid appcast
+        return WIN_SPARKLE_ERROR_OTHER;
+    }
+}
+
+void Stats::RecordError(const std::exception_ptr& error)
+{
+    win_sparkle_error_info_t info;
+    memset(&info, 0, sizeof(info));
+    info.size = sizeof(info);
+    info.kind = ClassifyError(error);
+
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch ( OperationCancelledException& )
+    {
+        return;
+    }
+    catch ( HttpErrorException& e )
+    {
+        info.http_status = e.GetStatusCode();
+        strncpy(info.message, e.what(), sizeof(info.message) - 1);
+    }
+    catch ( Win32Exception& e )
+    {
+        info.system_error = e.GetErrorCode();
+        strncpy(info.message, e.what(), sizeof(info.message) - 1);
+    }
+    catch ( std::exception& e )
+    {
+        strncpy(info.message, e.what(), sizeof(info.message) - 1);
+    }
+    catch ( ... )
+    {
+        strncpy(info.message, "Unknown error.", sizeof(info.message) - 1);
+    }
+
+    CriticalSectionLocker lock(g_csStats);
+    g_lastError = info;
+    g_stats.last_error_kind = info.kind;
+    g_stats.last_error_http_status = info.http_status;
+    g_stats.last_error_system_code = info.system_error;
+    PipelineStatus::SetLastError(info.kind, info.http_status, info.system_error);
+}
+
+bool Stats::GetLastError(win_sparkle_error_info_t& info)
+{
+    const size_t size = info.size < sizeof(win_sparkle_error_info_t) ? info.size : sizeof(win_sparkle_error_info_t);
+
+    CriticalSectionLocker lock(g_csStats);
+    if ( g_lastError.kind == WIN_SPARKLE_ERROR_NONE )
+        return false;
+    // everything except for the size field
+    memcpy(reinterpret_cast<char*>(&info) + sizeof(info.size),
+           reinterpret_cast<const char*>(&g_lastError) + sizeof(info.size),
+           size - sizeof(info.size));
+    return true;
+}
+
+void Stats::RecordCheckRetry()
+{
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.check_retries++;
+}
+
+void Stats::RecordResponse(unsigned statusCode)
+{
+    Telemetry::AddResponse(statusCode);
+
+    CriticalSectionLocker lock(g_csStats);
+    switch ( statusCode )
+    {
+        case 200:
+            g_stats.responses_full++;
+            break;
+        case 206:
+            g_stats.responses_partial++;
+            break;
+        case 304:
+            g_stats.responses_not_modified++;
+            break;
+    }
+}
+
+void Stats::RecordResumedDownload()
+{
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.resumed_downloads++;
+}
+
+void Stats::AddBytesDownloaded(unsigned long long bytes)
+{
+    Telemetry::AddBytesDownloaded(bytes);
+
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.bytes_downloaded += bytes;
+}
+
+void Stats::AddBytesSavedByCache(unsigned long long bytes)
+{
+    Telemetry::AddBytesSavedByCache(bytes);
+
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.bytes_saved_by_cache += bytes;
+}
+
+void Stats::AddBytesSavedByCompression(unsigned long long bytes)
+{
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.bytes_saved_by_compression += bytes;
+}
+
+void Stats::RecordUpdateDownload(unsigned long long bytes, unsigned time)
+{
+    Telemetry::AddUpdateDownload(bytes, time);
+
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.last_download_bytes_per_second = GetBytesPerSecond(bytes, time);
+}
+
+void Stats::RecordVerification(unsigned long long bytes, unsigned time)
+{
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.last_verification_bytes_per_second = GetBytesPerSecond(bytes, time);
+}
+
+void Stats::StartUIInteraction()
+{
+    CriticalSectionLocker lock(g_csStats);
+    g_uiInteractionTimer = TraceTimer();
+    for ( int i = 0; i < UIMilestone_Max; i++ )
+        g_uiMilestonePending[i] = true;
+}
+
+void Stats::RecordUIMilestone(UIMilestone milestone)
+{
+    CriticalSectionLocker lock(g_csStats);
+    if ( !g_uiMilestonePending[milestone] )
+        return;
+    g_uiMilestonePending[milestone] = false;
+
+    const unsigned ms = unsigned(g_uiInteractionTimer.GetMicroseconds() / 1000);
+    switch ( milestone )
+    {
+        case UIMilestone_FirstPaint:
+            g_stats.last_ui_first_paint_ms = ms;
+            break;
+        case UIMilestone_ResultShown:
+            g_stats.last_ui_result_shown_ms = ms;
+            break;
+        case UIMilestone_ReleaseNotesShown:
+            g_stats.last_ui_release_notes_ms = ms;
+            break;
+        case UIMilestone_Max:
+            break;
+    }
+}
+
+void Stats::RecordFootprint(int point)
+{
+    if ( point < 0 || point >= WIN_SPARKLE_STATS_FOOTPRINTS )
+        return;
+
+    // measured outside of the lock, these calls aren't entirely cheap
+    win_sparkle_footprint_t footprint;
+    memset(&footprint, 0, sizeof(footprint));
+
+    HANDLE process = GetCurrentProcess();
+    PROCESS_MEMORY_COUNTERS_EX mem;
+    memset(&mem, 0, sizeof(mem));
+    mem.cb = sizeof(mem);
+    if ( GetProcessMemoryInfo(process, reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&mem), sizeof(mem)) )
+    {
+        footprint.private_bytes = mem.PrivateUsage;
+        footprint.working_set = mem.WorkingSetSize;
+    }
+    footprint.gdi_objects = GetGuiResources(process, GR_GDIOBJECTS);
+    footprint.user_objects = GetGuiResources(process, GR_USEROBJECTS);
+    DWORD handles = 0;
+    if ( GetProcessHandleCount(process, &handles) )
+        footprint.handles = handles;
+
+    CriticalSectionLocker lock(g_csStats);
+    g_stats.footprints[point] = footprint;
+}
+
+void Stats::Get(win_sparkle_stats_t& stats)
+{
+    const size_t size = stats.size < sizeof(win_sparkle_stats_t) ? stats.size : sizeof(win_sparkle_stats_t);
+
+    const LockContentionStats locks = GetLockContentionStats();
+
+    CriticalSectionLocker lock(g_csStats);
+    AllocationStats::Get(g_stats);
+    g_stats.lock_contentions = locks.contentions;
+    g_stats.lock_wait_us = locks.waitTimeUs;
+    g_stats.longest_lock_wait_us = locks.longestWaitUs;
+    // everything except for the size field
+    memcpy(reinterpret_cast<char*>(&stats) + sizeof(stats.size),
+           reinterpret_cast<const char*>(&g_stats) + sizeof(stats.size),
+           size - sizeof(stats.size));
+}
+
+std::string Stats::GetJSON()
+{
+    win_sparkle_stats_t s;
+    s.size = sizeof(s);
+    Get(s);
+
+    std::string json("{");
+#define APPEND_FIELD(name) AppendJSONField(json, #name, s.name)
+    APPEND_FIELD(checks);
+    APPEND_FIELD(failed_checks);
+    APPEND_FIELD(check_retries);
+    APPEND_FIELD(check_latency_histogram);
+    APPEND_FIELD(last_check_ms);
+    APPEND_FIELD(last_check_resolve_ms);
+    APPEND_FIELD(last_check_connect_ms);
+    APPEND_FIELD(last_check_tls_ms);
+    APPEND_FIELD(last_check_ttfb_ms);
+    APPEND_FIELD(last_check_redirects);
+    APPEND_FIELD(last_check_transfer_ms);
+    APPEND_FIELD(last_check_parse_ms);
+    APPEND_FIELD(responses_full);
+    APPEND_FIELD(responses_partial);
+    APPEND_FIELD(responses_not_modified);
+    APPEND_FIELD(resumed_downloads);
+    APPEND_FIELD(bytes_downloaded);
+    APPEND_FIELD(bytes_saved_by_cache);
+    APPEND_FIELD(bytes_saved_by_compression);
+    APPEND_FIELD(last_download_bytes_per_second);
+    APPEND_FIELD(last_verification_bytes_per_second);
+    APPEND_FIELD(allocations);
+    APPEND_FIELD(allocated_bytes);
+    APPEND_FIELD(last_ui_first_paint_ms);
+    APPEND_FIELD(last_ui_result_shown_ms);
+    APPEND_FIELD(last_ui_release_notes_ms);
+    APPEND_FIELD(lock_contentions);
+    APPEND_FIELD(lock_wait_us);
+    APPEND_FIELD(longest_lock_wait_us);
+    APPEND_FIELD(last_error_kind);
+    APPEND_FIELD(last_error_http_status);
+    APPEND_FIELD(last_error_system_code);
+#undef APPEND_FIELD
+
+    AppendJSONKey(json, "footprints");
+    json += "[";
+    for ( int i = 0; i < WIN_SPARKLE_STATS_FOOTPRINTS; i++ )
+    {
+        const win_sparkle_footprint_t& f = s.footprints[i];
+        json += i ? ",\n    {" : "\n    {";
+        json += "\"private_bytes\": ";
+        AppendJSONValue(json, f.private_bytes);
+        json += ", \"working_set\": ";
+        AppendJSONValue(json, f.working_set);
+        json += ", \"gdi_objects\": ";
+        AppendJSONValue(json, f.gdi_objects);
+        json += ", \"user_objects\": ";
+        AppendJSONValue(json, f.user_objects);
+        json += ", \"handles\": ";
+        AppendJSONValue(json, f.handles);
+        json += "}";
+    }
+    json += "\n  ]";
+    json += "\n}\n";
+    return json;
+}
+
+} // namespace winsparkle
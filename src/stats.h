@@ -0,0 +1,153 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _stats_h_
+#define _stats_h_
+
+#include "winsparkle.h"
+#include "download.h"
+
+#include <exception>
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Collects the statistics returned by win_sparkle_get_stats().
+
+    All methods are thread-safe.
+ */
+class Stats
+{
+public:
+    /**
+        Records a successful download of the appcast.
+
+        @param totalTime  Duration of the whole check in milliseconds.
+        @param download   Timings of the feed's download.
+        @param parseTime  Time spent parsing the feed in milliseconds.
+     */
+    static void RecordCheck(unsigned totalTime, const DownloadTimings& download, unsigned parseTime);
+
+    /// Records an update check that failed with @a error.
+    static void RecordFailedCheck(const std::exception_ptr& error);
+
+    /// Returns the win_sparkle_error_kind_t of @a error.
+    static win_sparkle_error_kind_t ClassifyError(const std::exception_ptr& error);
+
+    /**
+        Remembers @a error as the last error reported to the application,
+        see win_sparkle_get_last_error(). Cancellations are ignored.
+
+        Call this before notifying the application about the error.
+     */
+    static void RecordError(const std::exception_ptr& error);
+
+    /// Copies the last error to @a info, up to its size field.
+    static bool GetLastError(win_sparkle_error_info_t& info);
+
+    /// Records an automatic check made to retry a failed one.
+    static void RecordCheckRetry();
+
+    /// Records a HTTP response with given status code.
+    static void RecordResponse(unsigned statusCode);
+
+    /// Records resuming an interrupted download.
+    static void RecordResumedDownload();
+
+    /// Counts @a bytes received over the network.
+    static void AddBytesDownloaded(unsigned long long bytes);
+
+    /// Counts @a bytes that were reused from a cache instead of downloaded.
+    static void AddBytesSavedByCache(unsigned long long bytes);
+
+    /// Counts @a bytes that HTTP compression saved.
+    static void AddBytesSavedByCompression(unsigned long long bytes);
+
+    /// Records download of an update file of @a bytes in @a time ms.
+    static void RecordUpdateDownload(unsigned long long bytes, unsigned time);
+
+    /// Records verification of an update file of @a bytes in @a time ms.
+    static void RecordVerification(unsigned long long bytes, unsigned time);
+
+    /// Points in the update dialog's workflow, see RecordUIMilestone().
+    enum UIMilestone
+    {
+        /// the dialog was painted for the first time
+        UIMilestone_FirstPaint,
+        /// the check's result is shown
+        UIMilestone_ResultShown,
+        /// the release notes are rendered
+        UIMilestone_ReleaseNotesShown,
+
+        UIMilestone_Max
+    };
+
+    /// Starts timing an update check with the UI requested by the user.
+    static void StartUIInteraction();
+
+    /**
+        Records the time @a milestone was reached since StartUIInteraction().
+
+        Only the first time after StartUIInteraction() is recorded, and
+        nothing if there was no such call, e.g. with automatic checks.
+     */
+    static void RecordUIMilestone(UIMilestone milestone);
+
+    /**
+        Records the process's resource usage at @a point, one of
+        WIN_SPARKLE_STATS_FOOTPRINT_INIT etc.
+     */
+    static void RecordFootprint(int point);
+
+    /// Copies the statistics to @a stats, up to its size field.
+    static void Get(win_sparkle_stats_t& stats);
+
+    /**
+        Returns the statistics as a JSON object, with the names of
+        win_sparkle_stats_t's fields as keys.
+     */
+    static std::string GetJSON();
+};
+
+
+/// Records the process's resource usage at @a point when leaving the scope.
+class FootprintRecorder
+{
+public:
+    explicit FootprintRecorder(int point) : m_point(point) {}
+    ~FootprintRecorder() { Stats::RecordFootprint(m_point); }
+
+private:
+    int m_point;
+
+    FootprintRecorder(const FootprintRecorder&);
+    FootprintRecorder& operator=(const FootprintRecorder&);
+};
+
+} // namespace winsparkle
+
+#endif // _stats_h_
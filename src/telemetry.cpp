@@ -0,0 +1,443 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "telemetry.h"
+
+#include "download.h"
+#include "error.h"
+#include "logger.h"
+#include "settings.h"
+#include "stats.h"
+#include "threads.h"
+#include "winsparkle-version.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// how often the aggregates are sent
+const time_t TELEMETRY_PERIOD = 24 * 60 * 60;
+
+// Percentiles are computed from at most this many check latencies, newer
+// ones replace the oldest.
+const size_t MAX_LATENCY_SAMPLES = 256;
+
+// Kinds of failed checks, named in the report by FAILURE_NAMES.
+enum Failure
+{
+    Failure_Network,
+    Failure_Timeout,
+    Failure_Http,
+    Failure_Signature,
+    Failure_Other,
+
+    Failure_Max
+};
+
+const char *const FAILURE_NAMES[Failure_Max] =
+    { "network", "timeout", "http", "signature", "other" };
+
+Failure ClassifyFailure(const std::exception_ptr& error)
+{
+    switch ( Stats::ClassifyError(error) )
+    {
+        case WIN_SPARKLE_ERROR_NETWORK:
+            return Failure_Network;
+        case WIN_SPARKLE_ERROR_TIMEOUT:
+            return Failure_Timeout;
+        case WIN_SPARKLE_ERROR_HTTP:
+            return Failure_Http;
+        case WIN_SPARKLE_ERROR_SIGNATURE:
+            return Failure_Signature;
+        default:
+            return Failure_Other;
+    }
+}
+
+/*
+    The metrics aggregated since they were last sent, stored as a single
+    binary value: TELEMETRY_FORMAT followed by the fields in the order of
+    Save(), as 64-bit numbers. Increment TELEMETRY_FORMAT whenever this
+    changes, older aggregates are then discarded.
+ */
+#define TELEMETRY_VALUE "TelemetryAggregate"
+const unsigned long long TELEMETRY_FORMAT = 1;
+
+struct Aggregate
+{
+    Aggregate()
+        : periodStart(0), checks(0), failedChecks(0),
+          responsesFull(0), responsesNotModified(0),
+          bytesDownloaded(0), bytesSavedByCache(0),
+          updateDownloads(0), updateDownloadBytes(0), updateDownloadTime(0),
+          latencyCount(0)
+    {
+        for ( int i = 0; i < Failure_Max; i++ )
+            failures[i] = 0;
+    }
+
+    // when aggregating started, as time_t; 0 if not known yet
+    unsigned long long periodStart;
+    unsigned long long checks, failedChecks;
+    unsigned long long failures[Failure_Max];
+    unsigned long long responsesFull, responsesNotModified;
+    unsigned long long bytesDownloaded, bytesSavedByCache;
+    unsigned long long updateDownloads, updateDownloadBytes, updateDownloadTime;
+    // latencies of successful checks in ms, see AddLatency()
+    std::vector<unsigned> latencies;
+    unsigned long long latencyCount;
+
+    bool IsEmpty() const
+    {
+        return !checks && !failedChecks && !responsesFull && !responsesNotModified &&
+               !bytesDownloaded && !bytesSavedByCache && !updateDownloads;
+    }
+
+    void AddLatency(unsigned time)
+    {
+        if ( latencies.size() < MAX_LATENCY_SAMPLES )
+            latencies.push_back(time);
+        else
+            latencies[size_t(latencyCount % MAX_LATENCY_SAMPLES)] = time;
+        latencyCount++;
+    }
+
+    // Adds @a other's metrics, collected after these.
+    void Merge(const Aggregate& other)
+    {
+        checks += other.checks;
+        failedChecks += other.failedChecks;
+        for ( int i = 0; i < Failure_Max; i++ )
+            failures[i] += other.failures[i];
+        responsesFull += other.responsesFull;
+        responsesNotModified += other.responsesNotModified;
+        bytesDownloaded += other.bytesDownloaded;
+        bytesSavedByCache += other.bytesSavedByCache;
+        updateDownloads += other.updateDownloads;
+        updateDownloadBytes += other.updateDownloadBytes;
+        updateDownloadTime += other.updateDownloadTime;
+        for ( std::vector<unsigned>::const_iterator i = other.latencies.begin(); i != other.latencies.end(); ++i )
+            AddLatency(*i);
+    }
+
+    void Load()
+    {
+        *this = Aggregate();
+
+        std::string data;
+        if ( !Settings::ReadConfigBlob(TELEMETRY_VALUE, data) || data.size() % 8 )
+            return;
+
+        std::vector<unsigned long long> words(data.size() / 8);
+        for ( size_t i = 0; i < words.size(); i++ )
+        {
+            const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data.data() + i * 8);
+            for ( int b = 7; b >= 0; b-- )
+                words[i] = (words[i] << 8) | bytes[b];
+        }
+
+        const size_t fixed = 13 + Failure_Max;
+        if ( words.size() < fixed || words[0] != TELEMETRY_FORMAT ||
+             words[fixed - 1] > MAX_LATENCY_SAMPLES || words.size() != fixed + words[fixed - 1] )
+            return;
+
+        size_t pos = 1;
+        periodStart = words[pos++];
+        checks = words[pos++];
+        failedChecks = words[pos++];
+        for ( int i = 0; i < Failure_Max; i++ )
+            failures[i] = words[pos++];
+        responsesFull = words[pos++];
+        responsesNotModified = words[pos++];
+        bytesDownloaded = words[pos++];
+        bytesSavedByCache = words[pos++];
+        updateDownloads = words[pos++];
+        updateDownloadBytes = words[pos++];
+        updateDownloadTime = words[pos++];
+        latencyCount = words[pos++];
+        latencies.resize(size_t(words[pos++]));
+        for ( size_t i = 0; i < latencies.size(); i++ )
+            latencies[i] = unsigned(words[pos++]);
+    }
+
+    void Save() const
+    {
+        std::vector<unsigned long long> words;
+        words.push_back(TELEMETRY_FORMAT);
+        words.push_back(periodStart);
+        words.push_back(checks);
+        words.push_back(failedChecks);
+        for ( int i = 0; i < Failure_Max; i++ )
+            words.push_back(failures[i]);
+        words.push_back(responsesFull);
+        words.push_back(responsesNotModified);
+        words.push_back(bytesDownloaded);
+        words.push_back(bytesSavedByCache);
+        words.push_back(updateDownloads);
+        words.push_back(updateDownloadBytes);
+        words.push_back(updateDownloadTime);
+        words.push_back(latencyCount);
+        words.push_back(latencies.size());
+        words.insert(words.end(), latencies.begin(), latencies.end());
+
+        std::string data;
+        data.reserve(words.size() * 8);
+        for ( size_t i = 0; i < words.size(); i++ )
+        {
+            for ( int b = 0; b < 8; b++ )
+                data += char((words[i] >> (b * 8)) & 0xFF);
+        }
+        Settings::WriteConfigBlob(TELEMETRY_VALUE, data);
+    }
+
+    std::string ToJSON(time_t periodEnd) const
+    {
+        std::vector<unsigned> sorted(latencies);
+        std::sort(sorted.begin(), sorted.end());
+
+        std::string json("{");
+        AppendField(json, "period_start", periodStart);
+        AppendField(json, "period_end", periodEnd);
+        AppendKey(json, "app_version");
+        AppendString(json, Settings::GetAppBuildVersionUTF8());
+        AppendKey(json, "winsparkle_version");
+        AppendString(json, WIN_SPARKLE_VERSION_STRING);
+        AppendField(json, "checks", checks);
+        AppendField(json, "failed_checks", failedChecks);
+
+        AppendKey(json, "check_latency_ms");
+        json += "{";
+        AppendField(json, "p50", GetPercentile(sorted, 50));
+        AppendField(json, "p90", GetPercentile(sorted, 90));
+        AppendField(json, "p99", GetPercentile(sorted, 99));
+        AppendField(json, "samples", sorted.size());
+        json += "}";
+
+        AppendField(json, "responses_full", responsesFull);
+        AppendField(json, "responses_not_modified", responsesNotModified);
+        AppendField(json, "bytes_downloaded", bytesDownloaded);
+        AppendField(json, "bytes_saved_by_cache", bytesSavedByCache);
+        AppendField(json, "update_downloads", updateDownloads);
+        AppendField(json, "update_download_bytes_per_second",
+                    updateDownloadTime ? updateDownloadBytes * 1000 / updateDownloadTime : 0);
+
+        AppendKey(json, "failures");
+        json += "{";
+        for ( int i = 0; i < Failure_Max; i++ )
+            AppendField(json, FAILURE_NAMES[i], failures[i]);
+        json += "}";
+
+        json += "}";
+        return json;
+    }
+
+private:
+    // nearest-rank percentile of @a sorted, 0 if it's empty
+    static unsigned long long GetPercentile(const std::vector<unsigned>& sorted, size_t percent)
+    {
+        if ( sorted.empty() )
+            return 0;
+        const size_t rank = (sorted.size() * percent + 99) / 100;
+        return sorted[rank ? rank - 1 : 0];
+    }
+
+    static void AppendKey(std::string& json, const char *name)
+    {
+        if ( json[json.length() - 1] != '{' )
+            json += ",";
+        json += "\"";
+        json += name;
+        json += "\":";
+    }
+
+    static void AppendField(std::string& json, const char *name, unsigned long long value)
+    {
+        AppendKey(json, name);
+        char buf[32];
+        _snprintf(buf, sizeof(buf), "%I64u", value);
+        buf[sizeof(buf) - 1] = '\0';
+        json += buf;
+    }
+
+    static void AppendString(std::string& json, const std::string& value)
+    {
+        json += "\"";
+        for ( std::string::const_iterator i = value.begin(); i != value.end(); ++i )
+        {
+            const unsigned char c = *i;
+            if ( c == '"' || c == '\\' )
+            {
+                json += '\\';
+                json += char(c);
+            }
+            else if ( c < 0x20 )
+            {
+                char buf[8];
+                _snprintf(buf, sizeof(buf), "\\u%04x", c);
+                buf[sizeof(buf) - 1] = '\0';
+                json += buf;
+            }
+            else
+            {
+                json += char(c);
+            }
+        }
+        json += "\"";
+    }
+};
+
+// metrics collected since the last Submit(), guarded by g_csPending
+CriticalSection g_csPending;
+Aggregate g_pending;
+
+// makes Submit() calls run one at a time, so that nothing is sent twice
+CriticalSection g_csSubmit;
+
+bool IsEnabled()
+{
+    return !Settings::GetTelemetryURL().empty();
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                Telemetry
+ *--------------------------------------------------------------------------*/
+
+void Telemetry::AddCheck(unsigned time)
+{
+    if ( !IsEnabled() )
+        return;
+    CriticalSectionLocker lock(g_csPending);
+    g_pending.checks++;
+    g_pending.AddLatency(time);
+}
+
+void Telemetry::AddFailedCheck(const std::exception_ptr& error)
+{
+    if ( !IsEnabled() )
+        return;
+    const Failure failure = ClassifyFailure(error);
+    CriticalSectionLocker lock(g_csPending);
+    g_pending.failedChecks++;
+    g_pending.failures[failure]++;
+}
+
+void Telemetry::AddResponse(unsigned statusCode)
+{
+    if ( statusCode != 200 && statusCode != 304 )
+        return;
+    if ( !IsEnabled() )
+        return;
+    CriticalSectionLocker lock(g_csPending);
+    if ( statusCode == 200 )
+        g_pending.responsesFull++;
+    else
+        g_pending.responsesNotModified++;
+}
+
+void Telemetry::AddBytesDownloaded(unsigned long long bytes)
+{
+    if ( !IsEnabled() )
+        return;
+    CriticalSectionLocker lock(g_csPending);
+    g_pending.bytesDownloaded += bytes;
+}
+
+void Telemetry::AddBytesSavedByCache(unsigned long long bytes)
+{
+    if ( !IsEnabled() )
+        return;
+    CriticalSectionLocker lock(g_csPending);
+    g_pending.bytesSavedByCache += bytes;
+}
+
+void Telemetry::AddUpdateDownload(unsigned long long bytes, unsigned time)
+{
+    if ( !IsEnabled() )
+        return;
+    CriticalSectionLocker lock(g_csPending);
+    g_pending.updateDownloads++;
+    g_pending.updateDownloadBytes += bytes;
+    g_pending.updateDownloadTime += time;
+}
+
+void Telemetry::Submit(Thread& thread)
+{
+    const std::string url = Settings::GetTelemetryURL();
+    if ( url.empty() )
+        return;
+
+    CriticalSectionLocker submitLock(g_csSubmit);
+
+    Aggregate pending;
+    {
+        CriticalSectionLocker lock(g_csPending);
+        std::swap(pending, g_pending);
+    }
+
+    try
+    {
+        const time_t now = time(NULL);
+
+        // saved first, so that nothing is lost if sending fails
+        Aggregate aggregate;
+        aggregate.Load();
+        if ( !aggregate.periodStart )
+            aggregate.periodStart = now;
+        aggregate.Merge(pending);
+        aggregate.Save();
+
+        // the clock may have been set back, too
+        const time_t start = time_t(aggregate.periodStart);
+        if ( aggregate.IsEmpty() || (now >= start && now - start < TELEMETRY_PERIOD) )
+            return;
+
+        PostData(url, "application/json", aggregate.ToJSON(now), &thread);
+        LogInfo("Telemetry sent.");
+
+        Aggregate next;
+        next.periodStart = now;
+        next.Save();
+    }
+    catch ( std::exception& e )
+    {
+        LogError(std::string("Cannot send telemetry: ") + e.what());
+    }
+}
+
+} // namespace winsparkle
@@ -0,0 +1,86 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _telemetry_h_
+#define _telemetry_h_
+
+#include <exception>
+
+namespace winsparkle
+{
+
+class Thread;
+
+/**
+    Opt-in telemetry of the update checks' and downloads' performance.
+
+    If the application set the telemetry URL (see
+    win_sparkle_set_telemetry_url()), the metrics collected by Stats are
+    also aggregated in the settings, so that they survive restarts of the
+    application: check latency percentiles, throughput of update downloads,
+    cache hit rates and the kinds of failures. Once a day, the aggregates
+    are sent to the URL in a single POST request and start over.
+
+    The Add*() methods are called by Stats and do nothing if telemetry is
+    disabled. All methods are thread-safe.
+ */
+class Telemetry
+{
+public:
+    /// Records a successful update check that took @a time ms.
+    static void AddCheck(unsigned time);
+
+    /// Records an update check that failed with @a error.
+    static void AddFailedCheck(const std::exception_ptr& error);
+
+    /// Records a HTTP response with given status code.
+    static void AddResponse(unsigned statusCode);
+
+    /// Counts @a bytes received over the network.
+    static void AddBytesDownloaded(unsigned long long bytes);
+
+    /// Counts @a bytes that were reused from a cache instead of downloaded.
+    static void AddBytesSavedByCache(unsigned long long bytes);
+
+    /// Records download of an update file of @a bytes in @a time ms.
+    static void AddUpdateDownload(unsigned long long bytes, unsigned time);
+
+    /**
+        Saves the metrics aggregated since the last call and sends the
+        aggregates, if a day passed since they were last sent.
+
+        This is meant to be called right after an update check, so that the
+        request can reuse its connection if the telemetry server is the same
+        as the appcast's. Errors are only logged: the aggregates are then
+        kept and sent after the next check.
+
+        Throws TerminateThreadException if @a thread is told to terminate.
+     */
+    static void Submit(Thread& thread);
+};
+
+} // namespace winsparkle
+
+#endif // _telemetry_h_
@@ -24,9 +24,17 @@
  */
 
 #include "threads.h"
-
+#include "apistall.h"
+#include "privateheap.h"
+#include "settings.h"
+#include "utils.h"
+
+#include <vector>
+#include <algorithm>
+#include <sstream>
 #include <windows.h>
 #include <process.h>
+#include <limits.h>
 
 namespace winsparkle
 {
@@ -38,12 +46,27 @@ namespace winsparkle
 namespace
 {
 
-// Sets thread's name for the debugger
-void SetThreadName(DWORD threadId, const char *name)
+// Sets name of the current thread for the debugger and other tools. The
+// name is reset to empty string if @a name is NULL.
+void SetCurrentThreadName(const char *name)
 {
+    // Windows 10 1607 and newer, the name is also visible in crash dumps
+    // and ETW traces
+    typedef HRESULT (WINAPI *SetThreadDescription_t)(HANDLE, PCWSTR);
+    SetThreadDescription_t setThreadDescription = reinterpret_cast<SetThreadDescription_t>(
+        GetProcAddress(GetModuleHandleA("kernel32.dll"), "SetThreadDescription"));
+    if ( setThreadDescription )
+    {
+        setThreadDescription(GetCurrentThread(), name ? AnsiToWide(name).c_str() : L"");
+        return;
+    }
+
 #ifdef _MSC_VER
-    // This code is copied verbatim from MSDN, see
+    // Older systems only support naming threads in a debugger, by raising
+    // a special exception; see
     // http://msdn.microsoft.com/en-us/library/xcb2z8hs%28VS.100%29.aspx
+    if ( !name || !IsDebuggerPresent() )
+        return;
 
     #define MS_VC_EXCEPTION 0x406D1388
 
@@ -57,11 +80,11 @@ void SetThreadName(DWORD threadId, const char *name)
     } THREADNAME_INFO;
     #pragma pack(pop)
 
-    Sleep(10);
+    // The thread names itself, so there's no need to wait for it to start.
     THREADNAME_INFO info;
     info.dwType = 0x1000;
     info.szName = name;
-    info.dwThreadID = threadId;
+    info.dwThreadID = (DWORD)-1;
     info.dwFlags = 0;
 
     __try
@@ -80,29 +103,341 @@ void SetThreadName(DWORD threadId, const char *name)
 #endif // _MSC_VER
 }
 
+
+// Threads that were started and didn't finish yet, see Thread::TerminateAll()
+CriticalSection g_csRunningThreads;
+std::vector<Thread*> g_runningThreads;
+
+// signaled when g_runningThreads becomes empty
+Event g_noRunningThreads(true);
+
+// is Thread::TerminateAll() in progress?
+bool g_terminatingAll = false;
+
+// Statistics of contended locks. They are updated after the wait, briefly,
+// so a spin lock guards them: unlike a critical section, it needs no
+// initialization that static locks could be used before.
+volatile LONG g_lockStatsSpin = 0;
+LockContentionStats g_lockStats;
+
+void RecordLockWait(unsigned long long us)
+{
+    while ( InterlockedExchange(&g_lockStatsSpin, 1) != 0 )
+        Sleep(0);
+
+    g_lockStats.contentions++;
+    g_lockStats.waitTimeUs += us;
+    if ( us > g_lockStats.longestWaitUs )
+        g_lockStats.longestWaitUs = us > UINT_MAX ? UINT_MAX : unsigned(us);
+
+    InterlockedExchange(&g_lockStatsSpin, 0);
+}
+
+// Measures the wait for a lock that was found to be held by another thread.
+class ContendedLockWait
+{
+public:
+    explicit ContendedLockWait(const char *name)
+        : m_stall("waiting for a lock", name)
+    {
+        QueryPerformanceCounter(&m_start);
+    }
+
+    ~ContendedLockWait()
+    {
+        // racing threads would just write the same value
+        static LARGE_INTEGER s_freq;
+        if ( !s_freq.QuadPart )
+            QueryPerformanceFrequency(&s_freq);
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        RecordLockWait((now.QuadPart - m_start.QuadPart) * 1000000 / s_freq.QuadPart);
+    }
+
+private:
+    StallScope m_stall;
+    LARGE_INTEGER m_start;
+};
+
+} // anonymous namespace
+
+
+LockContentionStats GetLockContentionStats()
+{
+    while ( InterlockedExchange(&g_lockStatsSpin, 1) != 0 )
+        Sleep(0);
+    const LockContentionStats stats = g_lockStats;
+    InterlockedExchange(&g_lockStatsSpin, 0);
+    return stats;
+}
+
+
+/*--------------------------------------------------------------------------*
+                            CancellationToken
+ *--------------------------------------------------------------------------*/
+
+bool CancellationToken::Wait(HANDLE handle, DWORD timeout) const
+{
+    // m_event goes first, so that cancellation wins if both are signaled
+    // at once
+    const HANDLE handles[] = { m_event.GetHandle(), handle };
+
+    switch ( WaitForMultipleObjects(handle ? 2 : 1, handles, FALSE, timeout) )
+    {
+        case WAIT_OBJECT_0:
+            throw OperationCancelledException();
+        case WAIT_OBJECT_0 + 1:
+        case WAIT_ABANDONED_0 + 1: // a mutex whose owner exited is acquired too
+            return true;
+        case WAIT_TIMEOUT:
+            return false;
+        default:
+            throw Win32Exception();
+    }
+}
+
+
+/*--------------------------------------------------------------------------*
+                             CriticalSection
+ *--------------------------------------------------------------------------*/
+
+void CriticalSection::EnterContended()
+{
+    ContendedLockWait wait(m_name);
+    EnterCriticalSection(&m_cs);
+}
+
+
+/*--------------------------------------------------------------------------*
+                              ReadWriteLock
+ *--------------------------------------------------------------------------*/
+
+ReadWriteLock::ReadWriteLock(const char *name) : m_srw(NULL), m_name(name)
+{
+    // The functions are resolved here rather than globally, because locks
+    // may be static objects constructed before other globals.
+    HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+    m_acquireShared = reinterpret_cast<SRWLockFunc>(GetProcAddress(kernel32, "AcquireSRWLockShared"));
+    m_releaseShared = reinterpret_cast<SRWLockFunc>(GetProcAddress(kernel32, "ReleaseSRWLockShared"));
+    m_acquireExclusive = reinterpret_cast<SRWLockFunc>(GetProcAddress(kernel32, "AcquireSRWLockExclusive"));
+    m_releaseExclusive = reinterpret_cast<SRWLockFunc>(GetProcAddress(kernel32, "ReleaseSRWLockExclusive"));
+
+    m_tryAcquireShared = reinterpret_cast<SRWTryLockFunc>(GetProcAddress(kernel32, "TryAcquireSRWLockShared"));
+    m_tryAcquireExclusive = reinterpret_cast<SRWTryLockFunc>(GetProcAddress(kernel32, "TryAcquireSRWLockExclusive"));
+
+    if ( !m_acquireShared || !m_releaseShared || !m_acquireExclusive || !m_releaseExclusive )
+        m_acquireShared = m_releaseShared = m_acquireExclusive = m_releaseExclusive = NULL;
+    if ( !m_acquireShared || !m_tryAcquireShared || !m_tryAcquireExclusive )
+        m_tryAcquireShared = m_tryAcquireExclusive = NULL;
+
+    // SRW locks are initialized by zeroing, which was done above
+    InitializeCriticalSection(&m_cs);
+}
+
+ReadWriteLock::~ReadWriteLock()
+{
+    DeleteCriticalSection(&m_cs);
+}
+
+void ReadWriteLock::EnterRead()
+{
+    if ( m_tryAcquireShared )
+    {
+        if ( !m_tryAcquireShared(&m_srw) )
+        {
+            ContendedLockWait wait(m_name);
+            m_acquireShared(&m_srw);
+        }
+    }
+    else if ( m_acquireShared )
+    {
+        // Vista: contention can't be told, so only the stall is measured
+        StallScope stall("waiting for a lock", m_name);
+        m_acquireShared(&m_srw);
+    }
+    else if ( !TryEnterCriticalSection(&m_cs) )
+    {
+        ContendedLockWait wait(m_name);
+        EnterCriticalSection(&m_cs);
+    }
+}
+
+void ReadWriteLock::LeaveRead()
+{
+    if ( m_releaseShared )
+        m_releaseShared(&m_srw);
+    else
+        LeaveCriticalSection(&m_cs);
+}
+
+void ReadWriteLock::EnterWrite()
+{
+    if ( m_tryAcquireExclusive )
+    {
+        if ( !m_tryAcquireExclusive(&m_srw) )
+        {
+            ContendedLockWait wait(m_name);
+            m_acquireExclusive(&m_srw);
+        }
+    }
+    else if ( m_acquireExclusive )
+    {
+        StallScope stall("waiting for a lock", m_name);
+        m_acquireExclusive(&m_srw);
+    }
+    else if ( !TryEnterCriticalSection(&m_cs) )
+    {
+        ContendedLockWait wait(m_name);
+        EnterCriticalSection(&m_cs);
+    }
+}
+
+void ReadWriteLock::LeaveWrite()
+{
+    if ( m_releaseExclusive )
+        m_releaseExclusive(&m_srw);
+    else
+        LeaveCriticalSection(&m_cs);
+}
+
+
+/*--------------------------------------------------------------------------*
+                              OneShotEvent
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// WaitOnAddress() and WakeByAddressAll() are Windows 8+ and only exported
+// from KernelBase.dll, not kernel32.dll.
+typedef BOOL (WINAPI *WaitOnAddress_t)(volatile void*, void*, size_t, DWORD);
+typedef void (WINAPI *WakeByAddressAll_t)(void*);
+
+// Constant-initialized, so that they can be used from static objects'
+// constructors too. Racing threads resolve the same values, so there's
+// no need for locking.
+WaitOnAddress_t g_waitOnAddress = NULL;
+WakeByAddressAll_t g_wakeByAddressAll = NULL;
+volatile LONG g_waitOnAddressResolved = 0;
+
+bool HasWaitOnAddress()
+{
+    if ( !g_waitOnAddressResolved )
+    {
+        HMODULE kernelbase = GetModuleHandleA("kernelbase.dll");
+        if ( kernelbase )
+        {
+            WaitOnAddress_t wait = reinterpret_cast<WaitOnAddress_t>(
+                GetProcAddress(kernelbase, "WaitOnAddress"));
+            WakeByAddressAll_t wake = reinterpret_cast<WakeByAddressAll_t>(
+                GetProcAddress(kernelbase, "WakeByAddressAll"));
+            if ( wait && wake )
+            {
+                g_waitOnAddress = wait;
+                g_wakeByAddressAll = wake;
+            }
+        }
+        InterlockedExchange(&g_waitOnAddressResolved, 1);
+    }
+
+    return g_wakeByAddressAll != NULL;
+}
+
 } // anonymous namespace
 
+OneShotEvent::OneShotEvent() : m_signaled(0), m_fallback(NULL)
+{
+    if ( HasWaitOnAddress() )
+        return;
+
+    m_fallback = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if ( !m_fallback )
+        throw Win32Exception();
+}
+
+
+OneShotEvent::~OneShotEvent()
+{
+    if ( m_fallback )
+        CloseHandle(m_fallback);
+}
+
+
+void OneShotEvent::Signal()
+{
+    if ( m_fallback )
+    {
+        SetEvent(m_fallback);
+        return;
+    }
+
+    // Waking up only uses the address, so it's fine if a waiter already
+    // destroyed the event; at worst, it's a spurious wake-up for another
+    // object at the same address.
+    InterlockedExchange(&m_signaled, 1);
+    g_wakeByAddressAll(const_cast<LONG*>(&m_signaled));
+}
+
+
+bool OneShotEvent::WaitUntilSignaled(DWORD timeoutMilliseconds)
+{
+    if ( m_fallback )
+        return WaitForSingleObject(m_fallback, timeoutMilliseconds) == WAIT_OBJECT_0;
+
+    const DWORD start = GetTickCount();
+    LONG unsignaled = 0;
+    while ( !m_signaled )
+    {
+        DWORD timeout = INFINITE;
+        if ( timeoutMilliseconds != INFINITE )
+        {
+            const DWORD elapsed = GetTickCount() - start;
+            if ( elapsed >= timeoutMilliseconds )
+                return false;
+            timeout = timeoutMilliseconds - elapsed;
+        }
+
+        // returns when woken up, possibly spuriously, or on timeout
+        g_waitOnAddress(&m_signaled, &unsignaled, sizeof(unsignaled), timeout);
+    }
+    return true;
+}
+
 
 /*--------------------------------------------------------------------------*
                               Thread class
  *--------------------------------------------------------------------------*/
 
-Thread::Thread(const char *name) : m_handle(NULL), m_id(0)
+Thread::Thread(const char *name, bool dedicated)
+    : m_handle(NULL), m_name(name), m_dedicated(dedicated)
 {
-    m_handle = (HANDLE)_beginthreadex
-                       (
-                           NULL,                      // default security
-                           0,                         // default stack size
-                           &Thread::ThreadEntryPoint,
-                           this,                      // arguments
-                           CREATE_SUSPENDED,
-                           &m_id                      // thread ID
-                       );
+    if ( dedicated )
+    {
+        m_handle = (HANDLE)_beginthreadex
+                           (
+                               NULL,                      // default security
+                               0,                         // default stack size
+                               &Thread::ThreadEntryPoint,
+                               this,                      // arguments
+                               CREATE_SUSPENDED,
+                               NULL                       // thread ID
+                           );
+    }
+    else
+    {
+        m_handle = CreateEvent
+                   (
+                       NULL,  // default security attributes
+                       TRUE,  // = is manual-reset, so that any number of
+                              //   Join() calls return
+                       FALSE, // initially non-signaled
+                       NULL   // anonymous
+                   );
+    }
 
     if ( !m_handle )
         throw Win32Exception();
-
-    SetThreadName(m_id, name);
 }
 
 
@@ -114,14 +449,40 @@ Thread::~Thread()
 
 
 /*static*/ unsigned __stdcall Thread::ThreadEntryPoint(void *data)
+{
+    Execute(reinterpret_cast<Thread*>(data));
+    return 0;
+}
+
+
+/*static*/ DWORD WINAPI Thread::PoolEntryPoint(void *data)
+{
+    Thread *thread = reinterpret_cast<Thread*>(data);
+
+    // Non-joinable threads delete themselves, nobody waits for them.
+    const HANDLE done = thread->IsJoinable() ? thread->m_handle : NULL;
+
+    Execute(thread);
+
+    // the worker goes back to the pool, don't leave the name on it
+    SetCurrentThreadName(NULL);
+
+    // this must be the very last thing done, the joinable thread object
+    // may be destroyed right after
+    if ( done )
+        SetEvent(done);
+
+    return 0;
+}
+
+
+/*static*/ void Thread::Execute(Thread *thread)
 {
     try
     {
-        Thread *thread = reinterpret_cast<Thread*>(data);
-        thread->Run();
+        SetCurrentThreadName(thread->m_name);
 
-        if ( !thread->IsJoinable() )
-            delete thread;
+        thread->Run();
     }
     catch ( TerminateThreadException& )
     {
@@ -129,7 +490,44 @@ Thread::~Thread()
     }
     CATCH_ALL_EXCEPTIONS
 
-    return 0;
+    const bool wasLast = thread->Unregister();
+
+    if ( !thread->IsJoinable() )
+        delete thread;
+
+    // WinSparkle is idle now, until the next check or API call
+    if ( wasLast )
+        PrivateHeap::Compact();
+}
+
+
+void Thread::Register()
+{
+    CriticalSectionLocker lock(g_csRunningThreads);
+
+    if ( g_runningThreads.empty() )
+        g_noRunningThreads.Reset();
+    g_runningThreads.push_back(this);
+
+    if ( g_terminatingAll )
+        m_cancel.Cancel();
+}
+
+
+bool Thread::Unregister()
+{
+    CriticalSectionLocker lock(g_csRunningThreads);
+
+    std::vector<Thread*>::iterator i =
+        std::find(g_runningThreads.begin(), g_runningThreads.end(), this);
+    if ( i != g_runningThreads.end() )
+        g_runningThreads.erase(i);
+
+    if ( !g_runningThreads.empty() )
+        return false;
+
+    g_noRunningThreads.Signal();
+    return true;
 }
 
 
@@ -138,36 +536,111 @@ void Thread::Start()
     if ( !m_handle )
         throw Win32Exception();
 
-    if ( ResumeThread(m_handle) == (DWORD)-1 )
-        throw Win32Exception();
+    // A thread that doesn't need waiting for may finish and delete itself
+    // as soon as it's launched, so this can't be checked afterwards.
+    const bool wait = IsStartSynchronous();
+
+    Register();
+
+    if ( m_dedicated )
+    {
+        if ( ResumeThread(m_handle) == (DWORD)-1 )
+        {
+            Unregister();
+            throw Win32Exception();
+        }
+    }
+    else
+    {
+        // The pool adds more workers if all of them are busy with long
+        // functions, so threads waiting for each other can't deadlock.
+        if ( !QueueUserWorkItem(&Thread::PoolEntryPoint, this, WT_EXECUTELONGFUNCTION) )
+        {
+            Unregister();
+            throw Win32Exception();
+        }
+    }
 
     // Wait until Run() signals that it is fully initialized.
     // Note that this must be the last manipulation of 'this' in this function!
-    m_signalEvent.WaitUntilSignaled();
+    if ( wait )
+    {
+        StallScope stall("waiting for a thread to start", m_name);
+        m_signalEvent.WaitUntilSignaled();
+    }
 }
 
 
-void Thread::Join()
+bool Thread::Join(DWORD timeout)
 {
     if ( !m_handle )
         throw Win32Exception();
 
-    if ( WaitForSingleObject(m_handle, INFINITE) != WAIT_OBJECT_0 )
+    StallScope stall("waiting for a thread to finish", m_name);
+
+    switch ( WaitForSingleObject(m_handle, timeout) )
+    {
+        case WAIT_OBJECT_0:
+            return true;
+        case WAIT_TIMEOUT:
+            return false;
+        default:
+            throw Win32Exception();
+    }
+}
+
+
+void Thread::JoinWithTerminationCheck(Thread& waiter)
+{
+    if ( !m_handle )
         throw Win32Exception();
+
+    StallScope stall("waiting for a thread to finish", m_name);
+    waiter.WaitWithTerminationCheck(m_handle);
 }
 
 
 void Thread::TerminateAndJoin()
 {
-    m_terminateEvent.Signal();
+    m_cancel.Cancel();
     Join();
 }
 
 
-void Thread::CheckShouldTerminate()
+/*static*/ bool Thread::TerminateAll(DWORD timeout)
+{
+    {
+        CriticalSectionLocker lock(g_csRunningThreads);
+
+        if ( g_runningThreads.empty() )
+            return true;
+
+        g_terminatingAll = true;
+        for ( size_t i = 0; i < g_runningThreads.size(); i++ )
+            g_runningThreads[i]->m_cancel.Cancel();
+    }
+
+    StallScope stall("waiting for all threads to finish");
+    const bool finished = g_noRunningThreads.WaitUntilSignaled(timeout);
+
+    CriticalSectionLocker lock(g_csRunningThreads);
+    g_terminatingAll = false;
+    return finished;
+}
+
+
+/*static*/ std::string Thread::GetRunningThreadNames()
 {
-    if (m_terminateEvent.CheckIfSignaled())
-        throw TerminateThreadException();
+    CriticalSectionLocker lock(g_csRunningThreads);
+
+    std::string names;
+    for ( size_t i = 0; i < g_runningThreads.size(); i++ )
+    {
+        if ( !names.empty() )
+            names += ", ";
+        names += g_runningThreads[i]->m_name ? g_runningThreads[i]->m_name : "unnamed";
+    }
+    return names;
 }
 
 
@@ -176,4 +649,258 @@ void Thread::SignalReady()
     m_signalEvent.Signal();
 }
 
+
+/*--------------------------------------------------------------------------*
+                            BackgroundPriority
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// BackgroundPriority of the current thread, NULL if none
+struct BackgroundPriorityTls
+{
+    BackgroundPriorityTls() : index(TlsAlloc()) {}
+    ~BackgroundPriorityTls() { TlsFree(index); }
+    DWORD index;
+} g_tlsBackgroundPriority;
+
+// Not in older SDKs, see SetThreadInformation() documentation.
+const int ThreadPowerThrottlingClass = 3;  // THREAD_INFORMATION_CLASS
+const ULONG THREAD_POWER_THROTTLING_VERSION = 1;
+const ULONG THREAD_POWER_THROTTLING_SPEED = 0x1;
+
+struct PowerThrottlingState
+{
+    ULONG Version;
+    ULONG ControlMask;
+    ULONG StateMask;
+};
+
+// Opts the current thread in or out of EcoQoS on Windows 11 (and of power
+// throttling on Windows 10 1709+), does nothing on older systems.
+void SetPowerThrottling(HANDLE thread, bool enable)
+{
+    typedef BOOL (WINAPI *SetThreadInformation_t)(HANDLE, int, LPVOID, DWORD);
+    static const SetThreadInformation_t setThreadInformation = reinterpret_cast<SetThreadInformation_t>(
+        GetProcAddress(GetModuleHandleA("kernel32.dll"), "SetThreadInformation"));
+    if ( !setThreadInformation )
+        return;
+
+    // Clearing the control mask gives the decision back to the OS.
+    PowerThrottlingState state;
+    state.Version = THREAD_POWER_THROTTLING_VERSION;
+    state.ControlMask = enable ? THREAD_POWER_THROTTLING_SPEED : 0;
+    state.StateMask = enable ? THREAD_POWER_THROTTLING_SPEED : 0;
+
+    // fails harmlessly on systems that don't know the class
+    setThreadInformation(thread, ThreadPowerThrottlingClass, &state, sizeof(state));
+}
+
+// The user is considered idle after this long without any input, in ms.
+const DWORD USER_IDLE_TIME = 2 * 60 * 1000;
+
+// How long the user's activity is cached for, in ms, as it's checked for
+// every block of data.
+const DWORD USER_ACTIVITY_CACHE_TIME = 1000;
+
+// QUERY_USER_NOTIFICATION_STATE values, not in older SDKs
+const int QUNS_NOT_PRESENT = 1;
+const int QUNS_BUSY = 2;
+const int QUNS_RUNNING_D3D_FULL_SCREEN = 3;
+const int QUNS_PRESENTATION_MODE = 4;
+
+// cached result of IsUserActive(), races are harmless
+volatile DWORD g_userActivityTime = 0;
+volatile bool g_userActive = false;
+
+// Is the user using the computer, or busy with a full-screen application
+// or a presentation?
+bool CheckUserActivity()
+{
+    // Vista and newer
+    typedef HRESULT (WINAPI *SHQueryUserNotificationState_t)(int*);
+    static const SHQueryUserNotificationState_t queryUserNotificationState =
+        reinterpret_cast<SHQueryUserNotificationState_t>(
+            GetProcAddress(LoadLibraryA("shell32.dll"), "SHQueryUserNotificationState"));
+    int state = 0;
+    if ( queryUserNotificationState && SUCCEEDED(queryUserNotificationState(&state)) )
+    {
+        switch ( state )
+        {
+            case QUNS_NOT_PRESENT:
+                // locked, screen saver or another user's session
+                return false;
+            case QUNS_BUSY:
+            case QUNS_RUNNING_D3D_FULL_SCREEN:
+            case QUNS_PRESENTATION_MODE:
+                return true;
+        }
+    }
+
+    LASTINPUTINFO input;
+    input.cbSize = sizeof(input);
+    if ( !GetLastInputInfo(&input) )
+        return true;
+    return GetTickCount() - input.dwTime < USER_IDLE_TIME;
+}
+
+// Should background work stay out of the user's way as much as possible?
+bool IsUserActive()
+{
+    if ( !Settings::GetIdleAwareDownloads() )
+        return true;
+
+    const DWORD now = GetTickCount();
+    if ( g_userActivityTime == 0 || now - g_userActivityTime >= USER_ACTIVITY_CACHE_TIME )
+    {
+        g_userActive = CheckUserActivity();
+        g_userActivityTime = now;
+    }
+    return g_userActive;
+}
+
+} // anonymous namespace
+
+volatile LONG BackgroundPriority::ms_usersWaiting = 0;
+
+BackgroundPriority::BackgroundPriority()
+    : m_thread(GetCurrentThread()), m_active(false), m_backgroundMode(false), m_oldPriority(0)
+{
+    // the outermost instance owns the thread's priority
+    if ( TlsGetValue(g_tlsBackgroundPriority.index) )
+        return;
+
+    TlsSetValue(g_tlsBackgroundPriority.index, this);
+    if ( ms_usersWaiting == 0 && IsUserActive() )
+        Enter();
+}
+
+
+BackgroundPriority::~BackgroundPriority()
+{
+    if ( TlsGetValue(g_tlsBackgroundPriority.index) != this )
+        return;
+
+    if ( m_active )
+        Leave();
+    TlsSetValue(g_tlsBackgroundPriority.index, NULL);
+}
+
+
+/*static*/ bool BackgroundPriority::IsCurrentThreadInBackground()
+{
+    return TlsGetValue(g_tlsBackgroundPriority.index) != NULL;
+}
+
+
+/*static*/ void BackgroundPriority::Refresh()
+{
+    BackgroundPriority *self =
+        static_cast<BackgroundPriority*>(TlsGetValue(g_tlsBackgroundPriority.index));
+    if ( !self )
+        return;
+
+    // full speed while the user waits, or isn't there to be disturbed
+    const bool normal = ms_usersWaiting != 0 || !IsUserActive();
+    if ( normal && self->m_active )
+        self->Leave();
+    else if ( !normal && !self->m_active )
+        self->Enter();
+}
+
+
+/*static*/ bool BackgroundPriority::ShouldYieldToUser()
+{
+    BackgroundPriority *self =
+        static_cast<BackgroundPriority*>(TlsGetValue(g_tlsBackgroundPriority.index));
+    // without idle awareness, the priority is lowered all the time
+    return self && self->m_active && Settings::GetIdleAwareDownloads();
+}
+
+
+void BackgroundPriority::Enter()
+{
+    // background mode is only available since Vista, lower at least
+    // the CPU priority on older systems
+    m_backgroundMode = SetThreadPriority(m_thread, THREAD_MODE_BACKGROUND_BEGIN) != 0;
+    if ( !m_backgroundMode )
+    {
+        m_oldPriority = GetThreadPriority(m_thread);
+        SetThreadPriority(m_thread, THREAD_PRIORITY_LOWEST);
+    }
+    SetPowerThrottling(m_thread, true);
+    m_active = true;
+}
+
+
+void BackgroundPriority::Leave()
+{
+    if ( m_backgroundMode )
+        SetThreadPriority(m_thread, THREAD_MODE_BACKGROUND_END);
+    else
+        SetThreadPriority(m_thread, m_oldPriority);
+    SetPowerThrottling(m_thread, false);
+    m_active = false;
+}
+
+
+/*--------------------------------------------------------------------------*
+                              SessionMutex
+ *--------------------------------------------------------------------------*/
+
+SessionMutex::SessionMutex(const char *purpose, const std::string& key)
+{
+    // The key may be long and contain backslashes, which aren't allowed
+    // in the name, so its FNV-1a hash is used instead.
+    unsigned long long hash = 14695981039346656037ULL;
+    for ( size_t i = 0; i < key.size(); i++ )
+    {
+        hash ^= static_cast<unsigned char>(key[i]);
+        hash *= 1099511628211ULL;
+    }
+
+    std::ostringstream name;
+    name << "Local\\WinSparkle." << purpose << "." << std::hex << hash;
+
+    m_handle = CreateMutexW(NULL, FALSE, AnsiToWide(name.str()).c_str());
+    if ( !m_handle )
+        throw Win32Exception();
+}
+
+
+SessionMutex::~SessionMutex()
+{
+    CloseHandle(m_handle);
+}
+
+
+bool SessionMutex::Lock(Thread *thread)
+{
+    switch ( WaitForSingleObject(m_handle, 0) )
+    {
+        case WAIT_OBJECT_0:
+            return false;
+        case WAIT_ABANDONED:
+            // the previous owner exited without releasing it
+            return true;
+        case WAIT_TIMEOUT:
+            break;
+        default:
+            throw Win32Exception();
+    }
+
+    if ( thread )
+        thread->GetCancellationToken().Wait(m_handle);
+    else if ( WaitForSingleObject(m_handle, INFINITE) == WAIT_FAILED )
+        throw Win32Exception();
+    return true;
+}
+
+
+void SessionMutex::Unlock()
+{
+    ReleaseMutex(m_handle);
+}
+
 } // namespace winsparkle
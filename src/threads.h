@@ -28,6 +28,7 @@
 
 #include "error.h"
 
+#include <string>
 #include <windows.h>
 
 namespace winsparkle
@@ -37,12 +38,19 @@ namespace winsparkle
 class Event
 {
 public:
-    Event()
+    /**
+        Creates the event.
+
+        @param manualReset  If false, the event is reset as soon as one
+                            waiting thread wakes up. If true, it stays
+                            signaled and wakes up all waiting threads.
+     */
+    explicit Event(bool manualReset = false)
     {
         m_handle = CreateEvent
                    (
                        NULL,  // default security attributes
-                       FALSE, // = is auto-resetting
+                       manualReset ? TRUE : FALSE,
                        FALSE, // initially non-signaled
                        NULL   // anonymous
                    );
@@ -69,25 +77,157 @@ public:
         return WaitUntilSignaled(0);
     }
 
+    /// Reset a manual-reset event to non-signaled state
+    void Reset()
+    {
+        ResetEvent(m_handle);
+    }
+
+    /// Returns the underlying handle, e.g. for WaitForMultipleObjects()
+    HANDLE GetHandle() const { return m_handle; }
+
 private:
     HANDLE m_handle;
 };
 
 
+/**
+    Event that is signaled once and then stays signaled, without a kernel
+    object where possible.
+
+    On Windows 8 and newer, it's just a flag that waiting threads block on
+    with WaitOnAddress(), so creating, signaling and checking it doesn't
+    enter the kernel unless somebody waits. Older systems use a kernel
+    event.
+
+    Use Event instead if it must be waited for together with other handles,
+    e.g. with Thread::WaitWithTerminationCheck().
+
+    A waiter may destroy the event as soon as it sees it signaled, even if
+    Signal() didn't return yet; Signal() doesn't touch it afterwards.
+ */
+class OneShotEvent
+{
+public:
+    OneShotEvent();
+    ~OneShotEvent();
+
+    /// Signal the event, waking up all waiting threads
+    void Signal();
+
+    /// Wait until the event is signalled (true) or timeout ellapses (false)
+    bool WaitUntilSignaled(DWORD timeoutMilliseconds = INFINITE);
+
+    bool CheckIfSignaled()
+    {
+        return m_fallback ? WaitForSingleObject(m_fallback, 0) == WAIT_OBJECT_0
+                          : m_signaled != 0;
+    }
+
+private:
+    volatile LONG m_signaled;
+    // kernel event used instead of m_signaled if WaitOnAddress isn't available
+    HANDLE m_fallback;
+
+    OneShotEvent(const OneShotEvent&);
+    OneShotEvent& operator=(const OneShotEvent&);
+};
+
+
+/**
+    Exception thrown when an operation is cancelled, see CancellationToken.
+
+    It intentionally doesn't derive from std::exception, so that handlers
+    of errors don't catch it and report it as one.
+ */
+struct OperationCancelledException
+{
+};
+
+
+/**
+    Lets other threads ask an operation to stop.
+
+    Checking the token with IsCancelled() or ThrowIfCancelled() is just a
+    memory read, so it can be done as often as needed, e.g. for every chunk
+    of downloaded data. Blocking waits should use Wait() instead, which
+    wakes up as soon as the token is cancelled, so that the operation stops
+    right away even in the middle of (asynchronous) network I/O.
+
+    Once cancelled, the token stays cancelled.
+ */
+class CancellationToken
+{
+public:
+    CancellationToken() : m_cancelled(0), m_event(true) {}
+
+    /// Cancels the token. May be called from any thread, any number of times.
+    void Cancel()
+    {
+        InterlockedExchange(&m_cancelled, 1);
+        m_event.Signal();
+    }
+
+    /// Was the token cancelled?
+    bool IsCancelled() const { return m_cancelled != 0; }
+
+    /// Throws OperationCancelledException if the token was cancelled.
+    void ThrowIfCancelled() const
+    {
+        if ( IsCancelled() )
+            throw OperationCancelledException();
+    }
+
+    /**
+        Waits until @a handle is signaled or the token is cancelled,
+        whichever comes first. Throws OperationCancelledException in the
+        latter case.
+
+        @param handle   Handle to wait for, may be NULL to only wait for
+                        the timeout.
+        @param timeout  Timeout in milliseconds.
+
+        @return true if @a handle was signaled, false if the timeout
+                elapsed.
+     */
+    bool Wait(HANDLE handle, DWORD timeout = INFINITE) const;
+
+    /// Returns the handle signaled when the token is cancelled.
+    HANDLE GetHandle() const { return m_event.GetHandle(); }
+
+private:
+    volatile LONG m_cancelled;
+    Event m_event;
+};
+
+
 /**
 C++ wrapper for win32 critical section object.
 */
 class CriticalSection
 {
 public:
-    CriticalSection() { InitializeCriticalSection(&m_cs); }
+    /**
+        @param name  Name of what the section protects, for
+                     win_sparkle_set_api_stall_threshold() reports.
+     */
+    explicit CriticalSection(const char *name = NULL) : m_name(name)
+        { InitializeCriticalSection(&m_cs); }
     ~CriticalSection() { DeleteCriticalSection(&m_cs); }
 
-    void Enter() { EnterCriticalSection(&m_cs); }
+    void Enter()
+    {
+        // only waiting is worth measuring, see ApiCallTimer
+        if ( !TryEnterCriticalSection(&m_cs) )
+            EnterContended();
+    }
     void Leave() { LeaveCriticalSection(&m_cs); }
 
 private:
+    void EnterContended();
+
     CRITICAL_SECTION m_cs;
+    const char *m_name;
 };
 
 
@@ -106,6 +246,91 @@ private:
 };
 
 
+/// Statistics of waits for locks, see GetLockContentionStats().
+struct LockContentionStats
+{
+    /// Number of times a lock held by another thread had to be waited for
+    unsigned contentions;
+    /// Total time spent waiting, in microseconds
+    unsigned long long waitTimeUs;
+    /// Longest single wait, in microseconds
+    unsigned longestWaitUs;
+};
+
+/**
+    Returns how long threads waited for CriticalSection and ReadWriteLock
+    locks held by other threads, since the process started.
+
+    ReadWriteLock waits aren't counted on Windows Vista, where it can't be
+    told if the lock was contended.
+ */
+LockContentionStats GetLockContentionStats();
+
+
+/**
+    Lock that can be held by several readers at once, or by one writer.
+
+    Uses slim reader/writer lock where available (Windows Vista and newer),
+    so that uncontended read locking is a single interlocked operation and
+    readers never wait for each other. On older systems, it behaves like
+    a critical section.
+
+    Unlike CriticalSection, it is not recursive: a thread holding the lock
+    must not lock it again, not even for reading.
+ */
+class ReadWriteLock
+{
+public:
+    /// @param name  Name of what the lock protects, see CriticalSection.
+    explicit ReadWriteLock(const char *name = NULL);
+    ~ReadWriteLock();
+
+    void EnterRead();
+    void LeaveRead();
+    void EnterWrite();
+    void LeaveWrite();
+
+private:
+    typedef void (WINAPI *SRWLockFunc)(void*);
+    typedef BOOLEAN (WINAPI *SRWTryLockFunc)(void*);
+
+    // SRWLOCK, declared as void* to work with SDKs targeting XP too
+    void *m_srw;
+    SRWLockFunc m_acquireShared, m_releaseShared, m_acquireExclusive, m_releaseExclusive;
+    // only available since Windows 7, NULL before
+    SRWTryLockFunc m_tryAcquireShared, m_tryAcquireExclusive;
+    const char *m_name;
+
+    // used if SRW locks aren't available
+    CRITICAL_SECTION m_cs;
+
+    ReadWriteLock(const ReadWriteLock&);
+    ReadWriteLock& operator=(const ReadWriteLock&);
+};
+
+/// Locks ReadWriteLock for reading as RIIA.
+class ReadLocker
+{
+public:
+    ReadLocker(ReadWriteLock& lock) : m_lock(lock) { lock.EnterRead(); }
+    ~ReadLocker() { m_lock.LeaveRead(); }
+
+private:
+    ReadWriteLock& m_lock;
+};
+
+/// Locks ReadWriteLock for writing as RIIA.
+class WriteLocker
+{
+public:
+    WriteLocker(ReadWriteLock& lock) : m_lock(lock) { lock.EnterWrite(); }
+    ~WriteLocker() { m_lock.LeaveWrite(); }
+
+private:
+    ReadWriteLock& m_lock;
+};
+
+
 /**
     Lightweight thread class.
 
@@ -123,11 +348,19 @@ public:
 
         Note that you must explicitly call Start() to start it.
 
+        By default, Run() is executed on a worker thread of the system
+        thread pool, so that starting the thread doesn't have the cost of
+        creating a new OS thread.
+
         @param name Descriptive name of the thread. This is shown in (Visual C++)
                     debugger and should always be set to something meaningful to
-                    help identify WinSparkle threads.
+                    help identify WinSparkle threads. It must be a string
+                    literal or otherwise outlive the thread.
+        @param dedicated Run in a new OS thread of its own instead. Use this
+                    for long-lived threads with a message loop or windows,
+                    which shouldn't occupy a pool thread.
      */
-    Thread(const char *name);
+    Thread(const char *name, bool dedicated = false);
 
     virtual ~Thread();
 
@@ -136,7 +369,10 @@ public:
 
         Calls Run() in the new thread's context.
 
-        This method doesn't return until Run() calls SignalReady().
+        If IsStartSynchronous() is true, this method doesn't return until
+        Run() calls SignalReady(). Otherwise it returns right away; a
+        non-joinable thread may then be gone already, so the caller must not
+        use it anymore.
 
         Throws on error.
      */
@@ -144,8 +380,21 @@ public:
 
     /**
         Wait for the thread to terminate.
+
+        @param timeout  How long to wait, in milliseconds.
+
+        @return true if the thread terminated, false if the timeout elapsed.
      */
-    void Join();
+    bool Join(DWORD timeout = INFINITE);
+
+    /**
+        Wait for the thread to terminate, like Join(), but stop waiting if
+        @a waiter is asked to terminate meanwhile.
+
+        Must be called from @a waiter's thread. Throws
+        TerminateThreadException if @a waiter should terminate.
+     */
+    void JoinWithTerminationCheck(Thread& waiter);
 
     /**
         Signal the thread to terminate and call Join().
@@ -154,12 +403,59 @@ public:
               CheckShouldTerminate() frequently.
      */
     void TerminateAndJoin();
-    
+
+    /**
+        Signals all running threads to terminate and waits for them.
+
+        Threads started while this is in progress are told to terminate
+        right away.
+
+        @param timeout  How long to wait for the threads, in milliseconds.
+
+        @return true if all threads finished, false if some were still
+                running when the timeout elapsed.
+     */
+    static bool TerminateAll(DWORD timeout);
+
+    /**
+        Returns names of the threads that are still running, separated with
+        commas, for diagnostics.
+     */
+    static std::string GetRunningThreadNames();
+
+    /**
+        Returns the token cancelled when the thread is asked to terminate.
+
+        Pass it to code that doesn't know about the thread, to let it stop
+        early.
+     */
+    CancellationToken& GetCancellationToken() { return m_cancel; }
+
     /// Check if the thread should terminate and throw TerminateThreadException if so.
-    void CheckShouldTerminate();
+    void CheckShouldTerminate() { m_cancel.ThrowIfCancelled(); }
+
+    /**
+        Wait until @a event is signaled or the thread is asked to terminate,
+        whichever comes first. Throws TerminateThreadException in the latter
+        case.
+
+        This must be called from the thread itself. Unlike polling
+        CheckShouldTerminate(), it doesn't wake up until either happens.
+     */
+    void WaitWithTerminationCheck(Event& event)
+    {
+        WaitWithTerminationCheck(event.GetHandle());
+    }
+
+    /// Same as WaitWithTerminationCheck(Event&), for any waitable handle.
+    void WaitWithTerminationCheck(HANDLE handle) { m_cancel.Wait(handle); }
 
 protected:
-    /// Signals Start() that the thread is up and ready.
+    /**
+        Signals Start() that the thread is up and ready.
+
+        Only needed if IsStartSynchronous() is true, but harmless otherwise.
+     */
     void SignalReady();
 
     /**
@@ -172,18 +468,170 @@ protected:
     /// Is the thread joinable?
     virtual bool IsJoinable() const = 0;
 
+    /**
+        Does the caller of Start() need to wait until the thread is
+        initialized, see SignalReady()?
+
+        False by default, so that starting a worker doesn't cost the caller
+        a round trip to the new thread.
+     */
+    virtual bool IsStartSynchronous() const { return false; }
+
     /// This exception is thrown when the thread was terminated.
-    struct TerminateThreadException
-    {
-    };
+    typedef OperationCancelledException TerminateThreadException;
 
 private:
     static unsigned __stdcall ThreadEntryPoint(void *data);
+    static DWORD WINAPI PoolEntryPoint(void *data);
+    static void Execute(Thread *thread);
+    void Register();
+    // returns true if no other thread is running
+    bool Unregister();
 
 protected:
+    // Handle to wait on for the thread to finish: the OS thread itself for
+    // dedicated threads, manual-reset event signaled when done otherwise.
     HANDLE m_handle;
-    unsigned m_id;
-    Event m_signalEvent, m_terminateEvent;
+    const char *m_name;
+    bool m_dedicated;
+    OneShotEvent m_signalEvent;
+    CancellationToken m_cancel;
+};
+
+
+/**
+    Lowers priority of the current thread for as long as it exists.
+
+    Disk and network I/O of the thread are deprioritized too where
+    supported (Vista and newer) and on Windows 11, the thread is marked as
+    EcoQoS work, which the OS schedules on efficient cores at low clock.
+
+    Nested instances on the same thread don't do anything. Long running
+    work should call Refresh() periodically, so that the thread runs at
+    normal priority while the user waits for WinSparkle (see UserWaiting)
+    or is idle, and only stays out of the way while the user is using the
+    computer and not waiting.
+ */
+class BackgroundPriority
+{
+public:
+    BackgroundPriority();
+    ~BackgroundPriority();
+
+    /// Is the current thread in background mode set by BackgroundPriority?
+    static bool IsCurrentThreadInBackground();
+
+    /**
+        Temporarily restores normal priority of the current thread if the
+        user is waiting or idle, or lowers it again if not anymore.
+
+        Does nothing if there's no BackgroundPriority on this thread. This
+        is cheap and can be called for every block of data processed.
+     */
+    static void Refresh();
+
+    /**
+        Should the current thread's work, including network transfers,
+        yield to the user's right now?
+
+        True if its priority is lowered because the user is active, as of
+        the last Refresh(), and win_sparkle_set_idle_aware_downloads() is
+        enabled.
+     */
+    static bool ShouldYieldToUser();
+
+    /**
+        Marks the user as actively waiting, e.g. for a download in the
+        update dialog, as RIIA.
+
+        Background work of this process doesn't get in the way for as long
+        as any instance exists.
+     */
+    class UserWaiting
+    {
+    public:
+        UserWaiting() { InterlockedIncrement(&ms_usersWaiting); }
+        ~UserWaiting() { InterlockedDecrement(&ms_usersWaiting); }
+
+    private:
+        UserWaiting(const UserWaiting&);
+        UserWaiting& operator=(const UserWaiting&);
+    };
+
+private:
+    void Enter();
+    void Leave();
+
+    HANDLE m_thread;
+    // is the priority lowered right now?
+    bool m_active;
+    // was THREAD_MODE_BACKGROUND_BEGIN used or only the CPU priority lowered?
+    bool m_backgroundMode;
+    int m_oldPriority;
+
+    static volatile LONG ms_usersWaiting;
+
+    BackgroundPriority(const BackgroundPriority&);
+    BackgroundPriority& operator=(const BackgroundPriority&);
+};
+
+
+/**
+    Mutex shared by all processes in the user's session.
+
+    This coordinates work that several processes using WinSparkle would
+    otherwise duplicate, e.g. several instances of the same app checking
+    the same feed at once. The state they share is in the settings and in
+    the update cache.
+
+    Like other Windows mutexes, it's owned by a thread and is recursive.
+ */
+class SessionMutex
+{
+public:
+    /**
+        Opens the mutex for @a purpose and @a key (e.g. the URL of the
+        resource the mutex protects), creating it if it doesn't exist
+        yet. Throws on error.
+     */
+    SessionMutex(const char *purpose, const std::string& key);
+    ~SessionMutex();
+
+    /**
+        Acquires the mutex, waiting for it as long as needed.
+
+        Throws TerminateThreadException if @a thread is told to terminate
+        while waiting.
+
+        @return true if the mutex was owned by somebody else and had to be
+                waited for, false if it was acquired right away.
+     */
+    bool Lock(Thread *thread);
+
+    /// Releases the mutex acquired with Lock().
+    void Unlock();
+
+private:
+    HANDLE m_handle;
+
+    SessionMutex(const SessionMutex&);
+    SessionMutex& operator=(const SessionMutex&);
+};
+
+/// Locks SessionMutex as RIIA.
+class SessionMutexLocker
+{
+public:
+    SessionMutexLocker(SessionMutex& mutex, Thread *thread)
+        : m_mutex(mutex), m_waited(mutex.Lock(thread)) {}
+    ~SessionMutexLocker() { m_mutex.Unlock(); }
+
+    /// Did another owner of the mutex have to be waited for?
+    bool HadToWait() const { return m_waited; }
+
+private:
+    SessionMutex& m_mutex;
+    bool m_waited;
 };
 
 } // namespace winsparkle
@@ -0,0 +1,269 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+#include "trace.h"
+#include "utils.h"
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// {D5101EFE-0E4B-594F-87E5-0A51C07DECCB}, hash of "WinSparkle" as computed by
+// TraceLoggingRegister() and EventSource
+const GUID PROVIDER_ID =
+    { 0xd5101efe, 0x0e4b, 0x594f, { 0x87, 0xe5, 0x0a, 0x51, 0xc0, 0x7d, 0xec, 0xcb } };
+
+// TraceLogging provider metadata: 16-bit total size followed by the name
+const char PROVIDER_METADATA[] = "\x0d\x00" "WinSparkle";
+
+// values from TraceLoggingProvider.h, not in older SDKs
+const UCHAR CHANNEL_TRACELOGGING = 11;
+const UCHAR TLG_IN_ANSISTRING = 2;
+const UCHAR TLG_IN_UINT64 = 10;
+const UCHAR TLG_OUT_UTF8 = 35;
+const UCHAR TLG_CHAIN_FLAG = 0x80;
+
+const ULONG DATA_DESCRIPTOR_TYPE_EVENT_METADATA = 1;
+const ULONG DATA_DESCRIPTOR_TYPE_PROVIDER_METADATA = 2;
+
+const ULONG CONTROL_CODE_CAPTURE_STATE = 2;
+
+// EventSetInformation() is Windows 8+, not in older SDKs
+const int EVENT_PROVIDER_SET_TRAITS = 2;
+typedef ULONG WINAPI EventSetInformation_t(REGHANDLE, int, PVOID, ULONG);
+
+// ETW functions are only available since Vista
+decltype(EventRegister)          *g_eventRegister = NULL;
+decltype(EventUnregister)        *g_eventUnregister = NULL;
+decltype(EventWriteTransfer)     *g_eventWriteTransfer = NULL;
+decltype(EventActivityIdControl) *g_eventActivityIdControl = NULL;
+
+REGHANDLE g_provider = 0;
+
+void SetDataDescriptor(EVENT_DATA_DESCRIPTOR& desc, const void *data, size_t size, ULONG type = 0)
+{
+    desc.Ptr = reinterpret_cast<ULONG_PTR>(data);
+    desc.Size = static_cast<ULONG>(size);
+    desc.Reserved = type; // EVENT_DATA_DESCRIPTOR::Type in newer SDKs
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                 Tracing
+ *--------------------------------------------------------------------------*/
+
+volatile LONG Tracing::ms_enabledLevelPlus1 = 0;
+
+void Tracing::Register()
+{
+    if ( g_provider )
+        return;
+
+    g_eventRegister = LOAD_DYNAMIC_FUNC(EventRegister, advapi32);
+    g_eventUnregister = LOAD_DYNAMIC_FUNC(EventUnregister, advapi32);
+    g_eventWriteTransfer = LOAD_DYNAMIC_FUNC(EventWriteTransfer, advapi32);
+    g_eventActivityIdControl = LOAD_DYNAMIC_FUNC(EventActivityIdControl, advapi32);
+    if ( !g_eventRegister || !g_eventUnregister || !g_eventWriteTransfer || !g_eventActivityIdControl )
+        return;
+
+    if ( g_eventRegister(&PROVIDER_ID, &Tracing::OnEnable, NULL, &g_provider) != ERROR_SUCCESS )
+    {
+        g_provider = 0;
+        return;
+    }
+
+    // tell ETW the provider's name, for decoding its events (Windows 8+)
+    auto f_EventSetInformation =
+        LoadDynamicFunc<EventSetInformation_t>("EventSetInformation", "advapi32");
+    if ( f_EventSetInformation )
+    {
+        f_EventSetInformation(g_provider, EVENT_PROVIDER_SET_TRAITS,
+                              const_cast<char*>(PROVIDER_METADATA), sizeof(PROVIDER_METADATA));
+    }
+}
+
+void Tracing::Unregister()
+{
+    if ( !g_provider )
+        return;
+
+    InterlockedExchange(&ms_enabledLevelPlus1, 0);
+    g_eventUnregister(g_provider);
+    g_provider = 0;
+}
+
+bool Tracing::GetCurrentActivityId(GUID& id)
+{
+    if ( !IsEnabled() )
+        return false;
+    return g_eventActivityIdControl(EVENT_ACTIVITY_CTRL_GET_ID, &id) == ERROR_SUCCESS;
+}
+
+void NTAPI Tracing::OnEnable(LPCGUID, ULONG isEnabled, UCHAR level,
+                             ULONGLONG, ULONGLONG,
+                             PEVENT_FILTER_DESCRIPTOR, PVOID)
+{
+    if ( isEnabled == CONTROL_CODE_CAPTURE_STATE )
+        return; // we have no state to report
+
+    // level 0 means all levels
+    LONG levelPlus1 = 0;
+    if ( isEnabled )
+        levelPlus1 = level ? level + 1 : 256;
+    InterlockedExchange(&ms_enabledLevelPlus1, levelPlus1);
+}
+
+
+/*--------------------------------------------------------------------------*
+                                TraceEvent
+ *--------------------------------------------------------------------------*/
+
+TraceEvent::TraceEvent(const char *name, Tracing::Level level, Opcode opcode)
+    : m_enabled(Tracing::IsEnabled(level)),
+      m_level(static_cast<UCHAR>(level)),
+      m_opcode(opcode)
+{
+    if ( !m_enabled )
+        return;
+
+    // TraceLogging event metadata: 16-bit total size (filled in by
+    // Write()), tags (none), name and then the fields
+    m_metadata.append(2, '\0');
+    m_metadata.append(1, '\0');
+    m_metadata.append(name);
+    m_metadata.append(1, '\0');
+}
+
+TraceEvent& TraceEvent::Field(const char *name, unsigned long long value)
+{
+    if ( !m_enabled )
+        return *this;
+
+    m_metadata.append(name);
+    m_metadata.append(1, '\0');
+    m_metadata.append(1, char(TLG_IN_UINT64));
+
+    m_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    return *this;
+}
+
+TraceEvent& TraceEvent::Field(const char *name, const char *value)
+{
+    if ( !m_enabled )
+        return *this;
+
+    m_metadata.append(name);
+    m_metadata.append(1, '\0');
+    m_metadata.append(1, char(TLG_IN_ANSISTRING | TLG_CHAIN_FLAG));
+    m_metadata.append(1, char(TLG_OUT_UTF8));
+
+    m_data.append(value ? value : "");
+    m_data.append(1, '\0');
+    return *this;
+}
+
+void TraceEvent::Write(const GUID *activity, const GUID *related)
+{
+    // the provider may have been unregistered since the event was created
+    if ( !m_enabled || !g_provider )
+        return;
+
+    const USHORT metadataSize = static_cast<USHORT>(m_metadata.size());
+    memcpy(&m_metadata[0], &metadataSize, sizeof(metadataSize));
+
+    EVENT_DESCRIPTOR desc = { 0 };
+    desc.Channel = CHANNEL_TRACELOGGING;
+    desc.Level = m_level;
+    desc.Opcode = static_cast<UCHAR>(m_opcode);
+
+    EVENT_DATA_DESCRIPTOR data[3];
+    SetDataDescriptor(data[0], PROVIDER_METADATA, sizeof(PROVIDER_METADATA),
+                      DATA_DESCRIPTOR_TYPE_PROVIDER_METADATA);
+    SetDataDescriptor(data[1], m_metadata.data(), m_metadata.size(),
+                      DATA_DESCRIPTOR_TYPE_EVENT_METADATA);
+    SetDataDescriptor(data[2], m_data.data(), m_data.size());
+
+    g_eventWriteTransfer(g_provider, &desc, activity, related, m_data.empty() ? 2 : 3, data);
+}
+
+
+/*--------------------------------------------------------------------------*
+                               TraceActivity
+ *--------------------------------------------------------------------------*/
+
+TraceActivity::TraceActivity(const char *name)
+    : m_name(name), m_result(NULL), m_started(false)
+{
+    if ( !Tracing::IsEnabled() )
+        return;
+
+    if ( g_eventActivityIdControl(EVENT_ACTIVITY_CTRL_CREATE_ID, &m_id) != ERROR_SUCCESS )
+        return;
+
+    // make it the thread's current activity, remembering the previous one
+    m_parentId = m_id;
+    if ( g_eventActivityIdControl(EVENT_ACTIVITY_CTRL_GET_SET_ID, &m_parentId) != ERROR_SUCCESS )
+        return;
+
+    m_started = true;
+    TraceEvent(m_name, Tracing::Level_Info, TraceEvent::Opcode_Start).Write(&m_id, &m_parentId);
+}
+
+TraceActivity::~TraceActivity()
+{
+    if ( !m_started )
+        return;
+
+    TraceEvent stop(m_name, Tracing::Level_Info, TraceEvent::Opcode_Stop);
+    if ( m_result )
+        stop.Field("Result", m_result);
+    stop.Write(&m_id);
+
+    g_eventActivityIdControl(EVENT_ACTIVITY_CTRL_SET_ID, &m_parentId);
+}
+
+
+/*--------------------------------------------------------------------------*
+                                TraceTimer
+ *--------------------------------------------------------------------------*/
+
+unsigned long long TraceTimer::GetMicroseconds() const
+{
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    if ( frequency.QuadPart == 0 )
+        return 0;
+    return (now.QuadPart - m_start.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+} // namespace winsparkle
@@ -0,0 +1,189 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _trace_h_
+#define _trace_h_
+
+#include <string>
+#include <windows.h>
+#include <evntprov.h>
+
+namespace winsparkle
+{
+
+/**
+    Event Tracing for Windows (ETW) provider, for profiling WinSparkle with
+    tools such as Windows Performance Analyzer.
+
+    The events use the TraceLogging encoding, so they can be decoded
+    without a manifest. The provider is named "WinSparkle", and its GUID
+    {D5101EFE-0E4B-594F-87E5-0A51C07DECCB} is derived from that name the
+    same way as for other TraceLogging providers, so tools accept either.
+
+    If no trace session collects the events, writing one costs a single
+    memory read. Tracing is not available on Windows XP.
+ */
+class Tracing
+{
+public:
+    /// Event levels, as in ETW.
+    enum Level
+    {
+        Level_Info = 4,
+        Level_Verbose = 5
+    };
+
+    /// Registers the provider. Errors are ignored, there are just no events.
+    static void Register();
+
+    /// Unregisters the provider.
+    static void Unregister();
+
+    /**
+        Gets the calling thread's current activity, see TraceActivity.
+
+        @return false if tracing is disabled.
+     */
+    static bool GetCurrentActivityId(GUID& id);
+
+    /// Is any trace session collecting events of this @a level?
+    static bool IsEnabled(Level level = Level_Info)
+    {
+        return level < ms_enabledLevelPlus1;
+    }
+
+private:
+    static void NTAPI OnEnable(LPCGUID sourceId, ULONG isEnabled, UCHAR level,
+                               ULONGLONG matchAnyKeyword, ULONGLONG matchAllKeyword,
+                               PEVENT_FILTER_DESCRIPTOR filterData, PVOID context);
+
+    // 0 if disabled, 256 for all levels
+    static volatile LONG ms_enabledLevelPlus1;
+};
+
+
+/**
+    Event to write to the trace.
+
+    Fields are added with Field() and the event is written by Write():
+
+    @code
+    TraceEvent("AppcastParsed").Field("Bytes", xml.size()).Write();
+    @endcode
+
+    If tracing is disabled, it does nothing, so there's no need to check
+    Tracing::IsEnabled() first, unless computing the fields is expensive.
+ */
+class TraceEvent
+{
+public:
+    /// Kinds of events, as in ETW.
+    enum Opcode
+    {
+        Opcode_Info = 0,
+        Opcode_Start = 1,
+        Opcode_Stop = 2
+    };
+
+    explicit TraceEvent(const char *name,
+                        Tracing::Level level = Tracing::Level_Info,
+                        Opcode opcode = Opcode_Info);
+
+    /// Adds an unsigned integer field.
+    TraceEvent& Field(const char *name, unsigned long long value);
+
+    /// Adds an UTF-8 string field.
+    TraceEvent& Field(const char *name, const char *value);
+
+    TraceEvent& Field(const char *name, const std::string& value)
+    {
+        return Field(name, value.c_str());
+    }
+
+    /**
+        Writes the event.
+
+        @param activity  Activity the event belongs to, see TraceActivity.
+                         If NULL, the calling thread's current activity.
+        @param related   For start events, the parent activity.
+     */
+    void Write(const GUID *activity = NULL, const GUID *related = NULL);
+
+private:
+    bool m_enabled;
+    UCHAR m_level;
+    Opcode m_opcode;
+    std::string m_metadata;
+    std::string m_data;
+};
+
+
+/**
+    Groups events into an activity for its lifetime.
+
+    Writes the activity's start event when created and its stop event when
+    destroyed. Events written in between by the same thread belong to the
+    activity. Events written on other threads can be added to it with
+    GetId().
+ */
+class TraceActivity
+{
+public:
+    explicit TraceActivity(const char *name);
+    ~TraceActivity();
+
+    /// Returns the activity's ID, NULL if tracing is disabled.
+    const GUID *GetId() const { return m_started ? &m_id : NULL; }
+
+    /// Sets the result reported with the stop event.
+    void SetResult(const char *result) { m_result = result; }
+
+private:
+    const char *m_name;
+    const char *m_result;
+    bool m_started;
+    GUID m_id;
+    GUID m_parentId;
+
+    TraceActivity(const TraceActivity&);
+    TraceActivity& operator=(const TraceActivity&);
+};
+
+
+/// Measures elapsed time, for the events' duration fields and statistics.
+class TraceTimer
+{
+public:
+    TraceTimer() { QueryPerformanceCounter(&m_start); }
+
+    /// Returns time since the timer was created in microseconds.
+    unsigned long long GetMicroseconds() const;
+
+private:
+    LARGE_INTEGER m_start;
+};
+
+} // namespace winsparkle
+
+#endif // _trace_h_
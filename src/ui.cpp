@@ -24,10 +24,13 @@
  */
 
 #include "ui.h"
+#include "allocstats.h"
 #include "settings.h"
 #include "error.h"
+#include "stats.h"
 #include "updatechecker.h"
 #include "updatedownloader.h"
+#include "updatescheduler.h"
 #include "appcontroller.h"
 
 #define wxNO_NET_LIB
@@ -52,13 +55,18 @@
 #include <wx/timer.h>
 #include <wx/settings.h>
 #include <wx/msw/ole/activex.h>
+#include <wx/msw/private.h>
 #include <wx/msgdlg.h>
 
 #include <exdisp.h>
+#include <exdispid.h>
 #include <mshtml.h>
 #include <commctrl.h>
 #include <shellapi.h>
 
+#include <map>
+#include <memory>
+
 
 #if !wxCHECK_VERSION(2,9,0)
 #error "wxWidgets >= 2.9 is required to compile this code"
@@ -90,10 +98,8 @@ void DoShowElement(wxSizer *s, bool show)
     s->ShowItems(show);
 }
 
-#define SHOW(c)    DoShowElement(c, true)
-#define HIDE(c)    DoShowElement(c, false)
 
-wxIcon LoadNamedIcon(HMODULE module, const wchar_t *iconName, int size)
+wxIcon DoLoadNamedIcon(HMODULE module, const wchar_t *iconName, int size)
 {
     HICON hIcon = NULL;
 
@@ -120,12 +126,86 @@ wxIcon LoadNamedIcon(HMODULE module, const wchar_t *iconName, int size)
     return icon;
 }
 
+
+// Name of an icon resource, which is either a string or an integer ID.
+struct IconName
+{
+    IconName() : id(0) {}
+
+    explicit IconName(const wchar_t *n)
+    {
+        if ( IS_INTRESOURCE(n) )
+            id = reinterpret_cast<ULONG_PTR>(n);
+        else
+        {
+            id = 0;
+            name = n;
+        }
+    }
+
+    const wchar_t *Get() const
+    {
+        return id ? MAKEINTRESOURCEW(id) : name.c_str();
+    }
+
+    bool IsEmpty() const { return !id && name.empty(); }
+
+    bool operator<(const IconName& other) const
+    {
+        return id != other.id ? id < other.id : name < other.name;
+    }
+
+    ULONG_PTR    id;
+    std::wstring name;
+};
+
+
+/**
+    Icons loaded so far, so that every dialog doesn't decode them again.
+
+    Only used from the UI thread, so it's not locked. The icons must be
+    freed while wx is still running, so this is cleared in App::OnExit().
+ */
+class IconCache
+{
+public:
+    wxIcon Get(HMODULE module, const wchar_t *iconName, int size)
+    {
+        const Key key(std::make_pair(module, IconName(iconName)), size);
+
+        Icons::const_iterator i = m_icons.find(key);
+        if ( i != m_icons.end() )
+            return i->second;
+
+        // failures are cached too, they wouldn't succeed the next time
+        wxIcon icon = DoLoadNamedIcon(module, iconName, size);
+        m_icons[key] = icon;
+        return icon;
+    }
+
+    void Clear() { m_icons.clear(); }
+
+private:
+    typedef std::pair<std::pair<HMODULE, IconName>, int> Key;
+    typedef std::map<Key, wxIcon> Icons;
+    Icons m_icons;
+};
+
+IconCache g_iconCache;
+
+// Name of the application's icon, see GetApplicationIcon()
+IconName g_appIconName;
+bool g_appIconNameResolved = false;
+
+
+wxIcon LoadNamedIcon(HMODULE module, const wchar_t *iconName, int size)
+{
+    return g_iconCache.Get(module, iconName, size);
+}
+
 BOOL CALLBACK GetFirstIconProc(HMODULE hModule, LPCTSTR lpszType, LPTSTR lpszName, LONG_PTR lParam)
 {
-    if (IS_INTRESOURCE(lpszName))
-        *((LPTSTR*)lParam) = lpszName;
-    else
-        *((LPTSTR*)lParam) = _tcsdup(lpszName);
+    *reinterpret_cast<IconName*>(lParam) = IconName(lpszName);
     return FALSE; // stop on the first icon found
 }
 
@@ -135,107 +215,199 @@ wxIcon GetApplicationIcon(int size)
     if ( !hParentExe )
         return wxNullIcon;
 
-    LPTSTR iconName = 0;
-    EnumResourceNames(hParentExe, RT_GROUP_ICON, GetFirstIconProc, (LONG_PTR)&iconName);
+    // The resources can't change while running, so find the icon only once.
+    if ( !g_appIconNameResolved )
+    {
+        g_appIconNameResolved = true;
+
+        IconName iconName;
+        EnumResourceNames(hParentExe, RT_GROUP_ICON, GetFirstIconProc, (LONG_PTR)&iconName);
 
-    if ( GetLastError() != ERROR_SUCCESS && GetLastError() != ERROR_RESOURCE_ENUM_USER_STOP )
-        return wxNullIcon;
+        if ( GetLastError() != ERROR_SUCCESS && GetLastError() != ERROR_RESOURCE_ENUM_USER_STOP )
+            return wxNullIcon;
 
-    wxIcon icon = LoadNamedIcon(hParentExe, iconName, size);
+        g_appIconName = iconName;
+    }
 
-    if ( !IS_INTRESOURCE(iconName) )
-        free(iconName);
+    if ( g_appIconName.IsEmpty() )
+        return wxNullIcon;
 
-    return icon;
+    return LoadNamedIcon(hParentExe, g_appIconName.Get(), size);
 }
 
 
 struct EventPayload
 {
-    Appcast      appcast;
-    size_t       sizeDownloaded, sizeTotal;
+    AppcastPtr   appcast;
     std::wstring updateFile;
     bool         installAutomatically;
     ErrorCode    error;
+    bool         success;
 };
 
 
-struct EnumProcessWindowsData
+/**
+    Latest progress of the update download.
+
+    The downloading thread only stores the values here, without waiting for
+    or allocating anything; the dialog samples them on its own timer. Only
+    the latest values matter, so no intermediate ones are queued.
+
+    This is a sequence lock: the counter is odd while the values are being
+    written and readers retry if it changed while they were reading. It
+    supports only one writer at a time, which is the case as UpdateDownloader
+    serializes its progress reports.
+ */
+class DownloadProgressState
 {
-    DWORD process_id;
-    wxRect biggest;
+public:
+    DownloadProgressState() : m_seq(0), m_changed(0), m_downloaded(0), m_total(0) {}
+
+    void Set(size_t downloaded, size_t total)
+    {
+        InterlockedIncrement(&m_seq);
+        m_downloaded = downloaded;
+        m_total = total;
+        InterlockedIncrement(&m_seq);
+
+        InterlockedExchange(&m_changed, 1);
+    }
+
+    /// Gets the values if they changed since the last call.
+    bool GetIfChanged(size_t& downloaded, size_t& total)
+    {
+        if ( !InterlockedExchange(&m_changed, 0) )
+            return false;
+
+        for ( ;; )
+        {
+            const LONG seq = InterlockedCompareExchange(&m_seq, 0, 0);
+            if ( seq & 1 )
+            {
+                YieldProcessor();
+                continue;
+            }
+
+            downloaded = m_downloaded;
+            total = m_total;
+
+            if ( InterlockedCompareExchange(&m_seq, 0, 0) == seq )
+                return true;
+        }
+    }
+
+    void Reset()
+    {
+        Set(0, 0);
+        InterlockedExchange(&m_changed, 0);
+    }
+
+private:
+    volatile LONG m_seq;
+    volatile LONG m_changed;
+    volatile size_t m_downloaded, m_total;
 };
 
-BOOL CALLBACK EnumProcessWindowsCallback(HWND handle, LPARAM lParam)
-{
-    EnumProcessWindowsData& data = *reinterpret_cast<EnumProcessWindowsData*>(lParam);
+DownloadProgressState g_downloadProgress;
 
-    if (!IsWindowVisible(handle) || IsIconic(handle))
-        return TRUE;
 
-    DWORD process_id = 0;
-    GetWindowThreadProcessId(handle, &process_id);
-    if (data.process_id != process_id)
-        return TRUE; // another process' window
+// Checks if @a handle is an application's main window and gets its area.
+bool GetHostWindowRect(HWND handle, DWORD process_id, wxRect& rect)
+{
+    if (!IsWindow(handle) || !IsWindowVisible(handle) || IsIconic(handle))
+        return false;
+
+    if (process_id)
+    {
+        DWORD window_process_id = 0;
+        GetWindowThreadProcessId(handle, &window_process_id);
+        if (process_id != window_process_id)
+            return false; // another process' window
+    }
 
     if (GetWindow(handle, GW_OWNER) != 0)
-        return TRUE; // child, not main, window
+        return false; // child, not main, window
 
     RECT rwin;
     GetWindowRect(handle, &rwin);
     if (MonitorFromRect(&rwin, MONITOR_DEFAULTTONULL) == NULL)
-        return TRUE; // window is offscreen 
+        return false; // window is offscreen
+
+    rect = wxRect(rwin.left, rwin.top, rwin.right - rwin.left, rwin.bottom - rwin.top);
+    return true;
+}
+
+struct EnumProcessWindowsData
+{
+    DWORD process_id;
+    HWND biggestWindow;
+    wxRect biggest;
+};
+
+BOOL CALLBACK EnumProcessWindowsCallback(HWND handle, LPARAM lParam)
+{
+    EnumProcessWindowsData& data = *reinterpret_cast<EnumProcessWindowsData*>(lParam);
+
+    wxRect r;
+    if (!GetHostWindowRect(handle, data.process_id, r))
+        return TRUE;
 
-    wxRect r(rwin.left, rwin.top, rwin.right - rwin.left, rwin.bottom - rwin.top);
     if (r.width * r.height > data.biggest.width * data.biggest.height)
+    {
+        data.biggestWindow = handle;
         data.biggest = r;
+    }
 
     return TRUE;
 }
 
+// The window found by EnumWindows() the last time and the foreground window
+// at that time. All windows on the desktop, which may be thousands on
+// terminal servers, are only enumerated again when the user switched to
+// another window since. Only used from the UI thread.
+HWND g_cachedHostWindow = NULL;
+HWND g_cachedForegroundWindow = NULL;
+
 wxRect GetHostApplicationScreenArea()
 {
-    EnumProcessWindowsData data;
-    data.process_id = GetCurrentProcessId();
-    EnumWindows(EnumProcessWindowsCallback, (LPARAM)&data);
-    return data.biggest;
-}
+    wxRect rect;
 
-wxPoint GetWindowOriginSoThatItFits(int display, const wxRect& windowRect)
-{
-    wxPoint pos = windowRect.GetTopLeft();
-    wxRect desktop = wxDisplay(display).GetClientArea();
-    if (!desktop.Contains(windowRect))
+    // the application knows its main window best
+    HWND hint = static_cast<HWND>(Settings::GetHostWindow());
+    if (hint && GetHostWindowRect(hint, 0, rect))
+        return rect;
+
+    const DWORD process_id = GetCurrentProcessId();
+    HWND foreground = GetForegroundWindow();
+    if (g_cachedHostWindow && foreground == g_cachedForegroundWindow &&
+        GetHostWindowRect(g_cachedHostWindow, process_id, rect))
     {
-        if (pos.x < desktop.x)
-            pos.x = desktop.x;
-        if (pos.y < desktop.y)
-            pos.y = desktop.y;
-       wxPoint bottomRightDiff = windowRect.GetBottomRight() - desktop.GetBottomRight();
-       if (bottomRightDiff.x > 0)
-           pos.x -= bottomRightDiff.x;
-       if (bottomRightDiff.y > 0)
-           pos.y -= bottomRightDiff.y;
+        return rect;
     }
-    return pos;
+
+    // find application's biggest window:
+    EnumProcessWindowsData data;
+    data.process_id = process_id;
+    data.biggestWindow = NULL;
+    EnumWindows(EnumProcessWindowsCallback, (LPARAM)&data);
+
+    g_cachedHostWindow = data.biggestWindow;
+    g_cachedForegroundWindow = foreground;
+
+    return data.biggest;
 }
 
 void CenterWindowOnHostApplication(wxTopLevelWindow *win)
 {
-    // find application's biggest window:
-    EnumProcessWindowsData data;
-    data.process_id = GetCurrentProcessId();
-    EnumWindows(EnumProcessWindowsCallback, (LPARAM) &data);
+    const wxRect host(GetHostApplicationScreenArea());
 
-    if (data.biggest.IsEmpty())
+    if (host.IsEmpty())
     {
         // no parent window to center on, so center on the screen
         win->Center();
         return;
     }
 
-    const wxRect& host(data.biggest);
-
     // and center WinSparkle on it:
     wxSize winsz = win->GetClientSize();
     wxPoint pos(host.x + (host.width - winsz.x) / 2,
@@ -263,31 +435,31 @@ void EnsureWindowIsFullyVisible(wxTopLevelWindow *win)
 }
 
 
-// Locks window updates to reduce flicker. Redoes layout in dtor.
-struct LayoutChangesGuard
+class DllTranslationsLoader : public wxResourceTranslationsLoader
 {
-    LayoutChangesGuard(wxTopLevelWindow *win) : m_win(win)
-    {
-        m_win->Freeze();
-    }
-
-    ~LayoutChangesGuard()
+public:
+    // wxTranslations asks for this whenever it looks for the best language,
+    // but the resources can't change, so enumerate them only once.
+    virtual wxArrayString GetAvailableTranslations(const wxString& domain) const
     {
-        m_win->Layout();
-        m_win->GetSizer()->SetSizeHints(m_win);
-        m_win->Refresh();
-        EnsureWindowIsFullyVisible(m_win);
-        m_win->Thaw();
-        m_win->Update();
+        if ( !m_availableFound || domain != m_availableDomain )
+        {
+            m_available = wxResourceTranslationsLoader::GetAvailableTranslations(domain);
+            m_availableDomain = domain;
+            m_availableFound = true;
+        }
+        return m_available;
     }
 
-    wxTopLevelWindow *m_win;
-};
+    DllTranslationsLoader() : m_availableFound(false) {}
 
-class DllTranslationsLoader : public wxResourceTranslationsLoader
-{
 protected:
     virtual WXHINSTANCE GetModule() const { return UI::GetDllHINSTANCE(); }
+
+private:
+    mutable bool          m_availableFound;
+    mutable wxString      m_availableDomain;
+    mutable wxArrayString m_available;
 };
 
 } // anonymous namespace
@@ -405,133 +577,543 @@ void WinSparkleDialog::SetHeadingFont(wxWindow *win)
 
 
 /*--------------------------------------------------------------------------*
-                      Window for communicating with the user
+                               Release notes
  *--------------------------------------------------------------------------*/
 
-const int ID_SKIP_VERSION = wxNewId();
-const int ID_REMIND_LATER = wxNewId();
-const int ID_INSTALL = wxNewId();
-const int ID_RUN_INSTALLER = wxNewId();
-
-class UpdateDialog : public WinSparkleDialog
+namespace
 {
-public:
-    UpdateDialog();
 
-    // changes state into "checking for updates"
-    void StateCheckingUpdates();
-    // change state into "no updates found"
-    void StateNoUpdateFound(bool installAutomatically);
-    // change state into "update error"
-    void StateUpdateError(ErrorCode err);
-    // change state into "a new version is available"
-    void StateUpdateAvailable(const Appcast& info, bool installAutomatically);
-    // change state into "downloading update"
-    void StateDownloading();
-    // update download progress
-    void DownloadProgress(size_t downloaded, size_t total);
-    // change state into "update downloaded"
-    void StateUpdateDownloaded(const std::wstring& updateFile, const std::string &installerArguments);
+// Tags that the text view can show well enough, see IsSimpleHtml().
+const char *const SIMPLE_HTML_TAGS[] =
+{
+    "a", "b", "blockquote", "body", "br", "code", "div", "em",
+    "h1", "h2", "h3", "h4", "h5", "h6", "hr", "html", "i", "li",
+    "ol", "p", "pre", "small", "span", "strong", "tt", "u", "ul"
+};
 
-private:
-    void EnablePulsing(bool enable);
-    void OnTimer(wxTimerEvent& event);
-    void OnCloseButton(wxCommandEvent& event);
-    void OnClose(wxCloseEvent& event);
+// Gets the name of the tag starting at html[pos] ('<'), lowercase and
+// without the slash of closing tags. Returns the position after the tag.
+size_t ParseTag(const wxString& html, size_t pos, wxString& name, bool& closing)
+{
+    const size_t end = html.find('>', pos);
 
-    void OnSkipVersion(wxCommandEvent&);
-    void OnRemindLater(wxCommandEvent&);
-    void OnInstall(wxCommandEvent&);
+    size_t i = pos + 1;
+    closing = i < html.length() && html[i] == '/';
+    if ( closing )
+        i++;
 
-    void OnRunInstaller(wxCommandEvent&);
+    const size_t nameStart = i;
+    for ( ; i < html.length() && i < end && wxIsalnum(html[i]); i++ )
+        ;
+    name = html.substr(nameStart, i - nameStart).Lower();
 
-    bool RunInstaller();
+    return end == wxString::npos ? html.length() : end + 1;
+}
 
-    void SetMessage(const wxString& text, int width = MESSAGE_AREA_WIDTH);
-    void ShowReleaseNotes(const Appcast& info);
+bool IsSimpleTag(const wxString& name)
+{
+    for ( size_t i = 0; i < WXSIZEOF(SIMPLE_HTML_TAGS); i++ )
+    {
+        if ( name == SIMPLE_HTML_TAGS[i] )
+            return true;
+    }
+    return false;
+}
 
-private:
-    wxTimer       m_timer;
-    wxSizer      *m_buttonSizer;
-    wxStaticText *m_heading;
-    wxStaticText *m_message;
-    wxGauge      *m_progress;
-    wxStaticText *m_progressLabel;
-    wxButton     *m_closeButton;
-    wxSizer      *m_closeButtonSizer;
-    wxButton     *m_runInstallerButton;
-    wxSizer      *m_runInstallerButtonSizer;
-    wxButton     *m_installButton;
-    wxSizer      *m_updateButtonsSizer;
-    wxSizer      *m_releaseNotesSizer;
-    wxPanel      *m_browserParent;
+// Is @a html plain text or HTML that only uses basic text formatting?
+bool IsSimpleHtml(const wxString& html)
+{
+    for ( size_t pos = html.find('<'); pos != wxString::npos; pos = html.find('<', pos) )
+    {
+        wxString name;
+        bool closing;
+        pos = ParseTag(html, pos, name, closing);
 
-    wxAutoOleInterface<IWebBrowser2> m_webBrowser;
+        // this includes comments, scripts, styles, images and tables
+        if ( !IsSimpleTag(name) )
+            return false;
+    }
+    return true;
+}
 
-    // current appcast data (only valid after StateUpdateAvailable())
-    Appcast m_appcast;
-    // current update file (only valid after StateUpdateDownloaded)
-    wxString m_updateFile;
-    // space separated arguments to update file (only valid after StateUpdateDownloaded)
-    std::string m_installerArguments;
-    // downloader (only valid between OnInstall and OnUpdateDownloaded)
-    UpdateDownloader* m_downloader;
-    // whether the update should be installed without prompting the user
-    bool m_installAutomatically;
-    // whether an error occurred (used to properly call NotifyUpdateCancelled)
-    bool m_errorOccurred;
+// Ends the text with at least @a count line breaks, unless it's empty.
+void EnsureLineBreaks(wxString& text, size_t count)
+{
+    if ( text.empty() )
+        return;
 
-    static const int RELNOTES_WIDTH = 460;
-    static const int RELNOTES_HEIGHT = 200;
-};
+    size_t existing = 0;
+    for ( size_t i = text.length(); i > 0 && text[i - 1] == '\n'; i-- )
+        existing++;
 
+    for ( ; existing < count; existing++ )
+        text += '\n';
+}
 
-UpdateDialog::UpdateDialog()
-    : m_timer(this),
-      m_downloader(NULL)
-{
-    m_installAutomatically = false;
-    m_errorOccurred = false;
+// Decodes the entity starting at html[pos] ('&'), returns its length or 0.
+size_t DecodeEntity(const wxString& html, size_t pos, wxString& decoded)
+{
+    const size_t end = html.find(';', pos);
+    if ( end == wxString::npos || end - pos > 10 )
+        return 0;
+
+    const wxString name = html.substr(pos + 1, end - pos - 1);
+    if ( name == "amp" )
+        decoded = "&";
+    else if ( name == "lt" )
+        decoded = "<";
+    else if ( name == "gt" )
+        decoded = ">";
+    else if ( name == "quot" )
+        decoded = "\"";
+    else if ( name == "apos" )
+        decoded = "'";
+    else if ( name == "nbsp" )
+        decoded = " ";
+    else if ( name.StartsWith("#") )
+    {
+        unsigned long code;
+        const bool ok = (name.length() > 1 && (name[1] == 'x' || name[1] == 'X'))
+                        ? name.Mid(2).ToULong(&code, 16)
+                        : name.Mid(1).ToULong(&code, 10);
+        if ( !ok || code == 0 || code > 0xFFFF )
+            return 0;
+        decoded = wxString(wxUniChar(code));
+    }
+    else
+    {
+        return 0;
+    }
 
-    m_heading = new wxStaticText(this, wxID_ANY, "");
-    SetHeadingFont(m_heading);
-    m_mainAreaSizer->Add(m_heading, wxSizerFlags(0).Expand().Border(wxBOTTOM, PX(10)));
+    return end - pos + 1;
+}
 
-    m_message = new wxStaticText(this, wxID_ANY, "",
-                                 wxDefaultPosition, wxSize(PX(MESSAGE_AREA_WIDTH), -1));
-    m_mainAreaSizer->Add(m_message, wxSizerFlags(0).Expand());
+/**
+    Converts release notes to text shown by the text view.
 
-    m_progress = new wxGauge(this, wxID_ANY, 100,
-                             wxDefaultPosition, wxSize(PX(MESSAGE_AREA_WIDTH), PX(16)));
-    m_progressLabel = new wxStaticText(this, wxID_ANY, "");
-    m_mainAreaSizer->Add(m_progress, wxSizerFlags(0).Expand().Border(wxTOP|wxBOTTOM, PX(10)));
-    m_mainAreaSizer->Add(m_progressLabel, wxSizerFlags(0).Expand());
-    m_mainAreaSizer->AddStretchSpacer(1);
+    Plain text (e.g. Markdown) is shown as it is. HTML accepted by
+    IsSimpleHtml() is shown without the tags, with line breaks and list
+    bullets where the browser would put them.
+ */
+wxString HtmlToText(const wxString& html)
+{
+    wxString text;
 
-    m_releaseNotesSizer = new wxBoxSizer(wxVERTICAL);
+    if ( html.find('<') == wxString::npos )
+    {
+        text = html;
+        text.Replace("\r\n", "\n");
+    }
+    else
+    {
+        bool pre = false;
+        bool pendingSpace = false;
 
-    wxStaticText *notesLabel = new wxStaticText(this, wxID_ANY, _("Release notes:"));
-    SetBoldFont(notesLabel);
-    m_releaseNotesSizer->Add(notesLabel, wxSizerFlags().Border(wxTOP, PX(10)));
+        for ( size_t pos = 0; pos < html.length(); )
+        {
+            const wxUniChar c = html[pos];
 
-    m_browserParent = new wxPanel(this, wxID_ANY,
-                                  wxDefaultPosition,
-                                  wxSize(PX(RELNOTES_WIDTH), PX(RELNOTES_HEIGHT)));
-    m_browserParent->SetBackgroundColour(*wxWHITE);
-    m_releaseNotesSizer->Add
-                         (
-                             m_browserParent,
-                             wxSizerFlags(1).Expand().Border(wxTOP, PX(10))
-                         );
+            if ( c == '<' )
+            {
+                wxString name;
+                bool closing;
+                pos = ParseTag(html, pos, name, closing);
+
+                // inline tags like <b> don't affect the text
+                if ( name == "br" )
+                    text += '\n';
+                else if ( name == "li" && !closing )
+                {
+                    EnsureLineBreaks(text, 1);
+                    text += L"\u2022 ";
+                }
+                else if ( name == "p" || name == "pre" || name == "hr" || name == "blockquote" ||
+                          (name.length() == 2 && name[0] == 'h' && wxIsdigit(name[1])) )
+                {
+                    EnsureLineBreaks(text, 2);
+                    if ( name == "pre" )
+                        pre = !closing;
+                }
+                else if ( name == "div" || name == "ul" || name == "ol" || name == "li" )
+                {
+                    EnsureLineBreaks(text, 1);
+                }
+                else
+                {
+                    continue;
+                }
+
+                pendingSpace = false;
+                continue;
+            }
 
-    m_mainAreaSizer->Add
-                 (
-                     m_releaseNotesSizer,
-                     // proportion=10000 to overcome stretch spacer above
-                     wxSizerFlags(10000).Expand()
-                 );
+            if ( !pre && wxIsspace(c) )
+            {
+                pendingSpace = !text.empty() && text.Last() != '\n' && text.Last() != ' ';
+                pos++;
+                continue;
+            }
 
-    m_buttonSizer = new wxBoxSizer(wxHORIZONTAL);
+            if ( pendingSpace )
+            {
+                text += ' ';
+                pendingSpace = false;
+            }
+
+            wxString decoded;
+            const size_t entityLen = (c == '&') ? DecodeEntity(html, pos, decoded) : 0;
+            if ( entityLen )
+            {
+                text += decoded;
+                pos += entityLen;
+            }
+            else
+            {
+                text += c;
+                pos++;
+            }
+        }
+    }
+
+    text.Trim(true).Trim(false);
+    text.Replace("\n", "\r\n");
+    return text;
+}
+
+} // anonymous namespace
+
+
+/**
+    Panel showing the release notes.
+
+    Release notes given as plain text or simple HTML are shown in a plain
+    read-only EDIT control, which is fast to create. Others are shown by the
+    web browser control that the UpdateDialog puts into the panel.
+ */
+class ReleaseNotesPanel : public wxPanel
+{
+public:
+    ReleaseNotesPanel(wxWindow *parent, const wxSize& size)
+        : wxPanel(parent, wxID_ANY, wxDefaultPosition, size),
+          m_text(NULL)
+    {
+        SetBackgroundColour(*wxWHITE);
+        Bind(wxEVT_SIZE, &ReleaseNotesPanel::OnSize, this);
+    }
+
+    /// Shows @a text instead of the web browser.
+    void ShowText(const wxString& text)
+    {
+        if ( !m_text )
+        {
+            m_text = ::CreateWindowEx
+                     (
+                         0, L"EDIT", L"",
+                         WS_CHILD | WS_VSCROLL | ES_MULTILINE | ES_READONLY | ES_AUTOVSCROLL,
+                         0, 0, 0, 0,
+                         (HWND)GetHWND(), NULL, UI::GetDllHINSTANCE(), NULL
+                     );
+            if ( !m_text )
+            {
+                LogError("Failed to create release notes control.");
+                return;
+            }
+            ::SendMessage(m_text, WM_SETFONT, (WPARAM)GetFont().GetHFONT(), FALSE);
+            const int margin = GetCharWidth() / 2;
+            ::SendMessage(m_text, EM_SETMARGINS, EC_LEFTMARGIN | EC_RIGHTMARGIN, MAKELONG(margin, margin));
+        }
+
+        ::SetWindowText(m_text, text.wc_str());
+        ShowBrowser(false);
+        UpdateTextSize();
+        ::ShowWindow(m_text, SW_SHOW);
+    }
+
+    /// Shows the browser, i.e. all wx children, instead of the text.
+    void ShowBrowser(bool show = true)
+    {
+        if ( show && m_text )
+            ::ShowWindow(m_text, SW_HIDE);
+
+        for ( wxWindowList::iterator i = GetChildren().begin(); i != GetChildren().end(); ++i )
+            (*i)->Show(show);
+    }
+
+protected:
+    virtual WXLRESULT MSWWindowProc(WXUINT msg, WXWPARAM wParam, WXLPARAM lParam)
+    {
+        // read-only EDIT controls are grey by default
+        if ( msg == WM_CTLCOLORSTATIC && m_text && (HWND)lParam == m_text )
+        {
+            ::SetBkColor((HDC)wParam, ::GetSysColor(COLOR_WINDOW));
+            ::SetTextColor((HDC)wParam, ::GetSysColor(COLOR_WINDOWTEXT));
+            return (WXLRESULT)::GetSysColorBrush(COLOR_WINDOW);
+        }
+
+        return wxPanel::MSWWindowProc(msg, wParam, lParam);
+    }
+
+private:
+    void OnSize(wxSizeEvent& event)
+    {
+        UpdateTextSize();
+        event.Skip();
+    }
+
+    void UpdateTextSize()
+    {
+        if ( m_text )
+        {
+            const wxSize size = GetClientSize();
+            ::MoveWindow(m_text, 0, 0, size.x, size.y, TRUE);
+        }
+    }
+
+    HWND m_text;
+};
+
+
+/*--------------------------------------------------------------------------*
+                             Installer launching
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+/**
+    Launches the installer, off the UI thread.
+
+    Starting the freshly downloaded executable may take a while, e.g. while
+    it's scanned by antivirus software or the user confirms its elevation,
+    and the dialog must stay responsive meanwhile. The result is reported to
+    UpdateDialog::InstallerLaunched() only once the installer really runs,
+    so that the application isn't shut down if it failed to start.
+ */
+class InstallerLauncher : public Thread
+{
+public:
+    InstallerLauncher(const std::wstring& file, const AppcastPtr& update)
+        : Thread("WinSparkle installer launcher"),
+          m_file(file), m_update(update)
+    {}
+
+protected:
+    virtual void Run();
+    virtual bool IsJoinable() const { return false; }
+
+private:
+    bool Launch();
+
+    std::wstring m_file;
+    AppcastPtr m_update;
+};
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                      Window for communicating with the user
+ *--------------------------------------------------------------------------*/
+
+const int ID_SKIP_VERSION = wxNewId();
+const int ID_REMIND_LATER = wxNewId();
+const int ID_INSTALL = wxNewId();
+const int ID_RUN_INSTALLER = wxNewId();
+
+class UpdateDialog : public WinSparkleDialog
+{
+public:
+    UpdateDialog();
+
+    // does the layout update scheduled by SetState() right away
+    void FlushLayout();
+
+    // changes state into "checking for updates"
+    void StateCheckingUpdates();
+    // change state into "no updates found"
+    void StateNoUpdateFound(bool installAutomatically);
+    // change state into "update error"
+    void StateUpdateError(ErrorCode err);
+    // change state into "a new version is available"
+    void StateUpdateAvailable(const AppcastPtr& info, bool installAutomatically);
+    // change state into "downloading update"
+    void StateDownloading();
+    // change state into "update downloaded"
+    void StateUpdateDownloaded(const std::wstring& updateFile, const AppcastPtr& update);
+
+private:
+    // parts of the dialog shown or hidden depending on the state
+    enum Element
+    {
+        El_Heading              = 0x01,
+        El_Progress             = 0x02,
+        El_ProgressLabel        = 0x04,
+        El_CloseButton          = 0x08,
+        El_RunInstallerButton   = 0x10,
+        El_ReleaseNotes         = 0x20,
+        El_UpdateButtons        = 0x40,
+        El_All                  = 0x7F
+    };
+
+    enum State
+    {
+        State_CheckingUpdates,
+        State_NoUpdateFound,
+        State_UpdateError,
+        State_UpdateAvailable,
+        State_UpdateAvailableWithNotes,
+        State_Downloading,
+        State_UpdateDownloaded,
+        State_Max
+    };
+
+    /**
+        Shows the elements of @a state and hides the others.
+
+        Only the elements that change are shown or hidden, and the layout is
+        updated once, after all changes done in the current event, so that
+        going through several states doesn't lay the dialog out each time.
+     */
+    void SetState(State state);
+    void ShowElement(Element el, bool show);
+    void ScheduleLayout();
+
+    void EnablePulsing(bool enable);
+    /**
+        Shows indeterminate progress in the native marquee style, which the
+        control animates on its own, without waking up the UI thread.
+
+        @return false if it isn't available and must be emulated by calling
+                m_progress->Pulse() repeatedly.
+     */
+    bool StartMarquee();
+    void StopMarquee();
+    void EnableProgressTracking();
+    void OnTimer(wxTimerEvent& event);
+    // update download progress
+    void DownloadProgress(size_t downloaded, size_t total);
+    void OnCloseButton(wxCommandEvent& event);
+    void OnClose(wxCloseEvent& event);
+
+    void OnSkipVersion(wxCommandEvent&);
+    void OnRemindLater(wxCommandEvent&);
+    void OnInstall(wxCommandEvent&);
+
+    void OnRunInstaller(wxCommandEvent&);
+
+    // launches the installer in the background, see InstallerLaunched()
+    void RunInstaller();
+
+public:
+    // called when the installer launched by RunInstaller() started or failed
+    void InstallerLaunched(bool success);
+
+private:
+
+    void SetMessage(const wxString& text, int width = MESSAGE_AREA_WIDTH);
+    void ShowReleaseNotes(const AppcastPtr& info);
+    void ShowReleaseNotesInBrowser(const AppcastPtr& info);
+
+    void OnPaint(wxPaintEvent& event);
+    void OnBrowserEvent(wxActiveXEvent& event);
+
+private:
+    wxTimer       m_timer;
+    // does m_timer update download progress rather than pulse m_progress?
+    bool          m_trackProgress;
+    // is m_progress in the native marquee style, see StartMarquee()?
+    bool          m_marquee;
+    // Element values currently shown
+    int           m_shownElements;
+    // is the dialog frozen until the layout scheduled by SetState() is done?
+    bool          m_layoutPending;
+    wxSizer      *m_buttonSizer;
+    wxStaticText *m_heading;
+    wxStaticText *m_message;
+    wxGauge      *m_progress;
+    wxStaticText *m_progressLabel;
+    wxButton     *m_closeButton;
+    wxSizer      *m_closeButtonSizer;
+    wxButton     *m_runInstallerButton;
+    wxSizer      *m_runInstallerButtonSizer;
+    wxButton     *m_installButton;
+    wxSizer      *m_updateButtonsSizer;
+    wxSizer      *m_releaseNotesSizer;
+    ReleaseNotesPanel *m_browserParent;
+
+    wxAutoOleInterface<IWebBrowser2> m_webBrowser;
+    // is m_webBrowser loading the release notes from their URL?
+    bool m_loadingReleaseNotes;
+
+    // current appcast data (only valid after StateUpdateAvailable())
+    AppcastPtr m_appcast;
+    // current update file (only valid after StateUpdateDownloaded)
+    wxString m_updateFile;
+    // downloader (only valid between OnInstall and OnUpdateDownloaded)
+    UpdateDownloader* m_downloader;
+    // whether the update should be installed without prompting the user
+    bool m_installAutomatically;
+    // whether an error occurred (used to properly call NotifyUpdateCancelled)
+    bool m_errorOccurred;
+
+    static const int RELNOTES_WIDTH = 460;
+    static const int RELNOTES_HEIGHT = 200;
+
+    // how often to pulse the progress bar, in milliseconds
+    static const int PULSE_INTERVAL = 100;
+    // how often to show new download progress: at most once per frame
+    static const int PROGRESS_UPDATE_INTERVAL = 1000 / 60;
+};
+
+
+UpdateDialog::UpdateDialog()
+    : m_timer(this),
+      m_trackProgress(false),
+      m_marquee(false),
+      m_shownElements(El_All),
+      m_layoutPending(false),
+      m_loadingReleaseNotes(false),
+      m_downloader(NULL)
+{
+    m_installAutomatically = false;
+    m_errorOccurred = false;
+
+    m_heading = new wxStaticText(this, wxID_ANY, "");
+    SetHeadingFont(m_heading);
+    m_mainAreaSizer->Add(m_heading, wxSizerFlags(0).Expand().Border(wxBOTTOM, PX(10)));
+
+    m_message = new wxStaticText(this, wxID_ANY, "",
+                                 wxDefaultPosition, wxSize(PX(MESSAGE_AREA_WIDTH), -1));
+    m_mainAreaSizer->Add(m_message, wxSizerFlags(0).Expand());
+
+    m_progress = new wxGauge(this, wxID_ANY, 100,
+                             wxDefaultPosition, wxSize(PX(MESSAGE_AREA_WIDTH), PX(16)));
+    m_progressLabel = new wxStaticText(this, wxID_ANY, "");
+    m_mainAreaSizer->Add(m_progress, wxSizerFlags(0).Expand().Border(wxTOP|wxBOTTOM, PX(10)));
+    m_mainAreaSizer->Add(m_progressLabel, wxSizerFlags(0).Expand());
+    m_mainAreaSizer->AddStretchSpacer(1);
+
+    m_releaseNotesSizer = new wxBoxSizer(wxVERTICAL);
+
+    wxStaticText *notesLabel = new wxStaticText(this, wxID_ANY, _("Release notes:"));
+    SetBoldFont(notesLabel);
+    m_releaseNotesSizer->Add(notesLabel, wxSizerFlags().Border(wxTOP, PX(10)));
+
+    m_browserParent = new ReleaseNotesPanel(this, wxSize(PX(RELNOTES_WIDTH), PX(RELNOTES_HEIGHT)));
+    m_releaseNotesSizer->Add
+                         (
+                             m_browserParent,
+                             wxSizerFlags(1).Expand().Border(wxTOP, PX(10))
+                         );
+
+    m_mainAreaSizer->Add
+                 (
+                     m_releaseNotesSizer,
+                     // proportion=10000 to overcome stretch spacer above
+                     wxSizerFlags(10000).Expand()
+                 );
+
+    m_buttonSizer = new wxBoxSizer(wxHORIZONTAL);
 
     m_updateButtonsSizer = new wxBoxSizer(wxHORIZONTAL);
     m_updateButtonsSizer->Add
@@ -575,6 +1157,7 @@ UpdateDialog::UpdateDialog()
 
     Bind(wxEVT_CLOSE_WINDOW, &UpdateDialog::OnClose, this);
     Bind(wxEVT_TIMER, &UpdateDialog::OnTimer, this);
+    Bind(wxEVT_PAINT, &UpdateDialog::OnPaint, this);
     Bind(wxEVT_COMMAND_BUTTON_CLICKED, &UpdateDialog::OnCloseButton, this, wxID_CANCEL);
     Bind(wxEVT_COMMAND_BUTTON_CLICKED, &UpdateDialog::OnSkipVersion, this, ID_SKIP_VERSION);
     Bind(wxEVT_COMMAND_BUTTON_CLICKED, &UpdateDialog::OnRemindLater, this, ID_REMIND_LATER);
@@ -583,18 +1166,206 @@ UpdateDialog::UpdateDialog()
 }
 
 
+void UpdateDialog::SetState(State state)
+{
+    static const int STATE_ELEMENTS[State_Max] =
+    {
+        // State_CheckingUpdates
+        El_Progress | El_CloseButton,
+        // State_NoUpdateFound
+        El_Heading | El_CloseButton,
+        // State_UpdateError
+        El_Heading | El_CloseButton,
+        // State_UpdateAvailable
+        El_Heading | El_UpdateButtons,
+        // State_UpdateAvailableWithNotes
+        El_Heading | El_UpdateButtons | El_ReleaseNotes,
+        // State_Downloading
+        El_Progress | El_ProgressLabel | El_CloseButton,
+        // State_UpdateDownloaded
+        El_Progress | El_RunInstallerButton
+    };
+
+    // labels etc. were most likely changed already, so lay out always
+    ScheduleLayout();
+
+    const int elements = STATE_ELEMENTS[state];
+    const int changed = elements ^ m_shownElements;
+    for ( int el = 1; el < El_All; el <<= 1 )
+    {
+        if ( changed & el )
+            ShowElement(Element(el), (elements & el) != 0);
+    }
+    m_shownElements = elements;
+
+    MakeResizable(state == State_UpdateAvailableWithNotes);
+}
+
+
+void UpdateDialog::ShowElement(Element el, bool show)
+{
+    switch ( el )
+    {
+        case El_Heading:
+            DoShowElement(m_heading, show);
+            break;
+        case El_Progress:
+            DoShowElement(m_progress, show);
+            break;
+        case El_ProgressLabel:
+            DoShowElement(m_progressLabel, show);
+            break;
+        case El_CloseButton:
+            DoShowElement(m_closeButtonSizer, show);
+            break;
+        case El_RunInstallerButton:
+            DoShowElement(m_runInstallerButtonSizer, show);
+            break;
+        case El_ReleaseNotes:
+            DoShowElement(m_releaseNotesSizer, show);
+            break;
+        case El_UpdateButtons:
+            DoShowElement(m_updateButtonsSizer, show);
+            break;
+        case El_All:
+            break;
+    }
+}
+
+
+void UpdateDialog::ScheduleLayout()
+{
+    if ( m_layoutPending )
+        return;
+
+    // don't paint the partially changed dialog until it's laid out
+    Freeze();
+    m_layoutPending = true;
+
+#if wxCHECK_VERSION(2,9,5)
+    CallAfter(&UpdateDialog::FlushLayout);
+#else
+    FlushLayout();
+#endif
+}
+
+
+void UpdateDialog::FlushLayout()
+{
+    if ( !m_layoutPending )
+        return;
+    m_layoutPending = false;
+
+    UpdateLayout();
+    Refresh();
+    EnsureWindowIsFullyVisible(this);
+    Thaw();
+}
+
+
 void UpdateDialog::EnablePulsing(bool enable)
 {
-    if ( enable && !m_timer.IsRunning() )
-        m_timer.Start(100);
-    else if ( !enable && m_timer.IsRunning() )
-        m_timer.Stop();
+    if ( enable )
+    {
+        // only emulated pulsing needs the timer
+        if ( StartMarquee() )
+        {
+            if ( m_timer.IsRunning() )
+                m_timer.Stop();
+        }
+        else if ( m_trackProgress || !m_timer.IsRunning() )
+        {
+            m_timer.Start(PULSE_INTERVAL);
+        }
+    }
+    else
+    {
+        if ( m_timer.IsRunning() )
+            m_timer.Stop();
+        StopMarquee();
+    }
+
+    m_trackProgress = false;
+}
+
+
+bool UpdateDialog::StartMarquee()
+{
+    // older versions don't have PBS_MARQUEE, wx emulates it
+    if ( wxApp::GetComCtl32Version() < 600 )
+        return false;
+
+    // the first Pulse() switches the native control to the marquee style
+    if ( !m_marquee )
+    {
+        m_progress->Pulse();
+        m_marquee = true;
+    }
+    return true;
+}
+
+
+void UpdateDialog::StopMarquee()
+{
+    // The animation would go on even with the gauge hidden. Setting a value
+    // switches the gauge back to the normal style, which stops it.
+    if ( m_marquee )
+    {
+        m_progress->SetValue(0);
+        m_marquee = false;
+    }
+}
+
+
+void UpdateDialog::EnableProgressTracking()
+{
+    g_downloadProgress.Reset();
+
+    m_trackProgress = true;
+    m_timer.Start(PROGRESS_UPDATE_INTERVAL);
 }
 
 
 void UpdateDialog::OnTimer(wxTimerEvent&)
 {
-    m_progress->Pulse();
+    if ( m_trackProgress )
+    {
+        size_t downloaded, total;
+        if ( g_downloadProgress.GetIfChanged(downloaded, total) )
+            DownloadProgress(downloaded, total);
+    }
+    else
+    {
+        m_progress->Pulse();
+    }
+}
+
+
+void UpdateDialog::OnPaint(wxPaintEvent& event)
+{
+    Stats::RecordUIMilestone(Stats::UIMilestone_FirstPaint);
+    event.Skip();
+}
+
+
+void UpdateDialog::OnBrowserEvent(wxActiveXEvent& event)
+{
+    event.Skip();
+
+    if ( event.GetDispatchId() != DISPID_DOCUMENTCOMPLETE || !m_loadingReleaseNotes )
+        return;
+
+    // the about:blank page loaded when the browser is created doesn't count
+    BSTR url = NULL;
+    if ( FAILED(m_webBrowser->get_LocationURL(&url)) || !url )
+        return;
+    const bool blank = wcscmp(url, L"about:blank") == 0;
+    SysFreeString(url);
+    if ( blank )
+        return;
+
+    m_loadingReleaseNotes = false;
+    Stats::RecordUIMilestone(Stats::UIMilestone_ReleaseNotesShown);
 }
 
 
@@ -615,9 +1386,9 @@ void UpdateDialog::OnClose(wxCloseEvent&)
         UpdateDownloader::CleanLeftovers();
     }
 
-    // We need to override this, because by default, wxDialog doesn't
-    // destroy itself in Close().
-    Destroy();
+    // The dialog isn't destroyed, but kept hidden, so that showing it again
+    // for the next check is instant; the state functions reset its content.
+    Hide();
 
     // If the update was not downloaded and the appcast is empty and we're closing,
     // it means that we're about to restart or there was an error, and that the
@@ -626,16 +1397,26 @@ void UpdateDialog::OnClose(wxCloseEvent&)
     {
         ApplicationController::NotifyUpdateError();
     }
-    else if ( m_appcast.IsValid() && m_updateFile.IsEmpty() )
+    else if ( m_appcast && m_appcast->IsValid() && m_updateFile.IsEmpty() )
     {
         ApplicationController::NotifyUpdateCancelled();
     }
+
+    // forget this session's update, the next one starts afresh
+    EnablePulsing(false);
+    m_appcast.reset();
+    m_updateFile.clear();
+    m_installAutomatically = false;
+    m_errorOccurred = false;
+    m_runInstallerButton->Enable();
+
+    Stats::RecordFootprint(WIN_SPARKLE_STATS_FOOTPRINT_DIALOG_CLOSED);
 }
 
 
 void UpdateDialog::OnSkipVersion(wxCommandEvent&)
 {
-    Settings::WriteConfigValue("SkipThisVersion", m_appcast.Version);
+    Settings::WriteConfigValue("SkipThisVersion", m_appcast->Version);
     Close();
 }
 
@@ -650,9 +1431,9 @@ void UpdateDialog::OnRemindLater(wxCommandEvent&)
 
 void UpdateDialog::OnInstall(wxCommandEvent&)
 {
-    if ( !m_appcast.HasDownload() )
+    if ( !m_appcast->HasDownload() )
     {
-        wxLaunchDefaultBrowser(m_appcast.WebBrowserURL, wxBROWSER_NEW_WINDOW);
+        wxLaunchDefaultBrowser(m_appcast->WebBrowserURL, wxBROWSER_NEW_WINDOW);
         Close();
     }
     else if ( m_downloader == NULL )
@@ -678,44 +1459,34 @@ void UpdateDialog::OnRunInstaller(wxCommandEvent&)
         return;
     }
 
-    wxBusyCursor bcur;
-
     m_message->SetLabel(_("Launching the installer..."));
     m_runInstallerButton->Disable();
 
-    if ( !RunInstaller() )
-    {
-        wxMessageDialog dlg(this,
-            _("Failed to launch the installer."),
-            _("Software Update"),
-            wxOK | wxOK_DEFAULT | wxICON_EXCLAMATION);
-        dlg.ShowModal();
-    }
-    else
-    {
-        Close();
-        ApplicationController::RequestShutdown();
-    }
+    RunInstaller();
 }
 
-bool UpdateDialog::RunInstaller()
-{
-    std::wstring wArgs;
 
-    SHELLEXECUTEINFO sei;
-    ::ZeroMemory(&sei, sizeof(SHELLEXECUTEINFO));
-    sei.cbSize = sizeof(SHELLEXECUTEINFO);
-    sei.lpFile = m_updateFile.t_str();
-    sei.nShow = SW_SHOWDEFAULT;
-    sei.fMask = SEE_MASK_FLAG_NO_UI;	// We display our own dialog box on error
-
-    if (! m_installerArguments.empty())
+void UpdateDialog::InstallerLaunched(bool success)
+{
+    if ( success )
     {
-        wArgs = AnsiToWide(m_installerArguments);
-        sei.lpParameters = wArgs.c_str();
+        Close();
+        return;
     }
 
-    return ::ShellExecuteEx(&sei) ? true : false;
+    wxMessageDialog dlg(this,
+        _("Failed to launch the installer."),
+        _("Software Update"),
+        wxOK | wxOK_DEFAULT | wxICON_EXCLAMATION);
+    dlg.ShowModal();
+
+    m_runInstallerButton->Enable();
+}
+
+void UpdateDialog::RunInstaller()
+{
+    Thread *launcher = new InstallerLauncher(m_updateFile.ToStdWstring(), m_appcast);
+    launcher->Start();
 }
 
 void UpdateDialog::SetMessage(const wxString& text, int width)
@@ -727,21 +1498,12 @@ void UpdateDialog::SetMessage(const wxString& text, int width)
 
 void UpdateDialog::StateCheckingUpdates()
 {
-    LayoutChangesGuard guard(this);
-
     SetMessage(_("Checking for updates..."));
 
     m_closeButton->SetLabel(_("Cancel"));
     EnablePulsing(true);
 
-    HIDE(m_heading);
-    SHOW(m_progress);
-    HIDE(m_progressLabel);
-    SHOW(m_closeButtonSizer);
-    HIDE(m_runInstallerButtonSizer);
-    HIDE(m_releaseNotesSizer);
-    HIDE(m_updateButtonsSizer);
-    MakeResizable(false);
+    SetState(State_CheckingUpdates);
 }
 
 
@@ -755,8 +1517,6 @@ void UpdateDialog::StateNoUpdateFound(bool installAutomatically)
         return;
     }
 
-    LayoutChangesGuard guard(this);
-
     m_heading->SetLabel(_("You're up to date!"));
 
     wxString msg;
@@ -781,14 +1541,7 @@ void UpdateDialog::StateNoUpdateFound(bool installAutomatically)
     m_closeButton->SetDefault();
     EnablePulsing(false);
 
-    SHOW(m_heading);
-    HIDE(m_progress);
-    HIDE(m_progressLabel);
-    SHOW(m_closeButtonSizer);
-    HIDE(m_runInstallerButtonSizer);
-    HIDE(m_releaseNotesSizer);
-    HIDE(m_updateButtonsSizer);
-    MakeResizable(false);
+    SetState(State_NoUpdateFound);
 }
 
 
@@ -796,8 +1549,6 @@ void UpdateDialog::StateUpdateError(ErrorCode err)
 {
     m_errorOccurred = true;
 
-    LayoutChangesGuard guard(this);
-
     m_heading->SetLabel(_("Update Error!"));
 
     wxString msg;
@@ -816,19 +1567,12 @@ void UpdateDialog::StateUpdateError(ErrorCode err)
     m_closeButton->SetDefault();
     EnablePulsing(false);
 
-    SHOW(m_heading);
-    HIDE(m_progress);
-    HIDE(m_progressLabel);
-    SHOW(m_closeButtonSizer);
-    HIDE(m_runInstallerButtonSizer);
-    HIDE(m_releaseNotesSizer);
-    HIDE(m_updateButtonsSizer);
-    MakeResizable(false);
+    SetState(State_UpdateError);
 }
 
 
 
-void UpdateDialog::StateUpdateAvailable(const Appcast& info, bool installAutomatically)
+void UpdateDialog::StateUpdateAvailable(const AppcastPtr& info, bool installAutomatically)
 {
     m_appcast = info;
     m_installAutomatically = installAutomatically;
@@ -840,55 +1584,47 @@ void UpdateDialog::StateUpdateAvailable(const Appcast& info, bool installAutomat
         return;
     }
 
-    const bool showRelnotes = !info.ReleaseNotesURL.empty() || !info.Description.empty();
+    const bool showRelnotes = !info->ReleaseNotesURL.empty() || !info->Description.empty();
 
-    {
-        LayoutChangesGuard guard(this);
+    const wxString appname = Settings::GetAppName();
 
-        const wxString appname = Settings::GetAppName();
+    wxString ver_my = Settings::GetAppVersion();
+    wxString ver_new = info->ShortVersionString;
+    if ( ver_new.empty() )
+        ver_new = info->Version;
+    if ( ver_my == ver_new )
+    {
+        ver_my = wxString::Format("%s (%s)", ver_my, Settings::GetAppBuildVersion());
+        ver_new = wxString::Format("%s (%s)", ver_new, info->Version);
+    }
 
-        wxString ver_my = Settings::GetAppVersion();
-        wxString ver_new = info.ShortVersionString;
-        if ( ver_new.empty() )
-            ver_new = info.Version;
-        if ( ver_my == ver_new )
-        {
-            ver_my = wxString::Format("%s (%s)", ver_my, Settings::GetAppBuildVersion());
-            ver_new = wxString::Format("%s (%s)", ver_new, info.Version);
-        }
+    m_heading->SetLabel(
+        wxString::Format(_("A new version of %s is available!"), appname));
 
-        m_heading->SetLabel(
-            wxString::Format(_("A new version of %s is available!"), appname));
+    if ( !info->HasDownload() )
+        m_installButton->SetLabel(_("Get update"));
 
-        if ( !info.HasDownload() )
-            m_installButton->SetLabel(_("Get update"));
+    // critical updates can't be skipped, see UpdateChecker::PerformUpdateCheck()
+    FindWindow(ID_SKIP_VERSION)->Show(!info->IsCritical(Settings::GetAppBuildVersionKey()));
 
-        SetMessage
+    SetMessage
+    (
+        wxString::Format
         (
-            wxString::Format
-            (
-                _("%s %s is now available (you have %s). Would you like to download it now?"),
-                appname, ver_new, ver_my
-            ),
-            showRelnotes ? RELNOTES_WIDTH : MESSAGE_AREA_WIDTH
-        );
+            _("%s %s is now available (you have %s). Would you like to download it now?"),
+            appname, ver_new, ver_my
+        ),
+        showRelnotes ? RELNOTES_WIDTH : MESSAGE_AREA_WIDTH
+    );
 
-        EnablePulsing(false);
+    EnablePulsing(false);
 
-        m_installButton->SetDefault();
+    m_installButton->SetDefault();
 
-        SHOW(m_heading);
-        HIDE(m_progress);
-        HIDE(m_progressLabel);
-        HIDE(m_closeButtonSizer);
-        HIDE(m_runInstallerButtonSizer);
-        SHOW(m_updateButtonsSizer);
-        DoShowElement(m_releaseNotesSizer, showRelnotes);
-        MakeResizable(showRelnotes);
-    }
+    SetState(showRelnotes ? State_UpdateAvailableWithNotes : State_UpdateAvailable);
 
-    // Only show the release notes now that the layout was updated, as it may
-    // take some time to load the MSIE control:
+    // Only show the release notes once the rest of the dialog is ready, as
+    // it may take some time to load them:
     if ( showRelnotes )
         ShowReleaseNotes(info);
 }
@@ -896,21 +1632,12 @@ void UpdateDialog::StateUpdateAvailable(const Appcast& info, bool installAutomat
 
 void UpdateDialog::StateDownloading()
 {
-    LayoutChangesGuard guard(this);
-
     SetMessage(_("Downloading update..."));
 
     m_closeButton->SetLabel(_("Cancel"));
-    EnablePulsing(false);
+    EnableProgressTracking();
 
-    HIDE(m_heading);
-    SHOW(m_progress);
-    SHOW(m_progressLabel);
-    SHOW(m_closeButtonSizer);
-    HIDE(m_runInstallerButtonSizer);
-    HIDE(m_releaseNotesSizer);
-    HIDE(m_updateButtonsSizer);
-    MakeResizable(false);
+    SetState(State_Downloading);
 }
 
 
@@ -923,6 +1650,7 @@ void UpdateDialog::DownloadProgress(size_t downloaded, size_t total)
         if ( m_progress->GetRange() != total )
             m_progress->SetRange(total);
         m_progress->SetValue(downloaded);
+        m_marquee = false;
         label = wxString::Format
                 (
                     // TRANSLATORS: This is the progress of a download, e.g. "3 MB of 12 MB".
@@ -933,26 +1661,26 @@ void UpdateDialog::DownloadProgress(size_t downloaded, size_t total)
     }
     else
     {
-        m_progress->Pulse();
+        if ( !StartMarquee() )
+            m_progress->Pulse();
         label = wxFileName::GetHumanReadableSize(downloaded, "", 1, wxSIZE_CONV_SI);
     }
 
     if ( label != m_progressLabel->GetLabel() )
       m_progressLabel->SetLabel(label);
-
-    Refresh();
-    Update();
 }
 
 
-void UpdateDialog::StateUpdateDownloaded(const std::wstring& updateFile, const std::string& installerArguments)
+void UpdateDialog::StateUpdateDownloaded(const std::wstring& updateFile, const AppcastPtr& update)
 {
+    EnablePulsing(false);
+
     m_downloader->Join();
     delete m_downloader;
     m_downloader = NULL;
 
     m_updateFile = updateFile;
-    m_installerArguments = installerArguments;
+    m_appcast = update;
 
     if ( m_installAutomatically )
     {
@@ -961,8 +1689,6 @@ void UpdateDialog::StateUpdateDownloaded(const std::wstring& updateFile, const s
         return;
     }
 
-    LayoutChangesGuard guard(this);
-
     SetMessage(_("Ready to install."));
 
     m_progress->SetRange(1);
@@ -970,18 +1696,40 @@ void UpdateDialog::StateUpdateDownloaded(const std::wstring& updateFile, const s
 
     m_runInstallerButton->SetDefault();
 
-    HIDE(m_heading);
-    SHOW(m_progress);
-    HIDE(m_progressLabel);
-    HIDE(m_closeButtonSizer);
-    SHOW(m_runInstallerButtonSizer);
-    HIDE(m_releaseNotesSizer);
-    HIDE(m_updateButtonsSizer);
-    MakeResizable(false);
+    SetState(State_UpdateDownloaded);
 }
 
 
-void UpdateDialog::ShowReleaseNotes(const Appcast& info)
+void UpdateDialog::ShowReleaseNotes(const AppcastPtr& info)
+{
+    SetWindowStyleFlag(GetWindowStyleFlag() | wxRESIZE_BORDER);
+
+    // Most release notes are simple enough not to need the whole MSIE
+    // engine, which is slow to load and takes a lot of memory.
+    if ( info->ReleaseNotesURL.empty() || !info->ReleaseNotes.empty() )
+    {
+        const std::string& html = info->ReleaseNotes.empty() ? info->Description : info->ReleaseNotes;
+        const wxString notes = wxString::FromUTF8(html.c_str());
+        if ( IsSimpleHtml(notes) )
+        {
+            m_browserParent->ShowText(HtmlToText(notes));
+            Stats::RecordUIMilestone(Stats::UIMilestone_ReleaseNotesShown);
+            return;
+        }
+    }
+
+    m_browserParent->ShowBrowser();
+
+#if wxCHECK_VERSION(2,9,5)
+    // Let the dialog be shown first, loading MSIE takes a moment.
+    CallAfter(&UpdateDialog::ShowReleaseNotesInBrowser, info);
+#else
+    ShowReleaseNotesInBrowser(info);
+#endif
+}
+
+
+void UpdateDialog::ShowReleaseNotesInBrowser(const AppcastPtr& info)
 {
     if ( !m_webBrowser.IsOk() )
     {
@@ -1002,16 +1750,15 @@ void UpdateDialog::ShowReleaseNotes(const Appcast& info)
         if ( FAILED(hr) )
         {
             // hide the notes again, we cannot show them
-            LayoutChangesGuard guard(this);
-            HIDE(m_releaseNotesSizer);
-            MakeResizable(false);
+            SetState(State_UpdateAvailable);
             LogError("Failed to create WebBrowser ActiveX control.");
             return;
         }
 
         m_webBrowser = browser;
 
-        new wxActiveXContainer(m_browserParent, IID_IWebBrowser2, browser);
+        wxActiveXContainer *container = new wxActiveXContainer(m_browserParent, IID_IWebBrowser2, browser);
+        container->Bind(wxEVT_ACTIVEX, &UpdateDialog::OnBrowserEvent, this);
 
         // Poke the browser to initialize it. This is needed when using
         // info.Description and does no harm with ReleaseNotesURL. To
@@ -1028,18 +1775,34 @@ void UpdateDialog::ShowReleaseNotes(const Appcast& info)
         );
     }
 
-    if( !info.ReleaseNotesURL.empty() )
+    // Release notes prefetched by UpdateChecker are written into the
+    // document like the description, the page doesn't need to be loaded.
+    wxString html;
+    if ( !info->ReleaseNotes.empty() )
     {
+        // relative links must still point to the release notes' site
+        html = wxString::Format("<base href=\"%s\">", info->ReleaseNotesURL) +
+               wxString::FromUTF8(info->ReleaseNotes.c_str());
+    }
+    else if ( !info->Description.empty() )
+    {
+        html = wxString::FromUTF8(info->Description.c_str());
+    }
+
+    if( !info->ReleaseNotesURL.empty() && info->ReleaseNotes.empty() )
+    {
+        // rendered when the page completes loading, see OnBrowserEvent()
+        m_loadingReleaseNotes = true;
         m_webBrowser->Navigate
                       (
-                          wxBasicString(info.ReleaseNotesURL),
+                          wxBasicString(info->ReleaseNotesURL),
                           NULL,  // Flags
                           NULL,  // TargetFrameName
                           NULL,  // PostData
                           NULL   // Headers
                       );
     }
-    else if ( !info.Description.empty() )
+    else if ( !html.empty() )
     {
         HRESULT hr = E_FAIL;
         IHTMLDocument2 *doc;
@@ -1076,7 +1839,7 @@ void UpdateDialog::ShowReleaseNotes(const Appcast& info)
                 VARIANT *param;
                 SafeArrayAccessData(psaStrings, (LPVOID*) &param);
                 param->vt = VT_BSTR;
-                param->bstrVal = wxBasicString(wxString::FromUTF8(info.Description.c_str()));
+                param->bstrVal = wxBasicString(html);
                 SafeArrayUnaccessData(psaStrings);
 
                 doc->write(psaStrings);
@@ -1086,10 +1849,9 @@ void UpdateDialog::ShowReleaseNotes(const Appcast& info)
             }
 
             doc->Release();
+            Stats::RecordUIMilestone(Stats::UIMilestone_ReleaseNotesShown);
         }
     }
-
-    SetWindowStyleFlag(GetWindowStyleFlag() | wxRESIZE_BORDER);
 }
 
 
@@ -1169,47 +1931,245 @@ const int MSG_UPDATE_AVAILABLE = wxNewId();
 // Notify the UI that a new version is available
 const int MSG_UPDATE_ERROR = wxNewId();
 
-// Inform the UI about download progress
-const int MSG_DOWNLOAD_PROGRESS = wxNewId();
-
 // Inform the UI that update download finished
 const int MSG_UPDATE_DOWNLOADED = wxNewId();
 
+// Inform the UI whether the installer was launched
+const int MSG_INSTALLER_LAUNCHED = wxNewId();
+
 // Tell the UI to ask for permission to check updates
 const int MSG_ASK_FOR_PERMISSION = wxNewId();
 
+// Create the update window hidden, so that showing it later is quick
+const int MSG_PREWARM = wxNewId();
+
+// Process the messages in App's queue, see App::PostMsg()
+const int MSG_PROCESS_QUEUE = wxNewId();
+
+
+/**
+    Message sent to the UI thread by another thread.
+
+    The payload is filled in place and then only referenced, never copied,
+    so messages can't be copied either.
+ */
+struct UIMessage
+{
+    explicit UIMessage(int id_) : id(id_), next(NULL) {}
+
+    int          id;
+    EventPayload payload;
+    UIMessage   *next;
+
+private:
+    UIMessage(const UIMessage&);
+    UIMessage& operator=(const UIMessage&);
+};
+
+
+/**
+    Lock-free queue of UIMessages.
+
+    Any number of threads can push messages into it concurrently without
+    ever waiting for each other or for the UI thread, which takes all the
+    queued messages at once. Because of that, a simple linked stack (with
+    compare-and-swap push) is enough; it's reversed when taken.
+ */
+class UIMessageQueue
+{
+public:
+    UIMessageQueue() : m_head(NULL) {}
+
+    ~UIMessageQueue()
+    {
+        DeleteList(TakeAll());
+    }
+
+    /**
+        Adds the message to the queue, taking ownership of it.
+
+        @return true if the queue was empty, i.e. the UI thread must be told
+                to process it.
+     */
+    bool Push(UIMessage *msg)
+    {
+        for ( ;; )
+        {
+            UIMessage *head = m_head;
+            msg->next = head;
+            if ( InterlockedCompareExchangePointer(
+                     reinterpret_cast<PVOID volatile*>(&m_head), msg, head) == head )
+            {
+                return head == NULL;
+            }
+        }
+    }
+
+    /// Takes all queued messages, as a list linked with next in FIFO order.
+    UIMessage *TakeAll()
+    {
+        UIMessage *list = static_cast<UIMessage*>(InterlockedExchangePointer(
+                                reinterpret_cast<PVOID volatile*>(&m_head), NULL));
+        UIMessage *fifo = NULL;
+        while ( list )
+        {
+            UIMessage *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+        return fifo;
+    }
+
+    bool IsEmpty() const { return m_head == NULL; }
+
+    static void DeleteList(UIMessage *list)
+    {
+        while ( list )
+        {
+            UIMessage *next = list->next;
+            delete list;
+            list = next;
+        }
+    }
+
+private:
+    UIMessage * volatile m_head;
+};
+
+
+/*--------------------------------------------------------------------------*
+                          UI on the host's thread
+ *--------------------------------------------------------------------------*/
+
+/**
+    Runs the app on the host application's thread instead of the UI thread,
+    see win_sparkle_set_ui_on_host_thread().
+
+    wx is initialized on that thread, but its event loop doesn't run there
+    (except for modal dialogs): the host's loop dispatches messages to wx
+    windows like to any others. The rest of what wx's loop does is done by
+    a message-only window on the thread: App::WakeUpIdle() posts to it to
+    process pending events, which includes messages from other threads (see
+    App::PostMsg()), and a message hook lets wx windows preprocess keyboard
+    input for dialog navigation.
+ */
+class HostThreadUI
+{
+public:
+    /// Creates the window on the calling thread, which becomes the host's.
+    static void Attach();
+
+    /// Destroys the window, must be called on the host's thread.
+    static void Detach();
+
+    /// Is the UI run on the host's thread?
+    static bool IsEnabled() { return ms_window != NULL; }
+
+    static bool IsHostThread() { return GetCurrentThreadId() == ms_threadId; }
+
+    /// Processes wx's pending events on the host's thread soon.
+    static void WakeUp()
+    {
+        // one posted message handles any number of wake-ups
+        if ( InterlockedExchange(&ms_wakeUpPending, 1) == 0 )
+            PostMessage(ms_window, WM_WAKE_UP, 0, 0);
+    }
+
+    /// Starts the app on the host's thread soon, see UIThreadAccess::Send().
+    static void RequestStart() { PostMessage(ms_window, WM_START_APP, 0, 0); }
+
+    /// Installs the keyboard message hook, once wx is initialized.
+    static void InstallHook();
+
+private:
+    static const UINT WM_WAKE_UP = WM_APP + 1;
+    static const UINT WM_START_APP = WM_APP + 2;
+
+    static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
+    static LRESULT CALLBACK GetMessageHook(int code, WPARAM wParam, LPARAM lParam);
+
+    static HWND ms_window;
+    static DWORD ms_threadId;
+    static HHOOK ms_hook;
+    static volatile LONG ms_wakeUpPending;
+};
+
+HWND HostThreadUI::ms_window = NULL;
+DWORD HostThreadUI::ms_threadId = 0;
+HHOOK HostThreadUI::ms_hook = NULL;
+volatile LONG HostThreadUI::ms_wakeUpPending = 0;
+
+const wchar_t HOST_THREAD_WINDOW_CLASS[] = L"WinSparkleHostThreadUI";
+
 
 /*--------------------------------------------------------------------------*
                                 Application
  *--------------------------------------------------------------------------*/
 
+const int ID_IDLE_TIMER = wxNewId();
+
 class App : public wxApp
 {
 public:
     App();
+    virtual ~App();
 
     virtual bool OnInit();
+    virtual int OnExit();
     virtual wxLayoutDirection GetLayoutDirection() const;
+    virtual void WakeUpIdle();
+
+    /**
+        Sends @a msg to the app, taking ownership of it.
+
+        May be called from any thread. Doesn't lock anything nor allocate
+        memory, unless the queue was empty and the app has to be woken up.
+     */
+    void PostMsg(UIMessage *msg);
 
-    // Sends a message with ID @a msg to the app.
-    void SendMsg(int msg, EventPayload *data = NULL);
+    // Sends a message with ID @a msg and no payload to the app.
+    void SendMsg(int msg) { PostMsg(new UIMessage(msg)); }
+
+    /// Are there messages sent to the app that it didn't process yet?
+    bool HasQueuedMessages() const { return m_pending || !m_queue.IsEmpty(); }
 
 private:
     void InitWindow();
     void ShowWindow();
 
+    // Is the update window shown? It's kept hidden when closed.
+    bool IsWindowShown() const { return m_win && m_win->IsShown(); }
+
     void OnWindowClose(wxCloseEvent& event);
-    void OnTerminate(wxThreadEvent& event);
-    void OnShowCheckingUpdates(wxThreadEvent& event);
-    void OnNoUpdateFound(wxThreadEvent& event);
-    void OnUpdateAvailable(wxThreadEvent& event);
-    void OnUpdateError(wxThreadEvent& event);
-    void OnDownloadProgress(wxThreadEvent& event);
-    void OnUpdateDownloaded(wxThreadEvent& event);
-    void OnAskForPermission(wxThreadEvent& event);
+    void OnProcessQueue(wxThreadEvent& event);
+    void ScheduleIdleShutdown(bool closingWindow = false);
+    void OnIdleTimeout(wxTimerEvent& event);
+    void DispatchMsg(UIMessage& msg);
+
+    void OnTerminate();
+    void OnShowCheckingUpdates();
+    void OnNoUpdateFound(const EventPayload& payload);
+    void OnUpdateAvailable(const EventPayload& payload);
+    void OnUpdateError(const EventPayload& payload);
+    void OnUpdateDownloaded(const EventPayload& payload);
+    void OnInstallerLaunched(const EventPayload& payload);
+    void OnAskForPermission();
+    void OnPrewarm();
 
 private:
     UpdateDialog *m_win;
+
+    // direction of the language used, found once in OnInit()
+    wxLayoutDirection m_layoutDirection;
+
+    UIMessageQueue m_queue;
+    // messages taken from m_queue, but not processed yet
+    UIMessage *m_pending;
+
+    // shuts the UI thread down when there's no window for a while, see
+    // win_sparkle_set_ui_idle_timeout()
+    wxTimer m_idleTimer;
 };
 
 IMPLEMENT_APP_NO_MAIN(App)
@@ -1217,6 +2177,8 @@ IMPLEMENT_APP_NO_MAIN(App)
 App::App()
 {
     m_win = NULL;
+    m_pending = NULL;
+    m_layoutDirection = wxLayout_Default;
 
     // Keep the wx "main" thread running even without windows. This greatly
     // simplifies threads handling, because we don't have to correctly
@@ -1229,19 +2191,22 @@ App::App()
     // would be destroyed.
     //
     // Also note that this is efficient, because if there are no windows, the
-    // thread will sleep waiting for a new event. We could safe some memory
-    // by shutting the thread down when it's no longer needed, though.
+    // thread will sleep waiting for a new event. To save memory, it can also
+    // exit when it's no longer needed, see OnIdleTimeout(); it's then
+    // started anew, instead of restarting the wx thread.
     SetExitOnFrameDelete(false);
 
-    // Bind events to their handlers:
-    Bind(wxEVT_COMMAND_THREAD, &App::OnTerminate, this, MSG_TERMINATE);
-    Bind(wxEVT_COMMAND_THREAD, &App::OnShowCheckingUpdates, this, MSG_SHOW_CHECKING_UPDATES);
-    Bind(wxEVT_COMMAND_THREAD, &App::OnNoUpdateFound, this, MSG_NO_UPDATE_FOUND);
-    Bind(wxEVT_COMMAND_THREAD, &App::OnUpdateAvailable, this, MSG_UPDATE_AVAILABLE);
-    Bind(wxEVT_COMMAND_THREAD, &App::OnUpdateError, this, MSG_UPDATE_ERROR);
-    Bind(wxEVT_COMMAND_THREAD, &App::OnDownloadProgress, this, MSG_DOWNLOAD_PROGRESS);
-    Bind(wxEVT_COMMAND_THREAD, &App::OnUpdateDownloaded, this, MSG_UPDATE_DOWNLOADED);
-    Bind(wxEVT_COMMAND_THREAD, &App::OnAskForPermission, this, MSG_ASK_FOR_PERMISSION);
+    // Messages are dispatched to their handlers by OnProcessQueue():
+    Bind(wxEVT_COMMAND_THREAD, &App::OnProcessQueue, this, MSG_PROCESS_QUEUE);
+
+    m_idleTimer.SetOwner(this, ID_IDLE_TIMER);
+    Bind(wxEVT_TIMER, &App::OnIdleTimeout, this, ID_IDLE_TIMER);
+}
+
+
+App::~App()
+{
+    UIMessageQueue::DeleteList(m_pending);
 }
 
 
@@ -1269,37 +2234,122 @@ bool App::OnInit()
     }
     language.Replace("-", "_");
 
-    wxTranslations *trans = new wxTranslations();
-    wxTranslations::Set(trans);
+    wxTranslations *trans = new wxTranslations();
+    wxTranslations::Set(trans);
+
+    trans->SetLoader(new DllTranslationsLoader());
+    trans->SetLanguage(language);
+    trans->AddCatalog("winsparkle");
+
+    // GetLayoutDirection() is called for every window, don't look for the
+    // best translation every time.
+    const wxLanguageInfo *info =
+        wxLocale::FindLanguageInfo(trans->GetBestTranslation("winsparkle"));
+    if ( info )
+        m_layoutDirection = info->LayoutDirection;
+
+    return true;
+}
+
+
+int App::OnExit()
+{
+    g_iconCache.Clear();
+    return wxApp::OnExit();
+}
+
+
+wxLayoutDirection App::GetLayoutDirection() const
+{
+    return m_layoutDirection;
+}
+
 
-    trans->SetLoader(new DllTranslationsLoader());
-    trans->SetLanguage(language);
-    trans->AddCatalog("winsparkle");
+void App::WakeUpIdle()
+{
+    // wx's event loop doesn't run on the host's thread to be woken up
+    if ( HostThreadUI::IsEnabled() )
+        HostThreadUI::WakeUp();
+    else
+        wxApp::WakeUpIdle();
+}
 
-    return true;
+
+void App::PostMsg(UIMessage *msg)
+{
+    // Only one wake-up event is needed for any number of queued messages,
+    // OnProcessQueue() handles all of them.
+    if ( m_queue.Push(msg) )
+        wxQueueEvent(this, new wxThreadEvent(wxEVT_COMMAND_THREAD, MSG_PROCESS_QUEUE));
 }
 
 
-wxLayoutDirection App::GetLayoutDirection() const
+void App::OnProcessQueue(wxThreadEvent&)
 {
-    wxString lang = wxTranslations::Get()->GetBestTranslation("winsparkle");
-    const wxLanguageInfo *info = wxLocale::FindLanguageInfo(lang);
-    return info ? info->LayoutDirection : wxLayout_Default;
+    // The messages are kept in m_pending rather than in a local variable, so
+    // that they are processed in order even if a handler runs a nested event
+    // loop (e.g. shows a modal dialog) that calls this function again.
+    for ( ;; )
+    {
+        if ( !m_pending )
+            m_pending = m_queue.TakeAll();
+        if ( !m_pending )
+            break;
+
+        std::unique_ptr<UIMessage> msg(m_pending);
+        m_pending = msg->next;
+
+        DispatchMsg(*msg);
+    }
+
+    // e.g. the permission dialog was closed, or the message was for
+    // a window that isn't there
+    ScheduleIdleShutdown();
 }
 
 
-void App::SendMsg(int msg, EventPayload *data)
+void App::ScheduleIdleShutdown(bool closingWindow)
 {
-    wxThreadEvent *event = new wxThreadEvent(wxEVT_COMMAND_THREAD, msg);
-    if ( data )
-        event->SetPayload(*data);
+    const int timeout = Settings::GetUIIdleTimeout();
+    if ( timeout <= 0 || (IsWindowShown() && !closingWindow) || HostThreadUI::IsEnabled() )
+        return;
+
+    // restarts the timer if it's running already
+    m_idleTimer.Start(timeout * 1000, wxTIMER_ONE_SHOT);
+}
+
 
-    wxQueueEvent(this, event);
+void App::DispatchMsg(UIMessage& msg)
+{
+    // message IDs aren't constants, so they can't be used in a switch
+    const int id = msg.id;
+    if ( id == MSG_TERMINATE )
+        OnTerminate();
+    else if ( id == MSG_SHOW_CHECKING_UPDATES )
+        OnShowCheckingUpdates();
+    else if ( id == MSG_NO_UPDATE_FOUND )
+        OnNoUpdateFound(msg.payload);
+    else if ( id == MSG_UPDATE_AVAILABLE )
+        OnUpdateAvailable(msg.payload);
+    else if ( id == MSG_UPDATE_ERROR )
+        OnUpdateError(msg.payload);
+    else if ( id == MSG_UPDATE_DOWNLOADED )
+        OnUpdateDownloaded(msg.payload);
+    else if ( id == MSG_INSTALLER_LAUNCHED )
+        OnInstallerLaunched(msg.payload);
+    else if ( id == MSG_ASK_FOR_PERMISSION )
+        OnAskForPermission();
+    else if ( id == MSG_PREWARM )
+        OnPrewarm();
 }
 
 
 void App::InitWindow()
 {
+    m_idleTimer.Stop();
+
+    // the window is created only once and then reused, see
+    // UpdateDialog::OnClose()
     if ( !m_win )
     {
         m_win = new UpdateDialog();
@@ -1312,24 +2362,31 @@ void App::ShowWindow()
 {
     wxASSERT( m_win );
 
+    // the window must have its final size before it's centered
+    m_win->FlushLayout();
+
     m_win->Freeze();
     if (!m_win->IsShown())
         CenterWindowOnHostApplication(m_win);
     m_win->Show();
     m_win->Thaw();
     m_win->Raise();
+
+    Stats::RecordFootprint(WIN_SPARKLE_STATS_FOOTPRINT_DIALOG_SHOWN);
 }
 
 
 void App::OnWindowClose(wxCloseEvent& event)
 {
-    m_win = NULL;
+    // called before UpdateDialog::OnClose() hides the window
+    ScheduleIdleShutdown(true);
     event.Skip();
 }
 
 
-void App::OnTerminate(wxThreadEvent&)
+void App::OnTerminate()
 {
+    // not used on the host's thread, see UIThreadAccess::ShutDownHostThreadApp()
     wxEventLoopBase *activeLoop = wxEventLoop::GetActive();
     if (!activeLoop->IsMain())
         activeLoop->Exit(wxID_CANCEL);
@@ -1337,7 +2394,7 @@ void App::OnTerminate(wxThreadEvent&)
 }
 
 
-void App::OnShowCheckingUpdates(wxThreadEvent&)
+void App::OnShowCheckingUpdates()
 {
     InitWindow();
     m_win->StateCheckingUpdates();
@@ -1345,56 +2402,58 @@ void App::OnShowCheckingUpdates(wxThreadEvent&)
 }
 
 
-void App::OnNoUpdateFound(wxThreadEvent& event)
+void App::OnNoUpdateFound(const EventPayload& payload)
 {
-    if ( m_win )
+    if ( IsWindowShown() )
     {
-        EventPayload payload(event.GetPayload<EventPayload>());
         m_win->StateNoUpdateFound(payload.installAutomatically);
+        Stats::RecordUIMilestone(Stats::UIMilestone_ResultShown);
     }
 }
 
 
-void App::OnUpdateError(wxThreadEvent& event)
+void App::OnUpdateError(const EventPayload& payload)
 {
-    if ( m_win )
+    if ( IsWindowShown() )
     {
-        EventPayload payload(event.GetPayload<EventPayload>());
         m_win->StateUpdateError(payload.error);
+        Stats::RecordUIMilestone(Stats::UIMilestone_ResultShown);
     }
 }
 
-void App::OnDownloadProgress(wxThreadEvent& event)
+void App::OnUpdateDownloaded(const EventPayload& payload)
 {
-    if ( m_win )
+    if ( IsWindowShown() )
     {
-        EventPayload payload(event.GetPayload<EventPayload>());
-        m_win->DownloadProgress(payload.sizeDownloaded, payload.sizeTotal);
+        m_win->StateUpdateDownloaded(payload.updateFile, payload.appcast);
     }
 }
 
-void App::OnUpdateDownloaded(wxThreadEvent& event)
+
+void App::OnInstallerLaunched(const EventPayload& payload)
 {
-    if ( m_win )
-    {
-        EventPayload payload(event.GetPayload<EventPayload>());
-        m_win->StateUpdateDownloaded(payload.updateFile, payload.appcast.InstallerArguments);
-    }
+    if ( IsWindowShown() )
+        m_win->InstallerLaunched(payload.success);
+
+    // even if the user closed the window meanwhile, the installer needs the
+    // application to exit
+    if ( payload.success )
+        ApplicationController::RequestShutdown();
 }
 
 
-void App::OnUpdateAvailable(wxThreadEvent& event)
+void App::OnUpdateAvailable(const EventPayload& payload)
 {
     InitWindow();
 
-    EventPayload payload(event.GetPayload<EventPayload>());
     m_win->StateUpdateAvailable(payload.appcast, payload.installAutomatically);
 
     ShowWindow();
+    Stats::RecordUIMilestone(Stats::UIMilestone_ResultShown);
 }
 
 
-void App::OnAskForPermission(wxThreadEvent& event)
+void App::OnAskForPermission()
 {
     AskPermissionDialog dlg;
     bool shouldCheck = (dlg.ShowModal() == wxID_OK);
@@ -1404,16 +2463,53 @@ void App::OnAskForPermission(wxThreadEvent& event)
     if ( shouldCheck )
     {
         // same as in win_sparkle_init()
-        UpdateChecker *check = new PeriodicUpdateChecker();
-        check->Start();
+        UpdateScheduler::Start();
     }
 }
 
 
+void App::OnPrewarm()
+{
+    // The window stays hidden until there's something to show in it. Until
+    // then, the background checks' results are ignored, just as they would
+    // be without any window, see IsWindowShown().
+    InitWindow();
+
+    // The thread was started at low priority for this, see UI::Run().
+    if ( !HostThreadUI::IsEnabled() )
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+}
+
+
 /*--------------------------------------------------------------------------*
                              winsparkle::UI class
  *--------------------------------------------------------------------------*/
 
+// Does what's needed before wx is initialized on the calling thread, which
+// is either the UI thread or the host's. Returns HINSTANCE to pass to it.
+HINSTANCE PrepareWxInitialization()
+{
+    // We need to pass correct HINSTANCE to wxEntry() and the right value is
+    // HINSTANCE of this DLL, not of the main .exe.
+    if ( !UI::GetDllHINSTANCE() )
+    {
+        // If DllMain() was not called, assume we're statically linked
+        // and use the hInstance of the containing program.
+        UI::SetDllHINSTANCE(GetModuleHandle(NULL));
+    }
+
+    // IMPLEMENT_WXWIN_MAIN does this as the first thing
+    wxDISABLE_DEBUG_SUPPORT();
+
+    // the DPI awareness is the app's business
+#if wxCHECK_VERSION(3, 0, 3) && !wxCHECK_VERSION(3, 1, 0)
+    wxMSWDisableSettingHighDPIAware();
+#endif
+
+    return UI::GetDllHINSTANCE();
+}
+
+
 // helper for accessing the UI thread
 class UIThreadAccess
 {
@@ -1426,46 +2522,403 @@ public:
         return wxGetApp();
     }
 
-    bool IsRunning() const { return ms_uiThread != NULL; }
+    bool IsRunning() const { return ms_uiThread != NULL || ms_hostThreadApp; }
+
+    /**
+        Sends @a msg to the app, taking ownership of it, and starts the app
+        first if needed.
+
+        If the UI runs on the host's thread and this is another thread, the
+        app can't be started here. It's started on the host's thread later
+        and gets the message then.
+     */
+    void Send(UIMessage *msg)
+    {
+        std::unique_ptr<UIMessage> guard(msg);
+        if ( !IsRunning() && HostThreadUI::IsEnabled() && !HostThreadUI::IsHostThread() )
+        {
+            ms_earlyMessages.Push(guard.release());
+            if ( !ms_hostStartPending )
+            {
+                ms_hostStartPending = true;
+                HostThreadUI::RequestStart();
+            }
+            return;
+        }
+
+        App().PostMsg(guard.release());
+    }
+
+    /**
+        Sends @a msg to the UI thread, taking ownership of it.
+
+        If the thread is running, this doesn't take ms_uiThreadCS, so that
+        worker threads don't wait for each other or for the UI thread to
+        start or shut down.
+
+        @param startIfNeeded  Start the UI thread if it isn't running,
+                              otherwise the message is dropped.
+     */
+    static void Post(UIMessage *msg, bool startIfNeeded)
+    {
+        std::unique_ptr<UIMessage> guard(msg);
+        if ( TryPost(guard) )
+            return;
+
+        // The thread may be starting right now, so wait for that to finish
+        // before dropping the message, see UI::ShowCheckingUpdates().
+        UIThreadAccess uit;
+        if ( TryPost(guard) )
+            return;
+
+        // the window the message is for may be about to be shown on the
+        // host's thread
+        if ( !startIfNeeded && !ms_hostStartPending )
+            return;
+
+        uit.Send(guard.release());
+    }
+
+    /**
+        Starts the UI thread, if needed, at low priority and creates the
+        update window hidden.
+     */
+    void Prewarm()
+    {
+        if ( HostThreadUI::IsEnabled() )
+        {
+            // this is never the host's thread, so the app starts when the
+            // host's loop gets to it
+            Send(new UIMessage(MSG_PREWARM));
+            return;
+        }
+
+        StartIfNeeded(true);
+        wxGetApp().SendMsg(MSG_PREWARM);
+    }
+
+    /// Makes Post() stop using the app, before shutting it down.
+    void StopPosting()
+    {
+        WriteLocker lock(ms_appLock);
+        ms_appRunning = false;
+    }
 
     // intentionally not static, to force locking before access
     UI* UIThread() { return ms_uiThread; }
 
-    void ShutDownThread()
+    bool ShutDownThread(DWORD timeout)
     {
         if ( ms_uiThread )
         {
-            ms_uiThread->Join();
+            // If the thread is still running, it's left alone: deleting it
+            // would pull the rug from under it, and keeping ms_uiThread set
+            // prevents starting another one.
+            if ( !ms_uiThread->Join(timeout) )
+                return false;
             delete ms_uiThread;
             ms_uiThread = NULL;
         }
+        return true;
+    }
+
+    /// Cleans up after the UI thread if it exited after being idle.
+    void JoinIdleThread()
+    {
+        {
+            ReadLocker lock(ms_appLock);
+            if ( !ms_idleExit )
+                return;
+        }
+
+        // it doesn't wait for anything anymore, so this is quick
+        ms_uiThread->Join();
+        delete ms_uiThread;
+        ms_uiThread = NULL;
+
+        WriteLocker lock(ms_appLock);
+        ms_idleExit = false;
+    }
+
+    /**
+        Makes Post() stop using the app if it has nothing to do, so that
+        the UI thread can exit. Called on the UI thread itself, see
+        App::OnIdleTimeout().
+
+        This doesn't take ms_uiThreadCS, whose owner may be waiting for the
+        UI thread. The next StartIfNeeded() joins the thread and starts
+        a new one.
+
+        @return true if the thread should exit now.
+     */
+    static bool StopPostingIfIdle()
+    {
+        // Messages are only pushed with the read lock held, so all of them
+        // are in the queue by now.
+        WriteLocker lock(ms_appLock);
+        if ( !ms_appRunning || wxGetApp().HasQueuedMessages() )
+            return false;
+
+        ms_appRunning = false;
+        ms_idleExit = true;
+        return true;
+    }
+
+    /// Shuts down the app running on the host's thread, see HostThreadUI.
+    void ShutDownHostThreadApp()
+    {
+        StopPosting();
+
+        if ( !HostThreadUI::IsHostThread() )
+        {
+            // wx can't be cleaned up on another thread; leave it be
+            LogError("win_sparkle_cleanup() must be called from the thread that called win_sparkle_init()");
+            return;
+        }
+
+        if ( ms_hostThreadApp )
+        {
+            wxTheApp->OnExit();
+            wxEntryCleanup();
+            ms_hostThreadApp = false;
+        }
+
+        ms_hostStartPending = false;
+        UIMessageQueue::DeleteList(ms_earlyMessages.TakeAll());
+        HostThreadUI::Detach();
     }
 
 private:
-    void StartIfNeeded()
+    // posts the message if the app is running, without taking ms_uiThreadCS
+    static bool TryPost(std::unique_ptr<UIMessage>& msg)
     {
-        // if the thread is not running yet, we have to start it
-        if ( !ms_uiThread )
+        ReadLocker lock(ms_appLock);
+        if ( !ms_appRunning )
+            return false;
+        wxGetApp().PostMsg(msg.release());
+        return true;
+    }
+
+    void StartIfNeeded(bool lowPriority = false)
+    {
+        JoinIdleThread();
+        if ( IsRunning() )
+            return;
+
+        if ( HostThreadUI::IsEnabled() )
+        {
+            // only called on the host's thread, see Send()
+            StartHostThreadApp();
+        }
+        else
         {
-            ms_uiThread = new UI();
+            // if the thread is not running yet, we have to start it
+            ms_uiThread = new UI(lowPriority);
             ms_uiThread->Start();
         }
+
+        // Messages sent while the app was starting on the host's thread go
+        // first, before Post() can add newer ones.
+        ms_hostStartPending = false;
+        for ( UIMessage *msg = ms_earlyMessages.TakeAll(); msg; )
+        {
+            UIMessage *next = msg->next;
+            wxGetApp().PostMsg(msg);
+            msg = next;
+        }
+
+        WriteLocker lock(ms_appLock);
+        ms_appRunning = true;
+    }
+
+    // initializes wx and the app on the host's thread, see UI::Run()
+    void StartHostThreadApp()
+    {
+        const HINSTANCE hInstance = PrepareWxInitialization();
+
+        if ( !wxEntryStart(hInstance) )
+            throw std::runtime_error("Failed to initialize wxWidgets.");
+        if ( !wxTheApp->CallOnInit() )
+        {
+            wxEntryCleanup();
+            throw std::runtime_error("Failed to initialize WinSparkle UI.");
+        }
+
+        HostThreadUI::InstallHook();
+        ms_hostThreadApp = true;
     }
 
     CriticalSectionLocker m_lock;
 
     static UI *ms_uiThread;
     static CriticalSection ms_uiThreadCS;
+
+    // Is the app running and can Post() use it? Guarded by ms_appLock,
+    // which is only locked for writing when the UI thread starts or stops.
+    static bool ms_appRunning;
+    static ReadWriteLock ms_appLock;
+
+    // Did the UI thread exit (or is exiting) because it was idle? Guarded by
+    // ms_appLock too.
+    static bool ms_idleExit;
+
+    // Is the app running on the host's thread instead of ms_uiThread?
+    static bool ms_hostThreadApp;
+    // Was the host's thread asked to start the app? Messages sent until it
+    // does are kept in ms_earlyMessages.
+    static bool ms_hostStartPending;
+    static UIMessageQueue ms_earlyMessages;
+
+    friend class HostThreadUI;
 };
 
 UI *UIThreadAccess::ms_uiThread = NULL;
-CriticalSection UIThreadAccess::ms_uiThreadCS;
+CriticalSection UIThreadAccess::ms_uiThreadCS("UI thread");
+bool UIThreadAccess::ms_appRunning = false;
+ReadWriteLock UIThreadAccess::ms_appLock("UI app");
+bool UIThreadAccess::ms_idleExit = false;
+bool UIThreadAccess::ms_hostThreadApp = false;
+bool UIThreadAccess::ms_hostStartPending = false;
+UIMessageQueue UIThreadAccess::ms_earlyMessages;
+
+
+void HostThreadUI::Attach()
+{
+    const HINSTANCE hInstance = UI::GetDllHINSTANCE() ? UI::GetDllHINSTANCE()
+                                                      : GetModuleHandle(NULL);
+
+    WNDCLASSW wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.lpfnWndProc = &HostThreadUI::WndProc;
+    wc.hInstance = hInstance;
+    wc.lpszClassName = HOST_THREAD_WINDOW_CLASS;
+    if ( !RegisterClassW(&wc) && GetLastError() != ERROR_CLASS_ALREADY_EXISTS )
+        throw Win32Exception();
+
+    HWND window = CreateWindowW(HOST_THREAD_WINDOW_CLASS, L"", 0, 0, 0, 0, 0,
+                                HWND_MESSAGE, NULL, hInstance, NULL);
+    if ( !window )
+        throw Win32Exception();
+
+    ms_threadId = GetCurrentThreadId();
+    ms_window = window;
+}
+
+
+void HostThreadUI::Detach()
+{
+    if ( ms_hook )
+    {
+        UnhookWindowsHookEx(ms_hook);
+        ms_hook = NULL;
+    }
+
+    if ( ms_window )
+    {
+        const HINSTANCE hInstance =
+            reinterpret_cast<HINSTANCE>(GetWindowLongPtr(ms_window, GWLP_HINSTANCE));
+        DestroyWindow(ms_window);
+        ms_window = NULL;
+        UnregisterClassW(HOST_THREAD_WINDOW_CLASS, hInstance);
+    }
+}
+
+
+void HostThreadUI::InstallHook()
+{
+    // without it, the dialogs still work, just not from the keyboard
+    ms_hook = SetWindowsHookExW(WH_GETMESSAGE, &HostThreadUI::GetMessageHook, NULL, ms_threadId);
+    if ( !ms_hook )
+        LogError("Failed to install keyboard hook for WinSparkle UI");
+}
+
+
+LRESULT CALLBACK HostThreadUI::WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    // exceptions must not propagate into the host's message loop
+    try
+    {
+        if ( msg == WM_WAKE_UP )
+        {
+            InterlockedExchange(&ms_wakeUpPending, 0);
+            if ( wxTheApp )
+            {
+                wxTheApp->ProcessPendingEvents();
+                // e.g. deletes destroyed windows, ignores requests for more
+                // idle events to not starve the host's loop
+                wxTheApp->ProcessIdle();
+            }
+            return 0;
+        }
+        else if ( msg == WM_START_APP )
+        {
+            UIThreadAccess uit;
+            uit.StartIfNeeded();
+            return 0;
+        }
+    }
+    CATCH_ALL_EXCEPTIONS
+
+    return DefWindowProcW(hwnd, msg, wParam, lParam);
+}
+
+
+LRESULT CALLBACK HostThreadUI::GetMessageHook(int code, WPARAM wParam, LPARAM lParam)
+{
+    // wx's loop lets windows handle Tab, Enter, Esc etc. before the message
+    // is dispatched, but the host's loop doesn't, nor should this be done
+    // twice from the loop of a modal dialog
+    MSG *msg = reinterpret_cast<MSG*>(lParam);
+    if ( code == HC_ACTION && wParam == PM_REMOVE &&
+         msg->message >= WM_KEYFIRST && msg->message <= WM_KEYLAST &&
+         !wxEventLoopBase::GetActive() )
+    {
+        wxWindow *win = wxGetWindowFromHWND(msg->hwnd);
+        wxWindow *tlw = win ? wxGetTopLevelParent(win) : NULL;
+        if ( tlw && tlw->MSWProcessMessage(msg) )
+        {
+            // handled, the host must not translate and dispatch it too
+            msg->message = WM_NULL;
+        }
+    }
+
+    return CallNextHookEx(ms_hook, code, wParam, lParam);
+}
+
+
+void App::OnIdleTimeout(wxTimerEvent&)
+{
+    // a modal dialog may be shown without m_win, e.g. AskPermissionDialog
+    wxEventLoopBase *activeLoop = wxEventLoop::GetActive();
+    if ( IsWindowShown() || !activeLoop || !activeLoop->IsMain() )
+    {
+        ScheduleIdleShutdown();
+        return;
+    }
+
+    // Queued messages may need a window. If so, the timer is started again
+    // once it's closed.
+    if ( !UIThreadAccess::StopPostingIfIdle() )
+        return;
+
+    // wxEntry() returns and cleans up wx, see UI::Run()
+    GetMainLoop()->ScheduleExit(0);
+}
 
 
 HINSTANCE UI::ms_hInstance = NULL;
 
 
-UI::UI() : Thread("WinSparkle UI thread")
+/*static*/
+void UI::AttachToHostThread()
+{
+    HostThreadUI::Attach();
+}
+
+
+UI::UI(bool lowPriority)
+    : Thread("WinSparkle UI thread", true),
+      m_lowPriority(lowPriority)
 {
 }
 
@@ -1475,18 +2928,14 @@ void UI::Run()
     // Note: The thread that called UI::Get() holds gs_uiThreadCS
     //       at this point and won't release it until we signal it.
 
-    // We need to pass correct HINSTANCE to wxEntry() and the right value is
-    // HINSTANCE of this DLL, not of the main .exe.
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_UI);
 
-    if ( !ms_hInstance )
-    {
-        // If DllMain() was not called, assume we're statically linked
-        // and use the hInstance of the containing program.
-        ms_hInstance = GetModuleHandle(NULL);
-    }
+    // When prewarming, initialize without competing with the app for CPU;
+    // App::OnPrewarm() restores normal priority when done.
+    if ( m_lowPriority )
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
 
-    // IMPLEMENT_WXWIN_MAIN does this as the first thing
-    wxDISABLE_DEBUG_SUPPORT();
+    const HINSTANCE hInstance = PrepareWxInitialization();
 
     // We do this before wxEntry() explicitly, even though wxEntry() would
     // do it too, so that we know when wx is initialized and can signal
@@ -1499,23 +2948,28 @@ void UI::Run()
     SignalReady();
 
     // Run the app:
-#if wxCHECK_VERSION(3, 0, 3) && !wxCHECK_VERSION(3, 1, 0)
-    wxMSWDisableSettingHighDPIAware();
-#endif
-    wxEntry(ms_hInstance);
+    wxEntry(hInstance);
 }
 
 
 /*static*/
-void UI::ShutDown()
+bool UI::ShutDown(DWORD timeout)
 {
     UIThreadAccess uit;
 
+    if ( HostThreadUI::IsEnabled() )
+    {
+        uit.ShutDownHostThreadApp();
+        return true;
+    }
+
+    uit.JoinIdleThread();
     if ( !uit.IsRunning() )
-        return;
+        return true;
 
+    uit.StopPosting();
     uit.App().SendMsg(MSG_TERMINATE);
-    uit.ShutDownThread();
+    return uit.ShutDownThread(timeout);
 }
 
 
@@ -1524,71 +2978,123 @@ void UI::NotifyNoUpdates(bool installAutomatically)
 {
     ApplicationController::NotifyUpdateNotFound();
 
-    UIThreadAccess uit;
-    EventPayload payload;
-    payload.installAutomatically = installAutomatically;
-
-    if ( !uit.IsRunning() )
-        return;
-
-    uit.App().SendMsg(MSG_NO_UPDATE_FOUND, &payload);
+    UIMessage *msg = new UIMessage(MSG_NO_UPDATE_FOUND);
+    msg->payload.installAutomatically = installAutomatically;
+    UIThreadAccess::Post(msg, false);
 }
 
 
 /*static*/
-void UI::NotifyUpdateAvailable(const Appcast& info, bool installAutomatically)
+void UI::NotifyUpdateAvailable(const AppcastPtr& info, bool installAutomatically)
 {
     ApplicationController::NotifyUpdateFound();
 
-    UIThreadAccess uit;
-    EventPayload payload;
-    payload.appcast = info;
-    payload.installAutomatically = installAutomatically;
-    uit.App().SendMsg(MSG_UPDATE_AVAILABLE, &payload);
+    UIMessage *msg = new UIMessage(MSG_UPDATE_AVAILABLE);
+    msg->payload.appcast = info;
+    msg->payload.installAutomatically = installAutomatically;
+    // In headless mode, the app was told about the update by the callback
+    // above and shows the UI itself. Still show the update if the UI is
+    // already running, as it's then a manual check started by the app.
+    UIThreadAccess::Post(msg, !Settings::GetHeadlessMode());
 }
 
 
 /*static*/
 void UI::NotifyDownloadProgress(size_t downloaded, size_t total)
 {
-    UIThreadAccess uit;
-    EventPayload payload;
-    payload.sizeDownloaded = downloaded;
-    payload.sizeTotal = total;
-    uit.App().SendMsg(MSG_DOWNLOAD_PROGRESS, &payload);
+    // sampled by the dialog, see UpdateDialog::OnTimer()
+    g_downloadProgress.Set(downloaded, total);
 }
 
 
 /*static*/
-void UI::NotifyUpdateDownloaded(const std::wstring& updateFile, const Appcast &appcast)
+void UI::NotifyUpdateDownloaded(const std::wstring& updateFile, const AppcastPtr& appcast)
 {
-    UIThreadAccess uit;
-    EventPayload payload;
-    payload.updateFile = updateFile;
-    payload.appcast = appcast;
-    uit.App().SendMsg(MSG_UPDATE_DOWNLOADED, &payload);
+    UIMessage *msg = new UIMessage(MSG_UPDATE_DOWNLOADED);
+    msg->payload.updateFile = updateFile;
+    msg->payload.appcast = appcast;
+    // only the dialog downloads updates, there's no one to tell if it's gone
+    UIThreadAccess::Post(msg, false);
 }
 
 
 /*static*/
 void UI::NotifyUpdateError(ErrorCode err)
+{
+    UIMessage *msg = new UIMessage(MSG_UPDATE_ERROR);
+    msg->payload.error = err;
+    UIThreadAccess::Post(msg, false);
+}
+
+
+/*static*/
+void UI::ShowCheckingUpdates(Thread *check)
 {
     UIThreadAccess uit;
 
-    if ( !uit.IsRunning() )
-        return;
+    if ( uit.IsRunning() )
+    {
+        // the window must be shown before the check can report its result
+        uit.Send(new UIMessage(MSG_SHOW_CHECKING_UPDATES));
+        check->Start();
+    }
+    else
+    {
+        // Don't wait with the check until the UI thread starts. Its result
+        // can't overtake the window, because reporting it to a UI that isn't
+        // running yet waits for ms_uiThreadCS, which we hold. (If the UI
+        // starts on the host's thread later, it's queued after the window.)
+        check->Start();
+        uit.Send(new UIMessage(MSG_SHOW_CHECKING_UPDATES));
+    }
+}
 
-    EventPayload payload;
-    payload.error = err;
-    uit.App().SendMsg(MSG_UPDATE_ERROR, &payload);
+
+namespace
+{
+
+void InstallerLauncher::Run()
+{
+    SignalReady();
+
+    UIMessage *msg = new UIMessage(MSG_INSTALLER_LAUNCHED);
+    msg->payload.success = Launch();
+    UIThreadAccess::Post(msg, false);
+}
+
+
+bool InstallerLauncher::Launch()
+{
+    return UpdateDownloader::LaunchInstaller(m_file, *m_update);
 }
 
 
+// Starts the UI thread in the background, see UI::Prewarm().
+class UIPrewarmer : public Thread
+{
+public:
+    UIPrewarmer() : Thread("WinSparkle UI prewarmer") {}
+
+protected:
+    virtual void Run()
+    {
+        SignalReady();
+
+        UIThreadAccess uit;
+        uit.Prewarm();
+    }
+
+    virtual bool IsJoinable() const { return false; }
+};
+
+} // anonymous namespace
+
+
 /*static*/
-void UI::ShowCheckingUpdates()
+void UI::Prewarm()
 {
-    UIThreadAccess uit;
-    uit.App().SendMsg(MSG_SHOW_CHECKING_UPDATES);
+    Thread *prewarmer = new UIPrewarmer();
+    prewarmer->Start();
 }
 
 
@@ -1596,7 +3102,7 @@ void UI::ShowCheckingUpdates()
 void UI::AskForPermission()
 {
     UIThreadAccess uit;
-    uit.App().SendMsg(MSG_ASK_FOR_PERMISSION);
+    uit.Send(new UIMessage(MSG_ASK_FOR_PERMISSION));
 }
 
 } // namespace winsparkle
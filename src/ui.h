@@ -46,7 +46,11 @@ enum ErrorCode
 
     This thread is only created when needed -- in most cases, it isn't. Once it
     is created, it runs indefinitely (without wasting CPU time -- it sleeps
-    waiting for incoming messages).
+    waiting for incoming messages), unless it's set to exit when idle (see
+    Settings::GetUIIdleTimeout()).
+
+    Alternatively, the UI runs on the host application's thread, see
+    AttachToHostThread().
  */
 class UI : public Thread
 {
@@ -54,10 +58,16 @@ public:
     /**
         Shuts the UI thread down.
 
+        @param timeout  How long to wait for the thread to finish, in
+                        milliseconds.
+
+        @return false if the thread was still running when the timeout
+                elapsed.
+
         @note Currently, this may only be called once, from
               win_sparkle_cleanup().
      */
-    static void ShutDown();
+    static bool ShutDown(DWORD timeout = INFINITE);
 
     /**
         Notifies the UI that no updates were found.
@@ -80,30 +90,55 @@ public:
     /**
         Notifies the UI that a new version is available.
 
-        If the UI thread isn't running yet, it will be launched.
+        If the UI thread isn't running yet, it will be launched, unless
+        in headless mode (see Settings::GetHeadlessMode()).
      */
-    static void NotifyUpdateAvailable(const Appcast& info, bool installAutomatically);
+    static void NotifyUpdateAvailable(const AppcastPtr& info, bool installAutomatically);
 
     /**
         Notifies the UI about download progress.
+
+        This only stores the values, which the UI shows the next time it
+        updates the progress bar, so it's cheap to call often. Must not be
+        called from several threads at once.
      */
     static void NotifyDownloadProgress(size_t downloaded, size_t total);
 
     /**
         Notifies the UI that an update was downloaded.
      */
-    static void NotifyUpdateDownloaded(const std::wstring& updateFile, const Appcast &appcast);
+    static void NotifyUpdateDownloaded(const std::wstring& updateFile, const AppcastPtr& appcast);
 
     /**
-        Shows the WinSparkle window in "checking for updates..." state.
+        Shows the WinSparkle window in "checking for updates..." state
+        and starts the @a check thread.
+
+        If the UI thread isn't running yet, the check runs while it starts.
      */
-    static void ShowCheckingUpdates();
+    static void ShowCheckingUpdates(Thread *check);
+
+    /**
+        Prepares the UI in the background, so that showing it later is fast.
+
+        Starts the UI thread at low priority, if it isn't running yet, and
+        creates the update window hidden. Returns immediately.
+     */
+    static void Prewarm();
 
     /**
         Shows the dialog asking user for permission to check for updates.
      */
     static void AskForPermission();
 
+    /**
+        Makes the UI run on the calling thread, driven by its message loop,
+        instead of a thread of its own.
+
+        Called by win_sparkle_init() if Settings::GetUIOnHostThread() is set.
+        ShutDown() must then be called on the same thread.
+     */
+    static void AttachToHostThread();
+
     /**
         Sets HINSTANCE of the DLL.
 
@@ -117,8 +152,14 @@ protected:
     virtual void Run();
     virtual bool IsJoinable() const { return true; }
 
+    // wx must be initialized before the UI thread can be used
+    virtual bool IsStartSynchronous() const { return true; }
+
 private:
-    UI();
+    explicit UI(bool lowPriority);
+
+    // initialize at low priority, see Prewarm()
+    bool m_lowPriority;
 
     static HINSTANCE ms_hInstance;
 
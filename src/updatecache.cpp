@@ -0,0 +1,544 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "updatecache.h"
+
+#include "appcast.h"
+#include "error.h"
+#include "hashengine.h"
+#include "settings.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include <windows.h>
+#include <shlobj.h>
+#include <sddl.h>
+
+namespace winsparkle
+{
+
+namespace
+{
+
+// The cache is trimmed to this size, except for the most recent file,
+// which is always kept.
+const ULONGLONG UPDATE_CACHE_MAX_SIZE = ULONGLONG(1024) * 1024 * 1024;
+
+// Every cached file is in a directory of its own, named after its key, with
+// this marker file next to it. The marker holds the size of the file when it
+// was verified and, on the next line, the version of the update (if known);
+// it is written last, so incomplete entries are easy to tell. Its
+// modification time records when the entry was last used.
+#define VERIFIED_MARKER L".verified"
+
+std::string ToHex(const std::string& data)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(data.size() * 2);
+    for ( size_t i = 0; i < data.size(); i++ )
+    {
+        const unsigned char c = static_cast<unsigned char>(data[i]);
+        hex += digits[c >> 4];
+        hex += digits[c & 0xF];
+    }
+    return hex;
+}
+
+// Returns the name of the cache directory, different for every app using
+// WinSparkle.
+std::wstring GetCacheDirectoryName()
+{
+    const std::string app = Settings::GetRegistryPath();
+    const std::string appHash = HashEngine::HashData(Hash_SHA1, app.data(), app.size());
+    return L"UpdateCache-" + AnsiToWide(ToHex(appHash.substr(0, 8)));
+}
+
+// Returns the cache directory, shared by all instances of the app, but not
+// by other apps using WinSparkle. It's next to the downloads, so that they
+// can be moved into it without copying.
+std::wstring GetCacheDirectory()
+{
+    return Settings::GetStagingDirectory() + GetCacheDirectoryName();
+}
+
+
+// Files in the shared cache that weren't shared again for this long are
+// removed, the updates are likely superseded by then.
+const ULONGLONG SHARED_CACHE_MAX_AGE = ULONGLONG(30) * 24 * 60 * 60 * 10000000; // 30 days in FILETIME units
+
+// Access to the shared cache's directories: full for the system and
+// administrators, while users can only list them, read the files and add
+// new ones. Whoever adds a file owns it and can remove it again.
+const wchar_t SHARED_CACHE_SDDL[] =
+    L"D:P(A;OICI;FA;;;SY)(A;OICI;FA;;;BA)(A;;0x1200af;;;BU)(A;OICIIO;FR;;;BU)(A;OICIIO;FA;;;CO)";
+
+// Is @a path a real directory, not a link to somewhere else? Anybody could
+// have created the shared directories, don't let them redirect the writes.
+bool IsPlainDirectory(const std::wstring& path)
+{
+    const DWORD attrs = GetFileAttributesW(path.c_str());
+    return attrs != INVALID_FILE_ATTRIBUTES &&
+           (attrs & FILE_ATTRIBUTE_DIRECTORY) &&
+           !(attrs & FILE_ATTRIBUTE_REPARSE_POINT);
+}
+
+// Creates directory of the shared cache, if it doesn't exist yet.
+void CreateSharedDirectory(const std::wstring& path)
+{
+    if ( GetFileAttributesW(path.c_str()) != INVALID_FILE_ATTRIBUTES )
+        return;
+
+    PSECURITY_DESCRIPTOR sd = NULL;
+    if ( !ConvertStringSecurityDescriptorToSecurityDescriptorW(SHARED_CACHE_SDDL, SDDL_REVISION_1, &sd, NULL) )
+        throw Win32Exception("Cannot create shared update cache directory");
+
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), sd, FALSE };
+    const BOOL created = CreateDirectoryW(path.c_str(), &sa);
+    const DWORD err = GetLastError();
+    LocalFree(sd);
+    if ( !created && err != ERROR_ALREADY_EXISTS )
+    {
+        SetLastError(err);
+        throw Win32Exception("Cannot create shared update cache directory");
+    }
+}
+
+// Returns the cache directory shared by all users of the app on this
+// computer, creating it if @a create is true. Returns empty string if it
+// doesn't exist or isn't safe to use.
+std::wstring GetSharedCacheDirectory(bool create)
+{
+    wchar_t appdata[MAX_PATH];
+    if ( FAILED(SHGetFolderPathW(NULL, CSIDL_COMMON_APPDATA, NULL, SHGFP_TYPE_CURRENT, appdata)) )
+        throw std::runtime_error("Cannot determine the shared application data directory");
+
+    const std::wstring parent = std::wstring(appdata) + L"\\WinSparkle";
+    const std::wstring dir = parent + L"\\" + GetCacheDirectoryName();
+    if ( create )
+    {
+        CreateSharedDirectory(parent);
+        CreateSharedDirectory(dir);
+    }
+
+    if ( !IsPlainDirectory(parent) || !IsPlainDirectory(dir) )
+        return std::wstring();
+    return dir;
+}
+
+// Removes files in the shared cache that weren't shared recently. Only those
+// added by this user can be removed, others are left to their owners.
+void TrimSharedCache(const std::wstring& dir)
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    ULARGE_INTEGER nowValue;
+    nowValue.LowPart = now.dwLowDateTime;
+    nowValue.HighPart = now.dwHighDateTime;
+
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((dir + L"\\*").c_str(), &data);
+    if ( h == INVALID_HANDLE_VALUE )
+        return;
+    do
+    {
+        if ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+            continue;
+        ULARGE_INTEGER written;
+        written.LowPart = data.ftLastWriteTime.dwLowDateTime;
+        written.HighPart = data.ftLastWriteTime.dwHighDateTime;
+        if ( nowValue.QuadPart > written.QuadPart &&
+             nowValue.QuadPart - written.QuadPart > SHARED_CACHE_MAX_AGE )
+        {
+            DeleteFile((dir + L"\\" + data.cFileName).c_str());
+        }
+    } while ( FindNextFile(h, &data) );
+    FindClose(h);
+}
+
+// Suffix of files in the shared cache that are still being copied in.
+const wchar_t SHARED_PARTIAL_SUFFIX[] = L".partial";
+
+bool IsSharedPartialFile(const std::wstring& name)
+{
+    const size_t len = wcslen(SHARED_PARTIAL_SUFFIX);
+    return name.length() > len &&
+           name.compare(name.length() - len, len, SHARED_PARTIAL_SUFFIX) == 0;
+}
+
+ULONGLONG FindFileSize(const WIN32_FIND_DATA& data)
+{
+    ULARGE_INTEGER size;
+    size.LowPart = data.nFileSizeLow;
+    size.HighPart = data.nFileSizeHigh;
+    return size.QuadPart;
+}
+
+// Finds the update file in an entry's directory, returns its name or empty
+// string.
+std::wstring FindEntryFile(const std::wstring& entry, ULONGLONG& size)
+{
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((entry + L"\\*").c_str(), &data);
+    if ( h == INVALID_HANDLE_VALUE )
+        return std::wstring();
+
+    std::wstring name;
+    do
+    {
+        if ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+            continue;
+        if ( wcscmp(data.cFileName, VERIFIED_MARKER) == 0 )
+            continue;
+        name = data.cFileName;
+        size = FindFileSize(data);
+        break;
+    } while ( FindNextFile(h, &data) );
+
+    FindClose(h);
+    return name;
+}
+
+// Writes the marker; this also marks the entry as recently used.
+void WriteMarker(const std::wstring& entry, ULONGLONG size, const std::string& version)
+{
+    HANDLE f = CreateFileW((entry + L"\\" VERIFIED_MARKER).c_str(),
+                           GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( f == INVALID_HANDLE_VALUE )
+        throw Win32Exception("Cannot write to update cache");
+
+    std::ostringstream ss;
+    ss << size << "\n" << version;
+    const std::string buf = ss.str();
+    DWORD written = 0;
+    const BOOL ok = WriteFile(f, buf.data(), DWORD(buf.size()), &written, NULL);
+    CloseHandle(f);
+
+    if ( !ok || written != DWORD(buf.size()) )
+        throw Win32Exception("Cannot write to update cache");
+}
+
+// Reads the size and version recorded in the marker, returns false if
+// there's none.
+bool ReadMarker(const std::wstring& entry, ULONGLONG& size, std::string *version = NULL)
+{
+    HANDLE f = CreateFileW((entry + L"\\" VERIFIED_MARKER).c_str(),
+                           GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( f == INVALID_HANDLE_VALUE )
+        return false;
+
+    char buf[256];
+    DWORD read = 0;
+    const BOOL ok = ReadFile(f, buf, sizeof(buf) - 1, &read, NULL);
+    CloseHandle(f);
+
+    if ( !ok || read == 0 )
+        return false;
+    buf[read] = '\0';
+    char *end;
+    size = _strtoui64(buf, &end, 10);
+    if ( version )
+    {
+        if ( *end == '\n' )
+            version->assign(end + 1);
+        else
+            version->clear();
+    }
+    return true;
+}
+
+// Removes the entry's directory, including the update's components kept in
+// its subdirectory, if any.
+void RemoveEntry(const std::wstring& entry)
+{
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((entry + L"\\*").c_str(), &data);
+    if ( h != INVALID_HANDLE_VALUE )
+    {
+        do
+        {
+            const std::wstring path = entry + L"\\" + data.cFileName;
+            if ( !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) )
+                DeleteFile(path.c_str());
+            else if ( wcscmp(data.cFileName, L".") != 0 && wcscmp(data.cFileName, L"..") != 0 &&
+                      !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) )
+                RemoveEntry(path);
+        } while ( FindNextFile(h, &data) );
+        FindClose(h);
+    }
+    RemoveDirectory(entry.c_str());
+}
+
+struct CacheEntry
+{
+    std::wstring dir;
+    ULONGLONG size;
+    FILETIME lastUsed;
+
+    bool operator<(const CacheEntry& other) const
+    {
+        // most recently used first
+        return CompareFileTime(&lastUsed, &other.lastUsed) > 0;
+    }
+};
+
+// Removes least recently used entries that don't fit in the size limit.
+void TrimCache(const std::wstring& cacheDir)
+{
+    std::vector<CacheEntry> entries;
+
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((cacheDir + L"\\*").c_str(), &data);
+    if ( h == INVALID_HANDLE_VALUE )
+        return;
+    do
+    {
+        if ( !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+             wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0 )
+            continue;
+
+        CacheEntry e;
+        e.dir = cacheDir + L"\\" + data.cFileName;
+
+        WIN32_FIND_DATA marker;
+        HANDLE hm = FindFirstFile((e.dir + L"\\" VERIFIED_MARKER).c_str(), &marker);
+        if ( hm == INVALID_HANDLE_VALUE || !ReadMarker(e.dir, e.size) )
+        {
+            if ( hm != INVALID_HANDLE_VALUE )
+                FindClose(hm);
+            RemoveEntry(e.dir); // incomplete
+            continue;
+        }
+        FindClose(hm);
+
+        e.lastUsed = marker.ftLastWriteTime;
+        entries.push_back(e);
+    } while ( FindNextFile(h, &data) );
+    FindClose(h);
+
+    std::sort(entries.begin(), entries.end());
+
+    ULONGLONG total = 0;
+    for ( size_t i = 0; i < entries.size(); i++ )
+    {
+        total += entries[i].size;
+        if ( i > 0 && total > UPDATE_CACHE_MAX_SIZE )
+            RemoveEntry(entries[i].dir);
+    }
+}
+
+} // anonymous namespace
+
+
+std::string UpdateCache::GetKey(const Appcast& appcast)
+{
+    // use the signature that will be verified, see UpdateDownloader::Run()
+    std::string signature;
+    if ( Settings::HasEdDSAPubKey() )
+    {
+        if ( !appcast.EdDSAChunkedSignature.empty() )
+            signature = "edchunked:" + appcast.EdDSAChunkedSignature;
+        else if ( !appcast.EdDSASignature.empty() )
+            signature = "ed:" + appcast.EdDSASignature;
+    }
+    else if ( Settings::HasDSAPubKey() )
+    {
+        if ( !appcast.DsaSignature.empty() )
+            signature = "dsa:" + appcast.DsaSignature;
+    }
+
+    if ( signature.empty() )
+        return std::string();
+
+    return ToHex(HashEngine::HashData(Hash_SHA256, signature.data(), signature.size()));
+}
+
+
+std::wstring UpdateCache::Find(const std::string& key)
+{
+    const std::wstring entry = GetCacheDirectory() + L"\\" + AnsiToWide(key);
+
+    ULONGLONG verifiedSize;
+    std::string version;
+    if ( !ReadMarker(entry, verifiedSize, &version) )
+        return std::wstring();
+
+    ULONGLONG size = 0;
+    const std::wstring name = FindEntryFile(entry, size);
+    if ( name.empty() || size != verifiedSize )
+    {
+        // the file was tampered with or removed
+        RemoveEntry(entry);
+        return std::wstring();
+    }
+
+    WriteMarker(entry, size, version);
+    return entry + L"\\" + name;
+}
+
+
+std::wstring UpdateCache::FindVersion(const std::string& version)
+{
+    if ( version.empty() )
+        return std::wstring();
+
+    const std::wstring cacheDir = GetCacheDirectory();
+
+    // there may be several files of the same version, use the newest one
+    std::string key;
+    FILETIME lastUsed = { 0, 0 };
+
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((cacheDir + L"\\*").c_str(), &data);
+    if ( h == INVALID_HANDLE_VALUE )
+        return std::wstring();
+    do
+    {
+        if ( !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+             wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0 )
+            continue;
+
+        const std::wstring entry = cacheDir + L"\\" + data.cFileName;
+        ULONGLONG size;
+        std::string entryVersion;
+        if ( !ReadMarker(entry, size, &entryVersion) || entryVersion != version )
+            continue;
+
+        WIN32_FIND_DATA marker;
+        HANDLE hm = FindFirstFile((entry + L"\\" VERIFIED_MARKER).c_str(), &marker);
+        if ( hm == INVALID_HANDLE_VALUE )
+            continue;
+        FindClose(hm);
+
+        if ( key.empty() || CompareFileTime(&marker.ftLastWriteTime, &lastUsed) > 0 )
+        {
+            key = WideToAnsi(data.cFileName);
+            lastUsed = marker.ftLastWriteTime;
+        }
+    } while ( FindNextFile(h, &data) );
+    FindClose(h);
+
+    // this also checks the file is still intact
+    return key.empty() ? std::wstring() : Find(key);
+}
+
+
+std::wstring UpdateCache::Store(const std::string& key,
+                                const std::wstring& path,
+                                const std::string& version)
+{
+    const std::wstring cacheDir = GetCacheDirectory();
+    if ( !CreateDirectory(cacheDir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS )
+        throw Win32Exception("Cannot create update cache directory");
+
+    const std::wstring entry = cacheDir + L"\\" + AnsiToWide(key);
+    RemoveEntry(entry);
+    if ( !CreateDirectory(entry.c_str(), NULL) )
+        throw Win32Exception("Cannot create update cache directory");
+
+    const std::wstring newPath = entry + path.substr(path.find_last_of(L'\\'));
+
+    // both are in the staging directory, so this is normally just a rename
+    if ( !MoveFileEx(path.c_str(), newPath.c_str(), MOVEFILE_COPY_ALLOWED) )
+    {
+        RemoveEntry(entry);
+        throw Win32Exception("Cannot move update file to cache");
+    }
+
+    ULONGLONG size = 0;
+    FindEntryFile(entry, size);
+    WriteMarker(entry, size, version);
+
+    TrimCache(cacheDir);
+
+    return newPath;
+}
+
+
+std::wstring UpdateCache::FindShared(const std::string& key, std::wstring& name)
+{
+    const std::wstring dir = GetSharedCacheDirectory(false);
+    if ( dir.empty() )
+        return std::wstring();
+
+    // files are named after their key, followed by their original name
+    const std::wstring prefix = AnsiToWide(key) + L"-";
+
+    std::wstring path;
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((dir + L"\\" + prefix + L"*").c_str(), &data);
+    if ( h == INVALID_HANDLE_VALUE )
+        return std::wstring();
+    do
+    {
+        const std::wstring fn(data.cFileName);
+        if ( (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+             fn.length() <= prefix.length() || IsSharedPartialFile(fn) )
+            continue;
+        name = fn.substr(prefix.length());
+        path = dir + L"\\" + fn;
+        break;
+    } while ( FindNextFile(h, &data) );
+    FindClose(h);
+
+    return path;
+}
+
+
+void UpdateCache::StoreShared(const std::string& key, const std::wstring& path)
+{
+    const std::wstring dir = GetSharedCacheDirectory(true);
+    if ( dir.empty() )
+        throw std::runtime_error("Shared update cache directory is not safe to use.");
+
+    const std::wstring name = path.substr(path.find_last_of(L'\\') + 1);
+    const std::wstring target = dir + L"\\" + AnsiToWide(key) + L"-" + name;
+    if ( GetFileAttributesW(target.c_str()) != INVALID_FILE_ATTRIBUTES )
+        return; // somebody shared it already
+
+    // copy under another name first, so that nobody uses it half-written;
+    // the copy gets the directory's permissions, not those of the original
+    const std::wstring tmp = target + SHARED_PARTIAL_SUFFIX;
+    if ( !CopyFileW(path.c_str(), tmp.c_str(), TRUE) )
+        throw Win32Exception("Cannot copy update file to shared cache");
+    if ( !MoveFileExW(tmp.c_str(), target.c_str(), 0) )
+    {
+        const DWORD err = GetLastError();
+        DeleteFileW(tmp.c_str());
+        if ( err == ERROR_ALREADY_EXISTS )
+            return;
+        SetLastError(err);
+        throw Win32Exception("Cannot copy update file to shared cache");
+    }
+
+    TrimSharedCache(dir);
+}
+
+} // namespace winsparkle
@@ -0,0 +1,119 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _updatecache_h_
+#define _updatecache_h_
+
+#include <string>
+
+namespace winsparkle
+{
+
+struct Appcast;
+
+/**
+    Persistent cache of downloaded and verified update files.
+
+    Files are keyed by the signature they were verified with, so a cached
+    file is only ever used for the very same update. This lets a download
+    that wasn't installed right away (e.g. the user postponed it, or the
+    app was restarted) be used again without downloading it anew.
+
+    The cache lives in the staging directory (see
+    Settings::GetStagingDirectory()) and is limited in size; the least
+    recently used files are removed when it grows too big.
+
+    Optionally, verified files are also shared with the other users of the
+    computer (see Settings::GetSharedUpdateCache()), e.g. on terminal
+    servers, through a directory in ProgramData that any user can add
+    files to. Files from there are never trusted, they are copied and
+    verified again by every user.
+ */
+class UpdateCache
+{
+public:
+    /**
+        Returns the cache key of @a appcast's update file.
+
+        The key is empty if the update isn't signed with a key WinSparkle
+        is configured to verify, such files are never cached.
+     */
+    static std::string GetKey(const Appcast& appcast);
+
+    /**
+        Looks up an update file stored under @a key.
+
+        @return Path to the file, or empty string if it's not in the cache.
+     */
+    static std::wstring Find(const std::string& key);
+
+    /**
+        Looks up the newest update file of given @a version.
+
+        This is used to find the installer of the installed version, to
+        apply a delta update to. Throws on error.
+
+        @return Path to the file, or empty string if it's not in the cache.
+     */
+    static std::wstring FindVersion(const std::string& version);
+
+    /**
+        Moves a verified update file of @a version into the cache.
+
+        Throws on error.
+
+        @return New path of the file.
+     */
+    static std::wstring Store(const std::string& key,
+                              const std::wstring& path,
+                              const std::string& version);
+
+    /**
+        Looks up an update file stored under @a key in the cache shared by
+        all users of the computer.
+
+        The file may have been put there by anyone, it must be copied
+        elsewhere and verified before it's used. Throws on error.
+
+        @param key   Cache key of the update, see GetKey().
+        @param name  Receives the original name of the file.
+
+        @return Path to the file, or empty string if it's not there.
+     */
+    static std::wstring FindShared(const std::string& key, std::wstring& name);
+
+    /**
+        Puts a copy of the verified update file @a path into the cache
+        shared by all users of the computer, unless another user did
+        already.
+
+        Throws on error.
+     */
+    static void StoreShared(const std::string& key, const std::wstring& path);
+};
+
+} // namespace winsparkle
+
+#endif // _updatecache_h_
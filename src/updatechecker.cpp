@@ -25,17 +25,39 @@
  */
 
 #include "updatechecker.h"
+#include "updatedownloader.h"
+#include "updatescheduler.h"
+#include "updatejournal.h"
 #include "appcast.h"
+#include "binaryappcast.h"
+#include "appcontroller.h"
 #include "ui.h"
 #include "error.h"
+#include "logger.h"
 #include "settings.h"
+#include "serviceagent.h"
 #include "download.h"
+#include "databudget.h"
+#include "pipelinestatus.h"
+#include "signatureverifier.h"
+#include "stats.h"
+#include "telemetry.h"
+#include "allocstats.h"
+#include "trace.h"
 #include "utils.h"
+#include "versionkey.h"
+// for its compile-time checks of the comparison rules
+#include "versioncompare.h"
 
 #include <ctime>
 #include <vector>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <sstream>
 #include <algorithm>
+#include <memory>
+#include <exception>
 #include <winsparkle.h>
 
 using namespace std;
@@ -47,297 +69,1890 @@ namespace winsparkle
                               version comparison
  *--------------------------------------------------------------------------*/
 
-// Note: This code is based on Sparkle's SUStandardVersionComparator by
-//       Andy Matuschak.
+int UpdateChecker::CompareVersions(const string& verA, const string& verB)
+{
+    // Not CompareVersionStrings(): its recursion depth grows with the length
+    // of the versions, which come from the appcast.
+    return VersionKey(verA).Compare(VersionKey(verB));
+}
+
+
+/*--------------------------------------------------------------------------*
+                              appcast caching
+ *--------------------------------------------------------------------------*/
 
 namespace
 {
 
-// String characters classification. Valid components of version numbers
-// are numbers, period or string fragments ("beta" etc.).
-enum CharType
-{
-    Type_Number,
-    Type_Period,
-    Type_String
-};
+/*
+    Snapshot of the last parsed appcast, stored as a single binary value, so
+    that it's always written (or not) as a whole.
 
-CharType ClassifyChar(char c)
-{
-    if ( c == '.' )
-        return Type_Period;
-    else if ( c >= '0' && c <= '9' )
-        return Type_Number;
-    else
-        return Type_String;
-}
+    The format is a version number followed by the feed's URL, ETag and
+    Last-Modified values, its verified signature (if it was signed), the app
+    version the delta update was selected for, the update channels the
+    update was selected from, the feed's revision (see
+    AppcastDownloadSink::GetRequestURL()) and the selected update as a BinaryAppcast
+    with a single item, each stored as 32-bit length followed by the data,
+    and finally the size of the feed as a 32-bit number. Increment
+    CACHED_APPCAST_FORMAT whenever this changes, older snapshots are then
+    ignored; new Appcast fields don't need that, see BinaryAppcast.
+ */
+#define CACHED_APPCAST_VALUE "CachedAppcast"
+const unsigned CACHED_APPCAST_FORMAT = 18;
 
-// Split version string into individual components. A component is continuous
-// run of characters with the same classification. For example, "1.20rc3" would
-// be split into ["1",".","20","rc","3"].
-vector<string> SplitVersionString(const string& version)
+struct CachedAppcast
 {
-    vector<string> list;
+    CachedAppcast() : feedSize(0) {}
 
-    if ( version.empty() )
-        return list; // nothing to do here
+    std::string url, etag, lastModified, signature, installedVersion, channels, revision;
+    Appcast appcast;
+    // bytes downloaded, for statistics
+    unsigned feedSize;
 
-    string s;
-    const size_t len = version.length();
+    bool Load()
+    {
+        std::string data;
+        if ( !Settings::ReadConfigBlob(CACHED_APPCAST_VALUE, data) )
+            return false;
 
-    s = version[0];
-    CharType prevType = ClassifyChar(version[0]);
+        size_t pos = 0;
+        unsigned format;
+        if ( !ReadUInt32(data, pos, format) || format != CACHED_APPCAST_FORMAT )
+            return false;
 
-    for ( size_t i = 1; i < len; i++ )
-    {
-        const char c = version[i];
-        const CharType newType = ClassifyChar(c);
+        if ( !ReadString(data, pos, url) ||
+             !ReadString(data, pos, etag) ||
+             !ReadString(data, pos, lastModified) ||
+             !ReadString(data, pos, signature) ||
+             !ReadString(data, pos, installedVersion) ||
+             !ReadString(data, pos, channels) ||
+             !ReadString(data, pos, revision) )
+            return false;
 
-        if ( prevType != newType || prevType == Type_Period )
+        unsigned len;
+        if ( !ReadUInt32(data, pos, len) || data.size() - pos < len ||
+             !BinaryAppcast::IsBinaryAppcast(data.data() + pos, len) )
+            return false;
+        try
         {
-            // We reached a new segment. Period gets special treatment,
-            // because "." always delimiters components in version strings
-            // (and so ".." means there's empty component value).
-            list.push_back(s);
-            s = c;
+            // used in place, it's only copied to the Appcast
+            const BinaryAppcast snapshot(data.data() + pos, len);
+            if ( snapshot.GetItemCount() != 1 )
+                return false;
+            appcast = snapshot.GetItem(0);
         }
-        else
+        catch ( const std::exception& )
         {
-            // Add character to current segment and continue.
-            s += c;
+            return false;
         }
+        pos += len;
+
+        if ( !ReadUInt32(data, pos, feedSize) )
+            return false;
 
-        prevType = newType;
+        return pos == data.size();
     }
 
-    // Don't forget to add the last part:
-    list.push_back(s);
+    void Save() const
+    {
+        std::string data;
+        WriteUInt32(data, CACHED_APPCAST_FORMAT);
+        WriteString(data, url);
+        WriteString(data, etag);
+        WriteString(data, lastModified);
+        WriteString(data, signature);
+        WriteString(data, installedVersion);
+        WriteString(data, channels);
+        WriteString(data, revision);
+        AppcastChannel snapshot;
+        snapshot.SetKeepAllDescriptions();
+        snapshot.SetCheckInterval(appcast.CheckInterval);
+        snapshot.AddItem(appcast);
+        WriteString(data, BinaryAppcast::Write(snapshot));
+        WriteUInt32(data, feedSize);
 
-    return list;
-}
+        Settings::WriteConfigBlob(CACHED_APPCAST_VALUE, data);
+    }
 
-} // anonymous namespace
+    static void Forget()
+    {
+        Settings::DeleteConfigValue(CACHED_APPCAST_VALUE);
+    }
 
+private:
+    static void WriteUInt32(std::string& data, unsigned value)
+    {
+        const unsigned char bytes[4] =
+        {
+            (unsigned char)(value & 0xFF), (unsigned char)((value >> 8) & 0xFF),
+            (unsigned char)((value >> 16) & 0xFF), (unsigned char)((value >> 24) & 0xFF)
+        };
+        data.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    }
 
-int UpdateChecker::CompareVersions(const string& verA, const string& verB)
-{
-    const vector<string> partsA = SplitVersionString(verA);
-    const vector<string> partsB = SplitVersionString(verB);
+    static void WriteString(std::string& data, const std::string& value)
+    {
+        WriteUInt32(data, (unsigned)value.size());
+        data.append(value);
+    }
+
+    static bool ReadUInt32(const std::string& data, size_t& pos, unsigned& value)
+    {
+        if ( data.size() - pos < 4 )
+            return false;
+        const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data.data() + pos);
+        value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned)bytes[3] << 24);
+        pos += 4;
+        return true;
+    }
 
-    // Compare common length of both version strings.
-    const size_t n = min(partsA.size(), partsB.size());
-    for ( size_t i = 0; i < n; i++ )
+    static bool ReadString(const std::string& data, size_t& pos, std::string& value)
     {
-        const string& a = partsA[i];
-        const string& b = partsB[i];
+        unsigned len;
+        if ( !ReadUInt32(data, pos, len) || data.size() - pos < len )
+            return false;
+        value.assign(data, pos, len);
+        pos += len;
+        return true;
+    }
+};
 
-        const CharType typeA = ClassifyChar(a[0]);
-        const CharType typeB = ClassifyChar(b[0]);
+// Appends "&name=value" to the query, percent-encoding the value.
+void AppendQueryParameter(std::string& query, const char *name, const std::string& value)
+{
+    static const char HEX[] = "0123456789ABCDEF";
 
-        if ( typeA == typeB )
+    query.append(1, '&').append(name).append(1, '=');
+    for ( size_t i = 0; i < value.size(); i++ )
+    {
+        const unsigned char c = value[i];
+        if ( isalnum(c) || strchr("-._~", c) )
         {
-            if ( typeA == Type_String )
-            {
-                int result = a.compare(b);
-                if ( result != 0 )
-                    return result;
-            }
-            else if ( typeA == Type_Number )
-            {
-                const int intA = atoi(a.c_str());
-                const int intB = atoi(b.c_str());
-                if ( intA > intB )
-                    return 1;
-                else if ( intA < intB )
-                    return -1;
-            }
+            query.append(1, char(c));
         }
-        else // components of different types
+        else
         {
-            if ( typeA != Type_String && typeB == Type_String )
-            {
-                // 1.2.0 > 1.2rc1
-                return 1;
-            }
-            else if ( typeA == Type_String && typeB != Type_String )
-            {
-                // 1.2rc1 < 1.2.0
-                return -1;
-            }
-            else
-            {
-                // One is a number and the other is a period. The period
-                // is invalid.
-                return (typeA == Type_Number) ? 1 : -1;
-            }
+            query.append(1, '%');
+            query.append(1, HEX[c >> 4]);
+            query.append(1, HEX[c & 0xF]);
         }
     }
+}
+
+// Returns the URL with the query made by AppendQueryParameter() appended.
+std::string AppendQuery(const std::string& url, std::string query)
+{
+    // the query goes before the fragment, if any
+    const size_t end = (std::min)(url.find('#'), url.size());
+    if ( url.find('?') >= end )
+        query[0] = '?';
+    else if ( end > 0 && (url[end - 1] == '?' || url[end - 1] == '&') )
+        query.erase(0, 1);
 
-    // The versions are equal up to the point where they both still have
-    // parts. Lets check to see if one is larger than the other.
-    if ( partsA.size() == partsB.size() )
-        return 0; // the two strings are identical
+    std::string result(url, 0, end);
+    result.append(query).append(url, end, std::string::npos);
+    return result;
+}
 
-    // Lets get the next part of the larger version string
-    // Note that 'n' already holds the index of the part we want.
+// Sink for the appcast feed that parses it as it arrives, instead of keeping
+// all of it in memory first. It also makes the request conditional on the
+// feed having changed since it was last parsed.
+struct AppcastDownloadSink : public IDownloadSink
+{
+    AppcastDownloadSink(const std::string& url,
+                        const std::string& signature,
+                        const std::string& installedVersion,
+                        const std::string& channels)
+        : m_url(url), m_signature(signature), m_installedVersion(installedVersion),
+          m_channels(channels),
+          m_parser(false, installedVersion, channels),
+          m_isDelta(false),
+          m_complete(false),
+          m_parsedBytes(0), m_parseTime(0)
+    {
+        // The delta update, if any, was selected for the version installed
+        // back then, and the update for the channels used back then.
+        m_hasCached = m_cached.Load() &&
+                      m_cached.url == m_url &&
+                      m_cached.installedVersion == m_installedVersion &&
+                      m_cached.channels == m_channels;
 
-    int shorterResult, longerResult;
-    CharType missingPartType; // ('missing' as in "missing in shorter version")
+        if ( !m_signature.empty() )
+        {
+            // Verify the feed as it arrives. The signature changes whenever
+            // the feed does, so a cached copy with a different (or no)
+            // signature is useless: it doesn't match the signed feed.
+            m_verifier.reset(new EdDSAVerifier(m_signature));
+            if ( m_cached.signature != m_signature )
+                m_hasCached = false;
+        }
+    }
 
-    if ( partsA.size() > partsB.size() )
+    virtual void SetLength(size_t len)
     {
-        missingPartType = ClassifyChar(partsA[n][0]);
-        shorterResult = -1;
-        longerResult = 1;
+        CheckSize(len);
     }
-    else
+
+    virtual void SetFilename(const std::wstring&) {}
+
+    /*
+        Returns the URL to request the feed from.
+
+        A server that sends the feed's revision in the X-Sparkle-Feed-Revision
+        header is asked for the changes since the revision the cached appcast
+        was parsed from, with the sinceRevision query parameter. It may then
+        send only the items added since, with that revision in the
+        X-Sparkle-Feed-Delta-From header, which are merged with the cached
+        update. Signed feeds are always requested whole, as the signature is
+        of the whole feed.
+     */
+    std::string GetRequestURL() const
+    {
+        if ( !m_hasCached || m_cached.revision.empty() || m_verifier )
+            return m_url;
+
+        std::string query;
+        AppendQueryParameter(query, "sinceRevision", m_cached.revision);
+        return AppendQuery(m_url, query);
+    }
+
+    virtual const char *GetExtraHeaderName(size_t index) const
     {
-        missingPartType = ClassifyChar(partsB[n][0]);
-        shorterResult = 1;
-        longerResult = -1;
+        static const char *const HEADERS[] =
+        {
+            "Content-Type",             // the feed may be RSS or JSON
+            "X-Sparkle-Feed-Revision",
+            "X-Sparkle-Feed-Delta-From"
+        };
+        return index < sizeof(HEADERS) / sizeof(HEADERS[0]) ? HEADERS[index] : NULL;
     }
 
-    if ( missingPartType == Type_String )
+    virtual void SetExtraHeader(size_t index, const std::string& value)
     {
-        // 1.5 > 1.5b3
-        return shorterResult;
+        switch ( index )
+        {
+            case 0:
+                m_parser.SetFormat(AppcastParser::GetFormatFromContentType(value));
+                break;
+            case 1:
+                m_revision = value;
+                break;
+            case 2:
+                m_isDelta = m_hasCached && !m_verifier && !value.empty() && value == m_cached.revision;
+                break;
+        }
     }
-    else
+
+    virtual void Add(const void *data, size_t len)
     {
-        // 1.5.1 > 1.5
-        return longerResult;
+        CheckSize(m_parsedBytes + len);
+
+        const TraceTimer timer;
+        if ( m_verifier )
+            m_verifier->Update(data, len);
+        m_complete = !m_parser.Feed(data, len);
+        m_parsedBytes += len;
+        m_parseTime += timer.GetMicroseconds();
     }
-}
 
+    // Stop downloading the feed once a suitable item was found, the rest of
+    // it is usually just the history of older releases. A signed feed must
+    // be downloaded whole, though.
+    virtual bool IsComplete() const { return m_complete && !m_verifier; }
 
-/*--------------------------------------------------------------------------*
-                             UpdateChecker::Run()
- *--------------------------------------------------------------------------*/
+    // Returns the update parsed from the downloaded feed. Throws
+    // BadSignatureException if the feed doesn't match its signature.
+    Appcast GetAppcast()
+    {
+        const TraceTimer timer;
+        if ( m_verifier )
+            m_verifier->Verify();
+        Appcast appcast = m_parser.Finish();
+        if ( m_isDelta )
+            appcast = MergeWithCached();
+        m_parseTime += timer.GetMicroseconds();
 
-UpdateChecker::UpdateChecker(): Thread("WinSparkle updates check")
-{
-}
+        TraceEvent("AppcastParsed")
+            .Field("Bytes", m_parsedBytes)
+            .Field("Items", m_parser.GetChannel().GetItemCount())
+            .Field("ParseUs", m_parseTime)
+            .Field("Signed", m_verifier ? 1u : 0u)
+            .Field("Delta", m_isDelta ? 1u : 0u)
+            .Write();
+        return appcast;
+    }
 
-void UpdateChecker::PerformUpdateCheck()
-{
-    try
+    virtual void SetTimings(const DownloadTimings& timings) { m_timings = timings; }
+
+    // Returns time spent parsing the feed in milliseconds
+    unsigned GetParseTime() const { return unsigned(m_parseTime / 1000); }
+
+    const DownloadTimings& GetTimings() const { return m_timings; }
+
+    virtual bool GetCachedVersion(std::string& etag, std::string& lastModified) const
     {
-        const std::string url = Settings::GetAppcastURL();
-        if ( url.empty() )
-            throw std::runtime_error("Appcast URL not specified.");
-        CheckForInsecureURL(url, "appcast feed");
+        if ( !m_hasCached )
+            return false;
 
-        StringDownloadSink appcast_xml;
-        DownloadFile(url, &appcast_xml, this, Download_BypassProxies);
+        etag = m_cached.etag;
+        lastModified = m_cached.lastModified;
+        return !etag.empty() || !lastModified.empty();
+    }
 
-        Appcast appcast = Appcast::Load(appcast_xml.data);
-        if (!appcast.ReleaseNotesURL.empty())
-            CheckForInsecureURL(appcast.ReleaseNotesURL, "release notes");
-        if (!appcast.DownloadURL.empty())
-            CheckForInsecureURL(appcast.DownloadURL, "update file");
+    virtual void SetCacheValidators(const std::string& etag, const std::string& lastModified)
+    {
+        m_etag = etag;
+        m_lastModified = lastModified;
+    }
 
-        Settings::WriteConfigValue("LastCheckTime", time(NULL));
+    // Is there an appcast parsed after the last download of the feed?
+    bool HasCachedAppcast() const { return m_hasCached; }
 
-        const std::string currentVersion =
-                WideToAnsi(Settings::GetAppBuildVersion());
+    // Returns the appcast parsed after the last download of the feed
+    Appcast GetCachedAppcast() const
+    {
+        Stats::AddBytesSavedByCache(m_cached.feedSize);
+        return m_cached.appcast;
+    }
 
-        // Check if our version is out of date.
-        if ( !appcast.IsValid() || CompareVersions(currentVersion, appcast.Version) >= 0 )
+    // Remembers the appcast parsed from the downloaded data, together with
+    // the validators needed to check if it changed.
+    void SaveCachedAppcast(const Appcast& appcast) const
+    {
+        if ( m_etag.empty() && m_lastModified.empty() && m_revision.empty() )
         {
-            // The same or newer version is already installed.
-            UI::NotifyNoUpdates(ShouldAutomaticallyInstall());
+            // the server doesn't support conditional or delta requests
+            CachedAppcast::Forget();
             return;
         }
 
-        // Check if the user opted to ignore this particular version.
-        if ( ShouldSkipUpdate(appcast) )
-        {
-            UI::NotifyNoUpdates(ShouldAutomaticallyInstall());
-            return;
-        }
+        CachedAppcast cached;
+        cached.url = m_url;
+        cached.etag = m_etag;
+        cached.lastModified = m_lastModified;
+        cached.signature = m_signature;
+        cached.installedVersion = m_installedVersion;
+        cached.channels = m_channels;
+        cached.revision = m_revision;
+        cached.appcast = appcast;
+        cached.feedSize = unsigned(m_parsedBytes);
+        cached.Save();
+    }
 
-        UI::NotifyUpdateAvailable(appcast, ShouldAutomaticallyInstall());
+private:
+    // Returns the update selected from the items of the delta feed, which
+    // are all newer, followed by the cached update.
+    Appcast MergeWithCached() const
+    {
+        AppcastChannel merged = m_parser.GetChannel();
+        if ( merged.GetCheckInterval().empty() )
+            merged.SetCheckInterval(m_cached.appcast.CheckInterval);
+        if ( m_cached.appcast.IsValid() )
+            merged.AddItem(m_cached.appcast);
+        return merged.GetUpdate();
     }
-    catch ( ... )
+
+    static void CheckSize(size_t size)
     {
-        UI::NotifyUpdateError();
-        throw;
+        const size_t maxSize = Settings::GetMaxAppcastSize();
+        if ( maxSize && size > maxSize )
+            throw std::runtime_error("Appcast feed is too large.");
+    }
+
+    std::string m_url;
+    std::string m_signature;
+    std::string m_installedVersion;
+    std::string m_channels;
+    AppcastParser m_parser;
+    std::string m_etag, m_lastModified, m_revision;
+    CachedAppcast m_cached;
+    bool m_hasCached;
+    bool m_isDelta;
+    std::unique_ptr<EdDSAVerifier> m_verifier;
+    bool m_complete;
+    size_t m_parsedBytes;
+    unsigned long long m_parseTime;
+    DownloadTimings m_timings;
+};
+
+
+/*--------------------------------------------------------------------------*
+                          hedged appcast requests
+ *--------------------------------------------------------------------------*/
+
+// How long the whole check may spend downloading:
+const unsigned CHECK_DEADLINE = 120000;
+
+// How long to wait for the feed's server to respond before requesting the
+// feed from the next URL too, if there isn't enough history to tell:
+const DWORD DEFAULT_HEDGE_DELAY = 2000;
+// ...and the range the delay based on the history is kept within:
+const DWORD MIN_HEDGE_DELAY = 250;
+const DWORD MAX_HEDGE_DELAY = 10000;
+
+// Number of the main URL's response times kept for computing the delay,
+// and how many are needed before they are used:
+const size_t HEDGE_HISTORY_SIZE = 20;
+const size_t HEDGE_HISTORY_MIN = 5;
+
+#define HEDGE_HISTORY_VALUE "AppcastResponseTimes"
+
+std::vector<DWORD> LoadResponseTimes()
+{
+    std::vector<DWORD> times;
+    std::string list;
+    if ( Settings::ReadConfigValue(HEDGE_HISTORY_VALUE, list) )
+    {
+        std::istringstream in(list);
+        DWORD t;
+        while ( times.size() < HEDGE_HISTORY_SIZE && in >> t )
+            times.push_back(t);
     }
+    return times;
 }
 
-bool UpdateChecker::ShouldSkipUpdate(const Appcast& appcast) const
+// Remembers how long it took the main URL's server to respond.
+void RecordResponseTime(DWORD time)
 {
-    std::string toSkip;
-    if ( Settings::ReadConfigValue("SkipThisVersion", toSkip) )
+    std::vector<DWORD> times = LoadResponseTimes();
+    if ( times.size() == HEDGE_HISTORY_SIZE )
+        times.erase(times.begin());
+    times.push_back(time);
+
+    std::ostringstream out;
+    for ( size_t i = 0; i < times.size(); i++ )
+        out << (i ? " " : "") << times[i];
+    Settings::WriteConfigValue(HEDGE_HISTORY_VALUE, out.str());
+}
+
+// Returns how long to wait for a response before asking the next server:
+// the 95th percentile of the recent response times of the main URL.
+DWORD GetHedgeDelay()
+{
+    std::vector<DWORD> times = LoadResponseTimes();
+    if ( times.size() < HEDGE_HISTORY_MIN )
+        return DEFAULT_HEDGE_DELAY;
+
+    std::sort(times.begin(), times.end());
+    const DWORD p95 = times[(times.size() * 95 + 99) / 100 - 1];
+    return (std::max)(MIN_HEDGE_DELAY, (std::min)(p95, MAX_HEDGE_DELAY));
+}
+
+
+// AppcastDownloadSink that tells when the server responded.
+struct HedgedAppcastSink : public AppcastDownloadSink
+{
+    HedgedAppcastSink(const std::string& url,
+                      const std::string& signature,
+                      Event& changed)
+        : AppcastDownloadSink(url, signature,
+                              Settings::GetAppBuildVersionUTF8(),
+                              Settings::GetUpdateChannels()),
+          responded(0), respondedAt(0), m_changed(changed)
     {
-        return toSkip == appcast.Version;
     }
-    else
+
+    // called once the response headers of a (modified) feed arrived
+    virtual void SetFilename(const std::wstring&)
     {
-        return false;
+        respondedAt = GetTickCount();
+        if ( InterlockedExchange(&responded, 1) == 0 )
+            m_changed.Signal();
     }
-}
 
+    volatile LONG responded;
+    DWORD respondedAt;
 
-void PeriodicUpdateChecker::Run()
+private:
+    Event& m_changed;
+};
+
+
+// Downloads the appcast feed from one of its URLs.
+class FeedRequest : public Thread
 {
-    // no initialization to do, so signal readiness immediately
-    SignalReady();
+public:
+    FeedRequest(const std::string& url, const std::string& signature, Event& changed)
+        : Thread("WinSparkle appcast request"),
+          m_url(url), m_sink(url, signature, changed), m_changed(changed),
+          m_deadline(DownloadDeadline::GetRemaining()),
+          m_started(false), m_finished(0),
+          m_startTime(0), m_responseTime(0)
+    {
+    }
+
+    ~FeedRequest()
+    {
+        if ( m_started )
+            TerminateAndJoin();
+    }
+
+    const std::string& GetURL() const { return m_url; }
+    AppcastDownloadSink& GetSink() { return m_sink; }
+
+    // Downloads the feed on @a onThread, see TryDownloadFile().
+    DownloadResult Download(Thread *onThread)
+    {
+        m_startTime = GetTickCount();
+        const DownloadResult result = TryDownloadFile(m_sink.GetRequestURL(), &m_sink, onThread,
+                                                      Download_BypassProxies | Download_Compressed);
+        // "not modified" responses finish right after the headers arrive
+        m_responseTime = (HasResponded() ? m_sink.respondedAt : GetTickCount()) - m_startTime;
+        return result;
+    }
 
-    while (true)
+    // Starts downloading the feed in the background.
+    void StartDownload()
     {
-        // time to wait for next iteration: either a reasonable default or
-        // time to next scheduled update check if checks are enabled
-        unsigned sleepTimeInSeconds = 60 * 60; // 1 hour
+        m_started = true;
+        Start();
+    }
+
+    bool IsStarted() const { return m_started; }
+    bool HasResponded() const { return m_sink.responded != 0; }
+    bool HasFinished() const { return m_finished != 0; }
+    bool HasSucceeded() const { return HasFinished() && !m_error && m_result.Succeeded(); }
+
+    // Returns the result of Download() on the background thread, after it
+    // finished without throwing.
+    const DownloadResult& GetDownloadResult() const { return m_result; }
+
+    // Returns whether the feed was modified, or throws Download()'s error.
+    bool GetResult() const
+    {
+        if ( m_error )
+            std::rethrow_exception(m_error);
+        m_result.ThrowIfFailed();
+        return m_result.status == DownloadResult::Status_Downloaded;
+    }
 
-        bool checkUpdates;
-        Settings::ReadConfigValue("CheckForUpdates", checkUpdates, false);
+    // Returns how many milliseconds it took the server to respond, after
+    // Download() succeeded.
+    DWORD GetResponseTime() const { return m_responseTime; }
+
+protected:
+    virtual void Run()
+    {
+        // no initialization to do, so signal readiness immediately
+        SignalReady();
 
-        if (checkUpdates)
+        // the deadline of the thread that wants the feed applies here too
+        DownloadDeadline deadline(m_deadline);
+        try
         {
-            const time_t currentTime = time(NULL);
-            time_t lastCheck = 0;
-            Settings::ReadConfigValue("LastCheckTime", lastCheck);
+            m_result = Download(this);
+        }
+        catch ( TerminateThreadException& )
+        {
+            throw;
+        }
+        catch ( ... )
+        {
+            m_error = std::current_exception();
+        }
+
+        // a hedged request that lost the race, nobody waits for it
+        if ( m_result.status == DownloadResult::Status_Cancelled )
+            return;
+
+        InterlockedExchange(&m_finished, 1);
+        m_changed.Signal();
+    }
+
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    std::string m_url;
+    HedgedAppcastSink m_sink;
+    Event& m_changed;
+    unsigned m_deadline;
+    bool m_started;
+    volatile LONG m_finished;
+    DownloadResult m_result;
+    std::exception_ptr m_error;
+    DWORD m_startTime, m_responseTime;
+};
+
+
+/*
+    Downloads the feed from the first of @a requests, or from the next ones
+    too if the servers asked so far didn't respond within GetHedgeDelay()
+    or failed.
+
+    Returns the request that succeeded first; the others are cancelled. If
+    all fail, the first one's error is thrown.
+ */
+FeedRequest& HedgeFeedRequests(std::vector<std::unique_ptr<FeedRequest>>& requests,
+                               Event& changed,
+                               Thread *onThread)
+{
+    const DWORD delay = GetHedgeDelay();
 
-            // Only check for updates in reasonable intervals:
-            const int interval = win_sparkle_get_update_check_interval();
-            time_t nextCheck = lastCheck + interval;
-            if (currentTime >= nextCheck)
+    size_t started = 0;
+    DWORD lastStart = 0;
+    for ( ;; )
+    {
+        bool responded = false, allFailed = true;
+        for ( size_t i = 0; i < started; i++ )
+        {
+            FeedRequest& request = *requests[i];
+            if ( request.HasSucceeded() )
             {
-                PerformUpdateCheck();
-                sleepTimeInSeconds = interval;
+                // cancel the losers, their responses are of no use now
+                for ( size_t j = 0; j < started; j++ )
+                {
+                    if ( j != i )
+                        requests[j]->TerminateAndJoin();
+                }
+
+                TraceEvent("AppcastHedged")
+                    .Field("Requests", started)
+                    .Field("Url", request.GetURL())
+                    .Field("DelayMs", delay)
+                    .Write();
+                return request;
             }
-            else
+            if ( request.HasResponded() && !request.HasFinished() )
+                responded = true;
+            if ( !request.HasFinished() )
+                allFailed = false;
+        }
+
+        if ( started == requests.size() && allFailed )
+            requests[0]->GetResult(); // throws
+
+        const DWORD now = GetTickCount();
+        DWORD timeout = INFINITE;
+        if ( started < requests.size() && !responded )
+        {
+            if ( started == 0 || allFailed || now - lastStart >= delay )
             {
-                sleepTimeInSeconds = unsigned(nextCheck - currentTime);
+                requests[started++]->StartDownload();
+                lastStart = now;
+                continue;
             }
+            timeout = delay - (now - lastStart);
         }
 
-        m_terminateEvent.WaitUntilSignaled(sleepTimeInSeconds * 1000);
+        onThread->GetCancellationToken().Wait(changed.GetHandle(), timeout);
     }
 }
 
 
-void OneShotUpdateChecker::Run()
+// Largest detached signature of the feed accepted; it's a base64-encoded
+// 64 bytes signature, but may be surrounded by whitespace.
+const size_t MAX_SIGNATURE_SIZE = 1024;
+
+// Downloads the feed's detached signature, if the feed is signed.
+std::string DownloadAppcastSignature(Thread *onThread)
 {
-    // no initialization to do, so signal readiness immediately
-    SignalReady();
+    const std::string url = Settings::GetAppcastSignatureURL();
+    if ( url.empty() )
+        return std::string();
+    CheckForInsecureURL(url, "appcast signature");
 
-    PerformUpdateCheck();
+    StringDownloadSink sig(MAX_SIGNATURE_SIZE);
+    DownloadFile(url, &sig, onThread, Download_BypassProxies);
+
+    // ignore surrounding whitespace, e.g. trailing newline
+    const size_t first = sig.data.find_first_not_of(" \t\r\n");
+    if ( first == std::string::npos )
+        throw BadSignatureException("Empty appcast signature");
+    const size_t last = sig.data.find_last_not_of(" \t\r\n");
+    return sig.data.substr(first, last - first + 1);
 }
 
 
-/*--------------------------------------------------------------------------*
-                            ManualUpdateChecker
- *--------------------------------------------------------------------------*/
+// Largest document with the latest version that is accepted.
+const size_t MAX_LATEST_VERSION_SIZE = 1024;
 
-bool ManualUpdateChecker::ShouldSkipUpdate(const Appcast&) const
+// Sink for the document with the latest version, see
+// win_sparkle_set_latest_version_url().
+struct LatestVersionDownloadSink : public StringDownloadSink
 {
-    // If I chose "Skip version" it should not prompt me for automatic updates,
-    // but if I explicitly open the dialog using
-    // win_sparkle_check_update_with_ui() it should still show that version.
-    // This is the semantics in Sparkle for Mac.
-    return false;
+    virtual const char *GetExtraHeaderName(size_t index) const
+    {
+        return index == 0 ? "X-Sparkle-Latest-Version" : NULL;
+    }
+
+    virtual void SetExtraHeader(size_t, const std::string& value) { header = value; }
+
+    // the header makes the body unnecessary, and too big body isn't
+    // the expected document
+    virtual bool IsComplete() const
+    {
+        return !header.empty() || data.size() > MAX_LATEST_VERSION_SIZE;
+    }
+
+    // Returns the latest version, empty if the server didn't send it.
+    std::string GetVersion() const
+    {
+        const std::string& version = header.empty() ? data : header;
+        if ( version.size() > MAX_LATEST_VERSION_SIZE )
+            return std::string();
+
+        // ignore surrounding whitespace, e.g. trailing newline
+        const size_t first = version.find_first_not_of(" \t\r\n");
+        if ( first == std::string::npos )
+            return std::string();
+        const size_t last = version.find_last_not_of(" \t\r\n");
+        return version.substr(first, last - first + 1);
+    }
+
+    std::string header;
+};
+
+// Returns true if the document with the latest version says there's no
+// newer one than the installed version, so that the feed needn't be
+// checked. Errors are only logged, the feed is checked then.
+bool IsLatestVersionInstalled(Thread *onThread)
+{
+    const std::string url = Settings::GetLatestVersionURL();
+    if ( url.empty() )
+        return false;
+
+    try
+    {
+        LatestVersionDownloadSink latest;
+        DownloadFile(url, &latest, onThread, Download_BypassProxies);
+
+        const std::string version = latest.GetVersion();
+        return !version.empty() && Settings::GetAppBuildVersionKey() >= VersionKey(version);
+    }
+    catch ( std::exception& e )
+    {
+        LogError(e.what());
+        return false;
+    }
+}
+
+
+// Release notes bigger than this aren't prefetched, the UI loads them itself.
+const size_t MAX_PREFETCHED_RELEASE_NOTES = 1024 * 1024;
+
+// How old a check made by another process may be for its result to be used
+// instead of checking again (in seconds)
+const time_t SHARED_CHECK_MAX_AGE = 5 * 60;
+
+struct ReleaseNotesDownloadSink : public StringDownloadSink
+{
+    ReleaseNotesDownloadSink() : tooBig(false) {}
+
+    virtual void SetLength(size_t len)
+    {
+        if ( len > MAX_PREFETCHED_RELEASE_NOTES )
+            tooBig = true;
+    }
+
+    virtual void Add(const void *data, size_t len)
+    {
+        StringDownloadSink::Add(data, len);
+        if ( this->data.size() > MAX_PREFETCHED_RELEASE_NOTES )
+            tooBig = true;
+    }
+
+    virtual bool IsComplete() const { return tooBig; }
+
+    bool tooBig;
+};
+
+// Downloads release notes on a worker thread, so that it can be done at
+// the same time as pre-downloading the update.
+class ReleaseNotesPrefetcher : public Thread
+{
+public:
+    ReleaseNotesPrefetcher(const std::string& url)
+        : Thread("WinSparkle release notes"), m_url(url) {}
+
+    // Returns the notes, or an empty string if they weren't prefetched.
+    // Must only be called after the thread finished.
+    const std::string& GetNotes() const { return m_notes; }
+
+protected:
+    virtual void Run()
+    {
+        SignalReady();
+
+        try
+        {
+            ReleaseNotesDownloadSink notes;
+            DownloadFile(m_url, &notes, this, Download_Compressed);
+            if ( !notes.tooBig )
+                m_notes.swap(notes.data);
+        }
+        catch ( std::exception& e )
+        {
+            LogError(e.what());
+        }
+    }
+
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    std::string m_url;
+    std::string m_notes;
+};
+
+/**
+    Prefetches the update's release notes into Appcast::ReleaseNotes, so
+    that they appear instantly with the update window.
+
+    Errors are only logged, the UI then loads the notes itself. The
+    prefetch is cancelled if it isn't finished when this object goes away.
+ */
+class ReleaseNotesPrefetch
+{
+public:
+    ReleaseNotesPrefetch() : m_thread(NULL) {}
+
+    ~ReleaseNotesPrefetch()
+    {
+        if ( m_thread )
+        {
+            m_thread->TerminateAndJoin();
+            delete m_thread;
+        }
+    }
+
+    void Start(const std::string& url)
+    {
+        try
+        {
+            std::unique_ptr<ReleaseNotesPrefetcher> thread(new ReleaseNotesPrefetcher(url));
+            thread->Start();
+            m_thread = thread.release();
+        }
+        catch ( std::exception& e )
+        {
+            LogError(e.what());
+        }
+    }
+
+    // Waits for the prefetch started with Start(), if any.
+    void Finish(Appcast& appcast, Thread& waiter)
+    {
+        if ( !m_thread )
+            return;
+        m_thread->JoinWithTerminationCheck(waiter);
+        appcast.ReleaseNotes = m_thread->GetNotes();
+    }
+
+private:
+    ReleaseNotesPrefetcher *m_thread;
+};
+
+
+// Appcast check shared by all checkers started while it's in progress, so
+// that the appcast isn't downloaded several times at once, e.g. when the
+// user checks manually during a periodic check.
+struct SharedAppcastCheck
+{
+    SharedAppcastCheck() : done(true) {}
+
+    // signaled when the check finished and the result below is set
+    Event done;
+
+    Appcast appcast;
+    std::exception_ptr error;
+};
+
+// guards g_sharedCheck
+CriticalSection g_csSharedCheck("shared update check");
+
+// check in progress, if any
+std::shared_ptr<SharedAppcastCheck> g_sharedCheck;
+
+
+// Returns the scheme, host and port part of @a url.
+std::string GetServerOfURL(const std::string& url)
+{
+    const size_t hostStart = url.find("://");
+    if ( hostStart == std::string::npos )
+        return url;
+    return url.substr(0, url.find('/', hostStart + 3));
+}
+
+// Returns the URL to download the appcast feed from, which is @a url with
+// the filter hints appended if enabled, see Settings::GetAppcastFilterHints().
+std::string GetFeedURL(const std::string& url)
+{
+    if ( !Settings::GetAppcastFilterHints() )
+        return url;
+
+    std::string query;
+    AppendQueryParameter(query, "appVersion", Settings::GetAppBuildVersionUTF8());
+    AppendQueryParameter(query, "os", Appcast::GetHostOs());
+    AppendQueryParameter(query, "osVersion", Appcast::GetHostOSVersion());
+    const std::string channels = Settings::GetUpdateChannels();
+    if ( !channels.empty() )
+        AppendQueryParameter(query, "channels", channels);
+
+    return AppendQuery(url, query);
+}
+
+// Returns this installation's phased rollout group, assigned randomly on
+// first use, see Appcast::IsAvailableToRolloutGroup().
+
+unsigned GetPhasedRolloutGroup()
+{
+    unsigned group;
+    if ( !Settings::ReadConfigValue("PhasedRolloutGroup", group) ||
+         group >= PHASED_ROLLOUT_GROUPS )
+    {
+        group = GetRandomNumber(PHASED_ROLLOUT_GROUPS - 1);
+        Settings::WriteConfigValue("PhasedRolloutGroup", group);
+    }
+    return group;
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                             UpdateChecker::Run()
+ *--------------------------------------------------------------------------*/
+
+// Gets the appcast from the feed the service agent downloaded, see
+// win_sparkle_set_use_service_agent(). Returns false if the agent isn't
+// available, the feed is then downloaded as usual.
+bool GetAppcastFromAgent(Thread& onThread, Appcast& appcast)
+{
+    if ( !Settings::GetUseServiceAgent() )
+        return false;
+
+    try
+    {
+        std::string feed, signature;
+        if ( !ServiceAgent::FetchFeed(onThread, feed, signature) )
+            return false;
+
+        // it's up to the app, not the agent, whether the feed must be signed
+        if ( !Settings::GetAppcastSignatureURL().empty() )
+        {
+            EdDSAVerifier verifier(signature);
+            verifier.Update(feed.data(), feed.size());
+            verifier.Verify();
+        }
+
+        appcast = Appcast::Load(feed, Settings::GetAppBuildVersionUTF8(),
+                                Settings::GetUpdateChannels());
+        return true;
+    }
+    catch ( std::exception& e )
+    {
+        LogError(std::string("Cannot use appcast from the service agent: ") + e.what());
+        return false;
+    }
+}
+
+// Checks the URLs in the appcast found and remembers the check.
+void FinishAppcastCheck(const Appcast& appcast)
+{
+    if (!appcast.ReleaseNotesURL.empty())
+        CheckForInsecureURL(appcast.ReleaseNotesURL, "release notes");
+    const std::vector<std::string> downloadURLs = appcast.GetDownloadURLs();
+    for ( size_t i = 0; i < downloadURLs.size(); i++ )
+        CheckForInsecureURL(downloadURLs[i], "update file");
+    if (!appcast.DeltaURL.empty())
+        CheckForInsecureURL(appcast.DeltaURL, "delta update file");
+    const std::vector<AppcastDelta> deltaChain = appcast.GetDeltaChain();
+    for ( size_t i = 0; i < deltaChain.size(); i++ )
+        CheckForInsecureURL(deltaChain[i].URL, "delta update file");
+
+    Settings::WriteConfigValue("LastCheckTime", time(NULL));
+
+    // the newest item's date, even if it's the installed version
+    const time_t published = appcast.GetPubDate();
+    if ( published )
+        UpdateScheduler::OnReleaseSeen(published);
+
+    // the feed may ask for checking less often, see UpdateScheduler
+    const int feedInterval = appcast.GetCheckInterval();
+    if ( feedInterval )
+        Settings::WriteConfigValue("AppcastCheckInterval", feedInterval);
+    else
+        Settings::DeleteConfigValue("AppcastCheckInterval");
+}
+
+namespace
+{
+
+// Starts downloading the additional feeds, see win_sparkle_add_appcast_feed().
+void StartAdditionalFeeds(const std::vector<Settings::AdditionalFeed>& feeds,
+                          std::vector<std::unique_ptr<FeedRequest>>& requests,
+                          Event& changed)
+{
+    for ( size_t i = 0; i < feeds.size(); i++ )
+    {
+        // they are parsed as they arrive, on their own threads
+        requests.push_back(std::unique_ptr<FeedRequest>(
+            new FeedRequest(GetFeedURL(feeds[i].url), std::string(), changed)));
+        requests.back()->StartDownload();
+    }
+}
+
+// Waits for the additional feeds and merges their updates with the main
+// feed's @a appcast. Feeds that failed are skipped.
+Appcast MergeAdditionalFeeds(const Appcast& appcast,
+                             const std::vector<Settings::AdditionalFeed>& feeds,
+                             std::vector<std::unique_ptr<FeedRequest>>& requests,
+                             Event& changed,
+                             Thread *onThread)
+{
+    AppcastChannel updates;
+    updates.SetAllowedChannels(Settings::GetUpdateChannels());
+    updates.SetCheckInterval(appcast.CheckInterval);
+    if ( appcast.IsValid() )
+        updates.AddItem(appcast);
+    std::vector<Appcast> components;
+
+    for ( size_t i = 0; i < requests.size(); i++ )
+    {
+        FeedRequest& request = *requests[i];
+        while ( !request.HasFinished() )
+            onThread->GetCancellationToken().Wait(changed.GetHandle(), INFINITE);
+
+        // e.g. a feed of a channel that was retired
+        if ( request.GetDownloadResult().status == DownloadResult::Status_HttpError )
+        {
+            LogWarning("Cannot check appcast " + feeds[i].url + ": " +
+                       request.GetDownloadResult().Describe());
+            continue;
+        }
+
+        try
+        {
+            request.GetResult();
+            const Appcast feedAppcast = request.GetSink().GetAppcast();
+            if ( !feedAppcast.IsValid() )
+                continue;
+            if ( feeds[i].role == Settings::FeedRole_Updates )
+                updates.AddItem(feedAppcast);
+            else
+                components.push_back(feedAppcast);
+        }
+        catch ( OperationCancelledException& )
+        {
+            throw;
+        }
+        catch ( std::exception& e )
+        {
+            LogWarning("Cannot check appcast " + feeds[i].url + ": " + e.what());
+        }
+    }
+
+    Appcast merged = updates.FindLatest([](const AppcastChannel& channel, size_t index)
+                                        {
+                                            return channel.IsSuitable(index);
+                                        });
+    if ( !merged.IsValid() )
+        merged = appcast;
+    if ( !merged.IsValid() )
+        return merged;
+
+    for ( size_t i = 0; i < components.size(); i++ )
+    {
+        AppcastComponent component;
+        component.DownloadURL = components[i].DownloadURL;
+        component.Length = components[i].Length;
+        component.Sha256 = components[i].Sha256;
+        component.EdDSASignature = components[i].EdDSASignature;
+        component.DsaSignature = components[i].DsaSignature;
+        merged.AddComponent(component);
+    }
+    return merged;
+}
+
+} // anonymous namespace
+
+UpdateChecker::UpdateChecker(): Thread("WinSparkle updates check")
+{
+}
+
+Appcast UpdateChecker::DownloadAppcast()
+{
+    const std::string url = Settings::GetAppcastURL();
+    if ( url.empty() )
+        throw std::runtime_error("Appcast URL not specified.");
+    CheckForInsecureURL(url, "appcast feed");
+
+    // On computers with the service agent, it checks for all the users.
+    Appcast agentAppcast;
+    if ( GetAppcastFromAgent(*this, agentAppcast) )
+    {
+        FinishAppcastCheck(agentAppcast);
+        return agentAppcast;
+    }
+
+    // Another process may be checking the same feed right now, e.g. another
+    // instance of the app. Wait for it to finish and use its result, which
+    // is stored in the shared settings, instead of checking again.
+    SessionMutex checkMutex("Check", url);
+    StatusOperation::SetCurrentPhase(WIN_SPARKLE_PHASE_QUEUED);
+    SessionMutexLocker checkLock(checkMutex, this);
+    StatusOperation::SetCurrentPhase(WIN_SPARKLE_PHASE_CHECKING);
+    time_t lastCheck = 0;
+    Settings::ReadConfigValue("LastCheckTime", lastCheck);
+    const bool checkedByOther = checkLock.HadToWait() &&
+                                time(NULL) - lastCheck < SHARED_CHECK_MAX_AGE;
+
+    // don't let an unresponsive server hold the check for longer
+    DownloadDeadline deadline(CHECK_DEADLINE);
+
+    // The additional feeds download while the main one is being checked.
+    const std::vector<Settings::AdditionalFeed> feeds = Settings::GetAdditionalFeeds();
+    bool hasUpdateFeeds = false;
+    for ( size_t i = 0; i < feeds.size(); i++ )
+        hasUpdateFeeds |= feeds[i].role == Settings::FeedRole_Updates;
+    Event feedsChanged;
+    std::vector<std::unique_ptr<FeedRequest>> feedRequests;
+    StartAdditionalFeeds(feeds, feedRequests, feedsChanged);
+
+    // No need for the feed if the server says there's nothing newer; the
+    // update checkers take the invalid appcast for no update. The other
+    // feeds may have newer updates, though.
+    if ( !checkedByOther && !hasUpdateFeeds && IsLatestVersionInstalled(this) )
+    {
+        Settings::WriteConfigValue("LastCheckTime", time(NULL));
+        return Appcast();
+    }
+
+    // Only download and parse the feed if it changed since the last
+    // check, otherwise reuse the appcast parsed back then:
+    // A signed feed's signature is needed before the feed itself, to
+    // verify the feed while it's being parsed.
+    // The cached appcast is keyed on the full URL, so it's only reused if
+    // the filter hints didn't change either.
+    const DWORD start = GetTickCount();
+    const std::string signature = DownloadAppcastSignature(this);
+    Event requestChanged;
+    std::vector<std::unique_ptr<FeedRequest>> requests;
+    requests.push_back(std::unique_ptr<FeedRequest>(
+        new FeedRequest(GetFeedURL(url), signature, requestChanged)));
+    const std::vector<std::string> fallbackURLs = Settings::GetAppcastFallbackURLs();
+    for ( size_t i = 0; i < fallbackURLs.size(); i++ )
+    {
+        requests.push_back(std::unique_ptr<FeedRequest>(
+            new FeedRequest(GetFeedURL(fallbackURLs[i]), signature, requestChanged)));
+    }
+
+    FeedRequest *request = requests[0].get();
+    AppcastDownloadSink *appcast_xml = &request->GetSink();
+    Appcast appcast;
+    if ( checkedByOther && appcast_xml->HasCachedAppcast() )
+    {
+        appcast = appcast_xml->GetCachedAppcast();
+    }
+    else
+    {
+        bool modified;
+        if ( requests.size() == 1 )
+        {
+            // nothing to hedge with, download on this thread
+            const DownloadResult result = request->Download(this);
+            result.ThrowIfFailed();
+            modified = result.status == DownloadResult::Status_Downloaded;
+        }
+        else
+        {
+            request = &HedgeFeedRequests(requests, requestChanged, this);
+            appcast_xml = &request->GetSink();
+            modified = request->GetResult();
+        }
+
+        if ( request == requests[0].get() )
+            RecordResponseTime(request->GetResponseTime());
+
+        if ( modified )
+        {
+            appcast = appcast_xml->GetAppcast();
+            appcast_xml->SaveCachedAppcast(appcast);
+        }
+        else
+        {
+            appcast = appcast_xml->GetCachedAppcast();
+        }
+    }
+    if ( !feedRequests.empty() )
+        appcast = MergeAdditionalFeeds(appcast, feeds, feedRequests, feedsChanged, this);
+    FinishAppcastCheck(appcast);
+
+    Stats::RecordCheck(GetTickCount() - start, appcast_xml->GetTimings(), appcast_xml->GetParseTime());
+    return appcast;
+}
+
+/*static*/
+void UpdateChecker::DownloadFeed(Thread& onThread, std::string& feed, std::string& signature)
+{
+    const std::string url = Settings::GetAppcastURL();
+    if ( url.empty() )
+        throw std::runtime_error("Appcast URL not specified.");
+    CheckForInsecureURL(url, "appcast feed");
+
+    DownloadDeadline deadline(CHECK_DEADLINE);
+    signature = DownloadAppcastSignature(&onThread);
+
+    std::vector<std::string> urls(1, url);
+    const std::vector<std::string> fallbackURLs = Settings::GetAppcastFallbackURLs();
+    urls.insert(urls.end(), fallbackURLs.begin(), fallbackURLs.end());
+
+    const size_t maxSize = Settings::GetMaxAppcastSize();
+    for ( size_t i = 0; ; i++ )
+    {
+        try
+        {
+            // the whole feed is needed, to hand it out to others
+            StringDownloadSink sink(maxSize ? maxSize : size_t(-1));
+            const DownloadResult result = TryDownloadFile(GetFeedURL(urls[i]), &sink, &onThread,
+                                                          Download_BypassProxies | Download_Compressed);
+            // a fallback server without the feed is tried past without unwinding
+            if ( result.status == DownloadResult::Status_HttpError && i + 1 < urls.size() )
+            {
+                LogWarning("Cannot download appcast from " + urls[i] + ", trying " +
+                           urls[i + 1] + ": " + result.Describe());
+                continue;
+            }
+            result.ThrowIfFailed();
+            if ( !signature.empty() )
+            {
+                EdDSAVerifier verifier(signature);
+                verifier.Update(sink.data.data(), sink.data.size());
+                verifier.Verify();
+            }
+            feed.swap(sink.data);
+            return;
+        }
+        catch ( std::exception& e )
+        {
+            if ( i + 1 == urls.size() )
+                throw;
+            LogWarning("Cannot download appcast from " + urls[i] + ", trying " +
+                     urls[i + 1] + ": " + e.what());
+        }
+    }
+}
+
+Appcast UpdateChecker::GetAppcast()
+{
+    std::shared_ptr<SharedAppcastCheck> check;
+    bool isOwner = false;
+    {
+        CriticalSectionLocker lock(g_csSharedCheck);
+        if ( !g_sharedCheck )
+        {
+            g_sharedCheck = std::make_shared<SharedAppcastCheck>();
+            isOwner = true;
+        }
+        check = g_sharedCheck;
+    }
+
+    if ( !isOwner )
+    {
+        // join the check that is already in progress
+        WaitWithTerminationCheck(check->done);
+        if ( check->error )
+            std::rethrow_exception(check->error);
+        return check->appcast;
+    }
+
+    try
+    {
+        check->appcast = DownloadAppcast();
+    }
+    catch ( TerminateThreadException& )
+    {
+        check->error = std::current_exception();
+    }
+    catch ( ... )
+    {
+        check->error = std::current_exception();
+        Stats::RecordFailedCheck(check->error);
+    }
+
+    // checkers started from now on must get a fresh result
+    {
+        CriticalSectionLocker lock(g_csSharedCheck);
+        g_sharedCheck.reset();
+    }
+    check->done.Signal();
+
+    if ( check->error )
+        std::rethrow_exception(check->error);
+    return check->appcast;
+}
+
+void UpdateChecker::PerformUpdateCheck()
+{
+    FootprintRecorder footprint(WIN_SPARKLE_STATS_FOOTPRINT_CHECK);
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_CHECK);
+    StatusOperation status(WIN_SPARKLE_OPERATION_CHECK, WIN_SPARKLE_PHASE_CHECKING);
+    TraceActivity activity("UpdateCheck");
+    try
+    {
+        const Appcast appcast = LoadAppcast();
+
+        // Check if our version is out of date.
+        if ( !appcast.IsValid() ||
+             Settings::GetAppBuildVersionKey() >= VersionKey(appcast.Version) )
+        {
+            // The same or newer version is already installed.
+            activity.SetResult("NoUpdate");
+            LogInfo("No update available");
+            OnNoUpdateAvailable();
+            return;
+        }
+
+        // Critical updates, e.g. security fixes, must reach everyone as
+        // soon as possible.
+        const bool critical = appcast.IsCritical(Settings::GetAppBuildVersionKey());
+
+        // Check if the user opted to ignore this particular version.
+        if ( !critical && ShouldSkipUpdate(appcast) )
+        {
+            activity.SetResult("Skipped");
+            OnNoUpdateAvailable();
+            return;
+        }
+
+        // Check if the update was released to this installation yet.
+        if ( !critical && ShouldFollowPhasedRollout() &&
+             !appcast.IsAvailableToRolloutGroup(GetPhasedRolloutGroup(), time(NULL)) )
+        {
+            activity.SetResult("NotRolledOut");
+            OnNoUpdateAvailable();
+            return;
+        }
+
+        // The release notes are fetched at the same time as the update is
+        // pre-downloaded. When both come from the same server, the requests
+        // share the session's connection (multiplexed over HTTP/2 or newer
+        // with the WinHTTP backend).
+        std::shared_ptr<Appcast> update(new Appcast(appcast));
+        ReleaseNotesPrefetch notes;
+        if ( ShouldPrefetchReleaseNotes() && !update->ReleaseNotesURL.empty() )
+            notes.Start(update->ReleaseNotesURL);
+
+        // Have the update ready by the time the user is asked about it,
+        // unless the user pays for the data beyond the daily budget. On
+        // battery, only critical updates are worth the power, others are
+        // downloaded later.
+        if ( ShouldPreDownload() && DataBudget::GetAllowance() > 0 )
+        {
+            if ( critical || !UpdateScheduler::ShouldSavePower() )
+                UpdateDownloader::PreDownload(*update, *this, critical);
+            else
+                UpdateScheduler::OnDownloadDeferred();
+        }
+
+        notes.Finish(*update, *this);
+
+        activity.SetResult("UpdateAvailable");
+        if ( Logger::IsEnabled(WIN_SPARKLE_LOG_INFO) )
+            LogInfo("Update available: " + update->Version);
+        UpdateJournal::RecordCheck(update->Version);
+        OnUpdateAvailable(update);
+    }
+    catch ( ... )
+    {
+        activity.SetResult("Error");
+        Stats::RecordError(std::current_exception());
+        OnUpdateError();
+        throw;
+    }
+}
+
+void UpdateChecker::OnUpdateAvailable(const AppcastPtr& appcast)
+{
+    // unsigned updates can't be staged, they're offered as usual, and
+    // critical ones shouldn't wait until the app exits
+    if ( ShouldInstallOnExit() && appcast->HasDownload() &&
+         !appcast->IsCritical(Settings::GetAppBuildVersionKey()) )
+    {
+        // staged once on AC power, the user isn't bothered meanwhile
+        if ( UpdateScheduler::ShouldSavePower() )
+        {
+            UpdateScheduler::OnDownloadDeferred();
+            ApplicationController::NotifyUpdateFound();
+            return;
+        }
+
+        try
+        {
+            if ( UpdateDownloader::StageForExit(appcast, *this) )
+            {
+                ApplicationController::NotifyUpdateFound();
+                return;
+            }
+        }
+        catch ( DataBudgetExhaustedException& e )
+        {
+            // the next check continues the download
+            LogInfo(std::string(e.what()) + " The update will be staged later.");
+            ApplicationController::NotifyUpdateFound();
+            return;
+        }
+    }
+
+    UI::NotifyUpdateAvailable(appcast, ShouldAutomaticallyInstall());
+}
+
+void UpdateChecker::OnNoUpdateAvailable()
+{
+    UI::NotifyNoUpdates(ShouldAutomaticallyInstall());
+}
+
+void UpdateChecker::OnUpdateError()
+{
+    UI::NotifyUpdateError();
+}
+
+bool UpdateChecker::ShouldSkipUpdate(const Appcast& appcast) const
+{
+    std::string toSkip;
+    if ( Settings::ReadConfigValue("SkipThisVersion", toSkip) )
+    {
+        return toSkip == appcast.Version;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+bool UpdateChecker::ShouldPrefetchReleaseNotes() const
+{
+    // Updates installed automatically are installed without showing
+    // anything, and in headless mode, the app may not show them either.
+    return !ShouldAutomaticallyInstall() && !Settings::GetHeadlessMode();
+}
+
+bool UpdateChecker::ShouldInstallOnExit() const
+{
+    // staging downloads the update in the background
+    return Settings::GetInstallOnExit() && !ShouldAutomaticallyInstall() &&
+           UpdateScheduler::IsInMaintenanceWindow();
+}
+
+bool UpdateChecker::ShouldPreDownload() const
+{
+    // automatic installation downloads the update right away anyway
+    return Settings::GetPreDownloadUpdates() && !ShouldAutomaticallyInstall() &&
+           UpdateScheduler::IsInMaintenanceWindow();
+}
+
+
+void PeriodicUpdateChecker::Run()
+{
+    // no initialization to do, so signal readiness immediately
+    SignalReady();
+
+    // UpdateScheduler only starts the checker when a check is due
+    try
+    {
+        // Every running instance of the app has its own scheduler, but they
+        // share the settings. Only one of them checks at a time, and when
+        // the others get their turn, they find out from LastCheckTime that
+        // the check was done already. Its result is shown by the instance
+        // that did it.
+        StatusOperation status(WIN_SPARKLE_OPERATION_CHECK, WIN_SPARKLE_PHASE_QUEUED);
+        SessionMutex lease("PeriodicCheck", Settings::GetAppcastURL());
+        SessionMutexLocker lock(lease, this);
+        if ( UpdateScheduler::IsCheckDue() )
+        {
+            PerformUpdateCheck();
+            // while the connection is open, if it's the same server
+            Telemetry::Submit(*this);
+        }
+    }
+    catch ( const HttpErrorException& e )
+    {
+        UpdateScheduler::OnCheckFailed(e.IsTransient(), e.GetRetryAfter());
+        throw;
+    }
+    catch ( ... )
+    {
+        UpdateScheduler::OnCheckFailed(true);
+        throw;
+    }
+
+    UpdateScheduler::OnCheckSucceeded();
+}
+
+
+void OneShotUpdateChecker::Run()
+{
+    // no initialization to do, so signal readiness immediately
+    SignalReady();
+
+    PerformUpdateCheck();
+}
+
+
+/*--------------------------------------------------------------------------*
+                            ManualUpdateChecker
+ *--------------------------------------------------------------------------*/
+
+bool ManualUpdateChecker::ShouldSkipUpdate(const Appcast&) const
+{
+    // If I chose "Skip version" it should not prompt me for automatic updates,
+    // but if I explicitly open the dialog using
+    // win_sparkle_check_update_with_ui() it should still show that version.
+    // This is the semantics in Sparkle for Mac.
+    return false;
+}
+
+
+/*--------------------------------------------------------------------------*
+                          UnattendedUpdateChecker
+ *--------------------------------------------------------------------------*/
+
+void UnattendedUpdateChecker::Run()
+{
+    // no initialization to do, so signal readiness immediately
+    SignalReady();
+
+    try
+    {
+        PerformUpdateCheck();
+    }
+    catch ( TerminateThreadException& )
+    {
+        throw;
+    }
+    catch ( ... )
+    {
+        // there's no UI to report it when closed
+        ApplicationController::NotifyUpdateError();
+        throw;
+    }
+}
+
+void UnattendedUpdateChecker::OnUpdateAvailable(const AppcastPtr& appcast)
+{
+    ApplicationController::NotifyUpdateFound();
+
+    if ( !appcast->HasDownload() )
+        throw std::runtime_error("The update can't be installed unattended, it has no download.");
+
+    // administrators may limit such downloads to maintenance windows; wake
+    // up every hour in case the clock was changed
+    for ( ;; )
+    {
+        const time_t now = time(NULL);
+        const time_t start = UpdateScheduler::GetMaintenanceWindowTime(now);
+        if ( start <= now )
+            break;
+        GetCancellationToken().Wait(NULL, DWORD((std::min)(start - now, time_t(60 * 60)) * 1000));
+    }
+
+    const std::wstring updateFile = UpdateDownloader::DownloadAndVerify(*appcast, *this);
+
+    // A signed update stays in UpdateCache, so it doesn't have to be
+    // downloaded again the next time.
+    if ( !ApplicationController::IsReadyToShutdown() )
+        throw std::runtime_error("The application can't be shut down, the update wasn't installed.");
+
+    if ( !UpdateDownloader::LaunchInstaller(updateFile, *appcast) )
+        throw std::runtime_error("Failed to launch the installer.");
+
+    ApplicationController::RequestShutdown();
+}
+
+
+/*--------------------------------------------------------------------------*
+                            ImportUpdateChecker
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Reads a file of the update bundle, at most maxSize bytes of it.
+std::string ReadBundleFile(const std::wstring& path, size_t maxSize)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file == INVALID_HANDLE_VALUE )
+        throw Win32Exception(("Failed to open " + WideToAnsi(path)).c_str());
+
+    std::string data;
+    char buffer[64 * 1024];
+    DWORD read;
+    while ( ReadFile(file, buffer, sizeof(buffer), &read, NULL) && read > 0 )
+    {
+        data.append(buffer, read);
+        if ( data.size() > maxSize )
+        {
+            CloseHandle(file);
+            throw std::runtime_error("Update bundle file " + WideToAnsi(path) + " is too large.");
+        }
+    }
+    CloseHandle(file);
+    return data;
+}
+
+} // anonymous namespace
+
+
+Appcast ImportUpdateChecker::LoadAppcast()
+{
+    const size_t maxSize = Settings::GetMaxAppcastSize();
+    const std::string feed = ReadBundleFile(m_feedPath, maxSize ? maxSize : size_t(-1));
+
+    // A signed feed must come with its signature, in the same form as it
+    // is published at win_sparkle_set_appcast_signature_url().
+    if ( !Settings::GetAppcastSignatureURL().empty() )
+    {
+        const std::string sig = ReadBundleFile(m_feedPath + L".sig", MAX_SIGNATURE_SIZE);
+        const size_t first = sig.find_first_not_of(" \t\r\n");
+        if ( first == std::string::npos )
+            throw BadSignatureException("Empty appcast signature");
+        const size_t last = sig.find_last_not_of(" \t\r\n");
+
+        EdDSAVerifier verifier(sig.substr(first, last - first + 1));
+        verifier.Update(feed.data(), feed.size());
+        verifier.Verify();
+    }
+
+    // nothing is remembered about the check: the bundle isn't the feed the
+    // periodic checks use, which may well be unreachable
+    return Appcast::Load(feed, Settings::GetAppBuildVersionUTF8(),
+                         Settings::GetUpdateChannels());
+}
+
+
+void ImportUpdateChecker::OnUpdateAvailable(const AppcastPtr& appcast)
+{
+    const size_t sep = m_feedPath.find_last_of(L"\\/");
+    const std::wstring dir = sep == std::wstring::npos ? std::wstring(L".") : m_feedPath.substr(0, sep);
+    UpdateDownloader::Import(*appcast, dir, *this);
+
+    // installing it finds the file in UpdateCache
+    ManualUpdateChecker::OnUpdateAvailable(appcast);
+}
+
+
+/*--------------------------------------------------------------------------*
+                            UpdateCheckRequest
+ *--------------------------------------------------------------------------*/
+
+UpdateCheckRequest::UpdateCheckRequest(win_sparkle_check_completed_callback_t callback,
+                                       void *userData,
+                                       bool ignoreSkippedVersion)
+    : m_callback(callback),
+      m_userData(userData),
+      m_ignoreSkippedVersion(ignoreSkippedVersion),
+      m_refCount(1),
+      m_thread(NULL)
+{
+    memset(&m_result, 0, sizeof(m_result));
+}
+
+void UpdateCheckRequest::Release()
+{
+    if ( InterlockedDecrement(&m_refCount) == 0 )
+        delete this;
+}
+
+void UpdateCheckRequest::Start()
+{
+    AsyncUpdateChecker *check = new AsyncUpdateChecker(this);
+    {
+        CriticalSectionLocker lock(m_cs);
+        m_thread = check;
+    }
+
+    try
+    {
+        check->Start();
+    }
+    catch ( ... )
+    {
+        {
+            CriticalSectionLocker lock(m_cs);
+            m_thread = NULL;
+        }
+        delete check;
+        throw;
+    }
+}
+
+void UpdateCheckRequest::Cancel()
+{
+    // The thread can't finish while we hold the lock, because Complete()
+    // must take it first.
+    CriticalSectionLocker lock(m_cs);
+    if ( m_thread )
+        m_thread->GetCancellationToken().Cancel();
+}
+
+void UpdateCheckRequest::Complete(win_sparkle_check_status_t status, const AppcastPtr& appcast)
+{
+    {
+        CriticalSectionLocker lock(m_cs);
+        m_thread = NULL;
+    }
+
+    // the result's strings point into the appcast, an empty one without update
+    m_appcast = appcast ? appcast : AppcastPtr(new Appcast);
+
+    m_result.status = status;
+    m_result.version = m_appcast->Version.c_str();
+    m_result.short_version = m_appcast->ShortVersionString.c_str();
+    m_result.title = m_appcast->Title.c_str();
+    m_result.description = m_appcast->Description.c_str();
+    m_result.download_url = m_appcast->DownloadURL.c_str();
+    m_result.download_size = m_appcast->Length.empty()
+                             ? -1
+                             : _strtoi64(m_appcast->Length.c_str(), NULL, 10);
+    m_result.release_notes_url = m_appcast->ReleaseNotesURL.c_str();
+    m_result.web_browser_url = m_appcast->WebBrowserURL.c_str();
+
+    if ( m_callback )
+        (*m_callback)(reinterpret_cast<win_sparkle_check_t>(this), &m_result, m_userData);
+
+    m_done.Signal();
+}
+
+
+/*--------------------------------------------------------------------------*
+                            AsyncUpdateChecker
+ *--------------------------------------------------------------------------*/
+
+AsyncUpdateChecker::AsyncUpdateChecker(UpdateCheckRequest *request)
+    : m_request(request)
+{
+    m_request->AddRef();
+}
+
+AsyncUpdateChecker::~AsyncUpdateChecker()
+{
+    m_request->Release();
+}
+
+void AsyncUpdateChecker::Run()
+{
+    // no initialization to do, so signal readiness immediately
+    SignalReady();
+
+    try
+    {
+        PerformUpdateCheck();
+    }
+    catch ( TerminateThreadException& )
+    {
+        m_request->Complete(WIN_SPARKLE_CHECK_CANCELLED, AppcastPtr());
+        throw;
+    }
+    catch ( ... )
+    {
+        m_request->Complete(WIN_SPARKLE_CHECK_ERROR, AppcastPtr());
+        throw;
+    }
+}
+
+bool AsyncUpdateChecker::ShouldSkipUpdate(const Appcast& appcast) const
+{
+    if ( m_request->m_ignoreSkippedVersion )
+        return false;
+    return OneShotUpdateChecker::ShouldSkipUpdate(appcast);
+}
+
+void AsyncUpdateChecker::OnUpdateAvailable(const AppcastPtr& appcast)
+{
+    m_request->Complete(WIN_SPARKLE_CHECK_UPDATE_AVAILABLE, appcast);
+}
+
+void AsyncUpdateChecker::OnNoUpdateAvailable()
+{
+    m_request->Complete(WIN_SPARKLE_CHECK_NO_UPDATE, AppcastPtr());
+}
+
+/*--------------------------------------------------------------------------*
+                             cached update info
+ *--------------------------------------------------------------------------*/
+
+/*static*/
+bool UpdateChecker::GetCachedUpdate(Appcast& update)
+{
+    const std::string url = Settings::GetAppcastURL();
+    if ( url.empty() )
+        return false;
+
+    CachedAppcast cached;
+    if ( !cached.Load() )
+        return false;
+
+    // the feed may have come from one of the fallback URLs; the URL also
+    // has the installed version and the channels as hints, so the snapshot
+    // is only used if they are the same as in the last check
+    std::vector<std::string> urls = Settings::GetAppcastFallbackURLs();
+    urls.insert(urls.begin(), url);
+    bool sameFeed = false;
+    for ( size_t i = 0; i < urls.size() && !sameFeed; i++ )
+        sameFeed = cached.url == GetFeedURL(urls[i]);
+    if ( !sameFeed )
+        return false;
+
+    // the same tests as in PerformUpdateCheck()
+    const Appcast& appcast = cached.appcast;
+    if ( !appcast.IsValid() ||
+         Settings::GetAppBuildVersionKey() >= VersionKey(appcast.Version) )
+        return false;
+
+    if ( !appcast.IsCritical(Settings::GetAppBuildVersionKey()) )
+    {
+        std::string toSkip;
+        if ( Settings::ReadConfigValue("SkipThisVersion", toSkip) && toSkip == appcast.Version )
+            return false;
+        if ( !appcast.IsAvailableToRolloutGroup(GetPhasedRolloutGroup(), time(NULL)) )
+            return false;
+    }
+
+    update = appcast;
+    return true;
+}
+
+
+/*--------------------------------------------------------------------------*
+                            ConnectionWarmer
+ *--------------------------------------------------------------------------*/
+
+ConnectionWarmer::ConnectionWarmer() : Thread("WinSparkle connection warmer")
+{
+}
+
+void ConnectionWarmer::Run()
+{
+    // no initialization to do, so signal readiness immediately
+    SignalReady();
+
+    const std::string url = Settings::GetAppcastURL();
+    if ( url.empty() )
+        return;
+
+    std::vector<std::string> urls(1, url);
+
+    // the servers of the last update found, if the feed didn't change since
+    CachedAppcast cached;
+    if ( cached.Load() && cached.url == GetFeedURL(url) )
+    {
+        urls.push_back(cached.appcast.DownloadURL);
+        urls.push_back(cached.appcast.ReleaseNotesURL);
+    }
+
+    std::vector<std::string> servers;
+    for ( size_t i = 0; i < urls.size(); i++ )
+    {
+        if ( urls[i].empty() )
+            continue;
+        const std::string server = GetServerOfURL(urls[i]);
+        if ( std::find(servers.begin(), servers.end(), server) != servers.end() )
+            continue;
+        servers.push_back(server);
+
+        PreconnectToServer(urls[i], this);
+    }
 }
 
 } // namespace winsparkle
@@ -27,14 +27,14 @@
 #define _updatechecker_h_
 
 #include "threads.h"
+#include "appcast.h"
+#include "winsparkle.h"
 
 #include <string>
 
 namespace winsparkle
 {
 
-struct Appcast;
-
 /**
     This class checks the appcast for updates.
 
@@ -59,6 +59,27 @@ public:
      */
     static int CompareVersions(const std::string& a, const std::string& b);
 
+    /**
+        Downloads the whole appcast feed, from one of its URLs, and its
+        detached signature, if the feed is signed, for ServiceAgent.
+
+        The feed is verified against the signature. Throws on error.
+     */
+    static void DownloadFeed(Thread& onThread, std::string& feed, std::string& signature);
+
+    /**
+        Gets the update found by the last check, from the appcast snapshot
+        kept in the settings, without accessing the network.
+
+        The update is only returned if it would be offered now: it's newer
+        than the installed version, wasn't skipped by the user (unless it's
+        critical) and was released to this installation, and the feed
+        didn't change since (e.g. because of another update channel).
+
+        @return false if there's no such update.
+     */
+    static bool GetCachedUpdate(Appcast& update);
+
 protected:
     /// Should give version be ignored?
     virtual bool ShouldSkipUpdate(const Appcast& appcast) const;
@@ -66,13 +87,79 @@ protected:
     /// Should we install the update or prompt the user for options first?
     virtual bool ShouldAutomaticallyInstall() const { return false; }
 
+    /**
+        Should the update only be offered once its phased rollout reaches
+        this installation (see Appcast::IsAvailableToRolloutGroup())?
+
+        True for checks done in the background, but not for checks the
+        user asked for.
+     */
+    virtual bool ShouldFollowPhasedRollout() const { return true; }
+
+    /**
+        May the update be downloaded before telling the user about it?
+
+        True for checks done in the background if enabled with
+        win_sparkle_set_predownload_updates(), but not for checks the user
+        waits for.
+     */
+    virtual bool ShouldPreDownload() const;
+
+    /**
+        May the release notes be downloaded before telling the user about
+        the update? True, unless the update is installed automatically or
+        the app shows it itself in headless mode.
+     */
+    virtual bool ShouldPrefetchReleaseNotes() const;
+
+    /**
+        Should the update be downloaded silently and installed when the
+        application exits (see win_sparkle_set_install_on_exit())?
+
+        True for checks done in the background if enabled.
+     */
+    virtual bool ShouldInstallOnExit() const;
+
+    /**
+        Called when an update that shouldn't be skipped was found.
+
+        By default, tells the UI about it, or stages it to be installed
+        on exit if ShouldInstallOnExit().
+     */
+    virtual void OnUpdateAvailable(const AppcastPtr& appcast);
+
+    /// Called when no update was found. By default, tells the UI about it.
+    virtual void OnNoUpdateAvailable();
+
+    /// Called when the check failed. By default, tells the UI about it.
+    virtual void OnUpdateError();
+
 protected:
+    /**
+        Gets the appcast to check: by default, the current one from the
+        network, see GetAppcast(). Throws on error.
+     */
+    virtual Appcast LoadAppcast() { return GetAppcast(); }
+
     virtual void PerformUpdateCheck();
     virtual bool IsJoinable() const { return false; }
+
+private:
+    /**
+        Gets the current appcast.
+
+        If another checker is getting it already, waits for it and returns
+        the same result instead of downloading the appcast again. Throws on
+        error.
+     */
+    Appcast GetAppcast();
+
+    /// Downloads the appcast, throws on error.
+    Appcast DownloadAppcast();
 };
 
 
-/// Runs in the background and performs periodic update checks
+/// Performs a periodic update check when UpdateScheduler decides it's due
 class PeriodicUpdateChecker : public UpdateChecker
 {
 protected:
@@ -99,6 +186,9 @@ public:
 
 protected:
     virtual bool ShouldSkipUpdate(const Appcast& appcast) const;
+    virtual bool ShouldPreDownload() const { return false; }
+    virtual bool ShouldFollowPhasedRollout() const { return false; }
+    virtual bool ShouldInstallOnExit() const { return false; }
 };
 
 
@@ -116,6 +206,155 @@ protected:
 };
 
 
+/**
+    Update checker used by win_sparkle_import_update().
+
+    Checks the appcast feed of an update bundle on disk instead of the
+    network one, and imports the update file from the bundle before telling
+    the UI about it, so that installing it doesn't download anything.
+ */
+class ImportUpdateChecker : public ManualUpdateChecker
+{
+public:
+    /// Creates checker thread for the bundle's feed file @a feedPath.
+    ImportUpdateChecker(const std::wstring& feedPath)
+        : ManualUpdateChecker(), m_feedPath(feedPath) {}
+
+protected:
+    virtual Appcast LoadAppcast();
+    virtual bool ShouldPrefetchReleaseNotes() const { return false; }
+    virtual void OnUpdateAvailable(const AppcastPtr& appcast);
+
+private:
+    std::wstring m_feedPath;
+};
+
+
+/**
+    Update checker that installs updates without any UI.
+
+    The update is downloaded, verified and its installer launched on this
+    thread, and the application is then asked to shut down. The UI thread
+    isn't involved at all; the application is informed through the
+    callbacks set in ApplicationController.
+ */
+class UnattendedUpdateChecker : public ManualAutoInstallUpdateChecker
+{
+public:
+    /// Creates checker thread.
+    UnattendedUpdateChecker() : ManualAutoInstallUpdateChecker() {}
+
+protected:
+    virtual void Run();
+    virtual void OnUpdateAvailable(const AppcastPtr& appcast);
+};
+
+
+/**
+    Update check started with win_sparkle_check_async().
+
+    This is the state behind win_sparkle_check_t: it is shared by the
+    application's handle and the AsyncUpdateChecker thread doing the check,
+    and destroyed when both released it.
+ */
+class UpdateCheckRequest
+{
+public:
+    UpdateCheckRequest(win_sparkle_check_completed_callback_t callback,
+                       void *userData,
+                       bool ignoreSkippedVersion);
+
+    /// Starts the check, throws on error.
+    void Start();
+
+    /// Asks the check to stop, does nothing if it completed already.
+    void Cancel();
+
+    /// Waits until the check completes, returns false on timeout.
+    bool Wait(DWORD timeout) { return m_done.WaitUntilSignaled(timeout); }
+
+    /// Returns the result, NULL if the check didn't complete yet.
+    const win_sparkle_check_result_t *GetResult()
+    {
+        return m_done.CheckIfSignaled() ? &m_result : NULL;
+    }
+
+    void AddRef() { InterlockedIncrement(&m_refCount); }
+    void Release();
+
+private:
+    ~UpdateCheckRequest() {}
+
+    /**
+        Stores the result and calls the callback. Called by the checker
+        exactly once, @a appcast is empty unless an update was found.
+     */
+    void Complete(win_sparkle_check_status_t status, const AppcastPtr& appcast);
+
+    win_sparkle_check_completed_callback_t m_callback;
+    void *m_userData;
+    bool m_ignoreSkippedVersion;
+
+    volatile LONG m_refCount;
+
+    // guards m_thread, which is NULL once the check completed
+    CriticalSection m_cs;
+    Thread *m_thread;
+
+    // signaled after the callback returned
+    OneShotEvent m_done;
+
+    AppcastPtr m_appcast;
+    win_sparkle_check_result_t m_result;
+
+    friend class AsyncUpdateChecker;
+};
+
+
+/**
+    Update checker reporting to an UpdateCheckRequest instead of the UI.
+ */
+class AsyncUpdateChecker : public OneShotUpdateChecker
+{
+public:
+    /// Creates checker thread, which keeps a reference to @a request.
+    AsyncUpdateChecker(UpdateCheckRequest *request);
+    virtual ~AsyncUpdateChecker();
+
+protected:
+    virtual void Run();
+    virtual bool ShouldSkipUpdate(const Appcast& appcast) const;
+    virtual bool ShouldPreDownload() const { return false; }
+    virtual bool ShouldPrefetchReleaseNotes() const { return false; }
+    virtual bool ShouldInstallOnExit() const { return false; }
+    virtual void OnUpdateAvailable(const AppcastPtr& appcast);
+    virtual void OnNoUpdateAvailable();
+    virtual void OnUpdateError() {}
+
+private:
+    UpdateCheckRequest *m_request;
+};
+
+
+/**
+    Connects to the servers the next periodic check is going to use, so that
+    it doesn't have to wait for DNS resolution and TLS handshakes.
+
+    These are the appcast's server and the servers of the update and its
+    release notes found by the last check, if any. The thread terminates
+    itself when done.
+ */
+class ConnectionWarmer : public Thread
+{
+public:
+    ConnectionWarmer();
+
+protected:
+    virtual void Run();
+    virtual bool IsJoinable() const { return false; }
+};
+
+
 } // namespace winsparkle
 
 #endif // _updatechecker_h_
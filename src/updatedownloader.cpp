@@ -26,16 +26,31 @@
 #include "appcontroller.h"
 #include "updatedownloader.h"
 #include "download.h"
+#include "databudget.h"
 #include "settings.h"
 #include "ui.h"
 #include "error.h"
+#include "logger.h"
+#include "pipelinestatus.h"
 #include "signatureverifier.h"
+#include "asyncfilewriter.h"
+#include "stats.h"
+#include "allocstats.h"
+#include "trace.h"
+#include "updatecache.h"
+#include "updatejournal.h"
+#include "deltapatch.h"
 
 #include <wx/string.h>
 
+#include <exception>
+#include <memory>
 #include <sstream>
+#include <ctype.h>
+#include <stdlib.h>
+#include <io.h>
 #include <rpc.h>
-#include <time.h>
+#include <shellapi.h>
 
 namespace winsparkle
 {
@@ -48,105 +63,2103 @@ namespace
 {
 
 std::wstring GetUniqueTempDirectoryPrefix()
+{
+    return Settings::GetStagingDirectory() + L"Update-";
+}
+
+// Prefix of update directories in the system temp directory, used if the
+// staging directory set by the application doesn't have enough free space.
+// Empty if it's the same as GetUniqueTempDirectoryPrefix().
+std::wstring GetFallbackTempDirectoryPrefix()
 {
     wchar_t tmpdir[MAX_PATH + 1];
-    if (GetTempPath(MAX_PATH + 1, tmpdir) == 0)
-        throw Win32Exception("Cannot create temporary directory");
+    if ( GetTempPath(MAX_PATH + 1, tmpdir) == 0 )
+        return std::wstring();
+    const std::wstring prefix = std::wstring(tmpdir) + L"Update-";
+    return _wcsicmp(prefix.c_str(), GetUniqueTempDirectoryPrefix().c_str()) == 0 ? std::wstring() : prefix;
+}
+
+// Does @a path lie in one of the directories updates are downloaded to?
+// Throws if they can't be determined.
+bool HasUpdateTempDirectoryPrefix(const std::wstring& path)
+{
+    if ( path.find(GetUniqueTempDirectoryPrefix()) == 0 )
+        return true;
+    const std::wstring fallback = GetFallbackTempDirectoryPrefix();
+    return !fallback.empty() && path.find(fallback) == 0;
+}
+
+// Free space that must remain on the volume after downloading the update,
+// so that the installer can unpack it.
+const unsigned long long DISK_SPACE_RESERVE = 64 * 1024 * 1024;
+
+// Is there room for @a size bytes on the volume of @a dir? Also returns true
+// if it can't be determined, the download then finds out.
+bool HasFreeSpaceFor(const std::wstring& dir, unsigned long long size)
+{
+    ULARGE_INTEGER available;
+    if ( !GetDiskFreeSpaceExW(dir.c_str(), &available, NULL, NULL) )
+        return true;
+    return available.QuadPart >= size + DISK_SPACE_RESERVE;
+}
+
+// Thrown if there's not enough free disk space for the update.
+class DiskFullException : public std::runtime_error
+{
+public:
+    DiskFullException()
+        : std::runtime_error("Not enough free disk space to download the update.") {}
+};
+
+// Picks the prefix for the directory of an update of @a size bytes (0 if
+// unknown): the staging directory if its volume has enough space for it,
+// else the system temp directory. Throws DiskFullException if neither has.
+std::wstring ChooseTempDirectoryPrefix(unsigned long long size)
+{
+    const std::wstring prefix = GetUniqueTempDirectoryPrefix();
+    if ( !size )
+        return prefix;
+
+    // GetDiskFreeSpaceEx() wants an existing directory, not the prefix
+    if ( HasFreeSpaceFor(prefix.substr(0, prefix.find_last_of(L'\\') + 1), size) )
+        return prefix;
+
+    const std::wstring fallback = GetFallbackTempDirectoryPrefix();
+    if ( !fallback.empty() &&
+         HasFreeSpaceFor(fallback.substr(0, fallback.find_last_of(L'\\') + 1), size) )
+    {
+        LogError("Not enough free space in the staging directory, downloading the update to the temp directory.");
+        return fallback;
+    }
+
+    throw DiskFullException();
+}
+
+// Creates the directory to download an update of @a size bytes into, see
+// ChooseTempDirectoryPrefix().
+std::wstring CreateUniqueTempDirectory(unsigned long long size = 0)
+{
+    // We need to put downloaded updates into a directory of their own, because
+    // if we put it in $TMP, some DLLs could be there and interfere with the
+    // installer.
+    //
+    // This code creates a new randomized directory name and tries to create it;
+    // this process is repeated if the directory already exists.
+    const std::wstring tmpdir = ChooseTempDirectoryPrefix(size);
+
+    for ( ;; )
+    {
+        std::wstring dir(tmpdir);
+        UUID uuid;
+        UuidCreate(&uuid);
+        RPC_WSTR uuidStr;
+        RPC_STATUS status = UuidToString(&uuid, &uuidStr);
+        dir += reinterpret_cast<wchar_t*>(uuidStr);
+        RpcStringFree(&uuidStr);
+
+        if ( CreateDirectory(dir.c_str(), NULL) )
+            return dir;
+        else if ( GetLastError() != ERROR_ALREADY_EXISTS )
+            throw Win32Exception("Cannot create temporary directory");
+    }
+}
+
+// Guards changes of the UpdateTempDir setting by a download in progress and
+// by removal of leftovers, which may run at the same time.
+CriticalSection g_csTempDir;
+
+bool IsUpdateTempDirectory(const std::wstring& path)
+{
+    try
+    {
+        return HasUpdateTempDirectoryPrefix(path);
+    }
+    catch (Win32Exception&) // cannot determine temp directory
+    {
+        return false;
+    }
+}
+
+
+// State of an interrupted download, persisted in the settings so that the
+// download can be resumed instead of starting from scratch.
+struct PartialDownload
+{
+    std::string  url;
+    std::wstring path;
+    std::string  validator;
+    // background transfer writing the file, if it's downloaded with BITS
+    std::string  job;
+
+    bool Load()
+    {
+        if ( !Settings::ReadConfigValue("PartialDownloadURL", url) ||
+             !Settings::ReadConfigValue("PartialDownloadFile", path) ||
+             !Settings::ReadConfigValue("PartialDownloadValidator", validator) )
+            return false;
+        if ( !Settings::ReadConfigValue("PartialDownloadJob", job) )
+            job.clear();
+        // don't let anybody trick us into appending to arbitrary files
+        return IsUpdateTempDirectory(path);
+    }
+
+    void Save() const
+    {
+        // the values only make sense together, write all of them or none
+        Settings::Batch batch;
+        Settings::WriteConfigValue("PartialDownloadURL", url);
+        Settings::WriteConfigValue("PartialDownloadFile", path);
+        Settings::WriteConfigValue("PartialDownloadValidator", validator);
+        if ( job.empty() )
+            Settings::DeleteConfigValue("PartialDownloadJob");
+        else
+            Settings::WriteConfigValue("PartialDownloadJob", job);
+        batch.Commit();
+    }
+
+    static bool Exists()
+    {
+        std::wstring path;
+        return Settings::ReadConfigValue("PartialDownloadFile", path);
+    }
+
+    static void Forget()
+    {
+        if ( !Exists() )
+            return;
+
+        // don't leave the transfer running if the file isn't wanted anymore
+        std::string job;
+        if ( Settings::ReadConfigValue("PartialDownloadJob", job) )
+            CancelBackgroundDownload(job);
+
+        Settings::Batch batch;
+        Settings::DeleteConfigValue("PartialDownloadJob");
+        Settings::DeleteConfigValue("PartialDownloadURL");
+        Settings::DeleteConfigValue("PartialDownloadFile");
+        Settings::DeleteConfigValue("PartialDownloadValidator");
+        batch.Commit();
+    }
+};
+
+
+// Returns size of the file or 0 if it doesn't exist.
+size_t GetExistingFileSize(const std::wstring& path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if ( !GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data) )
+        return 0;
+    if ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+        return 0;
+    ULARGE_INTEGER size;
+    size.LowPart = data.nFileSizeLow;
+    size.HighPart = data.nFileSizeHigh;
+    return size_t(size.QuadPart);
+}
+
+
+// Downloaded files have this appended to their name until they are verified,
+// so that a file with the real name is always complete and valid.
+const wchar_t PARTIAL_SUFFIX[] = L".partial";
+
+// Gives the verified file @a path its real name and returns the new path.
+std::wstring RenameVerifiedFile(const std::wstring& path)
+{
+    const size_t suffixLen = wcslen(PARTIAL_SUFFIX);
+    if ( path.length() <= suffixLen ||
+         path.compare(path.length() - suffixLen, suffixLen, PARTIAL_SUFFIX) != 0 )
+    {
+        return path; // downloaded by an older version
+    }
+
+    const std::wstring finalPath = path.substr(0, path.length() - suffixLen);
+    if ( !MoveFileExW(path.c_str(), finalPath.c_str(), MOVEFILE_REPLACE_EXISTING) )
+        throw Win32Exception("Cannot rename the update file");
+    return finalPath;
+}
+
+
+// Deletes directory @a dir with all its contents. Returns false if some of
+// it couldn't be deleted.
+//
+// This uses plain file functions rather than SHFileOperation(), which loads
+// much of the shell. Links to other directories are removed, not followed.
+bool DeleteDirectoryTree(const std::wstring& dir, Thread *thread)
+{
+    WIN32_FIND_DATA data;
+    HANDLE h = FindFirstFile((dir + L"\\*").c_str(), &data);
+    if ( h != INVALID_HANDLE_VALUE )
+    {
+        do
+        {
+            if ( thread )
+                thread->CheckShouldTerminate();
+
+            const std::wstring name(data.cFileName);
+            if ( name == L"." || name == L".." )
+                continue;
+
+            const std::wstring path = dir + L"\\" + name;
+            if ( (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                 !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) )
+            {
+                DeleteDirectoryTree(path, thread);
+                continue;
+            }
+
+            if ( data.dwFileAttributes & FILE_ATTRIBUTE_READONLY )
+                SetFileAttributes(path.c_str(), data.dwFileAttributes & ~FILE_ATTRIBUTE_READONLY);
+
+            if ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+                RemoveDirectory(path.c_str());
+            else
+                DeleteFile(path.c_str());
+        } while ( FindNextFile(h, &data) );
+        FindClose(h);
+    }
+
+    return RemoveDirectory(dir.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND
+                                        || GetLastError() == ERROR_PATH_NOT_FOUND;
+}
+
+
+// What the appcast says about the update file, so that it can be checked
+// while it is being downloaded.
+struct ExpectedFile
+{
+    ExpectedFile() : length(0), compressed(false), repairable(false) {}
+
+    // size in bytes, 0 if unknown
+    size_t length;
+    // binary SHA-256 hash, empty if unknown
+    std::string sha256;
+    // may the server send it compressed, see Appcast::IsCompressed()?
+    bool compressed;
+    // can a damaged file be repaired, see RepairUpdateFile()?
+    bool repairable;
+};
+
+// @a length and @a hex are the feed's length and hex-encoded SHA-256 hash
+ExpectedFile GetExpectedFile(const std::string& length, const std::string& hex)
+{
+    ExpectedFile expected;
+    if ( !length.empty() )
+        expected.length = size_t(_strtoui64(length.c_str(), NULL, 10));
+
+    if ( hex.empty() )
+        return expected;
+    if ( hex.length() != 2 * HashEngine::GetDigestSize(Hash_SHA256) )
+        throw std::runtime_error("Invalid SHA-256 hash of the update in the appcast.");
+    for ( size_t i = 0; i < hex.length(); i += 2 )
+    {
+        char digit[3] = { hex[i], hex[i + 1], 0 };
+        char *end;
+        const unsigned long value = strtoul(digit, &end, 16);
+        if ( *end != 0 || !isxdigit((unsigned char)digit[0]) )
+            throw std::runtime_error("Invalid SHA-256 hash of the update in the appcast.");
+        expected.sha256 += char(value);
+    }
+    return expected;
+}
+
+ExpectedFile GetExpectedFile(const Appcast& appcast)
+{
+    ExpectedFile expected = GetExpectedFile(appcast.Length, appcast.Sha256);
+    expected.compressed = appcast.IsCompressed();
+    expected.repairable = appcast.HasChunkManifest() && Settings::HasEdDSAPubKey() && !expected.compressed;
+    return expected;
+}
+
+
+// The download ended before all of the file was received.
+class IncompleteDownloadException : public std::runtime_error
+{
+public:
+    IncompleteDownloadException()
+        : std::runtime_error("Incomplete download of the update file.") {}
+};
+
+
+struct UpdateDownloadSink : public IRandomAccessDownloadSink,
+                            public IBackgroundDownloadSink
+{
+    UpdateDownloadSink(Thread& thread, const std::string& url, const std::wstring& dir,
+                       bool reportProgress, const ExpectedFile& expected)
+        : m_thread(thread),
+          m_reportProgress(reportProgress),
+          m_url(url), m_dir(dir),
+          m_downloaded(0), m_total(0),
+          m_hostProgressInterval(reportProgress ? ApplicationController::GetDownloadProgressInterval() : -1),
+          m_hostProgressStarted(false),
+          m_lastHostProgressTime(0), m_lastHostProgressBytes(0),
+          m_status(StatusOperation::GetCurrent()),
+          m_resumeSize(0), m_startOffset(0),
+          m_resumable(false),
+          m_expected(expected),
+          m_cost(ConnectionCost_Unrestricted),
+          m_allowance(DataBudget::UNLIMITED), m_received(0),
+          m_budgeted(false)
+    {
+        // hash the file as it arrives, so that it doesn't have to be read
+        // again to verify its DSA signature
+        if ( !Settings::HasEdDSAPubKey() && Settings::HasDSAPubKey() )
+            m_hasher.reset(new DataHasher(Hash_SHA1));
+        if ( !expected.sha256.empty() )
+            m_sha256.reset(new DataHasher(Hash_SHA256));
+    }
+
+    ~UpdateDownloadSink()
+    {
+        if ( m_budgeted )
+            DataBudget::RecordUsage(m_cost, m_received);
+
+        if ( !m_file.IsOpen() )
+            return;
 
-    std::wstring dir(tmpdir);
-    dir += L"Update-";
-    return dir;
+        // The download didn't finish. Cut off the preallocated part of the
+        // file, so that what remains can be continued from later.
+        m_file.Abort();
+        if ( m_resumable )
+            SavePartial();
+    }
+
+    // Finish writing the downloaded file. Throws IncompleteDownloadException
+    // if the response ended early, which leaves the partial file to resume.
+    void Close()
+    {
+        if ( m_file.IsOpen() )
+        {
+            // the server's size is more reliable than the one in the feed
+            const size_t total = m_total ? m_total : m_expected.length;
+            if ( total && m_downloaded < total )
+                throw IncompleteDownloadException();
+        }
+        m_file.Close();
+    }
+
+    std::wstring GetFilePath(void) { return m_path; }
+
+    // Get SHA1 hash of the downloaded file, if it could be computed during
+    // the download.
+    bool GetSHA1(std::string& sha1)
+    {
+        if ( !m_hasher )
+            return false;
+        sha1 = m_hasher->GetDigest();
+        return true;
+    }
+
+    // Checks the file's SHA-256 hash if the appcast gives it, throws
+    // BadSignatureException if it doesn't match.
+    void VerifySHA256()
+    {
+        if ( m_expected.sha256.empty() )
+            return;
+
+        // not hashed during the download if it wasn't written sequentially
+        if ( !m_sha256 )
+        {
+            m_sha256.reset(new DataHasher(Hash_SHA256));
+            m_sha256->UpdateFromFile(m_path);
+        }
+
+        if ( m_sha256->GetDigest() != m_expected.sha256 )
+            throw BadSignatureException("the update doesn't match its SHA-256 hash");
+    }
+
+    // Counts the data received against @a allowance for a connection of
+    // @a cost, see DataBudget. Add() throws DataBudgetExhaustedException
+    // once it's used up, leaving the partial file to be continued later.
+    void SetDataBudget(ConnectionCost cost, unsigned long long allowance)
+    {
+        m_cost = cost;
+        m_allowance = allowance;
+        m_budgeted = true;
+    }
+
+    // Continue the download from an existing partial file.
+    void ResumeFrom(const PartialDownload& partial, size_t size)
+    {
+        m_resumePath = partial.path;
+        m_resumeValidator = partial.validator;
+        m_resumeSize = size;
+        m_resumeJob = partial.job;
+    }
+
+    virtual size_t GetResumeOffset(std::string& validator) const
+    {
+        validator = m_resumeValidator;
+        return m_resumeSize;
+    }
+
+    virtual void SetStartOffset(size_t offset, const std::string& validator)
+    {
+        m_startOffset = offset;
+        m_validator = validator;
+
+        if ( offset == 0 && !m_resumePath.empty() )
+        {
+            // the server couldn't continue where we left off
+            PartialDownload::Forget();
+            _wremove(m_resumePath.c_str());
+            m_resumePath.clear();
+            m_resumeSize = 0;
+        }
+    }
+
+    virtual void SetLength(size_t l)
+    {
+        m_total = l;
+        if ( m_expected.length && l != m_expected.length )
+        {
+            // Not fatal, feeds often aren't updated when the file is rebuilt.
+            // The SHA-256 hash or the signature catch any damage.
+            LogError("Update file size differs from the appcast's length attribute.");
+        }
+    }
+
+    virtual void SetFilename(const std::wstring& filename)
+    {
+        if ( m_file.IsOpen() )
+            throw std::runtime_error("Update file already set");
+
+        if ( m_startOffset && !m_resumePath.empty() )
+        {
+            // keep the name the partial file was saved under originally
+            m_path = m_resumePath;
+            HashPartialFile();
+            m_file.Open(m_path, true);
+            m_downloaded = m_startOffset;
+        }
+        else
+        {
+            // The installer of an update the user waits for (which is what
+            // reports progress) is launched right away, there's no point in
+            // writing it to the disk first unless it's big. The cache then
+            // serves the reads for verifying it, and StageForExit() makes
+            // the file persistent if it has to wait.
+            const size_t size = m_total ? m_total : m_expected.length;
+            const bool temporary = m_reportProgress && size &&
+                                   size <= Settings::GetTemporaryStagingLimit();
+
+            m_path = m_dir + L"\\" + filename + PARTIAL_SUFFIX;
+            m_file.Open(m_path, false, temporary);
+            m_downloaded = 0;
+        }
+
+        // Writes that extend the file are never asynchronous, so allocate
+        // all of it upfront if we know how big it will be.
+        const bool preallocated = m_total > m_downloaded;
+        if ( preallocated )
+        {
+            // the server's size may be bigger than the feed said
+            if ( !HasFreeSpaceFor(m_dir, m_total - m_downloaded) )
+                throw DiskFullException();
+            m_file.Preallocate(m_total);
+        }
+
+        // Remember what we're downloading, so that we can continue if the
+        // download is interrupted. Without a validator, there's no way to
+        // tell if the file changed on the server, so don't even try then.
+        //
+        // A preallocated file's size doesn't tell how much of it was written
+        // until it's truncated when the download stops, so it can only be
+        // continued from afterwards, not if we crash before that.
+        m_resumable = !m_validator.empty();
+        if ( m_resumable && !preallocated )
+            SavePartial();
+        else
+            PartialDownload::Forget();
+    }
+
+    // The data from the previous download attempt have to be hashed too.
+    void HashPartialFile()
+    {
+        HashPartialFile(m_hasher);
+        HashPartialFile(m_sha256);
+    }
+
+    void HashPartialFile(std::unique_ptr<DataHasher>& hasher)
+    {
+        if ( !hasher )
+            return;
+        try
+        {
+            if ( hasher->UpdateFromFile(m_path) == m_startOffset )
+                return;
+        }
+        catch ( ... )
+        {
+        }
+        // hash the file after downloading it instead
+        hasher.reset();
+    }
+
+    void SavePartial()
+    {
+        PartialDownload partial;
+        partial.url = m_url;
+        partial.path = m_path;
+        partial.validator = m_validator;
+        partial.Save();
+    }
+
+    virtual void Add(const void *data, size_t len)
+    {
+        if ( !m_file.IsOpen() )
+            throw std::runtime_error("Filename is not net");
+
+        BackgroundPriority::Refresh();
+
+        // this doesn't wait for the data to be written, only for a free buffer
+        m_file.Write(data, len);
+        if ( m_hasher )
+            m_hasher->Update(data, len);
+        if ( m_sha256 )
+            m_sha256->Update(data, len);
+        m_downloaded += len;
+
+        NotifyProgress();
+
+        m_received += len;
+        if ( m_received >= m_allowance && (!m_total || m_downloaded < m_total) )
+            throw DataBudgetExhaustedException();
+    }
+
+    virtual bool IsCancelled() const
+    {
+        return m_thread.GetCancellationToken().IsCancelled();
+    }
+
+    virtual void *GetBuffer(size_t& len)
+    {
+        if ( !m_file.IsOpen() )
+            return NULL;
+
+        // receive the data right into the next buffer to be written out
+        return m_file.GetBuffer(len);
+    }
+
+    virtual void BeginSegmented(size_t len)
+    {
+        if ( !m_file.IsOpen() )
+            throw std::runtime_error("Filename is not net");
+
+        // A file with holes in it can't be resumed by appending to it.
+        PartialDownload::Forget();
+        m_resumable = false;
+
+        // data coming out of order can't be hashed as they arrive
+        m_hasher.reset();
+        m_sha256.reset();
+
+        m_total = len;
+        m_downloaded = 0;
+
+        // preallocate the file so that the segments can be written anywhere
+        m_file.Preallocate(len);
+    }
+
+    virtual std::wstring GetBackgroundTarget(const std::wstring& filename)
+    {
+        return m_dir + L"\\" + filename + PARTIAL_SUFFIX;
+    }
+
+    virtual std::string GetBackgroundJob() const
+    {
+        return m_resumeJob;
+    }
+
+    virtual void SetBackgroundJob(const std::string& job, const std::wstring& path)
+    {
+        m_path = path;
+
+        // the file is written by BITS, it has to be hashed afterwards
+        m_hasher.reset();
+        m_sha256.reset();
+
+        // Remember the transfer, the system continues it even if we exit.
+        PartialDownload partial;
+        partial.url = m_url;
+        partial.path = m_path;
+        partial.job = job;
+        partial.Save();
+    }
+
+    virtual void SetBackgroundProgress(size_t downloaded)
+    {
+        m_downloaded = downloaded;
+        NotifyProgress();
+    }
+
+    virtual void AddAt(size_t offset, const void *data, size_t len)
+    {
+        // Note: don't check m_thread's cancellation here, this is called
+        //       from other threads than m_thread and they check for
+        //       termination on their own.
+        CriticalSectionLocker lock(m_cs);
+
+        m_file.WriteAt(offset, data, len);
+        m_downloaded += len;
+
+        NotifyProgress();
+    }
+
+    void NotifyProgress()
+    {
+        // for win_sparkle_get_status(), even in the background
+        if ( m_status )
+            m_status->SetProgress(m_downloaded, m_total);
+
+        if ( !m_reportProgress )
+            return;
+
+        // This only stores the values for the UI to show them when it
+        // repaints, so it's cheap enough to do for every chunk.
+        UI::NotifyDownloadProgress(m_downloaded, m_total);
+
+        if ( m_hostProgressInterval >= 0 )
+            NotifyHostProgress();
+    }
+
+    // Tells the application, at most once per its interval.
+    void NotifyHostProgress()
+    {
+        const DWORD now = GetTickCount();
+        const DWORD elapsed = now - m_lastHostProgressTime;
+        const bool finished = m_total != 0 && m_downloaded >= m_total;
+        if ( m_hostProgressStarted && elapsed < DWORD(m_hostProgressInterval) && !finished )
+            return;
+
+        // speed since the previous call, not known for the first one
+        size_t bytesPerSecond = 0;
+        if ( m_hostProgressStarted && elapsed > 0 && m_downloaded >= m_lastHostProgressBytes )
+            bytesPerSecond = size_t((unsigned long long)(m_downloaded - m_lastHostProgressBytes) * 1000 / elapsed);
+
+        m_hostProgressStarted = true;
+        m_lastHostProgressTime = now;
+        m_lastHostProgressBytes = m_downloaded;
+
+        ApplicationController::NotifyDownloadProgress(m_downloaded, m_total, bytesPerSecond);
+    }
+
+    Thread& m_thread;
+    bool m_reportProgress;
+    size_t m_downloaded, m_total;
+    // see ApplicationController::GetDownloadProgressInterval()
+    int m_hostProgressInterval;
+    bool m_hostProgressStarted;
+    DWORD m_lastHostProgressTime;
+    size_t m_lastHostProgressBytes;
+    // the download's operation, see NotifyProgress()
+    StatusOperation *m_status;
+    AsyncFileWriter m_file;
+    std::string m_url;
+    std::wstring m_dir;
+    std::wstring m_path;
+
+    // partial file from a previous download attempt, if any
+    std::wstring m_resumePath;
+    std::string m_resumeValidator;
+    size_t m_resumeSize;
+    std::string m_resumeJob;
+
+    // where the data from the server start and their validator
+    size_t m_startOffset;
+    std::string m_validator;
+
+    // can the download be continued if it's interrupted?
+    bool m_resumable;
+
+    // hashes of the data written so far, NULL if they aren't being computed
+    std::unique_ptr<DataHasher> m_hasher;
+    std::unique_ptr<DataHasher> m_sha256;
+
+    ExpectedFile m_expected;
+
+    // data budget of background downloads, see SetDataBudget()
+    ConnectionCost m_cost;
+    unsigned long long m_allowance, m_received;
+    bool m_budgeted;
+
+    // guards writes done by AddAt()
+    CriticalSection m_cs;
+};
+
+
+
+// Looks up verified update in the cache, returns empty string if it's not
+// there or the update isn't signed.
+std::wstring FindCachedUpdate(const std::string& cacheKey)
+{
+    if ( cacheKey.empty() )
+        return std::wstring();
+    try
+    {
+        return UpdateCache::Find(cacheKey);
+    }
+    catch ( std::exception& e )
+    {
+        LogError(e.what()); // just download it again
+        return std::wstring();
+    }
+}
+
+
+// Lets the cache manager write out a file that was downloaded as temporary,
+// see UpdateDownloadSink::SetFilename(), because it's needed for longer.
+void MakeFilePersistent(const std::wstring& path)
+{
+    const DWORD attributes = GetFileAttributesW(path.c_str());
+    if ( attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_TEMPORARY) )
+        return;
+
+    if ( !SetFileAttributesW(path.c_str(), attributes & ~FILE_ATTRIBUTE_TEMPORARY) )
+        LogError("Cannot make the update file persistent.");
+}
+
+
+// Returns the file downloaded from @a url before WinSparkle was interrupted,
+// if the journal says it was complete and it's still there, unchanged in
+// size; otherwise returns empty string.
+std::wstring FindJournaledDownload(const std::string& url, const ExpectedFile& expected)
+{
+    const UpdateJournal::State state = UpdateJournal::GetState();
+    if ( !state.downloaded || state.finished || state.url != url || !state.size )
+        return std::wstring();
+    if ( expected.length && state.size != expected.length )
+        return std::wstring();
+    // don't let anybody trick us into using arbitrary files
+    if ( !IsUpdateTempDirectory(state.path) || GetExistingFileSize(state.path) != state.size )
+        return std::wstring();
+    return state.path;
+}
+
+
+// A single attempt of DownloadUpdateFile().
+std::wstring DownloadUpdateFileOnce(Thread& thread,
+                                    const std::string& url,
+                                    const std::string& source,
+                                    bool background,
+                                    const ExpectedFile& expected,
+                                    std::string& sha1,
+                                    DownloadResult *failure)
+{
+    // A download that completed before WinSparkle was interrupted only has
+    // to be verified again.
+    const std::wstring journaled = FindJournaledDownload(url, expected);
+    if ( !journaled.empty() )
+    {
+        LogInfo("Using the update downloaded before WinSparkle was interrupted.");
+        if ( !expected.sha256.empty() )
+        {
+            DataHasher sha256(Hash_SHA256);
+            sha256.UpdateFromFile(journaled);
+            if ( sha256.GetDigest() != expected.sha256 )
+            {
+                UpdateJournal::RecordFinished(); // so that it's removed
+                throw BadSignatureException("the update doesn't match its SHA-256 hash");
+            }
+        }
+        sha1.clear();
+        return journaled;
+    }
+
+    // Checked before anything is cleaned up, so that the partial download
+    // is kept for when there's budget again.
+    ConnectionCost cost = ConnectionCost_Unrestricted;
+    unsigned long long allowance = DataBudget::UNLIMITED;
+    if ( background )
+    {
+        cost = GetConnectionCost();
+        allowance = DataBudget::GetAllowance(cost);
+        if ( allowance == 0 )
+            throw DataBudgetExhaustedException();
+    }
+
+    // If a previous attempt to download the same file was interrupted,
+    // continue where it left off; otherwise start from scratch.
+    // Compressed downloads can't be resumed, ranges would refer to the
+    // compressed data, which aren't kept.
+    PartialDownload partial;
+    size_t partialSize = 0;
+    bool resume = false;
+    if ( !expected.compressed && partial.Load() && partial.url == url )
+    {
+        // a file downloaded with BITS only appears when it's complete
+        partialSize = GetExistingFileSize(partial.path);
+        resume = partialSize || !partial.job.empty();
+    }
+
+    std::wstring tmpdir;
+    if ( resume )
+    {
+        tmpdir = partial.path.substr(0, partial.path.find_last_of(L'\\'));
+    }
+    else
+    {
+        {
+            // before cleaning up, so that the journal doesn't keep the
+            // previous download around
+            Settings::Batch batch;
+            PartialDownload::Forget();
+            UpdateJournal::RecordDownloadStarted(url);
+            batch.Commit();
+        }
+        UpdateDownloader::CleanLeftovers();
+        tmpdir = CreateUniqueTempDirectory(expected.length);
+
+        CriticalSectionLocker lock(g_csTempDir);
+        Settings::WriteConfigValue("UpdateTempDir", tmpdir);
+    }
+
+    UpdateDownloadSink sink(thread, url, tmpdir, !background, expected);
+    if ( resume )
+        sink.ResumeFrom(partial, partialSize);
+    if ( background )
+        sink.SetDataBudget(cost, allowance);
+    // The data are decompressed on the fly, as they arrive, and the sink
+    // hashes the decompressed data for the signature.
+    int flags = expected.compressed ? Download_Compressed : (background ? 0 : Download_Segmented);
+    // the system services would download past the budget
+    if ( allowance == DataBudget::UNLIMITED )
+    {
+        if ( Settings::GetBITSDownload() )
+            flags |= Download_Background;
+        // only BITS and Delivery Optimization yield the network to other traffic
+        if ( background && Settings::GetLowPriorityDownloads() )
+            flags |= Download_Background | Download_LowPriority;
+        // other computers can only share the file with BITS
+        if ( Settings::GetPeerCaching() )
+            flags |= Download_Background | Download_PeerCaching;
+        if ( Settings::GetDeliveryOptimization() )
+            flags |= Download_DeliveryOptimization;
+    }
+    const DWORD start = GetTickCount();
+    const DownloadResult result = TryDownloadFile(source, &sink, &thread, flags);
+    if ( !result.Succeeded() )
+    {
+        // the partial file stays for resuming, e.g. from another mirror
+        if ( !failure )
+            result.ThrowIfFailed();
+        *failure = result;
+        return std::wstring();
+    }
+    sink.Close();
+    // only the rest of a resumed download was downloaded now
+    const size_t fileSize = GetExistingFileSize(sink.GetFilePath());
+    Stats::RecordUpdateDownload(fileSize > partialSize ? fileSize - partialSize : fileSize,
+                                GetTickCount() - start);
+
+    // the file is complete, nothing to resume anymore
+    PartialDownload::Forget();
+
+    try
+    {
+        sink.VerifySHA256();
+    }
+    catch ( BadSignatureException& e )
+    {
+        // the chunked signature, which is checked next, finds the damage
+        if ( !expected.repairable )
+            throw;
+        LogWarning(std::string("Downloaded update is damaged: ") + e.what());
+    }
+    UpdateJournal::RecordDownloaded(url, sink.GetFilePath(), fileSize);
+    if ( !sink.GetSHA1(sha1) )
+        sha1.clear();
+    return sink.GetFilePath();
+}
+
+
+// How many times a download that ended early or stalled is continued right
+// away.
+const unsigned MAX_INCOMPLETE_RESUMES = 3;
+
+// Downloads the file at @a source into a temporary directory and returns
+// its path. @a url identifies the file for resuming interrupted downloads;
+// it's the same as @a source unless the file is downloaded from a mirror.
+// If its SHA-1 hash could be computed during the download, it's stored in
+// @a sha1, otherwise @a sha1 is empty.
+//
+// If @a failure is given, an error response of the server and cancellation
+// are stored in it and an empty path is returned, instead of throwing.
+//
+// The file is checked against @a expected as it arrives. A download that
+// ended before all of the file was received, or in which the server stopped
+// sending data, is continued immediately.
+//
+// In background mode, the download isn't shown in the UI and uses a single
+// connection, to interfere with the user's work as little as possible.
+std::wstring DownloadUpdateFile(Thread& thread,
+                                const std::string& url,
+                                const std::string& source,
+                                bool background,
+                                const ExpectedFile& expected,
+                                std::string& sha1,
+                                DownloadResult *failure = NULL)
+{
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_DOWNLOAD);
+
+    for ( unsigned attempt = 0; ; attempt++ )
+    {
+        try
+        {
+            return DownloadUpdateFileOnce(thread, url, source, background, expected, sha1, failure);
+        }
+        catch ( IncompleteDownloadException& e )
+        {
+            if ( attempt == MAX_INCOMPLETE_RESUMES )
+                throw;
+            LogWarning(std::string(e.what()) + " Continuing the download.");
+        }
+        catch ( DownloadTimeoutException& e )
+        {
+            // a new connection is likely faster than waiting for this one
+            if ( e.GetKind() != DownloadTimeoutException::Timeout_Stall ||
+                 attempt == MAX_INCOMPLETE_RESUMES )
+            {
+                throw;
+            }
+            LogWarning(std::string(e.what()) + " Continuing the download.");
+        }
+    }
+}
+
+
+// Downloads the full update like DownloadUpdateFile(), from the fastest of
+// the servers hosting it. If the download fails, tries the other servers,
+// continuing the interrupted download if they have the same file.
+std::wstring DownloadUpdateFromMirrors(Thread& thread,
+                                       const Appcast& appcast,
+                                       bool background,
+                                       std::string& sha1)
+{
+    const std::vector<std::string> servers =
+        RankServersByLatency(appcast.GetDownloadURLs(), &thread);
+
+    const ExpectedFile expected = GetExpectedFile(appcast);
+
+    for ( size_t i = 0; ; i++ )
+    {
+        DownloadResult failure;
+        try
+        {
+            const std::wstring path = DownloadUpdateFile(thread, appcast.DownloadURL, servers[i],
+                                                         background, expected, sha1, &failure);
+            if ( !path.empty() )
+                return path;
+        }
+        catch ( DataBudgetExhaustedException& )
+        {
+            // a mirror wouldn't be any cheaper
+            throw;
+        }
+        catch ( std::exception& e )
+        {
+            if ( i + 1 == servers.size() )
+                throw;
+            LogWarning("Cannot download update from " + servers[i] + ", trying " +
+                     servers[i + 1] + ": " + e.what());
+            continue;
+        }
+
+        // a mirror without the file is tried past without unwinding
+        if ( failure.status == DownloadResult::Status_Cancelled || i + 1 == servers.size() )
+            failure.ThrowIfFailed();
+        LogWarning("Cannot download update from " + servers[i] + ", trying " +
+                 servers[i + 1] + ": " + failure.Describe());
+    }
+}
+
+
+// Verifies the downloaded file's signature, throws BadSignatureException if
+// it doesn't match. @a sha1 is the file's SHA-1 hash, if already known.
+void VerifyUpdateFile(Thread& thread,
+                      const std::wstring& path,
+                      const std::string& edSignature,
+                      const std::string& edChunkedSignature,
+                      const std::string& dsaSignature,
+                      const std::string& sha1)
+{
+    AllocationScope allocScope(WIN_SPARKLE_STATS_PHASE_VERIFY);
+    const TraceTimer timer;
+    const char *method;
+
+    if (Settings::HasEdDSAPubKey())
+    {
+        // EdDSA is preferred if configured, don't fall back to DSA then;
+        // the chunked signature is faster to check for big files
+        if (!edChunkedSignature.empty())
+        {
+            method = "EdDSAChunked";
+            SignatureVerifier::VerifyEdDSAChunkedSignatureValid(path, edChunkedSignature,
+                                                                &thread.GetCancellationToken());
+        }
+        else
+        {
+            method = "EdDSA";
+            SignatureVerifier::VerifyEdDSASignatureValid(path, edSignature,
+                                                         &thread.GetCancellationToken());
+        }
+    }
+    else if (Settings::HasDSAPubKey())
+    {
+        if ( !sha1.empty() )
+        {
+            method = "DSADigest";
+            SignatureVerifier::VerifyDSASHA1DigestSignatureValid(sha1, dsaSignature);
+        }
+        else
+        {
+            method = "DSA";
+            SignatureVerifier::VerifyDSASHA1SignatureValid(path, dsaSignature);
+        }
+    }
+    else
+    {
+        // backward compatibility - accept as is, but complain about it
+        LogError("Using unsigned updates!");
+        return;
+    }
+
+    const unsigned long long duration = timer.GetMicroseconds();
+    const size_t size = GetExistingFileSize(path);
+    TraceEvent("SignatureVerified")
+        .Field("Method", method)
+        .Field("Bytes", size)
+        .Field("DurationUs", duration)
+        .Field("BytesPerSecond", duration ? size * 1000000ULL / duration : 0)
+        .Write();
+
+    // the file was hashed while it was being downloaded, so only the
+    // signature of the hash was checked
+    if ( sha1.empty() || Settings::HasEdDSAPubKey() )
+        Stats::RecordVerification(size, unsigned(duration / 1000));
+}
+
+
+// Verifies the Authenticode signature of an update on its own thread, so
+// that WinVerifyTrust(), which may wait for certificate revocation lists,
+// runs at the same time as VerifyUpdateFile().
+class AuthenticodeVerifier : public Thread
+{
+public:
+    AuthenticodeVerifier(const std::wstring& path)
+        : Thread("WinSparkle Authenticode verifier"), m_path(path) {}
+
+    // Throws the verification's error, if any, once it's joined.
+    void RethrowError() const
+    {
+        if ( m_error )
+            std::rethrow_exception(m_error);
+    }
+
+protected:
+    virtual void Run()
+    {
+        SignalReady();
+        try
+        {
+            SignatureVerifier::VerifyAuthenticodeSignatureValid(m_path);
+        }
+        catch ( ... )
+        {
+            m_error = std::current_exception();
+        }
+    }
+
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    std::wstring m_path;
+    std::exception_ptr m_error;
+};
+
+
+// Identifies what VerifyInstallerFile() checks the file against, for
+// remembering its result in the update journal.
+std::string GetVerificationKey(const Appcast& appcast, const std::string& sha1)
+{
+    DataHasher hasher(Hash_SHA256);
+    const std::string parts[] = { appcast.EdDSASignature, appcast.EdDSAChunkedSignature,
+                                  appcast.DsaSignature, sha1 };
+    for ( size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i )
+    {
+        const unsigned long len = (unsigned long)parts[i].length();
+        hasher.Update(&len, sizeof(len));
+        hasher.Update(parts[i].data(), parts[i].length());
+    }
+    const char authenticode = Settings::GetAuthenticodeCheck() ? 1 : 0;
+    hasher.Update(&authenticode, 1);
+    return hasher.GetDigest();
+}
+
+
+// Verifies the update's installer like VerifyUpdateFile() and, if enabled
+// with win_sparkle_set_authenticode_check(), its Authenticode signature in
+// parallel.
+//
+// The file can't be modified while it's verified, and verifying it again
+// while it stays unchanged is skipped: the result is kept in the journal.
+void VerifyInstallerFile(Thread& thread,
+                         const std::wstring& path,
+                         const Appcast& appcast,
+                         const std::string& sha1)
+{
+    const FileVerificationLock lock(path);
+    const std::string key = GetVerificationKey(appcast, sha1);
+    if ( UpdateJournal::IsVerified(lock.GetStamp(), key) )
+    {
+        TraceEvent("SignatureVerificationReused")
+            .Field("Bytes", GetExistingFileSize(path))
+            .Write();
+        return;
+    }
+
+    std::unique_ptr<AuthenticodeVerifier> authenticode;
+    if ( Settings::GetAuthenticodeCheck() )
+    {
+        authenticode.reset(new AuthenticodeVerifier(path));
+        authenticode->Start();
+    }
+
+    try
+    {
+        VerifyUpdateFile(thread, path, appcast.EdDSASignature, appcast.EdDSAChunkedSignature,
+                         appcast.DsaSignature, sha1);
+        if ( authenticode )
+            authenticode->JoinWithTerminationCheck(thread);
+    }
+    catch ( ... )
+    {
+        // WinVerifyTrust() can't be interrupted, but doesn't take long
+        // once the revocation lookups time out
+        if ( authenticode )
+            authenticode->TerminateAndJoin();
+        throw;
+    }
+
+    if ( authenticode )
+        authenticode->RethrowError();
+
+    if ( !lock.GetStamp().empty() )
+        UpdateJournal::RecordVerificationResult(lock.GetStamp(), key);
+}
+
+
+// Receives a chunk downloaded by RepairUpdateFile() into memory, so that it
+// can be checked before it is written over the damaged data.
+struct ChunkDownloadSink : public IRandomAccessDownloadSink
+{
+    ChunkDownloadSink(size_t offset, size_t length)
+        : m_offset(offset), m_data(length, '\0') {}
+
+    const std::string& GetData() const { return m_data; }
+
+    virtual void SetLength(size_t) {}
+    virtual void SetFilename(const std::wstring&) {}
+    virtual void BeginSegmented(size_t) {}
+
+    virtual void Add(const void *, size_t)
+    {
+        throw std::logic_error("Chunks must be downloaded with range requests.");
+    }
+
+    virtual void AddAt(size_t offset, const void *data, size_t len)
+    {
+        if ( offset < m_offset || offset - m_offset > m_data.size() ||
+             len > m_data.size() - (offset - m_offset) )
+            throw std::runtime_error("Unexpected data received from the server.");
+        memcpy(&m_data[offset - m_offset], data, len);
+    }
+
+private:
+    size_t m_offset;
+    std::string m_data;
+};
+
+
+// Writes @a data at @a offset of the existing file.
+void WriteFileAt(const std::wstring& path, size_t offset, const std::string& data)
+{
+    HANDLE f = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( f == INVALID_HANDLE_VALUE )
+        throw Win32Exception("Cannot repair the update file");
+
+    OVERLAPPED ov = { 0 };
+    ov.Offset = DWORD(ULONGLONG(offset) & 0xFFFFFFFF);
+    ov.OffsetHigh = DWORD(ULONGLONG(offset) >> 32);
+    DWORD written = 0;
+    const BOOL ok = WriteFile(f, data.data(), DWORD(data.size()), &written, &ov);
+    CloseHandle(f);
+    if ( !ok || written != data.size() )
+        throw Win32Exception("Cannot repair the update file");
+}
+
+
+// Repairs the downloaded update at @a path if it failed verification and
+// the appcast has its chunk manifest: only the chunks that don't match
+// their signed hashes are downloaded again, with range requests, and
+// written over the damaged data. Returns false if this can't be done, e.g.
+// because the file is truncated or most of it is damaged; it must then be
+// downloaded again.
+bool RepairUpdateFile(Thread& thread, const Appcast& appcast, const std::wstring& path)
+{
+    if ( !GetExpectedFile(appcast).repairable )
+        return false;
+
+    try
+    {
+        const TraceTimer timer;
+        const size_t chunkSize = SignatureVerifier::CHUNKED_DIGEST_CHUNK_SIZE;
+        const size_t hashSize = HashEngine::GetDigestSize(Hash_SHA256);
+        const size_t size = GetExistingFileSize(path);
+        const size_t chunks = (size + chunkSize - 1) / chunkSize;
+        if ( chunks == 0 )
+            return false;
+
+        // The hashes are only trusted if they are the signed ones, so a
+        // truncated file (or manifest) can't be repaired this way.
+        StringDownloadSink manifest(chunks * hashSize);
+        DownloadFile(appcast.ChunkManifestURL, &manifest, &thread);
+        if ( manifest.data.size() != chunks * hashSize )
+        {
+            LogWarning("The update's chunk manifest doesn't match the downloaded file.");
+            return false;
+        }
+        SignatureVerifier::VerifyEdDSAChunkHashesValid(manifest.data, appcast.EdDSAChunkedSignature);
+
+        // this only reads the file, which is much faster than downloading it
+        const std::string hashes = SignatureVerifier::ComputeChunkHashes(path, &thread.GetCancellationToken());
+        std::vector<size_t> damaged;
+        for ( size_t i = 0; i < chunks; i++ )
+        {
+            if ( hashes.compare(i * hashSize, hashSize, manifest.data, i * hashSize, hashSize) != 0 )
+                damaged.push_back(i);
+        }
+
+        // Most likely a different file; downloading it again in one piece
+        // is faster than by chunks.
+        if ( damaged.empty() || damaged.size() > chunks / 2 )
+            return false;
+
+        std::ostringstream msg;
+        msg << damaged.size() << " of " << chunks << " chunks of the update are damaged, downloading them again.";
+        LogWarning(msg.str());
+
+        const std::vector<std::string> servers = appcast.GetDownloadURLs();
+        size_t repairedBytes = 0;
+        for ( size_t i = 0; i < damaged.size(); i++ )
+        {
+            const size_t offset = damaged[i] * chunkSize;
+            const size_t len = size - offset < chunkSize ? size - offset : chunkSize;
+            const std::string expected = manifest.data.substr(damaged[i] * hashSize, hashSize);
+
+            // the same proxy may damage the chunk again, try the mirrors too
+            bool repaired = false;
+            for ( size_t s = 0; s < servers.size() && !repaired; s++ )
+            {
+                try
+                {
+                    ChunkDownloadSink sink(offset, len);
+                    DownloadFileRange(servers[s], offset, len, &sink, &thread);
+                    if ( HashEngine::HashData(Hash_SHA256, sink.GetData().data(), len) != expected )
+                        throw std::runtime_error("The downloaded chunk doesn't match its hash.");
+                    WriteFileAt(path, offset, sink.GetData());
+                    repaired = true;
+                }
+                catch ( std::exception& e )
+                {
+                    LogWarning("Cannot download chunk of the update from " + servers[s] + ": " + e.what());
+                }
+            }
+            if ( !repaired )
+                return false;
+            repairedBytes += len;
+        }
+
+        TraceEvent("UpdateRepaired")
+            .Field("Chunks", chunks)
+            .Field("DamagedChunks", damaged.size())
+            .Field("Bytes", repairedBytes)
+            .Field("DurationUs", timer.GetMicroseconds())
+            .Write();
+        return true;
+    }
+    catch ( std::exception& e )
+    {
+        LogWarning(std::string("Cannot repair the update: ") + e.what());
+        return false;
+    }
+}
+
+
+// Verifies the downloaded update like VerifyInstallerFile(). If it is
+// damaged, repairs it with RepairUpdateFile() and verifies it again.
+void VerifyOrRepairInstallerFile(Thread& thread,
+                                 const std::wstring& path,
+                                 const Appcast& appcast,
+                                 const std::string& sha1)
+{
+    try
+    {
+        VerifyInstallerFile(thread, path, appcast, sha1);
+    }
+    catch ( BadSignatureException& e )
+    {
+        if ( !RepairUpdateFile(thread, appcast, path) )
+            throw;
+        LogInfo(std::string("Repaired the damaged update (") + e.what() + ").");
+        // the whole file is still checked, including its Authenticode signature
+        VerifyInstallerFile(thread, path, appcast, std::string());
+    }
+}
+
+
+// Tries to reconstruct the update from its delta and the installer of the
+// installed version, kept in the cache since it was installed. Returns
+// path to the verified update file, or empty string if it couldn't be
+// done and the full update has to be downloaded.
+std::wstring DownloadAndApplyDelta(Thread& thread, const Appcast& appcast, bool background)
+{
+    try
+    {
+        if ( !appcast.HasDelta() ||
+             appcast.DeltaFrom != Settings::GetAppBuildVersionUTF8() )
+            return std::wstring();
+
+        const std::wstring base = UpdateCache::FindVersion(appcast.DeltaFrom);
+        if ( base.empty() )
+            return std::wstring();
+
+        std::string sha1;
+        const std::wstring delta = DownloadUpdateFile(thread, appcast.DeltaURL, appcast.DeltaURL, background,
+                                                       ExpectedFile(), sha1);
+        // don't let untrusted data anywhere near the patching code
+        VerifyUpdateFile(thread, delta, appcast.DeltaEdDSASignature, std::string(), appcast.DeltaDsaSignature, sha1);
+
+        const std::wstring target = delta.substr(0, delta.find_last_of(L'\\') + 1) +
+                                    GetURLFileName(appcast.DownloadURL.c_str());
+        if ( !ApplyDeltaPatch(base, delta, target) )
+            return std::wstring();
+        _wremove(delta.c_str());
+
+        // the result must be exactly the full update
+        VerifyInstallerFile(thread, target, appcast, std::string());
+        return target;
+    }
+    catch ( std::exception& e )
+    {
+        LogError(std::string("Cannot use delta update, downloading full update: ") + e.what());
+        return std::wstring();
+    }
+}
+
+
+// Name of the directory next to the installer that the update's components
+// are downloaded to, see Appcast::GetComponents().
+const wchar_t COMPONENTS_DIR[] = L"components";
+
+// Written to COMPONENTS_DIR once all of the components are verified.
+const wchar_t COMPONENTS_COMPLETE_MARKER[] = L".complete";
+
+// Maximum number of components downloaded at the same time.
+const int MAX_PARALLEL_COMPONENTS = 3;
+
+
+// Writes downloaded component of the update to a file.
+struct ComponentDownloadSink : public IDownloadSink
+{
+    ComponentDownloadSink(Thread& thread, const std::wstring& dir, const ExpectedFile& expected)
+        : m_thread(thread), m_dir(dir),
+          m_downloaded(0), m_total(0),
+          m_expected(expected)
+    {
+        if ( !expected.sha256.empty() )
+            m_sha256.reset(new DataHasher(Hash_SHA256));
+    }
+
+    ~ComponentDownloadSink()
+    {
+        if ( m_file.IsOpen() )
+            m_file.Abort();
+    }
+
+    // Finishes writing the file and checks its SHA-256 hash if the appcast
+    // gives it. Returns path to the (still partial-named) file.
+    std::wstring Close()
+    {
+        if ( m_path.empty() )
+            throw std::runtime_error("No update component was downloaded.");
+
+        const size_t total = m_total ? m_total : m_expected.length;
+        if ( total && m_downloaded < total )
+            throw std::runtime_error("Incomplete download of the update component.");
+        m_file.Close();
+
+        if ( m_sha256 && m_sha256->GetDigest() != m_expected.sha256 )
+            throw BadSignatureException("the update component doesn't match its SHA-256 hash");
+        return m_path;
+    }
+
+    virtual void SetLength(size_t l)
+    {
+        m_total = l;
+    }
+
+    virtual void SetFilename(const std::wstring& filename)
+    {
+        if ( m_file.IsOpen() )
+            throw std::runtime_error("Update component file already set");
+
+        m_path = m_dir + L"\\" + filename + PARTIAL_SUFFIX;
+        m_file.Open(m_path, false);
+        if ( m_total )
+            m_file.Preallocate(m_total);
+    }
+
+    virtual void Add(const void *data, size_t len)
+    {
+        if ( !m_file.IsOpen() )
+            throw std::runtime_error("Filename is not net");
+
+        m_file.Write(data, len);
+        if ( m_sha256 )
+            m_sha256->Update(data, len);
+        m_downloaded += len;
+    }
+
+    virtual bool IsCancelled() const
+    {
+        return m_thread.GetCancellationToken().IsCancelled();
+    }
+
+    Thread& m_thread;
+    std::wstring m_dir;
+    std::wstring m_path;
+    size_t m_downloaded, m_total;
+    AsyncFileWriter m_file;
+    std::unique_ptr<DataHasher> m_sha256;
+    ExpectedFile m_expected;
+};
+
+
+// What the ComponentDownloader threads of one DownloadComponents() call share.
+struct ComponentQueue
+{
+    ComponentQueue(const std::vector<AppcastComponent>& components_, const std::wstring& dir_)
+        : components(components_), dir(dir_), next(0), badSignature(0) {}
+
+    // components in the order they are downloaded in
+    const std::vector<AppcastComponent>& components;
+    // where they are downloaded to
+    std::wstring dir;
+    // index of the next component to download
+    volatile LONG next;
+    // set if any of the components failed verification
+    volatile LONG badSignature;
+};
+
+
+// Downloads and verifies components from the queue until there are none left.
+class ComponentDownloader : public Thread
+{
+public:
+    ComponentDownloader(ComponentQueue& queue)
+        : Thread("WinSparkle component download"), m_queue(queue)
+    {
+    }
+
+    /// Returns error message if a component couldn't be downloaded.
+    const std::string& GetError() const { return m_error; }
+
+protected:
+    virtual void Run()
+    {
+        // no initialization to do, so signal readiness immediately
+        SignalReady();
+
+        try
+        {
+            for ( ;; )
+            {
+                const size_t i = size_t(InterlockedIncrement(&m_queue.next) - 1);
+                if ( i >= m_queue.components.size() )
+                    break;
+                DownloadComponent(m_queue.components[i]);
+            }
+            return;
+        }
+        catch (TerminateThreadException&)
+        {
+            m_error = "Download cancelled.";
+            throw;
+        }
+        catch (BadSignatureException& e)
+        {
+            InterlockedExchange(&m_queue.badSignature, 1);
+            m_error = e.what();
+        }
+        catch (const std::exception& e)
+        {
+            m_error = e.what();
+        }
+        catch (...)
+        {
+            m_error = "Unknown error.";
+        }
+
+        // the update can't be installed anyway, don't start any more downloads
+        InterlockedExchange(&m_queue.next, LONG(m_queue.components.size()));
+    }
+
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    void DownloadComponent(const AppcastComponent& component)
+    {
+        ComponentDownloadSink sink(*this, m_queue.dir,
+                                   GetExpectedFile(component.Length, component.Sha256));
+        DownloadFile(component.DownloadURL, &sink, this);
+        const std::wstring path = sink.Close();
+
+        VerifyUpdateFile(*this, path, component.EdDSASignature, std::string(),
+                         component.DsaSignature, std::string());
+
+        // don't replace another component with the same name
+        const std::wstring finalPath = path.substr(0, path.length() - wcslen(PARTIAL_SUFFIX));
+        if ( !MoveFileExW(path.c_str(), finalPath.c_str(), 0) )
+            throw Win32Exception("Cannot rename the update component file");
+    }
+
+    ComponentQueue& m_queue;
+    std::string m_error;
+};
+
+
+// Owns running ComponentDownloader threads; cancels them if not joined.
+class ComponentDownloaders
+{
+public:
+    ~ComponentDownloaders()
+    {
+        for ( size_t i = 0; i < m_threads.size(); i++ )
+        {
+            m_threads[i]->TerminateAndJoin();
+            delete m_threads[i];
+        }
+    }
+
+    void Start(ComponentDownloader *thread)
+    {
+        m_threads.push_back(thread);
+        thread->Start();
+    }
+
+    // Waits for all threads to finish, returns the first error, if any.
+    std::string JoinAll(Thread& onThread)
+    {
+        std::string error;
+        for ( size_t i = 0; i < m_threads.size(); i++ )
+        {
+            m_threads[i]->JoinWithTerminationCheck(onThread);
+            if ( error.empty() )
+                error = m_threads[i]->GetError();
+        }
+        return error;
+    }
+
+private:
+    std::vector<ComponentDownloader*> m_threads;
+};
+
+
+// Downloads and verifies the deltas of a chain one after another, while
+// DownloadAndApplyDeltaChain() applies the ones already downloaded.
+class DeltaChainDownloader : public Thread
+{
+public:
+    DeltaChainDownloader(const std::vector<AppcastDelta>& chain, const std::wstring& dir)
+        : Thread("WinSparkle delta download"),
+          m_chain(chain), m_dir(dir), m_paths(chain.size()),
+          m_ready(0), m_done(0), m_badSignature(false)
+    {
+    }
+
+    /**
+        Waits until the @a index-th delta is verified and returns its path.
+        Throws if it couldn't be downloaded or @a waiter is terminated.
+     */
+    std::wstring WaitForDelta(Thread& waiter, size_t index)
+    {
+        for ( ;; )
+        {
+            if ( size_t(m_ready) > index )
+                return m_paths[index];
+            if ( m_done )
+            {
+                if ( m_badSignature )
+                    throw BadSignatureException(m_error);
+                throw std::runtime_error("Cannot download delta update: " + m_error);
+            }
+            waiter.WaitWithTerminationCheck(m_progress);
+        }
+    }
+
+protected:
+    virtual void Run()
+    {
+        // no initialization to do, so signal readiness immediately
+        SignalReady();
+
+        try
+        {
+            for ( size_t i = 0; i < m_chain.size(); i++ )
+            {
+                m_paths[i] = DownloadDelta(i);
+                InterlockedIncrement(&m_ready);
+                m_progress.Signal();
+            }
+        }
+        catch ( TerminateThreadException& )
+        {
+            m_error = "Download cancelled.";
+        }
+        catch ( BadSignatureException& e )
+        {
+            m_badSignature = true;
+            m_error = e.what();
+        }
+        catch ( const std::exception& e )
+        {
+            m_error = e.what();
+        }
+        catch ( ... )
+        {
+            m_error = "Unknown error.";
+        }
+
+        InterlockedExchange(&m_done, 1);
+        m_progress.Signal();
+    }
+
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    std::wstring DownloadDelta(size_t index)
+    {
+        const AppcastDelta& delta = m_chain[index];
+
+        ComponentDownloadSink sink(*this, m_dir, ExpectedFile());
+        DownloadFile(delta.URL, &sink, this);
+        const std::wstring path = sink.Close();
+
+        // don't let untrusted data anywhere near the patching code
+        VerifyUpdateFile(*this, path, delta.EdDSASignature, std::string(),
+                         delta.DsaSignature, std::string());
+
+        // the deltas' file names needn't differ
+        const std::wstring finalPath = m_dir + L"\\" + std::to_wstring((unsigned long long)index) + L".delta";
+        if ( !MoveFileExW(path.c_str(), finalPath.c_str(), 0) )
+            throw Win32Exception("Cannot rename the delta update file");
+        return finalPath;
+    }
+
+    const std::vector<AppcastDelta>& m_chain;
+    std::wstring m_dir;
+    // written before m_ready is incremented, read only after that
+    std::vector<std::wstring> m_paths;
+    volatile LONG m_ready;
+    volatile LONG m_done;
+    Event m_progress;
+    // set before m_done
+    bool m_badSignature;
+    std::string m_error;
+};
+
+
+// Reconstructs the update by applying the chain of deltas to the installer
+// of the installed version, kept in the cache since it was installed, see
+// Appcast::GetDeltaChain(). Each delta is applied as soon as it's verified,
+// while the next ones are being downloaded. Returns path to the verified
+// update file, or empty string if it couldn't be done and the full update
+// has to be downloaded.
+std::wstring DownloadAndApplyDeltaChain(Thread& thread, const Appcast& appcast, bool background)
+{
+    try
+    {
+        const std::vector<AppcastDelta> chain = appcast.GetDeltaChain();
+        if ( chain.empty() || chain[0].From != Settings::GetAppBuildVersionUTF8() )
+            return std::wstring();
+
+        std::wstring base = UpdateCache::FindVersion(chain[0].From);
+        if ( base.empty() )
+            return std::wstring();
+
+        // the full download would fail on this too
+        if ( background && DataBudget::GetAllowance(GetConnectionCost()) == 0 )
+            return std::wstring();
+
+        // the chain replaces any interrupted download, like a new download would
+        PartialDownload::Forget();
+        UpdateDownloader::CleanLeftovers();
+        const std::wstring tmpdir = CreateUniqueTempDirectory(GetExistingFileSize(base));
+        {
+            CriticalSectionLocker lock(g_csTempDir);
+            Settings::WriteConfigValue("UpdateTempDir", tmpdir);
+        }
+
+        const DWORD start = GetTickCount();
+        const std::wstring target = tmpdir + L"\\" + GetURLFileName(appcast.DownloadURL.c_str());
+        DeltaChainDownloader *downloader = new DeltaChainDownloader(chain, tmpdir);
+        try
+        {
+            downloader->Start();
+            for ( size_t i = 0; i < chain.size(); i++ )
+            {
+                const std::wstring delta = downloader->WaitForDelta(thread, i);
+
+                // only the last step's output is the update, the others are
+                // removed as soon as the next step has used them
+                const std::wstring output = i + 1 == chain.size()
+                                            ? target
+                                            : tmpdir + L"\\" + std::to_wstring((unsigned long long)i) + L".step";
+                if ( !ApplyDeltaPatch(base, delta, output) )
+                    throw std::runtime_error("Delta updates are not supported by the system.");
+                _wremove(delta.c_str());
+                if ( i > 0 )
+                    _wremove(base.c_str());
+                base = output;
+            }
+            downloader->JoinWithTerminationCheck(thread);
+        }
+        catch ( ... )
+        {
+            downloader->TerminateAndJoin();
+            delete downloader;
+            throw;
+        }
+        delete downloader;
+
+        TraceEvent("DeltaChainApplied")
+            .Field("Steps", unsigned(chain.size()))
+            .Field("DurationMs", unsigned(GetTickCount() - start))
+            .Write();
+
+        // the result must be exactly the full update
+        VerifyInstallerFile(thread, target, appcast, std::string());
+        return target;
+    }
+    catch ( OperationCancelledException& )
+    {
+        throw;
+    }
+    catch ( std::exception& e )
+    {
+        LogError(std::string("Cannot use delta updates, downloading full update: ") + e.what());
+        return std::wstring();
+    }
+}
+
+
+// Downloads the additional packages of the update, if it has any, into
+// COMPONENTS_DIR next to its verified installer @a updateFile, where the
+// installer finds them. The update can only be installed with all of them,
+// so this throws if any of them can't be downloaded or verified.
+//
+// Several components are downloaded in parallel, in the order of their
+// priority, except in background mode (see DownloadUpdateFile()).
+void DownloadComponents(Thread& thread,
+                        const Appcast& appcast,
+                        const std::wstring& updateFile,
+                        bool background)
+{
+    if ( !appcast.HasComponents() )
+        return;
+    const std::vector<AppcastComponent> components = appcast.GetComponents();
+    if ( components.empty() )
+        return;
+
+    const std::wstring dir = updateFile.substr(0, updateFile.find_last_of(L'\\') + 1) + COMPONENTS_DIR;
+    const std::wstring marker = dir + L"\\" + COMPONENTS_COMPLETE_MARKER;
+
+    // downloaded together with the cached installer before
+    if ( GetFileAttributesW(marker.c_str()) != INVALID_FILE_ATTRIBUTES )
+        return;
+
+    // anything there is left from an interrupted download
+    DeleteDirectoryTree(dir, &thread);
+    if ( !CreateDirectoryW(dir.c_str(), NULL) )
+        throw Win32Exception("Cannot create directory for the update components");
+
+    int parallel = background ? 1 : MAX_PARALLEL_COMPONENTS;
+    const int maxConnections = Settings::GetHttpMaxConnectionsPerServer();
+    if ( maxConnections > 0 && parallel > maxConnections )
+        parallel = maxConnections;
+    if ( parallel > int(components.size()) )
+        parallel = int(components.size());
+
+    const DWORD start = GetTickCount();
+    ComponentQueue queue(components, dir);
+    {
+        ComponentDownloaders workers;
+        for ( int i = 0; i < parallel; i++ )
+            workers.Start(new ComponentDownloader(queue));
+
+        const std::string error = workers.JoinAll(thread);
+        if ( queue.badSignature )
+            throw BadSignatureException(error);
+        if ( !error.empty() )
+            throw std::runtime_error("Cannot download update component: " + error);
+    }
+
+    HANDLE f = CreateFileW(marker.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( f == INVALID_HANDLE_VALUE )
+        throw Win32Exception("Cannot write the update components");
+    CloseHandle(f);
+
+    TraceEvent("ComponentsDownloaded")
+        .Field("Count", unsigned(components.size()))
+        .Field("Parallel", unsigned(parallel))
+        .Field("DurationMs", unsigned(GetTickCount() - start))
+        .Write();
+}
+
+
+// Are updates shared with the other users of the computer? Those using the
+// service agent get the updates it downloads that way.
+bool IsUpdateSharingEnabled()
+{
+    return Settings::GetSharedUpdateCache() || Settings::GetUseServiceAgent();
+}
+
+// Copies @a appcast's update file @a source, named @a name, into a new
+// temporary directory and verifies the copy, as if it was downloaded.
+// Returns path to the verified file, throws on error.
+std::wstring CopyAndVerifyUpdate(Thread& thread,
+                                 const Appcast& appcast,
+                                 const std::wstring& source,
+                                 const std::wstring& name)
+{
+    // the copy replaces any interrupted download, like a new download would
+    PartialDownload::Forget();
+    UpdateDownloader::CleanLeftovers();
+    const std::wstring tmpdir = CreateUniqueTempDirectory(GetExistingFileSize(source));
+    {
+        CriticalSectionLocker lock(g_csTempDir);
+        Settings::WriteConfigValue("UpdateTempDir", tmpdir);
+    }
+
+    // verify our own copy, the source could be changed meanwhile
+    const std::wstring path = tmpdir + L"\\" + name + PARTIAL_SUFFIX;
+    if ( !CopyFileW(source.c_str(), path.c_str(), TRUE) )
+        throw Win32Exception("Cannot copy the update file");
+    VerifyInstallerFile(thread, path, appcast, std::string());
+
+    return RenameVerifiedFile(path);
+}
+
+
+// Copies the update from the cache shared by all users of the computer, if
+// it's there, into a new temporary directory and verifies it. Returns path
+// to the verified file, or empty string if it has to be downloaded.
+std::wstring CopySharedUpdate(Thread& thread, const Appcast& appcast, const std::string& cacheKey)
+{
+    if ( cacheKey.empty() || !IsUpdateSharingEnabled() )
+        return std::wstring();
+
+    try
+    {
+        std::wstring name;
+        const std::wstring shared = UpdateCache::FindShared(cacheKey, name);
+        if ( shared.empty() )
+            return std::wstring();
+
+        const std::wstring path = CopyAndVerifyUpdate(thread, appcast, shared, name);
+        Stats::AddBytesSavedByCache(GetExistingFileSize(path));
+        return path;
+    }
+    catch ( std::exception& e )
+    {
+        LogError(std::string("Cannot use update from the shared cache, downloading it: ") + e.what());
+        return std::wstring();
+    }
 }
 
-std::wstring CreateUniqueTempDirectory()
+
+// Offers the verified update file to the other users of the computer, if
+// enabled, see CopySharedUpdate().
+void ShareUpdate(const std::wstring& updateFile, const std::string& cacheKey)
 {
-    // We need to put downloaded updates into a directory of their own, because
-    // if we put it in $TMP, some DLLs could be there and interfere with the
-    // installer.
-    //
-    // This code creates a new randomized directory name and tries to create it;
-    // this process is repeated if the directory already exists.
-    const std::wstring tmpdir = GetUniqueTempDirectoryPrefix();
+    if ( cacheKey.empty() || !IsUpdateSharingEnabled() )
+        return;
 
-    for ( ;; )
+    try
     {
-        std::wstring dir(tmpdir);
-        UUID uuid;
-        UuidCreate(&uuid);
-        RPC_WSTR uuidStr;
-        RPC_STATUS status = UuidToString(&uuid, &uuidStr);
-        dir += reinterpret_cast<wchar_t*>(uuidStr);
-        RpcStringFree(&uuidStr);
-
-        if ( CreateDirectory(dir.c_str(), NULL) )
-            return dir;
-        else if ( GetLastError() != ERROR_ALREADY_EXISTS )
-            throw Win32Exception("Cannot create temporary directory");
+        UpdateCache::StoreShared(cacheKey, updateFile);
+    }
+    catch ( std::exception& e )
+    {
+        // not fatal, the others just download it themselves
+        LogError(e.what());
     }
 }
 
-struct UpdateDownloadSink : public IDownloadSink
-{
-    UpdateDownloadSink(Thread& thread, const std::wstring& dir)
-        : m_thread(thread),
-          m_dir(dir), m_file(NULL),
-          m_downloaded(0), m_total(0), m_lastUpdate(-1)
-    {}
 
-    ~UpdateDownloadSink() { Close(); }
+// Opens the verified installer the way launching it does, at low priority,
+// so that real-time anti-malware scanners scan it now rather than when the
+// user clicks to install it. They remember files they scanned until they
+// change, so the launch itself doesn't wait for the scan.
+class InstallerPrescanner : public Thread
+{
+public:
+    InstallerPrescanner(const std::wstring& path)
+        : Thread("WinSparkle installer prescan"), m_path(path) {}
 
-    void Close()
+protected:
+    virtual void Run()
     {
-        if ( m_file )
+        SignalReady();
+
+        BackgroundPriority priority;
+        const TraceTimer timer;
+
+        // it's only an optimization, and the installer may be launched or
+        // removed meanwhile, which mustn't be prevented
+        HANDLE file = CreateFileW(m_path.c_str(), GENERIC_READ | GENERIC_EXECUTE,
+                                  FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if ( file == INVALID_HANDLE_VALUE )
         {
-            fclose(m_file);
-            m_file = NULL;
+            LogWarning("Cannot open the update for the anti-malware prescan.");
+            return;
         }
+
+        // Mapping an executable as an image is what scanners check before
+        // it can run. This fails for other files, e.g. MSI packages, which
+        // are scanned when they're opened.
+        HANDLE section = CreateFileMappingW(file, NULL, PAGE_EXECUTE_READ | SEC_IMAGE, 0, 0, NULL);
+        if ( section )
+            CloseHandle(section);
+        CloseHandle(file);
+
+        TraceEvent("InstallerPrescanned")
+            .Field("Image", section ? 1u : 0u)
+            .Field("DurationUs", timer.GetMicroseconds())
+            .Write();
     }
 
-    std::wstring GetFilePath(void) { return m_path; }
+    virtual bool IsJoinable() const { return false; }
+
+private:
+    const std::wstring m_path;
+};
 
-    virtual void SetLength(size_t l) { m_total = l; }
 
-    virtual void SetFilename(const std::wstring& filename)
+// Starts InstallerPrescanner for the verified installer.
+void PrescanInstallerInBackground(const std::wstring& path)
+{
+    Thread *prescanner = new InstallerPrescanner(path);
+    try
     {
-        if ( m_file )
-            throw std::runtime_error("Update file already set");
+        prescanner->Start();
+    }
+    catch ( std::exception& e )
+    {
+        // not fatal, the scan just happens when the installer is launched
+        delete prescanner;
+        LogError(e.what());
+    }
+}
+
 
-        m_path = m_dir + L"\\" + filename;
-        m_file = _wfopen(m_path.c_str(), L"wb");
-        if ( !m_file )
-            throw std::runtime_error("Cannot save update file");
+// Downloads the update, verifies its signature and keeps it in the cache
+// if @a cacheKey isn't empty. Returns path to the verified file.
+//
+// See DownloadUpdateFile() for the meaning of @a background.
+std::wstring DownloadAndVerifyUpdate(Thread& thread,
+                                     const Appcast& appcast,
+                                     const std::string& cacheKey,
+                                     bool background)
+{
+    // Another process may be downloading the same update right now, e.g.
+    // another instance of the app. Wait for it, so that the download isn't
+    // duplicated (and doesn't interfere with this one's partial download
+    // state), and use the file it put in the cache.
+    StatusOperation status(WIN_SPARKLE_OPERATION_DOWNLOAD, WIN_SPARKLE_PHASE_QUEUED);
+    SessionMutex downloadMutex("Download", cacheKey.empty() ? appcast.DownloadURL : cacheKey);
+    SessionMutexLocker downloadLock(downloadMutex, &thread);
+    status.SetPhase(WIN_SPARKLE_PHASE_DOWNLOADING);
+    if ( downloadLock.HadToWait() )
+    {
+        const std::wstring cached = FindCachedUpdate(cacheKey);
+        if ( !cached.empty() )
+        {
+            Stats::AddBytesSavedByCache(GetExistingFileSize(cached));
+            DownloadComponents(thread, appcast, cached, background);
+            return cached;
+        }
     }
 
-    virtual void Add(const void *data, size_t len)
+    // Another user of the computer may have downloaded it already.
+    std::wstring updateFile = CopySharedUpdate(thread, appcast, cacheKey);
+    const bool fromShared = !updateFile.empty();
+
+    // The reconstructed file can only be trusted if it can be verified.
+    if ( updateFile.empty() && !cacheKey.empty() )
     {
-        if ( !m_file )
-            throw std::runtime_error("Filename is not net");
+        updateFile = appcast.HasDeltaChain()
+                     ? DownloadAndApplyDeltaChain(thread, appcast, background)
+                     : DownloadAndApplyDelta(thread, appcast, background);
+    }
 
-        m_thread.CheckShouldTerminate();
+    if ( updateFile.empty() )
+    {
+        std::string sha1;
+        updateFile = DownloadUpdateFromMirrors(thread, appcast, background, sha1);
+        try
+        {
+            status.SetPhase(WIN_SPARKLE_PHASE_VERIFYING);
+            VerifyOrRepairInstallerFile(thread, updateFile, appcast, sha1);
+        }
+        catch ( BadSignatureException& )
+        {
+            UpdateJournal::RecordFinished(); // so that the file is removed
+            throw;
+        }
+        updateFile = RenameVerifiedFile(updateFile);
+        UpdateJournal::RecordVerified(appcast.DownloadURL, updateFile, GetExistingFileSize(updateFile));
+    }
 
-        if ( fwrite(data, len, 1, m_file) != 1 )
-            throw std::runtime_error("Cannot save update file");
-        m_downloaded += len;
+    if ( !fromShared )
+        ShareUpdate(updateFile, cacheKey);
 
-        // only update at most 10 times/sec so that we don't flood the UI:
-        clock_t now = clock();
-        if ( now == -1 || m_downloaded == m_total ||
-             ((double(now - m_lastUpdate) / CLOCKS_PER_SEC) >= 0.1) )
+    if ( !cacheKey.empty() )
+    {
+        // This keeps the installer around also as the base for delta
+        // updates from this version.
+        try
+        {
+            updateFile = UpdateCache::Store(cacheKey, updateFile, appcast.Version);
+        }
+        catch ( std::exception& e )
         {
-          UI::NotifyDownloadProgress(m_downloaded, m_total);
-          m_lastUpdate = now;
+            // not fatal, the file just won't be reused
+            LogError(e.what());
         }
     }
 
-    Thread& m_thread;
-    size_t m_downloaded, m_total;
-    FILE *m_file;
-    std::wstring m_dir;
-    std::wstring m_path;
-    clock_t m_lastUpdate;
-};
+    DownloadComponents(thread, appcast, updateFile, background);
+
+    PrescanInstallerInBackground(updateFile);
+
+    ApplicationController::NotifyUpdateDownloaded(updateFile);
+    return updateFile;
+}
+
 
 } // anonymous namespace
 
@@ -155,7 +2168,7 @@ struct UpdateDownloadSink : public IDownloadSink
                             updater initialization
  *--------------------------------------------------------------------------*/
 
-UpdateDownloader::UpdateDownloader(const Appcast& appcast)
+UpdateDownloader::UpdateDownloader(const AppcastPtr& appcast)
     : Thread("WinSparkle updater"),
       m_appcast(appcast)
 {
@@ -171,83 +2184,486 @@ void UpdateDownloader::Run()
     // no initialization to do, so signal readiness immediately
     SignalReady();
 
+    // The user watches this download in the update dialog, so any
+    // background pre-download in this process shouldn't slow it down.
+    BackgroundPriority::UserWaiting userWaiting;
+
     try
     {
-      const std::wstring tmpdir = CreateUniqueTempDirectory();
-      Settings::WriteConfigValue("UpdateTempDir", tmpdir);
-
-      UpdateDownloadSink sink(*this, tmpdir);
-      DownloadFile(m_appcast.DownloadURL, &sink, this);
-      sink.Close();
-
-      if (Settings::HasDSAPubKeyPem())
+      // The same update may have been downloaded and verified before, but
+      // not installed.
+      const std::string cacheKey = UpdateCache::GetKey(*m_appcast);
+      const std::wstring cached = FindCachedUpdate(cacheKey);
+      if ( !cached.empty() )
       {
-          SignatureVerifier::VerifyDSASHA1SignatureValid(sink.GetFilePath(), m_appcast.DsaSignature);
-      }
-      else
-      {
-          // backward compatibility - accept as is, but complain about it
-          LogError("Using unsigned updates!");
+          Stats::AddBytesSavedByCache(GetExistingFileSize(cached));
+          DownloadComponents(*this, *m_appcast, cached, false);
+          UI::NotifyUpdateDownloaded(cached, m_appcast);
+          return;
       }
 
-      UI::NotifyUpdateDownloaded(sink.GetFilePath(), m_appcast);
+      const std::wstring updateFile = DownloadAndVerifyUpdate(*this, *m_appcast, cacheKey, false);
+      UI::NotifyUpdateDownloaded(updateFile, m_appcast);
     }
     catch (BadSignatureException&)
     {
         CleanLeftovers();  // remove potentially corrupted file
+        Stats::RecordError(std::current_exception());
         UI::NotifyUpdateError(Err_BadSignature);
         throw;
     }
     catch ( ... )
     {
+        Stats::RecordError(std::current_exception());
         UI::NotifyUpdateError();
         throw;
     }
 }
 
 
+std::wstring UpdateDownloader::DownloadAndVerify(const Appcast& appcast, Thread& onThread)
+{
+    const std::string cacheKey = UpdateCache::GetKey(appcast);
+    if ( !cacheKey.empty() )
+    {
+        const std::wstring cached = FindCachedUpdate(cacheKey);
+        if ( !cached.empty() )
+        {
+            Stats::AddBytesSavedByCache(GetExistingFileSize(cached));
+            DownloadComponents(onThread, appcast, cached, false);
+            return cached;
+        }
+    }
+
+    try
+    {
+        return DownloadAndVerifyUpdate(onThread, appcast, cacheKey, false);
+    }
+    catch ( BadSignatureException& )
+    {
+        CleanLeftovers();  // remove potentially corrupted file
+        throw;
+    }
+}
+
+
+/*static*/
+UpdateDownloader::DownloadState UpdateDownloader::GetDownloadState(const Appcast& appcast)
+{
+    if ( !FindCachedUpdate(UpdateCache::GetKey(appcast)).empty() )
+        return DownloadState_Ready;
+
+    if ( !FindJournaledDownload(appcast.DownloadURL, ExpectedFile()).empty() )
+        return DownloadState_Ready;
+
+    PartialDownload partial;
+    // a file downloaded with BITS only appears when it's complete
+    if ( partial.Load() && partial.url == appcast.DownloadURL &&
+         (GetExistingFileSize(partial.path) || !partial.job.empty()) )
+        return DownloadState_Partial;
+
+    return DownloadState_None;
+}
+
+
+/*--------------------------------------------------------------------------*
+                            installer launching
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// how long to wait for the installer to show its UI before shutting down
+const DWORD INSTALLER_START_TIMEOUT = 10000;
+
+// update to install on exit, see UpdateDownloader::StageForExit()
+CriticalSection g_csStaged;
+std::wstring g_stagedFile;
+AppcastPtr g_stagedUpdate;
+
+bool IsMsiPackage(const std::wstring& file)
+{
+    const size_t len = file.length();
+    return len > 4 && _wcsicmp(file.c_str() + len - 4, L".msi") == 0;
+}
+
+// Path to msiexec.exe, so that it isn't looked up through the file association.
+std::wstring GetMsiexecPath()
+{
+    wchar_t dir[MAX_PATH + 1];
+    const UINT len = GetSystemDirectoryW(dir, MAX_PATH + 1);
+    if ( len == 0 || len > MAX_PATH )
+        return L"msiexec.exe";
+    return std::wstring(dir, len) + L"\\msiexec.exe";
+}
+
+// Runs the installer and, if @a waitForStart, waits until it starts, see
+// LaunchInstaller()
+bool ShellExecuteInstaller(const std::wstring& file, const Appcast& update, bool waitForStart)
+{
+    // normally done when the file was verified, unless it changed since or
+    // the check was enabled only after it was downloaded
+    if ( Settings::GetAuthenticodeCheck() && !SignatureVerifier::IsAuthenticodeVerified(file) )
+    {
+        try
+        {
+            SignatureVerifier::VerifyAuthenticodeSignatureValid(file);
+        }
+        catch ( BadSignatureException& e )
+        {
+            LogError(e.what());
+            return false;
+        }
+    }
+
+    // ShellExecuteEx() may use COM, which it wants to be single-threaded
+    const HRESULT hrInit = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+
+    std::wstring wArgs = AnsiToWide(update.InstallerArguments);
+    std::wstring program = file;
+    if ( IsMsiPackage(file) )
+    {
+        // what the association runs too, but without looking it up and
+        // even if another program took over .msi files
+        program = GetMsiexecPath();
+        wArgs = L"/i \"" + file + L"\"" + (wArgs.empty() ? L"" : L" " + wArgs);
+    }
+
+    SHELLEXECUTEINFO sei;
+    ::ZeroMemory(&sei, sizeof(SHELLEXECUTEINFO));
+    sei.cbSize = sizeof(SHELLEXECUTEINFO);
+    sei.lpFile = program.c_str();
+    sei.nShow = SW_SHOWDEFAULT;
+    // We display our own dialog box on error
+    sei.fMask = SEE_MASK_FLAG_NO_UI | SEE_MASK_NOCLOSEPROCESS | SEE_MASK_NOASYNC;
+
+    if ( !wArgs.empty() )
+        sei.lpParameters = wArgs.c_str();
+
+    // Ask for the elevation ourselves, instead of the installer restarting
+    // itself elevated. On XP, "runas" would ask for another user's account.
+    const bool elevated = update.IsElevationRequired() && IsWindowsVistaOrGreater();
+    if ( elevated )
+        sei.lpVerb = L"runas";
+
+    bool launched = ::ShellExecuteEx(&sei) ? true : false;
+
+    if ( SUCCEEDED(hrInit) )
+        CoUninitialize();
+
+    if ( !launched )
+    {
+        if ( elevated && GetLastError() == ERROR_CANCELLED )
+            LogError("The user declined to run the installer elevated.");
+        return false;
+    }
+
+    // no process handle e.g. if the installer was run through DDE
+    if ( !sei.hProcess )
+        return true;
+
+    if ( !waitForStart )
+    {
+        CloseHandle(sei.hProcess);
+        return true;
+    }
+
+    // Wait until the installer is ready for user input. This fails for
+    // installers without UI and possibly for elevated ones, whose handle has
+    // limited access rights; they're started at this point already.
+    WaitForInputIdle(sei.hProcess, INSTALLER_START_TIMEOUT);
+
+    // It's only a failure if the installer exited with an error right away:
+    // bootstrappers may exit successfully after starting the real installer.
+    DWORD exitCode;
+    if ( WaitForSingleObject(sei.hProcess, 0) == WAIT_OBJECT_0 &&
+         GetExitCodeProcess(sei.hProcess, &exitCode) && exitCode != 0 )
+    {
+        launched = false;
+    }
+
+    CloseHandle(sei.hProcess);
+    return launched;
+}
+
+} // anonymous namespace
+
+
+/*static*/
+bool UpdateDownloader::LaunchInstaller(const std::wstring& file, const Appcast& update)
+{
+    const TraceTimer timer;
+    const bool launched = ShellExecuteInstaller(file, update, true);
+
+    TraceEvent("InstallerLaunched")
+        .Field("Success", launched ? 1u : 0u)
+        .Field("Elevated", update.IsElevationRequired() ? 1u : 0u)
+        .Field("DurationUs", timer.GetMicroseconds())
+        .Write();
+
+    if ( launched )
+    {
+        // the installer has the file now, it's removed with the leftovers
+        UpdateJournal::RecordFinished();
+
+        // this one is installed now, don't run the staged one on exit too
+        CriticalSectionLocker lock(g_csStaged);
+        g_stagedFile.clear();
+        g_stagedUpdate.reset();
+    }
+    return launched;
+}
+
+
+/*static*/
+bool UpdateDownloader::StageForExit(const AppcastPtr& appcast, Thread& onThread)
+{
+    // only verified files are kept until the application exits
+    const std::string cacheKey = UpdateCache::GetKey(*appcast);
+    if ( cacheKey.empty() )
+        return false;
+
+    BackgroundPriority priority;
+    std::wstring updateFile = FindCachedUpdate(cacheKey);
+    try
+    {
+        if ( updateFile.empty() )
+            updateFile = DownloadAndVerifyUpdate(onThread, *appcast, cacheKey, true);
+        else
+            DownloadComponents(onThread, *appcast, updateFile, true);
+    }
+    catch ( BadSignatureException& )
+    {
+        CleanLeftovers();  // remove potentially corrupted file
+        throw;
+    }
+
+    // it may have been downloaded while the user waited for it
+    MakeFilePersistent(updateFile);
+
+    CriticalSectionLocker lock(g_csStaged);
+    g_stagedFile = updateFile;
+    g_stagedUpdate = appcast;
+    return true;
+}
+
+
+/*static*/
+void UpdateDownloader::LaunchStagedInstaller()
+{
+    std::wstring file;
+    AppcastPtr update;
+    {
+        CriticalSectionLocker lock(g_csStaged);
+        file.swap(g_stagedFile);
+        update.swap(g_stagedUpdate);
+    }
+
+    // the cache may have been cleaned up meanwhile
+    if ( !update || GetFileAttributesW(file.c_str()) == INVALID_FILE_ATTRIBUTES )
+        return;
+
+    // The application is exiting, there's no one to wait for the installer
+    // nor to report an error to.
+    const bool launched = ShellExecuteInstaller(file, *update, false);
+
+    TraceEvent("InstallerLaunched")
+        .Field("Success", launched ? 1u : 0u)
+        .Field("Elevated", update->IsElevationRequired() ? 1u : 0u)
+        .Field("OnExit", 1u)
+        .Write();
+    if ( !launched )
+        LogError("Failed to launch the update installer on exit.");
+}
+
+
+void UpdateDownloader::PreDownload(const Appcast& appcast, Thread& onThread, bool urgent)
+{
+    // Only verified files are kept until the update is installed, so
+    // there's no point in downloading unsigned updates in advance.
+    const std::string cacheKey = UpdateCache::GetKey(appcast);
+    if ( cacheKey.empty() )
+        return;
+    const std::wstring cached = FindCachedUpdate(cacheKey);
+    if ( !cached.empty() && !appcast.HasComponents() )
+        return;
+
+    std::unique_ptr<BackgroundPriority> priority;
+    if ( !urgent )
+        priority.reset(new BackgroundPriority);
+    try
+    {
+        if ( cached.empty() )
+            DownloadAndVerifyUpdate(onThread, appcast, cacheKey, true);
+        else
+            DownloadComponents(onThread, appcast, cached, true);
+    }
+    catch ( BadSignatureException& e )
+    {
+        CleanLeftovers();  // remove potentially corrupted file
+        LogError(e.what());
+    }
+    catch ( DataBudgetExhaustedException& e )
+    {
+        // a later check continues the partial download
+        LogInfo(std::string(e.what()) + " The update will be downloaded later.");
+    }
+    catch ( std::exception& e )
+    {
+        // not fatal, the download is retried if the user installs it
+        LogError(e.what());
+    }
+}
+
+
+/*static*/
+void UpdateDownloader::Import(const Appcast& appcast, const std::wstring& dir, Thread& onThread)
+{
+    // only verified files are kept until the update is installed
+    const std::string cacheKey = UpdateCache::GetKey(appcast);
+    if ( !appcast.HasDownload() )
+        throw std::runtime_error("The update has no file to import.");
+    if ( cacheKey.empty() )
+        throw std::runtime_error("Only signed updates can be imported.");
+    if ( appcast.HasComponents() )
+        throw std::runtime_error("Updates with components can't be imported.");
+    if ( !FindCachedUpdate(cacheKey).empty() )
+        return;
+
+    const std::wstring name = GetURLFileName(appcast.DownloadURL.c_str());
+    std::wstring updateFile;
+    try
+    {
+        updateFile = CopyAndVerifyUpdate(onThread, appcast, dir + L"\\" + name, name);
+    }
+    catch ( BadSignatureException& )
+    {
+        CleanLeftovers();  // remove potentially corrupted file
+        throw;
+    }
+
+    ShareUpdate(updateFile, cacheKey);
+    // unlike a download, the file is useless if it can't be kept
+    updateFile = UpdateCache::Store(cacheKey, updateFile, appcast.Version);
+
+    TraceEvent("UpdateImported")
+        .Field("Bytes", static_cast<unsigned long long>(GetExistingFileSize(updateFile)))
+        .Write();
+    ApplicationController::NotifyUpdateDownloaded(updateFile);
+}
+
+
 /*--------------------------------------------------------------------------*
                                cleanup
  *--------------------------------------------------------------------------*/
 
-void UpdateDownloader::CleanLeftovers()
+namespace
 {
-    // Note: this is called at startup. Do not use wxWidgets from this code!
 
+// Returns the temp directory of a previous update if it can be removed,
+// otherwise an empty string.
+std::wstring GetLeftoverTempDir()
+{
     std::wstring tmpdir;
     if ( !Settings::ReadConfigValue("UpdateTempDir", tmpdir) )
-        return;
+        return std::wstring();
 
     // Check that the directory actually is a valid update temp dir, to prevent
     // malicious users from forcing us into deleting arbitrary directories:
     try
     {
-        if (tmpdir.find(GetUniqueTempDirectoryPrefix()) != 0)
+        if ( !HasUpdateTempDirectoryPrefix(tmpdir) )
         {
             Settings::DeleteConfigValue("UpdateTempDir");
-            return;
+            return std::wstring();
         }
     }
     catch (Win32Exception&) // cannot determine temp directory
     {
-        return;
+        return std::wstring();
     }
 
-    tmpdir.append(1, '\0'); // double NULL-terminate for SHFileOperation
+    // Keep interrupted downloads around so that they can be resumed, and
+    // downloaded files that weren't installed yet. The directory is removed
+    // when a different update is downloaded.
+    if ( PartialDownload::Exists() )
+        return std::wstring();
+    const UpdateJournal::State journal = UpdateJournal::GetState();
+    if ( journal.downloaded && !journal.finished &&
+         journal.path.compare(0, tmpdir.length() + 1, tmpdir + L"\\") == 0 )
+        return std::wstring();
 
-    SHFILEOPSTRUCT fos = {0};
-    fos.wFunc = FO_DELETE;
-    fos.pFrom = tmpdir.c_str();
-    fos.fFlags = FOF_NO_UI | // Vista+-only
-                 FOF_SILENT |
-                 FOF_NOCONFIRMATION |
-                 FOF_NOERRORUI;
+    return tmpdir;
+}
 
-    if ( SHFileOperation(&fos) == 0 )
-    {
+// Removes the leftover directory @a tmpdir, see GetLeftoverTempDir().
+void RemoveLeftoverTempDir(const std::wstring& tmpdir, Thread *thread)
+{
+    if ( !DeleteDirectoryTree(tmpdir, thread) )
+        return; // try another time, this is just a "soft" error
+
+    // A download may have started meanwhile and replaced it with its own.
+    CriticalSectionLocker lock(g_csTempDir);
+    std::wstring current;
+    if ( Settings::ReadConfigValue("UpdateTempDir", current) && current == tmpdir )
         Settings::DeleteConfigValue("UpdateTempDir");
+}
+
+// Removes leftovers of previous updates at low priority.
+class LeftoversCleaner : public Thread
+{
+public:
+    LeftoversCleaner(const std::wstring& tmpdir)
+        : Thread("WinSparkle cleanup"), m_tmpdir(tmpdir) {}
+
+protected:
+    virtual void Run()
+    {
+        SignalReady();
+
+        BackgroundPriority priority;
+        RemoveLeftoverTempDir(m_tmpdir, this);
+    }
+
+    virtual bool IsJoinable() const { return false; }
+
+private:
+    const std::wstring m_tmpdir;
+};
+
+} // anonymous namespace
+
+
+void UpdateDownloader::CleanLeftovers()
+{
+    // Note: this is called at startup. Do not use wxWidgets from this code!
+
+    const std::wstring tmpdir = GetLeftoverTempDir();
+    if ( !tmpdir.empty() )
+        RemoveLeftoverTempDir(tmpdir, NULL);
+}
+
+
+void UpdateDownloader::CleanLeftoversInBackground()
+{
+    // Note: this is called at startup. Do not use wxWidgets from this code!
+
+    // The settings are only checked here, which is quick, so that nothing is
+    // started if there's nothing to clean, as is usually the case.
+    const std::wstring tmpdir = GetLeftoverTempDir();
+    if ( tmpdir.empty() )
+        return;
+
+    Thread *cleaner = new LeftoversCleaner(tmpdir);
+    try
+    {
+        cleaner->Start();
+    }
+    catch ( ... )
+    {
+        delete cleaner;
+        throw;
     }
-    // else: try another time, this is just a "soft" error
 }
 
 } // namespace winsparkle
@@ -44,7 +44,7 @@ class UpdateDownloader : public Thread
 {
 public:
     /// Creates updater thread.
-    UpdateDownloader(const Appcast& appcast);
+    UpdateDownloader(const AppcastPtr& appcast);
 
     /**
         Perform any necessary cleanup after previous updates.
@@ -52,16 +52,122 @@ public:
         Should be called on launch to get rid of leftover junk from previous
         updates, such as the installer files. Call it as soon as possible,
         before using other WinSparkle functionality.
+
+        Partially downloaded files of interrupted downloads are kept, so
+        that the download can be resumed later.
      */
     static void CleanLeftovers();
 
+    /**
+        Same as CleanLeftovers(), but the files are removed at low priority
+        in the background, so that startup doesn't wait for it.
+
+        Returns immediately. Throws on error.
+     */
+    static void CleanLeftoversInBackground();
+
+    /**
+        Download and verify the update in advance, without showing anything.
+
+        The verified file is kept in UpdateCache, so that UpdateDownloader
+        doesn't need to download it again when the user installs it. Errors
+        are only logged. Does nothing for unsigned updates.
+
+        This runs at low priority, on the calling thread, unless @a urgent.
+
+        @param appcast   The update to download.
+        @param onThread  The calling thread, checked for termination.
+        @param urgent    Download at normal priority, e.g. a critical update.
+     */
+    static void PreDownload(const Appcast& appcast, Thread& onThread, bool urgent = false);
+
+    /**
+        Imports the update file from a bundle copied to the computer by
+        other means than downloading, see win_sparkle_import_update().
+
+        The file, named as in the update's URL, is copied from directory
+        @a dir and verified, and kept in UpdateCache, so that it's installed
+        as if it had been downloaded, without accessing the network.
+
+        Throws on error, including if the update isn't signed.
+
+        @param appcast   The update to import.
+        @param dir       Directory with the update file.
+        @param onThread  The calling thread, checked for termination.
+     */
+    static void Import(const Appcast& appcast, const std::wstring& dir, Thread& onThread);
+
+    /**
+        Download and verify the update on the calling thread, reusing the
+        file in UpdateCache if it's there already.
+
+        Throws on error.
+
+        @param appcast   The update to download.
+        @param onThread  The calling thread, checked for termination.
+
+        @return Path to the verified update file.
+     */
+    static std::wstring DownloadAndVerify(const Appcast& appcast, Thread& onThread);
+
+    /// How far the download of an update got, see GetDownloadState().
+    enum DownloadState
+    {
+        /// not downloaded, or the files are gone
+        DownloadState_None,
+        /// an interrupted download can be resumed
+        DownloadState_Partial,
+        /// downloaded completely, in UpdateCache or left by an interrupted update
+        DownloadState_Ready
+    };
+
+    /**
+        Tells how far the download of @a appcast's update got, from the
+        files and settings left by previous downloads.
+
+        This only looks at the local files, it doesn't verify them nor
+        access the network.
+     */
+    static DownloadState GetDownloadState(const Appcast& appcast);
+
+    /**
+        Launches the installer @a file of @a update, with its arguments.
+
+        MSI packages are run by msiexec. The installer is run elevated if
+        the appcast says it requires it (see Appcast::IsElevationRequired()).
+
+        Blocks until the installer runs and is ready for user input, or a
+        few seconds at most.
+
+        @return false if it couldn't be launched or exited with an error
+                right away, including if the user declined the elevation.
+     */
+    static bool LaunchInstaller(const std::wstring& file, const Appcast& update);
+
+    /**
+        Download and verify the update on the calling thread, to be
+        installed when the application exits (see LaunchStagedInstaller()).
+
+        This runs at low priority, like PreDownload(), but throws on error.
+
+        @return false if the update isn't signed and can't be staged.
+     */
+    static bool StageForExit(const AppcastPtr& appcast, Thread& onThread);
+
+    /**
+        Launches the installer of the update staged by StageForExit(), if
+        any and if no other update was installed since, without waiting for
+        it. Called when the application exits.
+     */
+    static void LaunchStagedInstaller();
+
 protected:
     // Thread methods:
     virtual void Run();
     virtual bool IsJoinable() const { return true; }
 
 private:
-    Appcast m_appcast;
+    AppcastPtr m_appcast;
 };
 
 } // namespace winsparkle
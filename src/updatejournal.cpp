@@ -0,0 +1,345 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "updatejournal.h"
+
+#include "settings.h"
+#include "utils.h"
+
+#include <vector>
+
+namespace winsparkle
+{
+
+namespace
+{
+
+/*
+    The journal is a single binary value: its format number followed by
+    the records, each a 32-bit record type, the version, URL and path as
+    32-bit length followed by UTF-8 data and the size as two 32-bit
+    numbers. Records are only ever appended, replaying them in order gives
+    the State.
+ */
+#define UPDATE_JOURNAL_VALUE "UpdateJournal"
+const unsigned UPDATE_JOURNAL_FORMAT = 1;
+
+// The journal starts over when it gets longer, e.g. because the download
+// was interrupted again and again; the check and the newest record are
+// always kept.
+const size_t UPDATE_JOURNAL_MAX_RECORDS = 64;
+
+enum RecordType
+{
+    Record_Check = 1,
+    Record_DownloadStarted,
+    Record_Downloaded,
+    Record_Verified,
+    Record_Finished,
+    // result of a verification: the key in url, the file's stamp in path
+    Record_VerificationResult
+};
+
+struct Record
+{
+    Record() : type(0), size(0) {}
+
+    unsigned type;
+    std::string version, url, path;
+    unsigned long long size;
+};
+
+void WriteUInt32(std::string& data, unsigned value)
+{
+    const unsigned char bytes[4] =
+    {
+        (unsigned char)(value & 0xFF), (unsigned char)((value >> 8) & 0xFF),
+        (unsigned char)((value >> 16) & 0xFF), (unsigned char)((value >> 24) & 0xFF)
+    };
+    data.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+void WriteString(std::string& data, const std::string& value)
+{
+    WriteUInt32(data, (unsigned)value.size());
+    data.append(value);
+}
+
+bool ReadUInt32(const std::string& data, size_t& pos, unsigned& value)
+{
+    if ( data.size() - pos < 4 )
+        return false;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data.data() + pos);
+    value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned)bytes[3] << 24);
+    pos += 4;
+    return true;
+}
+
+bool ReadString(const std::string& data, size_t& pos, std::string& value)
+{
+    unsigned len;
+    if ( !ReadUInt32(data, pos, len) || data.size() - pos < len )
+        return false;
+    value.assign(data, pos, len);
+    pos += len;
+    return true;
+}
+
+void WriteRecord(std::string& data, const Record& r)
+{
+    WriteUInt32(data, r.type);
+    WriteString(data, r.version);
+    WriteString(data, r.url);
+    WriteString(data, r.path);
+    WriteUInt32(data, (unsigned)(r.size & 0xFFFFFFFF));
+    WriteUInt32(data, (unsigned)(r.size >> 32));
+}
+
+bool ReadRecord(const std::string& data, size_t& pos, Record& r)
+{
+    unsigned low, high;
+    if ( !ReadUInt32(data, pos, r.type) ||
+         !ReadString(data, pos, r.version) ||
+         !ReadString(data, pos, r.url) ||
+         !ReadString(data, pos, r.path) ||
+         !ReadUInt32(data, pos, low) ||
+         !ReadUInt32(data, pos, high) )
+        return false;
+    r.size = ((unsigned long long)high << 32) | low;
+    return true;
+}
+
+// Reads the journal's records; a damaged or unknown journal is ignored as
+// a whole, it's only an optimization.
+std::vector<Record> ReadJournal()
+{
+    std::vector<Record> records;
+
+    std::string data;
+    if ( !Settings::ReadConfigBlob(UPDATE_JOURNAL_VALUE, data) )
+        return records;
+
+    size_t pos = 0;
+    unsigned format;
+    if ( !ReadUInt32(data, pos, format) || format != UPDATE_JOURNAL_FORMAT )
+        return records;
+
+    while ( pos < data.size() )
+    {
+        Record r;
+        if ( !ReadRecord(data, pos, r) )
+            return std::vector<Record>();
+        records.push_back(r);
+    }
+
+    return records;
+}
+
+void Apply(UpdateJournal::State& state, const Record& r)
+{
+    switch ( r.type )
+    {
+        case Record_Check:
+            if ( r.version != state.version )
+            {
+                state = UpdateJournal::State();
+                state.version = r.version;
+            }
+            break;
+
+        case Record_DownloadStarted:
+        case Record_Downloaded:
+        case Record_Verified:
+            state.url = r.url;
+            state.path = AnsiToWide(r.path);
+            state.size = r.size;
+            state.downloaded = r.type != Record_DownloadStarted;
+            state.verified = r.type == Record_Verified;
+            state.finished = false;
+            break;
+
+        case Record_Finished:
+            state.finished = true;
+            break;
+
+        case Record_VerificationResult:
+            state.verifiedStamp = r.path;
+            state.verifiedKey = r.url;
+            break;
+
+        default:
+            // written by a newer version, skip it
+            break;
+    }
+}
+
+UpdateJournal::State Replay(const std::vector<Record>& records)
+{
+    UpdateJournal::State state;
+    for ( std::vector<Record>::const_iterator i = records.begin(); i != records.end(); ++i )
+        Apply(state, *i);
+    return state;
+}
+
+// Does the record begin another update, for which the records so far are
+// of no use?
+bool StartsOver(const UpdateJournal::State& state, const Record& r)
+{
+    switch ( r.type )
+    {
+        case Record_Check:
+            return r.version != state.version;
+        case Record_DownloadStarted:
+            return r.url != state.url;
+        default:
+            return false;
+    }
+}
+
+void Append(const Record& r)
+{
+    // the batch keeps other threads from appending in between
+    Settings::Batch batch;
+
+    std::vector<Record> records = ReadJournal();
+    const UpdateJournal::State state = Replay(records);
+
+    if ( (r.type == Record_Check && !StartsOver(state, r)) ||
+         (r.type == Record_VerificationResult &&
+          r.path == state.verifiedStamp && r.url == state.verifiedKey) )
+    {
+        // repeated checks finding the same update add nothing, nor do
+        // repeated verifications of the same file
+        batch.Commit();
+        return;
+    }
+
+    if ( StartsOver(state, r) || records.size() >= UPDATE_JOURNAL_MAX_RECORDS )
+    {
+        // keep the check that found the update a download is for
+        records.clear();
+        if ( r.type != Record_Check && !state.version.empty() )
+        {
+            Record check;
+            check.type = Record_Check;
+            check.version = state.version;
+            records.push_back(check);
+        }
+    }
+    records.push_back(r);
+
+    std::string data;
+    WriteUInt32(data, UPDATE_JOURNAL_FORMAT);
+    for ( std::vector<Record>::const_iterator i = records.begin(); i != records.end(); ++i )
+        WriteRecord(data, *i);
+    Settings::WriteConfigBlob(UPDATE_JOURNAL_VALUE, data);
+
+    batch.Commit();
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                                public API
+ *--------------------------------------------------------------------------*/
+
+UpdateJournal::State UpdateJournal::GetState()
+{
+    return Replay(ReadJournal());
+}
+
+
+void UpdateJournal::RecordCheck(const std::string& version)
+{
+    Record r;
+    r.type = Record_Check;
+    r.version = version;
+    Append(r);
+}
+
+
+void UpdateJournal::RecordDownloadStarted(const std::string& url)
+{
+    Record r;
+    r.type = Record_DownloadStarted;
+    r.url = url;
+    Append(r);
+}
+
+
+void UpdateJournal::RecordDownloaded(const std::string& url,
+                                     const std::wstring& path,
+                                     unsigned long long size)
+{
+    Record r;
+    r.type = Record_Downloaded;
+    r.url = url;
+    r.path = WideToAnsi(path);
+    r.size = size;
+    Append(r);
+}
+
+
+void UpdateJournal::RecordVerified(const std::string& url,
+                                   const std::wstring& path,
+                                   unsigned long long size)
+{
+    Record r;
+    r.type = Record_Verified;
+    r.url = url;
+    r.path = WideToAnsi(path);
+    r.size = size;
+    Append(r);
+}
+
+
+void UpdateJournal::RecordVerificationResult(const std::string& stamp, const std::string& key)
+{
+    Record r;
+    r.type = Record_VerificationResult;
+    r.url = key;
+    r.path = stamp;
+    Append(r);
+}
+
+
+bool UpdateJournal::IsVerified(const std::string& stamp, const std::string& key)
+{
+    if ( stamp.empty() )
+        return false;
+    const State state = GetState();
+    return state.verifiedStamp == stamp && state.verifiedKey == key;
+}
+
+
+void UpdateJournal::RecordFinished()
+{
+    Record r;
+    r.type = Record_Finished;
+    Append(r);
+}
+
+} // namespace winsparkle
@@ -0,0 +1,121 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _updatejournal_h_
+#define _updatejournal_h_
+
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Journal of the update in progress.
+
+    Each step of an update (the check that found it, start and end of its
+    download, verification, launching the installer) is appended to the
+    journal as a record, in the same settings batch as the other changes
+    the step makes, so that the journal always agrees with them. After a
+    crash or when the app is closed midway, the journal tells where the
+    update stopped, so that it can continue from there: e.g. a download
+    that completed is only verified again instead of downloading it anew.
+
+    The journal only holds the current update: it starts over when an
+    update of another version is found or another file is downloaded.
+ */
+class UpdateJournal
+{
+public:
+    /// State of the update, as recorded in the journal.
+    struct State
+    {
+        State() : size(0), downloaded(false), verified(false), finished(false) {}
+
+        /// Version of the update found by the last check, if any
+        std::string version;
+        /// URL of the file being downloaded, if any
+        std::string url;
+        /// Path of the downloaded file
+        std::wstring path;
+        /// Size of the downloaded file
+        unsigned long long size;
+        /// Was the file downloaded completely?
+        bool downloaded;
+        /// Was the downloaded file verified?
+        bool verified;
+        /// Was the installer launched, or the update abandoned?
+        bool finished;
+        /// Stamp of the last file that passed verification, see RecordVerificationResult()
+        std::string verifiedStamp;
+        /// What it was verified against
+        std::string verifiedKey;
+    };
+
+    /// Returns the update's state, empty if there's none.
+    static State GetState();
+
+    /// Records that a check found the update of @a version.
+    static void RecordCheck(const std::string& version);
+
+    /// Records that a download of @a url started from scratch.
+    static void RecordDownloadStarted(const std::string& url);
+
+    /// Records that @a url was downloaded into @a path completely.
+    static void RecordDownloaded(const std::string& url,
+                                 const std::wstring& path,
+                                 unsigned long long size);
+
+    /// Records that the file downloaded from @a url, now at @a path, was verified.
+    static void RecordVerified(const std::string& url,
+                               const std::wstring& path,
+                               unsigned long long size);
+
+    /**
+        Remembers that the file identified by @a stamp (see
+        FileVerificationLock) passed verification against the signatures
+        identified by @a key, so that it needn't be read again as long as
+        it's unchanged, see IsVerified().
+     */
+    static void RecordVerificationResult(const std::string& stamp, const std::string& key);
+
+    /**
+        Did the file identified by @a stamp pass verification against
+        @a key already?
+
+        Only the last result of the current update is remembered.
+     */
+    static bool IsVerified(const std::string& stamp, const std::string& key);
+
+    /**
+        Records that the update is finished, because its installer was
+        launched or because it was abandoned, e.g. its file didn't match its
+        signature. Its files aren't needed anymore.
+     */
+    static void RecordFinished();
+};
+
+} // namespace winsparkle
+
+#endif // _updatejournal_h_
@@ -0,0 +1,856 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "updatescheduler.h"
+#include "schedulepolicy.h"
+#include "updatechecker.h"
+#include "notificationlistener.h"
+#include "download.h"
+#include "databudget.h"
+#include "downloadbackend.h"
+#include "pipelinestatus.h"
+#include "settings.h"
+#include "stats.h"
+#include "threads.h"
+#include "error.h"
+#include "utils.h"
+
+#include <ctime>
+#include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <winsparkle.h>
+#include <netlistmgr.h>
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                 helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// how long to wait before looking at the network connection again if a check
+// was deferred because of it, in case no change is reported (in seconds)
+const unsigned NETWORK_RECHECK_INTERVAL = 15 * 60; // 15 minutes
+
+// Gets the maintenance windows, returns false if there are none.
+bool GetMaintenanceWindows(std::vector<MaintenanceWindow>& windows)
+{
+    const std::string spec = Settings::GetMaintenanceWindows();
+    if ( !ParseMaintenanceWindows(spec, windows) )
+    {
+        // the app's value is validated, so this comes from a policy; not
+        // downloading at all is worse than downloading at any time
+        LogError("Invalid maintenance windows set by policy, ignoring them");
+        windows.clear();
+    }
+    return !windows.empty();
+}
+
+// Returns this installation's moment within maintenance windows, in
+// SchedulePolicy::MAINTENANCE_WINDOW_SLOTS, assigned randomly on first use.
+unsigned GetMaintenanceWindowSlot()
+{
+    unsigned slot;
+    if ( !Settings::ReadConfigValue("MaintenanceWindowSlot", slot) ||
+         slot >= SchedulePolicy::MAINTENANCE_WINDOW_SLOTS )
+    {
+        slot = GetRandomNumber(SchedulePolicy::MAINTENANCE_WINDOW_SLOTS - 1);
+        Settings::WriteConfigValue("MaintenanceWindowSlot", slot);
+    }
+    return slot;
+}
+
+// Are periodic checks moved into maintenance windows, because they may
+// download updates in the background?
+bool ShouldCheckInMaintenanceWindow()
+{
+    return (Settings::GetPreDownloadUpdates() || Settings::GetInstallOnExit()) &&
+           !Settings::GetMaintenanceWindows().empty();
+}
+
+/// The real clock, used outside of simulations.
+class SystemClock : public SchedulerClock
+{
+public:
+    virtual time_t Now() const { return time(NULL); }
+
+    virtual time_t GetLocalMidnight(time_t time, int days) const
+    {
+        const tm *local = localtime(&time);
+        if ( !local )
+            throw std::runtime_error("Failed to determine local time.");
+
+        tm midnight = *local;
+        midnight.tm_mday += days;
+        midnight.tm_hour = midnight.tm_min = midnight.tm_sec = 0;
+        midnight.tm_isdst = -1; // mktime() determines it
+        return mktime(&midnight);
+    }
+
+    virtual unsigned GetRandomNumber(unsigned max) { return winsparkle::GetRandomNumber(max); }
+};
+
+/**
+    One-shot timer calling UpdateScheduler's callback on a thread pool thread.
+
+    Uses thread pool timers, which can be coalesced with other timers, on
+    Windows Vista and newer and timer queue timers on older systems.
+ */
+class CheckTimer
+{
+public:
+    typedef void (*Callback)();
+
+    CheckTimer(Callback callback)
+        : m_callback(callback), m_poolTimer(NULL), m_queueTimer(NULL)
+    {
+        HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+        m_createThreadpoolTimer = reinterpret_cast<CreateThreadpoolTimer_t>(
+            GetProcAddress(kernel32, "CreateThreadpoolTimer"));
+        m_setThreadpoolTimer = reinterpret_cast<SetThreadpoolTimer_t>(
+            GetProcAddress(kernel32, "SetThreadpoolTimer"));
+        m_waitForThreadpoolTimerCallbacks = reinterpret_cast<WaitForThreadpoolTimerCallbacks_t>(
+            GetProcAddress(kernel32, "WaitForThreadpoolTimerCallbacks"));
+        m_closeThreadpoolTimer = reinterpret_cast<CloseThreadpoolTimer_t>(
+            GetProcAddress(kernel32, "CloseThreadpoolTimer"));
+
+        if ( !m_createThreadpoolTimer || !m_setThreadpoolTimer ||
+             !m_waitForThreadpoolTimerCallbacks || !m_closeThreadpoolTimer )
+        {
+            m_createThreadpoolTimer = NULL;
+        }
+    }
+
+    /**
+        Sets the timer to fire in @a delay seconds, or up to @a tolerance
+        seconds later. Cancels any previous setting of the timer.
+
+        Must not be called concurrently with itself or Cancel().
+     */
+    void Set(unsigned delay, unsigned tolerance)
+    {
+        if ( m_createThreadpoolTimer )
+        {
+            if ( !m_poolTimer )
+            {
+                m_poolTimer = m_createThreadpoolTimer(&OnPoolTimer, this, NULL);
+                if ( !m_poolTimer )
+                    throw Win32Exception("Failed to create update check timer");
+            }
+
+            // negative due time is relative, in 100ns units
+            LARGE_INTEGER due;
+            due.QuadPart = -10000000LL * delay;
+            FILETIME dueTime;
+            dueTime.dwLowDateTime = due.LowPart;
+            dueTime.dwHighDateTime = due.HighPart;
+            m_setThreadpoolTimer(m_poolTimer, &dueTime, 0, tolerance * 1000);
+        }
+        else
+        {
+            // timer queue timers can't be re-set once they fired, so create
+            // a new one; this may be called from the old timer's callback,
+            // so don't wait for it
+            if ( m_queueTimer )
+                DeleteTimerQueueTimer(NULL, m_queueTimer, NULL);
+            m_queueTimer = NULL;
+            if ( !CreateTimerQueueTimer(&m_queueTimer, NULL, &OnQueueTimer, this,
+                                        delay * 1000, 0, WT_EXECUTEONLYONCE) )
+            {
+                m_queueTimer = NULL;
+                throw Win32Exception("Failed to create update check timer");
+            }
+        }
+    }
+
+    /**
+        Cancels the timer and waits for its callback if it's running.
+
+        Must not be called from the callback.
+     */
+    void Cancel()
+    {
+        if ( m_poolTimer )
+        {
+            m_setThreadpoolTimer(m_poolTimer, NULL, 0, 0);
+            m_waitForThreadpoolTimerCallbacks(m_poolTimer, TRUE);
+            m_closeThreadpoolTimer(m_poolTimer);
+            m_poolTimer = NULL;
+        }
+
+        if ( m_queueTimer )
+        {
+            DeleteTimerQueueTimer(NULL, m_queueTimer, INVALID_HANDLE_VALUE);
+            m_queueTimer = NULL;
+        }
+    }
+
+private:
+    // thread pool timer API, available since Windows Vista; the
+    // PTP_CALLBACK_INSTANCE and PTP_TIMER parameters are declared as void*
+    // to compile with SDKs for older systems too
+    typedef void (CALLBACK *PoolTimerCallback_t)(void *instance, void *context, void *timer);
+    typedef void* (WINAPI *CreateThreadpoolTimer_t)(PoolTimerCallback_t, void*, void*);
+    typedef void (WINAPI *SetThreadpoolTimer_t)(void*, FILETIME*, DWORD, DWORD);
+    typedef void (WINAPI *WaitForThreadpoolTimerCallbacks_t)(void*, BOOL);
+    typedef void (WINAPI *CloseThreadpoolTimer_t)(void*);
+
+    static void CALLBACK OnPoolTimer(void * /*instance*/, void *context, void * /*timer*/)
+    {
+        static_cast<CheckTimer*>(context)->m_callback();
+    }
+
+    static void CALLBACK OnQueueTimer(PVOID context, BOOLEAN /*timedOut*/)
+    {
+        static_cast<CheckTimer*>(context)->m_callback();
+    }
+
+    Callback m_callback;
+
+    CreateThreadpoolTimer_t m_createThreadpoolTimer;
+    SetThreadpoolTimer_t m_setThreadpoolTimer;
+    WaitForThreadpoolTimerCallbacks_t m_waitForThreadpoolTimerCallbacks;
+    CloseThreadpoolTimer_t m_closeThreadpoolTimer;
+
+    void *m_poolTimer;
+    HANDLE m_queueTimer;
+};
+
+
+/**
+    Receives Network List Manager events, on COM's threads.
+
+    Calls the callback when the computer connects to the Internet or when
+    the cost of the connection changes (since Windows 8).
+ */
+class NetworkEventsSink : public INetworkListManagerEvents
+#ifdef __INetworkCostManager_INTERFACE_DEFINED__
+                        , public INetworkCostManagerEvents
+#endif
+{
+public:
+    typedef void (*Callback)();
+
+    NetworkEventsSink(Callback callback) : m_refCount(1), m_callback(callback) {}
+
+    // virtual, because the class is polymorphic and Release() deletes it
+    virtual ~NetworkEventsSink() {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv)
+    {
+        if ( riid == __uuidof(IUnknown) || riid == __uuidof(INetworkListManagerEvents) )
+        {
+            *ppv = static_cast<INetworkListManagerEvents*>(this);
+        }
+#ifdef __INetworkCostManager_INTERFACE_DEFINED__
+        else if ( riid == __uuidof(INetworkCostManagerEvents) )
+        {
+            *ppv = static_cast<INetworkCostManagerEvents*>(this);
+        }
+#endif
+        else
+        {
+            *ppv = NULL;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        return S_OK;
+    }
+
+    virtual ULONG STDMETHODCALLTYPE AddRef()
+    {
+        return InterlockedIncrement(&m_refCount);
+    }
+
+    virtual ULONG STDMETHODCALLTYPE Release()
+    {
+        const LONG refCount = InterlockedDecrement(&m_refCount);
+        if ( refCount == 0 )
+            delete this;
+        return refCount;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE ConnectivityChanged(NLM_CONNECTIVITY connectivity)
+    {
+        if ( connectivity & (NLM_CONNECTIVITY_IPV4_INTERNET | NLM_CONNECTIVITY_IPV6_INTERNET) )
+            m_callback();
+        return S_OK;
+    }
+
+#ifdef __INetworkCostManager_INTERFACE_DEFINED__
+    virtual HRESULT STDMETHODCALLTYPE CostChanged(DWORD /*newCost*/, NLM_SOCKADDR * /*destAddr*/)
+    {
+        m_callback();
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE DataPlanStatusChanged(NLM_SOCKADDR * /*destAddr*/)
+    {
+        return S_OK;
+    }
+#endif
+
+private:
+    volatile LONG m_refCount;
+    Callback m_callback;
+};
+
+/// Subscribes to events of a COM connection point as RIIA.
+class EventSubscription
+{
+public:
+    EventSubscription(IConnectionPointContainer *container, REFIID iid, IUnknown *sink)
+        : m_cookie(0)
+    {
+        if ( FAILED(container->FindConnectionPoint(iid, m_point.Receive())) )
+            m_point.Reset();
+        else if ( FAILED(m_point->Advise(sink, &m_cookie)) )
+            m_point.Reset();
+    }
+
+    ~EventSubscription()
+    {
+        if ( m_point.Get() )
+            m_point->Unadvise(m_cookie);
+    }
+
+private:
+    COMPtr<IConnectionPoint> m_point;
+    DWORD m_cookie;
+};
+
+/**
+    Watches the network connection while the scheduler runs.
+
+    The events are delivered to COM's multithreaded apartment, which this
+    thread keeps alive, so that it doesn't depend on the app's threads
+    pumping messages. Network List Manager is only available since Windows
+    Vista, the thread just exits on older systems.
+ */
+class NetworkChangeMonitor : public Thread
+{
+public:
+    NetworkChangeMonitor(NetworkEventsSink::Callback callback)
+        : Thread("WinSparkle network monitor", true), m_callback(callback) {}
+
+protected:
+    virtual void Run()
+    {
+        SignalReady();
+
+        COMInitializer com;
+
+        COMPtr<INetworkListManager> manager;
+        if ( FAILED(CoCreateInstance(__uuidof(NetworkListManager), NULL, CLSCTX_ALL,
+                                     __uuidof(INetworkListManager),
+                                     reinterpret_cast<void**>(manager.Receive()))) )
+        {
+            return;
+        }
+
+        COMPtr<IConnectionPointContainer> container;
+        if ( FAILED(manager->QueryInterface(__uuidof(IConnectionPointContainer),
+                                            reinterpret_cast<void**>(container.Receive()))) )
+        {
+            return;
+        }
+
+        NetworkEventsSink *sink = new NetworkEventsSink(m_callback);
+        {
+            IUnknown *unknown = static_cast<INetworkListManagerEvents*>(sink);
+            EventSubscription connectivity(container.Get(), __uuidof(INetworkListManagerEvents), unknown);
+#ifdef __INetworkCostManager_INTERFACE_DEFINED__
+            EventSubscription cost(container.Get(), __uuidof(INetworkCostManagerEvents), unknown);
+#endif
+
+            WaitForSingleObject(GetCancellationToken().GetHandle(), INFINITE);
+        }
+        sink->Release();
+    }
+
+    virtual bool IsJoinable() const { return true; }
+
+private:
+    NetworkEventsSink::Callback m_callback;
+};
+
+
+void OnCheckTimer();
+void OnNetworkChanged();
+
+// guards the variables below
+CriticalSection g_csScheduler("scheduler");
+
+// is the scheduler running?
+bool g_running = false;
+
+// is a check started by the scheduler in progress?
+bool g_checkInProgress = false;
+
+// was a due check deferred until the network connection changes?
+bool g_waitingForNetwork = false;
+
+// is the timer set for warming up connections before the check?
+bool g_warmupPending = false;
+
+SystemClock g_clock;
+
+// the scheduling decisions and the state they depend on
+SchedulePolicy g_policy(g_clock);
+
+CheckTimer g_timer(&OnCheckTimer);
+
+NetworkChangeMonitor *g_networkMonitor = NULL;
+
+NotificationListener *g_notificationListener = NULL;
+
+
+bool IsCheckEnabled()
+{
+    bool checkUpdates;
+    Settings::ReadConfigValue("CheckForUpdates", checkUpdates, false);
+    return checkUpdates;
+}
+
+// Returns the interval the appcast feed asks for at least, 0 if none.
+unsigned GetFeedCheckInterval()
+{
+    int feedInterval;
+    Settings::ReadConfigValue("AppcastCheckInterval", feedInterval, 0);
+    return unsigned((std::max)(feedInterval, 0));
+}
+
+// Returns the interval between checks in seconds: the one set by the app,
+// unless the appcast feed asks for checking less often.
+unsigned GetCheckInterval()
+{
+    return (std::max)(unsigned(win_sparkle_get_update_check_interval()), GetFeedCheckInterval());
+}
+
+// Reads the release history recorded by UpdateScheduler::OnReleaseSeen().
+void GetReleaseHistory(time_t& lastRelease, unsigned& releaseInterval)
+{
+    lastRelease = 0;
+    Settings::ReadConfigValue("LastReleaseTime", lastRelease);
+    int interval;
+    Settings::ReadConfigValue("ReleaseInterval", interval, 0);
+    releaseInterval = unsigned((std::max)(interval, 0));
+}
+
+time_t GetLastCheckTime()
+{
+    time_t lastCheck = 0;
+    Settings::ReadConfigValue("LastCheckTime", lastCheck);
+    return lastCheck;
+}
+
+// Reads the settings g_policy depends on. Must be called with g_csScheduler
+// locked.
+ScheduleConfig GetScheduleConfig()
+{
+    ScheduleConfig config;
+    config.checkEnabled = IsCheckEnabled();
+    config.checkInterval = GetCheckInterval();
+    config.minCheckInterval = unsigned(Settings::GetMinAdaptiveCheckInterval());
+    config.maxCheckInterval = unsigned(Settings::GetMaxAdaptiveCheckInterval());
+    if ( config.maxCheckInterval )
+    {
+        config.feedCheckInterval = GetFeedCheckInterval();
+        GetReleaseHistory(config.lastRelease, config.releaseInterval);
+    }
+    config.jitter = unsigned(Settings::GetUpdateCheckJitter());
+    config.connectionWarmup = Settings::GetConnectionWarmup();
+    config.checkInMaintenanceWindow = ShouldCheckInMaintenanceWindow();
+    if ( config.checkInMaintenanceWindow && GetMaintenanceWindows(config.maintenanceWindows) )
+        config.maintenanceWindowSlot = GetMaintenanceWindowSlot();
+    // only matters, and is only worth looking up, for a deferred download
+    config.savePower = g_policy.IsDownloadDeferred() && UpdateScheduler::ShouldSavePower();
+    return config;
+}
+
+// Sets the timer for the next check. Must be called with g_csScheduler locked.
+void ScheduleNextCheck()
+{
+    const ScheduleConfig config = GetScheduleConfig();
+    const time_t lastCheck = GetLastCheckTime();
+    const unsigned delay = g_policy.GetTimerDelay(config, lastCheck, g_warmupPending);
+    g_timer.Set(delay, unsigned(Settings::GetUpdateCheckTolerance()));
+
+    PipelineStatus::SetScheduler(g_waitingForNetwork ? WIN_SPARKLE_SCHEDULER_WAITING_FOR_NETWORK
+                                                     : WIN_SPARKLE_SCHEDULER_WAITING,
+                                 config.checkEnabled ? g_policy.GetNextCheckTime(config, lastCheck) : 0);
+}
+
+// Starts warming up connections and sets the timer for the check itself.
+// Must be called with g_csScheduler locked.
+void StartWarmup()
+{
+    g_warmupPending = false;
+
+    // not fatal if it fails, the check just has to connect itself
+    try
+    {
+        Thread *warmer = new ConnectionWarmer();
+        warmer->Start();
+    }
+    catch ( std::exception& e )
+    {
+        LogError(e.what());
+    }
+
+    // no tolerance, so that the connections aren't closed as idle meanwhile
+    g_timer.Set(SchedulePolicy::WARMUP_LEAD_TIME, 0);
+}
+
+// Should a due check be deferred because of the network connection? It is
+// while offline or on a metered connection without data budget left (see
+// DataBudget), for up to one check interval:
+// the check is eventually done even if the computer never gets on an
+// unmetered connection, or if Network List Manager wrongly reports it as
+// offline (as it may e.g. behind some proxies). Must be called with
+// g_csScheduler locked.
+bool ShouldWaitForNetwork(const ScheduleConfig& config, time_t lastCheck)
+{
+    if ( !g_policy.CanDeferCheck(config, lastCheck) )
+        return false;
+
+    return !IsConnectedToInternet() || DataBudget::GetAllowance() == 0;
+}
+
+void OnCheckTimer()
+{
+    try
+    {
+        CriticalSectionLocker lock(g_csScheduler);
+
+        if ( !g_running || g_checkInProgress )
+            return;
+
+        if ( g_warmupPending )
+        {
+            StartWarmup();
+            return;
+        }
+
+        const ScheduleConfig config = GetScheduleConfig();
+        const time_t lastCheck = GetLastCheckTime();
+        if ( config.checkEnabled && g_policy.IsCheckDue(config, lastCheck) )
+        {
+            if ( ShouldWaitForNetwork(config, lastCheck) )
+            {
+                // OnNetworkChanged() checks again as soon as it changes
+                g_waitingForNetwork = true;
+                g_timer.Set(NETWORK_RECHECK_INTERVAL, unsigned(Settings::GetUpdateCheckTolerance()));
+                PipelineStatus::SetScheduler(WIN_SPARKLE_SCHEDULER_WAITING_FOR_NETWORK,
+                                             g_policy.GetNextCheckTime(config, lastCheck));
+                return;
+            }
+
+            g_waitingForNetwork = false;
+            g_checkInProgress = true;
+            PipelineStatus::SetScheduler(WIN_SPARKLE_SCHEDULER_CHECKING, 0);
+            if ( g_policy.OnCheckStarted() )
+                Stats::RecordCheckRetry();
+            try
+            {
+                // the checker calls UpdateScheduler::OnCheckFinished() when done
+                UpdateChecker *check = new PeriodicUpdateChecker();
+                check->Start();
+            }
+            catch ( ... )
+            {
+                g_checkInProgress = false;
+                g_policy.OnCheckFailed(config, true, -1);
+                ScheduleNextCheck();
+                throw;
+            }
+        }
+        else
+        {
+            // the settings changed since the timer was set, or the timer
+            // was set for less than the full delay
+            ScheduleNextCheck();
+        }
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+void OnNetworkChanged()
+{
+    try
+    {
+        CriticalSectionLocker lock(g_csScheduler);
+
+        if ( g_running && g_waitingForNetwork && !g_checkInProgress )
+        {
+            // OnCheckTimer() decides if the new connection is good enough
+            g_policy.OnNetworkChanged();
+            ScheduleNextCheck();
+        }
+    }
+    CATCH_ALL_EXCEPTIONS
+}
+
+} // anonymous namespace
+
+
+/*--------------------------------------------------------------------------*
+                             UpdateScheduler
+ *--------------------------------------------------------------------------*/
+
+void UpdateScheduler::Start()
+{
+    CriticalSectionLocker lock(g_csScheduler);
+
+    if ( g_running )
+        return;
+
+    g_running = true;
+    try
+    {
+        ScheduleNextCheck();
+    }
+    catch ( ... )
+    {
+        g_running = false;
+        throw;
+    }
+
+    // Not fatal if it fails, deferred checks are then only retried after
+    // NETWORK_RECHECK_INTERVAL.
+    try
+    {
+        std::unique_ptr<NetworkChangeMonitor> monitor(new NetworkChangeMonitor(&OnNetworkChanged));
+        monitor->Start();
+        g_networkMonitor = monitor.release();
+    }
+    catch ( ... )
+    {
+    }
+
+    // Not fatal either, releases are then found by the periodic checks.
+    const std::string notificationURL = Settings::GetUpdateNotificationURL();
+    if ( !notificationURL.empty() && IsCheckEnabled() )
+    {
+        try
+        {
+            std::unique_ptr<NotificationListener> listener(
+                new NotificationListener(notificationURL, &UpdateScheduler::OnUpdatePublished));
+            listener->Start();
+            g_notificationListener = listener.release();
+        }
+        catch ( std::exception& e )
+        {
+            LogError(e.what());
+        }
+    }
+}
+
+
+void UpdateScheduler::Stop()
+{
+    NetworkChangeMonitor *monitor;
+    NotificationListener *listener;
+    {
+        CriticalSectionLocker lock(g_csScheduler);
+        if ( !g_running )
+            return;
+        g_running = false;
+        g_waitingForNetwork = false;
+        g_policy.Reset();
+        PipelineStatus::SetScheduler(WIN_SPARKLE_SCHEDULER_STOPPED, 0);
+        monitor = g_networkMonitor;
+        g_networkMonitor = NULL;
+        listener = g_notificationListener;
+        g_notificationListener = NULL;
+    }
+
+    // The timer and network callbacks take g_csScheduler, so it must not be
+    // locked while waiting for them. Nothing sets the timer again once
+    // g_running is false, so it's safe not to.
+    g_timer.Cancel();
+
+    if ( monitor )
+    {
+        monitor->TerminateAndJoin();
+        delete monitor;
+    }
+
+    // its callback takes g_csScheduler too
+    if ( listener )
+    {
+        listener->TerminateAndJoin();
+        delete listener;
+    }
+}
+
+
+bool UpdateScheduler::IsValidMaintenanceWindows(const std::string& windows)
+{
+    std::vector<MaintenanceWindow> parsed;
+    return ParseMaintenanceWindows(windows, parsed);
+}
+
+
+bool UpdateScheduler::IsInMaintenanceWindow()
+{
+    std::vector<MaintenanceWindow> windows;
+    GetMaintenanceWindows(windows);
+    return g_policy.IsInMaintenanceWindow(windows);
+}
+
+
+time_t UpdateScheduler::GetMaintenanceWindowTime(time_t due)
+{
+    std::vector<MaintenanceWindow> windows;
+    if ( !GetMaintenanceWindows(windows) )
+        return due;
+
+    return g_policy.GetMaintenanceWindowTime(windows, GetMaintenanceWindowSlot(), due);
+}
+
+
+void UpdateScheduler::Reschedule()
+{
+    CriticalSectionLocker lock(g_csScheduler);
+
+    // if a check is in progress, the next one is scheduled after it anyway
+    if ( g_running && !g_checkInProgress )
+        ScheduleNextCheck();
+}
+
+
+bool UpdateScheduler::IsCheckDue()
+{
+    CriticalSectionLocker lock(g_csScheduler);
+
+    return g_policy.IsCheckDue(GetScheduleConfig(), GetLastCheckTime());
+}
+
+
+void UpdateScheduler::OnCheckSucceeded()
+{
+    CriticalSectionLocker lock(g_csScheduler);
+
+    g_checkInProgress = false;
+    g_policy.OnCheckSucceeded();
+
+    if ( g_running )
+        ScheduleNextCheck();
+}
+
+
+void UpdateScheduler::OnCheckFailed(bool transient, int retryAfter)
+{
+    CriticalSectionLocker lock(g_csScheduler);
+
+    g_checkInProgress = false;
+    g_policy.OnCheckFailed(GetScheduleConfig(), transient, retryAfter);
+
+    // if the computer went offline, retry as soon as it's back online
+    // rather than after the backoff delay
+    if ( transient && !IsConnectedToInternet() )
+        g_waitingForNetwork = true;
+
+    if ( g_running )
+        ScheduleNextCheck();
+}
+
+void UpdateScheduler::OnUpdatePublished()
+{
+    CriticalSectionLocker lock(g_csScheduler);
+
+    if ( !g_running )
+        return;
+
+    g_policy.OnUpdatePublished();
+
+    // if a check is in progress, the next one is scheduled after it anyway
+    if ( !g_checkInProgress )
+        ScheduleNextCheck();
+}
+
+
+void UpdateScheduler::OnReleaseSeen(time_t published)
+{
+    // the history is kept even if checks aren't adaptive (yet)
+    CriticalSectionLocker lock(g_csScheduler);
+
+    time_t lastRelease;
+    unsigned releaseInterval;
+    GetReleaseHistory(lastRelease, releaseInterval);
+    if ( !g_policy.OnReleaseSeen(published, lastRelease, releaseInterval) )
+        return;
+
+    Settings::WriteConfigValue("LastReleaseTime", lastRelease);
+    if ( releaseInterval )
+        Settings::WriteConfigValue("ReleaseInterval", int(releaseInterval));
+}
+
+
+
+bool UpdateScheduler::ShouldSavePower()
+{
+    if ( !Settings::GetPowerAwareDownloads() )
+        return false;
+
+    // SYSTEM_POWER_STATUS as of Windows 10 SDK; older SDKs call the battery
+    // saver flag Reserved1 (and older systems always set it to 0)
+    struct PowerStatus
+    {
+        BYTE ACLineStatus;
+        BYTE BatteryFlag;
+        BYTE BatteryLifePercent;
+        BYTE SystemStatusFlag;
+        DWORD BatteryLifeTime;
+        DWORD BatteryFullLifeTime;
+    };
+
+    PowerStatus status;
+    if ( !GetSystemPowerStatus(reinterpret_cast<SYSTEM_POWER_STATUS*>(&status)) )
+        return false;
+
+    // unknown AC line status (255) is treated as being on AC power
+    const bool onBattery = status.ACLineStatus == 0;
+    const bool batterySaver = (status.SystemStatusFlag & 1) != 0;
+    return onBattery || batterySaver;
+}
+
+
+void UpdateScheduler::OnDownloadDeferred()
+{
+    CriticalSectionLocker lock(g_csScheduler);
+
+    // the next check is scheduled when the current one finishes
+    if ( g_running )
+        g_policy.OnDownloadDeferred();
+}
+
+} // namespace winsparkle
@@ -0,0 +1,177 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _updatescheduler_h_
+#define _updatescheduler_h_
+
+#include <ctime>
+#include <string>
+
+namespace winsparkle
+{
+
+/**
+    Schedules periodic update checks.
+
+    Instead of keeping a thread sleeping until the next check is due, this
+    sets a thread pool timer and only starts a PeriodicUpdateChecker when
+    it fires, so no thread is held between checks.
+
+    A random delay of up to Settings::GetUpdateCheckJitter() is added to
+    the time of each check, so that many installations with the same check
+    interval don't all hit the appcast server at the same moment. The timer
+    may also be delayed by up to Settings::GetUpdateCheckTolerance() to let
+    the system coalesce it with other timers and save power.
+
+    Failed checks are retried with exponential backoff, delays requested by
+    the server with Retry-After are honored and checks are never done more
+    often than the appcast feed allows with <sparkle:checkInterval>. This
+    keeps the clients from overwhelming the server while it has problems.
+
+    With win_sparkle_set_adaptive_check_interval(), the interval follows
+    the publication dates of the releases found by the checks instead.
+
+    If the app set an update notification server, it is listened to while
+    the scheduler runs and announced releases are checked for right away.
+
+    If background downloads are limited to maintenance windows (see
+    win_sparkle_set_maintenance_windows()), checks that may download are
+    done in the windows, at this installation's random moment within them
+    rather than the jitter, so that the downloads are spread over the
+    whole windows.
+
+    The decisions themselves are made by SchedulePolicy, which doesn't
+    depend on the system, so that tools/fleetsim.cpp can simulate them.
+ */
+class UpdateScheduler
+{
+public:
+    /**
+        Starts scheduling update checks.
+
+        The first check is done right away (give or take the jitter) if it
+        is due already. Does nothing if the scheduler is running.
+     */
+    static void Start();
+
+    /**
+        Stops scheduling update checks.
+
+        Waits for the timer callback if it's running, but a check that was
+        already started isn't interrupted.
+     */
+    static void Stop();
+
+    /**
+        Re-evaluates when the next check should be done.
+
+        Call this when the check interval or whether to check at all
+        changes. Does nothing if the scheduler isn't running.
+     */
+    static void Reschedule();
+
+    /**
+        Is a periodic check due now?
+
+        This is false e.g. if another instance of the app, sharing the same
+        settings, did the check since the scheduler started the checker.
+     */
+    static bool IsCheckDue();
+
+    /// Schedules the next check after a check started by the scheduler succeeded.
+    static void OnCheckSucceeded();
+
+    /**
+        Schedules the next attempt after a check started by the scheduler
+        failed.
+
+        @param transient   Whether the error is likely to go away soon, e.g.
+                           a network error. Such checks are retried with
+                           increasing delays, others only after the usual
+                           interval.
+        @param retryAfter  Number of seconds the server asked to wait before
+                           trying again, -1 if it didn't.
+     */
+    static void OnCheckFailed(bool transient, int retryAfter = -1);
+
+    /**
+        Schedules a check as soon as possible, because the server announced
+        a new release (see NotificationListener).
+
+        The check still honors the retry delays after failures, the jitter
+        and MIN_NOTIFIED_CHECK_INTERVAL since the last check.
+     */
+    static void OnUpdatePublished();
+
+    /**
+        Records that a check found the newest release published at
+        @a published, so that adaptive checks can follow the releases'
+        cadence, see SchedulePolicy::GetCheckInterval().
+     */
+    static void OnReleaseSeen(time_t published);
+
+    /// Are @a windows valid for win_sparkle_set_maintenance_windows()?
+    static bool IsValidMaintenanceWindows(const std::string& windows);
+
+    /**
+        May updates be downloaded in the background now?
+
+        True if no maintenance windows are set or one of them is open.
+     */
+    static bool IsInMaintenanceWindow();
+
+    /**
+        Returns when a background download due at @a due may start.
+
+        That's @a due itself if no maintenance windows are set, or if it's
+        within a window, but no sooner than this installation's moment in
+        that window. Otherwise it's this installation's moment in the next
+        window. The moment is picked randomly on first use and kept, so
+        that the downloads are spread evenly over the windows.
+     */
+    static time_t GetMaintenanceWindowTime(time_t due);
+
+    /**
+        Should background downloads wait to save power?
+
+        True while the computer runs on battery or in battery saver mode,
+        unless disabled with win_sparkle_set_power_aware_downloads().
+        Update checks themselves are cheap and aren't affected.
+     */
+    static bool ShouldSavePower();
+
+    /**
+        Called when a check done in the background didn't download the
+        update because ShouldSavePower().
+
+        The scheduler then watches the power state and checks again as soon
+        as the computer is on AC power, so that the download is done then.
+     */
+    static void OnDownloadDeferred();
+};
+
+} // namespace winsparkle
+
+#endif // _updatescheduler_h_
@@ -27,56 +27,164 @@
 #define _utils_h_
 
 #include "error.h"
+#include "privateheap.h"
 
+#include <new>
 #include <string>
 #include <string.h>
+#include <rpc.h>
 
 namespace winsparkle
 {
 
-/// Helper class for RIIA handling of allocated buffers
-template<typename T>
+/// Whether DataBuffer's content is zeroed, see DataBuffer::DataBuffer().
+enum DataBufferInit
+{
+    DataBuffer_Zeroed,
+    DataBuffer_Uninitialized  ///< for buffers that are filled right away
+};
+
+/**
+    Helper class for RIIA handling of allocated buffers.
+
+    Buffers of up to @a InlineBytes bytes, which is what most of the
+    queried strings need, are stored in the object itself and don't
+    allocate at all. Larger ones are transient memory from the scratch
+    heap (see PrivateHeap), so @a T must be a plain data type.
+ */
+template<typename T, size_t InlineBytes = 512>
 struct DataBuffer
 {
-    DataBuffer(size_t size)
+    explicit DataBuffer(size_t size, DataBufferInit init = DataBuffer_Zeroed)
+        : data(m_inline), m_size(INLINE_SIZE)
+    {
+        Reserve(size);
+        if ( init == DataBuffer_Zeroed )
+            memset(data, 0, size * sizeof(T));
+    }
+
+    ~DataBuffer() { Free(); }
+
+    /**
+        Makes room for at least @a size elements. The buffer is only ever
+        enlarged and its content is not preserved when it is.
+     */
+    void Reserve(size_t size)
     {
-        data = new T[size];
-        memset(data, 0, size * sizeof(T));
+        if ( size <= m_size )
+            return;
+        if ( size > size_t(-1) / sizeof(T) )
+            throw std::bad_alloc();
+        T *bigger = static_cast<T*>(PrivateHeap::AllocScratch(size * sizeof(T)));
+        if ( !bigger )
+            throw std::bad_alloc();
+        Free();
+        data = bigger;
+        m_size = size;
     }
 
-    ~DataBuffer() { delete[] data; }
+    size_t GetSize() const { return m_size; }
 
     operator T*() { return data; }
     operator const T*() const { return data; }
 
     T *data;
+
+private:
+    void Free()
+    {
+        if ( data != m_inline )
+            PrivateHeap::FreeScratch(data);
+    }
+
+    static const size_t INLINE_SIZE = InlineBytes / sizeof(T) ? InlineBytes / sizeof(T) : 1;
+
+    size_t m_size;
+    T m_inline[INLINE_SIZE];
+
+    DataBuffer(const DataBuffer&);
+    DataBuffer& operator=(const DataBuffer&);
 };
 
 
-// Simple conversion between wide and narrow strings (only safe for ASCII!):
+// Conversion between wide and narrow strings. Narrow strings are UTF-8
+// encoded, which is what appcasts and HTTP use. Most strings are pure ASCII
+// and are converted in a single tight loop, without calling into Windows.
 
-template<typename TIn, typename TOut>
-inline std::basic_string<TOut> ConvertString(const std::basic_string<TIn>& s)
+// Slow paths of WideToAnsi() and AnsiToWide() for non-ASCII strings
+inline std::string DoWideToUTF8(const std::wstring& s)
 {
-    std::basic_string<TOut> out;
-    out.reserve(s.length());
-
-    for ( typename std::basic_string<TIn>::const_iterator i = s.begin(); i != s.end(); ++i )
+    const int len = WideCharToMultiByte(CP_UTF8, 0, s.data(), (int)s.length(), NULL, 0, NULL, NULL);
+    std::string out;
+    if ( len > 0 )
     {
-        out += static_cast<TOut>(*i);
+        out.resize(len);
+        WideCharToMultiByte(CP_UTF8, 0, s.data(), (int)s.length(), &out[0], len, NULL, NULL);
     }
+    return out;
+}
 
+inline std::wstring DoUTF8ToWide(const std::string& s)
+{
+    const int len = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.length(), NULL, 0);
+    std::wstring out;
+    if ( len > 0 )
+    {
+        out.resize(len);
+        MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.length(), &out[0], len);
+    }
     return out;
 }
 
 inline std::string WideToAnsi(const std::wstring& s)
 {
-    return ConvertString<wchar_t, char>(s);
+    const size_t len = s.length();
+    std::string out;
+    out.resize(len);
+
+    const wchar_t *in = s.data();
+    char *o = len ? &out[0] : NULL;
+    wchar_t bits = 0;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        bits |= in[i];
+        o[i] = static_cast<char>(in[i]);
+    }
+
+    if ( bits < 0x80 )
+        return out;
+    return DoWideToUTF8(s);
 }
 
 inline std::wstring AnsiToWide(const std::string& s)
 {
-    return ConvertString<char, wchar_t>(s);
+    const size_t len = s.length();
+    std::wstring out;
+    out.resize(len);
+
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(s.data());
+    wchar_t *o = len ? &out[0] : NULL;
+    unsigned char bits = 0;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        bits |= in[i];
+        o[i] = in[i];
+    }
+
+    if ( bits < 0x80 )
+        return out;
+    return DoUTF8ToWide(s);
+}
+
+// Conversion that simply truncates characters to 8 bits, as WideToAnsi()
+// did in earlier versions. Only use it where compatibility requires it.
+inline std::string LegacyWideToAnsi(const std::wstring& s)
+{
+    std::string out;
+    out.resize(s.length());
+    for ( size_t i = 0; i < s.length(); i++ )
+        out[i] = static_cast<char>(s[i]);
+    return out;
 }
 
 
@@ -112,6 +220,20 @@ inline T* LoadDynamicFunc(const char *func, const char *dll)
     LoadDynamicFunc<decltype(func)>(#func, #dll)
 
 
+// Returns a random number from the range [0, max].
+inline unsigned GetRandomNumber(unsigned max)
+{
+    if ( max == 0 )
+        return 0;
+
+    // version 4 UUIDs are random and, unlike rand(), don't need seeding
+    // that would be the same in processes started at the same time
+    UUID uuid;
+    UuidCreate(&uuid);
+    return unsigned(uuid.Data1 % (max + 1ULL));
+}
+
+
 // Check for insecure URLs
 inline bool CheckForInsecureURL(const std::string& url, const std::string& purpose)
 {
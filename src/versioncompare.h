@@ -0,0 +1,257 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _versioncompare_h_
+#define _versioncompare_h_
+
+#include <stddef.h>
+
+/*
+    Version comparison that can be evaluated at compile time.
+
+    This implements the same rules as UpdateChecker::CompareVersions() and
+    VersionKey (based on Sparkle's SUStandardVersionComparator), written as
+    C++11 constexpr functions, so that versions known at compile time can be
+    compared at compile time too. Visual C++ before 2015 doesn't support
+    constexpr; the functions are then ordinary inline functions.
+
+    The functions recurse once per character and component, so they are
+    only meant for constant versions, such as in the static_asserts below.
+    Versions from appcasts must be compared with VersionKey instead: a long
+    enough version string would overflow the stack.
+ */
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+    #define WINSPARKLE_CONSTEXPR inline
+    #define WINSPARKLE_HAS_CONSTEXPR 0
+#else
+    #define WINSPARKLE_CONSTEXPR constexpr
+    #define WINSPARKLE_HAS_CONSTEXPR 1
+#endif
+
+namespace winsparkle
+{
+
+namespace versioncompare
+{
+
+// String characters classification. Valid components of version numbers
+// are numbers, period or string fragments ("beta" etc.). A component is
+// continuous run of characters with the same classification, except for
+// periods, which are always components on their own (so ".." means there's
+// an empty component value).
+enum CharType
+{
+    Type_Number,
+    Type_Period,
+    Type_String
+};
+
+WINSPARKLE_CONSTEXPR CharType ClassifyChar(char c)
+{
+    return c == '.' ? Type_Period
+         : (c >= '0' && c <= '9') ? Type_Number
+         : Type_String;
+}
+
+// Returns end of the run of characters of given type starting at i.
+WINSPARKLE_CONSTEXPR size_t ScanRun(const char *s, size_t i, CharType type)
+{
+    return (s[i] != 0 && ClassifyChar(s[i]) == type) ? ScanRun(s, i + 1, type) : i;
+}
+
+// Returns end of the component starting at i.
+WINSPARKLE_CONSTEXPR size_t PartEnd(const char *s, size_t i)
+{
+    return ClassifyChar(s[i]) == Type_Period ? i + 1 : ScanRun(s, i + 1, ClassifyChar(s[i]));
+}
+
+// Skips leading zeros of a number, but not its last digit.
+WINSPARKLE_CONSTEXPR size_t SkipZeros(const char *s, size_t i, size_t end)
+{
+    return (i + 1 < end && s[i] == '0') ? SkipZeros(s, i + 1, end) : i;
+}
+
+WINSPARKLE_CONSTEXPR int CompareSizes(size_t a, size_t b)
+{
+    return a == b ? 0 : (a > b ? 1 : -1);
+}
+
+WINSPARKLE_CONSTEXPR int CompareChars(const char *a, size_t ia, const char *b, size_t ib, size_t n)
+{
+    return n == 0 ? 0
+         : a[ia] != b[ib] ? (static_cast<unsigned char>(a[ia]) > static_cast<unsigned char>(b[ib]) ? 1 : -1)
+         : CompareChars(a, ia + 1, b, ib + 1, n - 1);
+}
+
+// Without leading zeros, the longer number is larger; numbers of the same
+// length compare like strings.
+WINSPARKLE_CONSTEXPR int CompareDigits(const char *a, size_t ia, size_t ea, const char *b, size_t ib, size_t eb)
+{
+    return (ea - ia) != (eb - ib) ? CompareSizes(ea - ia, eb - ib)
+                                  : CompareChars(a, ia, b, ib, ea - ia);
+}
+
+WINSPARKLE_CONSTEXPR int CompareNumbers(const char *a, size_t ia, size_t ea, const char *b, size_t ib, size_t eb)
+{
+    return CompareDigits(a, SkipZeros(a, ia, ea), ea, b, SkipZeros(b, ib, eb), eb);
+}
+
+WINSPARKLE_CONSTEXPR int OrCompareSizes(int result, size_t a, size_t b)
+{
+    return result != 0 ? result : CompareSizes(a, b);
+}
+
+WINSPARKLE_CONSTEXPR int CompareStrings(const char *a, size_t ia, size_t ea, const char *b, size_t ib, size_t eb)
+{
+    return OrCompareSizes(CompareChars(a, ia, b, ib, (ea - ia) < (eb - ib) ? (ea - ia) : (eb - ib)),
+                          ea - ia, eb - ib);
+}
+
+WINSPARKLE_CONSTEXPR int CompareSameType(CharType type, const char *a, size_t ia, size_t ea, const char *b, size_t ib, size_t eb)
+{
+    return type == Type_Number ? CompareNumbers(a, ia, ea, b, ib, eb)
+         : type == Type_String ? CompareStrings(a, ia, ea, b, ib, eb)
+         : 0;
+}
+
+WINSPARKLE_CONSTEXPR int CompareDifferentTypes(CharType a, CharType b)
+{
+    return (a != Type_String && b == Type_String) ? 1           // 1.2.0 > 1.2rc1
+         : (a == Type_String && b != Type_String) ? -1          // 1.2rc1 < 1.2.0
+         : (a == Type_Number ? 1 : -1);                          // period is invalid
+}
+
+WINSPARKLE_CONSTEXPR int CompareFrom(const char *a, size_t ia, const char *b, size_t ib);
+
+WINSPARKLE_CONSTEXPR int OrCompareFrom(int result, const char *a, size_t ia, const char *b, size_t ib)
+{
+    return result != 0 ? result : CompareFrom(a, ia, b, ib);
+}
+
+WINSPARKLE_CONSTEXPR int ComparePart(const char *a, size_t ia, size_t ea, const char *b, size_t ib, size_t eb)
+{
+    return ClassifyChar(a[ia]) != ClassifyChar(b[ib])
+           ? CompareDifferentTypes(ClassifyChar(a[ia]), ClassifyChar(b[ib]))
+           : OrCompareFrom(CompareSameType(ClassifyChar(a[ia]), a, ia, ea, b, ib, eb), a, ea, b, eb);
+}
+
+// Compares the versions from the i-th character on. If one version has more
+// components, its next one decides: 1.5 > 1.5b3, but 1.5.1 > 1.5.
+WINSPARKLE_CONSTEXPR int CompareFrom(const char *a, size_t ia, const char *b, size_t ib)
+{
+    return (a[ia] == 0 && b[ib] == 0) ? 0
+         : a[ia] == 0 ? (ClassifyChar(b[ib]) == Type_String ? 1 : -1)
+         : b[ib] == 0 ? (ClassifyChar(a[ia]) == Type_String ? -1 : 1)
+         : ComparePart(a, ia, PartEnd(a, ia), b, ib, PartEnd(b, ib));
+}
+
+} // namespace versioncompare
+
+/**
+    Compares versions @a a and @a b.
+
+    @return 0 if the versions are identical, negative value if @a a is
+            smaller than @a b, positive value if @a a is larger than @a b.
+
+    @note Don't use this for versions that aren't compile-time constants,
+          use VersionKey or UpdateChecker::CompareVersions() instead.
+ */
+WINSPARKLE_CONSTEXPR int CompareVersionStrings(const char *a, const char *b)
+{
+    return versioncompare::CompareFrom(a, 0, b, 0);
+}
+
+#if WINSPARKLE_HAS_CONSTEXPR
+// The comparison rules, checked whenever this header is compiled:
+static_assert(CompareVersionStrings("1.0", "1.0") == 0, "identical versions");
+static_assert(CompareVersionStrings("", "") == 0, "empty versions");
+static_assert(CompareVersionStrings("1.10", "1.9") > 0, "numbers compare by value");
+static_assert(CompareVersionStrings("1.007", "1.7") == 0, "leading zeros are ignored");
+static_assert(CompareVersionStrings("1.100000000000000000000", "1.99999999999999999999") > 0, "long numbers don't overflow");
+static_assert(CompareVersionStrings("1.5.1", "1.5") > 0, "more numeric components is newer");
+static_assert(CompareVersionStrings("1.5", "1.5b3") > 0, "prerelease is older than release");
+static_assert(CompareVersionStrings("1.2rc1", "1.2.0") < 0, "prerelease is older than next component");
+static_assert(CompareVersionStrings("2.0beta2", "2.0beta") > 0, "prerelease numbers");
+static_assert(CompareVersionStrings("2.0rc1", "2.0beta2") > 0, "prerelease names compare as strings");
+static_assert(CompareVersionStrings("1.2", "1..2") > 0, "number is newer than period");
+static_assert(CompareVersionStrings("1.00.0", "1.0.0") == 0, "leading zeros in the middle");
+
+namespace versioncompare
+{
+
+// Real-world versions in ascending order: dotted, prerelease suffixes,
+// build numbers, dates and numbers too long for 64 bits.
+constexpr const char *ORDERED_VERSIONS[] =
+{
+    "0.9.9",
+    "1.0a1",
+    "1.0b1",
+    "1.0b2",
+    "1.0b10",
+    "1.0rc1",
+    "1.0",
+    "1.0.1",
+    "1.0.2",
+    "1.0.10",
+    "1.1b1",
+    "1.1",
+    "1.9",
+    "1.10",
+    "2.0.0.4567",
+    "2.0.0.12345",
+    "2.1.20231231",
+    "2.1.20240101",
+    "2.1.99999999999999999999",
+    "2.1.100000000000000000000",
+    "10.0"
+};
+
+// Checks that v[i] is older than all of v[j..n), and v[j..n) newer than it.
+constexpr bool IsOlderThanAll(const char *const *v, size_t i, size_t j, size_t n)
+{
+    return j == n ||
+           (CompareVersionStrings(v[i], v[j]) < 0 &&
+            CompareVersionStrings(v[j], v[i]) > 0 &&
+            IsOlderThanAll(v, i, j + 1, n));
+}
+
+// Checks that v[i..n) is strictly ascending, comparing every pair, so that
+// the order is consistent (antisymmetric and transitive) and not just
+// between neighbours.
+constexpr bool IsAscending(const char *const *v, size_t i, size_t n)
+{
+    return i == n || (IsOlderThanAll(v, i, i + 1, n) && IsAscending(v, i + 1, n));
+}
+
+static_assert(IsAscending(ORDERED_VERSIONS, 0, sizeof(ORDERED_VERSIONS) / sizeof(ORDERED_VERSIONS[0])),
+              "real-world versions are ordered");
+
+} // namespace versioncompare
+#endif
+
+} // namespace winsparkle
+
+#endif // _versioncompare_h_
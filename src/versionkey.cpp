@@ -0,0 +1,229 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "versionkey.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace winsparkle
+{
+
+// Note: This code is based on Sparkle's SUStandardVersionComparator by
+//       Andy Matuschak.
+
+namespace
+{
+
+// String characters classification. Valid components of version numbers
+// are numbers, period or string fragments ("beta" etc.).
+enum CharType
+{
+    Type_Number,
+    Type_Period,
+    Type_String
+};
+
+CharType ClassifyChar(char c)
+{
+    if ( c == '.' )
+        return Type_Period;
+    else if ( c >= '0' && c <= '9' )
+        return Type_Number;
+    else
+        return Type_String;
+}
+
+// numbers with more digits than this may not fit into 64 bits
+const unsigned MAX_NUMERIC_DIGITS = 19;
+
+} // anonymous namespace
+
+
+VersionKey::VersionKey(const std::string& version)
+    : m_version(version), m_count(0)
+{
+    // Split version string into individual components. A component is
+    // continuous run of characters with the same classification. For
+    // example, "1.20rc3" would be split into ["1",".","20","rc","3"].
+    const char *begin = m_version.data();
+    const char *end = begin + m_version.length();
+
+    for ( const char *ptr = begin; ptr != end; )
+    {
+        const char *start = ptr;
+        const CharType type = ClassifyChar(*ptr++);
+
+        // Period gets special treatment, because "." always delimiters
+        // components in version strings (and so ".." means there's empty
+        // component value).
+        if ( type != Type_Period )
+        {
+            while ( ptr != end && ClassifyChar(*ptr) == type )
+                ptr++;
+        }
+
+        Part part;
+        part.type = static_cast<unsigned char>(type);
+        part.value = 0;
+
+        if ( type == Type_Number )
+        {
+            // "007" is the same as "7"
+            while ( start != ptr - 1 && *start == '0' )
+                start++;
+            if ( ptr - start <= MAX_NUMERIC_DIGITS )
+            {
+                for ( const char *d = start; d != ptr; ++d )
+                    part.value = part.value * 10 + (*d - '0');
+            }
+        }
+
+        part.offset = static_cast<unsigned>(start - begin);
+        part.length = static_cast<unsigned>(ptr - start);
+        AddPart(part);
+    }
+}
+
+
+void VersionKey::AddPart(const Part& part)
+{
+    if ( m_count < INLINE_PARTS )
+        m_inline[m_count] = part;
+    else
+        m_overflow.push_back(part);
+    m_count++;
+}
+
+
+// Compares two components of the same type.
+int VersionKey::CompareParts(const Part& a, const Part& b, const VersionKey& other) const
+{
+    const char *strA = m_version.data() + a.offset;
+    const char *strB = other.m_version.data() + b.offset;
+
+    if ( a.type == Type_Number )
+    {
+        // without leading zeros, the longer number is larger
+        if ( a.length != b.length )
+            return (a.length > b.length) ? 1 : -1;
+        if ( a.length <= MAX_NUMERIC_DIGITS )
+        {
+            if ( a.value != b.value )
+                return (a.value > b.value) ? 1 : -1;
+            return 0;
+        }
+        // huge numbers of the same length compare like strings
+        return memcmp(strA, strB, a.length);
+    }
+    else if ( a.type == Type_String )
+    {
+        const int result = memcmp(strA, strB, (std::min)(a.length, b.length));
+        if ( result != 0 )
+            return result;
+        if ( a.length != b.length )
+            return (a.length > b.length) ? 1 : -1;
+        return 0;
+    }
+    else
+    {
+        return 0; // periods are all the same
+    }
+}
+
+
+int VersionKey::Compare(const VersionKey& other) const
+{
+    // Compare common length of both version strings.
+    const size_t n = (std::min)(GetPartCount(), other.GetPartCount());
+    for ( size_t i = 0; i < n; i++ )
+    {
+        const Part& a = GetPart(i);
+        const Part& b = other.GetPart(i);
+
+        if ( a.type == b.type )
+        {
+            const int result = CompareParts(a, b, other);
+            if ( result != 0 )
+                return result;
+        }
+        else // components of different types
+        {
+            if ( a.type != Type_String && b.type == Type_String )
+            {
+                // 1.2.0 > 1.2rc1
+                return 1;
+            }
+            else if ( a.type == Type_String && b.type != Type_String )
+            {
+                // 1.2rc1 < 1.2.0
+                return -1;
+            }
+            else
+            {
+                // One is a number and the other is a period. The period
+                // is invalid.
+                return (a.type == Type_Number) ? 1 : -1;
+            }
+        }
+    }
+
+    // The versions are equal up to the point where they both still have
+    // parts. Lets check to see if one is larger than the other.
+    if ( GetPartCount() == other.GetPartCount() )
+        return 0; // the two strings are identical
+
+    // Lets get the next part of the larger version string
+    // Note that 'n' already holds the index of the part we want.
+
+    int shorterResult, longerResult;
+    unsigned char missingPartType; // ('missing' as in "missing in shorter version")
+
+    if ( GetPartCount() > other.GetPartCount() )
+    {
+        missingPartType = GetPart(n).type;
+        shorterResult = -1;
+        longerResult = 1;
+    }
+    else
+    {
+        missingPartType = other.GetPart(n).type;
+        shorterResult = 1;
+        longerResult = -1;
+    }
+
+    if ( missingPartType == Type_String )
+    {
+        // 1.5 > 1.5b3
+        return shorterResult;
+    }
+    else
+    {
+        // 1.5.1 > 1.5
+        return longerResult;
+    }
+}
+
+} // namespace winsparkle
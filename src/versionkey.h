@@ -0,0 +1,101 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _versionkey_h_
+#define _versionkey_h_
+
+#include <string>
+#include <vector>
+
+namespace winsparkle
+{
+
+/**
+    Version string prepared for fast comparisons.
+
+    The string is split into components once, when the key is created, and
+    numeric components are converted to numbers, so that comparing two keys
+    is just a walk over the components. This makes keys suitable for sorting
+    many versions, where each one is compared many times.
+
+    The comparison is the same as UpdateChecker::CompareVersions() and
+    CompareVersionStrings() do.
+ */
+class VersionKey
+{
+public:
+    explicit VersionKey(const std::string& version = std::string());
+
+    /// Returns the version string.
+    const std::string& GetVersion() const { return m_version; }
+
+    /**
+        Compares versions.
+
+        @return 0 if the versions are identical, negative value if this
+                version is smaller than @a other, positive value if it is
+                larger.
+     */
+    int Compare(const VersionKey& other) const;
+
+    bool operator==(const VersionKey& other) const { return Compare(other) == 0; }
+    bool operator!=(const VersionKey& other) const { return Compare(other) != 0; }
+    bool operator<(const VersionKey& other) const { return Compare(other) < 0; }
+    bool operator>(const VersionKey& other) const { return Compare(other) > 0; }
+    bool operator<=(const VersionKey& other) const { return Compare(other) <= 0; }
+    bool operator>=(const VersionKey& other) const { return Compare(other) >= 0; }
+
+private:
+    struct Part
+    {
+        // one of the CharType values from versionkey.cpp
+        unsigned char type;
+        // where the component is in m_version; for numbers, leading zeros
+        // are not included
+        unsigned offset, length;
+        // numeric value of the component, if it's a number short enough
+        unsigned long long value;
+    };
+
+    size_t GetPartCount() const { return m_count; }
+    const Part& GetPart(size_t i) const
+        { return i < INLINE_PARTS ? m_inline[i] : m_overflow[i - INLINE_PARTS]; }
+    void AddPart(const Part& part);
+
+    int CompareParts(const Part& a, const Part& b, const VersionKey& other) const;
+
+    std::string m_version;
+
+    // Most versions have just a few components, so they are stored here
+    // instead of in a separately allocated vector.
+    static const size_t INLINE_PARTS = 8;
+    Part m_inline[INLINE_PARTS];
+    std::vector<Part> m_overflow;
+    size_t m_count;
+};
+
+} // namespace winsparkle
+
+#endif // _versionkey_h_
@@ -0,0 +1,928 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "downloadbackend.h"
+
+#include "download.h"
+#include "error.h"
+#include "settings.h"
+#include "threads.h"
+#include "utils.h"
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <windows.h>
+#include <winhttp.h>
+#include <iphlpapi.h>
+
+#ifdef _MSC_VER
+#pragma comment(lib, "winhttp.lib")
+#pragma comment(lib, "iphlpapi.lib")
+#endif
+
+// not defined in older SDKs:
+#ifndef WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY
+    #define WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY 4
+#endif
+#ifndef WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL
+    #define WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL 133
+#endif
+#ifndef WINHTTP_PROTOCOL_FLAG_HTTP2
+    #define WINHTTP_PROTOCOL_FLAG_HTTP2 0x1
+#endif
+#ifndef WINHTTP_PROTOCOL_FLAG_HTTP3
+    #define WINHTTP_PROTOCOL_FLAG_HTTP3 0x2
+#endif
+#ifndef WINHTTP_OPTION_DECOMPRESSION
+    #define WINHTTP_OPTION_DECOMPRESSION 118
+#endif
+#ifndef WINHTTP_DECOMPRESSION_FLAG_GZIP
+    #define WINHTTP_DECOMPRESSION_FLAG_GZIP    0x00000001
+    #define WINHTTP_DECOMPRESSION_FLAG_DEFLATE 0x00000002
+#endif
+
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+// Receives completions of an asynchronous request, see WinHTTPAsyncRequest.
+struct WinHTTPAsyncTarget
+{
+    // Called for WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE, _HEADERS_AVAILABLE,
+    // _READ_COMPLETE and _REQUEST_ERROR, on the thread of the callback.
+    virtual void OnCompletion(DWORD status, DWORD error, DWORD bytesRead) = 0;
+};
+
+// State shared between a request and its status callback.
+struct WinHTTPRequestContext
+{
+    WinHTTPRequestContext() : lastError(ERROR_SUCCESS), bytesRead(0), secureFailure(0), async(NULL) {}
+    DWORD lastError;
+    DWORD bytesRead;
+    // WINHTTP_CALLBACK_STATUS_FLAG_* of the last TLS failure, if any
+    DWORD secureFailure;
+    HttpPhaseTimer phases;
+    Event eventComplete;
+    OneShotEvent eventClosed;
+    // if set, completions go to it instead of signaling eventComplete
+    WinHTTPAsyncTarget *async;
+};
+
+void CALLBACK WinHTTPStatusCallback(_In_ HINTERNET hInternet,
+                                    _In_ DWORD_PTR dwContext,
+                                    _In_ DWORD     dwInternetStatus,
+                                    _In_ LPVOID    lpvStatusInformation,
+                                    _In_ DWORD     dwStatusInformationLength)
+{
+    WinHTTPRequestContext *context = (WinHTTPRequestContext*)dwContext;
+
+    // notifications for the session and connection handles have no context
+    if (!context)
+        return;
+
+    if ( context->async )
+    {
+        switch (dwInternetStatus)
+        {
+            case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+            case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+                context->async->OnCompletion(dwInternetStatus, ERROR_SUCCESS, 0);
+                return;
+            case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+                context->async->OnCompletion(dwInternetStatus, ERROR_SUCCESS, dwStatusInformationLength);
+                return;
+            case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+                context->async->OnCompletion(dwInternetStatus,
+                                             ((WINHTTP_ASYNC_RESULT*)lpvStatusInformation)->dwError,
+                                             0);
+                return;
+        }
+    }
+
+    switch (dwInternetStatus)
+    {
+        case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+        case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+            context->lastError = ERROR_SUCCESS;
+            context->eventComplete.Signal();
+            break;
+
+        case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+            context->lastError = ERROR_SUCCESS;
+            context->bytesRead = dwStatusInformationLength;
+            context->eventComplete.Signal();
+            break;
+
+        case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+            context->lastError = ((WINHTTP_ASYNC_RESULT*)lpvStatusInformation)->dwError;
+            context->eventComplete.Signal();
+            break;
+
+        case WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING:
+            context->eventClosed.Signal();
+            break;
+
+        case WINHTTP_CALLBACK_STATUS_SECURE_FAILURE:
+            // reported before the request fails with ERROR_WINHTTP_SECURE_FAILURE
+            context->secureFailure = *(DWORD*)lpvStatusInformation;
+            break;
+
+        case WINHTTP_CALLBACK_STATUS_RESOLVING_NAME:
+            context->phases.OnPhase(HttpPhase_Resolving);
+            break;
+        case WINHTTP_CALLBACK_STATUS_NAME_RESOLVED:
+            context->phases.OnPhase(HttpPhase_Resolved);
+            break;
+        case WINHTTP_CALLBACK_STATUS_CONNECTING_TO_SERVER:
+            context->phases.OnPhase(HttpPhase_Connecting);
+            break;
+        case WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER:
+            context->phases.OnPhase(HttpPhase_Connected);
+            break;
+        case WINHTTP_CALLBACK_STATUS_SENDING_REQUEST:
+            context->phases.OnPhase(HttpPhase_Sending);
+            break;
+        case WINHTTP_CALLBACK_STATUS_REQUEST_SENT:
+            context->phases.OnPhase(HttpPhase_Sent);
+            break;
+        case WINHTTP_CALLBACK_STATUS_RECEIVING_RESPONSE:
+            context->phases.OnPhase(HttpPhase_Receiving);
+            break;
+        case WINHTTP_CALLBACK_STATUS_RESPONSE_RECEIVED:
+            context->phases.OnPhase(HttpPhase_Received);
+            break;
+        case WINHTTP_CALLBACK_STATUS_REDIRECT:
+            context->phases.OnPhase(HttpPhase_Redirect);
+            break;
+        case WINHTTP_CALLBACK_STATUS_CONNECTION_CLOSED:
+            context->phases.OnPhase(HttpPhase_ConnectionClosed);
+            break;
+    }
+}
+
+
+SharedSession::Handle OpenWinHTTPSession()
+{
+    const std::wstring userAgent = MakeUserAgent();
+
+    HINTERNET session = WinHttpOpen
+                        (
+                            userAgent.c_str(),
+                            WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY,
+                            WINHTTP_NO_PROXY_NAME,
+                            WINHTTP_NO_PROXY_BYPASS,
+                            WINHTTP_FLAG_ASYNC
+                        );
+    // Automatic proxy configuration is only available since Windows 8.1, use
+    // the proxy configured with netsh on older versions:
+    if ( !session && GetLastError() == ERROR_INVALID_PARAMETER )
+    {
+        session = WinHttpOpen
+                  (
+                      userAgent.c_str(),
+                      WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+                      WINHTTP_NO_PROXY_NAME,
+                      WINHTTP_NO_PROXY_BYPASS,
+                      WINHTTP_FLAG_ASYNC
+                  );
+    }
+    if ( !session )
+        throw Win32Exception();
+
+    // Child handles inherit the callback; the per-request context is
+    // set with WINHTTP_OPTION_CONTEXT_VALUE.
+    if ( WinHttpSetStatusCallback(session,
+                                  &WinHTTPStatusCallback,
+                                  WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS | WINHTTP_CALLBACK_FLAG_HANDLES |
+                                  WINHTTP_CALLBACK_FLAG_RESOLVE_NAME | WINHTTP_CALLBACK_FLAG_CONNECT_TO_SERVER |
+                                  WINHTTP_CALLBACK_FLAG_SEND_REQUEST | WINHTTP_CALLBACK_FLAG_RECEIVE_RESPONSE |
+                                  WINHTTP_CALLBACK_FLAG_REDIRECT | WINHTTP_CALLBACK_FLAG_CLOSE_CONNECTION |
+                                  WINHTTP_CALLBACK_FLAG_SECURE_FAILURE,
+                                  0) == WINHTTP_INVALID_STATUS_CALLBACK )
+    {
+        Win32Exception err;
+        WinHttpCloseHandle(session);
+        throw err;
+    }
+
+    // Not fatal if it fails, it only limits parallelism.
+    DWORD maxConns = GetMaxConnectionsPerServer();
+    WinHttpSetOption(session, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &maxConns, sizeof(maxConns));
+
+    // Name resolution isn't limited by default. Waiting for the response
+    // and its data is limited by WaitForNetworkIO() already, the receive
+    // timeout only backs it up.
+    WinHttpSetTimeouts(session, CONNECT_TIMEOUT, CONNECT_TIMEOUT, STALL_TIMEOUT, RESPONSE_TIMEOUT);
+
+    return session;
+}
+
+void CloseWinHTTPSession(SharedSession::Handle session)
+{
+    WinHttpSetStatusCallback(session, NULL, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+    WinHttpCloseHandle(session);
+}
+
+SharedSession g_session(&OpenWinHTTPSession, &CloseWinHTTPSession);
+
+
+// WinHttpGetProxyForUrl() is synchronous, so it uses a session of its own.
+SharedSession::Handle OpenProxyResolverSession()
+{
+    HINTERNET session = WinHttpOpen
+                        (
+                            MakeUserAgent().c_str(),
+                            WINHTTP_ACCESS_TYPE_NO_PROXY,
+                            WINHTTP_NO_PROXY_NAME,
+                            WINHTTP_NO_PROXY_BYPASS,
+                            0
+                        );
+    if ( !session )
+        throw Win32Exception();
+    return session;
+}
+
+void CloseProxyResolverSession(SharedSession::Handle session)
+{
+    WinHttpCloseHandle(session);
+}
+
+SharedSession g_proxySession(&OpenProxyResolverSession, &CloseProxyResolverSession);
+
+
+// Proxy to use for a server, as found by ProxyCache.
+struct ProxySettings
+{
+    ProxySettings() : accessType(WINHTTP_ACCESS_TYPE_NO_PROXY) {}
+    DWORD accessType;
+    std::wstring proxy, bypass;
+};
+
+// Takes ownership of the strings allocated by WinHTTP.
+std::wstring TakeWinHTTPString(LPWSTR str)
+{
+    if ( !str )
+        return std::wstring();
+    std::wstring s(str);
+    GlobalFree(str);
+    return s;
+}
+
+// Returns the IPv4 addresses of all network interfaces. The addresses
+// change when the computer connects to another network, which may have
+// a different (or no) WPAD server or require a different proxy.
+std::vector<DWORD> GetNetworkAddresses()
+{
+    std::vector<DWORD> addresses;
+
+    ULONG size = 0;
+    if ( GetIpAddrTable(NULL, &size, FALSE) != ERROR_INSUFFICIENT_BUFFER )
+        return addresses;
+
+    std::vector<char> buffer(size);
+    MIB_IPADDRTABLE *table = reinterpret_cast<MIB_IPADDRTABLE*>(&buffer[0]);
+    if ( GetIpAddrTable(table, &size, TRUE) != NO_ERROR )
+        return addresses;
+
+    for ( DWORD i = 0; i < table->dwNumEntries; i++ )
+        addresses.push_back(table->table[i].dwAddr);
+    return addresses;
+}
+
+/*
+    Resolves the proxy for each server once and remembers it.
+
+    With WPAD auto-discovery or a PAC script, resolving the proxy may take
+    seconds. Sessions are closed between update checks, and WinHTTP doesn't
+    keep its auto-proxy results across them (nor does it use auto-proxy at
+    all before Windows 8.1), so this would be paid for every check. Instead,
+    the result is cached for the lifetime of the process, until the network
+    changes.
+ */
+class ProxyCache
+{
+public:
+    // Returns the proxy to use for @a url; @a server identifies the server
+    // (scheme, host and port), as PAC scripts are only evaluated per server.
+    ProxySettings Get(const std::wstring& url, const std::wstring& server)
+    {
+        // Resolving is done under the lock, so that concurrent requests to
+        // the same server don't evaluate the PAC script in parallel.
+        CriticalSectionLocker lock(m_cs);
+
+        const std::vector<DWORD> addresses = GetNetworkAddresses();
+        if ( addresses != m_addresses )
+        {
+            m_servers.clear();
+            m_addresses = addresses;
+        }
+
+        std::map<std::wstring, ProxySettings>::const_iterator i = m_servers.find(server);
+        if ( i != m_servers.end() )
+            return i->second;
+
+        const ProxySettings proxy = Resolve(url);
+        m_servers[server] = proxy;
+        return proxy;
+    }
+
+private:
+    static ProxySettings Resolve(const std::wstring& url)
+    {
+        ProxySettings proxy;
+
+        WINHTTP_CURRENT_USER_IE_PROXY_CONFIG ieConfig;
+        memset(&ieConfig, 0, sizeof(ieConfig));
+        if ( !WinHttpGetIEProxyConfigForCurrentUser(&ieConfig) )
+        {
+            // use the proxy configured with netsh, if any
+            proxy.accessType = WINHTTP_ACCESS_TYPE_DEFAULT_PROXY;
+            return proxy;
+        }
+
+        const std::wstring autoConfigUrl = TakeWinHTTPString(ieConfig.lpszAutoConfigUrl);
+        const std::wstring ieProxy = TakeWinHTTPString(ieConfig.lpszProxy);
+        const std::wstring ieBypass = TakeWinHTTPString(ieConfig.lpszProxyBypass);
+
+        if ( ieConfig.fAutoDetect || !autoConfigUrl.empty() )
+        {
+            WINHTTP_AUTOPROXY_OPTIONS options;
+            memset(&options, 0, sizeof(options));
+            if ( ieConfig.fAutoDetect )
+            {
+                options.dwFlags |= WINHTTP_AUTOPROXY_AUTO_DETECT;
+                options.dwAutoDetectFlags = WINHTTP_AUTO_DETECT_TYPE_DHCP | WINHTTP_AUTO_DETECT_TYPE_DNS_A;
+            }
+            if ( !autoConfigUrl.empty() )
+            {
+                options.dwFlags |= WINHTTP_AUTOPROXY_CONFIG_URL;
+                options.lpszAutoConfigUrl = autoConfigUrl.c_str();
+            }
+            options.fAutoLogonIfChallenged = TRUE;
+
+            WINHTTP_PROXY_INFO info;
+            memset(&info, 0, sizeof(info));
+            SharedSessionRef session(g_proxySession);
+            if ( WinHttpGetProxyForUrl(session, url.c_str(), &options, &info) )
+            {
+                proxy.accessType = info.dwAccessType;
+                proxy.proxy = TakeWinHTTPString(info.lpszProxy);
+                proxy.bypass = TakeWinHTTPString(info.lpszProxyBypass);
+                return proxy;
+            }
+            // else: no WPAD server found or the script failed, fall back
+            // to the manually configured proxy, like browsers do
+        }
+
+        if ( !ieProxy.empty() )
+        {
+            proxy.accessType = WINHTTP_ACCESS_TYPE_NAMED_PROXY;
+            proxy.proxy = ieProxy;
+            proxy.bypass = ieBypass;
+        }
+        return proxy;
+    }
+
+    // guards the variables below:
+    CriticalSection m_cs;
+    std::vector<DWORD> m_addresses;
+    std::map<std::wstring, ProxySettings> m_servers;
+};
+
+ProxyCache g_proxyCache;
+
+
+// Returns the proxy to use for @a url, split into @a urlc.
+ProxySettings GetProxySettings(const std::wstring& url, const URL_COMPONENTS& urlc)
+{
+    std::wstring server(url, 0, urlc.lpszHostName - url.c_str() + urlc.dwHostNameLength);
+    server += L":" + std::to_wstring((unsigned long long)urlc.nPort);
+    return g_proxyCache.Get(url, server);
+}
+
+
+// Thrown by WinHTTPResponse::Open() if the request failed only because the
+// certificate's revocation status couldn't be looked up, with
+// RevocationCheck_SoftFail.
+struct RevocationOfflineError
+{
+};
+
+
+class WinHTTPResponse : public IHttpResponse
+{
+public:
+    WinHTTPResponse(Thread *onThread)
+        : m_session(g_session),
+          m_connect(NULL), m_request(NULL), m_hasContext(false),
+          m_revocationSoftFail(false),
+          m_onThread(onThread)
+    {
+    }
+
+    ~WinHTTPResponse()
+    {
+        if ( m_request )
+        {
+            WinHttpCloseHandle(m_request);
+            // the callback may still be running with m_context:
+            if ( m_hasContext )
+                m_context.eventClosed.WaitUntilSignaled();
+        }
+        if ( m_connect )
+            WinHttpCloseHandle(m_connect);
+    }
+
+    // Sends a GET request, or a POST one with @a body if it isn't NULL,
+    // and waits for the response headers.
+    void Open(const std::wstring& url, const URL_COMPONENTS& urlc, const std::string& headers,
+              const std::string *body, int flags)
+    {
+        Start(url, urlc, headers, body, flags);
+        WaitForCompletion(NetworkWait_Response);
+
+        if ( !WinHttpReceiveResponse(m_request, NULL) )
+            throw Win32Exception();
+        WaitForCompletion(NetworkWait_Response);
+    }
+
+    // Starts sending the request like Open(), but doesn't wait for it; the
+    // completions are passed to @a async, which must outlive this object.
+    void StartAsync(const std::wstring& url, const URL_COMPONENTS& urlc, const std::string& headers,
+                    int flags, WinHTTPAsyncTarget *async)
+    {
+        m_context.async = async;
+        Start(url, urlc, headers, NULL, flags);
+    }
+
+    HINTERNET GetHandle() const { return m_request; }
+
+private:
+    // Sends the request, without waiting for any of it to complete.
+    void Start(const std::wstring& url, const URL_COMPONENTS& urlc, const std::string& headers,
+               const std::string *body, int flags)
+    {
+        const std::wstring host(urlc.lpszHostName, urlc.dwHostNameLength);
+        // the query string immediately follows the path:
+        const std::wstring path(urlc.lpszUrlPath, urlc.dwUrlPathLength + urlc.dwExtraInfoLength);
+
+        m_connect = WinHttpConnect(m_session, host.c_str(), urlc.nPort, 0);
+        if ( !m_connect )
+            throw Win32Exception();
+
+        DWORD dwFlags = 0;
+        if ( urlc.nScheme == INTERNET_SCHEME_HTTPS )
+            dwFlags |= WINHTTP_FLAG_SECURE;
+        // For some requests (appcast feeds), don't allow proxies to cache,
+        // as we need the most up-to-date information. (WinHTTP doesn't have
+        // a local cache that would need to be bypassed too.)
+        if ( flags & Download_BypassProxies )
+            dwFlags |= WINHTTP_FLAG_REFRESH;
+
+        m_request = WinHttpOpenRequest
+                    (
+                        m_connect,
+                        body ? L"POST" : L"GET",
+                        path.c_str(),
+                        NULL, // HTTP/1.1
+                        WINHTTP_NO_REFERER,
+                        WINHTTP_DEFAULT_ACCEPT_TYPES,
+                        dwFlags
+                    );
+        if ( !m_request )
+            throw Win32Exception();
+
+        DWORD_PTR context = (DWORD_PTR)&m_context;
+        if ( !WinHttpSetOption(m_request, WINHTTP_OPTION_CONTEXT_VALUE, &context, sizeof(context)) )
+            throw Win32Exception();
+        m_hasContext = true;
+
+        // Use the cached proxy; if setting it fails, WinHTTP resolves it itself.
+        ProxySettings proxy = GetProxySettings(url, urlc);
+        if ( proxy.accessType != WINHTTP_ACCESS_TYPE_DEFAULT_PROXY )
+        {
+            WINHTTP_PROXY_INFO info;
+            info.dwAccessType = proxy.accessType;
+            info.lpszProxy = proxy.proxy.empty() ? WINHTTP_NO_PROXY_NAME : &proxy.proxy[0];
+            info.lpszProxyBypass = proxy.bypass.empty() ? WINHTTP_NO_PROXY_BYPASS : &proxy.bypass[0];
+            WinHttpSetOption(m_request, WINHTTP_OPTION_PROXY, &info, sizeof(info));
+        }
+
+        // Use HTTP/3 if the OS supports it (Windows 11+) and the server
+        // advertises it, otherwise HTTP/2 (Windows 10 1607+); either lets
+        // concurrent requests to the same server share one connection.
+        // Ignore failure, older systems use HTTP/1.1.
+        DWORD protocols = WINHTTP_PROTOCOL_FLAG_HTTP2 | WINHTTP_PROTOCOL_FLAG_HTTP3;
+        if ( !WinHttpSetOption(m_request, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &protocols, sizeof(protocols)) )
+        {
+            protocols = WINHTTP_PROTOCOL_FLAG_HTTP2;
+            WinHttpSetOption(m_request, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &protocols, sizeof(protocols));
+        }
+
+        // WinHTTP doesn't check revocation unless asked to. Failed lookups
+        // aren't ignored by older versions, the soft-fail mode handles them
+        // by repeating the request without the check, see WinHTTPBackend::Open().
+        if ( urlc.nScheme == INTERNET_SCHEME_HTTPS && ShouldCheckRevocation(host) )
+        {
+            DWORD feature = WINHTTP_ENABLE_SSL_REVOCATION;
+            if ( WinHttpSetOption(m_request, WINHTTP_OPTION_ENABLE_FEATURE, &feature, sizeof(feature)) )
+                m_revocationSoftFail = Settings::GetRevocationCheck() == Settings::RevocationCheck_SoftFail;
+        }
+
+        // WinHTTP sends Accept-Encoding and decompresses the response itself
+        // if it supports this (Windows 8.1+), ignore failure
+        if ( flags & Download_Compressed )
+        {
+            DWORD decompression = WINHTTP_DECOMPRESSION_FLAG_GZIP | WINHTTP_DECOMPRESSION_FLAG_DEFLATE;
+            WinHttpSetOption(m_request, WINHTTP_OPTION_DECOMPRESSION, &decompression, sizeof(decompression));
+        }
+
+        const std::wstring wheaders = AnsiToWide(headers);
+        if ( !WinHttpSendRequest
+              (
+                  m_request,
+                  wheaders.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : wheaders.c_str(),
+                  (DWORD)wheaders.length(),
+                  body ? (LPVOID)body->data() : WINHTTP_NO_REQUEST_DATA,
+                  body ? (DWORD)body->size() : 0, // dwOptionalLength
+                  body ? (DWORD)body->size() : 0, // dwTotalLength
+                  context
+              ) )
+        {
+            throw Win32Exception();
+        }
+    }
+
+public:
+    virtual unsigned GetStatusCode()
+    {
+        DWORD statusCode = 0;
+        DWORD statusCodeSize = sizeof(statusCode);
+        if ( !WinHttpQueryHeaders(m_request,
+                                  WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+                                  WINHTTP_HEADER_NAME_BY_INDEX,
+                                  &statusCode, &statusCodeSize,
+                                  WINHTTP_NO_HEADER_INDEX) )
+        {
+            return 0;
+        }
+        return statusCode;
+    }
+
+    virtual bool GetHeader(const char *name, std::string& value)
+    {
+        wchar_t buffer[1024];
+        DWORD bufferSize = sizeof(buffer);
+        if ( !WinHttpQueryHeaders(m_request,
+                                  WINHTTP_QUERY_CUSTOM,
+                                  AnsiToWide(name).c_str(),
+                                  buffer, &bufferSize,
+                                  WINHTTP_NO_HEADER_INDEX) )
+        {
+            return false;
+        }
+        value = WideToAnsi(std::wstring(buffer, bufferSize / sizeof(wchar_t)));
+        return true;
+    }
+
+    virtual std::string GetURL()
+    {
+        DWORD ousize = 0;
+        WinHttpQueryOption(m_request, WINHTTP_OPTION_URL, NULL, &ousize);
+        if ( GetLastError() != ERROR_INSUFFICIENT_BUFFER )
+            return std::string();
+
+        const size_t len = ousize / sizeof(wchar_t);
+        DataBuffer<wchar_t> optionurl(len + 1, DataBuffer_Uninitialized);
+        if ( !WinHttpQueryOption(m_request, WINHTTP_OPTION_URL, optionurl.data, &ousize) )
+            return std::string();
+        optionurl.data[len] = 0;
+        return WideToAnsi(optionurl.data);
+    }
+
+    virtual size_t Read(void *buffer, size_t len)
+    {
+        // in asynchronous mode, the number of bytes read is reported by
+        // WINHTTP_CALLBACK_STATUS_READ_COMPLETE
+        if ( !WinHttpReadData(m_request, buffer, (DWORD)len, NULL) )
+            throw Win32Exception();
+        WaitForCompletion(NetworkWait_Data);
+        return m_context.bytesRead;
+    }
+
+    virtual HttpPhaseTimings GetPhaseTimings()
+    {
+        return m_context.phases.GetTimings();
+    }
+
+private:
+    void WaitForCompletion(NetworkWait wait)
+    {
+        WaitForNetworkIO(m_context.eventComplete, m_onThread, wait);
+        if ( m_context.lastError != ERROR_SUCCESS )
+        {
+            if ( m_revocationSoftFail &&
+                 m_context.lastError == ERROR_WINHTTP_SECURE_FAILURE &&
+                 m_context.secureFailure == WINHTTP_CALLBACK_STATUS_FLAG_CERT_REV_FAILED )
+            {
+                throw RevocationOfflineError();
+            }
+
+            SetLastError(m_context.lastError);
+            throw Win32Exception();
+        }
+    }
+
+    SharedSessionRef m_session;
+    HINTERNET m_connect, m_request;
+    WinHTTPRequestContext m_context;
+    bool m_hasContext;
+    bool m_revocationSoftFail;
+    Thread *m_onThread;
+};
+
+
+/*
+    Request made with IDownloadBackend::OpenURLAsync().
+
+    Each completion starts the next step from the status callback, on
+    WinHTTP's thread pool: sending the request, receiving the response and
+    reading the data one chunk at a time, until the handler is done with
+    it. No thread waits for the request meanwhile.
+ */
+class WinHTTPAsyncRequest : public IAsyncRequest, private WinHTTPAsyncTarget
+{
+public:
+    WinHTTPAsyncRequest(IAsyncResponseHandler *handler)
+        : m_response(new WinHTTPResponse(NULL)),
+          m_handler(handler),
+          m_buffer(READ_CHUNK_SIZE, DataBuffer_Uninitialized),
+          m_readState(Read_Idle), m_inlineRead(0)
+    {
+    }
+
+    ~WinHTTPAsyncRequest()
+    {
+        // closes the request and waits for its callback to finish, which
+        // must happen while this object is still intact
+        m_response.reset();
+    }
+
+    void Start(const std::wstring& url, const URL_COMPONENTS& urlc, const std::string& headers, int flags)
+    {
+        m_response->StartAsync(url, urlc, headers, flags, this);
+    }
+
+private:
+    // Size of the chunks read at once.
+    static const DWORD READ_CHUNK_SIZE = 64 * 1024;
+
+    enum ReadState
+    {
+        Read_Idle,
+        // WinHttpReadData() is being called
+        Read_Issuing,
+        // it returned, the data will arrive later
+        Read_Pending,
+        // the data arrived before it returned
+        Read_Completed
+    };
+
+    virtual void OnCompletion(DWORD status, DWORD error, DWORD bytesRead)
+    {
+        switch ( status )
+        {
+            case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+                if ( !WinHttpReceiveResponse(m_response->GetHandle(), NULL) )
+                    Fail(GetLastError());
+                break;
+
+            case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+                if ( Deliver(NULL, 0) )
+                    ReadNext();
+                break;
+
+            case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+                // If WinHttpReadData() is still being called on this thread,
+                // let ReadNext() continue instead of nesting it here, so
+                // that the stack doesn't grow with every chunk that was
+                // already available.
+                m_inlineRead = bytesRead;
+                if ( InterlockedCompareExchange(&m_readState, Read_Completed, Read_Issuing) == Read_Issuing )
+                    break;
+                if ( Deliver(m_buffer.data, bytesRead) )
+                    ReadNext();
+                break;
+
+            case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+                Fail(error);
+                break;
+        }
+    }
+
+    // Reads chunks of the body until one doesn't arrive immediately.
+    void ReadNext()
+    {
+        for ( ;; )
+        {
+            InterlockedExchange(&m_readState, Read_Issuing);
+            if ( !WinHttpReadData(m_response->GetHandle(), m_buffer.data, READ_CHUNK_SIZE, NULL) )
+            {
+                Fail(GetLastError());
+                return;
+            }
+
+            if ( InterlockedCompareExchange(&m_readState, Read_Pending, Read_Issuing) == Read_Issuing )
+                return; // OnCompletion() continues when the data arrive
+
+            if ( !Deliver(m_buffer.data, m_inlineRead) )
+                return;
+        }
+    }
+
+    // Passes the headers (if @a data is NULL) or a chunk of the body to the
+    // handler. Returns false if the request ended.
+    bool Deliver(const void *data, DWORD len)
+    {
+        if ( data && len == 0 )
+        {
+            // all of the body was read
+            m_handler->OnComplete(std::string());
+            return false;
+        }
+
+        try
+        {
+            const bool more = data ? m_handler->OnData(data, len) : m_handler->OnHeaders(*m_response);
+            if ( !more )
+                m_handler->OnComplete(std::string());
+            return more;
+        }
+        catch ( const std::exception& e )
+        {
+            m_handler->OnComplete(e.what());
+        }
+        catch ( ... )
+        {
+            m_handler->OnComplete("Unknown error.");
+        }
+        return false;
+    }
+
+    void Fail(DWORD error)
+    {
+        SetLastError(error);
+        m_handler->OnComplete(Win32Exception().what());
+    }
+
+    std::unique_ptr<WinHTTPResponse> m_response;
+    IAsyncResponseHandler *m_handler;
+    DataBuffer<char> m_buffer;
+    volatile LONG m_readState;
+    // length of the chunk that arrived while in Read_Issuing state
+    DWORD m_inlineRead;
+};
+
+
+// Splits @a url into its components, which point into it.
+void CrackWinHTTPURL(const std::wstring& url, URL_COMPONENTS& urlc)
+{
+    memset(&urlc, 0, sizeof(urlc));
+    urlc.dwStructSize = sizeof(urlc);
+    // let WinHttpCrackUrl() point into url:
+    urlc.dwHostNameLength = (DWORD)-1;
+    urlc.dwUrlPathLength = (DWORD)-1;
+    urlc.dwExtraInfoLength = (DWORD)-1;
+
+    if ( !WinHttpCrackUrl(url.c_str(), 0, 0, &urlc) )
+        throw Win32Exception();
+}
+
+
+class WinHTTPBackend : public IDownloadBackend
+{
+public:
+    virtual IHttpResponse *OpenURL(const std::string& url,
+                                   const std::string& headers,
+                                   int flags,
+                                   Thread *onThread)
+    {
+        return Open(url, headers, NULL, flags, onThread);
+    }
+
+    virtual IHttpResponse *PostData(const std::string& url,
+                                    const std::string& headers,
+                                    const std::string& body,
+                                    Thread *onThread)
+    {
+        return Open(url, headers, &body, 0, onThread);
+    }
+
+    virtual IAsyncRequest *OpenURLAsync(const std::string& url,
+                                        const std::string& headers,
+                                        int flags,
+                                        IAsyncResponseHandler *handler)
+    {
+        const std::wstring wurl = AnsiToWide(url);
+        URL_COMPONENTS urlc;
+        CrackWinHTTPURL(wurl, urlc);
+
+        std::unique_ptr<WinHTTPAsyncRequest> request(new WinHTTPAsyncRequest(handler));
+        request->Start(wurl, urlc, headers, flags);
+        return request.release();
+    }
+
+    virtual void CloseSession()
+    {
+        g_session.Close();
+        g_proxySession.Close();
+    }
+
+    virtual std::string GetProxyForURL(const std::string& url)
+    {
+        const std::wstring wurl = AnsiToWide(url);
+        URL_COMPONENTS urlc;
+        CrackWinHTTPURL(wurl, urlc);
+
+        const ProxySettings proxy = GetProxySettings(wurl, urlc);
+        switch ( proxy.accessType )
+        {
+            case WINHTTP_ACCESS_TYPE_NO_PROXY:
+                return "DIRECT";
+            case WINHTTP_ACCESS_TYPE_NAMED_PROXY:
+                return WideToAnsi(proxy.proxy);
+            default:
+                // the one configured with netsh, which WinHTTP reads itself
+                return std::string();
+        }
+    }
+
+private:
+    IHttpResponse *Open(const std::string& url,
+                        const std::string& headers,
+                        const std::string *body,
+                        int flags,
+                        Thread *onThread)
+    {
+        const std::wstring wurl = AnsiToWide(url);
+        URL_COMPONENTS urlc;
+        CrackWinHTTPURL(wurl, urlc);
+
+        std::unique_ptr<WinHTTPResponse> response(new WinHTTPResponse(onThread));
+        try
+        {
+            response->Open(wurl, urlc, headers, body, flags);
+        }
+        catch ( RevocationOfflineError& )
+        {
+            // connect without the check, and don't wait for the lookups
+            // again for a while
+            RememberRevocationOffline(std::wstring(urlc.lpszHostName, urlc.dwHostNameLength));
+            response.reset(new WinHTTPResponse(onThread));
+            response->Open(wurl, urlc, headers, body, flags);
+        }
+        return response.release();
+    }
+};
+
+WinHTTPBackend g_backend;
+
+} // anonymous namespace
+
+
+IDownloadBackend& GetWinHTTPBackend()
+{
+    return g_backend;
+}
+
+} // namespace winsparkle
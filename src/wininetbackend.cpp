@@ -0,0 +1,516 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "downloadbackend.h"
+
+#include "download.h"
+#include "error.h"
+#include "settings.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <memory>
+#include <windows.h>
+#include <wininet.h>
+
+// not defined in older SDKs:
+#ifndef INTERNET_OPTION_HTTP_DECODING
+    #define INTERNET_OPTION_HTTP_DECODING 65
+#endif
+#ifndef ERROR_INTERNET_SEC_CERT_REV_FAILED
+    #define ERROR_INTERNET_SEC_CERT_REV_FAILED 12057
+#endif
+
+
+namespace winsparkle
+{
+
+/*--------------------------------------------------------------------------*
+                                helpers
+ *--------------------------------------------------------------------------*/
+
+namespace
+{
+
+struct InetHandle
+{
+    InetHandle(HINTERNET handle = 0) : m_handle(handle) {}
+
+    ~InetHandle()
+    {
+        Close();
+    }
+
+    InetHandle& operator=(HINTERNET handle)
+    {
+        Close();
+        m_handle = handle;
+        return *this;
+    }
+
+    void Close()
+    {
+        if (m_handle)
+        {
+            InternetCloseHandle(m_handle);
+            m_handle = NULL;
+        }
+    }
+
+    operator HINTERNET() const { return m_handle; }
+
+    HINTERNET m_handle;
+};
+
+struct DownloadCallbackContext
+{
+    DownloadCallbackContext(InetHandle *conn_) : conn(conn_), lastError(ERROR_SUCCESS)
+    {
+        // the callback runs on WinINet's threads, outside of the activity
+        hasActivity = Tracing::GetCurrentActivityId(activity);
+    }
+
+    InetHandle *conn;
+    DWORD lastError;
+    Event eventRequestComplete;
+    GUID activity;
+    bool hasActivity;
+    HttpPhaseTimer phases;
+};
+
+// Returns the request phase that WinINet's status stands for, false if none.
+bool GetHttpPhase(DWORD status, HttpPhase& phase)
+{
+    switch (status)
+    {
+        case INTERNET_STATUS_RESOLVING_NAME:        phase = HttpPhase_Resolving;        break;
+        case INTERNET_STATUS_NAME_RESOLVED:         phase = HttpPhase_Resolved;         break;
+        case INTERNET_STATUS_CONNECTING_TO_SERVER:  phase = HttpPhase_Connecting;       break;
+        case INTERNET_STATUS_CONNECTED_TO_SERVER:   phase = HttpPhase_Connected;        break;
+        case INTERNET_STATUS_SENDING_REQUEST:       phase = HttpPhase_Sending;          break;
+        case INTERNET_STATUS_REQUEST_SENT:          phase = HttpPhase_Sent;             break;
+        case INTERNET_STATUS_RECEIVING_RESPONSE:    phase = HttpPhase_Receiving;        break;
+        case INTERNET_STATUS_RESPONSE_RECEIVED:     phase = HttpPhase_Received;         break;
+        case INTERNET_STATUS_REDIRECT:              phase = HttpPhase_Redirect;         break;
+        case INTERNET_STATUS_CONNECTION_CLOSED:     phase = HttpPhase_ConnectionClosed; break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Traces progress of a request through the connection phases. The TLS
+// handshake is not reported by WinINet, it's between Connected and
+// SendingRequest.
+void TraceConnectionPhase(const DownloadCallbackContext& context, HttpPhase phase)
+{
+    const char *name;
+    switch (phase)
+    {
+        case HttpPhase_Resolving:        name = "ResolvingName";    break;
+        case HttpPhase_Resolved:         name = "NameResolved";     break;
+        case HttpPhase_Connecting:       name = "Connecting";       break;
+        case HttpPhase_Connected:        name = "Connected";        break;
+        case HttpPhase_Sending:          name = "SendingRequest";   break;
+        case HttpPhase_Sent:             name = "RequestSent";      break;
+        case HttpPhase_Redirect:         name = "Redirect";         break;
+        case HttpPhase_ConnectionClosed: name = "ConnectionClosed"; break;
+        default:
+            // reported for every chunk of the response, too many to trace
+            return;
+    }
+
+    TraceEvent("ConnectionPhase", Tracing::Level_Verbose)
+        .Field("Phase", name)
+        .Write(context.hasActivity ? &context.activity : NULL);
+}
+
+void CALLBACK DownloadInternetStatusCallback(_In_ HINTERNET hInternet,
+                                             _In_ DWORD_PTR dwContext,
+                                             _In_ DWORD     dwInternetStatus,
+                                             _In_ LPVOID    lpvStatusInformation,
+                                             _In_ DWORD     dwStatusInformationLength)
+{
+    DownloadCallbackContext *context = (DownloadCallbackContext*)dwContext;
+    INTERNET_ASYNC_RESULT *res = (INTERNET_ASYNC_RESULT*)lpvStatusInformation;
+
+    if (!context)
+        return;
+
+    switch (dwInternetStatus)
+    {
+        case INTERNET_STATUS_HANDLE_CREATED:
+            context->conn->m_handle = (HINTERNET)(res->dwResult);
+            break;
+
+        case INTERNET_STATUS_REQUEST_COMPLETE:
+            context->lastError = res->dwError;
+            context->eventRequestComplete.Signal();
+            break;
+
+        default:
+        {
+            HttpPhase phase;
+            if ( GetHttpPhase(dwInternetStatus, phase) )
+            {
+                context->phases.OnPhase(phase);
+                if ( Tracing::IsEnabled(Tracing::Level_Verbose) )
+                    TraceConnectionPhase(*context, phase);
+            }
+            break;
+        }
+    }
+}
+
+
+// Does WinINet decompress responses for us? (IE 8+)
+bool g_httpDecoding = false;
+
+SharedSession::Handle OpenWinINetSession()
+{
+    HINTERNET session = InternetOpen
+                        (
+                            MakeUserAgent().c_str(),
+                            INTERNET_OPEN_TYPE_PRECONFIG,
+                            NULL, // lpszProxyName
+                            NULL, // lpszProxyBypass
+                            INTERNET_FLAG_ASYNC // dwFlags
+                        );
+    if ( !session )
+        throw Win32Exception();
+
+    // Child handles inherit the callback; the per-request context is
+    // passed as dwContext to InternetOpenUrl().
+    InternetSetStatusCallback(session, &DownloadInternetStatusCallback);
+
+    // Allow all segments of a segmented download to be fetched at once.
+    // Not fatal if it fails, it only limits parallelism.
+    DWORD maxConns = GetMaxConnectionsPerServer();
+    InternetSetOption(session, INTERNET_OPTION_MAX_CONNS_PER_SERVER, &maxConns, sizeof(maxConns));
+
+    // The default is a minute per attempt, for several attempts; the other
+    // phases' budgets are enforced by WaitForNetworkIO().
+    DWORD connectTimeout = CONNECT_TIMEOUT;
+    InternetSetOption(session, INTERNET_OPTION_CONNECT_TIMEOUT, &connectTimeout, sizeof(connectTimeout));
+
+    // Decompress responses to requests made with Download_Compressed. This
+    // doesn't affect other requests, they don't send Accept-Encoding.
+    BOOL decoding = TRUE;
+    g_httpDecoding =
+        InternetSetOption(session, INTERNET_OPTION_HTTP_DECODING, &decoding, sizeof(decoding)) != FALSE;
+
+    return session;
+}
+
+void CloseWinINetSession(SharedSession::Handle session)
+{
+    InternetSetStatusCallback(session, NULL);
+    InternetCloseHandle(session);
+}
+
+SharedSession g_session(&OpenWinINetSession, &CloseWinINetSession);
+
+
+class WinINetResponse : public IHttpResponse
+{
+public:
+    WinINetResponse(Thread *onThread)
+        : m_session(g_session), m_context(&m_conn), m_onThread(onThread)
+    {
+    }
+
+    void Open(const std::string& url, const std::string& headers, DWORD dwFlags)
+    {
+        HINTERNET conn_raw = InternetOpenUrlA
+                             (
+                                 m_session,
+                                 url.c_str(),
+                                 headers.empty() ? NULL : headers.c_str(), // lpszHeaders
+                                 -1,   // dwHeadersLength
+                                 dwFlags,
+                                 (DWORD_PTR)&m_context  // dwContext
+                             );
+        // InternetOpenUrl() may return NULL handle and then fill it in asynchronously from
+        // DownloadInternetStatusCallback. We must make sure we don't overwrite the handle
+        // in that case, or throw an error.
+        if (conn_raw)
+        {
+            m_conn = conn_raw;
+        }
+        else
+        {
+            if (GetLastError() != ERROR_IO_PENDING)
+                throw Win32Exception();
+        }
+
+        WaitForNetworkIO(m_context.eventRequestComplete, m_onThread, NetworkWait_Response);
+        CheckResponse();
+    }
+
+    // InternetOpenUrl() can only make GET requests, POST needs the request
+    // handle to be created explicitly.
+    void Post(const URL_COMPONENTSA& urlc, const std::string& headers, const std::string& body, DWORD dwFlags)
+    {
+        const std::string host(urlc.lpszHostName, urlc.dwHostNameLength);
+        // the query string immediately follows the path:
+        const std::string path(urlc.lpszUrlPath, urlc.dwUrlPathLength + urlc.dwExtraInfoLength);
+
+        // no context, the callback ignores the connection handle's
+        // notifications; it doesn't do any I/O itself
+        m_connection = InternetConnectA(m_session, host.c_str(), urlc.nPort,
+                                        NULL, NULL, INTERNET_SERVICE_HTTP, 0, 0);
+        if ( !m_connection )
+            throw Win32Exception();
+
+        m_conn = HttpOpenRequestA(m_connection, "POST", path.c_str(), NULL, NULL, NULL,
+                                  dwFlags, (DWORD_PTR)&m_context);
+        if ( !m_conn )
+            throw Win32Exception();
+
+        // added to the request, so that they're resent with the body by
+        // ResendIgnoringRevocation() too
+        if ( !headers.empty() &&
+             !HttpAddRequestHeadersA(m_conn, headers.c_str(), (DWORD)-1,
+                                     HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE) )
+        {
+            throw Win32Exception();
+        }
+
+        // kept until the request completes, WinINet sends it asynchronously
+        m_body = body;
+        Send();
+        CheckResponse();
+    }
+
+    virtual HttpPhaseTimings GetPhaseTimings()
+    {
+        return m_context.phases.GetTimings();
+    }
+
+    virtual unsigned GetStatusCode()
+    {
+        DWORD statusCode = 0;
+        DWORD statusCodeSize = sizeof(statusCode);
+        DWORD headerIndex = 0;
+        if ( !HttpQueryInfoA(m_conn, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
+                             &statusCode, &statusCodeSize, &headerIndex) )
+        {
+            return 0;
+        }
+        return statusCode;
+    }
+
+    virtual bool GetHeader(const char *name, std::string& value)
+    {
+        // with HTTP_QUERY_CUSTOM, the buffer holds header name on input
+        char buffer[1024];
+        strncpy(buffer, name, sizeof(buffer) - 1);
+        buffer[sizeof(buffer) - 1] = 0;
+        DWORD bufferSize = sizeof(buffer);
+        DWORD headerIndex = 0;
+        if ( !HttpQueryInfoA(m_conn, HTTP_QUERY_CUSTOM, buffer, &bufferSize, &headerIndex) )
+            return false;
+        value.assign(buffer, bufferSize);
+        return true;
+    }
+
+    virtual std::string GetURL()
+    {
+        DWORD ousize = 0;
+        InternetQueryOptionA(m_conn, INTERNET_OPTION_URL, NULL, &ousize);
+        if ( GetLastError() != ERROR_INSUFFICIENT_BUFFER )
+            return std::string();
+
+        const size_t len = ousize;
+        DataBuffer<char> optionurl(len + 1, DataBuffer_Uninitialized);
+        if ( !InternetQueryOptionA(m_conn, INTERNET_OPTION_URL, optionurl, &ousize) )
+            return std::string();
+        optionurl.data[len] = 0;
+        return optionurl.data;
+    }
+
+    virtual size_t Read(void *buffer, size_t len)
+    {
+        for ( ;; )
+        {
+            INTERNET_BUFFERS ibuf = { 0 };
+            ibuf.dwStructSize = sizeof(ibuf);
+            ibuf.lpvBuffer = buffer;
+            ibuf.dwBufferLength = (DWORD)len;
+
+            if (!InternetReadFileEx(m_conn, &ibuf, IRF_ASYNC | IRF_NO_WAIT, NULL))
+            {
+                if (GetLastError() != ERROR_IO_PENDING)
+                    throw Win32Exception();
+
+                WaitForNetworkIO(m_context.eventRequestComplete, m_onThread, NetworkWait_Data);
+                continue;
+            }
+
+            if (ibuf.dwBufferLength == 0 && m_context.lastError != ERROR_SUCCESS)
+            {
+                SetLastError(m_context.lastError);
+                throw Win32Exception();
+            }
+
+            return ibuf.dwBufferLength;
+        }
+    }
+
+private:
+    // Checks the result of the request sent by Open() or Post().
+    void CheckResponse()
+    {
+        // Whether revocation is checked is the system's setting, but a
+        // failed lookup doesn't have to be fatal; a revoked certificate
+        // fails with a different error.
+        if (m_context.lastError == ERROR_INTERNET_SEC_CERT_REV_FAILED && m_conn &&
+            (Settings::GetRevocationCheck() == Settings::RevocationCheck_SoftFail ||
+             Settings::GetRevocationCheck() == Settings::RevocationCheck_Disabled))
+        {
+            ResendIgnoringRevocation();
+        }
+
+        if (m_context.lastError != ERROR_SUCCESS)
+        {
+            SetLastError(m_context.lastError);
+            throw Win32Exception();
+        }
+    }
+
+    void ResendIgnoringRevocation()
+    {
+        DWORD securityFlags = 0;
+        DWORD size = sizeof(securityFlags);
+        InternetQueryOptionA(m_conn, INTERNET_OPTION_SECURITY_FLAGS, &securityFlags, &size);
+        securityFlags |= SECURITY_FLAG_IGNORE_REVOCATION;
+        if ( !InternetSetOption(m_conn, INTERNET_OPTION_SECURITY_FLAGS, &securityFlags, sizeof(securityFlags)) )
+            return; // report the original error
+
+        Send();
+    }
+
+    // (Re)sends the request, with m_body if there's any.
+    void Send()
+    {
+        m_context.lastError = ERROR_SUCCESS;
+        if ( !HttpSendRequestA(m_conn, NULL, 0,
+                               m_body.empty() ? NULL : (LPVOID)m_body.data(), (DWORD)m_body.size()) )
+        {
+            if ( GetLastError() != ERROR_IO_PENDING )
+                throw Win32Exception();
+            WaitForNetworkIO(m_context.eventRequestComplete, m_onThread, NetworkWait_Response);
+        }
+    }
+
+    SharedSessionRef m_session;
+    // declared before m_conn, so that they outlive the request handle
+    DownloadCallbackContext m_context;
+    InetHandle m_connection;
+    std::string m_body;
+    InetHandle m_conn;
+    Thread *m_onThread;
+};
+
+
+class WinINetBackend : public IDownloadBackend
+{
+public:
+    virtual IHttpResponse *OpenURL(const std::string& url,
+                                   const std::string& headers,
+                                   int flags,
+                                   Thread *onThread)
+    {
+        URL_COMPONENTSA urlc;
+        memset(&urlc, 0, sizeof(urlc));
+        urlc.dwStructSize = sizeof(urlc);
+
+        if ( !InternetCrackUrlA(url.c_str(), 0, 0, &urlc) )
+            throw Win32Exception();
+
+        // Never allow local caching, always contact the server for both
+        // appcast feeds and downloads. This is useful in case of
+        // misconfigured servers.
+        DWORD dwFlags = INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_RELOAD;
+        // For some requests (appcast feeds), don't even allow proxies to cache,
+        // as we need the most up-to-date information.
+        if ( flags & Download_BypassProxies )
+            dwFlags |= INTERNET_FLAG_PRAGMA_NOCACHE;
+        if ( urlc.nScheme == INTERNET_SCHEME_HTTPS )
+            dwFlags |= INTERNET_FLAG_SECURE;
+
+        std::unique_ptr<WinINetResponse> response(new WinINetResponse(onThread));
+
+        // the session is open now, so g_httpDecoding is known
+        std::string allHeaders(headers);
+        if ( (flags & Download_Compressed) && g_httpDecoding )
+            allHeaders += "Accept-Encoding: gzip, deflate\r\n";
+
+        response->Open(url, allHeaders, dwFlags);
+        return response.release();
+    }
+
+    virtual IHttpResponse *PostData(const std::string& url,
+                                    const std::string& headers,
+                                    const std::string& body,
+                                    Thread *onThread)
+    {
+        URL_COMPONENTSA urlc;
+        memset(&urlc, 0, sizeof(urlc));
+        urlc.dwStructSize = sizeof(urlc);
+        // let InternetCrackUrl() point into url:
+        urlc.dwHostNameLength = 1;
+        urlc.dwUrlPathLength = 1;
+        urlc.dwExtraInfoLength = 1;
+
+        if ( !InternetCrackUrlA(url.c_str(), 0, 0, &urlc) )
+            throw Win32Exception();
+
+        DWORD dwFlags = INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_RELOAD | INTERNET_FLAG_KEEP_CONNECTION;
+        if ( urlc.nScheme == INTERNET_SCHEME_HTTPS )
+            dwFlags |= INTERNET_FLAG_SECURE;
+
+        std::unique_ptr<WinINetResponse> response(new WinINetResponse(onThread));
+        response->Post(urlc, headers, body, dwFlags);
+        return response.release();
+    }
+
+    virtual void CloseSession()
+    {
+        g_session.Close();
+    }
+};
+
+WinINetBackend g_backend;
+
+} // anonymous namespace
+
+
+IDownloadBackend& GetWinINetBackend()
+{
+    return g_backend;
+}
+
+} // namespace winsparkle
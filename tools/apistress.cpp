@@ -0,0 +1,558 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    apistress: calls the WinSparkle API from many threads at once, to find
+    deadlocks and to measure how much the threads wait for each other.
+
+    Setter threads change the settings, reader threads get them and the
+    statistics, checker threads start checks (with --ui, also ones with the
+    update dialog) and wait for asynchronous ones, and with --restart the
+    library is cleaned up and initialized again all the time. The checks
+    go to --appcast-url, by default a local port nobody listens on, so that
+    they fail fast and the run doesn't depend on the network.
+
+    A watchdog reports any call that doesn't return within --timeout, and
+    any asynchronous check that doesn't complete by then, and exits with
+    code 2. Otherwise, the lock contention counters of win_sparkle_get_stats()
+    are printed, with the waits broken down by lock from the API stall
+    reports (see win_sparkle_set_api_stall_threshold()).
+
+    The settings are stored in a file in the temporary directory, so the
+    registry isn't touched. Build it with -DWIN_SPARKLE_BUILD_APISTRESS=ON.
+ */
+
+#include "winsparkle.h"
+
+#include <windows.h>
+#include <process.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+struct Options
+{
+    Options()
+        : setters(4), readers(4), checkers(2), ui(false), restartInterval(0),
+          duration(10), timeout(30), stallThreshold(1),
+          appcastURL("https://127.0.0.1:9/appcast.xml") {}
+
+    unsigned setters;
+    unsigned readers;
+    unsigned checkers;
+    bool ui;
+    unsigned restartInterval;   // milliseconds, 0 if not restarting
+    unsigned duration;          // seconds
+    unsigned timeout;           // seconds
+    unsigned stallThreshold;    // milliseconds
+    std::string appcastURL;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: apistress [options]\n"
+        "\n"
+        "  --setters=N           threads changing the settings (4)\n"
+        "  --readers=N           threads getting the settings and statistics (4)\n"
+        "  --checkers=N          threads checking for updates (2)\n"
+        "  --ui                  the checkers also check with the update dialog\n"
+        "  --restart=MS          clean up and initialize again every MS milliseconds\n"
+        "  --duration=SECONDS    length of the run (10)\n"
+        "  --timeout=SECONDS     calls taking longer are reported as hangs (30)\n"
+        "  --stall-threshold=MS  see win_sparkle_set_api_stall_threshold() (1)\n"
+        "  --appcast-url=URL     feed to check (https://127.0.0.1:9/appcast.xml)\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--setters")) != NULL )
+            opts.setters = atoi(v);
+        else if ( (v = GetOptionValue(arg, "--readers")) != NULL )
+            opts.readers = atoi(v);
+        else if ( (v = GetOptionValue(arg, "--checkers")) != NULL )
+            opts.checkers = atoi(v);
+        else if ( strcmp(arg, "--ui") == 0 )
+            opts.ui = true;
+        else if ( (v = GetOptionValue(arg, "--restart")) != NULL )
+            opts.restartInterval = atoi(v);
+        else if ( (v = GetOptionValue(arg, "--duration")) != NULL )
+            opts.duration = atoi(v);
+        else if ( (v = GetOptionValue(arg, "--timeout")) != NULL )
+            opts.timeout = atoi(v);
+        else if ( (v = GetOptionValue(arg, "--stall-threshold")) != NULL )
+            opts.stallThreshold = atoi(v);
+        else if ( (v = GetOptionValue(arg, "--appcast-url")) != NULL )
+            opts.appcastURL = v;
+        else
+            return false;
+    }
+    return opts.duration > 0 && opts.timeout > 0;
+}
+
+
+/*--------------------------------------------------------------------------*
+                              stall reports
+ *--------------------------------------------------------------------------*/
+
+// What the API calls waited for, e.g. "waiting for a lock (UI thread)",
+// summed up from the stall reports.
+struct Wait
+{
+    Wait() : count(0), ms(0) {}
+
+    unsigned long long count;
+    unsigned long long ms;
+};
+
+CRITICAL_SECTION g_waitsCS;
+std::map<std::string, Wait> g_waits;
+unsigned g_stallReports = 0;
+
+// Adds one part of a stall report's breakdown, "N ms what (detail) K times".
+void AddWait(const std::string& part)
+{
+    const size_t unit = part.find(" ms ");
+    if ( unit == std::string::npos )
+        return;
+    std::string what = part.substr(unit + 4);
+    if ( what == "elsewhere" )
+        return;
+
+    unsigned long long count = 1;
+    const size_t times = what.rfind(" times");
+    if ( times != std::string::npos && times + 6 == what.size() )
+    {
+        const size_t space = what.rfind(' ', times - 1);
+        if ( space != std::string::npos )
+        {
+            count = strtoull(what.c_str() + space + 1, NULL, 10);
+            what.erase(space);
+        }
+    }
+
+    Wait& w = g_waits[what];
+    w.count += count;
+    w.ms += strtoull(part.c_str(), NULL, 10);
+}
+
+void __cdecl OnLogMessage(win_sparkle_log_level_t level, const char *message, void *)
+{
+    // "win_sparkle_xxx() blocked the calling thread for N ms: breakdown"
+    const std::string msg(message);
+    if ( level != WIN_SPARKLE_LOG_WARNING ||
+         msg.find("() blocked the calling thread for ") == std::string::npos )
+        return;
+    const size_t start = msg.find(" ms: ");
+    if ( start == std::string::npos )
+        return;
+
+    EnterCriticalSection(&g_waitsCS);
+    g_stallReports++;
+    for ( size_t pos = start + 5; pos < msg.size(); )
+    {
+        size_t end = msg.find(", ", pos);
+        if ( end == std::string::npos )
+            end = msg.size();
+        AddWait(msg.substr(pos, end - pos));
+        pos = end + 2;
+    }
+    LeaveCriticalSection(&g_waitsCS);
+}
+
+
+/*--------------------------------------------------------------------------*
+                                 workers
+ *--------------------------------------------------------------------------*/
+
+enum WorkerKind
+{
+    Worker_Setter,
+    Worker_Reader,
+    Worker_Checker,
+    Worker_Restarter,
+    Worker_Cleanup      // the final win_sparkle_cleanup()
+};
+
+const char *const WORKER_KIND_NAMES[] =
+{
+    "setter", "reader", "checker", "restarter", "cleanup"
+};
+
+struct Worker
+{
+    Worker(WorkerKind kind_, unsigned index_, const Options& opts_)
+        : kind(kind_), index(index_), opts(opts_), thread(NULL),
+          call(NULL), callStart(0), calls(0) {}
+
+    WorkerKind kind;
+    unsigned index;
+    const Options& opts;
+    HANDLE thread;
+
+    // the API function being called and since when, for the watchdog
+    const char * volatile call;
+    volatile LONG callStart;
+    unsigned long long calls;
+};
+
+volatile LONG g_stop = 0;
+
+bool ShouldStop()
+{
+    return InterlockedCompareExchange(&g_stop, 0, 0) != 0;
+}
+
+// Marks the duration of an API call for the watchdog.
+class CallScope
+{
+public:
+    CallScope(Worker& w, const char *call) : m_worker(w)
+    {
+        InterlockedExchange(&w.callStart, static_cast<LONG>(GetTickCount()));
+        w.call = call;
+        MemoryBarrier();
+    }
+
+    ~CallScope()
+    {
+        m_worker.call = NULL;
+        m_worker.calls++;
+        MemoryBarrier();
+    }
+
+private:
+    Worker& m_worker;
+};
+
+#define STRESS_CALL(worker, func, args) \
+    do { CallScope scope(worker, #func); func args; } while ( 0 )
+
+void RunSetter(Worker& w)
+{
+    wchar_t version[32];
+    char url[1024];
+    for ( unsigned n = 0; !ShouldStop(); n++ )
+    {
+        swprintf(version, 32, L"1.0.%u", n % 100);
+        STRESS_CALL(w, win_sparkle_set_app_details, (L"WinSparkle", L"apistress", version));
+        STRESS_CALL(w, win_sparkle_set_app_build_version, (version));
+
+        // the same feed, but a different URL for the settings to store
+        _snprintf(url, sizeof(url), "%s?n=%u", w.opts.appcastURL.c_str(), n % 10);
+        STRESS_CALL(w, win_sparkle_set_appcast_url, (url));
+
+        STRESS_CALL(w, win_sparkle_set_update_check_interval, (3600 + n % 100));
+        STRESS_CALL(w, win_sparkle_set_langid, (n % 2 ? 0x0409 : 0x0405));
+        if ( n % 16 == 0 )
+            STRESS_CALL(w, win_sparkle_set_automatic_check_for_updates, (0));
+    }
+}
+
+void RunReader(Worker& w)
+{
+    static char json[16384];   // only ever written, so it can be shared
+    win_sparkle_stats_t stats;
+    win_sparkle_error_info_t error;
+    while ( !ShouldStop() )
+    {
+        STRESS_CALL(w, win_sparkle_get_update_check_interval, ());
+        STRESS_CALL(w, win_sparkle_get_automatic_check_for_updates, ());
+        STRESS_CALL(w, win_sparkle_get_last_check_time, ());
+
+        stats.size = sizeof(stats);
+        STRESS_CALL(w, win_sparkle_get_stats, (&stats));
+        STRESS_CALL(w, win_sparkle_get_stats_json, (json, sizeof(json)));
+
+        error.size = sizeof(error);
+        STRESS_CALL(w, win_sparkle_get_last_error, (&error));
+    }
+}
+
+void RunChecker(Worker& w)
+{
+    // the checks themselves run on WinSparkle's threads; starting them
+    // faster than they fail would only pile the threads up
+    for ( unsigned n = 0; !ShouldStop(); n++ )
+    {
+        switch ( n % 3 )
+        {
+            case 0:
+                STRESS_CALL(w, win_sparkle_check_update_without_ui, ());
+                break;
+
+            case 1:
+            {
+                win_sparkle_check_t check;
+                {
+                    CallScope scope(w, "win_sparkle_check_async");
+                    check = win_sparkle_check_async(NULL, NULL, NULL);
+                }
+                // NULL between win_sparkle_cleanup() and win_sparkle_init()
+                if ( !check )
+                    break;
+
+                int done;
+                {
+                    CallScope scope(w, "win_sparkle_check_wait");
+                    done = win_sparkle_check_wait(check, int(w.opts.timeout * 1000));
+                }
+                if ( !done )
+                {
+                    fprintf(stderr, "HANG: checker %u: asynchronous check didn't complete in %u s\n",
+                            w.index, w.opts.timeout);
+                    fflush(stderr);
+                    ExitProcess(2);
+                }
+                STRESS_CALL(w, win_sparkle_check_release, (check));
+                break;
+            }
+
+            case 2:
+                if ( w.opts.ui )
+                    STRESS_CALL(w, win_sparkle_check_update_with_ui, ());
+                break;
+        }
+        Sleep(50);
+    }
+}
+
+void RunRestarter(Worker& w)
+{
+    while ( !ShouldStop() )
+    {
+        Sleep(w.opts.restartInterval);
+        STRESS_CALL(w, win_sparkle_cleanup, ());
+        STRESS_CALL(w, win_sparkle_init, ());
+    }
+}
+
+unsigned __stdcall WorkerMain(void *arg)
+{
+    Worker& w = *static_cast<Worker*>(arg);
+    switch ( w.kind )
+    {
+        case Worker_Setter:     RunSetter(w);       break;
+        case Worker_Reader:     RunReader(w);       break;
+        case Worker_Checker:    RunChecker(w);      break;
+        case Worker_Restarter:  RunRestarter(w);    break;
+        case Worker_Cleanup:
+            STRESS_CALL(w, win_sparkle_cleanup, ());
+            break;
+    }
+    return 0;
+}
+
+void StartWorker(Worker *w)
+{
+    w->thread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, WorkerMain, w, 0, NULL));
+    if ( !w->thread )
+        throw std::runtime_error("cannot start a thread");
+}
+
+
+/*--------------------------------------------------------------------------*
+                                 watchdog
+ *--------------------------------------------------------------------------*/
+
+// Exits with code 2 if any of @a workers is in a call for longer than the
+// timeout.
+void CheckForHangs(const std::vector<Worker*>& workers, unsigned timeout)
+{
+    const DWORD now = GetTickCount();
+    for ( size_t i = 0; i < workers.size(); i++ )
+    {
+        const Worker& w = *workers[i];
+        MemoryBarrier();
+        const char *call = w.call;
+        const DWORD since = static_cast<DWORD>(InterlockedCompareExchange(
+                                const_cast<volatile LONG*>(&w.callStart), 0, 0));
+        if ( call && now - since > timeout * 1000 )
+        {
+            fprintf(stderr, "HANG: %s %u: %s() didn't return in %u s\n",
+                    WORKER_KIND_NAMES[w.kind], w.index, call,
+                    static_cast<unsigned>((now - since) / 1000));
+            fflush(stderr);
+            ExitProcess(2);
+        }
+    }
+}
+
+// Waits until all @a workers finish, watching them for hangs.
+void WaitForWorkers(const std::vector<Worker*>& workers, unsigned timeout)
+{
+    for ( size_t i = 0; i < workers.size(); )
+    {
+        if ( WaitForSingleObject(workers[i]->thread, 100) == WAIT_OBJECT_0 )
+        {
+            i++;
+            continue;
+        }
+        CheckForHangs(workers, timeout);
+    }
+}
+
+
+/*--------------------------------------------------------------------------*
+                                  report
+ *--------------------------------------------------------------------------*/
+
+void PrintReport(const std::vector<Worker*>& workers, const win_sparkle_stats_t& stats)
+{
+    unsigned long long calls[Worker_Cleanup + 1] = { 0 };
+    for ( size_t i = 0; i < workers.size(); i++ )
+        calls[workers[i]->kind] += workers[i]->calls;
+
+    printf("API calls:");
+    for ( int k = Worker_Setter; k < Worker_Cleanup; k++ )
+    {
+        if ( calls[k] )
+            printf("  %s %llu", WORKER_KIND_NAMES[k], calls[k]);
+    }
+    printf("\n\n");
+
+    printf("lock contentions:      %u\n", stats.lock_contentions);
+    printf("lock wait:             %llu us\n", stats.lock_wait_us);
+    printf("longest lock wait:     %u us\n", stats.longest_lock_wait_us);
+
+    // the reports were all delivered by win_sparkle_cleanup()
+    EnterCriticalSection(&g_waitsCS);
+    printf("\n%u calls blocked for longer than the stall threshold, waiting for:\n",
+           g_stallReports);
+    for ( std::map<std::string, Wait>::const_iterator i = g_waits.begin(); i != g_waits.end(); ++i )
+        printf("  %-50s %8llu times  %8llu ms\n", i->first.c_str(), i->second.count, i->second.ms);
+    LeaveCriticalSection(&g_waitsCS);
+}
+
+void Run(const Options& opts)
+{
+    wchar_t configFile[MAX_PATH];
+    const DWORD tempLen = GetTempPathW(MAX_PATH, configFile);
+    if ( tempLen == 0 || tempLen + 20 > MAX_PATH )
+        throw std::runtime_error("cannot get the temporary directory");
+    wcscat(configFile, L"apistress.ini");
+    DeleteFileW(configFile);
+
+    win_sparkle_set_log_level(WIN_SPARKLE_LOG_WARNING);
+    win_sparkle_set_log_callback(OnLogMessage, NULL);
+    win_sparkle_set_api_stall_threshold(int(opts.stallThreshold));
+    win_sparkle_set_config_file(configFile);
+    win_sparkle_set_app_details(L"WinSparkle", L"apistress", L"1.0");
+    win_sparkle_set_appcast_url(opts.appcastURL.c_str());
+    win_sparkle_set_automatic_check_for_updates(0);
+    win_sparkle_init();
+
+    std::vector<Worker*> workers;
+    for ( unsigned i = 0; i < opts.setters; i++ )
+        workers.push_back(new Worker(Worker_Setter, i, opts));
+    for ( unsigned i = 0; i < opts.readers; i++ )
+        workers.push_back(new Worker(Worker_Reader, i, opts));
+    for ( unsigned i = 0; i < opts.checkers; i++ )
+        workers.push_back(new Worker(Worker_Checker, i, opts));
+    if ( opts.restartInterval )
+        workers.push_back(new Worker(Worker_Restarter, 0, opts));
+
+    for ( size_t i = 0; i < workers.size(); i++ )
+        StartWorker(workers[i]);
+
+    const DWORD start = GetTickCount();
+    while ( GetTickCount() - start < opts.duration * 1000 )
+    {
+        Sleep(100);
+        CheckForHangs(workers, opts.timeout);
+    }
+
+    InterlockedExchange(&g_stop, 1);
+    WaitForWorkers(workers, opts.timeout);
+
+    // before the cleanup, whose own waits are for the checks still running
+    win_sparkle_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.size = sizeof(stats);
+    win_sparkle_get_stats(&stats);
+
+    // the cleanup is watched too, it waits for the checks still running
+    std::vector<Worker*> cleanup(1, new Worker(Worker_Cleanup, 0, opts));
+    StartWorker(cleanup[0]);
+    WaitForWorkers(cleanup, opts.timeout);
+    workers.push_back(cleanup[0]);
+
+    PrintReport(workers, stats);
+
+    for ( size_t i = 0; i < workers.size(); i++ )
+    {
+        CloseHandle(workers[i]->thread);
+        delete workers[i];
+    }
+    DeleteFileW(configFile);
+}
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    InitializeCriticalSection(&g_waitsCS);
+    try
+    {
+        Run(opts);
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "apistress: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
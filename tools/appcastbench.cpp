@@ -0,0 +1,379 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    appcastbench: measures how fast Appcast::Load() parses appcasts.
+
+    Synthetic feeds with 1, 100 and 10000 items (or the sizes given with
+    --items) are generated in memory. Their items have descriptions of
+    different sizes, are for different OSes, and declare the Sparkle
+    namespace with different prefixes, next to elements of other namespaces
+    the parser has to skip. Each feed is parsed repeatedly with
+    Appcast::Load(), which stops at the first suitable item, and with
+    AppcastChannel::Load(), which parses all of them. The median times are
+    written to the standard output as CSV.
+
+    Allocations are only counted if WinSparkle is built with
+    WIN_SPARKLE_ALLOC_STATS. The peak memory is the process's peak
+    private bytes after parsing the feed; the feeds are parsed from the
+    smallest, so it grows with them.
+
+    Build it with -DWIN_SPARKLE_BUILD_BENCHMARKS=ON.
+ */
+
+#include "appcast.h"
+#include "allocstats.h"
+#include "trace.h"
+
+#include <windows.h>
+#include <psapi.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace winsparkle;
+
+namespace
+{
+
+#define NS_SPARKLE "http://www.andymatuschak.org/xml-namespaces/sparkle"
+
+struct Options
+{
+    Options() : minTime(1000), json(false)
+    {
+        items.push_back(1);
+        items.push_back(100);
+        items.push_back(10000);
+    }
+
+    std::vector<unsigned> items;
+    unsigned minTime;   // milliseconds per feed and way of loading it
+    bool json;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: appcastbench [options] > results.csv\n"
+        "\n"
+        "  --items=N,N,...     sizes of the feeds (1,100,10000)\n"
+        "  --min-time=MS       parse each feed for at least MS milliseconds (1000)\n"
+        "  --json              write the metrics as JSON, for winsparkle-bench\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--items")) != NULL )
+        {
+            opts.items.clear();
+            for ( char *end; *v; v = end )
+            {
+                const unsigned n = unsigned(strtoul(v, &end, 10));
+                if ( end == v || n == 0 || (*end != ',' && *end != 0) )
+                    return false;
+                opts.items.push_back(n);
+                if ( *end == ',' )
+                    end++;
+            }
+        }
+        else if ( (v = GetOptionValue(arg, "--min-time")) != NULL )
+            opts.minTime = unsigned(strtoul(v, NULL, 10));
+        else if ( strcmp(arg, "--json") == 0 )
+            opts.json = true;
+        else
+            return false;
+    }
+
+    return !opts.items.empty();
+}
+
+
+/*--------------------------------------------------------------------------*
+                              synthetic feeds
+ *--------------------------------------------------------------------------*/
+
+// Sizes of the items' descriptions, used in turn; most are short, the
+// occasional long one is like release notes embedded in the feed.
+const size_t DESCRIPTION_SIZES[] = { 0, 120, 800, 120, 8000, 120, 800 };
+
+// OS markers of the items; those for other OSes are skipped by the parser.
+const char *const ITEM_OSES[] = { "windows", "windows-x64", "windows-x86", "macos", "windows-arm64" };
+
+std::string FormatVersion(unsigned n)
+{
+    char buf[32];
+    sprintf(buf, "%u.%u.%u", 1 + n / 10000, (n / 100) % 100, n % 100);
+    return buf;
+}
+
+void AppendDescription(std::string& xml, size_t size, unsigned index)
+{
+    if ( !size )
+        return;
+
+    xml += "      <description><![CDATA[<h2>Changes</h2><ul>";
+    const size_t target = xml.size() + size;
+    for ( unsigned line = 0; xml.size() < target; line++ )
+    {
+        char buf[96];
+        sprintf(buf, "<li>Fixed issue #%u &amp; improved things</li>", index * 100 + line);
+        xml += buf;
+    }
+    xml += "</ul>]]></description>\n";
+}
+
+/**
+    Generates a feed with @a count items, the newest first.
+
+    The feed is deterministic, so that runs on different machines or with
+    different versions of the parser measure the same thing.
+ */
+std::string GenerateFeed(unsigned count)
+{
+    std::string xml;
+    xml += "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+           "<rss version=\"2.0\" xmlns:sparkle=\"" NS_SPARKLE "\"\n"
+           "     xmlns:dc=\"http://purl.org/dc/elements/1.1/\">\n"
+           "  <channel>\n"
+           "    <title>Benchmark feed</title>\n"
+           "    <link>https://example.com/appcast.xml</link>\n"
+           "    <language>en</language>\n";
+
+    for ( unsigned i = 0; i < count; i++ )
+    {
+        const std::string version = FormatVersion(count - i);
+        const char *os = ITEM_OSES[i % (sizeof(ITEM_OSES) / sizeof(ITEM_OSES[0]))];
+        // every third item declares the namespace itself, with another prefix
+        const bool ownPrefix = i % 3 == 2;
+        const char *ns = ownPrefix ? "s" : "sparkle";
+
+        xml += ownPrefix ? "    <item xmlns:s=\"" NS_SPARKLE "\">\n" : "    <item>\n";
+        xml += "      <title>Version " + version + "</title>\n";
+        xml += "      <pubDate>Mon, 01 Jan 2024 12:00:00 +0000</pubDate>\n";
+        xml += "      <dc:creator>Release bot</dc:creator>\n";
+        xml += std::string("      <") + ns + ":minimumSystemVersion>6.1</" + ns + ":minimumSystemVersion>\n";
+        AppendDescription(xml, DESCRIPTION_SIZES[i % (sizeof(DESCRIPTION_SIZES) / sizeof(DESCRIPTION_SIZES[0]))], i);
+
+        char length[16];
+        sprintf(length, "%u", 10000000 + i);
+        xml += "      <enclosure url=\"https://example.com/downloads/app-" + version + ".exe\"\n";
+        xml += std::string("                 ") + ns + ":version=\"" + version + "\"\n";
+        xml += std::string("                 ") + ns + ":os=\"" + os + "\"\n";
+        xml += std::string("                 ") + ns + ":edSignature=\"" +
+               std::string(86, 'A') + "==\"\n";
+        xml += std::string("                 length=\"") + length + "\" type=\"application/octet-stream\"/>\n";
+        xml += "    </item>\n";
+    }
+
+    xml += "  </channel>\n"
+           "</rss>\n";
+    return xml;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                measurement
+ *--------------------------------------------------------------------------*/
+
+// Parse result of one of the ways to load a feed.
+struct Measurement
+{
+    unsigned loads;
+    double usPerLoad;               // median
+    unsigned long long allocations; // per load, 0 without WIN_SPARKLE_ALLOC_STATS
+};
+
+struct Result
+{
+    unsigned items;
+    size_t bytes;
+    // Appcast::Load(), which stops at the first suitable item
+    Measurement update;
+    // AppcastChannel::Load(), which parses all items
+    Measurement channel;
+    size_t peakPrivateBytes;
+};
+
+unsigned long long GetParseAllocations()
+{
+    win_sparkle_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    AllocationStats::Get(stats);
+    return stats.allocations[WIN_SPARKLE_STATS_PHASE_PARSE];
+}
+
+size_t GetPeakPrivateBytes()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    counters.cb = sizeof(counters);
+    if ( !GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) )
+        return 0;
+    return counters.PeakPagefileUsage;
+}
+
+void Load(const std::string& xml, bool allItems)
+{
+    if ( allItems )
+    {
+        if ( AppcastChannel::Load(xml).GetItemCount() == 0 )
+            throw std::runtime_error("no items parsed");
+    }
+    else
+    {
+        if ( !Appcast::Load(xml).IsValid() )
+            throw std::runtime_error("no update found");
+    }
+}
+
+Measurement Measure(const std::string& xml, bool allItems, const Options& opts)
+{
+    Measurement m;
+
+    // the first parse warms up the caches and counts the allocations
+    const unsigned long long allocations = GetParseAllocations();
+    Load(xml, allItems);
+    m.allocations = GetParseAllocations() - allocations;
+
+    std::vector<unsigned long long> times;
+    const TraceTimer total;
+    while ( times.size() < 5 || total.GetMicroseconds() < opts.minTime * 1000ULL )
+    {
+        const TraceTimer timer;
+        Load(xml, allItems);
+        times.push_back(timer.GetMicroseconds());
+    }
+
+    std::sort(times.begin(), times.end());
+    m.loads = unsigned(times.size());
+    m.usPerLoad = double(times[times.size() / 2]);
+    return m;
+}
+
+Result Measure(unsigned items, const Options& opts)
+{
+    const std::string xml = GenerateFeed(items);
+
+    Result r;
+    r.items = items;
+    r.bytes = xml.size();
+    r.update = Measure(xml, false, opts);
+    r.channel = Measure(xml, true, opts);
+    r.peakPrivateBytes = GetPeakPrivateBytes();
+    return r;
+}
+
+double GetMBPerSecond(size_t bytes, const Measurement& m)
+{
+    return double(bytes) / (std::max)(m.usPerLoad, 1.0);
+}
+
+void PrintCSV(const std::vector<Result>& results)
+{
+    printf("items,bytes,us_per_update_load,us_per_channel_load,channel_mb_per_second,"
+           "update_allocations,channel_allocations,peak_private_bytes\n");
+    for ( size_t i = 0; i < results.size(); i++ )
+    {
+        const Result& r = results[i];
+        printf("%u,%lu,%.1f,%.1f,%.2f,%llu,%llu,%lu\n",
+               r.items, (unsigned long)r.bytes,
+               r.update.usPerLoad, r.channel.usPerLoad, GetMBPerSecond(r.bytes, r.channel),
+               r.update.allocations, r.channel.allocations,
+               (unsigned long)r.peakPrivateBytes);
+    }
+}
+
+void PrintJSON(const std::vector<Result>& results)
+{
+    printf("{\n");
+    for ( size_t i = 0; i < results.size(); i++ )
+    {
+        const Result& r = results[i];
+        printf("  \"appcast.%u.bytes\": %lu,\n", r.items, (unsigned long)r.bytes);
+        printf("  \"appcast.%u.update_us\": %.1f,\n", r.items, r.update.usPerLoad);
+        printf("  \"appcast.%u.channel_us\": %.1f,\n", r.items, r.channel.usPerLoad);
+        printf("  \"appcast.%u.channel_mb_per_second\": %.2f,\n", r.items, GetMBPerSecond(r.bytes, r.channel));
+        printf("  \"appcast.%u.update_allocations\": %llu,\n", r.items, r.update.allocations);
+        printf("  \"appcast.%u.channel_allocations\": %llu,\n", r.items, r.channel.allocations);
+        printf("  \"appcast.%u.peak_private_bytes\": %lu%s\n", r.items,
+               (unsigned long)r.peakPrivateBytes, i + 1 < results.size() ? "," : "");
+    }
+    printf("}\n");
+}
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        std::vector<unsigned> sizes(opts.items);
+        std::sort(sizes.begin(), sizes.end());
+
+        std::vector<Result> results;
+        for ( size_t i = 0; i < sizes.size(); i++ )
+            results.push_back(Measure(sizes[i], opts));
+
+        if ( opts.json )
+            PrintJSON(results);
+        else
+            PrintCSV(results);
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "appcastbench: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,476 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    winsparkle-bench: runs the benchmarks and compares their results with
+    a baseline.
+
+    The baseline (tools/bench-baseline.json by default) lists the benchmarks
+    to run, with their arguments, and the expected value of each metric:
+
+        {
+          "benchmarks": { "appcastbench": "--min-time=500", ... },
+          "metrics": {
+            "appcast.100.channel_us": { "value": 950, "better": "lower", "tolerance": 0.15 },
+            ...
+          }
+        }
+
+    Every benchmark is started from the directory of winsparkle-bench with
+    --json added, and prints its metrics as a JSON object. A metric
+    regressed if it's worse than the baseline by more than its tolerance,
+    a fraction of the baseline value: larger if "better" is "lower",
+    smaller if it's "higher", or different at all if it's "equal". A null
+    value hasn't been recorded yet; a baseline with any of them can't catch
+    regressions of those metrics, so it is refused.
+
+    The report is written to the standard output, and the exit code is 1 if
+    any metric regressed or is missing. --output=FILE also writes the
+    metrics as JSON, and --update-baseline stores them in the baseline,
+    keeping the tolerances, after the benchmarks were run on the reference
+    machine; this is the only way to run with an incomplete baseline.
+
+    Build it with -DWIN_SPARKLE_BUILD_BENCHMARKS=ON.
+ */
+
+#include "jsonreader.h"
+
+#include <windows.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace winsparkle;
+
+// set by the CMake build to the one in the source tree
+#ifndef WINSPARKLE_BENCH_BASELINE
+    #define WINSPARKLE_BENCH_BASELINE "bench-baseline.json"
+#endif
+
+namespace
+{
+
+struct Options
+{
+    Options() : baseline(WINSPARKLE_BENCH_BASELINE), updateBaseline(false) {}
+
+    std::string baseline;
+    std::string output;
+    bool updateBaseline;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: winsparkle-bench [options]\n"
+        "\n"
+        "  --baseline=FILE     baseline to compare with (" WINSPARKLE_BENCH_BASELINE ")\n"
+        "  --output=FILE       write the measured metrics to FILE as JSON\n"
+        "  --update-baseline   store the measured values in the baseline\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--baseline")) != NULL )
+            opts.baseline = v;
+        else if ( (v = GetOptionValue(arg, "--output")) != NULL )
+            opts.output = v;
+        else if ( strcmp(arg, "--update-baseline") == 0 )
+            opts.updateBaseline = true;
+        else
+            return false;
+    }
+    return true;
+}
+
+std::string ReadFile(const std::string& path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if ( !f )
+        throw std::runtime_error("cannot open " + path);
+    std::string data;
+    char buf[4096];
+    size_t len;
+    while ( (len = fread(buf, 1, sizeof(buf), f)) > 0 )
+        data.append(buf, len);
+    fclose(f);
+    return data;
+}
+
+void WriteFile(const std::string& path, const std::string& data)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if ( !f || fwrite(data.data(), 1, data.size(), f) != data.size() )
+    {
+        if ( f )
+            fclose(f);
+        throw std::runtime_error("cannot write " + path);
+    }
+    fclose(f);
+}
+
+std::string FormatNumber(double value)
+{
+    char buf[64];
+    sprintf(buf, "%.10g", value);
+    return buf;
+}
+
+std::string QuoteString(const std::string& s)
+{
+    std::string quoted = "\"";
+    for ( size_t i = 0; i < s.size(); i++ )
+    {
+        if ( s[i] == '"' || s[i] == '\\' )
+            quoted += '\\';
+        quoted += s[i];
+    }
+    return quoted + "\"";
+}
+
+
+/*--------------------------------------------------------------------------*
+                                  baseline
+ *--------------------------------------------------------------------------*/
+
+struct Expectation
+{
+    Expectation() : recorded(false), value(0), better("lower"), tolerance(0.1) {}
+
+    bool recorded;          // false if the value is null
+    double value;
+    std::string better;     // "lower", "higher" or "equal"
+    double tolerance;
+};
+
+struct Baseline
+{
+    // benchmark names and their arguments, in the order given
+    std::vector<std::pair<std::string, std::string> > benchmarks;
+    std::map<std::string, Expectation> metrics;
+
+    void Load(const std::string& path)
+    {
+        const std::string data = ReadFile(path);
+        JsonReader reader(data.data(), data.size());
+        std::string key, value;
+
+        reader.BeginObject();
+        for ( bool first = true; reader.NextMember(first, key); )
+        {
+            if ( key == "benchmarks" )
+            {
+                reader.BeginObject();
+                std::string name;
+                for ( bool f = true; reader.NextMember(f, name); )
+                {
+                    reader.ReadScalar(value, 4096);
+                    benchmarks.push_back(std::make_pair(name, value));
+                }
+            }
+            else if ( key == "metrics" )
+            {
+                reader.BeginObject();
+                std::string name;
+                for ( bool f = true; reader.NextMember(f, name); )
+                    metrics[name] = ReadExpectation(reader);
+            }
+            else
+            {
+                reader.Skip();
+            }
+        }
+        reader.End();
+
+        if ( benchmarks.empty() )
+            throw std::runtime_error(path + " lists no benchmarks");
+        if ( metrics.empty() )
+            throw std::runtime_error(path + " lists no metrics");
+    }
+
+    /// Returns the names of the metrics whose values are null.
+    std::vector<std::string> GetUnrecorded() const
+    {
+        std::vector<std::string> names;
+        for ( std::map<std::string, Expectation>::const_iterator i = metrics.begin(); i != metrics.end(); ++i )
+        {
+            if ( !i->second.recorded )
+                names.push_back(i->first);
+        }
+        return names;
+    }
+
+    std::string Write(const std::map<std::string, double>& measured) const
+    {
+        std::string json = "{\n  \"benchmarks\": {\n";
+        for ( size_t i = 0; i < benchmarks.size(); i++ )
+        {
+            json += "    " + QuoteString(benchmarks[i].first) + ": " + QuoteString(benchmarks[i].second);
+            json += i + 1 < benchmarks.size() ? ",\n" : "\n";
+        }
+        json += "  },\n  \"metrics\": {\n";
+
+        // metrics new in this run are added, with the default expectation
+        std::map<std::string, Expectation> all(metrics);
+        for ( std::map<std::string, double>::const_iterator i = measured.begin(); i != measured.end(); ++i )
+        {
+            Expectation& e = all[i->first];
+            e.recorded = true;
+            e.value = i->second;
+        }
+        for ( std::map<std::string, Expectation>::const_iterator i = all.begin(); i != all.end(); ++i )
+        {
+            const Expectation& e = i->second;
+            json += "    " + QuoteString(i->first) + ": { \"value\": " +
+                    (e.recorded ? FormatNumber(e.value) : std::string("null")) +
+                    ", \"better\": " + QuoteString(e.better) +
+                    ", \"tolerance\": " + FormatNumber(e.tolerance) + " }";
+            std::map<std::string, Expectation>::const_iterator next = i;
+            json += ++next != all.end() ? ",\n" : "\n";
+        }
+        json += "  }\n}\n";
+        return json;
+    }
+
+private:
+    static Expectation ReadExpectation(JsonReader& reader)
+    {
+        Expectation e;
+        std::string key, value;
+        reader.BeginObject();
+        for ( bool first = true; reader.NextMember(first, key); )
+        {
+            reader.ReadScalar(value, 64);
+            if ( key == "value" )
+            {
+                e.recorded = !value.empty();
+                e.value = atof(value.c_str());
+            }
+            else if ( key == "better" )
+            {
+                if ( value != "lower" && value != "higher" && value != "equal" )
+                    throw std::runtime_error("invalid \"better\" value: " + value);
+                e.better = value;
+            }
+            else if ( key == "tolerance" )
+            {
+                e.tolerance = atof(value.c_str());
+            }
+        }
+        return e;
+    }
+};
+
+
+/*--------------------------------------------------------------------------*
+                                 benchmarks
+ *--------------------------------------------------------------------------*/
+
+// Returns the directory of this executable, with a trailing backslash.
+std::string GetToolsDirectory()
+{
+    char path[MAX_PATH];
+    const DWORD len = GetModuleFileNameA(NULL, path, MAX_PATH);
+    if ( len == 0 || len == MAX_PATH )
+        throw std::runtime_error("cannot find the benchmarks");
+    std::string dir(path, len);
+    return dir.substr(0, dir.find_last_of("\\/") + 1);
+}
+
+// Runs the benchmark and adds its metrics to @a metrics.
+void RunBenchmark(const std::string& name, const std::string& args,
+                  std::map<std::string, double>& metrics)
+{
+    fprintf(stderr, "running %s %s\n", name.c_str(), args.c_str());
+
+    // cmd.exe strips the outer quotes
+    const std::string command = "\"\"" + GetToolsDirectory() + name + ".exe\" " + args + " --json\"";
+    FILE *pipe = _popen(command.c_str(), "rb");
+    if ( !pipe )
+        throw std::runtime_error("cannot run " + name);
+    std::string output;
+    char buf[4096];
+    size_t len;
+    while ( (len = fread(buf, 1, sizeof(buf), pipe)) > 0 )
+        output.append(buf, len);
+    if ( _pclose(pipe) != 0 )
+        throw std::runtime_error(name + " failed");
+
+    JsonReader reader(output.data(), output.size());
+    std::string key, value;
+    reader.BeginObject();
+    for ( bool first = true; reader.NextMember(first, key); )
+    {
+        reader.ReadScalar(value, 64);
+        if ( !value.empty() )
+            metrics[key] = atof(value.c_str());
+    }
+    reader.End();
+}
+
+
+/*--------------------------------------------------------------------------*
+                                   report
+ *--------------------------------------------------------------------------*/
+
+// Prints the comparison, returns the number of regressed or missing metrics.
+unsigned PrintReport(const Baseline& baseline, const std::map<std::string, double>& measured)
+{
+    unsigned failures = 0;
+    printf("%-45s %14s %14s %9s  %s\n", "metric", "baseline", "measured", "change", "result");
+
+    for ( std::map<std::string, Expectation>::const_iterator i = baseline.metrics.begin();
+          i != baseline.metrics.end(); ++i )
+    {
+        const Expectation& e = i->second;
+        const std::map<std::string, double>::const_iterator m = measured.find(i->first);
+        if ( m == measured.end() )
+        {
+            printf("%-45s %14s %14s %9s  MISSING\n", i->first.c_str(),
+                   FormatNumber(e.value).c_str(), "-", "");
+            failures++;
+            continue;
+        }
+        // positive change is worse
+        double change = 0;
+        if ( e.value != 0 )
+            change = (m->second - e.value) / fabs(e.value);
+        else if ( m->second != 0 )
+            change = m->second > 0 ? HUGE_VAL : -HUGE_VAL;
+        if ( e.better == "higher" )
+            change = -change;
+        else if ( e.better == "equal" )
+            change = fabs(change);
+
+        const char *result = "ok";
+        if ( change > e.tolerance )
+        {
+            result = "REGRESSED";
+            failures++;
+        }
+        else if ( e.better != "equal" && change < -e.tolerance )
+        {
+            result = "improved";
+        }
+
+        char changeText[32];
+        sprintf(changeText, "%+.1f%%", (e.better == "higher" ? -change : change) * 100);
+        printf("%-45s %14s %14s %9s  %s\n", i->first.c_str(), FormatNumber(e.value).c_str(),
+               FormatNumber(m->second).c_str(), changeText, result);
+    }
+
+    for ( std::map<std::string, double>::const_iterator i = measured.begin(); i != measured.end(); ++i )
+    {
+        if ( baseline.metrics.find(i->first) == baseline.metrics.end() )
+            printf("%-45s %14s %14s %9s  new\n", i->first.c_str(), "-", FormatNumber(i->second).c_str(), "");
+    }
+
+    printf("\n%u metric(s) regressed or missing\n", failures);
+    return failures;
+}
+
+std::string FormatMetrics(const std::map<std::string, double>& metrics)
+{
+    std::string json = "{\n";
+    for ( std::map<std::string, double>::const_iterator i = metrics.begin(); i != metrics.end(); ++i )
+    {
+        json += "  " + QuoteString(i->first) + ": " + FormatNumber(i->second);
+        std::map<std::string, double>::const_iterator next = i;
+        json += ++next != metrics.end() ? ",\n" : "\n";
+    }
+    return json + "}\n";
+}
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        Baseline baseline;
+        baseline.Load(opts.baseline);
+
+        // comparing with it would pass whatever the benchmarks measure
+        const std::vector<std::string> unrecorded = baseline.GetUnrecorded();
+        if ( !unrecorded.empty() && !opts.updateBaseline )
+        {
+            char count[64];
+            sprintf(count, "%u of %u metrics", unsigned(unrecorded.size()), unsigned(baseline.metrics.size()));
+            throw std::runtime_error(opts.baseline + " has no values for " + count +
+                                     " (e.g. " + unrecorded.front() + "); record them by running "
+                                     "winsparkle-bench --update-baseline on the reference machine");
+        }
+
+        std::map<std::string, double> measured;
+        for ( size_t i = 0; i < baseline.benchmarks.size(); i++ )
+            RunBenchmark(baseline.benchmarks[i].first, baseline.benchmarks[i].second, measured);
+
+        if ( !opts.output.empty() )
+            WriteFile(opts.output, FormatMetrics(measured));
+
+        if ( opts.updateBaseline )
+        {
+            WriteFile(opts.baseline, baseline.Write(measured));
+            fprintf(stderr, "updated %s\n", opts.baseline.c_str());
+            return 0;
+        }
+
+        return PrintReport(baseline, measured) ? 1 : 0;
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "winsparkle-bench: %s\n", e.what());
+        return 1;
+    }
+}
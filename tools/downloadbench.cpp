@@ -0,0 +1,815 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    downloadbench: measures checks and downloads end to end, against an
+    HTTP server on the loopback interface.
+
+    The server runs in the same process. It serves an appcast, answering
+    conditional requests with 304, and an update file of configurable size,
+    with Range support, and can add latency, limit the bandwidth, stall in
+    the middle of the body or cut the first connection off, so that the
+    download has to be resumed. Every run checks for updates with
+    DownloadFile() and Appcast::Load(), checks again with the cached ETag,
+    downloads the update and verifies its SHA-256 hash from the appcast.
+
+    The median of the runs is written to the standard output as CSV or, with
+    --json, as a JSON object: the download's throughput, the CPU time the
+    client used per megabyte (the server's threads are not included) and
+    the number of I/O operations of the process (the server's socket calls
+    are counted separately, WinSocket calls show up in the process's
+    counters too). HTTPS isn't supported, it would need a trusted
+    certificate for the server.
+
+    Build it with -DWIN_SPARKLE_BUILD_BENCHMARKS=ON.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <process.h>
+
+#include "appcast.h"
+#include "download.h"
+#include "settings.h"
+#include "signatureverifier.h"
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace winsparkle;
+
+namespace
+{
+
+struct Options
+{
+    Options()
+        : size(64), runs(5), latency(0), bandwidth(0), stallEvery(0), stall(0),
+          cutAt(0), segmented(false), backend(Settings::HttpBackend_WinHTTP), json(false) {}
+
+    unsigned size;          // megabytes
+    unsigned runs;
+    unsigned latency;       // milliseconds before each response
+    unsigned bandwidth;     // kilobytes per second, 0 for unlimited
+    unsigned stallEvery;    // kilobytes
+    unsigned stall;         // milliseconds
+    unsigned cutAt;         // kilobytes, 0 to never cut the connection
+    bool segmented;
+    Settings::HttpBackend backend;
+    bool json;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: downloadbench [options] > results.csv\n"
+        "\n"
+        "  --size=MB                 size of the update file (64)\n"
+        "  --runs=N                  number of checks and downloads (5)\n"
+        "  --latency=MS              delay of every response (0)\n"
+        "  --bandwidth=KBPS          bandwidth of every connection, 0 for unlimited (0)\n"
+        "  --stall=MS,KB             stall for MS milliseconds after every KB kilobytes\n"
+        "  --cut-at=KB               close the first download's connection after KB\n"
+        "                            kilobytes, so that it must be resumed\n"
+        "  --segmented               download with several connections (Download_Segmented)\n"
+        "  --backend=winhttp|wininet HTTP stack to use (winhttp)\n"
+        "  --json                    write the metrics as JSON, for winsparkle-bench\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--size")) != NULL )
+            opts.size = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--runs")) != NULL )
+            opts.runs = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--latency")) != NULL )
+            opts.latency = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--bandwidth")) != NULL )
+            opts.bandwidth = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--stall")) != NULL )
+        {
+            char *end;
+            opts.stall = unsigned(strtoul(v, &end, 10));
+            if ( *end != ',' )
+                return false;
+            opts.stallEvery = unsigned(strtoul(end + 1, NULL, 10));
+            if ( !opts.stallEvery )
+                return false;
+        }
+        else if ( (v = GetOptionValue(arg, "--cut-at")) != NULL )
+            opts.cutAt = unsigned(strtoul(v, NULL, 10));
+        else if ( strcmp(arg, "--segmented") == 0 )
+            opts.segmented = true;
+        else if ( (v = GetOptionValue(arg, "--backend")) != NULL )
+        {
+            if ( strcmp(v, "winhttp") == 0 )
+                opts.backend = Settings::HttpBackend_WinHTTP;
+            else if ( strcmp(v, "wininet") == 0 )
+                opts.backend = Settings::HttpBackend_WinINet;
+            else
+                return false;
+        }
+        else if ( strcmp(arg, "--json") == 0 )
+            opts.json = true;
+        else
+            return false;
+    }
+
+    return opts.size > 0 && opts.runs > 0 && opts.cutAt < opts.size * 1024;
+}
+
+unsigned long long FileTimeToMicroseconds(const FILETIME& ft)
+{
+    return ((ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) / 10;
+}
+
+std::string ToHex(const std::string& data)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for ( size_t i = 0; i < data.size(); i++ )
+    {
+        hex += digits[(unsigned char)data[i] >> 4];
+        hex += digits[(unsigned char)data[i] & 0xF];
+    }
+    return hex;
+}
+
+
+/*--------------------------------------------------------------------------*
+                              loopback server
+ *--------------------------------------------------------------------------*/
+
+#define APPCAST_ETAG "\"appcast-1\""
+#define PAYLOAD_ETAG "\"payload-1\""
+
+/**
+    HTTP/1.1 server on 127.0.0.1, serving /appcast.xml and /payload.bin.
+
+    Every connection is handled on its own thread, with keep-alive.
+ */
+class LoopbackServer
+{
+public:
+    LoopbackServer(const Options& opts)
+        : m_opts(opts), m_listener(INVALID_SOCKET), m_acceptThread(NULL),
+          m_port(0), m_cut(opts.cutAt == 0), m_socketCalls(0), m_notModified(0), m_partial(0)
+    {
+        InitializeCriticalSection(&m_cs);
+
+        // deterministic data, which don't compress
+        m_payload.resize(size_t(opts.size) * 1024 * 1024);
+        unsigned x = 2463534242u;
+        for ( size_t i = 0; i < m_payload.size(); i++ )
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            m_payload[i] = char(x);
+        }
+        DataHasher hasher(Hash_SHA256);
+        hasher.Update(m_payload.data(), m_payload.size());
+        m_payloadHash = hasher.GetDigest();
+
+        m_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if ( m_listener == INVALID_SOCKET )
+            throw std::runtime_error("cannot create the server socket");
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int addrLen = sizeof(addr);
+        if ( bind(m_listener, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+             listen(m_listener, SOMAXCONN) != 0 ||
+             getsockname(m_listener, (sockaddr*)&addr, &addrLen) != 0 )
+        {
+            closesocket(m_listener);
+            throw std::runtime_error("cannot listen on the loopback interface");
+        }
+        m_port = ntohs(addr.sin_port);
+
+        m_acceptThread = (HANDLE)_beginthreadex(NULL, 0, &AcceptThreadProc, this, 0, NULL);
+        if ( !m_acceptThread )
+        {
+            closesocket(m_listener);
+            throw std::runtime_error("cannot start the server thread");
+        }
+    }
+
+    ~LoopbackServer()
+    {
+        // accept() and recv() fail once their sockets are closed
+        closesocket(m_listener);
+        WaitForSingleObject(m_acceptThread, INFINITE);
+        CloseHandle(m_acceptThread);
+
+        EnterCriticalSection(&m_cs);
+        for ( size_t i = 0; i < m_connections.size(); i++ )
+            closesocket(m_connections[i]);
+        const std::vector<HANDLE> threads(m_threads);
+        LeaveCriticalSection(&m_cs);
+
+        for ( size_t i = 0; i < threads.size(); i++ )
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+        DeleteCriticalSection(&m_cs);
+    }
+
+    std::string GetAppcastURL() const { return GetURL("/appcast.xml"); }
+    const std::string& GetPayloadHash() const { return m_payloadHash; }
+
+    /// CPU time used by the server's threads so far.
+    unsigned long long GetCpuMicroseconds()
+    {
+        unsigned long long total = GetThreadCpuMicroseconds(m_acceptThread);
+        EnterCriticalSection(&m_cs);
+        for ( size_t i = 0; i < m_threads.size(); i++ )
+            total += GetThreadCpuMicroseconds(m_threads[i]);
+        LeaveCriticalSection(&m_cs);
+        return total;
+    }
+
+    unsigned long long GetSocketCalls() const { return m_socketCalls; }
+    unsigned GetNotModifiedCount() const { return m_notModified; }
+    unsigned GetPartialCount() const { return m_partial; }
+
+private:
+    struct Request
+    {
+        std::string path, range, ifNoneMatch, ifRange;
+        bool keepAlive;
+    };
+
+    std::string GetURL(const char *path) const
+    {
+        char url[64];
+        sprintf(url, "http://127.0.0.1:%u%s", unsigned(m_port), path);
+        return url;
+    }
+
+    static unsigned long long GetThreadCpuMicroseconds(HANDLE thread)
+    {
+        FILETIME created, exited, kernel, user;
+        if ( !GetThreadTimes(thread, &created, &exited, &kernel, &user) )
+            return 0;
+        return FileTimeToMicroseconds(kernel) + FileTimeToMicroseconds(user);
+    }
+
+    static unsigned __stdcall AcceptThreadProc(void *param)
+    {
+        LoopbackServer *self = static_cast<LoopbackServer*>(param);
+        for ( ;; )
+        {
+            const SOCKET s = accept(self->m_listener, NULL, NULL);
+            if ( s == INVALID_SOCKET )
+                return 0;
+
+            ConnectionParam *conn = new ConnectionParam;
+            conn->server = self;
+            conn->socket = s;
+
+            EnterCriticalSection(&self->m_cs);
+            self->m_connections.push_back(s);
+            HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, &ConnectionThreadProc, conn, 0, NULL);
+            if ( thread )
+                self->m_threads.push_back(thread);
+            LeaveCriticalSection(&self->m_cs);
+
+            if ( !thread )
+            {
+                closesocket(s);
+                delete conn;
+            }
+        }
+    }
+
+    struct ConnectionParam
+    {
+        LoopbackServer *server;
+        SOCKET socket;
+    };
+
+    static unsigned __stdcall ConnectionThreadProc(void *param)
+    {
+        const ConnectionParam conn = *static_cast<ConnectionParam*>(param);
+        delete static_cast<ConnectionParam*>(param);
+
+        std::string buffer;
+        Request request;
+        while ( conn.server->ReadRequest(conn.socket, buffer, request) &&
+                conn.server->Respond(conn.socket, request) &&
+                request.keepAlive )
+        {
+        }
+
+        // the socket is closed by the destructor, so that its handle isn't
+        // reused while it's still in m_connections
+        shutdown(conn.socket, SD_BOTH);
+        return 0;
+    }
+
+    static std::string GetHeader(const std::string& head, const char *name)
+    {
+        const size_t len = strlen(name);
+        for ( size_t pos = head.find("\r\n"); pos != std::string::npos; pos = head.find("\r\n", pos + 2) )
+        {
+            const size_t line = pos + 2;
+            if ( _strnicmp(head.c_str() + line, name, len) != 0 || head.compare(line + len, 1, ":") != 0 )
+                continue;
+            size_t start = line + len + 1;
+            while ( start < head.size() && head[start] == ' ' )
+                start++;
+            return head.substr(start, head.find("\r\n", start) - start);
+        }
+        return std::string();
+    }
+
+    bool ReadRequest(SOCKET s, std::string& buffer, Request& request)
+    {
+        size_t end;
+        while ( (end = buffer.find("\r\n\r\n")) == std::string::npos )
+        {
+            if ( buffer.size() > 64 * 1024 )
+                return false;
+            char chunk[4096];
+            const int received = recv(s, chunk, sizeof(chunk), 0);
+            InterlockedIncrement64(&m_socketCalls);
+            if ( received <= 0 )
+                return false;
+            buffer.append(chunk, received);
+        }
+
+        const std::string head = buffer.substr(0, end + 2);
+        buffer.erase(0, end + 4);
+
+        // "GET /path HTTP/1.1"
+        const size_t pathStart = head.find(' ');
+        const size_t pathEnd = head.find(' ', pathStart + 1);
+        if ( pathStart == std::string::npos || pathEnd == std::string::npos )
+            return false;
+        request.path = head.substr(pathStart + 1, pathEnd - pathStart - 1);
+        request.range = GetHeader(head, "Range");
+        request.ifNoneMatch = GetHeader(head, "If-None-Match");
+        request.ifRange = GetHeader(head, "If-Range");
+        request.keepAlive = _stricmp(GetHeader(head, "Connection").c_str(), "close") != 0;
+        return true;
+    }
+
+    bool Send(SOCKET s, const char *data, size_t len)
+    {
+        while ( len )
+        {
+            const int sent = send(s, data, int((std::min)(len, size_t(INT_MAX))), 0);
+            InterlockedIncrement64(&m_socketCalls);
+            if ( sent <= 0 )
+                return false;
+            data += sent;
+            len -= sent;
+        }
+        return true;
+    }
+
+    // Sends the body at the configured bandwidth, with the stalls. Returns
+    // false to close the connection.
+    bool SendBody(SOCKET s, const char *data, size_t len, bool mayCut)
+    {
+        const size_t CHUNK = 16 * 1024;
+        const size_t stallEvery = size_t(m_opts.stallEvery) * 1024;
+        const size_t cutAt = mayCut ? size_t(m_opts.cutAt) * 1024 : 0;
+        const DWORD start = GetTickCount();
+        size_t sinceStall = 0;
+
+        for ( size_t sent = 0; sent < len; )
+        {
+            size_t chunk = (std::min)(CHUNK, len - sent);
+            if ( cutAt && sent < cutAt )
+                chunk = (std::min)(chunk, cutAt - sent);
+            if ( stallEvery )
+                chunk = (std::min)(chunk, stallEvery - sinceStall);
+
+            if ( !Send(s, data + sent, chunk) )
+                return false;
+            sent += chunk;
+            sinceStall += chunk;
+
+            if ( cutAt && sent == cutAt )
+                return false;
+            if ( stallEvery && sinceStall == stallEvery )
+            {
+                Sleep(m_opts.stall);
+                sinceStall = 0;
+            }
+            if ( m_opts.bandwidth )
+            {
+                const unsigned long long due = sent * 1000ULL / (m_opts.bandwidth * 1024ULL);
+                const DWORD elapsed = GetTickCount() - start;
+                if ( due > elapsed )
+                    Sleep(DWORD(due - elapsed));
+            }
+        }
+        return true;
+    }
+
+    bool SendHeaders(SOCKET s, const char *status, const std::string& headers)
+    {
+        const std::string response = std::string("HTTP/1.1 ") + status + "\r\n" + headers + "\r\n";
+        return Send(s, response.data(), response.size());
+    }
+
+    std::string GetAppcast() const
+    {
+        char length[32];
+        sprintf(length, "%lu", (unsigned long)m_payload.size());
+        return
+            "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+            "<rss version=\"2.0\" xmlns:sparkle=\"http://www.andymatuschak.org/xml-namespaces/sparkle\">\n"
+            "  <channel>\n"
+            "    <title>downloadbench</title>\n"
+            "    <item>\n"
+            "      <title>Version 2.0</title>\n"
+            "      <enclosure url=\"" + GetURL("/payload.bin") + "\"\n"
+            "                 sparkle:version=\"2.0\" sparkle:os=\"windows\"\n"
+            "                 sparkle:sha256=\"" + ToHex(m_payloadHash) + "\"\n"
+            "                 length=\"" + length + "\" type=\"application/octet-stream\"/>\n"
+            "    </item>\n"
+            "  </channel>\n"
+            "</rss>\n";
+    }
+
+    // Returns false to close the connection.
+    bool Respond(SOCKET s, const Request& request)
+    {
+        if ( m_opts.latency )
+            Sleep(m_opts.latency);
+
+        if ( request.path == "/appcast.xml" )
+        {
+            if ( request.ifNoneMatch == APPCAST_ETAG )
+            {
+                InterlockedIncrement(&m_notModified);
+                return SendHeaders(s, "304 Not Modified", "ETag: " APPCAST_ETAG "\r\n");
+            }
+
+            const std::string xml = GetAppcast();
+            char headers[256];
+            sprintf(headers, "Content-Type: application/rss+xml\r\nContent-Length: %lu\r\nETag: " APPCAST_ETAG "\r\n",
+                    (unsigned long)xml.size());
+            return SendHeaders(s, "200 OK", headers) && SendBody(s, xml.data(), xml.size(), false);
+        }
+
+        if ( request.path == "/payload.bin" )
+        {
+            const size_t total = m_payload.size();
+            size_t first = 0, last = total - 1;
+            bool partial = false;
+            if ( !request.range.empty() && (request.ifRange.empty() || request.ifRange == PAYLOAD_ETAG) )
+            {
+                // "bytes=first-" or "bytes=first-last"
+                unsigned long long a = 0, b = 0;
+                const int fields = sscanf(request.range.c_str(), "bytes=%llu-%llu", &a, &b);
+                if ( fields < 1 || a >= total || (fields == 2 && (b < a || b >= total)) )
+                    return SendHeaders(s, "416 Range Not Satisfiable", "Content-Length: 0\r\n");
+                first = size_t(a);
+                if ( fields == 2 )
+                    last = size_t(b);
+                partial = true;
+                InterlockedIncrement(&m_partial);
+            }
+
+            char headers[256];
+            if ( partial )
+                sprintf(headers, "Content-Length: %lu\r\nContent-Range: bytes %lu-%lu/%lu\r\n",
+                        (unsigned long)(last - first + 1), (unsigned long)first, (unsigned long)last,
+                        (unsigned long)total);
+            else
+                sprintf(headers, "Content-Length: %lu\r\n", (unsigned long)total);
+            const std::string allHeaders = std::string(headers) +
+                "Content-Type: application/octet-stream\r\n"
+                "Accept-Ranges: bytes\r\n"
+                "ETag: " PAYLOAD_ETAG "\r\n";
+
+            // only the first request for the whole file is cut off
+            const bool cut = !partial && InterlockedExchange(&m_cut, 1) == 0;
+            return SendHeaders(s, partial ? "206 Partial Content" : "200 OK", allHeaders) &&
+                   SendBody(s, m_payload.data() + first, last - first + 1, cut);
+        }
+
+        return SendHeaders(s, "404 Not Found", "Content-Length: 0\r\n");
+    }
+
+    const Options& m_opts;
+    std::string m_payload;
+    std::string m_payloadHash;
+
+    SOCKET m_listener;
+    HANDLE m_acceptThread;
+    unsigned short m_port;
+
+    // guards m_connections and m_threads
+    CRITICAL_SECTION m_cs;
+    std::vector<SOCKET> m_connections;
+    std::vector<HANDLE> m_threads;
+
+    volatile LONG m_cut;
+    volatile LONGLONG m_socketCalls;
+    volatile LONG m_notModified;
+    volatile LONG m_partial;
+};
+
+
+/*--------------------------------------------------------------------------*
+                                  client
+ *--------------------------------------------------------------------------*/
+
+// Keeps the appcast's ETag for conditional requests, like the update check.
+struct AppcastSink : public StringDownloadSink
+{
+    virtual bool GetCachedVersion(std::string& etag, std::string& lastModified) const
+    {
+        etag = cachedETag;
+        lastModified.clear();
+        return !etag.empty();
+    }
+
+    virtual void SetCacheValidators(const std::string& etag, const std::string&)
+    {
+        cachedETag = etag;
+    }
+
+    std::string cachedETag;
+};
+
+// Keeps the update file in memory, so that the disk doesn't limit the
+// measurement; supports resuming and segmented downloads.
+struct PayloadSink : public IRandomAccessDownloadSink
+{
+    PayloadSink() : m_validated(false) {}
+
+    const std::string& GetData() const { return m_data; }
+
+    virtual void SetLength(size_t) {}
+    virtual void SetFilename(const std::wstring&) {}
+
+    virtual void Add(const void *data, size_t len)
+    {
+        m_data.append(static_cast<const char*>(data), len);
+    }
+
+    virtual size_t GetResumeOffset(std::string& validator) const
+    {
+        validator = m_validator;
+        return m_validated ? m_data.size() : 0;
+    }
+
+    virtual void SetStartOffset(size_t offset, const std::string& validator)
+    {
+        m_data.resize(offset);
+        m_validator = validator;
+        m_validated = !validator.empty();
+    }
+
+    virtual void BeginSegmented(size_t len)
+    {
+        m_data.assign(len, '\0');
+    }
+
+    virtual void AddAt(size_t offset, const void *data, size_t len)
+    {
+        if ( offset > m_data.size() || len > m_data.size() - offset )
+            throw std::runtime_error("unexpected segment");
+        memcpy(&m_data[offset], data, len);
+    }
+
+private:
+    std::string m_data;
+    std::string m_validator;
+    bool m_validated;
+};
+
+struct Run
+{
+    double checkMs;         // first check, with the appcast parsed
+    double notModifiedMs;   // second check, answered with 304
+    double downloadMBps;
+    double cpuUsPerMB;      // of the client
+    unsigned long long ioOperations;
+    unsigned long long socketCalls;
+    unsigned resumes;
+    double verifyMBps;
+};
+
+unsigned long long GetProcessCpuMicroseconds()
+{
+    FILETIME created, exited, kernel, user;
+    if ( !GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user) )
+        return 0;
+    return FileTimeToMicroseconds(kernel) + FileTimeToMicroseconds(user);
+}
+
+unsigned long long GetProcessIoOperations()
+{
+    IO_COUNTERS io;
+    if ( !GetProcessIoCounters(GetCurrentProcess(), &io) )
+        return 0;
+    return io.ReadOperationCount + io.WriteOperationCount + io.OtherOperationCount;
+}
+
+Run RunOnce(LoopbackServer& server, const Options& opts)
+{
+    Run run;
+
+    // check for updates
+    AppcastSink appcastSink;
+    TraceTimer checkTimer;
+    if ( !DownloadFile(server.GetAppcastURL(), &appcastSink, NULL, Download_BypassProxies) )
+        throw std::runtime_error("appcast not downloaded");
+    const Appcast appcast = Appcast::Load(appcastSink.data);
+    if ( !appcast.IsValid() || !appcast.HasDownload() )
+        throw std::runtime_error("no update in the appcast");
+    run.checkMs = checkTimer.GetMicroseconds() / 1000.0;
+
+    TraceTimer notModifiedTimer;
+    if ( DownloadFile(server.GetAppcastURL(), &appcastSink, NULL, Download_BypassProxies) )
+        throw std::runtime_error("appcast downloaded again, expected 304");
+    run.notModifiedMs = notModifiedTimer.GetMicroseconds() / 1000.0;
+
+    // download it, resuming if the connection is cut off; depending on the
+    // HTTP stack, that's an error or just the end of the data
+    const size_t length = size_t(_strtoui64(appcast.Length.c_str(), NULL, 10));
+    const unsigned long long cpuStart = GetProcessCpuMicroseconds();
+    const unsigned long long serverCpuStart = server.GetCpuMicroseconds();
+    const unsigned long long ioStart = GetProcessIoOperations();
+    const unsigned long long socketCallsStart = server.GetSocketCalls();
+    const int flags = Download_BypassProxies | (opts.segmented ? Download_Segmented : 0);
+
+    PayloadSink payload;
+    run.resumes = 0;
+    const TraceTimer downloadTimer;
+    for ( ;; )
+    {
+        try
+        {
+            DownloadFile(appcast.DownloadURL, &payload, NULL, flags);
+            if ( payload.GetData().size() == length )
+                break;
+        }
+        catch ( std::exception& )
+        {
+        }
+        if ( ++run.resumes > 3 )
+            throw std::runtime_error("download interrupted repeatedly");
+    }
+    const unsigned long long downloadUs = downloadTimer.GetMicroseconds();
+
+    const double megabytes = payload.GetData().size() / (1024.0 * 1024.0);
+    run.downloadMBps = megabytes / ((std::max)(downloadUs, 1ULL) / 1e6);
+    const unsigned long long clientCpu =
+        (GetProcessCpuMicroseconds() - cpuStart) - (server.GetCpuMicroseconds() - serverCpuStart);
+    run.cpuUsPerMB = double((long long)clientCpu) / (std::max)(megabytes, 1.0 / 1024);
+    run.ioOperations = GetProcessIoOperations() - ioStart;
+    run.socketCalls = server.GetSocketCalls() - socketCallsStart;
+
+    // verify it, as the appcast's sparkle:sha256 is verified
+    const TraceTimer verifyTimer;
+    DataHasher hasher(Hash_SHA256);
+    hasher.Update(payload.GetData().data(), payload.GetData().size());
+    if ( ToHex(hasher.GetDigest()) != appcast.Sha256 )
+        throw std::runtime_error("downloaded data don't match the appcast's hash");
+    run.verifyMBps = megabytes / ((std::max)(verifyTimer.GetMicroseconds(), 1ULL) / 1e6);
+
+    return run;
+}
+
+template<typename T>
+T Median(const std::vector<Run>& runs, T Run::*field)
+{
+    std::vector<T> values;
+    for ( size_t i = 0; i < runs.size(); i++ )
+        values.push_back(runs[i].*field);
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+void PrintCSV(const std::vector<Run>& runs)
+{
+    printf("run,check_ms,not_modified_ms,download_mb_per_second,client_cpu_us_per_mb,"
+           "io_operations,server_socket_calls,resumes,verify_mb_per_second\n");
+    for ( size_t i = 0; i < runs.size(); i++ )
+    {
+        const Run& r = runs[i];
+        printf("%u,%.2f,%.2f,%.2f,%.0f,%llu,%llu,%u,%.2f\n",
+               unsigned(i + 1), r.checkMs, r.notModifiedMs, r.downloadMBps, r.cpuUsPerMB,
+               r.ioOperations, r.socketCalls, r.resumes, r.verifyMBps);
+    }
+}
+
+void PrintJSON(const std::vector<Run>& runs, LoopbackServer& server)
+{
+    printf("{\n");
+    printf("  \"download.check_ms\": %.2f,\n", Median(runs, &Run::checkMs));
+    printf("  \"download.not_modified_ms\": %.2f,\n", Median(runs, &Run::notModifiedMs));
+    printf("  \"download.mb_per_second\": %.2f,\n", Median(runs, &Run::downloadMBps));
+    printf("  \"download.client_cpu_us_per_mb\": %.0f,\n", Median(runs, &Run::cpuUsPerMB));
+    printf("  \"download.io_operations\": %llu,\n", Median(runs, &Run::ioOperations));
+    printf("  \"download.server_socket_calls\": %llu,\n", Median(runs, &Run::socketCalls));
+    printf("  \"download.verify_mb_per_second\": %.2f,\n", Median(runs, &Run::verifyMBps));
+    printf("  \"download.not_modified_responses\": %u,\n", server.GetNotModifiedCount());
+    printf("  \"download.partial_responses\": %u\n", server.GetPartialCount());
+    printf("}\n");
+}
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    WSADATA wsa;
+    if ( WSAStartup(MAKEWORD(2, 2), &wsa) != 0 )
+    {
+        fprintf(stderr, "downloadbench: cannot initialize WinSock\n");
+        return 1;
+    }
+
+    int result = 0;
+    try
+    {
+        // there's no version info in this executable
+        Settings::SetAppName(L"downloadbench");
+        Settings::SetAppVersion(L"1.0");
+        Settings::SetCompanyName(L"WinSparkle");
+        Settings::SetHttpBackend(opts.backend);
+
+        LoopbackServer server(opts);
+        std::vector<Run> runs;
+        for ( unsigned i = 0; i < opts.runs; i++ )
+            runs.push_back(RunOnce(server, opts));
+        CloseDownloadSession();
+
+        if ( opts.json )
+            PrintJSON(runs, server);
+        else
+            PrintCSV(runs);
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "downloadbench: %s\n", e.what());
+        result = 1;
+    }
+
+    WSACleanup();
+    return result;
+}
@@ -0,0 +1,572 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    fleetsim: simulates the load a fleet of installations puts on the
+    appcast and download servers.
+
+    Every virtual client runs the SchedulePolicy used by UpdateScheduler,
+    with a virtual clock, so the jitter, backoff, notification, maintenance
+    window, adaptive interval and phased rollout settings can be tried out
+    before they are rolled out to real clients. The timeline of requests per second (or,
+    with --output=histogram, how many seconds saw each rate) is written to
+    the standard output as CSV, a summary to the standard error.
+
+    Build it with -DWIN_SPARKLE_BUILD_FLEETSIM=ON, or on any platform with:
+
+        c++ -std=c++11 -O2 -Isrc tools/fleetsim.cpp src/schedulepolicy.cpp -o fleetsim
+
+    It doesn't model clients that aren't running, network problems on the
+    clients' side or the time checks take.
+ */
+
+#include "schedulepolicy.h"
+#include "appcast.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace winsparkle;
+
+namespace
+{
+
+const time_t SECONDS_PER_DAY = 24 * 60 * 60;
+
+// the simulation starts at an arbitrary midnight (UTC); no clients checked
+// before the epoch, so times before the start must still be positive
+const time_t SIMULATION_START = 365 * SECONDS_PER_DAY;
+
+struct Options
+{
+    Options()
+        : clients(1000000), days(7), interval(SECONDS_PER_DAY), jitter(5 * 60),
+          tolerance(60), coldStart(false), timezones(1),
+          failureRate(0), outageStart(-1), outageEnd(-1), retryAfter(-1),
+          release(-1), rolloutInterval(0), notify(false),
+          minAdaptiveInterval(0), maxAdaptiveInterval(0),
+          previousRelease(-1), releaseCadence(0),
+          bucket(60), histogram(false), seed(1) {}
+
+    unsigned clients;
+    unsigned days;
+    unsigned interval;
+    unsigned jitter;
+    unsigned tolerance;
+    bool coldStart;
+    std::string maintenanceWindows;
+    unsigned timezones;
+    double failureRate;
+    double outageStart, outageEnd; // hours since the start
+    int retryAfter;
+    double release;                // hours since the start
+    unsigned rolloutInterval;
+    bool notify;
+    unsigned minAdaptiveInterval, maxAdaptiveInterval;
+    double previousRelease;        // hours before the start
+    double releaseCadence;         // days
+    unsigned bucket;
+    bool histogram;
+    unsigned seed;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: fleetsim [options] > load.csv\n"
+        "\n"
+        "  --clients=N               number of installations (1000000)\n"
+        "  --days=N                  simulated time (7)\n"
+        "  --interval=SECONDS        check interval (86400)\n"
+        "  --jitter=SECONDS          see win_sparkle_set_update_check_jitter() (300)\n"
+        "  --tolerance=SECONDS       timer coalescing tolerance (60)\n"
+        "  --start=steady|cold       whether the fleet checked before or not (steady)\n"
+        "  --maintenance-windows=W   background downloads only in windows W,\n"
+        "                            see win_sparkle_set_maintenance_windows()\n"
+        "  --timezones=N             spread the clients over N hourly time zones (1)\n"
+        "  --failure-rate=P          probability that a check fails (0)\n"
+        "  --outage=FROM-TO          all checks fail between FROM and TO hours\n"
+        "  --retry-after=SECONDS     Retry-After sent by the server during the outage\n"
+        "  --release=HOURS           an update is published after HOURS\n"
+        "  --rollout-interval=SECS   its sparkle:phasedRolloutInterval (0)\n"
+        "  --notify                  the release is announced by the notification server\n"
+        "  --adaptive=MIN-MAX        adaptive check interval in seconds,\n"
+        "                            see win_sparkle_set_adaptive_check_interval()\n"
+        "  --previous-release=HOURS  the clients saw a release HOURS before the start\n"
+        "  --release-cadence=DAYS    typical time between releases they learned (0)\n"
+        "  --bucket=SECONDS          length of the timeline's rows (60)\n"
+        "  --output=timeline|histogram\n"
+        "  --seed=N                  seed of the random numbers (1)\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--clients")) != NULL )
+            opts.clients = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--days")) != NULL )
+            opts.days = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--interval")) != NULL )
+            opts.interval = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--jitter")) != NULL )
+            opts.jitter = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--tolerance")) != NULL )
+            opts.tolerance = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--start")) != NULL )
+        {
+            if ( strcmp(v, "cold") == 0 )
+                opts.coldStart = true;
+            else if ( strcmp(v, "steady") != 0 )
+                return false;
+        }
+        else if ( (v = GetOptionValue(arg, "--maintenance-windows")) != NULL )
+            opts.maintenanceWindows = v;
+        else if ( (v = GetOptionValue(arg, "--timezones")) != NULL )
+            opts.timezones = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--failure-rate")) != NULL )
+            opts.failureRate = strtod(v, NULL);
+        else if ( (v = GetOptionValue(arg, "--outage")) != NULL )
+        {
+            char *end;
+            opts.outageStart = strtod(v, &end);
+            if ( *end != '-' )
+                return false;
+            opts.outageEnd = strtod(end + 1, NULL);
+        }
+        else if ( (v = GetOptionValue(arg, "--retry-after")) != NULL )
+            opts.retryAfter = atoi(v);
+        else if ( (v = GetOptionValue(arg, "--release")) != NULL )
+            opts.release = strtod(v, NULL);
+        else if ( (v = GetOptionValue(arg, "--rollout-interval")) != NULL )
+            opts.rolloutInterval = unsigned(strtoul(v, NULL, 10));
+        else if ( strcmp(arg, "--notify") == 0 )
+            opts.notify = true;
+        else if ( (v = GetOptionValue(arg, "--adaptive")) != NULL )
+        {
+            char *end;
+            opts.minAdaptiveInterval = unsigned(strtoul(v, &end, 10));
+            if ( *end != '-' )
+                return false;
+            opts.maxAdaptiveInterval = unsigned(strtoul(end + 1, NULL, 10));
+            if ( opts.maxAdaptiveInterval < opts.minAdaptiveInterval )
+                return false;
+        }
+        else if ( (v = GetOptionValue(arg, "--previous-release")) != NULL )
+            opts.previousRelease = strtod(v, NULL);
+        else if ( (v = GetOptionValue(arg, "--release-cadence")) != NULL )
+            opts.releaseCadence = strtod(v, NULL);
+        else if ( (v = GetOptionValue(arg, "--bucket")) != NULL )
+            opts.bucket = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--output")) != NULL )
+        {
+            if ( strcmp(v, "histogram") == 0 )
+                opts.histogram = true;
+            else if ( strcmp(v, "timeline") != 0 )
+                return false;
+        }
+        else if ( (v = GetOptionValue(arg, "--seed")) != NULL )
+            opts.seed = unsigned(strtoul(v, NULL, 10));
+        else
+            return false;
+    }
+
+    return opts.clients > 0 && opts.days > 0 && opts.interval > 0 &&
+           opts.timezones > 0 && opts.bucket > 0;
+}
+
+
+/*--------------------------------------------------------------------------*
+                               virtual clock
+ *--------------------------------------------------------------------------*/
+
+/**
+    Clock set to the time of the simulated event, in the time zone of the
+    client handling it. There's no daylight saving time.
+ */
+class VirtualClock : public SchedulerClock
+{
+public:
+    VirtualClock(unsigned seed) : m_now(0), m_utcOffset(0), m_random(seed) {}
+
+    void Set(time_t now, time_t utcOffset)
+    {
+        m_now = now;
+        m_utcOffset = utcOffset;
+    }
+
+    virtual time_t Now() const { return m_now; }
+
+    virtual time_t GetLocalMidnight(time_t time, int days) const
+    {
+        const time_t local = time + m_utcOffset;
+        return local - local % SECONDS_PER_DAY + days * SECONDS_PER_DAY - m_utcOffset;
+    }
+
+    virtual unsigned GetRandomNumber(unsigned max)
+    {
+        return std::uniform_int_distribution<unsigned>(0, max)(m_random);
+    }
+
+    double GetRandomFraction()
+    {
+        return std::uniform_real_distribution<double>(0, 1)(m_random);
+    }
+
+private:
+    time_t m_now;
+    time_t m_utcOffset;
+    std::mt19937 m_random;
+};
+
+
+/*--------------------------------------------------------------------------*
+                                simulation
+ *--------------------------------------------------------------------------*/
+
+struct Client
+{
+    Client(SchedulerClock& clock) : policy(clock) {}
+
+    SchedulePolicy policy;
+    time_t lastCheck;
+    time_t utcOffset;
+    unsigned maintenanceWindowSlot;
+    unsigned rolloutGroup;
+    unsigned timerId;  // events of older timers are obsolete
+    bool updated;      // downloaded the released update
+    time_t lastRelease;       // see ScheduleConfig
+    unsigned releaseInterval;
+};
+
+struct TimerEvent
+{
+    time_t time;
+    unsigned client;
+    unsigned timerId;
+
+    bool operator>(const TimerEvent& other) const { return time > other.time; }
+};
+
+typedef std::priority_queue<TimerEvent, std::vector<TimerEvent>, std::greater<TimerEvent> > EventQueue;
+
+class Simulation
+{
+public:
+    Simulation(const Options& opts)
+        : m_opts(opts),
+          m_clock(opts.seed),
+          m_end(SIMULATION_START + time_t(opts.days) * SECONDS_PER_DAY),
+          m_checks(size_t(opts.days) * SECONDS_PER_DAY),
+          m_downloads(size_t(opts.days) * SECONDS_PER_DAY),
+          m_failedChecks(0)
+    {
+        m_config.checkEnabled = true;
+        m_config.checkInterval = opts.interval;
+        m_config.jitter = opts.jitter;
+        m_config.minCheckInterval = opts.minAdaptiveInterval;
+        m_config.maxCheckInterval = opts.maxAdaptiveInterval;
+        m_config.checkInMaintenanceWindow = !opts.maintenanceWindows.empty();
+        if ( !ParseMaintenanceWindows(opts.maintenanceWindows, m_config.maintenanceWindows) )
+            throw std::runtime_error("invalid maintenance windows");
+
+        m_releaseTime = opts.release < 0 ? 0 : SIMULATION_START + time_t(opts.release * 3600);
+    }
+
+    void Run()
+    {
+        m_clients.reserve(m_opts.clients);
+        for ( unsigned i = 0; i < m_opts.clients; i++ )
+        {
+            Client client(m_clock);
+            client.lastCheck = m_opts.coldStart
+                               ? 0
+                               : SIMULATION_START - time_t(m_clock.GetRandomNumber(m_opts.interval - 1));
+            client.utcOffset = time_t(m_clock.GetRandomNumber(m_opts.timezones - 1)) * 3600;
+            client.maintenanceWindowSlot = m_clock.GetRandomNumber(SchedulePolicy::MAINTENANCE_WINDOW_SLOTS - 1);
+            client.rolloutGroup = m_clock.GetRandomNumber(PHASED_ROLLOUT_GROUPS - 1);
+            client.timerId = 0;
+            client.updated = false;
+            client.lastRelease = m_opts.previousRelease < 0
+                                 ? 0
+                                 : SIMULATION_START - time_t(m_opts.previousRelease * 3600);
+            client.releaseInterval = unsigned(m_opts.releaseCadence * SECONDS_PER_DAY);
+            m_clients.push_back(client);
+
+            // the app starts and UpdateScheduler::Start() sets the timer
+            ScheduleNextCheck(i, SIMULATION_START);
+        }
+
+        bool notified = !m_opts.notify || !m_releaseTime;
+        while ( !m_events.empty() )
+        {
+            const TimerEvent event = m_events.top();
+            if ( event.time >= m_end )
+                break;
+
+            if ( !notified && event.time >= m_releaseTime )
+            {
+                // UpdateScheduler::OnUpdatePublished() in all clients at once
+                notified = true;
+                for ( unsigned i = 0; i < m_clients.size(); i++ )
+                {
+                    SetClock(i, m_releaseTime);
+                    m_clients[i].policy.OnUpdatePublished();
+                    ScheduleNextCheck(i, m_releaseTime);
+                }
+                continue;
+            }
+
+            m_events.pop();
+            if ( event.timerId == m_clients[event.client].timerId )
+                OnCheckTimer(event.client, event.time);
+        }
+    }
+
+    void PrintTimeline() const
+    {
+        printf("time,checks_per_second,peak_checks_per_second,downloads_per_second,peak_downloads_per_second\n");
+        for ( size_t start = 0; start < m_checks.size(); start += m_opts.bucket )
+        {
+            const size_t end = (std::min)(start + m_opts.bucket, m_checks.size());
+            unsigned long long checks = 0, downloads = 0;
+            unsigned peakChecks = 0, peakDownloads = 0;
+            for ( size_t s = start; s < end; s++ )
+            {
+                checks += m_checks[s];
+                downloads += m_downloads[s];
+                peakChecks = (std::max)(peakChecks, m_checks[s]);
+                peakDownloads = (std::max)(peakDownloads, m_downloads[s]);
+            }
+            printf("%lu,%.2f,%u,%.2f,%u\n",
+                   (unsigned long)start,
+                   double(checks) / double(end - start), peakChecks,
+                   double(downloads) / double(end - start), peakDownloads);
+        }
+    }
+
+    void PrintHistogram() const
+    {
+        const std::vector<unsigned long> checks = CountSecondsByRate(m_checks);
+        const std::vector<unsigned long> downloads = CountSecondsByRate(m_downloads);
+
+        printf("requests_per_second,seconds_with_checks,seconds_with_downloads\n");
+        for ( size_t rate = 0; rate < (std::max)(checks.size(), downloads.size()); rate++ )
+        {
+            const unsigned long c = rate < checks.size() ? checks[rate] : 0;
+            const unsigned long d = rate < downloads.size() ? downloads[rate] : 0;
+            if ( c || d )
+                printf("%lu,%lu,%lu\n", (unsigned long)rate, c, d);
+        }
+    }
+
+    void PrintSummary() const
+    {
+        PrintSummary("checks", m_checks);
+        fprintf(stderr, "  failed:   %llu\n", m_failedChecks);
+        PrintSummary("downloads", m_downloads);
+    }
+
+private:
+    void SetClock(unsigned index, time_t now)
+    {
+        const Client& client = m_clients[index];
+        m_clock.Set(now, client.utcOffset);
+        m_config.maintenanceWindowSlot = client.maintenanceWindowSlot;
+        m_config.lastRelease = client.lastRelease;
+        m_config.releaseInterval = client.releaseInterval;
+    }
+
+    // Does what ScheduleNextCheck() in updatescheduler.cpp does.
+    void ScheduleNextCheck(unsigned index, time_t now)
+    {
+        SetClock(index, now);
+        Client& client = m_clients[index];
+
+        // connection warmup doesn't change when the check is done
+        bool warmup;
+        unsigned delay = client.policy.GetTimerDelay(m_config, client.lastCheck, warmup);
+        if ( warmup )
+            delay += SchedulePolicy::WARMUP_LEAD_TIME;
+
+        // the system may fire the timer anywhere within the tolerance
+        TimerEvent event;
+        event.time = now + delay + m_clock.GetRandomNumber(m_opts.tolerance);
+        event.client = index;
+        event.timerId = ++client.timerId;
+        m_events.push(event);
+    }
+
+    // Does what OnCheckTimer() and PeriodicUpdateChecker do.
+    void OnCheckTimer(unsigned index, time_t now)
+    {
+        SetClock(index, now);
+        Client& client = m_clients[index];
+
+        if ( client.policy.IsCheckDue(m_config, client.lastCheck) )
+        {
+            client.policy.OnCheckStarted();
+            m_checks[size_t(now - SIMULATION_START)]++;
+
+            if ( IsCheckFailing(now) )
+            {
+                m_failedChecks++;
+                const bool outage = now >= OutageTime(m_opts.outageStart) &&
+                                    now < OutageTime(m_opts.outageEnd);
+                client.policy.OnCheckFailed(m_config, true, outage ? m_opts.retryAfter : -1);
+            }
+            else
+            {
+                client.lastCheck = now;
+                // see UpdateScheduler::OnReleaseSeen()
+                if ( m_releaseTime && now >= m_releaseTime )
+                    client.policy.OnReleaseSeen(m_releaseTime, client.lastRelease, client.releaseInterval);
+                // see Appcast::IsAvailableToRolloutGroup()
+                if ( m_releaseTime && !client.updated && now >= m_releaseTime &&
+                     now >= m_releaseTime + time_t(client.rolloutGroup) * m_opts.rolloutInterval )
+                {
+                    client.updated = true;
+                    m_downloads[size_t(now - SIMULATION_START)]++;
+                }
+                client.policy.OnCheckSucceeded();
+            }
+        }
+
+        ScheduleNextCheck(index, now);
+    }
+
+    time_t OutageTime(double hours) const
+    {
+        return SIMULATION_START + time_t(hours * 3600);
+    }
+
+    bool IsCheckFailing(time_t now)
+    {
+        if ( m_opts.outageStart >= 0 &&
+             now >= OutageTime(m_opts.outageStart) && now < OutageTime(m_opts.outageEnd) )
+        {
+            return true;
+        }
+        return m_opts.failureRate > 0 && m_clock.GetRandomFraction() < m_opts.failureRate;
+    }
+
+    static std::vector<unsigned long> CountSecondsByRate(const std::vector<unsigned>& perSecond)
+    {
+        std::vector<unsigned long> counts;
+        for ( size_t s = 0; s < perSecond.size(); s++ )
+        {
+            if ( perSecond[s] >= counts.size() )
+                counts.resize(perSecond[s] + 1);
+            counts[perSecond[s]]++;
+        }
+        return counts;
+    }
+
+    static void PrintSummary(const char *name, const std::vector<unsigned> &perSecond)
+    {
+        std::vector<unsigned> sorted(perSecond);
+        std::sort(sorted.begin(), sorted.end());
+
+        unsigned long long total = 0;
+        for ( size_t s = 0; s < sorted.size(); s++ )
+            total += sorted[s];
+
+        fprintf(stderr, "%s: %llu total, %.2f/s on average\n",
+                name, total, double(total) / double(sorted.size()));
+        fprintf(stderr, "  per second: p50 %u, p90 %u, p99 %u, p99.9 %u, peak %u\n",
+                sorted[sorted.size() / 2],
+                sorted[sorted.size() * 9 / 10],
+                sorted[sorted.size() * 99 / 100],
+                sorted[sorted.size() * 999 / 1000],
+                sorted.back());
+    }
+
+    const Options& m_opts;
+    VirtualClock m_clock;
+    ScheduleConfig m_config;
+    const time_t m_end;
+    time_t m_releaseTime;     // 0 if nothing is released
+
+    std::vector<Client> m_clients;
+    EventQueue m_events;
+
+    // number of requests in each second of the simulation
+    std::vector<unsigned> m_checks;
+    std::vector<unsigned> m_downloads;
+    unsigned long long m_failedChecks;
+};
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        Simulation sim(opts);
+        sim.Run();
+
+        if ( opts.histogram )
+            sim.PrintHistogram();
+        else
+            sim.PrintTimeline();
+        sim.PrintSummary();
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "fleetsim: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
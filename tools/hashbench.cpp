@@ -0,0 +1,657 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    hashbench: measures how fast downloaded files are hashed to verify
+    their signatures.
+
+    Files of 10 and 100 MB (or the sizes given with --sizes, up to 4 GB) are
+    written to the temporary directory and hashed in these ways:
+
+      fread_sha1      8 KB fread() and CryptoAPI, as WinSparkle used to do it
+      blocks_sha1     DataHasher::UpdateFromFile(), the DSA signature path
+      blocks_sha512   the same with SHA-512, which Ed25519 signatures hash
+      mapped_sha1     the file mapped into memory in 64 MB views instead of
+      mapped_sha512   being read in 1 MB blocks, hashed by HashEngine
+      openssl_sha1    the same reads, hashed by OpenSSL instead of CNG
+      memory_sha1     the same data from memory, as hashed while downloading
+      chunked.Ncores  SignatureVerifier::ComputeChunkHashes(), the chunked
+                      EdDSA signature path, with the process restricted to
+                      N processors (1, 2, 4, ... by default, see --cores)
+
+    The files are read from the file cache, which they are still in after
+    being written, unless they are larger than the memory. The median times
+    of --runs runs are written to the standard output as CSV. All ways of
+    computing the same digest must agree, or the tool fails.
+
+    Build it with -DWIN_SPARKLE_BUILD_BENCHMARKS=ON.
+ */
+
+#include "signatureverifier.h"
+#include "hashengine.h"
+#include "trace.h"
+
+#include <windows.h>
+#include <wincrypt.h>
+
+#ifndef WIN_SPARKLE_NO_OPENSSL
+#include <openssl/sha.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace winsparkle;
+
+namespace
+{
+
+struct Options
+{
+    Options() : runs(3), json(false)
+    {
+        sizes.push_back(10);
+        sizes.push_back(100);
+    }
+
+    std::vector<unsigned> sizes;    // megabytes
+    std::vector<unsigned> cores;    // empty for the default
+    unsigned runs;
+    std::wstring dir;
+    bool json;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: hashbench [options] > results.csv\n"
+        "\n"
+        "  --sizes=MB,MB,...   sizes of the files, at most 4096 (10,100)\n"
+        "  --cores=N,N,...     processor counts of the chunked digest (1,2,4,... all)\n"
+        "  --runs=N            hash each file N times in each way (3)\n"
+        "  --dir=PATH          directory of the files (the temporary directory)\n"
+        "  --json              write the metrics as JSON, for winsparkle-bench\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool ParseList(const char *v, std::vector<unsigned>& list)
+{
+    list.clear();
+    for ( char *end; *v; v = end )
+    {
+        const unsigned n = unsigned(strtoul(v, &end, 10));
+        if ( end == v || n == 0 || (*end != ',' && *end != 0) )
+            return false;
+        list.push_back(n);
+        if ( *end == ',' )
+            end++;
+    }
+    return !list.empty();
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--sizes")) != NULL )
+        {
+            if ( !ParseList(v, opts.sizes) )
+                return false;
+        }
+        else if ( (v = GetOptionValue(arg, "--cores")) != NULL )
+        {
+            if ( !ParseList(v, opts.cores) )
+                return false;
+        }
+        else if ( (v = GetOptionValue(arg, "--runs")) != NULL )
+            opts.runs = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--dir")) != NULL )
+            opts.dir = std::wstring(v, v + strlen(v));
+        else if ( strcmp(arg, "--json") == 0 )
+            opts.json = true;
+        else
+            return false;
+    }
+
+    for ( size_t i = 0; i < opts.sizes.size(); i++ )
+    {
+        if ( opts.sizes[i] > 4096 )
+            return false;
+    }
+    return opts.runs > 0;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                 test files
+ *--------------------------------------------------------------------------*/
+
+const DWORD BLOCK_SIZE = 1024 * 1024;
+
+// Content of the files: random data, with each block's index in its first
+// bytes, so that no two blocks are the same.
+class TestData
+{
+public:
+    TestData() : m_block(BLOCK_SIZE)
+    {
+        std::mt19937 rng(1);
+        for ( size_t i = 0; i < m_block.size(); i++ )
+            m_block[i] = (unsigned char)rng();
+    }
+
+    const unsigned char *GetBlock(unsigned index)
+    {
+        memcpy(&m_block[0], &index, sizeof(index));
+        return &m_block[0];
+    }
+
+private:
+    std::vector<unsigned char> m_block;
+};
+
+// Test file that is deleted when the object is destroyed.
+class TestFile
+{
+public:
+    TestFile(const std::wstring& dir, unsigned megabytes) : m_megabytes(megabytes)
+    {
+        wchar_t name[64];
+        swprintf(name, 64, L"hashbench-%u-%umb.bin", unsigned(GetCurrentProcessId()), megabytes);
+        m_path = dir + name;
+
+        HANDLE f = CreateFileW(m_path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+        if ( f == INVALID_HANDLE_VALUE )
+            throw std::runtime_error("failed to create the test file");
+
+        TestData data;
+        bool ok = true;
+        for ( unsigned i = 0; ok && i < megabytes; i++ )
+        {
+            DWORD written = 0;
+            ok = WriteFile(f, data.GetBlock(i), BLOCK_SIZE, &written, NULL) && written == BLOCK_SIZE;
+        }
+        CloseHandle(f);
+
+        if ( !ok )
+        {
+            DeleteFileW(m_path.c_str());
+            throw std::runtime_error("failed to write the test file");
+        }
+    }
+
+    ~TestFile()
+    {
+        DeleteFileW(m_path.c_str());
+    }
+
+    const std::wstring& GetPath() const { return m_path; }
+    unsigned GetMegabytes() const { return m_megabytes; }
+    ULONGLONG GetSize() const { return ULONGLONG(m_megabytes) * BLOCK_SIZE; }
+
+private:
+    TestFile(const TestFile&);
+    TestFile& operator=(const TestFile&);
+
+    std::wstring m_path;
+    unsigned m_megabytes;
+};
+
+std::wstring GetDefaultDir()
+{
+    wchar_t buf[MAX_PATH + 1];
+    const DWORD len = GetTempPathW(MAX_PATH + 1, buf);
+    if ( len == 0 || len > MAX_PATH )
+        throw std::runtime_error("failed to get the temporary directory");
+    return std::wstring(buf, len);
+}
+
+
+/*--------------------------------------------------------------------------*
+                               ways of hashing
+ *--------------------------------------------------------------------------*/
+
+// How WinSparkle hashed files before ReadFileInBlocks(): fread() through
+// an 8 KB buffer and CryptoAPI's SHA-1.
+std::string HashFread(const TestFile& file)
+{
+    HCRYPTPROV provider;
+    if ( !CryptAcquireContextW(&provider, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) )
+        throw std::runtime_error("CryptAcquireContext failed");
+
+    HCRYPTHASH hash = 0;
+    FILE *f = NULL;
+    bool ok = CryptCreateHash(provider, CALG_SHA1, 0, 0, &hash) != 0;
+    if ( ok )
+        ok = _wfopen_s(&f, file.GetPath().c_str(), L"rb") == 0;
+
+    unsigned char buf[8192];
+    while ( ok )
+    {
+        const size_t read_bytes = fread(buf, 1, sizeof(buf), f);
+        if ( read_bytes == 0 )
+            break;
+        ok = CryptHashData(hash, buf, DWORD(read_bytes), 0) != 0;
+    }
+    ok = ok && !ferror(f);
+
+    BYTE sha1[20];
+    DWORD len = sizeof(sha1);
+    ok = ok && CryptGetHashParam(hash, HP_HASHVAL, sha1, &len, 0);
+
+    if ( f )
+        fclose(f);
+    if ( hash )
+        CryptDestroyHash(hash);
+    CryptReleaseContext(provider, 0);
+
+    if ( !ok )
+        throw std::runtime_error("failed to hash the file with CryptoAPI");
+    return std::string((const char*)sha1, len);
+}
+
+std::string HashBlocks(const TestFile& file, HashAlgorithm algorithm)
+{
+    DataHasher hasher(algorithm);
+    hasher.UpdateFromFile(file.GetPath());
+    return hasher.GetDigest();
+}
+
+std::string HashBlocksSHA1(const TestFile& file)
+{
+    return HashBlocks(file, Hash_SHA1);
+}
+
+std::string HashBlocksSHA512(const TestFile& file)
+{
+    return HashBlocks(file, Hash_SHA512);
+}
+
+// Maps the file into memory and hashes it directly from the views, which
+// saves copying it into a buffer, but takes a page fault for each page.
+std::string HashMapped(const TestFile& file, HashAlgorithm algorithm)
+{
+    // a multiple of the allocation granularity; small enough for the
+    // address space of 32-bit processes
+    const ULONGLONG VIEW_SIZE = 64 * 1024 * 1024;
+
+    HANDLE f = CreateFileW(file.GetPath().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if ( f == INVALID_HANDLE_VALUE )
+        throw std::runtime_error("failed to open the test file");
+
+    HANDLE mapping = CreateFileMappingW(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(f);
+    if ( !mapping )
+        throw std::runtime_error("failed to map the test file");
+
+    std::unique_ptr<Hash> hash(HashEngine::CreateHash(algorithm));
+    bool ok = true;
+    for ( ULONGLONG offset = 0; ok && offset < file.GetSize(); offset += VIEW_SIZE )
+    {
+        const size_t len = size_t((std::min)(VIEW_SIZE, file.GetSize() - offset));
+        const void *view = MapViewOfFile(mapping, FILE_MAP_READ,
+                                         DWORD(offset >> 32), DWORD(offset & 0xFFFFFFFF), len);
+        ok = view != NULL;
+        if ( ok )
+        {
+            hash->Update(view, len);
+            UnmapViewOfFile(view);
+        }
+    }
+    CloseHandle(mapping);
+
+    if ( !ok )
+        throw std::runtime_error("failed to map a view of the test file");
+    return hash->Finish();
+}
+
+std::string HashMappedSHA1(const TestFile& file)
+{
+    return HashMapped(file, Hash_SHA1);
+}
+
+std::string HashMappedSHA512(const TestFile& file)
+{
+    return HashMapped(file, Hash_SHA512);
+}
+
+#ifndef WIN_SPARKLE_NO_OPENSSL
+// Reads the file like ReadFileInBlocks() does, but hashes it with OpenSSL.
+std::string HashOpenSSL(const TestFile& file)
+{
+    HANDLE f = CreateFileW(file.GetPath().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if ( f == INVALID_HANDLE_VALUE )
+        throw std::runtime_error("failed to open the test file");
+
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+
+    std::vector<unsigned char> buf(BLOCK_SIZE);
+    bool ok = true;
+    for ( ;; )
+    {
+        DWORD read_bytes = 0;
+        ok = ReadFile(f, &buf[0], BLOCK_SIZE, &read_bytes, NULL) != 0;
+        if ( !ok || read_bytes == 0 )
+            break;
+        SHA1_Update(&ctx, &buf[0], read_bytes);
+    }
+    CloseHandle(f);
+
+    unsigned char sha1[SHA_DIGEST_LENGTH];
+    SHA1_Final(sha1, &ctx);
+    if ( !ok )
+        throw std::runtime_error("failed to read the test file");
+    return std::string((const char*)sha1, sizeof(sha1));
+}
+#endif // !WIN_SPARKLE_NO_OPENSSL
+
+// Hashes the file's content without reading it, which is the cost of
+// hashing the data while they are being downloaded.
+std::string HashMemory(const TestFile& file)
+{
+    TestData data;
+    std::unique_ptr<Hash> hash(HashEngine::CreateHash(Hash_SHA1));
+    for ( unsigned i = 0; i < file.GetMegabytes(); i++ )
+        hash->Update(data.GetBlock(i), BLOCK_SIZE);
+    return hash->Finish();
+}
+
+std::string HashChunked(const TestFile& file)
+{
+    const std::string hashes = SignatureVerifier::ComputeChunkHashes(file.GetPath());
+    return HashEngine::HashData(Hash_SHA256, hashes.data(), hashes.size());
+}
+
+typedef std::string (*HashFunction)(const TestFile& file);
+
+struct Variant
+{
+    const char *name;
+    HashFunction hash;
+    const char *digest;     // variants with the same digest must agree
+};
+
+const Variant VARIANTS[] =
+{
+    { "fread_sha1",     HashFread,          "sha1" },
+    { "blocks_sha1",    HashBlocksSHA1,     "sha1" },
+    { "blocks_sha512",  HashBlocksSHA512,   "sha512" },
+    { "mapped_sha1",    HashMappedSHA1,     "sha1" },
+    { "mapped_sha512",  HashMappedSHA512,   "sha512" },
+#ifndef WIN_SPARKLE_NO_OPENSSL
+    { "openssl_sha1",   HashOpenSSL,        "sha1" },
+#endif
+    { "memory_sha1",    HashMemory,         "sha1" }
+};
+
+
+/*--------------------------------------------------------------------------*
+                            processor affinity
+ *--------------------------------------------------------------------------*/
+
+// Restricts the process to some of its processors, for as long as it exists.
+class ProcessorAffinity
+{
+public:
+    ProcessorAffinity()
+    {
+        DWORD_PTR systemMask;
+        if ( !GetProcessAffinityMask(GetCurrentProcess(), &m_mask, &systemMask) )
+            throw std::runtime_error("failed to get the process affinity");
+    }
+
+    ~ProcessorAffinity()
+    {
+        Reset();
+    }
+
+    // Lets the process run on all of its processors again.
+    void Reset()
+    {
+        SetProcessAffinityMask(GetCurrentProcess(), m_mask);
+    }
+
+    unsigned GetProcessorCount() const
+    {
+        unsigned count = 0;
+        for ( DWORD_PTR mask = m_mask; mask; mask &= mask - 1 )
+            count++;
+        return count;
+    }
+
+    // Lets the process run on the first @a count of its processors only.
+    void Restrict(unsigned count)
+    {
+        if ( count > GetProcessorCount() )
+        {
+            char msg[96];
+            sprintf(msg, "only %u processors are available", GetProcessorCount());
+            throw std::runtime_error(msg);
+        }
+
+        DWORD_PTR mask = 0;
+        for ( DWORD_PTR bit = 1; count; bit <<= 1 )
+        {
+            if ( m_mask & bit )
+            {
+                mask |= bit;
+                count--;
+            }
+        }
+
+        if ( !SetProcessAffinityMask(GetCurrentProcess(), mask) )
+            throw std::runtime_error("failed to set the process affinity");
+    }
+
+private:
+    ProcessorAffinity(const ProcessorAffinity&);
+    ProcessorAffinity& operator=(const ProcessorAffinity&);
+
+    DWORD_PTR m_mask;
+};
+
+std::vector<unsigned> GetDefaultCores(unsigned available)
+{
+    std::vector<unsigned> cores;
+    for ( unsigned n = 1; n < available; n *= 2 )
+        cores.push_back(n);
+    cores.push_back(available);
+    return cores;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                measurement
+ *--------------------------------------------------------------------------*/
+
+struct Result
+{
+    unsigned megabytes;
+    std::string variant;
+    double ms;              // median
+    double mbPerSecond;
+};
+
+// Hashes the file @a runs times; returns the median time in microseconds
+// and the digest, which must be the same each time.
+unsigned long long Measure(HashFunction hash, const TestFile& file, unsigned runs, std::string& digest)
+{
+    std::vector<unsigned long long> times;
+    for ( unsigned i = 0; i < runs; i++ )
+    {
+        const TraceTimer timer;
+        const std::string d = hash(file);
+        times.push_back(timer.GetMicroseconds());
+
+        if ( i == 0 )
+            digest = d;
+        else if ( d != digest )
+            throw std::runtime_error("the digest changed between runs");
+    }
+
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+Result MakeResult(const TestFile& file, const std::string& variant, unsigned long long us)
+{
+    Result r;
+    r.megabytes = file.GetMegabytes();
+    r.variant = variant;
+    r.ms = double(us) / 1000.0;
+    r.mbPerSecond = double(file.GetSize()) / double((std::max)(us, 1ULL));
+    return r;
+}
+
+void CheckDigest(std::vector<std::pair<std::string, std::string> >& digests,
+                 const std::string& name, const std::string& digest, const std::string& variant)
+{
+    for ( size_t i = 0; i < digests.size(); i++ )
+    {
+        if ( digests[i].first == name )
+        {
+            if ( digests[i].second != digest )
+                throw std::runtime_error(variant + " computed a different " + name + " digest");
+            return;
+        }
+    }
+    digests.push_back(std::make_pair(name, digest));
+}
+
+void Measure(const TestFile& file, const std::vector<unsigned>& cores, const Options& opts,
+             ProcessorAffinity& affinity, std::vector<Result>& results)
+{
+    std::vector<std::pair<std::string, std::string> > digests;
+
+    for ( size_t i = 0; i < sizeof(VARIANTS) / sizeof(VARIANTS[0]); i++ )
+    {
+        const Variant& v = VARIANTS[i];
+        std::string digest;
+        results.push_back(MakeResult(file, v.name, Measure(v.hash, file, opts.runs, digest)));
+        CheckDigest(digests, v.digest, digest, v.name);
+    }
+
+    for ( size_t i = 0; i < cores.size(); i++ )
+    {
+        affinity.Restrict(cores[i]);
+
+        char name[32];
+        sprintf(name, "chunked.%ucores", cores[i]);
+        std::string digest;
+        results.push_back(MakeResult(file, name, Measure(HashChunked, file, opts.runs, digest)));
+        CheckDigest(digests, "chunked", digest, name);
+    }
+
+    affinity.Reset();
+}
+
+void PrintCSV(const std::vector<Result>& results)
+{
+    printf("size_mb,variant,ms,mb_per_second\n");
+    for ( size_t i = 0; i < results.size(); i++ )
+    {
+        const Result& r = results[i];
+        printf("%u,%s,%.1f,%.1f\n", r.megabytes, r.variant.c_str(), r.ms, r.mbPerSecond);
+    }
+}
+
+void PrintJSON(const std::vector<Result>& results)
+{
+    printf("{\n");
+    for ( size_t i = 0; i < results.size(); i++ )
+    {
+        const Result& r = results[i];
+        printf("  \"hash.%umb.%s.ms\": %.1f,\n", r.megabytes, r.variant.c_str(), r.ms);
+        printf("  \"hash.%umb.%s.mb_per_second\": %.1f%s\n", r.megabytes, r.variant.c_str(),
+               r.mbPerSecond, i + 1 < results.size() ? "," : "");
+    }
+    printf("}\n");
+}
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        ProcessorAffinity affinity;
+        const std::vector<unsigned> cores =
+            opts.cores.empty() ? GetDefaultCores(affinity.GetProcessorCount()) : opts.cores;
+
+        std::wstring dir = opts.dir.empty() ? GetDefaultDir() : opts.dir;
+        if ( dir[dir.size() - 1] != L'\\' && dir[dir.size() - 1] != L'/' )
+            dir += L'\\';
+
+        std::vector<Result> results;
+        for ( size_t i = 0; i < opts.sizes.size(); i++ )
+        {
+            const TestFile file(dir, opts.sizes[i]);
+            Measure(file, cores, opts, affinity, results);
+        }
+
+        if ( opts.json )
+            PrintJSON(results);
+        else
+            PrintCSV(results);
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "hashbench: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
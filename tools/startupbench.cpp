@@ -0,0 +1,625 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    startupbench: measures what WinSparkle adds to an application's startup.
+
+    Each run starts a new process, which loads WinSparkle.dll like an
+    application does, and measures how long win_sparkle_init() takes to
+    return and how long it is until the result of an update check started
+    right after it is known. The check goes to an appcast served by this
+    process on the loopback interface, in which there is no update. The
+    runs are made in these modes:
+
+      eager      the default initialization
+      deferred   with win_sparkle_set_deferred_init(1)
+      ui         win_sparkle_check_update_with_ui() after the default
+                 initialization, with an update with release notes in the
+                 appcast; the dialog's time to interactive is reported, as
+                 measured by WinSparkle (win_sparkle_stats_t's last_ui_xxx
+                 fields), and the dialog is closed once the release notes
+                 are rendered
+
+    The eager and ui runs also report the process's footprint (private
+    bytes, working set, GDI and USER objects and handles) that WinSparkle
+    records after the initialization, after the check and after the dialog
+    was shown and closed (win_sparkle_stats_t::footprints).
+
+    A first, uncounted run creates the settings, so that the measured runs
+    are those of an application that was run before. The settings are
+    stored in a file in the temporary directory, so the registry isn't
+    touched. The medians of the runs are written to the standard output as
+    CSV. With --init-budget, the tool fails if the median time the
+    deferred initialization took to return is over the budget.
+
+    Build it with -DWIN_SPARKLE_BUILD_BENCHMARKS=ON.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <process.h>
+
+#include "winsparkle.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+#define NS_SPARKLE "http://www.andymatuschak.org/xml-namespaces/sparkle"
+
+// how long a run may wait for WinSparkle
+const DWORD RUN_TIMEOUT = 30000;
+
+struct Options
+{
+    Options() : runs(5), initBudget(0), json(false)
+    {
+        modes.push_back("eager");
+        modes.push_back("deferred");
+        modes.push_back("ui");
+    }
+
+    std::vector<std::string> modes;
+    unsigned runs;
+    unsigned initBudget;    // microseconds, 0 for none
+    bool json;
+
+    // set in the processes of the runs
+    std::string child;
+    std::string url;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: startupbench [options] > results.csv\n"
+        "\n"
+        "  --modes=MODE,...    modes to run: eager, deferred, ui (all)\n"
+        "  --runs=N            number of runs of each mode (5)\n"
+        "  --init-budget=US    fail if deferred init takes longer to return\n"
+        "  --json              write the metrics as JSON, for winsparkle-bench\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool IsKnownMode(const std::string& mode)
+{
+    return mode == "eager" || mode == "deferred" || mode == "ui";
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--modes")) != NULL )
+        {
+            opts.modes.clear();
+            for ( const char *end; *v; v = end )
+            {
+                end = strchr(v, ',');
+                if ( !end )
+                    end = v + strlen(v);
+                const std::string mode(v, end);
+                if ( !IsKnownMode(mode) )
+                    return false;
+                opts.modes.push_back(mode);
+                if ( *end == ',' )
+                    end++;
+            }
+        }
+        else if ( (v = GetOptionValue(arg, "--runs")) != NULL )
+            opts.runs = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--init-budget")) != NULL )
+            opts.initBudget = unsigned(strtoul(v, NULL, 10));
+        else if ( strcmp(arg, "--json") == 0 )
+            opts.json = true;
+        // used by the runs' processes, which startupbench starts itself
+        else if ( (v = GetOptionValue(arg, "--child")) != NULL )
+            opts.child = v;
+        else if ( (v = GetOptionValue(arg, "--url")) != NULL )
+            opts.url = v;
+        else
+            return false;
+    }
+
+    if ( !opts.child.empty() )
+        return IsKnownMode(opts.child) && !opts.url.empty();
+    return opts.runs > 0 && !opts.modes.empty();
+}
+
+std::wstring GetConfigFile()
+{
+    wchar_t path[MAX_PATH];
+    const DWORD tempLen = GetTempPathW(MAX_PATH, path);
+    if ( tempLen == 0 || tempLen + 20 > MAX_PATH )
+        throw std::runtime_error("cannot get the temporary directory");
+    wcscat(path, L"startupbench.ini");
+    return path;
+}
+
+unsigned long long GetMicroseconds(const LARGE_INTEGER& since)
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (unsigned long long)(now.QuadPart - since.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+
+/*--------------------------------------------------------------------------*
+                               appcast server
+ *--------------------------------------------------------------------------*/
+
+/**
+    HTTP server on 127.0.0.1 serving /appcast.xml, a feed without updates
+    for the version the runs pretend to be, and /update.xml, a feed with
+    an update.
+
+    The connections are handled one at a time and closed after the response.
+ */
+class AppcastServer
+{
+public:
+    AppcastServer() : m_listener(INVALID_SOCKET), m_thread(NULL), m_port(0)
+    {
+        m_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if ( m_listener == INVALID_SOCKET )
+            throw std::runtime_error("cannot create the server socket");
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int addrLen = sizeof(addr);
+        if ( bind(m_listener, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+             listen(m_listener, SOMAXCONN) != 0 ||
+             getsockname(m_listener, (sockaddr*)&addr, &addrLen) != 0 )
+        {
+            closesocket(m_listener);
+            throw std::runtime_error("cannot listen on the loopback interface");
+        }
+        m_port = ntohs(addr.sin_port);
+
+        m_thread = (HANDLE)_beginthreadex(NULL, 0, &ThreadProc, this, 0, NULL);
+        if ( !m_thread )
+        {
+            closesocket(m_listener);
+            throw std::runtime_error("cannot start the server thread");
+        }
+    }
+
+    ~AppcastServer()
+    {
+        // accept() fails once the socket is closed
+        closesocket(m_listener);
+        WaitForSingleObject(m_thread, INFINITE);
+        CloseHandle(m_thread);
+    }
+
+    std::string GetURL(const char *path) const
+    {
+        char url[64];
+        sprintf(url, "http://127.0.0.1:%u%s", unsigned(m_port), path);
+        return url;
+    }
+
+private:
+    std::string GetFeed(const std::string& path) const
+    {
+        std::string version, description;
+        if ( path == "/appcast.xml" )
+        {
+            version = "1.0";
+        }
+        else if ( path == "/update.xml" )
+        {
+            version = "2.0";
+            description = "      <description><![CDATA[<h2>Changes</h2><ul>"
+                          "<li>Faster startup</li><li>Fixed many issues</li>"
+                          "</ul>]]></description>\n";
+        }
+        else
+        {
+            return std::string();
+        }
+
+        return "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+               "<rss version=\"2.0\" xmlns:sparkle=\"" NS_SPARKLE "\">\n"
+               "  <channel>\n"
+               "    <title>startupbench</title>\n"
+               "    <item>\n"
+               "      <title>Version " + version + "</title>\n"
+               "      <pubDate>Mon, 01 Jan 2024 12:00:00 +0000</pubDate>\n" +
+               description +
+               "      <enclosure url=\"" + GetURL("/app.exe") + "\"\n"
+               "                 sparkle:version=\"" + version + "\"\n"
+               "                 length=\"1000000\" type=\"application/octet-stream\"/>\n"
+               "    </item>\n"
+               "  </channel>\n"
+               "</rss>\n";
+    }
+
+    void Respond(SOCKET s)
+    {
+        std::string request;
+        char buf[4096];
+        while ( request.find("\r\n\r\n") == std::string::npos )
+        {
+            const int len = recv(s, buf, sizeof(buf), 0);
+            if ( len <= 0 )
+                return;
+            request.append(buf, len);
+        }
+
+        // "GET /path HTTP/1.1"
+        const size_t start = request.find(' ') + 1;
+        const std::string path = request.substr(start, request.find(' ', start) - start);
+        const std::string body = GetFeed(path);
+
+        char head[256];
+        sprintf(head,
+                "HTTP/1.1 %s\r\n"
+                "Content-Type: application/rss+xml\r\n"
+                "Content-Length: %u\r\n"
+                "Connection: close\r\n"
+                "\r\n",
+                body.empty() ? "404 Not Found" : "200 OK", unsigned(body.size()));
+
+        const std::string response = head + body;
+        for ( size_t sent = 0; sent < response.size(); )
+        {
+            const int len = send(s, response.data() + sent, int(response.size() - sent), 0);
+            if ( len <= 0 )
+                return;
+            sent += len;
+        }
+    }
+
+    static unsigned __stdcall ThreadProc(void *param)
+    {
+        AppcastServer *self = static_cast<AppcastServer*>(param);
+        for ( ;; )
+        {
+            const SOCKET s = accept(self->m_listener, NULL, NULL);
+            if ( s == INVALID_SOCKET )
+                return 0;
+            self->Respond(s);
+            shutdown(s, SD_SEND);
+            closesocket(s);
+        }
+    }
+
+    SOCKET m_listener;
+    HANDLE m_thread;
+    unsigned short m_port;
+};
+
+
+/*--------------------------------------------------------------------------*
+                                  the runs
+ *--------------------------------------------------------------------------*/
+
+HANDLE g_checkDone = NULL;
+volatile LONG g_checkFailed = 0;
+
+void __cdecl OnCheckFinished()
+{
+    SetEvent(g_checkDone);
+}
+
+void __cdecl OnCheckFailed()
+{
+    InterlockedExchange(&g_checkFailed, 1);
+    SetEvent(g_checkDone);
+}
+
+win_sparkle_stats_t GetStats()
+{
+    win_sparkle_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.size = sizeof(stats);
+    if ( !win_sparkle_get_stats(&stats) )
+        throw std::runtime_error("cannot get the statistics");
+    return stats;
+}
+
+// Waits until the footprint at @a point is recorded, which happens right
+// after the callbacks of the check or the dialog are called.
+win_sparkle_footprint_t WaitForFootprint(int point)
+{
+    win_sparkle_stats_t stats = GetStats();
+    for ( DWORD waited = 0; stats.footprints[point].handles == 0; waited += 10 )
+    {
+        if ( waited >= RUN_TIMEOUT )
+            throw std::runtime_error("the footprint wasn't recorded");
+        Sleep(10);
+        stats = GetStats();
+    }
+    return stats.footprints[point];
+}
+
+void PrintFootprint(const char *point, const win_sparkle_footprint_t& f)
+{
+    printf("footprint.%s.private_bytes %llu\n", point, f.private_bytes);
+    printf("footprint.%s.working_set %llu\n", point, f.working_set);
+    printf("footprint.%s.gdi_objects %u\n", point, f.gdi_objects);
+    printf("footprint.%s.user_objects %u\n", point, f.user_objects);
+    printf("footprint.%s.handles %u\n", point, f.handles);
+}
+
+BOOL CALLBACK CloseWindowOfThisProcess(HWND hwnd, LPARAM)
+{
+    DWORD pid = 0;
+    GetWindowThreadProcessId(hwnd, &pid);
+    if ( pid == GetCurrentProcessId() && IsWindowVisible(hwnd) )
+        PostMessage(hwnd, WM_CLOSE, 0, 0);
+    return TRUE;
+}
+
+// Shows the update dialog and waits until it has rendered the release notes.
+void RunDialog()
+{
+    win_sparkle_init();
+    win_sparkle_check_update_with_ui();
+
+    win_sparkle_stats_t stats = GetStats();
+    for ( DWORD waited = 0; stats.last_ui_release_notes_ms == 0; waited += 10 )
+    {
+        if ( g_checkFailed || waited >= RUN_TIMEOUT )
+        {
+            win_sparkle_cleanup();
+            throw std::runtime_error("the update dialog didn't show the release notes");
+        }
+        Sleep(10);
+        stats = GetStats();
+    }
+
+    const win_sparkle_footprint_t shown = WaitForFootprint(WIN_SPARKLE_STATS_FOOTPRINT_DIALOG_SHOWN);
+
+    // the dialog is the only window of this process
+    EnumWindows(CloseWindowOfThisProcess, 0);
+    const win_sparkle_footprint_t closed = WaitForFootprint(WIN_SPARKLE_STATS_FOOTPRINT_DIALOG_CLOSED);
+    win_sparkle_cleanup();
+
+    PrintFootprint("dialog_shown", shown);
+    PrintFootprint("dialog_closed", closed);
+
+    printf("ui.first_paint_ms %u\n", stats.last_ui_first_paint_ms);
+    printf("ui.result_shown_ms %u\n", stats.last_ui_result_shown_ms);
+    printf("ui.release_notes_ms %u\n", stats.last_ui_release_notes_ms);
+}
+
+// Initializes WinSparkle and checks for updates without the UI.
+void RunCheck(const std::string& prefix, bool reportFootprints)
+{
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    win_sparkle_init();
+    const unsigned long long initUs = GetMicroseconds(start);
+
+    win_sparkle_check_update_without_ui();
+    const bool checked = WaitForSingleObject(g_checkDone, RUN_TIMEOUT) == WAIT_OBJECT_0;
+    const unsigned long long checkUs = GetMicroseconds(start);
+
+    if ( !checked || g_checkFailed )
+    {
+        win_sparkle_cleanup();
+        throw std::runtime_error(checked ? "the update check failed" : "the update check didn't finish in time");
+    }
+
+    const win_sparkle_footprint_t init = WaitForFootprint(WIN_SPARKLE_STATS_FOOTPRINT_INIT);
+    const win_sparkle_footprint_t check = WaitForFootprint(WIN_SPARKLE_STATS_FOOTPRINT_CHECK);
+    win_sparkle_cleanup();
+
+    printf("%sinit_us %llu\n", prefix.c_str(), initUs);
+    printf("%sfirst_check_ms %.1f\n", prefix.c_str(), double(checkUs) / 1000.0);
+    if ( reportFootprints )
+    {
+        PrintFootprint("init", init);
+        PrintFootprint("check", check);
+    }
+}
+
+/**
+    Runs one measurement in this process, which was started by RunChild().
+
+    The metrics are written to the standard output as "name value" lines.
+ */
+void RunInThisProcess(const Options& opts)
+{
+    g_checkDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if ( !g_checkDone )
+        throw std::runtime_error("cannot create an event");
+
+    win_sparkle_set_config_file(GetConfigFile().c_str());
+    win_sparkle_set_app_details(L"WinSparkle", L"startupbench", L"1.0");
+    win_sparkle_set_appcast_url(opts.url.c_str());
+    win_sparkle_set_automatic_check_for_updates(0);
+    win_sparkle_set_did_not_find_update_callback(OnCheckFinished);
+    win_sparkle_set_did_find_update_callback(OnCheckFinished);
+    win_sparkle_set_error_callback(OnCheckFailed);
+    if ( opts.child == "deferred" )
+        win_sparkle_set_deferred_init(1);
+
+    if ( opts.child == "ui" )
+        RunDialog();
+    else if ( opts.child == "eager" )
+        RunCheck("startup.", true);
+    else
+        RunCheck("startup." + opts.child + ".", false);
+}
+
+std::string GetExecutable()
+{
+    char path[MAX_PATH];
+    const DWORD len = GetModuleFileNameA(NULL, path, MAX_PATH);
+    if ( len == 0 || len == MAX_PATH )
+        throw std::runtime_error("cannot find startupbench's executable");
+    return std::string(path, len);
+}
+
+// Runs @a mode in a new process and adds its metrics to @a metrics.
+void RunChild(const std::string& mode, const AppcastServer& server,
+              std::map<std::string, std::vector<double> >& metrics)
+{
+    // cmd.exe strips the outer quotes
+    const char *feed = mode == "ui" ? "/update.xml" : "/appcast.xml";
+    const std::string command = "\"\"" + GetExecutable() + "\" --child=" + mode +
+                                " --url=" + server.GetURL(feed) + "\"";
+    FILE *pipe = _popen(command.c_str(), "r");
+    if ( !pipe )
+        throw std::runtime_error("cannot start a run");
+
+    std::map<std::string, double> values;
+    char line[256];
+    while ( fgets(line, sizeof(line), pipe) )
+    {
+        char name[128];
+        double value;
+        if ( sscanf(line, "%127s %lf", name, &value) == 2 )
+            values[name] = value;
+    }
+    if ( _pclose(pipe) != 0 )
+        throw std::runtime_error("the " + mode + " run failed");
+
+    for ( std::map<std::string, double>::const_iterator i = values.begin(); i != values.end(); ++i )
+        metrics[i->first].push_back(i->second);
+}
+
+double Median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+void PrintCSV(const std::map<std::string, double>& results)
+{
+    printf("metric,median\n");
+    for ( std::map<std::string, double>::const_iterator i = results.begin(); i != results.end(); ++i )
+        printf("%s,%.1f\n", i->first.c_str(), i->second);
+}
+
+void PrintJSON(const std::map<std::string, double>& results)
+{
+    printf("{\n");
+    for ( std::map<std::string, double>::const_iterator i = results.begin(); i != results.end(); )
+    {
+        const std::string& name = i->first;
+        const double value = i->second;
+        ++i;
+        printf("  \"%s\": %.1f%s\n", name.c_str(), value, i != results.end() ? "," : "");
+    }
+    printf("}\n");
+}
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        if ( !opts.child.empty() )
+        {
+            RunInThisProcess(opts);
+            return 0;
+        }
+
+        WSADATA wsa;
+        if ( WSAStartup(MAKEWORD(2, 2), &wsa) != 0 )
+            throw std::runtime_error("cannot initialize Winsock");
+
+        std::map<std::string, double> results;
+        {
+            const AppcastServer server;
+            const std::wstring configFile = GetConfigFile();
+            DeleteFileW(configFile.c_str());
+
+            std::map<std::string, std::vector<double> > metrics, warmup;
+            RunChild("eager", server, warmup);
+
+            for ( size_t m = 0; m < opts.modes.size(); m++ )
+            {
+                for ( unsigned i = 0; i < opts.runs; i++ )
+                    RunChild(opts.modes[m], server, metrics);
+            }
+            DeleteFileW(configFile.c_str());
+
+            for ( std::map<std::string, std::vector<double> >::const_iterator i = metrics.begin();
+                  i != metrics.end(); ++i )
+            {
+                results[i->first] = Median(i->second);
+            }
+        }
+        WSACleanup();
+
+        if ( opts.json )
+            PrintJSON(results);
+        else
+            PrintCSV(results);
+
+        const std::map<std::string, double>::const_iterator deferred = results.find("startup.deferred.init_us");
+        if ( opts.initBudget && deferred != results.end() && deferred->second > opts.initBudget )
+        {
+            fprintf(stderr, "startupbench: deferred win_sparkle_init() took %.0f us, the budget is %u us\n",
+                    deferred->second, opts.initBudget);
+            return 1;
+        }
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "startupbench: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,609 @@
+/*
+ *  This file is part of WinSparkle (https://winsparkle.org)
+ *
+ *  Copyright (C) 2009-2018 Vaclav Slavik
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a
+ *  copy of this software and associated documentation files (the "Software"),
+ *  to deal in the Software without restriction, including without limitation
+ *  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+    versionbench: checks and measures the version comparison.
+
+    A random corpus of version strings (reproducible with --seed) is
+    generated: dotted numbers with leading zeros, prerelease suffixes,
+    doubled periods and numbers too long for 64 bits. Random pairs of them,
+    most of them variants of the same version so that the comparison has to
+    look at all components, are compared with VersionKey::Compare(),
+    UpdateChecker::CompareVersions() and CompareVersionStrings(), and with
+    the string-splitting comparator WinSparkle used before VersionKey, which
+    is kept here as the reference. Any disagreement, and any pair that
+    doesn't compare antisymmetrically, is reported and makes the tool fail.
+    The sorted corpus is checked too, which catches intransitive results.
+
+    Then the comparisons are timed; the median nanoseconds per comparison
+    are written to the standard output as CSV. Allocations are only counted
+    if WinSparkle is built with WIN_SPARKLE_ALLOC_STATS.
+
+    Build it with -DWIN_SPARKLE_BUILD_BENCHMARKS=ON.
+ */
+
+#include "updatechecker.h"
+#include "versionkey.h"
+#include "versioncompare.h"
+#include "allocstats.h"
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace winsparkle;
+
+namespace
+{
+
+struct Options
+{
+    Options() : versions(10000), pairs(200000), seed(1), minTime(1000), json(false) {}
+
+    unsigned versions;
+    unsigned pairs;
+    unsigned seed;
+    unsigned minTime;   // milliseconds per way of comparing
+    bool json;
+};
+
+void PrintUsage()
+{
+    fputs(
+        "usage: versionbench [options] > results.csv\n"
+        "\n"
+        "  --versions=N        size of the corpus (10000)\n"
+        "  --pairs=N           number of compared pairs (200000)\n"
+        "  --seed=N            seed of the corpus (1)\n"
+        "  --min-time=MS       time each way of comparing for at least MS milliseconds (1000)\n"
+        "  --json              write the metrics as JSON, for winsparkle-bench\n",
+        stderr);
+}
+
+// Returns the value of the "--name=value" option in @a arg, or NULL if it's
+// another option.
+const char *GetOptionValue(const char *arg, const char *name)
+{
+    const size_t len = strlen(name);
+    if ( strncmp(arg, name, len) != 0 || arg[len] != '=' )
+        return NULL;
+    return arg + len + 1;
+}
+
+bool ParseOptions(int argc, char **argv, Options& opts)
+{
+    for ( int i = 1; i < argc; i++ )
+    {
+        const char *arg = argv[i];
+        const char *v;
+        if ( (v = GetOptionValue(arg, "--versions")) != NULL )
+            opts.versions = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--pairs")) != NULL )
+            opts.pairs = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--seed")) != NULL )
+            opts.seed = unsigned(strtoul(v, NULL, 10));
+        else if ( (v = GetOptionValue(arg, "--min-time")) != NULL )
+            opts.minTime = unsigned(strtoul(v, NULL, 10));
+        else if ( strcmp(arg, "--json") == 0 )
+            opts.json = true;
+        else
+            return false;
+    }
+
+    return opts.versions >= 2 && opts.pairs > 0;
+}
+
+
+/*--------------------------------------------------------------------------*
+                            reference comparator
+ *--------------------------------------------------------------------------*/
+
+// This is UpdateChecker::CompareVersions() as it was before VersionKey,
+// except that numbers are compared as digit strings rather than with atoi(),
+// which overflowed for numbers that don't fit in an int.
+
+enum CharType
+{
+    Type_Number,
+    Type_Period,
+    Type_String
+};
+
+CharType ClassifyChar(char c)
+{
+    if ( c == '.' )
+        return Type_Period;
+    else if ( c >= '0' && c <= '9' )
+        return Type_Number;
+    else
+        return Type_String;
+}
+
+// Splits the version into runs of characters of the same type; each period
+// is a run of its own: "1.20rc3" is ["1",".","20","rc","3"].
+std::vector<std::string> SplitVersionString(const std::string& version)
+{
+    std::vector<std::string> list;
+
+    if ( version.empty() )
+        return list;
+
+    std::string s(1, version[0]);
+    CharType prevType = ClassifyChar(version[0]);
+
+    for ( size_t i = 1; i < version.length(); i++ )
+    {
+        const char c = version[i];
+        const CharType newType = ClassifyChar(c);
+
+        if ( prevType != newType || prevType == Type_Period )
+        {
+            list.push_back(s);
+            s = c;
+        }
+        else
+        {
+            s += c;
+        }
+
+        prevType = newType;
+    }
+
+    list.push_back(s);
+    return list;
+}
+
+int CompareNumbers(const std::string& a, const std::string& b)
+{
+    const size_t za = (std::min)(a.find_first_not_of('0'), a.length());
+    const size_t zb = (std::min)(b.find_first_not_of('0'), b.length());
+    const size_t lenA = a.length() - za;
+    const size_t lenB = b.length() - zb;
+    if ( lenA != lenB )
+        return lenA > lenB ? 1 : -1;
+    return a.compare(za, lenA, b, zb, lenB);
+}
+
+int ReferenceCompareVersions(const std::string& verA, const std::string& verB)
+{
+    const std::vector<std::string> partsA = SplitVersionString(verA);
+    const std::vector<std::string> partsB = SplitVersionString(verB);
+
+    const size_t n = (std::min)(partsA.size(), partsB.size());
+    for ( size_t i = 0; i < n; i++ )
+    {
+        const std::string& a = partsA[i];
+        const std::string& b = partsB[i];
+
+        const CharType typeA = ClassifyChar(a[0]);
+        const CharType typeB = ClassifyChar(b[0]);
+
+        if ( typeA == typeB )
+        {
+            int result = 0;
+            if ( typeA == Type_String )
+                result = a.compare(b);
+            else if ( typeA == Type_Number )
+                result = CompareNumbers(a, b);
+            if ( result != 0 )
+                return result;
+        }
+        else if ( typeA != Type_String && typeB == Type_String )
+        {
+            return 1;   // 1.2.0 > 1.2rc1
+        }
+        else if ( typeA == Type_String && typeB != Type_String )
+        {
+            return -1;  // 1.2rc1 < 1.2.0
+        }
+        else
+        {
+            // a number and a period, the period is invalid
+            return (typeA == Type_Number) ? 1 : -1;
+        }
+    }
+
+    if ( partsA.size() == partsB.size() )
+        return 0;
+
+    // the longer version's next part decides: 1.5 > 1.5b3, but 1.5.1 > 1.5
+    const bool longerA = partsA.size() > partsB.size();
+    const CharType missingPartType = ClassifyChar((longerA ? partsA : partsB)[n][0]);
+    if ( missingPartType == Type_String )
+        return longerA ? -1 : 1;
+    else
+        return longerA ? 1 : -1;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                  corpus
+ *--------------------------------------------------------------------------*/
+
+const char *const PRERELEASES[] = { "a", "b", "alpha", "beta", "rc", "dev", "pre", "RC" };
+
+std::string RandomNumber(std::mt19937& rng)
+{
+    const unsigned kind = rng() % 20;
+    std::string s;
+    if ( kind == 0 )
+        s = "0";                                   // leading zero
+    else if ( kind == 1 )
+        s = "00";
+
+    char buf[16];
+    if ( kind == 2 )
+    {
+        // a number too long for 64 bits, often sharing its start with others
+        s += "1844674407370955161";
+        for ( unsigned i = 0, n = 1 + rng() % 6; i < n; i++ )
+            s += char('0' + rng() % 10);
+    }
+    else if ( kind == 3 )
+    {
+        sprintf(buf, "%u", unsigned(rng() % 1000000000));   // build number
+        s += buf;
+    }
+    else if ( kind == 4 )
+    {
+        sprintf(buf, "%u%02u%02u", 2000 + unsigned(rng() % 30),
+                1 + unsigned(rng() % 12), 1 + unsigned(rng() % 28)); // date
+        s += buf;
+    }
+    else
+    {
+        sprintf(buf, "%u", unsigned(rng() % 12));
+        s += buf;
+    }
+    return s;
+}
+
+std::string RandomVersion(std::mt19937& rng)
+{
+    std::string v;
+    if ( rng() % 200 == 0 )
+        return v;                                  // empty version
+
+    const unsigned components = 1 + rng() % 5;
+    for ( unsigned i = 0; i < components; i++ )
+    {
+        if ( i > 0 )
+        {
+            const unsigned sep = rng() % 30;
+            if ( sep == 0 )
+                v += "..";                         // empty component
+            else if ( sep > 3 )
+                v += '.';
+            // else no separator, e.g. 1.0b2
+        }
+
+        if ( rng() % 6 == 0 )
+            v += PRERELEASES[rng() % (sizeof(PRERELEASES) / sizeof(PRERELEASES[0]))];
+        else
+            v += RandomNumber(rng);
+    }
+
+    if ( rng() % 50 == 0 )
+        v += '.';                                  // trailing period
+    return v;
+}
+
+// Returns a version close to @a v: with one component changed, added or
+// removed, or with a prerelease suffix.
+std::string Mutate(const std::string& v, std::mt19937& rng)
+{
+    switch ( rng() % 5 )
+    {
+        case 0:
+            return v + "." + RandomNumber(rng);
+        case 1:
+            return v + PRERELEASES[rng() % (sizeof(PRERELEASES) / sizeof(PRERELEASES[0]))] +
+                   RandomNumber(rng);
+        case 2:
+        {
+            const size_t dot = v.rfind('.');
+            return dot == std::string::npos ? v : v.substr(0, dot);
+        }
+        case 3:
+            return "0" + v;                        // same version, leading zero
+        default:
+        {
+            const size_t dot = v.rfind('.');
+            return (dot == std::string::npos ? std::string() : v.substr(0, dot + 1)) + RandomNumber(rng);
+        }
+    }
+}
+
+struct Corpus
+{
+    std::vector<std::string> versions;
+    std::vector<std::pair<size_t, size_t> > pairs;
+};
+
+Corpus GenerateCorpus(const Options& opts)
+{
+    std::mt19937 rng(opts.seed);
+    Corpus c;
+
+    while ( c.versions.size() < opts.versions )
+    {
+        const std::string v = RandomVersion(rng);
+        c.versions.push_back(v);
+        // most versions come with variants, so that pairs often share a prefix
+        for ( unsigned i = rng() % 4; i > 0 && c.versions.size() < opts.versions; i-- )
+            c.versions.push_back(Mutate(v, rng));
+    }
+
+    for ( unsigned i = 0; i < opts.pairs; i++ )
+    {
+        const size_t a = rng() % c.versions.size();
+        size_t b;
+        if ( rng() % 4 == 0 )
+            b = rng() % c.versions.size();
+        else
+            b = (std::min)(c.versions.size() - 1, size_t(a + rng() % 4));  // a close variant
+        c.pairs.push_back(std::make_pair(a, b));
+    }
+
+    return c;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                cross-check
+ *--------------------------------------------------------------------------*/
+
+int Sign(int n)
+{
+    return n < 0 ? -1 : (n > 0 ? 1 : 0);
+}
+
+unsigned ReportMismatch(unsigned mismatches, const char *what,
+                        const std::string& a, const std::string& b, int expected, int actual)
+{
+    // the first few are enough to see what's wrong
+    if ( mismatches < 20 )
+    {
+        fprintf(stderr, "versionbench: %s(\"%s\", \"%s\") is %d, should be %d\n",
+                what, a.c_str(), b.c_str(), actual, expected);
+    }
+    return mismatches + 1;
+}
+
+// Returns the number of disagreements with the reference comparator.
+unsigned CrossCheck(const Corpus& c, const std::vector<VersionKey>& keys)
+{
+    unsigned mismatches = 0;
+
+    for ( size_t i = 0; i < c.pairs.size(); i++ )
+    {
+        const std::string& a = c.versions[c.pairs[i].first];
+        const std::string& b = c.versions[c.pairs[i].second];
+        const VersionKey& ka = keys[c.pairs[i].first];
+        const VersionKey& kb = keys[c.pairs[i].second];
+
+        const int expected = Sign(ReferenceCompareVersions(a, b));
+
+        const int key = Sign(ka.Compare(kb));
+        if ( key != expected )
+            mismatches = ReportMismatch(mismatches, "VersionKey::Compare", a, b, expected, key);
+
+        const int reverse = Sign(kb.Compare(ka));
+        if ( reverse != -key )
+            mismatches = ReportMismatch(mismatches, "VersionKey::Compare", b, a, -key, reverse);
+
+        const int strings = Sign(UpdateChecker::CompareVersions(a, b));
+        if ( strings != expected )
+            mismatches = ReportMismatch(mismatches, "UpdateChecker::CompareVersions", a, b, expected, strings);
+
+        const int constant = Sign(CompareVersionStrings(a.c_str(), b.c_str()));
+        if ( constant != expected )
+            mismatches = ReportMismatch(mismatches, "CompareVersionStrings", a, b, expected, constant);
+    }
+
+    for ( size_t i = 0; i < keys.size(); i++ )
+    {
+        if ( keys[i].Compare(keys[i]) != 0 )
+            mismatches = ReportMismatch(mismatches, "VersionKey::Compare",
+                                        c.versions[i], c.versions[i], 0, keys[i].Compare(keys[i]));
+    }
+
+    // if the keys sort in an order the reference disagrees with, the
+    // comparison isn't transitive
+    std::vector<VersionKey> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    for ( size_t i = 1; i < sorted.size(); i++ )
+    {
+        const std::string& a = sorted[i - 1].GetVersion();
+        const std::string& b = sorted[i].GetVersion();
+        const int expected = Sign(ReferenceCompareVersions(a, b));
+        if ( expected > 0 )
+            mismatches = ReportMismatch(mismatches, "sorted VersionKey", a, b, -1, expected);
+    }
+
+    return mismatches;
+}
+
+
+/*--------------------------------------------------------------------------*
+                                measurement
+ *--------------------------------------------------------------------------*/
+
+struct Measurement
+{
+    double nsPerCompare;            // median
+    double allocationsPerCompare;   // 0 without WIN_SPARKLE_ALLOC_STATS
+};
+
+struct Result
+{
+    unsigned versions;
+    unsigned pairs;
+    unsigned mismatches;
+    // VersionKey::Compare() of keys made beforehand, as when sorting
+    Measurement key;
+    // UpdateChecker::CompareVersions(), which makes the keys each time
+    Measurement strings;
+    // the reference comparator, for comparison
+    Measurement reference;
+};
+
+unsigned long long GetCheckAllocations()
+{
+    win_sparkle_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    AllocationStats::Get(stats);
+    return stats.allocations[WIN_SPARKLE_STATS_PHASE_CHECK];
+}
+
+// Comparing with the ways below; the sum of the results is returned and
+// added to g_sum, so that the compiler can't leave the comparisons out.
+volatile int g_sum = 0;
+
+int CompareKeys(const Corpus& c, const std::vector<VersionKey>& keys)
+{
+    int sum = 0;
+    for ( size_t i = 0; i < c.pairs.size(); i++ )
+        sum += Sign(keys[c.pairs[i].first].Compare(keys[c.pairs[i].second]));
+    return sum;
+}
+
+int CompareStrings(const Corpus& c, const std::vector<VersionKey>&)
+{
+    int sum = 0;
+    for ( size_t i = 0; i < c.pairs.size(); i++ )
+        sum += Sign(UpdateChecker::CompareVersions(c.versions[c.pairs[i].first], c.versions[c.pairs[i].second]));
+    return sum;
+}
+
+int CompareReference(const Corpus& c, const std::vector<VersionKey>&)
+{
+    int sum = 0;
+    for ( size_t i = 0; i < c.pairs.size(); i++ )
+        sum += Sign(ReferenceCompareVersions(c.versions[c.pairs[i].first], c.versions[c.pairs[i].second]));
+    return sum;
+}
+
+typedef int (*CompareFunction)(const Corpus&, const std::vector<VersionKey>&);
+
+Measurement Measure(CompareFunction compare, const Corpus& c, const std::vector<VersionKey>& keys,
+                    const Options& opts)
+{
+    Measurement m;
+
+    // the first pass warms up the caches and counts the allocations
+    {
+        AllocationScope scope(WIN_SPARKLE_STATS_PHASE_CHECK);
+        const unsigned long long allocations = GetCheckAllocations();
+        g_sum += compare(c, keys);
+        m.allocationsPerCompare = double(GetCheckAllocations() - allocations) / c.pairs.size();
+    }
+
+    std::vector<unsigned long long> times;
+    const TraceTimer total;
+    while ( times.size() < 5 || total.GetMicroseconds() < opts.minTime * 1000ULL )
+    {
+        const TraceTimer timer;
+        g_sum += compare(c, keys);
+        times.push_back(timer.GetMicroseconds());
+    }
+
+    std::sort(times.begin(), times.end());
+    m.nsPerCompare = double(times[times.size() / 2]) * 1000.0 / c.pairs.size();
+    return m;
+}
+
+void PrintCSV(const Result& r)
+{
+    printf("versions,pairs,mismatches,key_compare_ns,compare_ns,reference_compare_ns,"
+           "key_compare_allocations,compare_allocations\n");
+    printf("%u,%u,%u,%.2f,%.2f,%.2f,%.3f,%.3f\n",
+           r.versions, r.pairs, r.mismatches,
+           r.key.nsPerCompare, r.strings.nsPerCompare, r.reference.nsPerCompare,
+           r.key.allocationsPerCompare, r.strings.allocationsPerCompare);
+}
+
+void PrintJSON(const Result& r)
+{
+    printf("{\n");
+    printf("  \"version.mismatches\": %u,\n", r.mismatches);
+    printf("  \"version.key_compare_ns\": %.2f,\n", r.key.nsPerCompare);
+    printf("  \"version.compare_ns\": %.2f,\n", r.strings.nsPerCompare);
+    printf("  \"version.reference_compare_ns\": %.2f,\n", r.reference.nsPerCompare);
+    printf("  \"version.key_compare_allocations\": %.3f,\n", r.key.allocationsPerCompare);
+    printf("  \"version.compare_allocations\": %.3f\n", r.strings.allocationsPerCompare);
+    printf("}\n");
+}
+
+} // anonymous namespace
+
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    if ( !ParseOptions(argc, argv, opts) )
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    try
+    {
+        const Corpus corpus = GenerateCorpus(opts);
+        const std::vector<VersionKey> keys(corpus.versions.begin(), corpus.versions.end());
+
+        Result r;
+        r.versions = unsigned(corpus.versions.size());
+        r.pairs = unsigned(corpus.pairs.size());
+        r.mismatches = CrossCheck(corpus, keys);
+        r.key = Measure(CompareKeys, corpus, keys, opts);
+        r.strings = Measure(CompareStrings, corpus, keys, opts);
+        r.reference = Measure(CompareReference, corpus, keys, opts);
+
+        if ( opts.json )
+            PrintJSON(r);
+        else
+            PrintCSV(r);
+
+        if ( r.mismatches )
+        {
+            fprintf(stderr, "versionbench: %u comparisons disagree with the reference\n", r.mismatches);
+            return 1;
+        }
+    }
+    catch ( std::exception& e )
+    {
+        fprintf(stderr, "versionbench: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}